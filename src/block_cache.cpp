@@ -19,44 +19,73 @@
 #include "block_cache.h"
 #include "pool_block.h"
 #include "p2p_server.h"
+#include "keccak.h"
+#include <thread>
 
 static constexpr char log_category_prefix[] = "BlockCache ";
 
-static constexpr uint32_t BLOCK_SIZE = 96 * 1024;
+// The cache file is a header followed by block records appended one after another
+// Records of blocks older than the last NUM_BLOCKS sidechain heights are dropped when the file is compacted
+static constexpr uint64_t CACHE_MAGIC = 0x31474F4C4C4F4F50ULL; // "POOLLOG1"
+static constexpr uint32_t HEADER_SIZE = 64;
+static constexpr uint32_t RECORD_MAGIC = 0x4B4C4250U; // "PBLK"
+static constexpr uint32_t MAX_BLOB_SIZE = 96 * 1024;
 static constexpr uint32_t NUM_BLOCKS = 4608;
-static constexpr uint32_t CACHE_SIZE = BLOCK_SIZE * NUM_BLOCKS;
+
+// The whole file can grow up to CACHE_SIZE bytes, it's mapped once and grows in CACHE_GROW_STEP increments
+static constexpr size_t CACHE_SIZE = 256 * 1024 * 1024;
+static constexpr size_t CACHE_GROW_STEP = 8 * 1024 * 1024;
 static constexpr char cache_name[] = "p2pool.cache";
 
+// Every flush() starts writing back what changed since the previous one, every FLUSH_BARRIER_INTERVAL-th flush() also waits for it
+static constexpr uint32_t FLUSH_BARRIER_INTERVAL = 10;
+
+// Each record's blob is followed by the block's PoW hash, the seed it was calculated with
+// and a checksum which binds them to the block's sidechain id
+static constexpr uint32_t POW_DATA_SIZE = p2pool::HASH_SIZE * 3;
+
 namespace p2pool {
 
+struct RecordHeader
+{
+	uint32_t magic;
+	uint32_t blob_size;
+	uint64_t sidechain_height;
+	hash sidechain_id;
+};
+
+static_assert(sizeof(RecordHeader) % 8 == 0, "RecordHeader size must be a multiple of 8");
+
+static FORCEINLINE size_t record_size(uint32_t blob_size)
+{
+	// Keep all records 8-byte aligned
+	return (sizeof(RecordHeader) + blob_size + POW_DATA_SIZE + 7) & ~static_cast<size_t>(7);
+}
+
 struct BlockCache::Impl : public nocopy_nomove
 {
 #if defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION) || defined(__MACH__)
 
 	Impl()
 	{
+		uv_mutex_init_checked(&m_lock);
+
 		m_fd = open(cache_name, O_RDWR | O_CREAT, static_cast<mode_t>(0600));
 		if (m_fd == -1) {
 			LOGERR(1, "couldn't open/create " << cache_name);
 			return;
 		}
 
-		int result = lseek(m_fd, static_cast<off_t>(CACHE_SIZE) - 1, SEEK_SET);
-		if (result == -1) {
+		const off_t file_size = lseek(m_fd, 0, SEEK_END);
+		if (file_size == -1) {
 			LOGERR(1, "lseek failed");
 			close(m_fd);
 			m_fd = -1;
 			return;
 		}
+		m_fileSize = static_cast<size_t>(file_size);
 
-		result = write(m_fd, "", 1);
-		if (result != 1) {
-			LOGERR(1, "write failed");
-			close(m_fd);
-			m_fd = -1;
-			return;
-		}
-
+		// Reserve address space for the biggest possible cache, only the part up to m_fileSize is backed by the file
 		void* map = mmap(0, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
 		if (map == MAP_FAILED) {
 			LOGERR(1, "mmap failed");
@@ -66,18 +95,46 @@ struct BlockCache::Impl : public nocopy_nomove
 		}
 
 		m_data = reinterpret_cast<uint8_t*>(map);
+		init();
 	}
 
 	~Impl()
 	{
 		if (m_data) munmap(m_data, CACHE_SIZE);
 		if (m_fd != -1) close(m_fd);
+		uv_mutex_destroy(&m_lock);
 	}
 
-	void flush()
+	bool resize(size_t size)
+	{
+		if (ftruncate(m_fd, static_cast<off_t>(size)) != 0) {
+			LOGERR(1, "ftruncate failed");
+			return false;
+		}
+		m_fileSize = size;
+		return true;
+	}
+
+	void sync_range(size_t begin, size_t end, bool wait)
+	{
+		static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		begin -= begin % page_size;
+		msync(m_data + begin, end - begin, wait ? MS_SYNC : MS_ASYNC);
+	}
+
+	// preload() reads the whole file front to back, let the kernel read ahead aggressively
+	void prefetch()
+	{
+		if (m_data) {
+			madvise(m_data, m_fileSize, MADV_SEQUENTIAL);
+			madvise(m_data, m_fileSize, MADV_WILLNEED);
+		}
+	}
+
+	void prefetch_done()
 	{
 		if (m_data) {
-			msync(m_data, CACHE_SIZE, MS_SYNC);
+			madvise(m_data, m_fileSize, MADV_NORMAL);
 		}
 	}
 
@@ -85,8 +142,11 @@ struct BlockCache::Impl : public nocopy_nomove
 
 #elif defined(_WIN32)
 
+	// File mappings can't grow on Windows, so the file always has its maximum size there
 	Impl()
 	{
+		uv_mutex_init_checked(&m_lock);
+
 		m_file = CreateFile(cache_name, GENERIC_ALL, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_HIDDEN, NULL);
 		if (m_file == INVALID_HANDLE_VALUE) {
 			LOGERR(1, "couldn't open " << cache_name << ", error " << static_cast<uint32_t>(GetLastError()));
@@ -122,7 +182,11 @@ struct BlockCache::Impl : public nocopy_nomove
 			CloseHandle(m_file);
 			m_map = 0;
 			m_file = INVALID_HANDLE_VALUE;
+			return;
 		}
+
+		m_fileSize = CACHE_SIZE;
+		init();
 	}
 
 	~Impl()
@@ -130,12 +194,18 @@ struct BlockCache::Impl : public nocopy_nomove
 		if (m_data) UnmapViewOfFile(m_data);
 		if (m_map) CloseHandle(m_map);
 		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+		uv_mutex_destroy(&m_lock);
 	}
 
-	void flush()
+	bool resize(size_t size) const { return size <= m_fileSize; }
+
+	void prefetch() {}
+	void prefetch_done() {}
+
+	void sync_range(size_t begin, size_t end, bool wait)
 	{
-		if (m_data) {
-			FlushViewOfFile(m_data, 0);
+		FlushViewOfFile(m_data + begin, end - begin);
+		if (wait) {
 			FlushFileBuffers(m_file);
 		}
 	}
@@ -145,10 +215,190 @@ struct BlockCache::Impl : public nocopy_nomove
 
 #else
 	// Not implemented on other platforms
-	void flush() {}
+	Impl() { uv_mutex_init_checked(&m_lock); }
+	~Impl() { uv_mutex_destroy(&m_lock); }
+	bool resize(size_t) const { return false; }
+	void sync_range(size_t, size_t, bool) {}
+	void prefetch() {}
+	void prefetch_done() {}
 #endif
 
+	void init()
+	{
+		if ((m_fileSize >= HEADER_SIZE) && (m_fileSize <= CACHE_SIZE) && (*reinterpret_cast<const uint64_t*>(m_data) == CACHE_MAGIC)) {
+			return;
+		}
+
+		// New file or a cache file of an older version, start from scratch
+		LOGINFO(1, "creating a new " << cache_name);
+
+		if (!resize(0) || !resize(CACHE_GROW_STEP)) {
+			m_data = nullptr;
+			return;
+		}
+
+		memset(m_data, 0, HEADER_SIZE + sizeof(RecordHeader));
+		*reinterpret_cast<uint64_t*>(m_data) = CACHE_MAGIC;
+		mark_dirty(0, HEADER_SIZE + sizeof(RecordHeader));
+	}
+
+	struct Range
+	{
+		size_t begin = std::numeric_limits<size_t>::max();
+		size_t end = 0;
+
+		void add(size_t b, size_t e)
+		{
+			begin = std::min(begin, b);
+			end = std::max(end, e);
+		}
+	};
+
+	void mark_dirty(size_t begin, size_t end)
+	{
+		m_dirty.add(begin, end);
+		m_unsynced.add(begin, end);
+	}
+
+	// Writes back only the part of the file which changed since the last flush
+	// Regular flushes don't wait for the disk, barriers wait for everything written since the last barrier
+	void flush(bool barrier)
+	{
+		Range r;
+		{
+			MutexLock lock(m_lock);
+
+			if (!m_data) {
+				return;
+			}
+
+			if (++m_flushCounter % FLUSH_BARRIER_INTERVAL == 0) {
+				barrier = true;
+			}
+
+			r = barrier ? m_unsynced : m_dirty;
+			r.end = std::min(r.end, m_fileSize);
+
+			m_dirty = Range();
+			if (barrier) {
+				m_unsynced = Range();
+			}
+		}
+
+		if (r.begin < r.end) {
+			sync_range(r.begin, r.end, barrier);
+		}
+	}
+
+	// Marks the end of the log, so load_all() doesn't pick up leftovers of compacted records after it
+	void write_terminator()
+	{
+		if (m_used + sizeof(uint32_t) <= m_fileSize) {
+			memset(m_data + m_used, 0, sizeof(uint32_t));
+			mark_dirty(m_used, m_used + sizeof(uint32_t));
+		}
+	}
+
+	uint64_t min_height() const { return (m_maxHeight >= NUM_BLOCKS) ? (m_maxHeight - NUM_BLOCKS + 1) : 0; }
+
+	size_t live_size() const
+	{
+		const uint64_t h = min_height();
+
+		size_t result = HEADER_SIZE;
+		for (const auto& it : m_index) {
+			if (it.second.height >= h) {
+				result += it.second.size;
+			}
+		}
+		return result;
+	}
+
+	// Moves all records which are still needed to the beginning of the file, in their original order
+	void compact()
+	{
+		const uint64_t h = min_height();
+
+		std::vector<std::pair<uint64_t, Entry*>> entries;
+		entries.reserve(m_index.size());
+
+		for (auto it = m_index.begin(); it != m_index.end();) {
+			if (it->second.height < h) {
+				it = m_index.erase(it);
+			}
+			else {
+				entries.emplace_back(it->second.offset, &it->second);
+				++it;
+			}
+		}
+
+		std::sort(entries.begin(), entries.end(), [](const std::pair<uint64_t, Entry*>& a, const std::pair<uint64_t, Entry*>& b) { return a.first < b.first; });
+
+		const size_t old_used = m_used;
+		m_used = HEADER_SIZE;
+
+		for (const std::pair<uint64_t, Entry*>& e : entries) {
+			Entry* entry = e.second;
+			if (entry->offset != m_used) {
+				memmove(m_data + m_used, m_data + entry->offset, entry->size);
+				mark_dirty(m_used, m_used + entry->size);
+				entry->offset = m_used;
+			}
+			m_used += entry->size;
+		}
+
+		write_terminator();
+
+		// Give the freed space back to the file system
+		const size_t new_size = ((m_used + sizeof(uint32_t)) / CACHE_GROW_STEP + 1) * CACHE_GROW_STEP;
+		if (new_size < m_fileSize) {
+			resize(new_size);
+		}
+
+		LOGINFO(4, "compacted " << cache_name << ": " << old_used << " -> " << m_used << " bytes, " << m_index.size() << " blocks");
+	}
+
+	// Makes sure there's space for "size" more bytes at the end of the log
+	bool reserve(size_t size)
+	{
+		if (m_used + size + sizeof(uint32_t) <= m_fileSize) {
+			return true;
+		}
+
+		// Compact if at least half of the used space is taken by old blocks, grow the file otherwise
+		if ((live_size() <= m_used / 2) || (m_fileSize + CACHE_GROW_STEP > CACHE_SIZE)) {
+			compact();
+			if (m_used + size + sizeof(uint32_t) <= m_fileSize) {
+				return true;
+			}
+		}
+
+		const size_t new_size = ((m_used + size + sizeof(uint32_t)) / CACHE_GROW_STEP + 1) * CACHE_GROW_STEP;
+		return (new_size <= CACHE_SIZE) && resize(new_size);
+	}
+
+	struct Entry
+	{
+		uint64_t offset;
+		uint64_t height;
+		uint32_t size;
+	};
+
 	uint8_t* m_data = nullptr;
+	size_t m_fileSize = 0;
+
+	uv_mutex_t m_lock;
+	unordered_map<hash, Entry> m_index;
+	size_t m_used = HEADER_SIZE;
+	uint64_t m_maxHeight = 0;
+
+	Range m_dirty;
+	Range m_unsynced;
+	uint32_t m_flushCounter = 0;
+
+	// Blocks deserialized by preload() and not handed over to the P2P server yet
+	bool m_preloaded = false;
+	std::vector<PoolBlock*> m_preloadedBlocks;
 };
 
 BlockCache::BlockCache()
@@ -159,57 +409,245 @@ BlockCache::BlockCache()
 
 BlockCache::~BlockCache()
 {
+	for (PoolBlock* block : m_impl->m_preloadedBlocks) {
+		delete block;
+	}
+
+	m_impl->flush(true);
 	delete m_impl;
 }
 
 void BlockCache::store(const PoolBlock& block)
 {
-	const size_t n1 = block.m_mainChainData.size();
-	const size_t n2 = block.m_sideChainData.size();
+	const size_t n1 = block.main_chain_data_size();
+	const size_t n2 = block.side_chain_data_size();
+
+	if (!m_impl->m_data || (n1 + n2 > MAX_BLOB_SIZE)) {
+		return;
+	}
+
+	MutexLock lock(m_impl->m_lock);
 
-	if (!m_impl->m_data || (sizeof(uint32_t) + n1 + n2 > BLOCK_SIZE)) {
+	if (m_impl->m_index.find(block.m_sidechainId) != m_impl->m_index.end()) {
 		return;
 	}
 
-	uint8_t* data = m_impl->m_data + (static_cast<size_t>(block.m_sidechainHeight % NUM_BLOCKS) * BLOCK_SIZE);
+	// Uncles and blocks from alternative chains can be stored at the same height, but don't let blocks which are too old in
+	if (block.m_sidechainHeight + NUM_BLOCKS <= m_impl->m_maxHeight) {
+		return;
+	}
+	m_impl->m_maxHeight = std::max(m_impl->m_maxHeight, block.m_sidechainHeight);
 
-	*reinterpret_cast<uint32_t*>(data) = static_cast<uint32_t>(n1 + n2);
-	memcpy(data + sizeof(uint32_t), block.m_mainChainData.data(), n1);
-	memcpy(data + sizeof(uint32_t) + n1, block.m_sideChainData.data(), n2);
+	const uint32_t blob_size = static_cast<uint32_t>(n1 + n2);
+	const size_t size = record_size(blob_size);
+
+	if (!m_impl->reserve(size)) {
+		LOGWARN(4, "no space left in " << cache_name << " for block " << block.m_sidechainId);
+		return;
+	}
+
+	uint8_t* data = m_impl->m_data + m_impl->m_used;
+
+	RecordHeader* header = reinterpret_cast<RecordHeader*>(data);
+	header->magic = RECORD_MAGIC;
+	header->blob_size = blob_size;
+	header->sidechain_height = block.m_sidechainHeight;
+	header->sidechain_id = block.m_sidechainId;
+
+	uint8_t* blob = data + sizeof(RecordHeader);
+	memcpy(blob, block.main_chain_data(), n1);
+	memcpy(blob + n1, block.side_chain_data(), n2);
+
+	uint8_t* pow_data = blob + blob_size;
+
+	if (block.m_powHash.empty()) {
+		memset(pow_data, 0, POW_DATA_SIZE);
+	}
+	else {
+		memcpy(pow_data, block.m_powHash.h, HASH_SIZE);
+		memcpy(pow_data + HASH_SIZE, block.m_powSeed.h, HASH_SIZE);
+		get_pow_checksum(block.m_sidechainId, block.m_powHash, block.m_powSeed, pow_data + HASH_SIZE * 2);
+	}
+
+	m_impl->m_index.insert({ block.m_sidechainId, Impl::Entry{ m_impl->m_used, block.m_sidechainHeight, static_cast<uint32_t>(size) } });
+	m_impl->mark_dirty(m_impl->m_used, m_impl->m_used + size);
+	m_impl->m_used += size;
+	m_impl->write_terminator();
+}
+
+void BlockCache::get_pow_checksum(const hash& sidechain_id, const hash& pow_hash, const hash& seed, uint8_t* checksum)
+{
+	uint8_t buf[HASH_SIZE * 3];
+	memcpy(buf, sidechain_id.h, HASH_SIZE);
+	memcpy(buf + HASH_SIZE, pow_hash.h, HASH_SIZE);
+	memcpy(buf + HASH_SIZE * 2, seed.h, HASH_SIZE);
+	keccak(buf, static_cast<int>(sizeof(buf)), checksum, HASH_SIZE);
+}
+
+void BlockCache::preload(SideChain& side_chain)
+{
+	MutexLock lock(m_impl->m_lock);
+	preload_nolock(side_chain);
 }
 
 void BlockCache::load_all(SideChain& side_chain, P2PServer& server)
 {
-	if (!m_impl->m_data) {
+	MutexLock lock(m_impl->m_lock);
+	preload_nolock(side_chain);
+
+	// m_cachedBlocks takes ownership of the blocks
+	server.add_cached_blocks(m_impl->m_preloadedBlocks);
+}
+
+void BlockCache::preload_nolock(SideChain& side_chain)
+{
+	if (!m_impl->m_data || m_impl->m_preloaded) {
 		return;
 	}
+	m_impl->m_preloaded = true;
 
 	LOGINFO(1, "loading cached blocks");
 
-	PoolBlock block;
-	uint32_t blocks_loaded = 0;
+	using namespace std::chrono;
+	const auto start_time = steady_clock::now();
+
+	m_impl->prefetch();
+
+	// First pass: find where all records are, this only reads record headers
+	std::vector<size_t> offsets;
+	size_t offset = HEADER_SIZE;
+
+	while (offset + sizeof(RecordHeader) <= m_impl->m_fileSize) {
+		const RecordHeader* header = reinterpret_cast<const RecordHeader*>(m_impl->m_data + offset);
+
+		if ((header->magic != RECORD_MAGIC) || (header->blob_size > MAX_BLOB_SIZE)) {
+			break;
+		}
+
+		const size_t size = record_size(header->blob_size);
+		if (offset + size > m_impl->m_fileSize) {
+			break;
+		}
+
+		offsets.push_back(offset);
+		offset += size;
+	}
+	offsets.push_back(offset);
+
+	const size_t num_records = offsets.size() - 1;
+
+	// Second pass: deserialize records in parallel, every thread takes chunks of consecutive records
+	std::vector<PoolBlock*> blocks(num_records, nullptr);
+	std::atomic<size_t> next_record{ 0 };
+	std::atomic<uint32_t> pow_hashes_loaded{ 0 };
+
+	constexpr size_t CHUNK_SIZE = 64;
+
+	auto worker = [this, &side_chain, &offsets, &blocks, &next_record, &pow_hashes_loaded, num_records]()
+	{
+		PoolBlock* block = nullptr;
+
+		for (;;) {
+			const size_t first = next_record.fetch_add(CHUNK_SIZE);
+			if (first >= num_records) {
+				break;
+			}
+
+			const size_t last = std::min(first + CHUNK_SIZE, num_records);
+
+			for (size_t i = first; i < last; ++i) {
+				const uint8_t* data = m_impl->m_data + offsets[i];
+				const RecordHeader* header = reinterpret_cast<const RecordHeader*>(data);
+				const uint8_t* blob = data + sizeof(RecordHeader);
+
+				if (!block) {
+					block = new PoolBlock();
+				}
+
+				// A record which was only partially written before a crash can't pass this check
+				if ((block->deserialize(blob, header->blob_size, side_chain) != 0) || (block->m_sidechainId != header->sidechain_id)) {
+					continue;
+				}
 
-	for (uint64_t i = 0; i < NUM_BLOCKS; ++i) {
-		const uint8_t* data = m_impl->m_data + i * BLOCK_SIZE;
-		const uint32_t n = *reinterpret_cast<const uint32_t*>(data);
+				const uint8_t* pow_data = blob + header->blob_size;
 
-		if (!n || (n + sizeof(uint32_t) > BLOCK_SIZE)) {
-			continue;
+				hash pow_hash, seed;
+				memcpy(pow_hash.h, pow_data, HASH_SIZE);
+				memcpy(seed.h, pow_data + HASH_SIZE, HASH_SIZE);
+
+				uint8_t checksum[HASH_SIZE];
+				get_pow_checksum(block->m_sidechainId, pow_hash, seed, checksum);
+
+				if (!pow_hash.empty() && (memcmp(checksum, pow_data + HASH_SIZE * 2, HASH_SIZE) == 0)) {
+					block->m_powHash = pow_hash;
+					block->m_powSeed = seed;
+					block->m_powHashTrusted = true;
+					++pow_hashes_loaded;
+				}
+
+				blocks[i] = block;
+				block = nullptr;
+			}
+		}
+
+		delete block;
+	};
+
+	const size_t num_threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1U), (num_records + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+	if (num_threads > 1) {
+		std::vector<std::thread> threads;
+		threads.reserve(num_threads - 1);
+
+		for (size_t i = 0; i < num_threads - 1; ++i) {
+			threads.emplace_back(worker);
+		}
+		worker();
+
+		for (std::thread& t : threads) {
+			t.join();
 		}
+	}
+	else {
+		worker();
+	}
+
+	m_impl->prefetch_done();
+
+	// Everything after the first corrupted record is ignored, the log is continued from there
+	size_t num_valid = 0;
+	while ((num_valid < num_records) && blocks[num_valid]) {
+		++num_valid;
+	}
 
-		if (block.deserialize(data + sizeof(uint32_t), n, side_chain) == 0) {
-			server.add_cached_block(block);
-			++blocks_loaded;
+	if (num_valid < num_records) {
+		LOGWARN(3, "cached block at offset " << offsets[num_valid] << " is corrupted, ignoring everything after it");
+
+		for (size_t i = num_valid; i < num_records; ++i) {
+			delete blocks[i];
 		}
+		blocks.resize(num_valid);
+	}
+
+	for (size_t i = 0; i < num_valid; ++i) {
+		const PoolBlock* block = blocks[i];
+		m_impl->m_index.insert({ block->m_sidechainId, Impl::Entry{ offsets[i], block->m_sidechainHeight, static_cast<uint32_t>(offsets[i + 1] - offsets[i]) } });
+		m_impl->m_maxHeight = std::max(m_impl->m_maxHeight, block->m_sidechainHeight);
 	}
 
-	LOGINFO(1, "loaded " << blocks_loaded << " cached blocks");
+	m_impl->m_used = offsets[num_valid];
+	m_impl->write_terminator();
+
+	m_impl->m_preloadedBlocks = std::move(blocks);
+
+	const int64_t dt = duration_cast<milliseconds>(steady_clock::now() - start_time).count();
+	LOGINFO(1, "loaded " << num_valid << " cached blocks (" << pow_hashes_loaded.load() << " with PoW hashes, " << m_impl->m_used << " bytes) in " << dt << " ms using " << num_threads << " threads");
 }
 
 void BlockCache::flush()
 {
 	if (m_flushRunning.exchange(1) == 0) {
-		m_impl->flush();
+		m_impl->flush(false);
 		m_flushRunning.store(0);
 	}
 }
@@ -30,10 +30,19 @@ public:
 	~BlockCache();
 
 	void store(const PoolBlock& block);
-	void load_all(SideChain& side_chain, P2PServer& server);
 	void flush();
 
+	// Reads and deserializes all cached blocks, it can run in a background thread before the P2P server exists
+	void preload(SideChain& side_chain);
+
+	// Hands cached blocks over to the P2P server, preloads them first if it hasn't been done yet
+	void load_all(SideChain& side_chain, P2PServer& server);
+
 private:
+	void preload_nolock(SideChain& side_chain);
+
+	static void get_pow_checksum(const hash& sidechain_id, const hash& pow_hash, const hash& seed, uint8_t* checksum);
+
 	struct Impl;
 	Impl* m_impl;
 	std::atomic<uint32_t> m_flushRunning;
@@ -28,17 +28,39 @@
 #include "side_chain.h"
 #include "pool_block.h"
 #include "params.h"
+#include "metrics.h"
+#include "memory_leak_debug.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define KNAPSACK_SSE2
+#ifndef _MSC_VER
+#include <emmintrin.h>
+#endif
+#endif
 #include <zmq.hpp>
 #include <ctime>
 #include <numeric>
+#include <thread>
 
 static constexpr char log_category_prefix[] = "BlockTemplate ";
 
 namespace p2pool {
 
 BlockTemplate::BlockTemplate(p2pool* pool)
+	: BlockTemplate(pool, SnapshotTag())
+{
+	for (size_t i = 0; i < array_size(&BlockTemplate::m_snapshots); ++i) {
+		m_snapshots[i] = new BlockTemplate(pool, SnapshotTag());
+	}
+
+	update_tx_keys();
+}
+
+BlockTemplate::BlockTemplate(p2pool* pool, SnapshotTag)
 	: m_pool(pool)
 	, m_templateId(0)
+	, m_current(nullptr)
+	, m_refCount(0)
 	, m_blockHeaderSize(0)
 	, m_minerTxOffsetInTemplate(0)
 	, m_minerTxSize(0)
@@ -50,10 +72,17 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 	, m_difficulty{}
 	, m_seedHash{}
 	, m_timestamp(0)
+	, m_txkeyPub{}
+	, m_txkeySec{}
 	, m_poolBlockTemplate(new PoolBlock())
 	, m_finalReward(0)
+	, m_baseReward(0)
+	, m_maxRewardAmountsWeight(0)
+	, m_finalFees(0)
+	, m_finalWeight(0)
 {
 	uv_rwlock_init_checked(&m_lock);
+	uv_mutex_init_checked(&m_submitLock);
 
 	m_blockHeader.reserve(64);
 	m_minerTx.reserve(49152);
@@ -66,78 +95,101 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 	m_mempoolTxsOrder.reserve(1024);
 	m_shares.reserve(m_pool->side_chain().chain_window_size() * 2);
 
-	for (size_t i = 0; i < array_size(&BlockTemplate::m_oldTemplates); ++i) {
-		m_oldTemplates[i] = new BlockTemplate(*this);
-	}
-
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-	m_knapsack.reserve(512 * 309375);
-#endif
-
-	update_tx_keys();
 }
 
 BlockTemplate::~BlockTemplate()
 {
-	for (size_t i = 0; i < array_size(&BlockTemplate::m_oldTemplates); ++i) {
-		delete m_oldTemplates[i];
+	for (size_t i = 0; i < array_size(&BlockTemplate::m_snapshots); ++i) {
+		delete m_snapshots[i];
 	}
 
 	uv_rwlock_destroy(&m_lock);
+	uv_mutex_destroy(&m_submitLock);
 
 	delete m_poolBlockTemplate;
 }
 
-BlockTemplate::BlockTemplate(const BlockTemplate& b)
-	: m_poolBlockTemplate(new PoolBlock())
+const BlockTemplate* BlockTemplate::acquire(uint32_t template_id) const
 {
-	uv_rwlock_init_checked(&m_lock);
-	*this = b;
+	ReadLock lock(m_lock);
+
+	for (const BlockTemplate* t : m_snapshots) {
+		if (t->m_templateId && (t->m_templateId == template_id)) {
+			t->m_refCount.fetch_add(1);
+			return t;
+		}
+	}
+
+	return nullptr;
 }
 
-// cppcheck-suppress operatorEqVarError
-BlockTemplate& BlockTemplate::operator=(const BlockTemplate& b)
+const BlockTemplate* BlockTemplate::acquire_current() const
 {
-	if (this == &b) {
-		return *this;
+	ReadLock lock(m_lock);
+
+	if (m_current) {
+		m_current->m_refCount.fetch_add(1);
 	}
 
-	WriteLock lock(m_lock);
+	return m_current;
+}
 
-	m_pool = b.m_pool;
-	m_templateId = b.m_templateId;
-	m_blockTemplateBlob = b.m_blockTemplateBlob;
-	m_merkleTreeMainBranch = b.m_merkleTreeMainBranch;
-	m_blockHeaderSize = b.m_blockHeaderSize;
-	m_minerTxOffsetInTemplate = b.m_minerTxOffsetInTemplate;
-	m_minerTxSize = b.m_minerTxSize;
-	m_nonceOffset = b.m_nonceOffset;
-	m_extraNonceOffsetInTemplate = b.m_extraNonceOffsetInTemplate;
-	m_numTransactionHashes = b.m_numTransactionHashes;
-	m_prevId = b.m_prevId;
-	m_height = b.m_height;
-	m_difficulty = b.m_difficulty;
-	m_seedHash = b.m_seedHash;
-	m_timestamp = b.m_timestamp;
-	m_txkeyPub = b.m_txkeyPub;
-	m_txkeySec = b.m_txkeySec;
-	*m_poolBlockTemplate = *b.m_poolBlockTemplate;
-	m_finalReward = b.m_finalReward;
+void BlockTemplate::release(const BlockTemplate* snapshot)
+{
+	if (snapshot) {
+		snapshot->m_refCount.fetch_sub(1);
+	}
+}
 
-	m_minerTx.clear();
-	m_blockHeader.clear();
-	m_minerTxExtra.clear();
-	m_transactionHashes.clear();
-	m_rewards.clear();
-	m_mempoolTxs.clear();
-	m_mempoolTxsOrder.clear();
-	m_shares.clear();
+BlockTemplate* BlockTemplate::get_free_snapshot()
+{
+	for (;;) {
+		{
+			WriteLock lock(m_lock);
 
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-	m_knapsack.clear();
-#endif
+			// Take the oldest snapshot which is not used by anyone
+			BlockTemplate* result = nullptr;
+			for (BlockTemplate* t : m_snapshots) {
+				if ((t != m_current) && (t->m_refCount.load() == 0) && (!result || (t->m_templateId < result->m_templateId))) {
+					result = t;
+				}
+			}
+
+			// acquire() increments reference counters only when m_lock is locked for reading,
+			// so no one can get this snapshot after its template_id is reset here
+			if (result) {
+				result->m_templateId = 0;
+				return result;
+			}
+		}
+
+		// All snapshots are being read right now, readers never keep them for long
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+uint64_t BlockTemplate::height() const
+{
+	ReadLock lock(m_lock);
+	return m_current ? m_current->m_height : 0;
+}
+
+time_t BlockTemplate::timestamp() const
+{
+	ReadLock lock(m_lock);
+	return m_current ? static_cast<time_t>(m_current->m_timestamp) : 0;
+}
 
-	return *this;
+difficulty_type BlockTemplate::difficulty() const
+{
+	ReadLock lock(m_lock);
+	return m_current ? m_current->m_difficulty : difficulty_type();
+}
+
+uint64_t BlockTemplate::final_reward() const
+{
+	ReadLock lock(m_lock);
+	return m_current ? m_current->m_finalReward : 0;
 }
 
 static FORCEINLINE uint64_t get_base_reward(uint64_t already_generated_coins)
@@ -178,18 +230,33 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		return;
 	}
 
-	// Block template construction is relatively slow, but it's better to keep the lock the whole time
-	// instead of using temporary variables and making a quick swap in the end
-	// 
-	// All readers will line up for the new template instead of using the outdated template
-	WriteLock lock(m_lock);
+	metrics::Timer timer(metrics::TEMPLATE_UPDATE);
+	alloc_telemetry::Scope alloc_scope(alloc_telemetry::BLOCK_TEMPLATE);
 
-	if (m_templateId > 0) {
-		*m_oldTemplates[m_templateId % array_size(&BlockTemplate::m_oldTemplates)] = *this;
+	// Block template construction is relatively slow, so it's done in a snapshot which no one else can access
+	// Readers keep using the current template until the new one is published
+	BlockTemplate* t = get_free_snapshot();
+	{
+		ReadLock lock(m_lock);
+		t->m_txkeyPub = m_txkeyPub;
+		t->m_txkeySec = m_txkeySec;
 	}
 
-	++m_templateId;
+	if (!t->build(data, mempool, miner_wallet)) {
+		return;
+	}
 
+	metrics::add(metrics::TEMPLATES_CREATED);
+	metrics::set(metrics::TEMPLATE_TRANSACTIONS, t->m_poolBlockTemplate->m_transactions.size() - 1);
+	metrics::set(metrics::TEMPLATE_SHARES, t->m_shares.size());
+
+	WriteLock lock(m_lock);
+	t->m_templateId = ++m_templateId;
+	m_current = t;
+}
+
+bool BlockTemplate::build(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet)
+{
 	m_height = data.height;
 	m_difficulty = data.difficulty;
 	m_seedHash = data.seed_hash;
@@ -197,32 +264,12 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	const time_t cur_time = time(nullptr);
 
 	// Only choose transactions that were received 10 or more seconds ago
-	size_t total_mempool_transactions;
-	{
-		m_mempoolTxs.clear();
-
-		ReadLock mempool_lock(mempool.m_lock);
-
-		total_mempool_transactions = mempool.m_transactions.size();
-
-		for (auto& it : mempool.m_transactions) {
-			if (cur_time >= it.second.time_received + 10) {
-				m_mempoolTxs.emplace_back(it.second);
-			}
-		}
-	}
-
+	//
 	// Safeguard for busy mempool moments
 	// If the block template gets too big, nodes won't be able to send and receive it because of p2p packet size limit
-	// Select 1000 transactions with the highest fee per byte
-	if (m_mempoolTxs.size() > 1000) {
-		std::nth_element(m_mempoolTxs.begin(), m_mempoolTxs.begin() + 1000, m_mempoolTxs.end(),
-			[](const TxMempoolData& tx_a, const TxMempoolData& tx_b)
-			{
-				return tx_a.fee * tx_b.weight > tx_b.fee * tx_a.weight;
-			});
-		m_mempoolTxs.resize(1000);
-	}
+	// Select 1000 transactions with the highest fee per byte (mempool returns them already sorted by fee per byte)
+	size_t total_mempool_transactions;
+	mempool.get_best_transactions(cur_time - 10, 1000, m_mempoolTxs, total_mempool_transactions);
 
 	LOGINFO(4, "mempool has " << total_mempool_transactions << " transactions, taking " << m_mempoolTxs.size() << " transactions from it");
 
@@ -274,8 +321,18 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	m_blockHeaderSize = m_blockHeader.size();
 
 	m_pool->side_chain().fill_sidechain_data(*m_poolBlockTemplate, miner_wallet, m_txkeySec, m_shares);
+
+	// Miners who entered the PPLNS window get their derivation tables, miners who left it lose them
+	{
+		std::vector<hash> view_keys;
+		view_keys.reserve(m_shares.size());
+		for (const MinerShare& share : m_shares) {
+			view_keys.push_back(share.m_wallet->view_public_key());
+		}
+		update_derivation_tables(view_keys);
+	}
 	if (!SideChain::split_reward(max_reward, m_shares, m_rewards)) {
-		return;
+		return false;
 	}
 
 	const uint64_t max_reward_amounts_weight = std::accumulate(m_rewards.begin(), m_rewards.end(), 0ULL,
@@ -286,7 +343,7 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		});
 
 	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, true)) {
-		return;
+		return false;
 	}
 
 	const uint64_t miner_tx_weight = m_minerTx.size();
@@ -324,14 +381,7 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		// Usually no more than 0.5 micronero away from the optimal discrete knapsack solution
 		// Sometimes it even finds the optimal solution
 
-		// Sort all transactions by fee per byte (highest to lowest)
-		std::sort(m_mempoolTxsOrder.begin(), m_mempoolTxsOrder.end(),
-			[this](int a, int b)
-			{
-				const TxMempoolData& tx_a = m_mempoolTxs[a];
-				const TxMempoolData& tx_b = m_mempoolTxs[b];
-				return tx_a.fee * tx_b.weight > tx_b.fee * tx_a.weight;
-			});
+		// All transactions are already sorted by fee per byte (highest to lowest)
 
 		final_reward = base_reward;
 		final_fees = 0;
@@ -399,48 +449,65 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 			LOGERR(1, "final_reward < base_reward, this should never happen. Fix the code!");
 		}
 
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-		LOGINFO(3, "final_reward = " << log::XMRAmount(final_reward) << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
-
-		uint64_t final_reward2;
-		fill_optimal_knapsack(data, base_reward, miner_tx_weight, final_reward2, final_fees, final_weight);
-		LOGINFO(3, "best_reward  = " << log::XMRAmount(final_reward2) << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
-		if (final_reward2 < final_reward) {
-			LOGERR(1, "fill_optimal_knapsack has a bug, found solution is not optimal. Fix it!");
-		}
-		LOGINFO(3, "difference   = " << static_cast<int64_t>(final_reward2 - final_reward));
-		final_reward = final_reward2;
-		{
-			uint64_t fee_check = 0;
-			uint64_t weight_check = miner_tx_weight;
-			for (int i : m_mempoolTxsOrder) {
-				const TxMempoolData& tx = m_mempoolTxs[i];
-				fee_check += tx.fee;
-				weight_check += tx.weight;
-			}
-			const uint64_t reward_check = get_block_reward(base_reward, data.median_weight, final_fees, final_weight);
-			if ((reward_check != final_reward) || (fee_check != final_fees) || (weight_check != final_weight)) {
-				LOGERR(1, "fill_optimal_knapsack has a bug, expected " << final_reward << ", got " << reward_check << " reward. Fix it!");
+		// The heuristic is usually very close to the optimal solution, but a bit of the reward can still be left on the table
+		// Try to improve it with the knapsack solver if it's enabled, it gives up if it can't finish in time
+		const uint32_t time_budget_ms = m_pool->params().m_txSelectionTimeBudget;
+		if (time_budget_ms > 0) {
+			const uint64_t heuristic_reward = final_reward;
+			if (fill_optimal_knapsack(data, base_reward, miner_tx_weight, final_reward, time_budget_ms, final_reward, final_fees, final_weight)) {
+				LOGINFO(4, "knapsack solver improved the block reward by " << log::XMRAmount(final_reward - heuristic_reward) << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
 			}
 		}
-#endif
 	}
 
 	if (!SideChain::split_reward(final_reward, m_shares, m_rewards)) {
-		return;
+		return false;
 	}
 
 	m_finalReward = final_reward;
 
+	m_minerData = data;
+	m_minerData.tx_backlog.clear();
+	m_baseReward = base_reward;
+	m_maxRewardAmountsWeight = max_reward_amounts_weight;
+	m_finalFees = final_fees;
+	m_finalWeight = final_weight;
+
 	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, false)) {
-		return;
+		return false;
 	}
 
 	if (m_minerTx.size() != miner_tx_weight) {
 		LOGERR(1, "miner tx size changed after adjusting reward");
-		return;
+		return false;
 	}
 
+	m_poolBlockTemplate->m_transactions.clear();
+	m_poolBlockTemplate->m_transactions.resize(1);
+	m_poolBlockTemplate->m_transactions.reserve(m_mempoolTxsOrder.size() + 1);
+	for (size_t i = 0, n = m_mempoolTxsOrder.size(); i < n;  ++i) {
+		m_poolBlockTemplate->m_transactions.push_back(m_mempoolTxs[m_mempoolTxsOrder[i]].id);
+	}
+
+	m_poolBlockTemplate->m_minerWallet = *miner_wallet;
+
+	assemble_template();
+
+	LOGINFO(3, "final reward = " << log::Gray() << log::XMRAmount(final_reward) << log::NoColor() <<
+		", weight = " << log::Gray() << final_weight << log::NoColor() <<
+		", outputs = " << log::Gray() << m_poolBlockTemplate->m_outputs.size() << log::NoColor() <<
+		", " << log::Gray() << m_numTransactionHashes << log::NoColor() <<
+		" of " << log::Gray() << m_mempoolTxs.size() << log::NoColor() << " transactions included");
+
+	// m_transactionHashes, m_rewards and m_shares are kept for refresh_transactions()
+	m_mempoolTxs.clear();
+	m_mempoolTxsOrder.clear();
+
+	return true;
+}
+
+void BlockTemplate::assemble_template()
+{
 	m_blockTemplateBlob = m_blockHeader;
 	m_extraNonceOffsetInTemplate += m_blockHeader.size();
 	m_minerTxOffsetInTemplate = m_blockHeader.size();
@@ -451,15 +518,6 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	// Miner tx hash is skipped here because it's not a part of block template
 	m_blockTemplateBlob.insert(m_blockTemplateBlob.end(), m_transactionHashes.begin() + HASH_SIZE, m_transactionHashes.end());
 
-	m_poolBlockTemplate->m_transactions.clear();
-	m_poolBlockTemplate->m_transactions.resize(1);
-	m_poolBlockTemplate->m_transactions.reserve(m_mempoolTxsOrder.size() + 1);
-	for (size_t i = 0, n = m_mempoolTxsOrder.size(); i < n;  ++i) {
-		m_poolBlockTemplate->m_transactions.push_back(m_mempoolTxs[m_mempoolTxsOrder[i]].id);
-	}
-
-	m_poolBlockTemplate->m_minerWallet = *miner_wallet;
-
 	m_poolBlockTemplate->serialize_sidechain_data();
 	m_poolBlockTemplate->m_sidechainId = calc_sidechain_hash();
 	const int sidechain_hash_offset = static_cast<int>(m_extraNonceOffsetInTemplate + m_poolBlockTemplate->m_extraNonceSize) + 2;
@@ -497,111 +555,329 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	}
 #endif
 
+	m_minerTxPrefixState.init(HASH_SIZE);
+	m_minerTxPrefixState.absorb(m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate, m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate);
+
 	const hash minerTx_hash = calc_miner_tx_hash(0);
 
 	memcpy(m_transactionHashes.data(), minerTx_hash.h, HASH_SIZE);
 
 	calc_merkle_tree_main_branch();
 
-	LOGINFO(3, "final reward = " << log::Gray() << log::XMRAmount(final_reward) << log::NoColor() <<
-		", weight = " << log::Gray() << final_weight << log::NoColor() <<
-		", outputs = " << log::Gray() << m_poolBlockTemplate->m_outputs.size() << log::NoColor() <<
-		", " << log::Gray() << m_numTransactionHashes << log::NoColor() <<
-		" of " << log::Gray() << m_mempoolTxs.size() << log::NoColor() << " transactions included");
-
 	m_minerTx.clear();
 	m_blockHeader.clear();
 	m_minerTxExtra.clear();
-	m_transactionHashes.clear();
-	m_rewards.clear();
-	m_mempoolTxs.clear();
-	m_mempoolTxsOrder.clear();
-	m_shares.clear();
 }
 
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight)
+void BlockTemplate::copy_from(const BlockTemplate& b)
+{
+	m_blockTemplateBlob = b.m_blockTemplateBlob;
+	m_merkleTreeMainBranch = b.m_merkleTreeMainBranch;
+	m_blockHeaderSize = b.m_blockHeaderSize;
+	m_minerTxOffsetInTemplate = b.m_minerTxOffsetInTemplate;
+	m_minerTxSize = b.m_minerTxSize;
+	m_nonceOffset = b.m_nonceOffset;
+	m_extraNonceOffsetInTemplate = b.m_extraNonceOffsetInTemplate;
+	m_minerTxPrefixState = b.m_minerTxPrefixState;
+	m_numTransactionHashes = b.m_numTransactionHashes;
+	m_prevId = b.m_prevId;
+	m_height = b.m_height;
+	m_difficulty = b.m_difficulty;
+	m_seedHash = b.m_seedHash;
+	m_timestamp = b.m_timestamp;
+	m_txkeyPub = b.m_txkeyPub;
+	m_txkeySec = b.m_txkeySec;
+	*m_poolBlockTemplate = *b.m_poolBlockTemplate;
+	m_finalReward = b.m_finalReward;
+	m_minerData = b.m_minerData;
+	m_baseReward = b.m_baseReward;
+	m_maxRewardAmountsWeight = b.m_maxRewardAmountsWeight;
+	m_finalFees = b.m_finalFees;
+	m_finalWeight = b.m_finalWeight;
+	m_transactionHashes = b.m_transactionHashes;
+	m_rewards = b.m_rewards;
+	m_shares = b.m_shares;
+}
+
+bool BlockTemplate::refresh_transactions(const Mempool& mempool)
+{
+	const BlockTemplate* cur = acquire_current();
+	if (!cur) {
+		return false;
+	}
+
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([cur]() { release(cur); });
+
+	const uint64_t median_weight = cur->m_minerData.median_weight;
+
+	// Only templates outside of the penalty zone can be extended, the full transaction picking algorithm is needed otherwise
+	if (cur->m_finalWeight > median_weight) {
+		return false;
+	}
+
+	std::vector<TxMempoolData> txs;
+	size_t total_mempool_transactions;
+	mempool.get_best_transactions(time(nullptr) - 10, 1000, txs, total_mempool_transactions);
+
+	unordered_set<hash> included;
+	included.reserve(cur->m_poolBlockTemplate->m_transactions.size());
+	for (const hash& id : cur->m_poolBlockTemplate->m_transactions) {
+		included.insert(id);
+	}
+
+	std::vector<TxMempoolData> new_txs;
+	uint64_t new_fees = 0;
+	uint64_t weight = cur->m_finalWeight;
+
+	for (const TxMempoolData& tx : txs) {
+		if (cur->m_numTransactionHashes + new_txs.size() >= 1000) {
+			break;
+		}
+		if ((weight + tx.weight <= median_weight) && (included.find(tx.id) == included.end())) {
+			new_txs.push_back(tx);
+			new_fees += tx.fee;
+			weight += tx.weight;
+		}
+	}
+
+	// Don't send new jobs to all miners unless it's worth it
+	if (new_txs.empty() || (new_fees < cur->m_finalReward / TX_REFRESH_MIN_REWARD_INCREASE)) {
+		return false;
+	}
+
+	BlockTemplate* t = get_free_snapshot();
+	{
+		// Submits copy PoolBlock from snapshots too
+		MutexLock lock(m_submitLock);
+		t->copy_from(*cur);
+	}
+
+	if (!t->add_transactions(new_txs)) {
+		return false;
+	}
+
+	LOGINFO(3, "added " << new_txs.size() << " transactions to the block template, fees = " << log::Gray() << log::XMRAmount(new_fees));
+
+	WriteLock lock(m_lock);
+	t->m_templateId = ++m_templateId;
+	m_current = t;
+
+	return true;
+}
+
+bool BlockTemplate::add_transactions(const std::vector<TxMempoolData>& txs)
+{
+	for (const TxMempoolData& tx : txs) {
+		m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
+		m_poolBlockTemplate->m_transactions.push_back(tx.id);
+		++m_numTransactionHashes;
+
+		m_finalFees += tx.fee;
+		m_finalWeight += tx.weight;
+	}
+
+	// Still outside of the penalty zone, so the block reward is just the base reward + fees
+	const uint64_t final_reward = m_baseReward + m_finalFees;
+
+	if (!SideChain::split_reward(final_reward, m_shares, m_rewards)) {
+		return false;
+	}
+
+	// Miner tx must keep its size, and extra_nonce padding can only make up for smaller reward amounts
+	uint64_t reward_amounts_weight = 0;
+	for (uint64_t reward : m_rewards) {
+		writeVarint(reward, [&reward_amounts_weight](uint8_t) { ++reward_amounts_weight; });
+	}
+
+	if (reward_amounts_weight > m_maxRewardAmountsWeight) {
+		LOGINFO(4, "can't add transactions to the block template: reward amounts don't fit in the miner tx anymore");
+		return false;
+	}
+
+	m_finalReward = final_reward;
+
+	// Ephemeral public keys don't depend on reward amounts, so they're reused from the current template
+	std::vector<hash> eph_keys;
+	eph_keys.reserve(m_poolBlockTemplate->m_outputs.size());
+	for (const PoolBlock::TxOutput& output : m_poolBlockTemplate->m_outputs) {
+		eph_keys.push_back(output.m_ephPublicKey);
+	}
+
+	if (!create_miner_tx(m_minerData, m_shares, m_maxRewardAmountsWeight, false, &eph_keys)) {
+		return false;
+	}
+
+	if (m_minerTx.size() != m_minerTxSize) {
+		LOGERR(1, "miner tx size changed after adding transactions");
+		return false;
+	}
+
+	m_blockHeader.assign(m_blockTemplateBlob.begin(), m_blockTemplateBlob.begin() + m_blockHeaderSize);
+
+	assemble_template();
+
+	return true;
+}
+
+bool BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t min_reward, uint32_t time_budget_ms, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight)
 {
 	// Find the maximum possible fee for every weight value and remember which tx leads to this fee/weight
-	// Run time is O(N*W) where N is the number of transactions and W is the maximum block weight
-	// 
-	// Actual run time is 0.02-0.05 seconds on real full blocks
-	// It's too slow and uses too much memory to be practical
+	// Run time is O(N*W) where N is the number of transactions and W is the number of weight buckets
+	//
+	// Weights are rounded up to KNAPSACK_BUCKETS buckets, so the solution is not always the exact optimum,
+	// but it always fits in the weight limit and is never worse than what the heuristic found (it's not used otherwise)
 
 	constexpr uint64_t FEE_COEFF = 1000;
 
+	const uint64_t start_time = uv_hrtime();
+	const uint64_t deadline = start_time + time_budget_ms * 1000000ULL;
+
 	const uint64_t n = m_mempoolTxs.size();
-	const uint64_t max_weight = data.median_weight + (data.median_weight / 32) - miner_tx_weight;
+	const uint64_t weight_limit = data.median_weight + (data.median_weight / 32);
+	if ((n == 0) || (weight_limit <= miner_tx_weight)) {
+		return false;
+	}
+
+	// Fees are compared as signed 32-bit integers in the SSE2 code
+	uint64_t total_fees = 0;
+	for (const TxMempoolData& tx : m_mempoolTxs) {
+		total_fees += tx.fee / FEE_COEFF;
+	}
+	if (total_fees > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+		return false;
+	}
 
-	m_knapsack.resize((n + 1) * max_weight);
-	memset(m_knapsack.data(), 0, max_weight * sizeof(uint32_t));
+	const uint64_t max_weight = weight_limit - miner_tx_weight;
+	const uint64_t bucket_size = (max_weight + KNAPSACK_BUCKETS - 1) / KNAPSACK_BUCKETS;
+	const uint64_t num_buckets = max_weight / bucket_size + 1;
+
+	// Rows are padded to a multiple of 64 buckets (one 64-bit word in m_knapsackUsed)
+	// Padding buckets are over the weight limit, they're calculated but never used
+	const uint64_t row_size = (num_buckets + 63) & ~63ULL;
+	const uint64_t words_per_row = row_size / 64;
+
+	m_knapsack.assign(row_size * 2, 0);
+	m_knapsackUsed.assign(n * words_per_row, 0);
+
+	uint32_t* prev_row = m_knapsack.data();
+	uint32_t* row = prev_row + row_size;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (((i & 15) == 0) && (uv_hrtime() > deadline)) {
+			LOGINFO(4, "knapsack solver ran out of time after " << i << " of " << n << " transactions");
+			return false;
+		}
 
-	for (size_t i = 1; i <= n; ++i) {
-		const TxMempoolData& tx = m_mempoolTxs[i - 1];
+		const TxMempoolData& tx = m_mempoolTxs[i];
 		const uint32_t tx_fee = static_cast<uint32_t>(tx.fee / FEE_COEFF);
-		const uint64_t tx_weight = tx.weight;
+		const uint64_t tx_weight = (tx.weight + bucket_size - 1) / bucket_size;
 
-		uint32_t* row = m_knapsack.data() + i * max_weight;
-		const uint32_t* prev_row = row - max_weight;
+		if (tx_weight >= num_buckets) {
+			memcpy(row, prev_row, row_size * sizeof(uint32_t));
+			std::swap(row, prev_row);
+			continue;
+		}
 
-		row[0] = 0;
-		memcpy(row + 1, prev_row + 1, (tx_weight - 1) * sizeof(uint32_t));
+		memcpy(row, prev_row, tx_weight * sizeof(uint32_t));
 
-#define INNER_LOOP(k) { \
-	const uint32_t fee_when_used = prev_row[w + k - tx_weight] + tx_fee; \
-	const uint32_t fee_when_not_used = prev_row[w + k]; \
-	row[w + k] = (fee_when_used > fee_when_not_used) ? fee_when_used : fee_when_not_used; \
-}
+		uint64_t* used = m_knapsackUsed.data() + i * words_per_row;
+
+#ifdef KNAPSACK_SSE2
+		// Do buckets up to the next 64-bit word boundary one by one, then 64 buckets at a time
+		const uint64_t w0 = std::min<uint64_t>((tx_weight + 63) & ~63ULL, row_size);
+#else
+		const uint64_t w0 = row_size;
+#endif
 
-		for (size_t w = tx_weight, max_w = max_weight - 3; w < max_w; w += 4) {
-			INNER_LOOP(0);
-			INNER_LOOP(1);
-			INNER_LOOP(2);
-			INNER_LOOP(3);
+		for (uint64_t w = tx_weight; w < w0; ++w) {
+			const uint32_t fee_when_used = prev_row[w - tx_weight] + tx_fee;
+			const uint32_t fee_when_not_used = prev_row[w];
+			row[w] = (fee_when_used > fee_when_not_used) ? fee_when_used : fee_when_not_used;
+			used[w / 64] |= static_cast<uint64_t>(fee_when_used > fee_when_not_used) << (w % 64);
 		}
 
-#undef INNER_LOOP
+#ifdef KNAPSACK_SSE2
+		const __m128i fee4 = _mm_set1_epi32(static_cast<int>(tx_fee));
+
+		for (uint64_t w = w0; w < row_size; w += 64) {
+			uint64_t mask = 0;
+			for (int j = 0; j < 64; j += 4) {
+				const __m128i fee_when_used = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(prev_row + w + j - tx_weight)), fee4);
+				const __m128i fee_when_not_used = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev_row + w + j));
+				const __m128i is_used = _mm_cmpgt_epi32(fee_when_used, fee_when_not_used);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(row + w + j), _mm_or_si128(_mm_and_si128(is_used, fee_when_used), _mm_andnot_si128(is_used, fee_when_not_used)));
+				mask |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(is_used)))) << j;
+			}
+			used[w / 64] = mask;
+		}
+#endif
+
+		std::swap(row, prev_row);
 	}
 
 	// Now that we know which fee we can get for each weight, just find the maximum possible block reward
-	best_reward = base_reward;
-	uint64_t best_weight = 0;
-	for (uint64_t w = 0, max_w = max_weight - 3; w < max_w; ++w) {
-		const uint64_t fee = m_knapsack[n * max_weight + w] * FEE_COEFF;
-		if (fee) {
-			const uint64_t cur_reward = get_block_reward(base_reward, data.median_weight, fee, w + miner_tx_weight);
-			if (cur_reward > best_reward) {
-				best_reward = cur_reward;
-				best_weight = w;
-			}
+	// Weight of each bucket's solution is not bigger than the bucket's upper bound, so the real reward can only be higher
+	uint64_t best_estimate = 0;
+	uint64_t best_bucket = 0;
+	for (uint64_t w = 0; w < num_buckets; ++w) {
+		const uint64_t fee = prev_row[w] * FEE_COEFF;
+		const uint64_t cur_reward = get_block_reward(base_reward, data.median_weight, fee, w * bucket_size + miner_tx_weight);
+		if (cur_reward > best_estimate) {
+			best_estimate = cur_reward;
+			best_bucket = w;
 		}
 	}
 
-	m_numTransactionHashes = 0;
+	std::vector<int> order;
+	order.reserve(n);
 
-	final_fees = 0;
-	final_weight = miner_tx_weight;
+	uint64_t fees = 0;
+	uint64_t weight = miner_tx_weight;
 
-	m_mempoolTxsOrder.clear();
-	m_transactionHashes.assign(HASH_SIZE, 0);
-	for (int i = static_cast<int>(n); (i > 0) && (best_weight > 0); --i) {
-		if (m_knapsack[i * max_weight + best_weight] > m_knapsack[(i - 1) * max_weight + best_weight]) {
-			m_mempoolTxsOrder.push_back(i - 1);
+	for (uint64_t i = n, w = best_bucket; (i > 0) && (w > 0); --i) {
+		if (m_knapsackUsed[(i - 1) * words_per_row + w / 64] & (1ULL << (w % 64))) {
 			const TxMempoolData& tx = m_mempoolTxs[i - 1];
-			m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
-			++m_numTransactionHashes;
-			best_weight -= tx.weight;
-			final_fees += tx.fee;
-			final_weight += tx.weight;
+			order.push_back(static_cast<int>(i - 1));
+			w -= (tx.weight + bucket_size - 1) / bucket_size;
+			fees += tx.fee;
+			weight += tx.weight;
 		}
 	}
 
-	m_knapsack.clear();
+	const uint64_t reward = get_block_reward(base_reward, data.median_weight, fees, weight);
+
+	LOGINFO(5, "knapsack solver finished in " << (uv_hrtime() - start_time) / 1000 << " us, reward = " << log::XMRAmount(reward) << ", transactions = " << order.size() << ", weight = " << weight);
+
+	if (reward <= min_reward) {
+		return false;
+	}
+
+	// Keep the original order (highest fee per byte first)
+	std::reverse(order.begin(), order.end());
+	m_mempoolTxsOrder = order;
+
+	m_numTransactionHashes = m_mempoolTxsOrder.size();
+	m_transactionHashes.assign(HASH_SIZE, 0);
+	for (int i : m_mempoolTxsOrder) {
+		const TxMempoolData& tx = m_mempoolTxs[i];
+		m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
+	}
+
+	best_reward = reward;
+	final_fees = fees;
+	final_weight = weight;
+
+	return true;
 }
-#endif
 
-bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run)
+bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run, const std::vector<hash>* eph_keys)
 {
+	if (eph_keys && (eph_keys->size() != shares.size())) {
+		LOGERR(1, "create_miner_tx: wrong number of ephemeral public keys (" << eph_keys->size() << " != " << shares.size() << ")");
+		return false;
+	}
+
 	// Miner transaction (coinbase)
 	m_minerTx.clear();
 
@@ -630,6 +906,15 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 	m_poolBlockTemplate->m_outputs.clear();
 	m_poolBlockTemplate->m_outputs.reserve(num_outputs);
 
+	std::vector<hash> new_eph_keys;
+	if (!dry_run && !eph_keys) {
+		size_t failed_index;
+		if (!SideChain::get_eph_public_keys(m_txkeySec, shares, new_eph_keys, failed_index)) {
+			LOGERR(1, "get_eph_public_key failed at index " << failed_index);
+		}
+		eph_keys = &new_eph_keys;
+	}
+
 	uint64_t reward_amounts_weight = 0;
 	for (size_t i = 0; i < num_outputs; ++i) {
 		writeVarint(m_rewards[i], [this, &reward_amounts_weight](uint8_t b)
@@ -643,10 +928,7 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 			m_minerTx.insert(m_minerTx.end(), HASH_SIZE, 0);
 		}
 		else {
-			hash eph_public_key;
-			if (!shares[i].m_wallet->get_eph_public_key(m_txkeySec, i, eph_public_key)) {
-				LOGERR(1, "get_eph_public_key failed at index " << i);
-			}
+			const hash& eph_public_key = (*eph_keys)[i];
 			m_minerTx.insert(m_minerTx.end(), eph_public_key.h, eph_public_key.h + HASH_SIZE);
 			m_poolBlockTemplate->m_outputs.emplace_back(m_rewards[i], eph_public_key);
 		}
@@ -707,54 +989,42 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 hash BlockTemplate::calc_sidechain_hash() const
 {
 	// Calculate side-chain hash (all block template bytes + all side-chain bytes + consensus ID, replacing NONCE, EXTRA_NONCE and HASH itself with 0's)
-	hash sidechain_hash;
-	const int sidechain_hash_offset = static_cast<int>(m_extraNonceOffsetInTemplate + m_poolBlockTemplate->m_extraNonceSize) + 2;
-	const int blob_size = static_cast<int>(m_blockTemplateBlob.size());
+	const size_t sidechain_hash_offset = m_extraNonceOffsetInTemplate + m_poolBlockTemplate->m_extraNonceSize + 2;
+	const uint8_t* blob = m_blockTemplateBlob.data();
 
 	const std::vector<uint8_t>& consensus_id = m_pool->side_chain().consensus_id();
+	const std::vector<uint8_t>& sidechain_data = m_poolBlockTemplate->m_sideChainData;
 
-	keccak_custom([this, sidechain_hash_offset, blob_size, consensus_id](int offset) -> uint8_t {
-			uint32_t k = static_cast<uint32_t>(offset - static_cast<int>(m_nonceOffset));
-			if (k < NONCE_SIZE) {
-				return 0;
-			}
+	KeccakState state;
 
-			k = static_cast<uint32_t>(offset - static_cast<int>(m_extraNonceOffsetInTemplate));
-			if (k < EXTRA_NONCE_SIZE) {
-				return 0;
-			}
+	state.absorb(blob, m_nonceOffset);
+	state.absorb_zeros(NONCE_SIZE);
 
-			k = static_cast<uint32_t>(offset - sidechain_hash_offset);
-			if (k < HASH_SIZE) {
-				return 0;
-			}
+	state.absorb(blob + m_nonceOffset + NONCE_SIZE, m_extraNonceOffsetInTemplate - m_nonceOffset - NONCE_SIZE);
+	state.absorb_zeros(EXTRA_NONCE_SIZE);
 
-			if (offset < blob_size) {
-				return m_blockTemplateBlob[offset];
-			}
+	state.absorb(blob + m_extraNonceOffsetInTemplate + EXTRA_NONCE_SIZE, sidechain_hash_offset - m_extraNonceOffsetInTemplate - EXTRA_NONCE_SIZE);
+	state.absorb_zeros(HASH_SIZE);
 
-			const int side_chain_data_offsset = offset - blob_size;
-			const int side_chain_data_size = static_cast<int>(m_poolBlockTemplate->m_sideChainData.size());
-			if (side_chain_data_offsset < side_chain_data_size) {
-				return m_poolBlockTemplate->m_sideChainData[side_chain_data_offsset];
-			}
+	state.absorb(blob + sidechain_hash_offset + HASH_SIZE, m_blockTemplateBlob.size() - sidechain_hash_offset - HASH_SIZE);
+	state.absorb(sidechain_data.data(), sidechain_data.size());
+	state.absorb(consensus_id.data(), consensus_id.size());
 
-			const int consensus_id_offset = side_chain_data_offsset - side_chain_data_size;
-			return consensus_id[consensus_id_offset];
-		},
-		static_cast<int>(m_blockTemplateBlob.size() + m_poolBlockTemplate->m_sideChainData.size() + consensus_id.size()), sidechain_hash.h, HASH_SIZE);
+	hash sidechain_hash;
+	state.finalize(sidechain_hash.h);
 
 	return sidechain_hash;
 }
 
-hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
-{
-	// Calculate 3 partial hashes
-	uint8_t hashes[HASH_SIZE * 3];
-
-	const uint8_t* data = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate;
+// Hash of base RCT, it's a single 0 byte in miner tx
+static constexpr uint8_t known_second_hash[HASH_SIZE] = {
+	188,54,120,158,122,30,40,20,54,70,66,41,130,143,129,125,102,18,247,180,119,214,101,145,255,150,169,224,100,188,201,138
+};
 
-	const int extra_nonce_offset = static_cast<int>(m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate);
+void BlockTemplate::calc_miner_tx_prefix_hash(uint32_t extra_nonce, uint8_t* result) const
+{
+	// Prefix (everything except vin_rct_type byte in the end)
+	// Everything before extra_nonce is already in m_minerTxPrefixState, so only the tail has to be hashed here
 	const uint8_t extra_nonce_buf[EXTRA_NONCE_SIZE] = {
 		static_cast<uint8_t>(extra_nonce >> 0),
 		static_cast<uint8_t>(extra_nonce >> 8),
@@ -762,22 +1032,24 @@ hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
 		static_cast<uint8_t>(extra_nonce >> 24)
 	};
 
-	// 1. Prefix (everything except vin_rct_type byte in the end)
-	// Apply extra_nonce in-place because we can't write to the block template here
-	keccak_custom([data, extra_nonce_offset, &extra_nonce_buf](int offset)
-		{
-			const uint32_t k = static_cast<uint32_t>(offset - extra_nonce_offset);
-			if (k < EXTRA_NONCE_SIZE) {
-				return extra_nonce_buf[k];
-			}
-			return data[offset];
-		},
-		static_cast<int>(m_minerTxSize) - 1, hashes, HASH_SIZE);
+	const size_t tail_offset = m_extraNonceOffsetInTemplate + EXTRA_NONCE_SIZE;
+	const size_t tail_size = m_minerTxOffsetInTemplate + m_minerTxSize - 1 - tail_offset;
+
+	KeccakState state = m_minerTxPrefixState;
+	state.absorb(extra_nonce_buf, EXTRA_NONCE_SIZE);
+	state.absorb(m_blockTemplateBlob.data() + tail_offset, tail_size);
+	state.finalize(result);
+}
+
+hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
+{
+	// Calculate 3 partial hashes
+	uint8_t hashes[HASH_SIZE * 3];
+
+	// 1. Prefix
+	calc_miner_tx_prefix_hash(extra_nonce, hashes);
 
 	// 2. Base RCT, single 0 byte in miner tx
-	static constexpr uint8_t known_second_hash[HASH_SIZE] = {
-		188,54,120,158,122,30,40,20,54,70,66,41,130,143,129,125,102,18,247,180,119,214,101,145,255,150,169,224,100,188,201,138
-	};
 	memcpy(hashes + HASH_SIZE, known_second_hash, HASH_SIZE);
 
 	// 3. Prunable RCT, empty in miner tx
@@ -790,6 +1062,33 @@ hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
 	return result;
 }
 
+void BlockTemplate::calc_merkle_roots_x4(uint32_t extra_nonce_start, hash (&root_hashes)[4]) const
+{
+	const uint8_t* in[4];
+	uint8_t hashes[4][HASH_SIZE * 3];
+
+	// Miner transaction prefix hashes (only the tail after m_minerTxPrefixState, so it's cheap to do them one by one)
+	for (uint32_t i = 0; i < 4; ++i) {
+		calc_miner_tx_prefix_hash(extra_nonce_start + i, hashes[i]);
+		memcpy(hashes[i] + HASH_SIZE, known_second_hash, HASH_SIZE);
+		memset(hashes[i] + HASH_SIZE * 2, 0, HASH_SIZE);
+		in[i] = hashes[i];
+	}
+
+	// Miner transaction hashes
+	uint8_t* const root[4] = { root_hashes[0].h, root_hashes[1].h, root_hashes[2].h, root_hashes[3].h };
+	keccak_x4(in, HASH_SIZE * 3, root, HASH_SIZE);
+
+	// Merkle roots
+	for (size_t k = 0; k < m_merkleTreeMainBranch.size(); k += HASH_SIZE) {
+		for (uint32_t i = 0; i < 4; ++i) {
+			memcpy(hashes[i], root_hashes[i].h, HASH_SIZE);
+			memcpy(hashes[i] + HASH_SIZE, m_merkleTreeMainBranch.data() + k, HASH_SIZE);
+		}
+		keccak_x4(in, HASH_SIZE * 2, root, HASH_SIZE);
+	}
+}
+
 void BlockTemplate::calc_merkle_tree_main_branch()
 {
 	m_merkleTreeMainBranch.clear();
@@ -840,68 +1139,60 @@ void BlockTemplate::calc_merkle_tree_main_branch()
 
 bool BlockTemplate::get_difficulties(const uint32_t template_id, difficulty_type& mainchain_difficulty, difficulty_type& sidechain_difficulty) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id == m_templateId) {
-		mainchain_difficulty = m_difficulty;
-		sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-		return true;
+	const BlockTemplate* t = acquire(template_id);
+	if (!t) {
+		return false;
 	}
 
-	const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([t]() { release(t); });
 
-	if (old && (template_id == old->m_templateId)) {
-		return old->get_difficulties(template_id, mainchain_difficulty, sidechain_difficulty);
-	}
-
-	return false;
+	mainchain_difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	return true;
 }
 
 uint32_t BlockTemplate::get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id == m_templateId) {
-		height = m_height;
-		difficulty = m_difficulty;
-		sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-		seed_hash = m_seedHash;
-		nonce_offset = m_nonceOffset;
-
-		return get_hashing_blob_nolock(extra_nonce, blob);
+	const BlockTemplate* t = acquire(template_id);
+	if (!t) {
+		return 0;
 	}
 
-	const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([t]() { release(t); });
 
-	if (old && (template_id == old->m_templateId)) {
-		return old->get_hashing_blob(template_id, extra_nonce, blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset);
-	}
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
 
-	return 0;
+	return t->get_hashing_blob_nolock(extra_nonce, blob);
 }
 
 uint32_t BlockTemplate::get_hashing_blob(uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const
 {
-	ReadLock lock(m_lock);
+	const BlockTemplate* t = acquire_current();
+	if (!t) {
+		return 0;
+	}
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([t]() { release(t); });
 
-	return get_hashing_blob_nolock(extra_nonce, blob);
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
+	template_id = t->m_templateId;
+
+	return t->get_hashing_blob_nolock(extra_nonce, blob);
 }
 
 uint32_t BlockTemplate::get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const
 {
-	uint8_t* p = blob;
-
-	// Block header
-	memcpy(p, m_blockTemplateBlob.data(), m_blockHeaderSize);
-	p += m_blockHeaderSize;
-
 	// Merkle tree hash
 	hash root_hash = calc_miner_tx_hash(extra_nonce);
 
@@ -914,6 +1205,18 @@ uint32_t BlockTemplate::get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* b
 		keccak(h, HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 
+	return write_hashing_blob_nolock(root_hash, blob);
+}
+
+uint32_t BlockTemplate::write_hashing_blob_nolock(const hash& root_hash, uint8_t* blob) const
+{
+	uint8_t* p = blob;
+
+	// Block header
+	memcpy(p, m_blockTemplateBlob.data(), m_blockHeaderSize);
+	p += m_blockHeaderSize;
+
+	// Merkle tree hash
 	memcpy(p, root_hash.h, HASH_SIZE);
 	p += HASH_SIZE;
 
@@ -932,20 +1235,64 @@ uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t c
 		blobs.reserve(required_capacity * 2);
 	}
 
-	uint32_t blob_size = 0;
+	const BlockTemplate* t = acquire_current();
+	if (!t) {
+		return 0;
+	}
 
-	ReadLock lock(m_lock);
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([t]() { release(t); });
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
+	template_id = t->m_templateId;
+
+	return t->get_hashing_blobs_nolock(extra_nonce_start, count, blobs);
+}
+
+uint32_t BlockTemplate::get_hashing_blobs(uint32_t template_id, uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const
+{
+	blobs.clear();
+
+	const BlockTemplate* t = acquire(template_id);
+	if (!t) {
+		return 0;
+	}
+
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([t]() { release(t); });
+
+	const size_t required_capacity = static_cast<size_t>(count) * 80;
+	if (blobs.capacity() < required_capacity) {
+		blobs.reserve(required_capacity);
+	}
+
+	return t->get_hashing_blobs_nolock(extra_nonce_start, count, blobs);
+}
+
+uint32_t BlockTemplate::get_hashing_blobs_nolock(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const
+{
+	uint32_t blob_size = 0;
+
+	// Blobs are made in groups of 4 (4 miner transactions are hashed at once), the remaining ones are made one by one
+	hash root_hashes[4];
 
 	for (uint32_t i = 0; i < count; ++i) {
 		uint8_t blob[128];
-		uint32_t n = get_hashing_blob_nolock(extra_nonce_start + i, blob);
+		uint32_t n;
+
+		if (i < (count & ~3U)) {
+			if ((i & 3) == 0) {
+				calc_merkle_roots_x4(extra_nonce_start + i, root_hashes);
+			}
+			n = write_hashing_blob_nolock(root_hashes[i & 3], blob);
+		}
+		else {
+			n = get_hashing_blob_nolock(extra_nonce_start + i, blob);
+		}
 
 		if (n > sizeof(blob)) {
 			LOGERR(1, "internal error: get_hashing_blob_nolock returned too large blob size " << n << ", expected <= " << sizeof(blob));
@@ -969,22 +1316,19 @@ uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t c
 
 std::vector<uint8_t> BlockTemplate::get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id != m_templateId) {
-		const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
-		if (old && (template_id == old->m_templateId)) {
-			return old->get_block_template_blob(template_id, nonce_offset, extra_nonce_offset);
-		}
-
+	const BlockTemplate* t = acquire(template_id);
+	if (!t) {
 		nonce_offset = 0;
 		extra_nonce_offset = 0;
 		return std::vector<uint8_t>();
 	}
 
-	nonce_offset = m_nonceOffset;
-	extra_nonce_offset = m_extraNonceOffsetInTemplate;
-	return m_blockTemplateBlob;
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([t]() { release(t); });
+
+	nonce_offset = t->m_nonceOffset;
+	extra_nonce_offset = t->m_extraNonceOffsetInTemplate;
+	return t->m_blockTemplateBlob;
 }
 
 void BlockTemplate::update_tx_keys()
@@ -996,50 +1340,54 @@ void BlockTemplate::update_tx_keys()
 
 void BlockTemplate::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
 {
-	WriteLock lock(m_lock);
+	const BlockTemplate* t = acquire(template_id);
+	if (!t) {
+		return;
+	}
 
-	if (template_id == m_templateId) {
-		m_poolBlockTemplate->m_nonce = nonce;
-		m_poolBlockTemplate->m_extraNonce = extra_nonce;
-		memcpy(m_poolBlockTemplate->m_mainChainData.data() + m_nonceOffset, &nonce, NONCE_SIZE);
-		memcpy(m_poolBlockTemplate->m_mainChainData.data() + m_extraNonceOffsetInTemplate, &extra_nonce, NONCE_SIZE);
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([t]() { release(t); });
 
-		SideChain& side_chain = m_pool->side_chain();
+	// Snapshots are immutable, so the block is submitted from a copy
+	// PoolBlock's copy constructor expects no one else to copy the same block at the same time
+	MutexLock lock(m_submitLock);
 
-#if POOL_BLOCK_DEBUG
-		{
-			std::vector<uint8_t> buf = m_poolBlockTemplate->m_mainChainData;
-			buf.insert(buf.end(), m_poolBlockTemplate->m_sideChainData.begin(), m_poolBlockTemplate->m_sideChainData.end());
+	PoolBlock block(*t->m_poolBlockTemplate);
 
-			PoolBlock check;
-			const int result = check.deserialize(buf.data(), buf.size(), side_chain);
-			if (result != 0) {
-				LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
-			}
+	block.m_nonce = nonce;
+	block.m_extraNonce = extra_nonce;
+	memcpy(block.m_mainChainData.data() + t->m_nonceOffset, &nonce, NONCE_SIZE);
+	memcpy(block.m_mainChainData.data() + t->m_extraNonceOffsetInTemplate, &extra_nonce, NONCE_SIZE);
 
-			hash pow_hash;
-			if (!check.get_pow_hash(m_pool->hasher(), m_seedHash, pow_hash)) {
-				LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
-			}
-			else if (!check.m_difficulty.check_pow(pow_hash)) {
-				LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
-			}
+	// From here on the block is immutable, the sidechain, block cache and peers share its bytes
+	block.make_blob();
+
+	SideChain& side_chain = m_pool->side_chain();
+
+#if POOL_BLOCK_DEBUG
+	{
+		const std::vector<uint8_t>& buf = block.m_blob->m_data;
+
+		PoolBlock check;
+		const int result = check.deserialize(buf.data(), buf.size(), side_chain);
+		if (result != 0) {
+			LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
 		}
-#endif
 
-		m_poolBlockTemplate->m_verified = true;
-		if (!side_chain.block_seen(*m_poolBlockTemplate)) {
-			m_poolBlockTemplate->m_wantBroadcast = true;
-			side_chain.add_block(*m_poolBlockTemplate);
+		hash pow_hash;
+		if (!check.get_pow_hash(m_pool->hasher(), t->m_seedHash, pow_hash)) {
+			LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
+		}
+		else if (!check.m_difficulty.check_pow(pow_hash)) {
+			LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
 		}
-		return;
 	}
+#endif
 
-	BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
-
-	if (old && (template_id == old->m_templateId)) {
-		old->submit_sidechain_block(template_id, nonce, extra_nonce);
-		return;
+	block.m_verified = true;
+	if (!side_chain.block_seen(block)) {
+		block.m_wantBroadcast = true;
+		side_chain.add_block(block);
 	}
 }
 
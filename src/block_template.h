@@ -18,6 +18,7 @@
 #pragma once
 
 #include "uv_util.h"
+#include "keccak.h"
 
 #define TEST_MEMPOOL_PICKING_ALGORITHM 0
 
@@ -29,49 +30,94 @@ class Wallet;
 struct PoolBlock;
 struct MinerShare;
 
-class BlockTemplate
+// Block templates are immutable snapshots once they're published
+// update() builds a new snapshot off to the side and then makes it current with a quick pointer swap,
+// so readers never wait for a template build. The last few snapshots stay reachable by template_id
+class BlockTemplate : public nocopy_nomove
 {
 public:
 	explicit BlockTemplate(p2pool* pool);
 	~BlockTemplate();
 
-	BlockTemplate(const BlockTemplate& b);
-	BlockTemplate& operator=(const BlockTemplate& b);
-
 	void update(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet);
 
+	// Adds new high-fee transactions from the mempool to a copy of the current template and publishes it
+	// Sidechain data, PPLNS shares and ephemeral keys are reused, so it's much faster than update()
+	// Returns false if there was nothing worth adding or if the template can't be extended (update() is needed then)
+	bool refresh_transactions(const Mempool& mempool);
+
 	bool get_difficulties(const uint32_t template_id, difficulty_type& mainchain_difficulty, difficulty_type& sidechain_difficulty) const;
 	uint32_t get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const;
 
 	uint32_t get_hashing_blob(uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const;
 	uint32_t get_hashing_blobs(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs, uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const;
 
+	// Same as above, but for a known template (it returns 0 if this template is not available anymore)
+	uint32_t get_hashing_blobs(uint32_t template_id, uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const;
+
 	std::vector<uint8_t> get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const;
 	void update_tx_keys();
 
-	FORCEINLINE uint64_t height() const { return m_height; }
-	FORCEINLINE time_t timestamp() const { return m_timestamp; }
-	FORCEINLINE difficulty_type difficulty() const { return m_difficulty; }
+	uint64_t height() const;
+	time_t timestamp() const;
+	difficulty_type difficulty() const;
 
 	void submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
 
-	FORCEINLINE uint64_t final_reward() const { return m_finalReward; }
+	uint64_t final_reward() const;
 
 private:
 	p2pool* m_pool;
 
 private:
-	bool create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run);
+	// Snapshots are created only by the top-level BlockTemplate
+	struct SnapshotTag {};
+	BlockTemplate(p2pool* pool, SnapshotTag);
+
+	// Return the snapshot with this template_id (or the current snapshot) and keep it alive until release() is called
+	const BlockTemplate* acquire(uint32_t template_id) const;
+	const BlockTemplate* acquire_current() const;
+	static void release(const BlockTemplate* snapshot);
+
+	// Finds a snapshot which is not used by anyone and makes it unreachable, so it can be rebuilt
+	BlockTemplate* get_free_snapshot();
+
+	// Builds a new block template in this snapshot, called only when no one else can access it
+	bool build(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet);
+
+	void copy_from(const BlockTemplate& b);
+	bool add_transactions(const std::vector<TxMempoolData>& txs);
+	void assemble_template();
+
+	// Minimal increase of the block reward (1/N) that makes refresh_transactions() publish a new template
+	enum { TX_REFRESH_MIN_REWARD_INCREASE = 1000 };
+
+	bool create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run, const std::vector<hash>* eph_keys = nullptr);
 	hash calc_sidechain_hash() const;
 	hash calc_miner_tx_hash(uint32_t extra_nonce) const;
 	void calc_merkle_tree_main_branch();
 
+	// Same as calc_miner_tx_hash() + merkle root, but for 4 consecutive extra_nonce values at once
+	void calc_merkle_roots_x4(uint32_t extra_nonce_start, hash (&root_hashes)[4]) const;
+	void calc_miner_tx_prefix_hash(uint32_t extra_nonce, uint8_t* result) const;
+
 	uint32_t get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const;
+	uint32_t get_hashing_blobs_nolock(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const;
+	uint32_t write_hashing_blob_nolock(const hash& root_hash, uint8_t* blob) const;
 
+	// Protects m_current, template ids of all snapshots and the tx keys below. It's never held for long
 	mutable uv_rwlock_t m_lock;
 
 	uint32_t m_templateId;
 
+	// 1 current snapshot, 4 old snapshots which are still reachable by template_id and 1 spare for building the next template
+	BlockTemplate* m_snapshots[6] = {};
+	BlockTemplate* m_current;
+
+	mutable std::atomic<uint32_t> m_refCount;
+
+	uv_mutex_t m_submitLock;
+
 	std::vector<uint8_t> m_blockTemplateBlob;
 	std::vector<uint8_t> m_merkleTreeMainBranch;
 
@@ -81,6 +127,9 @@ private:
 	size_t m_nonceOffset;
 	size_t m_extraNonceOffsetInTemplate;
 
+	// Keccak state after absorbing the miner tx up to extra_nonce, it's the same for all extra_nonce values
+	KeccakState m_minerTxPrefixState;
+
 	size_t m_numTransactionHashes;
 	hash m_prevId;
 	uint64_t m_height;
@@ -94,25 +143,33 @@ private:
 
 	PoolBlock* m_poolBlockTemplate;
 
-	BlockTemplate* m_oldTemplates[4] = {};
-
 	uint64_t m_finalReward;
 
-	// Temp vectors, will be cleaned up after use and skipped in copy constructor/assignment operators
+	// Needed to add transactions to this template later (refresh_transactions)
+	MinerData m_minerData;
+	uint64_t m_baseReward;
+	uint64_t m_maxRewardAmountsWeight;
+	uint64_t m_finalFees;
+	uint64_t m_finalWeight;
+	std::vector<uint8_t> m_transactionHashes;
+	std::vector<uint64_t> m_rewards;
+	std::vector<MinerShare> m_shares;
+
+	// Temp vectors, will be cleaned up after use
 	std::vector<uint8_t> m_minerTx;
 	std::vector<uint8_t> m_blockHeader;
 	std::vector<uint8_t> m_minerTxExtra;
-	std::vector<uint8_t> m_transactionHashes;
-	std::vector<uint64_t> m_rewards;
 	std::vector<TxMempoolData> m_mempoolTxs;
 	std::vector<int> m_mempoolTxsOrder;
-	std::vector<MinerShare> m_shares;
 
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-	void fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight);
+	// Weight resolution of the knapsack solver, it's the main factor in its run time and memory usage
+	enum { KNAPSACK_BUCKETS = 8192 };
+
+	// Returns true if it found a solution with reward higher than min_reward within the time budget
+	bool fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t min_reward, uint32_t time_budget_ms, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight);
 
 	std::vector<uint32_t> m_knapsack;
-#endif
+	std::vector<uint64_t> m_knapsackUsed;
 };
 
 } // namespace p2pool
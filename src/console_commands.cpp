@@ -22,6 +22,9 @@
 #include "stratum_server.h"
 #include "p2p_server.h"
 #include "side_chain.h"
+#include "crypto.h"
+#include "metrics.h"
+#include "memory_leak_debug.h"
 #include <iostream>
 
 static constexpr char log_category_prefix[] = "ConsoleCommands ";
@@ -69,7 +72,7 @@ typedef struct cmd {
 	cmdfunc *func;
 } cmd;
 
-static cmdfunc do_help, do_status, do_loglevel, do_addpeers, do_droppeers, do_showpeers, do_exit;
+static cmdfunc do_help, do_status, do_loglevel, do_addpeers, do_droppeers, do_showpeers, do_showworkers, do_perf, do_queues, do_alloc, do_exit;
 
 static cmd cmds[] = {
 	{ STRCONST("help"), "", "display list of commands", do_help },
@@ -78,6 +81,10 @@ static cmd cmds[] = {
 	{ STRCONST("addpeers"), "<peeraddr>", "add peer", do_addpeers },
 	{ STRCONST("droppeers"), "", "disconnect all peers", do_droppeers },
 	{ STRCONST("peers"), "", "show all peers", do_showpeers },
+	{ STRCONST("workers"), "", "show hashrate of all stratum workers", do_showworkers },
+	{ STRCONST("perf"), "<start|stop|report [N]>", "profile instrumented hot paths, report shows top N (default 10) by total time", do_perf },
+	{ STRCONST("queues"), "", "show threadpool backlog, background jobs and queue lengths", do_queues },
+	{ STRCONST("alloc"), "", "show sampled allocation rates and live memory by subsystem (needs --alloc-telemetry)", do_alloc },
 	{ STRCONST("exit"), "", "terminate p2pool", do_exit },
 	{ STRCNULL, NULL, NULL, NULL }
 };
@@ -95,6 +102,7 @@ static int do_help(p2pool * /* m_pool */, const char * /* args */)
 static int do_status(p2pool *m_pool, const char * /* args */)
 {
 	m_pool->side_chain().print_status();
+	m_pool->print_hosts();
 	if (m_pool->stratum_server()) {
 		m_pool->stratum_server()->print_status();
 	}
@@ -102,6 +110,15 @@ static int do_status(p2pool *m_pool, const char * /* args */)
 		m_pool->p2p_server()->print_status();
 	}
 	bkg_jobs_tracker.print_status();
+
+	CryptoCacheStats stats;
+	get_crypto_cache_stats(stats);
+	LOGINFO(0, "crypto cache: " <<
+		stats.derivations << " derivations (" << stats.derivation_hits << " hits, " << stats.derivation_misses << " misses, " << stats.derivation_evictions << " evictions), " <<
+		stats.public_keys << " public keys (" << stats.public_key_hits << " hits, " << stats.public_key_misses << " misses, " << stats.public_key_evictions << " evictions), " <<
+		stats.derivation_tables << " derivation tables");
+
+	metrics::print_status();
 	return 0;
 }
 
@@ -138,6 +155,54 @@ static int do_showpeers(p2pool* m_pool, const char* /* args */)
 	return 0;
 }
 
+static int do_showworkers(p2pool* m_pool, const char* /* args */)
+{
+	if (m_pool->stratum_server()) {
+		m_pool->stratum_server()->print_workers();
+	}
+	return 0;
+}
+
+static int do_perf(p2pool * /* m_pool */, const char *args)
+{
+	if (!strncmp(args, "start", 5)) {
+		metrics::perf_start();
+		LOGINFO(0, "perf: started");
+	}
+	else if (!strncmp(args, "stop", 4)) {
+		metrics::perf_stop();
+		metrics::perf_report(10);
+	}
+	else if (!strncmp(args, "report", 6)) {
+		const int n = atoi(args + 6);
+		metrics::perf_report((n > 0) ? static_cast<uint32_t>(n) : 10);
+	}
+	else {
+		LOGINFO(0, "usage: perf <start|stop|report [N]>");
+	}
+	return 0;
+}
+
+static int do_queues(p2pool *m_pool, const char * /* args */)
+{
+	bkg_jobs_tracker.print_queues();
+	bkg_jobs_tracker.print_status();
+
+	if (m_pool->stratum_server()) {
+		m_pool->stratum_server()->print_queues();
+	}
+	if (m_pool->p2p_server()) {
+		m_pool->p2p_server()->print_queues();
+	}
+	return 0;
+}
+
+static int do_alloc(p2pool * /* m_pool */, const char * /* args */)
+{
+	alloc_telemetry::print_status();
+	return 0;
+}
+
 static int do_exit(p2pool *m_pool, const char * /* args */)
 {
 	bkg_jobs_tracker.wait();
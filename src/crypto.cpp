@@ -19,6 +19,7 @@
 #include "crypto.h"
 #include "keccak.h"
 #include "uv_util.h"
+#include "memory_leak_debug.h"
 #include <random>
 
 extern "C" {
@@ -135,32 +136,360 @@ static FORCEINLINE void derivation_to_scalar(const hash& derivation, size_t outp
 	hash_to_scalar(begin, end - begin, res);
 }
 
-class Cache
+// Precomputed multiples of a view public key A: m_points[i][j] = (j + 1) * 256^i * A
+// With it, a derivation is a fixed base scalar multiplication (64 additions and 4 doublings, like ge_scalarmult_base)
+// instead of a variable base one (64 additions and 256 doublings), and point decompression is skipped too
+// It runs in variable time, but tx private keys are not secret: they're published in side chain blocks
+class DerivationTable
 {
 public:
-	Cache()
+	bool init(const hash& key)
 	{
-		uv_mutex_init_checked(&m);
+		ge_p3 p;
+		if (ge_frombytes_vartime(&p, key.h) != 0) {
+			return false;
+		}
+
+		ge_p1p1 t;
+		ge_p2 s;
+		ge_p3 u;
+
+		for (int i = 0; i < 32; ++i) {
+			ge_p3_to_cached(&m_points[i][0], &p);
+			for (int j = 1; j < 8; ++j) {
+				ge_add(&t, &p, &m_points[i][j - 1]);
+				ge_p1p1_to_p3(&u, &t);
+				ge_p3_to_cached(&m_points[i][j], &u);
+			}
+
+			// p = 256 * p
+			ge_p3_to_p2(&s, &p);
+			for (int k = 0; k < 7; ++k) {
+				ge_p2_dbl(&t, &s);
+				ge_p1p1_to_p2(&s, &t);
+			}
+			ge_p2_dbl(&t, &s);
+			ge_p1p1_to_p3(&p, &t);
+		}
+
+		return true;
 	}
 
-	~Cache()
+	// Same result as ge_scalarmult() + ge_mul8(), the same precondition applies: sec.h[31] <= 127
+	void derive(const hash& sec, hash& derivation) const
 	{
-		uv_mutex_destroy(&m);
+		const uint8_t* a = sec.h;
+
+		// Signed radix 16 digits, the same as in ge_scalarmult()
+		int8_t e[64];
+		int carry = 0;
+		for (int i = 0; i < 31; ++i) {
+			carry += a[i];
+			const int carry2 = (carry + 8) >> 4;
+			e[2 * i] = static_cast<int8_t>(carry - (carry2 << 4));
+			carry = (carry2 + 8) >> 4;
+			e[2 * i + 1] = static_cast<int8_t>(carry2 - (carry << 4));
+		}
+		carry += a[31];
+		const int carry2 = (carry + 8) >> 4;
+		e[62] = static_cast<int8_t>(carry - (carry2 << 4));
+		e[63] = static_cast<int8_t>(carry2);
+
+		ge_p3 h = ge_p3_identity;
+		ge_p1p1 t;
+		ge_p2 s;
+
+		for (int i = 1; i < 64; i += 2) {
+			add(h, i / 2, e[i]);
+		}
+
+		ge_p3_to_p2(&s, &h);
+		ge_p2_dbl(&t, &s); ge_p1p1_to_p2(&s, &t);
+		ge_p2_dbl(&t, &s); ge_p1p1_to_p2(&s, &t);
+		ge_p2_dbl(&t, &s); ge_p1p1_to_p2(&s, &t);
+		ge_p2_dbl(&t, &s); ge_p1p1_to_p3(&h, &t);
+
+		for (int i = 0; i < 64; i += 2) {
+			add(h, i / 2, e[i]);
+		}
+
+		ge_p3_to_p2(&s, &h);
+		ge_mul8(&t, &s);
+		ge_p1p1_to_p2(&s, &t);
+		ge_tobytes(derivation.h, &s);
 	}
 
+private:
+	FORCEINLINE void add(ge_p3& h, int i, int b) const
+	{
+		ge_p1p1 t;
+		if (b > 0) {
+			ge_add(&t, &h, &m_points[i][b - 1]);
+			ge_p1p1_to_p3(&h, &t);
+		}
+		else if (b < 0) {
+			ge_sub(&t, &h, &m_points[i][-b - 1]);
+			ge_p1p1_to_p3(&h, &t);
+		}
+	}
+
+	ge_cached m_points[32][8];
+};
+
+// Derivation tables for view public keys of miners in the PPLNS window, around 40 KB per miner
+class DerivationTables : public nocopy_nomove
+{
+public:
+	DerivationTables()
+	{
+		uv_rwlock_init_checked(&m_lock);
+	}
+
+	~DerivationTables()
+	{
+		for (auto& it : m_tables) {
+			delete it.second;
+		}
+		uv_rwlock_destroy(&m_lock);
+	}
+
+	bool derive(const hash& key1, const hash& key2, hash& derivation)
+	{
+		if (key2.h[HASH_SIZE - 1] > 127) {
+			return false;
+		}
+
+		ReadLock lock(m_lock);
+
+		auto it = m_tables.find(key1);
+		if (it == m_tables.end()) {
+			return false;
+		}
+
+		it->second->derive(key2, derivation);
+		return true;
+	}
+
+	void update(const std::vector<hash>& keys)
+	{
+		unordered_set<hash> new_keys;
+		{
+			ReadLock lock(m_lock);
+			for (const hash& key : keys) {
+				if (m_tables.find(key) == m_tables.end()) {
+					new_keys.insert(key);
+				}
+			}
+		}
+
+		// New tables are built without holding the lock
+		std::vector<std::pair<hash, DerivationTable*>> new_tables;
+		new_tables.reserve(new_keys.size());
+
+		for (const hash& key : new_keys) {
+			DerivationTable* table = new DerivationTable();
+			if (table->init(key)) {
+				new_tables.emplace_back(key, table);
+			}
+			else {
+				delete table;
+			}
+		}
+
+		const unordered_set<hash> keep(keys.begin(), keys.end());
+
+		WriteLock lock(m_lock);
+
+		for (auto it = m_tables.begin(); it != m_tables.end();) {
+			if (keep.find(it->first) == keep.end()) {
+				delete it->second;
+				it = m_tables.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+
+		for (const auto& it : new_tables) {
+			if (!m_tables.emplace(it.first, it.second).second) {
+				delete it.second;
+			}
+		}
+	}
+
+	size_t size()
+	{
+		ReadLock lock(m_lock);
+		return m_tables.size();
+	}
+
+private:
+	uv_rwlock_t m_lock;
+	unordered_map<hash, DerivationTable*> m_tables;
+};
+
+// Fixed size cache split into shards with their own locks, so threads deriving keys for different wallets don't wait for each other
+// A full shard evicts entries using the CLOCK algorithm: entries that were used since the last pass get a second chance
+template<size_t KEY_SIZE>
+class ShardedCache : public nocopy_nomove
+{
+public:
+	typedef std::array<uint8_t, KEY_SIZE> Key;
+
+	explicit ShardedCache(size_t capacity)
+		: m_shardCapacity(std::max<size_t>(capacity / NUM_SHARDS, 1))
+	{
+		for (Shard& shard : m_shards) {
+			uv_mutex_init_checked(&shard.lock);
+			shard.hand = 0;
+			shard.hits = 0;
+			shard.misses = 0;
+			shard.evictions = 0;
+		}
+	}
+
+	~ShardedCache()
+	{
+		for (Shard& shard : m_shards) {
+			uv_mutex_destroy(&shard.lock);
+		}
+	}
+
+	bool get(const Key& key, hash& value)
+	{
+		Shard& shard = get_shard(key);
+		MutexLock lock(shard.lock);
+
+		auto it = shard.index.find(key);
+		if (it == shard.index.end()) {
+			++shard.misses;
+			return false;
+		}
+
+		Entry& entry = shard.entries[it->second];
+		entry.referenced = true;
+		value = entry.value;
+		++shard.hits;
+		return true;
+	}
+
+	void put(const Key& key, const hash& value)
+	{
+		alloc_telemetry::Scope alloc_scope(alloc_telemetry::CRYPTO_CACHE);
+		Shard& shard = get_shard(key);
+		MutexLock lock(shard.lock);
+
+		// Other thread could've calculated the same value in the meantime
+		if (shard.index.find(key) != shard.index.end()) {
+			return;
+		}
+
+		if (shard.entries.size() < m_shardCapacity) {
+			shard.index.emplace(key, static_cast<uint32_t>(shard.entries.size()));
+			shard.entries.push_back({ key, value, false });
+			return;
+		}
+
+		for (;;) {
+			const uint32_t i = shard.hand;
+			shard.hand = static_cast<uint32_t>((i + 1) % m_shardCapacity);
+
+			Entry& entry = shard.entries[i];
+			if (entry.referenced) {
+				entry.referenced = false;
+				continue;
+			}
+
+			shard.index.erase(entry.key);
+			entry = { key, value, false };
+			shard.index.emplace(key, i);
+			++shard.evictions;
+			return;
+		}
+	}
+
+	void clear()
+	{
+		for (Shard& shard : m_shards) {
+			MutexLock lock(shard.lock);
+			shard.entries.clear();
+			shard.index.clear();
+			shard.hand = 0;
+		}
+	}
+
+	void get_stats(uint64_t& hits, uint64_t& misses, uint64_t& evictions, size_t& size)
+	{
+		hits = 0;
+		misses = 0;
+		evictions = 0;
+		size = 0;
+
+		for (Shard& shard : m_shards) {
+			MutexLock lock(shard.lock);
+			hits += shard.hits;
+			misses += shard.misses;
+			evictions += shard.evictions;
+			size += shard.entries.size();
+		}
+	}
+
+private:
+	enum { NUM_SHARDS = 64 };
+
+	struct Entry
+	{
+		Key key;
+		hash value;
+		bool referenced;
+	};
+
+	struct Shard
+	{
+		uv_mutex_t lock;
+		std::vector<Entry> entries;
+		unordered_map<Key, uint32_t> index;
+		uint32_t hand;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+	};
+
+	// Keys start with two curve points, mix both so the same wallet doesn't always end up in the same shard
+	FORCEINLINE Shard& get_shard(const Key& key)
+	{
+		uint64_t a, b;
+		memcpy(&a, key.data(), sizeof(a));
+		memcpy(&b, key.data() + HASH_SIZE, sizeof(b));
+		return m_shards[(a ^ b) % NUM_SHARDS];
+	}
+
+	const size_t m_shardCapacity;
+	Shard m_shards[NUM_SHARDS];
+};
+
+class Cache
+{
+public:
+	// Every PPLNS window block has its own tx key, so these caches would grow indefinitely without a limit
+	// Maximum memory usage is around 2 * CACHE_SIZE * 128 bytes
+	enum { CACHE_SIZE = 1 << 17 };
+
+	Cache() : derivations(CACHE_SIZE), public_keys(CACHE_SIZE) {}
+
 	bool get_derivation(const hash& key1, const hash& key2, hash& derivation)
 	{
 		std::array<uint8_t, HASH_SIZE * 2> index;
 		memcpy(index.data(), key1.h, HASH_SIZE);
 		memcpy(index.data() + HASH_SIZE, key2.h, HASH_SIZE);
 
-		{
-			MutexLock lock(m);
-			auto it = derivations.find(index);
-			if (it != derivations.end()) {
-				derivation = it->second;
-				return true;
-			}
+		if (derivations.get(index, derivation)) {
+			return true;
+		}
+
+		if (tables.derive(key1, key2, derivation)) {
+			derivations.put(index, derivation);
+			return true;
 		}
 
 		ge_p3 point;
@@ -176,10 +505,7 @@ public:
 		ge_p1p1_to_p2(&point2, &point3);
 		ge_tobytes(reinterpret_cast<uint8_t*>(&derivation), &point2);
 
-		{
-			MutexLock lock(m);
-			derivations.emplace(index, derivation);
-		}
+		derivations.put(index, derivation);
 
 		return true;
 	}
@@ -191,13 +517,8 @@ public:
 		memcpy(index.data() + HASH_SIZE, base.h, HASH_SIZE);
 		memcpy(index.data() + HASH_SIZE * 2, &output_index, sizeof(size_t));
 
-		{
-			MutexLock lock(m);
-			auto it = public_keys.find(index);
-			if (it != public_keys.end()) {
-				derived_key = it->second;
-				return true;
-			}
+		if (public_keys.get(index, derived_key)) {
+			return true;
 		}
 
 		uint8_t scalar[HASH_SIZE];
@@ -218,26 +539,33 @@ public:
 		ge_p1p1_to_p2(&point5, &point4);
 		ge_tobytes(derived_key.h, &point5);
 
-		{
-			MutexLock lock(m);
-			public_keys.emplace(index, derived_key);
-		}
+		public_keys.put(index, derived_key);
 
 		return true;
 	}
 
 	void clear()
 	{
-		MutexLock lock(m);
-
 		derivations.clear();
 		public_keys.clear();
 	}
 
+	void get_stats(CryptoCacheStats& stats)
+	{
+		derivations.get_stats(stats.derivation_hits, stats.derivation_misses, stats.derivation_evictions, stats.derivations);
+		public_keys.get_stats(stats.public_key_hits, stats.public_key_misses, stats.public_key_evictions, stats.public_keys);
+		stats.derivation_tables = tables.size();
+	}
+
+	void update_derivation_tables(const std::vector<hash>& view_public_keys)
+	{
+		tables.update(view_public_keys);
+	}
+
 private:
-	uv_mutex_t m;
-	unordered_map<std::array<uint8_t, HASH_SIZE * 2>, hash> derivations;
-	unordered_map<std::array<uint8_t, HASH_SIZE * 2 + sizeof(size_t)>, hash> public_keys;
+	DerivationTables tables;
+	ShardedCache<HASH_SIZE * 2> derivations;
+	ShardedCache<HASH_SIZE * 2 + sizeof(size_t)> public_keys;
 };
 
 static Cache* cache = nullptr;
@@ -272,4 +600,19 @@ void clear_crypto_cache()
 	cache->clear();
 }
 
+void update_derivation_tables(const std::vector<hash>& view_public_keys)
+{
+	cache->update_derivation_tables(view_public_keys);
+}
+
+void get_crypto_cache_stats(CryptoCacheStats& stats)
+{
+	if (cache) {
+		cache->get_stats(stats);
+	}
+	else {
+		stats = {};
+	}
+}
+
 } // namespace p2pool
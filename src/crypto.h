@@ -28,4 +28,25 @@ void init_crypto_cache();
 void destroy_crypto_cache();
 void clear_crypto_cache();
 
+// Keeps precomputed tables for these view public keys (miners in the PPLNS window) and drops all other tables
+// Derivations for wallets with a table are several times faster
+void update_derivation_tables(const std::vector<hash>& view_public_keys);
+
+struct CryptoCacheStats
+{
+	uint64_t derivation_hits;
+	uint64_t derivation_misses;
+	uint64_t derivation_evictions;
+	size_t derivations;
+
+	uint64_t public_key_hits;
+	uint64_t public_key_misses;
+	uint64_t public_key_evictions;
+	size_t public_keys;
+
+	size_t derivation_tables;
+};
+
+void get_crypto_cache_stats(CryptoCacheStats& stats);
+
 } // namespace p2pool
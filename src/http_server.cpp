@@ -0,0 +1,345 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "http_server.h"
+#include "keccak.h"
+
+static constexpr char log_category_prefix[] = "HTTPServer ";
+
+static constexpr int DEFAULT_BACKLOG = 16;
+
+#include "tcp_server.inl"
+
+namespace p2pool {
+
+namespace {
+
+llhttp_settings_t http_settings;
+
+bool init_http_settings()
+{
+	llhttp_settings_init(&http_settings);
+
+	http_settings.on_message_begin = [](llhttp_t* parser)
+	{
+		HTTPServer::HTTPClient* client = static_cast<HTTPServer::HTTPClient*>(parser->data);
+		client->m_url.clear();
+		client->m_headerField.clear();
+		client->m_ifNoneMatch.clear();
+		client->m_isIfNoneMatch = false;
+		client->m_headersSize = 0;
+		return 0;
+	};
+
+	http_settings.on_url = [](llhttp_t* parser, const char* at, size_t length)
+	{
+		HTTPServer::HTTPClient* client = static_cast<HTTPServer::HTTPClient*>(parser->data);
+		if (client->m_url.length() + length > HTTP_MAX_URL_SIZE) {
+			return -1;
+		}
+		client->m_url.append(at, length);
+		return 0;
+	};
+
+	http_settings.on_header_field = [](llhttp_t* parser, const char* at, size_t length)
+	{
+		HTTPServer::HTTPClient* client = static_cast<HTTPServer::HTTPClient*>(parser->data);
+		client->m_headersSize += length;
+		if (client->m_headersSize > HTTP_MAX_HEADERS_SIZE) {
+			return -1;
+		}
+		client->m_headerField.append(at, length);
+		return 0;
+	};
+
+	http_settings.on_header_field_complete = [](llhttp_t* parser)
+	{
+		HTTPServer::HTTPClient* client = static_cast<HTTPServer::HTTPClient*>(parser->data);
+
+		static constexpr char name[] = "if-none-match";
+		const std::string& field = client->m_headerField;
+
+		client->m_isIfNoneMatch = (field.length() == sizeof(name) - 1) &&
+			std::equal(field.begin(), field.end(), name, [](char a, char b) { return tolower(static_cast<unsigned char>(a)) == b; });
+
+		client->m_headerField.clear();
+		return 0;
+	};
+
+	http_settings.on_header_value = [](llhttp_t* parser, const char* at, size_t length)
+	{
+		HTTPServer::HTTPClient* client = static_cast<HTTPServer::HTTPClient*>(parser->data);
+		client->m_headersSize += length;
+		if (client->m_headersSize > HTTP_MAX_HEADERS_SIZE) {
+			return -1;
+		}
+		if (client->m_isIfNoneMatch) {
+			client->m_ifNoneMatch.append(at, length);
+		}
+		return 0;
+	};
+
+	http_settings.on_header_value_complete = [](llhttp_t* parser)
+	{
+		static_cast<HTTPServer::HTTPClient*>(parser->data)->m_isIfNoneMatch = false;
+		return 0;
+	};
+
+	http_settings.on_message_complete = [](llhttp_t* parser)
+	{
+		return static_cast<HTTPServer::HTTPClient*>(parser->data)->send_response() ? 0 : -1;
+	};
+
+	return true;
+}
+
+} // namespace
+
+HTTPServer::HTTPServer(const std::string& listen_addresses, uint64_t idle_timeout)
+	: TCPServer(HTTPClient::allocate)
+	, m_idleTimeout(idle_timeout)
+	, m_timer{}
+{
+	static const bool http_settings_initialized = init_http_settings();
+	(void)http_settings_initialized;
+
+	uv_mutex_init_checked(&m_documentsLock);
+
+	int err = uv_timer_init(&m_loop, &m_timer);
+	if (err) {
+		LOGERR(1, "failed to create timer, error " << uv_err_name(err));
+		panic();
+	}
+
+	m_timer.data = this;
+	err = uv_timer_start(&m_timer, on_timer, 1000, 1000);
+	if (err) {
+		LOGERR(1, "failed to start timer, error " << uv_err_name(err));
+		panic();
+	}
+
+	start_listening(listen_addresses);
+}
+
+HTTPServer::~HTTPServer()
+{
+	uv_timer_stop(&m_timer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+
+	shutdown_tcp();
+
+	for (auto& it : m_documents) {
+		it.second.m_data->release();
+	}
+
+	uv_mutex_destroy(&m_documentsLock);
+}
+
+void HTTPServer::update(const std::string& path, const char* data, size_t size)
+{
+	uint8_t h[HASH_SIZE];
+	keccak(reinterpret_cast<const uint8_t*>(data), static_cast<int>(size), h, HASH_SIZE);
+
+	char buf[32];
+	log::Stream s(buf);
+	s << '"' << log::hex_buf(h, 8) << '"';
+
+	std::string etag(buf, s.m_pos);
+	SharedBuf* old_data = nullptr;
+
+	{
+		MutexLock lock(m_documentsLock);
+
+		Document& doc = m_documents[path];
+		if (doc.m_data && (doc.m_etag == etag)) {
+			return;
+		}
+
+		old_data = doc.m_data;
+		doc.m_data = new SharedBuf(std::vector<uint8_t>(data, data + size));
+		doc.m_etag = std::move(etag);
+	}
+
+	// Clients which are still sending the old version hold their own references to it
+	if (old_data) {
+		old_data->release();
+	}
+}
+
+SharedBuf* HTTPServer::get(const std::string& path, std::string& etag)
+{
+	MutexLock lock(m_documentsLock);
+
+	auto it = m_documents.find(path);
+	if (it == m_documents.end()) {
+		return nullptr;
+	}
+
+	etag = it->second.m_etag;
+	it->second.m_data->add_ref();
+	return it->second.m_data;
+}
+
+void HTTPServer::close_idle_connections()
+{
+	const time_t cur_time = time(nullptr);
+
+	MutexLock lock(m_clientsListLock);
+
+	for (HTTPClient* client = static_cast<HTTPClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<HTTPClient*>(client->m_next)) {
+		if (static_cast<uint64_t>(cur_time - client->m_lastActive) >= m_idleTimeout) {
+			LOGINFO(5, "client " << static_cast<const char*>(client->m_addrString) << " has been idle for " << (cur_time - client->m_lastActive) << " seconds, disconnecting");
+			client->close();
+		}
+	}
+}
+
+HTTPServer::HTTPClient::HTTPClient()
+	: m_parser{}
+	, m_isIfNoneMatch(false)
+	, m_headersSize(0)
+	, m_lastActive(0)
+{
+	llhttp_init(&m_parser, HTTP_REQUEST, &http_settings);
+	m_parser.data = this;
+}
+
+void HTTPServer::HTTPClient::reset()
+{
+	Client::reset();
+
+	llhttp_init(&m_parser, HTTP_REQUEST, &http_settings);
+	m_parser.data = this;
+
+	m_url.clear();
+	m_headerField.clear();
+	m_ifNoneMatch.clear();
+	m_isIfNoneMatch = false;
+	m_headersSize = 0;
+	m_lastActive = 0;
+}
+
+bool HTTPServer::HTTPClient::on_connect()
+{
+	m_lastActive = time(nullptr);
+	return true;
+}
+
+bool HTTPServer::HTTPClient::on_read(char* data, uint32_t size)
+{
+	// The parser keeps its own state between reads, so the read buffer is always reused from the start
+	m_numRead = 0;
+
+	const llhttp_errno result = llhttp_execute(&m_parser, data, size);
+	if (result != HPE_OK) {
+		LOGWARN(5, "client " << static_cast<const char*>(m_addrString) << " sent an invalid HTTP request, error " << llhttp_errno_name(result));
+		return false;
+	}
+
+	return true;
+}
+
+bool HTTPServer::HTTPClient::send_response()
+{
+	HTTPServer* server = static_cast<HTTPServer*>(m_owner);
+	m_lastActive = time(nullptr);
+
+	const uint8_t method = m_parser.method;
+	const bool keep_alive = (llhttp_should_keep_alive(&m_parser) != 0);
+
+	int status = 200;
+	const char* status_text = "OK";
+	SharedBuf* payload = nullptr;
+	std::string etag;
+
+	if ((method != HTTP_GET) && (method != HTTP_HEAD)) {
+		status = 405;
+		status_text = "Method Not Allowed";
+	}
+	else {
+		const size_t k = m_url.find('?');
+		payload = server->get((k != std::string::npos) ? m_url.substr(0, k) : m_url, etag);
+
+		if (!payload) {
+			status = 404;
+			status_text = "Not Found";
+		}
+		else if ((m_ifNoneMatch == "*") || (m_ifNoneMatch.find(etag) != std::string::npos)) {
+			status = 304;
+			status_text = "Not Modified";
+		}
+	}
+
+	const size_t content_length = (status == 200) ? payload->m_data.size() : 0;
+
+	bool result = server->send(this,
+		[status, status_text, content_length, keep_alive, &etag](void* buf)
+		{
+			log::Stream s(reinterpret_cast<char*>(buf), HTTP_BUF_SIZE);
+			s << "HTTP/1.1 " << status << ' ' << status_text << "\r\n";
+
+			if (status == 405) {
+				s << "Allow: GET, HEAD\r\n";
+			}
+
+			if (!etag.empty()) {
+				s << "Content-Type: application/json\r\n"
+					"Cache-Control: no-cache\r\n"
+					"Access-Control-Allow-Origin: *\r\n"
+					"ETag: " << etag.c_str() << "\r\n";
+			}
+
+			if (status != 304) {
+				s << "Content-Length: " << content_length << "\r\n";
+			}
+
+			s << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+			return s.m_pos;
+		});
+
+	if (result && (content_length > 0) && (method == HTTP_GET)) {
+		result = server->send_shared(this, nullptr, 0, payload);
+	}
+
+	if (payload) {
+		payload->release();
+	}
+
+	if (!result) {
+		return false;
+	}
+
+	// Close the connection only after the response is sent
+	if (!keep_alive) {
+		uv_shutdown_t* req = new uv_shutdown_t;
+		const int err = uv_shutdown(req, reinterpret_cast<uv_stream_t*>(&m_socket),
+			[](uv_shutdown_t* req, int)
+			{
+				static_cast<HTTPClient*>(req->handle->data)->close();
+				delete req;
+			});
+		if (err) {
+			delete req;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+} // namespace p2pool
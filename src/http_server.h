@@ -0,0 +1,86 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcp_server.h"
+#include "llhttp.h"
+
+namespace p2pool {
+
+static constexpr size_t HTTP_BUF_SIZE = 4096;
+
+// Requests with longer URLs or headers are rejected, there's nothing that big to ask for
+static constexpr size_t HTTP_MAX_URL_SIZE = 256;
+static constexpr size_t HTTP_MAX_HEADERS_SIZE = 8192;
+
+// Connections which haven't sent a complete request for this many seconds are closed
+static constexpr uint64_t HTTP_IDLE_TIMEOUT = 30;
+
+// Serves the latest version of each API document from memory, documents are shared between all clients without copying
+class HTTPServer : public TCPServer<HTTP_BUF_SIZE, HTTP_BUF_SIZE>
+{
+public:
+	explicit HTTPServer(const std::string& listen_addresses, uint64_t idle_timeout = HTTP_IDLE_TIMEOUT);
+	~HTTPServer();
+
+	void update(const std::string& path, const char* data, size_t size);
+
+	struct HTTPClient : public Client
+	{
+		HTTPClient();
+
+		static Client* allocate() { return new HTTPClient(); }
+
+		void reset() override;
+		bool on_connect() override;
+		bool on_read(char* data, uint32_t size) override;
+
+		bool send_response();
+
+		llhttp_t m_parser;
+		std::string m_url;
+		std::string m_headerField;
+		std::string m_ifNoneMatch;
+		bool m_isIfNoneMatch;
+		size_t m_headersSize;
+
+		// Time of the connection or the last complete request
+		time_t m_lastActive;
+	};
+
+private:
+	// Returns the document with an added reference, the caller must release it
+	SharedBuf* get(const std::string& path, std::string& etag);
+
+	static void on_timer(uv_timer_t* timer) { reinterpret_cast<HTTPServer*>(timer->data)->close_idle_connections(); }
+	void close_idle_connections();
+
+	struct Document
+	{
+		SharedBuf* m_data;
+		std::string m_etag;
+	};
+
+	uv_mutex_t m_documentsLock;
+	unordered_map<std::string, Document> m_documents;
+
+	const uint64_t m_idleTimeout;
+	uv_timer_t m_timer;
+};
+
+} // namespace p2pool
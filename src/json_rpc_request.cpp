@@ -20,30 +20,106 @@
 #include "json_rpc_request.h"
 #include "llhttp.h"
 #include <string>
+#include <deque>
 
 static constexpr char log_category_prefix[] = "JSONRPCRequest ";
 
 namespace p2pool {
 
+class JSONRPCConnection : public nocopy_nomove
+{
+public:
+	static void send(JSONRPCRequest* r);
+	static void close_all();
+
+private:
+	JSONRPCConnection(const std::string& key, const sockaddr_storage& addr);
+	~JSONRPCConnection() {}
+
+	FORCEINLINE size_t num_requests() const { return m_pending.size() + m_inflight.size(); }
+
+	void connect();
+	void enqueue(JSONRPCRequest* r);
+	void write(JSONRPCRequest* r);
+	void close(const char* error);
+
+	// Restarts the timeout when a request is sent or a response comes, stops it when there are no requests left
+	void update_timer();
+
+	static void on_connect(uv_connect_t* req, int status);
+	static void on_write(uv_write_t* req, int status);
+	static void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+	static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+	static void on_close(uv_handle_t* handle);
+	static void on_timer(uv_timer_t* timer);
+	static void on_timer_close(uv_handle_t* handle);
+
+	static int on_headers_complete(llhttp_t* parser);
+	static int on_body(llhttp_t* parser, const char* at, size_t length);
+	static int on_message_complete(llhttp_t* parser);
+
+	std::string m_key;
+	sockaddr_storage m_addr;
+
+	uv_tcp_t m_socket;
+	uv_connect_t m_connect;
+	bool m_connected;
+	bool m_closing;
+	bool m_keepAlive;
+
+	uv_timer_t m_timer;
+	bool m_timedOut;
+
+	// The connection is deleted when both the socket and the timer are closed
+	uint32_t m_openHandles;
+
+	// Requests waiting for the connection to be established, and requests which were sent and are waiting for responses (in order)
+	std::deque<JSONRPCRequest*> m_pending;
+	std::deque<JSONRPCRequest*> m_inflight;
+	uint32_t m_numResponses;
+
+	// Responses are parsed by the same parser one after another as they come
+	llhttp_t m_parser;
+	bool m_statusOk;
+	std::string m_body;
+
+	std::string m_error;
+
+	char m_readBuf[65536];
+	bool m_readBufInUse;
+};
+
+namespace {
+
+llhttp_settings_t http_settings;
+
+// Connections which can take new requests, by "address:port"
+unordered_map<std::string, std::vector<JSONRPCConnection*>> connections;
+bool closing_all = false;
+uint64_t request_timeout_ms = REQUEST_TIMEOUT_MS;
+
+// Servers which closed the connection after a response, every request to them gets its own connection
+unordered_set<std::string> no_keep_alive;
+
+// Requests made from other threads
+uv_mutex_t submit_lock;
+uv_async_t submit_async;
+std::vector<JSONRPCRequest*> submit_queue;
+std::atomic<bool> pool_initialized{ false };
+
+} // namespace
+
 JSONRPCRequest::JSONRPCRequest(const char* address, int port, const char* req, CallbackBase* cb, CallbackBase* close_cb)
-	: m_socket{}
-	, m_connect{}
+	: m_addr{}
 	, m_write{}
 	, m_callback(cb)
 	, m_closeCallback(close_cb)
-	, m_contentLength(0)
-	, m_contentLengthHeader(false)
-	, m_readBufInUse(false)
 	, m_valid(true)
+	, m_urgent(false)
+	, m_retried(false)
 {
-	m_readBuf[0] = '\0';
-
-	uv_tcp_init(uv_default_loop_checked(), &m_socket);
-	uv_tcp_nodelay(&m_socket, 1);
-
-	sockaddr_storage addr;
-	if (uv_ip4_addr(address, port, reinterpret_cast<sockaddr_in*>(&addr)) != 0) {
-		const int err = uv_ip6_addr(address, port, reinterpret_cast<sockaddr_in6*>(&addr));
+	if (uv_ip4_addr(address, port, reinterpret_cast<sockaddr_in*>(&m_addr)) != 0) {
+		const int err = uv_ip6_addr(address, port, reinterpret_cast<sockaddr_in6*>(&m_addr));
 		if (err) {
 			LOGERR(1, "invalid IP address " << address << " or port " << port);
 			m_valid = false;
@@ -51,9 +127,12 @@ JSONRPCRequest::JSONRPCRequest(const char* address, int port, const char* req, C
 		}
 	}
 
-	m_socket.data = this;
-	m_connect.data = this;
-	m_write.data = this;
+	char buf[log::Stream::BUF_SIZE + 1];
+	{
+		log::Stream s(buf);
+		s << address << ':' << port;
+		m_key.assign(buf, s.m_pos);
+	}
 
 	const size_t len = strlen(req);
 
@@ -65,51 +144,321 @@ JSONRPCRequest::JSONRPCRequest(const char* address, int port, const char* req, C
 
 	m_request.resize(s.m_pos);
 	m_request.insert(m_request.end(), req, req + len);
+}
 
-	m_response.reserve(sizeof(m_readBuf));
+JSONRPCRequest::~JSONRPCRequest()
+{
+	delete m_callback;
+	delete m_closeCallback;
+}
 
-	const int err = uv_tcp_connect(&m_connect, &m_socket, reinterpret_cast<const sockaddr*>(&addr), on_connect);
+void JSONRPCRequest::init_pool(uint64_t timeout_ms)
+{
+	if (pool_initialized) {
+		return;
+	}
+
+	closing_all = false;
+	no_keep_alive.clear();
+	request_timeout_ms = timeout_ms;
+
+	uv_mutex_init_checked(&submit_lock);
+
+	const int err = uv_async_init(uv_default_loop_checked(), &submit_async, on_submit_async);
 	if (err) {
-		LOGERR(1, "failed to initiate tcp connection to " << address << ", error " << uv_err_name(err));
-		m_valid = false;
+		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
+		panic();
 	}
+
+	pool_initialized = true;
 }
 
-void JSONRPCRequest::on_connect(uv_connect_t* req, int status)
+void JSONRPCRequest::close_pool()
 {
-	JSONRPCRequest* pThis = static_cast<JSONRPCRequest*>(req->data);
+	if (!pool_initialized) {
+		return;
+	}
 
-	if (status != 0) {
-		pThis->m_error = uv_err_name(status);
-		LOGERR(1, "failed to connect, error " << pThis->m_error);
-		pThis->close();
+	std::vector<JSONRPCRequest*> queue;
+	{
+		MutexLock lock(submit_lock);
+		pool_initialized = false;
+		uv_close(reinterpret_cast<uv_handle_t*>(&submit_async), nullptr);
+		queue.swap(submit_queue);
+	}
+
+	for (JSONRPCRequest* r : queue) {
+		r->m_error = "shutting down";
+		r->finish();
+	}
+
+	JSONRPCConnection::close_all();
+}
+
+void JSONRPCRequest::submit(JSONRPCRequest* r)
+{
+	if (!is_main_thread() && pool_initialized.load()) {
+		MutexLock lock(submit_lock);
+		if (pool_initialized) {
+			submit_queue.push_back(r);
+			uv_async_send(&submit_async);
+			return;
+		}
+	}
+
+	JSONRPCConnection::send(r);
+}
+
+void JSONRPCRequest::on_submit_async(uv_async_t* /*handle*/)
+{
+	std::vector<JSONRPCRequest*> queue;
+	{
+		MutexLock lock(submit_lock);
+		queue.swap(submit_queue);
+	}
+
+	for (JSONRPCRequest* r : queue) {
+		JSONRPCConnection::send(r);
+	}
+}
+
+void JSONRPCRequest::finish()
+{
+	if (m_closeCallback) {
+		(*m_closeCallback)(m_error.c_str(), m_error.length());
+	}
+	delete this;
+}
+
+JSONRPCConnection::JSONRPCConnection(const std::string& key, const sockaddr_storage& addr)
+	: m_key(key)
+	, m_addr(addr)
+	, m_socket{}
+	, m_connect{}
+	, m_connected(false)
+	, m_closing(false)
+	, m_keepAlive(true)
+	, m_timer{}
+	, m_timedOut(false)
+	, m_openHandles(2)
+	, m_numResponses(0)
+	, m_parser{}
+	, m_statusOk(false)
+	, m_readBufInUse(false)
+{
+	m_readBuf[0] = '\0';
+
+	if (!http_settings.on_message_complete) {
+		http_settings.on_headers_complete = on_headers_complete;
+		http_settings.on_body = on_body;
+		http_settings.on_message_complete = on_message_complete;
+	}
+
+	llhttp_init(&m_parser, HTTP_RESPONSE, &http_settings);
+	m_parser.data = this;
+
+	uv_tcp_init(uv_default_loop_checked(), &m_socket);
+	uv_tcp_nodelay(&m_socket, 1);
+
+	uv_timer_init(uv_default_loop_checked(), &m_timer);
+
+	m_socket.data = this;
+	m_connect.data = this;
+	m_timer.data = this;
+}
+
+void JSONRPCConnection::send(JSONRPCRequest* r)
+{
+	if (closing_all) {
+		r->m_error = "shutting down";
+		r->finish();
+		return;
+	}
+
+	std::vector<JSONRPCConnection*>& list = connections[r->m_key];
+
+	JSONRPCConnection* c = nullptr;
+	for (JSONRPCConnection* k : list) {
+		if (!c || (k->num_requests() < c->num_requests())) {
+			c = k;
+		}
+	}
+
+	// Use an idle connection if there is one, otherwise open a new one or pipeline the request on the least busy one
+	// Urgent requests are never pipelined, they get a new connection even if there are MAX_CONNECTIONS_PER_DAEMON already
+	if (c && (c->num_requests() == 0 || (list.size() >= MAX_CONNECTIONS_PER_DAEMON && !r->m_urgent)) && (no_keep_alive.find(r->m_key) == no_keep_alive.end())) {
+		c->enqueue(r);
+		return;
+	}
+
+	LOGINFO(5, "opening new connection to " << r->m_key << " (" << list.size() + 1 << " total)");
+
+	c = new JSONRPCConnection(r->m_key, r->m_addr);
+	list.push_back(c);
+
+	c->enqueue(r);
+	c->connect();
+}
+
+void JSONRPCConnection::close_all()
+{
+	closing_all = true;
+
+	std::vector<JSONRPCConnection*> all;
+	for (const auto& it : connections) {
+		all.insert(all.end(), it.second.begin(), it.second.end());
+	}
+
+	for (JSONRPCConnection* c : all) {
+		c->close("shutting down");
+	}
+}
+
+void JSONRPCConnection::connect()
+{
+	const int err = uv_tcp_connect(&m_connect, &m_socket, reinterpret_cast<const sockaddr*>(&m_addr), on_connect);
+	if (err) {
+		LOGERR(1, "failed to initiate tcp connection to " << m_key << ", error " << uv_err_name(err));
+		close(uv_err_name(err));
 		return;
 	}
 
+	update_timer();
+}
+
+void JSONRPCConnection::enqueue(JSONRPCRequest* r)
+{
+	if (m_connected) {
+		write(r);
+	}
+	else {
+		m_pending.push_back(r);
+	}
+}
+
+void JSONRPCConnection::write(JSONRPCRequest* r)
+{
+	m_inflight.push_back(r);
+
 	uv_buf_t buf[1];
-	buf[0].base = pThis->m_request.data();
-	buf[0].len = static_cast<uint32_t>(pThis->m_request.size());
+	buf[0].base = r->m_request.data();
+	buf[0].len = static_cast<uint32_t>(r->m_request.size());
+
+	const int err = uv_write(&r->m_write, reinterpret_cast<uv_stream_t*>(&m_socket), buf, 1, on_write);
+	if (err) {
+		LOGERR(1, "failed to send request, error " << uv_err_name(err));
+		close(uv_err_name(err));
+		return;
+	}
+
+	update_timer();
+}
+
+void JSONRPCConnection::update_timer()
+{
+	if (m_closing) {
+		return;
+	}
+
+	if (num_requests() > 0) {
+		uv_timer_start(&m_timer, on_timer, request_timeout_ms, 0);
+	}
+	else {
+		uv_timer_stop(&m_timer);
+	}
+}
+
+void JSONRPCConnection::on_timer(uv_timer_t* timer)
+{
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(timer->data);
+
+	LOGWARN(3, "no response from " << pThis->m_key << " in " << request_timeout_ms << " ms, closing the connection");
+
+	pThis->m_timedOut = true;
+	pThis->close("timeout");
+}
 
-	uv_write(&pThis->m_write, reinterpret_cast<uv_stream_t*>(&pThis->m_socket), buf, 1, on_write);
+void JSONRPCConnection::on_timer_close(uv_handle_t* handle)
+{
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(handle->data);
+	if (--pThis->m_openHandles == 0) {
+		delete pThis;
+	}
 }
 
-void JSONRPCRequest::on_write(uv_write_t* handle, int status)
+void JSONRPCConnection::close(const char* error)
 {
-	JSONRPCRequest* pThis = static_cast<JSONRPCRequest*>(handle->data);
+	if (m_closing) {
+		return;
+	}
+
+	m_closing = true;
+
+	if (m_error.empty()) {
+		m_error = error;
+	}
+
+	// Don't give it any new requests
+	auto it = connections.find(m_key);
+	if (it != connections.end()) {
+		std::vector<JSONRPCConnection*>& list = it->second;
+		list.erase(std::remove(list.begin(), list.end(), this), list.end());
+		if (list.empty()) {
+			connections.erase(it);
+		}
+	}
+
+	uv_timer_stop(&m_timer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), on_timer_close);
+
+	// Requests are finished in on_close() when all write callbacks have been called
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_socket), on_close);
+}
+
+void JSONRPCConnection::on_connect(uv_connect_t* req, int status)
+{
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(req->data);
+
+	if (pThis->m_closing) {
+		return;
+	}
 
 	if (status != 0) {
-		pThis->m_error = uv_err_name(status);
-		LOGERR(1, "failed to send request, error " << pThis->m_error);
-		pThis->close();
+		LOGERR(1, "failed to connect to " << pThis->m_key << ", error " << uv_err_name(status));
+		pThis->close(uv_err_name(status));
 		return;
 	}
 
-	uv_read_start(reinterpret_cast<uv_stream_t*>(&pThis->m_socket), on_alloc, on_read);
+	pThis->m_connected = true;
+
+	const int err = uv_read_start(reinterpret_cast<uv_stream_t*>(&pThis->m_socket), on_alloc, on_read);
+	if (err) {
+		LOGERR(1, "failed to start reading from " << pThis->m_key << ", error " << uv_err_name(err));
+		pThis->close(uv_err_name(err));
+		return;
+	}
+
+	std::deque<JSONRPCRequest*> pending;
+	pending.swap(pThis->m_pending);
+
+	for (JSONRPCRequest* r : pending) {
+		pThis->write(r);
+	}
+}
+
+void JSONRPCConnection::on_write(uv_write_t* req, int status)
+{
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(req->handle->data);
+
+	if ((status != 0) && !pThis->m_closing) {
+		LOGERR(1, "failed to send request, error " << uv_err_name(status));
+		pThis->close(uv_err_name(status));
+	}
 }
 
-void JSONRPCRequest::on_alloc(uv_handle_t* handle, size_t /*suggested_size*/, uv_buf_t* buf)
+void JSONRPCConnection::on_alloc(uv_handle_t* handle, size_t /*suggested_size*/, uv_buf_t* buf)
 {
-	JSONRPCRequest* pThis = static_cast<JSONRPCRequest*>(handle->data);
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(handle->data);
 
 	if (pThis->m_readBufInUse) {
 		LOGERR(1, "read buffer is already in use");
@@ -120,121 +469,125 @@ void JSONRPCRequest::on_alloc(uv_handle_t* handle, size_t /*suggested_size*/, uv
 	pThis->m_readBufInUse = true;
 }
 
-void JSONRPCRequest::on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+void JSONRPCConnection::on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
 {
-	JSONRPCRequest* pThis = static_cast<JSONRPCRequest*>(stream->data);
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(stream->data);
 	pThis->m_readBufInUse = false;
 
+	if (pThis->m_closing) {
+		return;
+	}
+
 	if (nread > 0) {
-		pThis->on_read(buf->base, nread);
+		const llhttp_errno result = llhttp_execute(&pThis->m_parser, buf->base, static_cast<size_t>(nread));
+		if (result != HPE_OK) {
+			LOGERR(1, "failed to parse response, result = " << static_cast<int>(result));
+			pThis->close("failed to parse response");
+			return;
+		}
+
+		if (!pThis->m_keepAlive) {
+			pThis->close("connection closed by server");
+		}
 	}
 	else if (nread < 0) {
-		if (nread != UV_EOF){
-			pThis->m_error = uv_err_name(static_cast<int>(nread));
-			LOGERR(1, "failed to read response, error " << pThis->m_error);
+		if (nread != UV_EOF) {
+			LOGERR(1, "failed to read response, error " << uv_err_name(static_cast<int>(nread)));
+			pThis->close(uv_err_name(static_cast<int>(nread)));
+		}
+		else {
+			pThis->close("connection closed by server");
 		}
-		pThis->close();
 	}
 }
 
-void JSONRPCRequest::on_read(const char* data, size_t size)
+void JSONRPCConnection::on_close(uv_handle_t* handle)
 {
-	m_response.append(data, size);
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(handle->data);
 
-	static constexpr char headers_end[] = "\r\n\r\n";
-	if (m_response.find(headers_end) == std::string::npos) {
-		return;
-	}
+	std::vector<JSONRPCRequest*> requests(pThis->m_inflight.begin(), pThis->m_inflight.end());
+	requests.insert(requests.end(), pThis->m_pending.begin(), pThis->m_pending.end());
 
-	llhttp_settings_t settings{};
+	// A keep-alive connection can be closed by the server while requests are on their way, they're sent once more on a new connection
+	// If the server said it would close the connection, requests which didn't get their turn are just sent again
+	// Requests which timed out fail, the server is too slow to wait for them again
+	const bool retry = pThis->m_connected && !closing_all && !pThis->m_timedOut;
+	const bool resend = !pThis->m_keepAlive && !closing_all && !pThis->m_timedOut;
 
-	settings.on_status = [](llhttp_t*, const char* at, size_t length)
-	{
-		if ((length == 2) && (!memcmp(at, "Ok", 2) || !memcmp(at, "OK", 2))) {
-			return 0;
+	for (JSONRPCRequest* r : requests) {
+		if (resend) {
+			JSONRPCConnection::send(r);
 		}
-		return -1;
-	};
-
-	settings.on_header_field = [](llhttp_t* parser, const char* at, size_t length)
-	{
-		JSONRPCRequest* pThis = static_cast<JSONRPCRequest*>(parser->data);
-		static const char header[] = "Content-Length";
-		pThis->m_contentLengthHeader = ((length == sizeof(header) - 1) && (memcmp(at, header, length) == 0));
-		return 0;
-	};
-
-	settings.on_header_value = [](llhttp_t* parser, const char* at, size_t length)
-	{
-		JSONRPCRequest* pThis = static_cast<JSONRPCRequest*>(parser->data);
-		if (pThis->m_contentLengthHeader) {
-			uint32_t k = 0;
-			for (const char* p = at; p < at + length; ++p) {
-				if ('0' <= *p && *p <= '9') {
-					k = k * 10 + (*p - '0');
-				}
-				else {
-					return -1;
-				}
-			}
-			if (!k) {
-				return -1;
-			}
-			pThis->m_contentLength = k;
+		else if (retry && !r->m_retried) {
+			r->m_retried = true;
+			JSONRPCConnection::send(r);
 		}
-		return 0;
-	};
-
-	settings.on_body = [](llhttp_t* parser, const char* at, size_t length)
-	{
-		JSONRPCRequest* pThis = static_cast<JSONRPCRequest*>(parser->data);
-		if (pThis->m_contentLength && (length >= pThis->m_contentLength) && pThis->m_callback) {
-			(*pThis->m_callback)(at, length);
-			delete pThis->m_callback;
-			pThis->m_callback = nullptr;
+		else {
+			r->m_error = pThis->m_error;
+			r->finish();
 		}
-		return 0;
-	};
-
-	llhttp_t parser;
-	llhttp_init(&parser, HTTP_RESPONSE, &settings);
-
-	parser.data = this;
-
-	const llhttp_errno result = llhttp_execute(&parser, m_response.c_str(), m_response.length());
-	if (result != HPE_OK) {
-		m_error = "failed to parse response";
-		LOGERR(1, m_error << ", result = " << static_cast<int>(result));
-		close();
-		return;
 	}
 
-	if (!m_callback) {
-		close();
+	pThis->m_inflight.clear();
+	pThis->m_pending.clear();
+
+	if (--pThis->m_openHandles == 0) {
+		delete pThis;
 	}
 }
 
-void JSONRPCRequest::close()
+int JSONRPCConnection::on_headers_complete(llhttp_t* parser)
 {
-	uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&m_socket);
-	if (!uv_is_closing(h)) {
-		uv_close(h, on_close);
-	}
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(parser->data);
+	pThis->m_statusOk = (parser->status_code == 200);
+	return 0;
 }
 
-void JSONRPCRequest::on_close(uv_handle_t* handle)
+int JSONRPCConnection::on_body(llhttp_t* parser, const char* at, size_t length)
 {
-	JSONRPCRequest* req = static_cast<JSONRPCRequest*>(handle->data);
-	if (req->m_closeCallback) {
-		(*req->m_closeCallback)(req->m_error.c_str(), req->m_error.length());
-	}
-	delete req;
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(parser->data);
+	pThis->m_body.append(at, length);
+	return 0;
 }
 
-JSONRPCRequest::~JSONRPCRequest()
+int JSONRPCConnection::on_message_complete(llhttp_t* parser)
 {
-	delete m_callback;
-	delete m_closeCallback;
+	JSONRPCConnection* pThis = static_cast<JSONRPCConnection*>(parser->data);
+
+	if (pThis->m_inflight.empty()) {
+		LOGERR(1, "got a response from " << pThis->m_key << " without a request");
+		return -1;
+	}
+
+	++pThis->m_numResponses;
+
+	if (!llhttp_should_keep_alive(parser)) {
+		pThis->m_keepAlive = false;
+		if (no_keep_alive.insert(pThis->m_key).second) {
+			LOGWARN(4, pThis->m_key << " doesn't support keep-alive connections");
+		}
+	}
+
+	JSONRPCRequest* r = pThis->m_inflight.front();
+	pThis->m_inflight.pop_front();
+
+	pThis->update_timer();
+
+	if (!pThis->m_statusOk) {
+		r->m_error = "HTTP error status";
+		LOGERR(1, r->m_error << ' ' << parser->status_code << " from " << pThis->m_key);
+	}
+	else if (!pThis->m_body.empty() && r->m_callback) {
+		(*r->m_callback)(pThis->m_body.data(), pThis->m_body.size());
+		delete r->m_callback;
+		r->m_callback = nullptr;
+	}
+
+	pThis->m_body.clear();
+	pThis->m_statusOk = false;
+
+	r->finish();
+	return 0;
 }
 
 } // namespace p2pool
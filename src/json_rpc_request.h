@@ -19,32 +19,67 @@
 
 namespace p2pool {
 
+// New connections are opened until there are this many to one daemon, after that requests are pipelined
+static constexpr size_t MAX_CONNECTIONS_PER_DAEMON = 4;
+
+// Connection is closed and its requests fail if it has requests and nothing was received for this long
+static constexpr uint64_t REQUEST_TIMEOUT_MS = 15000;
+
+class JSONRPCConnection;
+
+// Requests to the same address and port share a small pool of HTTP/1.1 keep-alive connections
+// Requests can be made from any thread, but connections are only used by the main thread
 class JSONRPCRequest
 {
 public:
 	template<typename T>
 	static FORCEINLINE void call(const char* address, int port, const char* req, T&& cb)
 	{
-		// It will be deleted in one of the tcp callbacks eventually
+		// It will be deleted after the response is received or when the connection fails
 		JSONRPCRequest* r = new JSONRPCRequest(address, port, req, new Callback<T>(std::move(cb)), nullptr);
 		if (!r->m_valid) {
 			delete r;
+			return;
 		}
+		submit(r);
 	}
 
 	template<typename T, typename U>
 	static FORCEINLINE void call(const char* address, int port, const char* req, T&& cb, U&& close_cb)
 	{
-		// It will be deleted in one of the tcp callbacks eventually
+		call_impl(address, port, req, std::move(cb), std::move(close_cb), false);
+	}
+
+	// Urgent requests (submit_block) don't wait behind other requests: they get an idle connection or a new one
+	template<typename T, typename U>
+	static FORCEINLINE void call_urgent(const char* address, int port, const char* req, T&& cb, U&& close_cb)
+	{
+		call_impl(address, port, req, std::move(cb), std::move(close_cb), true);
+	}
+
+	// Must be called from the main thread before requests are made from other threads, and when p2pool stops
+	// A closed pool can be initialized again, it starts with no connections
+	static void init_pool(uint64_t timeout_ms = REQUEST_TIMEOUT_MS);
+	static void close_pool();
+
+private:
+	friend class JSONRPCConnection;
+
+	template<typename T, typename U>
+	static FORCEINLINE void call_impl(const char* address, int port, const char* req, T&& cb, U&& close_cb, bool urgent)
+	{
+		// It will be deleted after the response is received or when the connection fails
 		JSONRPCRequest* r = new JSONRPCRequest(address, port, req, new Callback<T>(std::move(cb)), new Callback<U>(std::move(close_cb)));
 		if (!r->m_valid) {
 			constexpr char err[] = "internal error";
 			close_cb(err, sizeof(err) - 1);
 			delete r;
+			return;
 		}
+		r->m_urgent = urgent;
+		submit(r);
 	}
 
-private:
 	struct CallbackBase
 	{
 		virtual ~CallbackBase() {}
@@ -65,28 +100,28 @@ private:
 	JSONRPCRequest(const char* address, int port, const char* req, CallbackBase* cb, CallbackBase* close_cb);
 	~JSONRPCRequest();
 
-	static void on_connect(uv_connect_t* req, int status);
-	static void on_write(uv_write_t* handle, int status);
-	static void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
-	static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
-	void on_read(const char* data, size_t size);
-	void close();
-	static void on_close(uv_handle_t* handle);
+	static void submit(JSONRPCRequest* r);
+	static void on_submit_async(uv_async_t* handle);
+
+	// Calls the close callback and deletes the request
+	void finish();
+
+	// "address:port", connections are pooled by this key
+	std::string m_key;
+	sockaddr_storage m_addr;
 
-	uv_tcp_t m_socket;
-	uv_connect_t m_connect;
 	uv_write_t m_write;
 
 	CallbackBase* m_callback;
 	CallbackBase* m_closeCallback;
-	uint32_t m_contentLength;
-	bool m_contentLengthHeader;
 
 	std::vector<char> m_request;
-	std::string m_response;
-	char m_readBuf[65536];
-	bool m_readBufInUse;
 	bool m_valid;
+	bool m_urgent;
+
+	// Request is sent again once if its keep-alive connection was closed before the response came
+	bool m_retried;
+
 	std::string m_error;
 };
 
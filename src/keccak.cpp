@@ -18,6 +18,18 @@
 #include "common.h"
 #include "keccak.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define KECCAK_X4_AVX2
+
+#ifdef _MSC_VER
+#define AVX2_TARGET
+#else
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#endif
+
 namespace p2pool {
 
 #ifndef ROTL64
@@ -182,4 +194,257 @@ void keccak(const uint8_t *in, int inlen, uint8_t (&md)[200])
 	keccak(in, inlen, md, 200);
 }
 
+void KeccakState::init(int _mdlen)
+{
+	memset(st, 0, sizeof(st));
+	rsiz = (_mdlen == sizeof(st)) ? KeccakParams::HASH_DATA_AREA : 200 - 2 * _mdlen;
+	pos = 0;
+	mdlen = _mdlen;
+}
+
+void KeccakState::absorb(const uint8_t* data, size_t size)
+{
+	uint8_t* s = reinterpret_cast<uint8_t*>(st);
+
+	// Fill the current block first
+	while (size && (pos || (size < static_cast<size_t>(rsiz)))) {
+		const size_t n = std::min(size, static_cast<size_t>(rsiz - pos));
+		for (size_t i = 0; i < n; ++i) {
+			s[pos + i] ^= data[i];
+		}
+		data += n;
+		size -= n;
+		pos += static_cast<int>(n);
+
+		if (pos == rsiz) {
+			keccakf(st);
+			pos = 0;
+		}
+	}
+
+	// Full blocks
+	const int rsizw = rsiz / 8;
+
+	for (; size >= static_cast<size_t>(rsiz); size -= rsiz, data += rsiz) {
+		for (int i = 0; i < rsizw; ++i) {
+			uint64_t k;
+			memcpy(&k, data + i * 8, sizeof(k));
+			st[i] ^= k;
+		}
+		keccakf(st);
+	}
+
+	// Remaining bytes
+	for (size_t i = 0; i < size; ++i) {
+		s[i] ^= data[i];
+	}
+	pos += static_cast<int>(size);
+}
+
+void KeccakState::absorb_zeros(size_t size)
+{
+	// XOR with zeros doesn't change the state, only the blocks have to be processed
+	while (size) {
+		const size_t n = std::min(size, static_cast<size_t>(rsiz - pos));
+		size -= n;
+		pos += static_cast<int>(n);
+
+		if (pos == rsiz) {
+			keccakf(st);
+			pos = 0;
+		}
+	}
+}
+
+void KeccakState::finalize(uint8_t* md)
+{
+	uint8_t* s = reinterpret_cast<uint8_t*>(st);
+
+	s[pos] ^= 1;
+	s[rsiz - 1] ^= 0x80;
+
+	keccakf(st);
+
+	memcpy(md, st, mdlen);
+}
+
+static void keccak_x4_generic(const uint8_t* const (&in)[4], int inlen, uint8_t* const (&md)[4], int mdlen)
+{
+	for (int i = 0; i < 4; ++i) {
+		keccak(in[i], inlen, md[i], mdlen);
+	}
+}
+
+#ifdef KECCAK_X4_AVX2
+
+#define ROTL256(x, y) _mm256_or_si256(_mm256_slli_epi64((x), (y)), _mm256_srli_epi64((x), 64 - (y)))
+
+// Same as keccakf(), but every 64-bit lane of st[i] belongs to a different hash
+AVX2_TARGET static void keccakf_avx2(__m256i* st)
+{
+	for (int round = 0; round < KeccakParams::ROUNDS; ++round) {
+		__m256i bc[5];
+
+		// Theta
+		for (int i = 0; i < 5; ++i) {
+			bc[i] = _mm256_xor_si256(_mm256_xor_si256(_mm256_xor_si256(st[i], st[i + 5]), _mm256_xor_si256(st[i + 10], st[i + 15])), st[i + 20]);
+		}
+
+		for (int i = 0; i < 5; ++i) {
+			const __m256i t = _mm256_xor_si256(bc[(i + 4) % 5], ROTL256(bc[(i + 1) % 5], 1));
+			st[i +  0] = _mm256_xor_si256(st[i +  0], t);
+			st[i +  5] = _mm256_xor_si256(st[i +  5], t);
+			st[i + 10] = _mm256_xor_si256(st[i + 10], t);
+			st[i + 15] = _mm256_xor_si256(st[i + 15], t);
+			st[i + 20] = _mm256_xor_si256(st[i + 20], t);
+		}
+
+		// Rho Pi
+		const __m256i t = st[1];
+		st[ 1] = ROTL256(st[ 6], 44);
+		st[ 6] = ROTL256(st[ 9], 20);
+		st[ 9] = ROTL256(st[22], 61);
+		st[22] = ROTL256(st[14], 39);
+		st[14] = ROTL256(st[20], 18);
+		st[20] = ROTL256(st[ 2], 62);
+		st[ 2] = ROTL256(st[12], 43);
+		st[12] = ROTL256(st[13], 25);
+		st[13] = ROTL256(st[19],  8);
+		st[19] = ROTL256(st[23], 56);
+		st[23] = ROTL256(st[15], 41);
+		st[15] = ROTL256(st[ 4], 27);
+		st[ 4] = ROTL256(st[24], 14);
+		st[24] = ROTL256(st[21],  2);
+		st[21] = ROTL256(st[ 8], 55);
+		st[ 8] = ROTL256(st[16], 45);
+		st[16] = ROTL256(st[ 5], 36);
+		st[ 5] = ROTL256(st[ 3], 28);
+		st[ 3] = ROTL256(st[18], 21);
+		st[18] = ROTL256(st[17], 15);
+		st[17] = ROTL256(st[11], 10);
+		st[11] = ROTL256(st[ 7],  6);
+		st[ 7] = ROTL256(st[10],  3);
+		st[10] = ROTL256(t, 1);
+
+		// Chi
+		for (int j = 0; j < 25; j += 5) {
+			for (int i = 0; i < 5; ++i) {
+				bc[i] = st[j + i];
+			}
+			for (int i = 0; i < 5; ++i) {
+				st[j + i] = _mm256_xor_si256(bc[i], _mm256_andnot_si256(bc[(i + 1) % 5], bc[(i + 2) % 5]));
+			}
+		}
+
+		// Iota
+		st[0] = _mm256_xor_si256(st[0], _mm256_set1_epi64x(static_cast<int64_t>(keccakf_rndc[round])));
+	}
+}
+
+#undef ROTL256
+
+static FORCEINLINE int64_t read_u64(const uint8_t* p)
+{
+	int64_t k;
+	memcpy(&k, p, sizeof(k));
+	return k;
+}
+
+AVX2_TARGET static void keccak_x4_avx2(const uint8_t* const (&in)[4], int inlen, uint8_t* const (&md)[4], int mdlen)
+{
+	__m256i st[25];
+
+	const int rsiz = 200 == mdlen ? KeccakParams::HASH_DATA_AREA : 200 - 2 * mdlen;
+	const int rsizw = rsiz / 8;
+
+	for (int i = 0; i < 25; ++i) {
+		st[i] = _mm256_setzero_si256();
+	}
+
+	int offset = 0;
+
+	for (; inlen >= rsiz; inlen -= rsiz, offset += rsiz) {
+		for (int i = 0; i < rsizw; ++i) {
+			const int k = offset + i * 8;
+			st[i] = _mm256_xor_si256(st[i], _mm256_set_epi64x(read_u64(in[3] + k), read_u64(in[2] + k), read_u64(in[1] + k), read_u64(in[0] + k)));
+		}
+		keccakf_avx2(st);
+	}
+
+	// last block and padding
+	alignas(8) uint8_t temp[4][144];
+
+	for (int j = 0; j < 4; ++j) {
+		memcpy(temp[j], in[j] + offset, inlen);
+		temp[j][inlen] = 1;
+		memset(temp[j] + inlen + 1, 0, rsiz - inlen - 1);
+		temp[j][rsiz - 1] |= 0x80;
+	}
+
+	for (int i = 0; i < rsizw; ++i) {
+		st[i] = _mm256_xor_si256(st[i], _mm256_set_epi64x(read_u64(temp[3] + i * 8), read_u64(temp[2] + i * 8), read_u64(temp[1] + i * 8), read_u64(temp[0] + i * 8)));
+	}
+
+	keccakf_avx2(st);
+
+	for (int i = 0; i * 8 < mdlen; ++i) {
+		alignas(32) uint8_t lanes[4][8];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lanes), st[i]);
+
+		const int n = std::min(mdlen - i * 8, 8);
+		for (int j = 0; j < 4; ++j) {
+			memcpy(md[j] + i * 8, lanes[j], n);
+		}
+	}
+}
+
+static bool avx2_supported()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+
+	// OSXSAVE and AVX
+	__cpuid(info, 1);
+	if ((info[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28))) {
+		return false;
+	}
+
+	// OS saves YMM registers
+	if ((_xgetbv(0) & 6) != 6) {
+		return false;
+	}
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+typedef void (*keccak_x4_func)(const uint8_t* const (&)[4], int, uint8_t* const (&)[4], int);
+
+static keccak_x4_func get_keccak_x4()
+{
+#ifdef KECCAK_X4_AVX2
+	if (avx2_supported()) {
+		return keccak_x4_avx2;
+	}
+#endif
+	return keccak_x4_generic;
+}
+
+static const keccak_x4_func keccak_x4_impl = get_keccak_x4();
+
+void keccak_x4(const uint8_t* const (&in)[4], int inlen, uint8_t* const (&md)[4], int mdlen)
+{
+	keccak_x4_impl(in, inlen, md, mdlen);
+}
+
 } // namespace p2pool
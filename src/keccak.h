@@ -28,6 +28,27 @@ void keccakf(uint64_t* st);
 void keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen);
 void keccak(const uint8_t* in, int inlen, uint8_t (&md)[200]);
 
+// Incremental Keccak hashing: absorb() can be called any number of times before finalize()
+// A copy of a partially absorbed state can be reused to hash different data with the same prefix
+struct KeccakState
+{
+	explicit KeccakState(int mdlen = HASH_SIZE) { init(mdlen); }
+
+	void init(int mdlen);
+	void absorb(const uint8_t* data, size_t size);
+	void absorb_zeros(size_t size);
+	void finalize(uint8_t* md);
+
+	uint64_t st[25];
+	int rsiz;
+	int pos;
+	int mdlen;
+};
+
+// Hashes 4 inputs of the same length at once
+// Uses AVX2 if the CPU supports it, falls back to 4 calls to keccak() otherwise
+void keccak_x4(const uint8_t* const (&in)[4], int inlen, uint8_t* const (&md)[4], int mdlen);
+
 template<typename T>
 FORCEINLINE void keccak_custom(T&& in, int inlen, uint8_t* md, int mdlen)
 {
@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "uv_util.h"
+#include "memory_leak_debug.h"
 #include <ctime>
 #include <fstream>
 
@@ -29,6 +30,7 @@ namespace log {
 
 int GLOBAL_LOG_LEVEL = 3;
 bool CONSOLE_COLORS = true;
+bool DEFERRED_FORMATTING = false;
 
 #ifndef P2POOL_LOG_DISABLE
 
@@ -48,11 +50,24 @@ public:
 	{
 		SLOT_SIZE = 1024,
 		BUF_SIZE = SLOT_SIZE * 16384,
+
+		// Deferred values take less space in a slot than formatted ones, hex is twice as big
+		EXPANDED_BUF_SIZE = SLOT_SIZE * 2 + 64,
+
+		// Log file is flushed when this much is written, or after FLUSH_INTERVAL_NS
+		FLUSH_SIZE = 65536,
 	};
 
+	static constexpr uint64_t FLUSH_INTERVAL_NS = 1000000000ULL;
+
 	FORCEINLINE Worker()
 		: m_writePos(0)
 		, m_readPos(0)
+		, m_idle(false)
+		, m_reopen(false)
+		, m_unflushedBytes(0)
+		, m_lastFlushTime(0)
+		, m_lastStatTime(0)
 	{
 		set_main_thread();
 
@@ -112,7 +127,10 @@ public:
 		if (m_writePos.load() - m_readPos > BUF_SIZE - SLOT_SIZE * 16) {
 			// Buffer is full, can't log normally
 			if (size > 3) {
-				fwrite(buf + 3, 1, size - 3, stderr);
+				char tmp[EXPANDED_BUF_SIZE];
+				uint32_t n = size - 3;
+				const char* p = expand_deferred(buf + 3, n, tmp);
+				fwrite(p, 1, n, stderr);
 			}
 			return;
 		}
@@ -127,89 +145,190 @@ public:
 		// Mark that everything is written into this log slot
 		p[0] = buf[0] + 1;
 
-		// Signal the worker thread
-		uv_cond_signal(&m_cond);
+		// Wake up the worker thread only if it's waiting, if it's busy, it will pick up this message without it
+		if (m_idle.load()) {
+			uv_mutex_lock(&m_mutex);
+			uv_cond_signal(&m_cond);
+			uv_mutex_unlock(&m_mutex);
+		}
 	}
 
+	FORCEINLINE void request_reopen() { m_reopen = true; }
+
 private:
 	static void run_wrapper(void* arg) { reinterpret_cast<Worker*>(arg)->run(); }
 
 	NOINLINE void run()
 	{
+		alloc_telemetry::Scope alloc_scope(alloc_telemetry::LOG);
 		worker_started = true;
 
 		do {
 			uv_mutex_lock(&m_mutex);
-			uv_cond_wait(&m_cond, &m_mutex);
+
+			// Checking for new messages after setting m_idle makes sure no wakeup is missed
+			m_idle = true;
+			if ((m_readPos == m_writePos.load()) && !stopped) {
+				if (m_unflushedBytes > 0) {
+					uv_cond_timedwait(&m_cond, &m_mutex, FLUSH_INTERVAL_NS);
+				}
+				else {
+					uv_cond_wait(&m_cond, &m_mutex);
+				}
+			}
+			m_idle = false;
+
 			uv_mutex_unlock(&m_mutex);
 
-			for (uint32_t writePos = m_writePos.load(); m_readPos < writePos; writePos = m_writePos.load()) {
-				// We have at least one log slot pending, possibly more than one
-				// Process everything in a loop before reading m_writePos again
-				do {
-					char* p = m_buf.data() + (m_readPos % BUF_SIZE);
+			process_pending();
 
-					// Wait until everything is written into this log slot
-					volatile char& severity = *p;
-					while (!severity) {}
+			const uint64_t t = uv_hrtime();
+			if ((m_unflushedBytes >= FLUSH_SIZE) || ((m_unflushedBytes > 0) && (t - m_lastFlushTime >= FLUSH_INTERVAL_NS))) {
+				flush(t);
+			}
+		} while (!stopped);
 
-					uint32_t size = static_cast<uint8_t>(p[2]);
-					size = (size << 8) + static_cast<uint8_t>(p[1]);
+		// Messages logged while stopping
+		process_pending();
+		flush(uv_hrtime());
+	}
 
-					if (size > 3) {
-						p += 3;
-						size -= 3;
+	void process_pending()
+	{
+		for (uint32_t writePos = m_writePos.load(); m_readPos < writePos; writePos = m_writePos.load()) {
+			// We have at least one log slot pending, possibly more than one
+			// Process everything in a loop before reading m_writePos again
+			do {
+				char* p = m_buf.data() + (m_readPos % BUF_SIZE);
+
+				// Wait until everything is written into this log slot
+				volatile char& severity = *p;
+				while (!severity) {}
+
+				uint32_t size = static_cast<uint8_t>(p[2]);
+				size = (size << 8) + static_cast<uint8_t>(p[1]);
+
+				if (size > 3) {
+					size -= 3;
+					char* line = expand_deferred(p + 3, size, m_expandedBuf);
+					write_line(line, size, severity);
+				}
+
+				// Mark this log slot empty
+				severity = '\0';
+
+				m_readPos += SLOT_SIZE;
+			} while (m_readPos < writePos);
+		}
+	}
 
-						// Read CONSOLE_COLORS only once because its value can be changed in another thread
-						const bool c = CONSOLE_COLORS;
+	void write_line(char* p, uint32_t size, char severity)
+	{
+		// Read CONSOLE_COLORS only once because its value can be changed in another thread
+		const bool c = CONSOLE_COLORS;
 
-						if (!c) {
-							strip_colors(p, size);
-						}
+		if (!c) {
+			strip_colors(p, size);
+		}
 
 #ifdef _WIN32
-						DWORD k;
-						WriteConsole((severity == 1) ? hStdOut : hStdErr, p, size, &k, nullptr);
+		DWORD k;
+		WriteConsole((severity == 1) ? hStdOut : hStdErr, p, size, &k, nullptr);
 #else
-						fwrite(p, 1, size, (severity == 1) ? stdout : stderr);
+		fwrite(p, 1, size, (severity == 1) ? stdout : stderr);
 #endif
 
-						// Reopen the log file if it's been moved (logrotate support)
-						if (m_logFile.is_open()) {
-							struct stat buf;
-							if (stat(log_file_name, &buf) != 0) {
-								m_logFile.close();
-								m_logFile.open(log_file_name, std::ios::app | std::ios::binary);
-							}
-						}
-
-						if (m_logFile.is_open()) {
-							if (c) {
-								strip_colors(p, size);
-							}
-
-							if (severity == 1) {
-								m_logFile.write("NOTICE  ", 8);
-							}
-							else if (severity == 2) {
-								m_logFile.write("WARNING ", 8);
-							}
-							else if (severity == 3) {
-								m_logFile.write("ERROR   ", 8);
-							}
-
-							m_logFile.write(p, size);
-							m_logFile.flush();
-						}
-					}
-
-					// Mark this log slot empty
-					severity = '\0';
-
-					m_readPos += SLOT_SIZE;
-				} while (m_readPos < writePos);
+		// Reopen the log file if it's been moved (logrotate support), it's checked at most once per flush interval
+		const uint64_t t = uv_hrtime();
+		if (m_logFile.is_open() && (m_reopen.exchange(false) || (t - m_lastStatTime >= FLUSH_INTERVAL_NS))) {
+			m_lastStatTime = t;
+
+			struct stat buf;
+			if (stat(log_file_name, &buf) != 0) {
+				m_logFile.close();
+				m_logFile.open(log_file_name, std::ios::app | std::ios::binary);
+				m_unflushedBytes = 0;
 			}
-		} while (!stopped);
+		}
+
+		if (m_logFile.is_open()) {
+			if (c) {
+				strip_colors(p, size);
+			}
+
+			if (severity == 1) {
+				m_logFile.write("NOTICE  ", 8);
+			}
+			else if (severity == 2) {
+				m_logFile.write("WARNING ", 8);
+			}
+			else if (severity == 3) {
+				m_logFile.write("ERROR   ", 8);
+			}
+
+			m_logFile.write(p, size);
+			m_unflushedBytes += size + 8;
+
+			// Warnings and errors are written right away, they're the most likely to be needed after a crash
+			if (severity > 1) {
+				flush(t);
+			}
+		}
+	}
+
+	void flush(uint64_t t)
+	{
+		if (m_logFile.is_open()) {
+			m_logFile.flush();
+		}
+		m_unflushedBytes = 0;
+		m_lastFlushTime = t;
+	}
+
+	// Formats deferred values, returns the original buffer if there are none
+	static char* expand_deferred(const char* p, uint32_t& size, char* out)
+	{
+		if (!DEFERRED_FORMATTING || !memchr(p, DEFERRED_MARKER, size)) {
+			return const_cast<char*>(p);
+		}
+
+		Stream s(out, EXPANDED_BUF_SIZE);
+
+		const char* e = p + size;
+		while (p < e) {
+			const char* marker = reinterpret_cast<const char*>(memchr(p, DEFERRED_MARKER, e - p));
+			if (!marker || (marker + 3 > e)) {
+				s.writeBuf(p, e - p);
+				break;
+			}
+
+			s.writeBuf(p, marker - p);
+
+			const uint8_t type = static_cast<uint8_t>(marker[1]);
+			const uint32_t n = static_cast<uint8_t>(marker[2]);
+			const char* data = marker + 3;
+
+			if (data + n > e) {
+				break;
+			}
+
+			if (type == DEFERRED_HEX) {
+				s << hex_buf(reinterpret_cast<const uint8_t*>(data), n);
+			}
+			else if ((type == DEFERRED_DIFFICULTY) && (n == sizeof(difficulty_type))) {
+				difficulty_type diff;
+				memcpy(&diff, data, sizeof(diff));
+				s << diff;
+			}
+			else if (type == DEFERRED_LITERAL) {
+				s.writeBuf(data, n);
+			}
+
+			p = data + n;
+		}
+
+		size = static_cast<uint32_t>(s.m_pos);
+		return out;
 	}
 
 	static FORCEINLINE void strip_colors(char* buf, uint32_t& size)
@@ -243,6 +362,16 @@ private:
 	std::atomic<uint32_t> m_writePos;
 	uint32_t m_readPos;
 
+	// Set while the worker thread is waiting for new messages
+	std::atomic<bool> m_idle;
+	std::atomic<bool> m_reopen;
+
+	uint32_t m_unflushedBytes;
+	uint64_t m_lastFlushTime;
+	uint64_t m_lastStatTime;
+
+	char m_expandedBuf[EXPANDED_BUF_SIZE];
+
 	uv_cond_t m_cond;
 	uv_mutex_t m_mutex;
 	uv_thread_t m_worker;
@@ -259,6 +388,7 @@ NOINLINE Writer::Writer(Severity severity) : Stream(m_stackBuf)
 {
 	m_buf[0] = static_cast<char>(severity);
 	m_pos = 3;
+	m_deferred = DEFERRED_FORMATTING;
 
 	*this << Cyan();
 	writeCurrentTime();
@@ -279,6 +409,9 @@ NOINLINE Writer::~Writer()
 void reopen()
 {
 	// This will trigger the worker thread which will then reopen log file if it's been moved
+#ifndef P2POOL_LOG_DISABLE
+	worker.request_reopen();
+#endif
 	LOGINFO(0, "reopening " << log_file_name);
 }
 
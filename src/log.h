@@ -25,6 +25,19 @@ extern int GLOBAL_LOG_LEVEL;
 extern bool CONSOLE_COLORS;
 constexpr int MAX_GLOBAL_LOG_LEVEL = 6;
 
+// Hashes, hex buffers and difficulty values in log messages are stored as raw bytes and formatted by the log thread
+extern bool DEFERRED_FORMATTING;
+
+// Deferred value in a log message: DEFERRED_MARKER, type, size (1 byte), then the raw bytes
+// DEFERRED_MARKER bytes in the message text itself are written as DEFERRED_LITERAL values
+static constexpr char DEFERRED_MARKER = '\x01';
+
+enum DeferredType : uint8_t {
+	DEFERRED_HEX = 1,
+	DEFERRED_DIFFICULTY = 2,
+	DEFERRED_LITERAL = 3,
+};
+
 enum class Severity {
 	Info,
 	Warning,
@@ -35,8 +48,8 @@ struct Stream
 {
 	enum params : int { BUF_SIZE = 1024 - 1 };
 
-	explicit FORCEINLINE Stream(char* buf) : m_pos(0), m_numberWidth(1), m_buf(buf), m_bufSize(BUF_SIZE) {}
-	FORCEINLINE Stream(char* buf, size_t size) : m_pos(0), m_numberWidth(1), m_buf(buf), m_bufSize(static_cast<int>(size) - 1) {}
+	explicit FORCEINLINE Stream(char* buf) : m_pos(0), m_numberWidth(1), m_buf(buf), m_bufSize(BUF_SIZE), m_deferred(false) {}
+	FORCEINLINE Stream(char* buf, size_t size) : m_pos(0), m_numberWidth(1), m_buf(buf), m_bufSize(static_cast<int>(size) - 1), m_deferred(false) {}
 
 	template<typename T>
 	struct Entry
@@ -88,6 +101,15 @@ struct Stream
 	}
 
 	FORCEINLINE void writeBuf(const char* buf, size_t n0)
+	{
+		if (m_deferred && memchr(buf, DEFERRED_MARKER, n0)) {
+			writeEscaped(buf, n0);
+			return;
+		}
+		writeRaw(buf, n0);
+	}
+
+	FORCEINLINE void writeRaw(const char* buf, size_t n0)
 	{
 		const int n = static_cast<int>(n0);
 		const int pos = m_pos;
@@ -98,6 +120,38 @@ struct Stream
 		m_pos = pos + n;
 	}
 
+	// Returns false if it doesn't fit, the value is not written then
+	FORCEINLINE bool writeDeferred(DeferredType type, const void* data, size_t size)
+	{
+		const int pos = m_pos;
+		const int n = static_cast<int>(size);
+		if ((size > 255) || (pos + 3 + n > m_bufSize)) {
+			return false;
+		}
+		m_buf[pos] = DEFERRED_MARKER;
+		m_buf[pos + 1] = static_cast<char>(type);
+		m_buf[pos + 2] = static_cast<char>(size);
+		memcpy(m_buf + pos + 3, data, size);
+		m_pos = pos + 3 + n;
+		return true;
+	}
+
+	NOINLINE void writeEscaped(const char* buf, size_t n)
+	{
+		for (const char* e = buf + n; buf < e;) {
+			const char* marker = reinterpret_cast<const char*>(memchr(buf, DEFERRED_MARKER, e - buf));
+			if (!marker) {
+				writeRaw(buf, e - buf);
+				break;
+			}
+			writeRaw(buf, marker - buf);
+			if (!writeDeferred(DEFERRED_LITERAL, marker, 1)) {
+				break;
+			}
+			buf = marker + 1;
+		}
+	}
+
 	FORCEINLINE int getNumberWidth() const { return m_numberWidth; }
 	FORCEINLINE void setNumberWidth(int width) { m_numberWidth = width; }
 
@@ -107,6 +161,9 @@ struct Stream
 	int m_numberWidth;
 	char* m_buf;
 	int m_bufSize;
+
+	// Only log messages can have deferred values, other users of Stream need the formatted text right away
+	bool m_deferred;
 };
 
 struct Writer : public Stream
@@ -222,6 +279,10 @@ template<> struct Stream::Entry<hash>
 {
 	static NOINLINE void put(const hash& data, Stream* wrapper)
 	{
+		if (wrapper->m_deferred && wrapper->writeDeferred(DEFERRED_HEX, data.h, sizeof(data.h))) {
+			return;
+		}
+
 		char buf[sizeof(data) * 2];
 		for (size_t i = 0; i < sizeof(data.h); ++i) {
 			buf[i * 2 + 0] = "0123456789abcdef"[data.h[i] >> 4];
@@ -235,6 +296,10 @@ template<> struct Stream::Entry<difficulty_type>
 {
 	static NOINLINE void put(const difficulty_type& data, Stream* wrapper)
 	{
+		if (wrapper->m_deferred && (wrapper->m_numberWidth == 1) && wrapper->writeDeferred(DEFERRED_DIFFICULTY, &data, sizeof(data))) {
+			return;
+		}
+
 		char buf[40];
 		size_t k = sizeof(buf);
 		int w = wrapper->m_numberWidth;
@@ -284,12 +349,14 @@ template<> struct log::Stream::Entry<hex_buf>
 {
 	static FORCEINLINE void put(const hex_buf& value, Stream* wrapper)
 	{
-		for (size_t i = 0; i < value.m_size; ++i) {
-			char buf[2];
-			buf[0] = "0123456789abcdef"[value.m_data[i] >> 4];
-			buf[1] = "0123456789abcdef"[value.m_data[i] & 15];
-			wrapper->writeBuf(buf, sizeof(buf));
+		if (wrapper->m_deferred && wrapper->writeDeferred(DEFERRED_HEX, value.m_data, value.m_size)) {
+			return;
 		}
+
+		// Write as many bytes as fit in the buffer
+		const size_t n = std::min<size_t>(value.m_size, static_cast<size_t>(wrapper->m_bufSize - wrapper->m_pos) / 2);
+		hex_encode(value.m_data, n, wrapper->m_buf + wrapper->m_pos);
+		wrapper->m_pos += static_cast<int>(n * 2);
 	}
 };
 
@@ -370,6 +437,37 @@ template<> struct log::Stream::Entry<XMRAmount>
 	}
 };
 
+// Writes a string as the contents of a JSON string: quotes, backslashes and control characters are escaped
+struct JSONString
+{
+	explicit FORCEINLINE JSONString(const std::string& data) : m_data(data) {}
+
+	const std::string& m_data;
+};
+
+template<> struct log::Stream::Entry<JSONString>
+{
+	static NOINLINE void put(JSONString&& value, Stream* wrapper)
+	{
+		static constexpr char hex[] = "0123456789abcdef";
+
+		for (char c : value.m_data) {
+			const uint8_t k = static_cast<uint8_t>(c);
+			if ((c == '"') || (c == '\\')) {
+				const char buf[2] = { '\\', c };
+				wrapper->writeBuf(buf, sizeof(buf));
+			}
+			else if (k < 0x20) {
+				const char buf[6] = { '\\', 'u', '0', '0', hex[k >> 4], hex[k & 15] };
+				wrapper->writeBuf(buf, sizeof(buf));
+			}
+			else {
+				wrapper->writeBuf(&c, 1);
+			}
+		}
+	}
+};
+
 template<> struct log::Stream::Entry<NetworkType>
 {
 	// cppcheck-suppress constParameter
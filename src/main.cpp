@@ -20,24 +20,39 @@
 #include "p2pool.h"
 #include "stratum_server.h"
 #include "p2p_server.h"
+#include "memory_leak_debug.h"
 
 static void usage()
 {
 	printf("P2Pool %s\n"
 		"\nUsage:\n\n" \
 		"--wallet             Wallet address to mine to. Subaddresses and integrated addresses are not supported!\n"
-		"--host               IP address of your Monero node, default is 127.0.0.1\n"
+		"--host               IP address of your Monero node, default is 127.0.0.1. Can be used multiple times for failover, each --host is followed by its own --rpc-port and --zmq-port\n"
 		"--rpc-port           monerod RPC API port number, default is 18081\n"
 		"--zmq-port           monerod ZMQ pub port number, default is 18083 (same port as in monerod's \"--zmq-pub\" command line parameter)\n"
 		"--stratum            Comma-separated list of IP:port for stratum server to listen on\n"
+		"--stratum-threads    Number of event loop threads for the stratum server, default is 1 (Linux/BSD only, uses SO_REUSEPORT)\n"
+		"--stratum-vardiff    Automatic difficulty for stratum clients targeting N seconds between shares, 0 (default) to disable. Difficulty set in the login is the starting point\n"
+		"--stratum-group-size Number of stratum clients (1-256) sharing one block template blob, each gets its own value of the highest nonce byte. Miners must support NiceHash mode. Default is 1 (own blob for each client)\n"
+		"--stratum-verify     Percentage (0-100) of low difficulty shares that get their PoW checked, default is 0. First shares of every connection are always checked, miners caught submitting invalid PoW are banned and all shares from their IP are checked for 24 hours\n"
 		"--p2p                Comma-separated list of IP:port for p2p server to listen on\n"
 		"--addpeers           Comma-separated list of IP:port of other p2pool nodes to connect to\n"
 		"--light-mode         Don't allocate RandomX dataset, saves 2GB of RAM\n"
+		"--randomx-vms        Number of full dataset RandomX VMs used for PoW checks, default is one per UV threadpool thread (UV_THREADPOOL_SIZE)\n"
+		"--prebuild-dataset   Build the next epoch's RandomX dataset in advance, uses 2GB of additional RAM\n"
+		"--numa               Allocate a separate RandomX dataset on each NUMA node (Linux only), uses 2GB of RAM per node\n"
 		"--loglevel           Verbosity of the log, integer number between 0 and %d\n"
 		"--config             Name of the p2pool config file\n"
 		"--data-api           Path to the p2pool JSON data (use it in tandem with an external web-server)\n"
+		"--http-api           Comma-separated list of IP:port for the built-in HTTP server to listen on, it serves the same JSON data as --data-api from memory (with ETag support)\n"
+		"--api-update-interval Update API data at most once in N seconds (1-3600), default is 5\n"
 		"--stratum-api        Enable /local/ path in api path for Stratum Server statistics\n"
 		"--no-cache           Disable p2pool.cache\n"
+		"--tx-refresh-interval Add new mempool transactions to the current block template every N seconds, default is 10, 0 to disable\n"
+		"--tx-selection-time  Time budget in milliseconds for the optimal transaction selection when the mempool doesn't fit in a block, 0 (default) uses only the heuristic algorithm\n"
+		"--record-traffic     Record all incoming ZMQ and P2P messages with timestamps to this file, it can be replayed offline with p2pool_replay\n"
+		"--alloc-telemetry    Sample memory allocations and count them by subsystem, see \"alloc\" console command and /alloc in the API\n"
+		"--log-deferred       Format hashes and other binary values in log messages in the logging thread instead of the thread that logs them\n"
 		"--no-color           Disable colors in console output\n"
 		"--help               Show this help message\n\n"
 		"Example command line:\n\n"
@@ -54,9 +69,6 @@ static void usage()
 	);
 }
 
-void memory_tracking_start();
-void memory_tracking_stop();
-
 int main(int argc, char* argv[])
 {
 	if (argc == 1) {
@@ -69,6 +81,11 @@ int main(int argc, char* argv[])
 			usage();
 			return 0;
 		}
+
+		// Allocation hooks must be set up before anything is allocated, so it's checked here and not in Params
+		if (!strcmp(argv[i], "--alloc-telemetry")) {
+			p2pool::alloc_telemetry::enable();
+		}
 	}
 
 	int result;
@@ -0,0 +1,325 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "mainchain_index.h"
+
+static constexpr char log_category_prefix[] = "MainchainIndex ";
+
+namespace p2pool {
+
+MainchainIndex::MainchainIndex(uint64_t seed_epoch_blocks)
+	: m_seedEpochBlocks(seed_epoch_blocks)
+	, m_hasHeaders(false)
+	, m_maxHeight(0)
+	, m_numEntries(0)
+	, m_ring{}
+	, m_oldSeeds{}
+	, m_timestamps{}
+	, m_numTimestamps(0)
+{
+	uv_rwlock_init_checked(&m_lock);
+	m_heightByHash.reserve(RING_SIZE + NUM_OLD_SEEDS);
+}
+
+MainchainIndex::~MainchainIndex()
+{
+	uv_rwlock_destroy(&m_lock);
+}
+
+bool MainchainIndex::get(uint64_t height, ChainMain& result) const
+{
+	ReadLock lock(m_lock);
+
+	const Slot* s = find(height);
+	if (!s) {
+		return false;
+	}
+
+	result = s->data;
+	return true;
+}
+
+bool MainchainIndex::get_by_hash(const hash& id, ChainMain& result) const
+{
+	ReadLock lock(m_lock);
+
+	auto it = m_heightByHash.find(id);
+	if (it == m_heightByHash.end()) {
+		return false;
+	}
+
+	const Slot* s = find(it->second);
+	if (!s || (s->data.id != id)) {
+		return false;
+	}
+
+	result = s->data;
+	return true;
+}
+
+bool MainchainIndex::get_difficulty(uint64_t height, difficulty_type& diff) const
+{
+	ReadLock lock(m_lock);
+
+	const Slot* s = find(height);
+	if (!s) {
+		return false;
+	}
+
+	diff = s->data.difficulty;
+	return true;
+}
+
+void MainchainIndex::get_missing_heights(uint64_t from, uint64_t to, std::vector<uint64_t>& heights) const
+{
+	ReadLock lock(m_lock);
+
+	for (uint64_t h = from; h <= to; ++h) {
+		if (!find(h)) {
+			heights.push_back(h);
+		}
+	}
+}
+
+uint64_t MainchainIndex::median_timestamp() const
+{
+	ReadLock lock(m_lock);
+
+	if (m_numEntries <= TIMESTAMP_WINDOW) {
+		return 0;
+	}
+
+	constexpr uint32_t n = TIMESTAMP_WINDOW;
+	if (m_numTimestamps == n) {
+		return (m_timestamps[n / 2] + m_timestamps[n / 2 + 1]) / 2;
+	}
+
+	// There are gaps in the window, older headers take their place until there are TIMESTAMP_WINDOW of them
+	uint64_t timestamps[TIMESTAMP_WINDOW];
+	uint32_t k = 0;
+
+	for (uint64_t i = 0; (i < RING_SIZE) && (i <= m_maxHeight) && (k < n); ++i) {
+		const uint64_t h = m_maxHeight - i;
+		const Slot& s = m_ring[h % RING_SIZE];
+		if (s.used && (s.data.height == h)) {
+			timestamps[k++] = s.data.timestamp;
+		}
+	}
+
+	// Not enough headers, the missing ones are requested from monerod again
+	if (k < n) {
+		return 0;
+	}
+
+	std::sort(timestamps, timestamps + n);
+	return (timestamps[n / 2] + timestamps[n / 2 + 1]) / 2;
+}
+
+const MainchainIndex::Slot* MainchainIndex::find(uint64_t height) const
+{
+	if (in_ring(height)) {
+		const Slot& s = m_ring[height % RING_SIZE];
+		return (s.used && (s.data.height == height)) ? &s : nullptr;
+	}
+
+	for (const Slot& s : m_oldSeeds) {
+		if (s.used && (s.data.height == height)) {
+			return &s;
+		}
+	}
+
+	return nullptr;
+}
+
+ChainMain* MainchainIndex::get_or_create(uint64_t height, bool& is_new)
+{
+	is_new = false;
+
+	if (!m_hasHeaders || (height > m_maxHeight)) {
+		advance(height);
+	}
+
+	Slot* s;
+
+	if (in_ring(height)) {
+		// advance() evicted everything else which could be in this slot
+		s = &m_ring[height % RING_SIZE];
+	}
+	else {
+		s = const_cast<Slot*>(find(height));
+		if (!s) {
+			if (height % m_seedEpochBlocks) {
+				return nullptr;
+			}
+			s = old_seed_slot(height);
+			if (!s) {
+				return nullptr;
+			}
+		}
+	}
+
+	if (!s->used) {
+		s->data = ChainMain();
+		s->data.height = height;
+		s->used = true;
+		++m_numEntries;
+		is_new = true;
+	}
+
+	return &s->data;
+}
+
+void MainchainIndex::on_updated(const ChainMain& old, const ChainMain& c, bool is_new)
+{
+	const uint64_t height = c.height;
+
+	if (in_window(height)) {
+		if (is_new) {
+			add_timestamp(c.timestamp);
+		}
+		else if (old.timestamp != c.timestamp) {
+			remove_timestamp(old.timestamp);
+			add_timestamp(c.timestamp);
+		}
+	}
+
+	if (!is_new && (old.id != c.id) && !old.id.empty()) {
+		auto it = m_heightByHash.find(old.id);
+		if ((it != m_heightByHash.end()) && (it->second == height)) {
+			m_heightByHash.erase(it);
+		}
+	}
+
+	if (!c.id.empty()) {
+		m_heightByHash[c.id] = height;
+	}
+}
+
+void MainchainIndex::advance(uint64_t new_max_height)
+{
+	if (!m_hasHeaders) {
+		m_hasHeaders = true;
+		m_maxHeight = new_max_height;
+		return;
+	}
+
+	const uint64_t old_max_height = m_maxHeight;
+
+	// Heights which leave the timestamp window
+	for (uint64_t i = 0; (i < TIMESTAMP_WINDOW) && (i <= old_max_height); ++i) {
+		const uint64_t h = old_max_height - i;
+		if (h + TIMESTAMP_WINDOW <= new_max_height) {
+			const Slot& s = m_ring[h % RING_SIZE];
+			if (s.used && (s.data.height == h)) {
+				remove_timestamp(s.data.timestamp);
+			}
+		}
+	}
+
+	m_maxHeight = new_max_height;
+
+	// Slots of the new heights still have headers which are RING_SIZE (or more) blocks older
+	const uint64_t n = std::min<uint64_t>(new_max_height - old_max_height, RING_SIZE);
+	for (uint64_t i = 0; i < n; ++i) {
+		Slot& s = m_ring[(new_max_height - i) % RING_SIZE];
+		if (s.used) {
+			evict(s);
+		}
+	}
+}
+
+void MainchainIndex::evict(Slot& slot)
+{
+	slot.used = false;
+	--m_numEntries;
+
+	const uint64_t height = slot.data.height;
+
+	if ((height % m_seedEpochBlocks) == 0) {
+		Slot* s = old_seed_slot(height);
+		if (s) {
+			*s = slot;
+			s->used = true;
+			++m_numEntries;
+			return;
+		}
+	}
+
+	auto it = m_heightByHash.find(slot.data.id);
+	if ((it != m_heightByHash.end()) && (it->second == height)) {
+		m_heightByHash.erase(it);
+	}
+}
+
+MainchainIndex::Slot* MainchainIndex::old_seed_slot(uint64_t height)
+{
+	Slot* result = nullptr;
+
+	for (Slot& s : m_oldSeeds) {
+		if (!s.used) {
+			return &s;
+		}
+		if (!result || (s.data.height < result->data.height)) {
+			result = &s;
+		}
+	}
+
+	// Only the latest seeds are kept
+	if (result->data.height > height) {
+		return nullptr;
+	}
+
+	auto it = m_heightByHash.find(result->data.id);
+	if ((it != m_heightByHash.end()) && (it->second == result->data.height)) {
+		m_heightByHash.erase(it);
+	}
+
+	result->used = false;
+	--m_numEntries;
+
+	return result;
+}
+
+void MainchainIndex::add_timestamp(uint64_t timestamp)
+{
+	if (m_numTimestamps >= TIMESTAMP_WINDOW) {
+		LOGERR(1, "timestamp window overflow. Fix the code!");
+		return;
+	}
+
+	uint64_t* end = m_timestamps + m_numTimestamps;
+	uint64_t* it = std::upper_bound(m_timestamps, end, timestamp);
+	memmove(it + 1, it, (end - it) * sizeof(uint64_t));
+	*it = timestamp;
+	++m_numTimestamps;
+}
+
+void MainchainIndex::remove_timestamp(uint64_t timestamp)
+{
+	uint64_t* end = m_timestamps + m_numTimestamps;
+	uint64_t* it = std::lower_bound(m_timestamps, end, timestamp);
+	if ((it == end) || (*it != timestamp)) {
+		LOGERR(1, "timestamp " << timestamp << " is not in the window. Fix the code!");
+		return;
+	}
+
+	memmove(it, it + 1, (end - it - 1) * sizeof(uint64_t));
+	--m_numTimestamps;
+}
+
+} // namespace p2pool
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "uv_util.h"
+
+namespace p2pool {
+
+// Headers of the last RING_SIZE Monero blocks in a ring indexed by height, plus a few older RandomX seed blocks
+// The median of TIMESTAMP_WINDOW highest blocks' timestamps is kept up to date on every change
+class MainchainIndex : public nocopy_nomove
+{
+public:
+	enum { RING_SIZE = 1024, NUM_OLD_SEEDS = 3, TIMESTAMP_WINDOW = 60 };
+
+	explicit MainchainIndex(uint64_t seed_epoch_blocks);
+	~MainchainIndex();
+
+	// Calls callback(ChainMain&) for the header at this height, a new header starts zero-filled
+	// Heights older than the ring are only kept if they are RandomX seed heights
+	template<typename T>
+	void update(uint64_t height, T&& callback)
+	{
+		WriteLock lock(m_lock);
+
+		bool is_new;
+		ChainMain* c = get_or_create(height, is_new);
+		if (!c) {
+			return;
+		}
+
+		const ChainMain old = *c;
+		callback(*c);
+		c->height = height;
+
+		on_updated(old, *c, is_new);
+	}
+
+	bool get(uint64_t height, ChainMain& result) const;
+	bool get_by_hash(const hash& id, ChainMain& result) const;
+	bool get_difficulty(uint64_t height, difficulty_type& diff) const;
+
+	// Heights in [from, to] which don't have a header
+	void get_missing_heights(uint64_t from, uint64_t to, std::vector<uint64_t>& heights) const;
+
+	// Median of the TIMESTAMP_WINDOW highest headers' timestamps, missing heights are skipped
+	// 0 if there are not enough headers yet
+	uint64_t median_timestamp() const;
+
+private:
+	struct Slot
+	{
+		ChainMain data;
+		bool used;
+	};
+
+	const Slot* find(uint64_t height) const;
+	ChainMain* get_or_create(uint64_t height, bool& is_new);
+	void on_updated(const ChainMain& old, const ChainMain& c, bool is_new);
+
+	void advance(uint64_t new_max_height);
+	void evict(Slot& slot);
+	Slot* old_seed_slot(uint64_t height);
+
+	FORCEINLINE bool in_window(uint64_t height) const { return m_hasHeaders && (height <= m_maxHeight) && (height + TIMESTAMP_WINDOW > m_maxHeight); }
+	FORCEINLINE bool in_ring(uint64_t height) const { return m_hasHeaders && (height <= m_maxHeight) && (height + RING_SIZE > m_maxHeight); }
+
+	void add_timestamp(uint64_t timestamp);
+	void remove_timestamp(uint64_t timestamp);
+
+	const uint64_t m_seedEpochBlocks;
+
+	mutable uv_rwlock_t m_lock;
+
+	bool m_hasHeaders;
+	uint64_t m_maxHeight;
+	uint32_t m_numEntries;
+
+	Slot m_ring[RING_SIZE];
+	Slot m_oldSeeds[NUM_OLD_SEEDS];
+	unordered_map<hash, uint64_t> m_heightByHash;
+
+	// Timestamps of headers in the window, sorted
+	uint64_t m_timestamps[TIMESTAMP_WINDOW];
+	uint32_t m_numTimestamps;
+};
+
+} // namespace p2pool
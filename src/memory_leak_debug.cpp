@@ -16,6 +16,289 @@
  */
 
 #include "common.h"
+#include "memory_leak_debug.h"
+#include "uv_util.h"
+
+static constexpr char log_category_prefix[] = "Memory ";
+
+namespace p2pool {
+
+namespace alloc_telemetry {
+
+namespace {
+
+// Recorded allocations are kept in a hash table with chains, like in the memory leak detector below
+// Bucket heads are atomic so that frees can skip the lock when their bucket is empty, which is almost always the case
+constexpr uint32_t NUM_BUCKETS = 1 << 20;
+constexpr uint32_t MAX_SAMPLES = 1 << 16;
+
+struct Sample
+{
+	void* p;
+	uint64_t weight;
+	Tag tag;
+};
+
+struct TagData
+{
+	std::atomic<uint64_t> allocs;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> live_bytes;
+};
+
+const char* tag_names[NUM_TAGS] = {
+	"other",
+	"sidechain",
+	"block_template",
+	"mempool",
+	"crypto_cache",
+	"network_buffers",
+	"log",
+};
+
+bool telemetry_enabled = false;
+uint64_t sample_interval = DEFAULT_SAMPLE_INTERVAL;
+uint64_t start_time = 0;
+
+TagData tag_data[NUM_TAGS];
+std::atomic<uint64_t> num_samples{ 0 };
+std::atomic<uint64_t> num_dropped_samples{ 0 };
+
+uv_mutex_t samples_lock;
+std::atomic<uint32_t> first[NUM_BUCKETS];
+uint32_t next[MAX_SAMPLES];
+Sample samples[MAX_SAMPLES];
+uint32_t free_slots[MAX_SAMPLES];
+uint32_t num_free_slots = 0;
+
+thread_local Tag current_tag = OTHER;
+thread_local int64_t bytes_until_sample = 0;
+thread_local uint64_t rng_state = 0;
+
+FORCEINLINE uint32_t bucket(const void* p)
+{
+	return static_cast<uint32_t>(((reinterpret_cast<uintptr_t>(p) >> 4) * 0x9E3779B97F4A7C15ULL) >> 44) & (NUM_BUCKETS - 1);
+}
+
+// Random distance to the next sample, so that allocation patterns can't line up with it
+FORCEINLINE int64_t next_sample_distance()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return static_cast<int64_t>(sample_interval / 2 + rng_state % sample_interval);
+}
+
+NOINLINE void record(void* p, size_t n)
+{
+	if (!rng_state) {
+		rng_state = (reinterpret_cast<uintptr_t>(&rng_state) | 1) * 0x9E3779B97F4A7C15ULL;
+		bytes_until_sample = next_sample_distance();
+		return;
+	}
+
+	// Bytes past the sample point count towards the next one, so small allocations aren't underestimated
+	bytes_until_sample += next_sample_distance();
+	if (bytes_until_sample <= 0) {
+		bytes_until_sample = next_sample_distance();
+	}
+
+	const uint64_t size = std::max<uint64_t>(n, 1);
+	const uint64_t weight = std::max(size, sample_interval);
+
+	TagData& data = tag_data[current_tag];
+	data.allocs.fetch_add((weight + size / 2) / size, std::memory_order_relaxed);
+	data.bytes.fetch_add(weight, std::memory_order_relaxed);
+	num_samples.fetch_add(1, std::memory_order_relaxed);
+
+	{
+		MutexLock lock(samples_lock);
+
+		if (!num_free_slots) {
+			num_dropped_samples.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		const uint32_t slot = free_slots[--num_free_slots];
+		samples[slot] = { p, weight, current_tag };
+
+		std::atomic<uint32_t>& head = first[bucket(p)];
+		next[slot] = head.load(std::memory_order_relaxed);
+		head.store(slot, std::memory_order_relaxed);
+	}
+
+	data.live_bytes.fetch_add(weight, std::memory_order_relaxed);
+}
+
+NOINLINE void forget(void* p, std::atomic<uint32_t>& head)
+{
+	MutexLock lock(samples_lock);
+
+	for (uint32_t prev = 0, k = head.load(std::memory_order_relaxed); k != 0; prev = k, k = next[k]) {
+		if (samples[k].p == p) {
+			if (prev) {
+				next[prev] = next[k];
+			}
+			else {
+				head.store(next[k], std::memory_order_relaxed);
+			}
+			free_slots[num_free_slots++] = k;
+			tag_data[samples[k].tag].live_bytes.fetch_sub(samples[k].weight, std::memory_order_relaxed);
+			return;
+		}
+	}
+}
+
+struct Snapshot
+{
+	uint64_t time;
+	TagStats stats[NUM_TAGS];
+};
+
+void update_snapshot(Snapshot& snapshot, TagStats (&stats)[NUM_TAGS], uint64_t (&allocs_per_second)[NUM_TAGS], uint64_t (&bytes_per_second)[NUM_TAGS])
+{
+	get(stats);
+
+	const uint64_t t = uv_hrtime();
+	if (!snapshot.time) {
+		snapshot.time = start_time;
+	}
+	const uint64_t dt = std::max<uint64_t>((t - snapshot.time) / 1000000, 1);
+
+	for (uint32_t i = 0; i < NUM_TAGS; ++i) {
+		allocs_per_second[i] = (stats[i].allocs - snapshot.stats[i].allocs) * 1000 / dt;
+		bytes_per_second[i] = (stats[i].bytes - snapshot.stats[i].bytes) * 1000 / dt;
+	}
+
+	snapshot.time = t;
+	memcpy(snapshot.stats, stats, sizeof(stats));
+}
+
+} // namespace
+
+FORCEINLINE void on_alloc(void* p, size_t n)
+{
+	if (!telemetry_enabled || !p) {
+		return;
+	}
+
+	bytes_until_sample -= static_cast<int64_t>(n);
+	if (bytes_until_sample <= 0) {
+		record(p, n);
+	}
+}
+
+FORCEINLINE void on_free(void* p)
+{
+	if (!telemetry_enabled || !p) {
+		return;
+	}
+
+	std::atomic<uint32_t>& head = first[bucket(p)];
+	if (head.load(std::memory_order_relaxed)) {
+		forget(p, head);
+	}
+}
+
+void enable(uint64_t interval)
+{
+	if (telemetry_enabled) {
+		return;
+	}
+
+	uv_mutex_init_checked(&samples_lock);
+
+	// Slot 0 marks the end of a chain
+	for (uint32_t i = 1; i < MAX_SAMPLES; ++i) {
+		free_slots[num_free_slots++] = MAX_SAMPLES - i;
+	}
+
+	sample_interval = std::max<uint64_t>(interval, 1);
+	start_time = uv_hrtime();
+	telemetry_enabled = true;
+}
+
+bool enabled()
+{
+	return telemetry_enabled;
+}
+
+Scope::Scope(Tag tag) : m_prevTag(current_tag)
+{
+	current_tag = tag;
+}
+
+Scope::~Scope()
+{
+	current_tag = m_prevTag;
+}
+
+void get(TagStats (&stats)[NUM_TAGS])
+{
+	for (uint32_t i = 0; i < NUM_TAGS; ++i) {
+		stats[i].allocs = tag_data[i].allocs.load(std::memory_order_relaxed);
+		stats[i].bytes = tag_data[i].bytes.load(std::memory_order_relaxed);
+		stats[i].live_bytes = tag_data[i].live_bytes.load(std::memory_order_relaxed);
+	}
+}
+
+const char* name(Tag tag)
+{
+	return (tag < NUM_TAGS) ? tag_names[tag] : "unknown";
+}
+
+void print_status()
+{
+	if (!telemetry_enabled) {
+		LOGINFO(0, "allocation telemetry is disabled, start p2pool with --alloc-telemetry to enable it");
+		return;
+	}
+
+	static Snapshot snapshot{};
+
+	TagStats stats[NUM_TAGS];
+	uint64_t allocs_per_second[NUM_TAGS], bytes_per_second[NUM_TAGS];
+	update_snapshot(snapshot, stats, allocs_per_second, bytes_per_second);
+
+	for (uint32_t i = 0; i < NUM_TAGS; ++i) {
+		LOGINFO(0, tag_names[i] <<
+			": live " << stats[i].live_bytes / 1024 <<
+			" KB, " << allocs_per_second[i] <<
+			" allocs/s, " << bytes_per_second[i] / 1024 <<
+			" KB/s, total " << stats[i].bytes / 1048576 << " MB");
+	}
+
+	LOGINFO(0, "sample interval " << sample_interval << " bytes, " << num_samples.load() << " samples, " << num_dropped_samples.load() << " not tracked (table full)");
+}
+
+void write_json(log::Stream& s)
+{
+	static Snapshot snapshot{};
+
+	TagStats stats[NUM_TAGS];
+	uint64_t allocs_per_second[NUM_TAGS], bytes_per_second[NUM_TAGS];
+	update_snapshot(snapshot, stats, allocs_per_second, bytes_per_second);
+
+	s << "{\"sample_interval\":" << sample_interval
+		<< ",\"samples\":" << num_samples.load()
+		<< ",\"dropped_samples\":" << num_dropped_samples.load()
+		<< ",\"tags\":{";
+
+	for (uint32_t i = 0; i < NUM_TAGS; ++i) {
+		s << ((i > 0) ? ",\"" : "\"") << tag_names[i]
+			<< "\":{\"allocs\":" << stats[i].allocs
+			<< ",\"bytes\":" << stats[i].bytes
+			<< ",\"live_bytes\":" << stats[i].live_bytes
+			<< ",\"allocs_per_second\":" << allocs_per_second[i]
+			<< ",\"bytes_per_second\":" << bytes_per_second[i] << '}';
+	}
+
+	s << "}}";
+}
+
+} // namespace alloc_telemetry
+
+} // namespace p2pool
 
 // Simple memory leak detector for Windows users, works best in RelWithDebInfo configuration.
 #if defined(_WIN32) && 0
@@ -236,15 +519,68 @@ NOINLINE void operator delete(void* p, size_t) noexcept { p2pool::free_hook(p);
 NOINLINE void operator delete[](void* p, size_t) noexcept { p2pool::free_hook(p); }
 
 #else
-void memory_tracking_start() {}
+void memory_tracking_start()
+{
+	using namespace p2pool;
+
+	if (alloc_telemetry::enabled()) {
+		uv_replace_allocator(malloc_hook, realloc_hook, calloc_hook, free_hook);
+	}
+}
+
 void memory_tracking_stop() {}
 
 namespace p2pool {
 
-void* malloc_hook(size_t n) noexcept { return malloc(n); }
-void* realloc_hook(void* ptr, size_t size) noexcept { return realloc(ptr, size); }
-void* calloc_hook(size_t count, size_t size) noexcept { return calloc(count, size); }
-void free_hook(void* p) noexcept { free(p); }
+void* malloc_hook(size_t n) noexcept
+{
+	void* p = malloc(n);
+	alloc_telemetry::on_alloc(p, n);
+	return p;
+}
+
+void* realloc_hook(void* ptr, size_t size) noexcept
+{
+	alloc_telemetry::on_free(ptr);
+
+	void* p = realloc(ptr, size);
+	alloc_telemetry::on_alloc(p, size);
+	return p;
+}
+
+void* calloc_hook(size_t count, size_t size) noexcept
+{
+	void* p = calloc(count, size);
+	alloc_telemetry::on_alloc(p, count * size);
+	return p;
+}
+
+void free_hook(void* p) noexcept
+{
+	alloc_telemetry::on_free(p);
+	free(p);
+}
 
+FORCEINLINE static void* allocate(size_t n)
+{
+	void* p = malloc_hook(n ? n : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
 }
+
+}
+
+// Test and benchmark executables count allocations on their own
+#ifndef P2POOL_NO_ALLOCATION_HOOKS
+NOINLINE void* operator new(size_t n) { return p2pool::allocate(n); }
+NOINLINE void* operator new[](size_t n) { return p2pool::allocate(n); }
+NOINLINE void* operator new(size_t n, const std::nothrow_t&) noexcept { return p2pool::malloc_hook(n ? n : 1); }
+NOINLINE void* operator new[](size_t n, const std::nothrow_t&) noexcept { return p2pool::malloc_hook(n ? n : 1); }
+NOINLINE void operator delete(void* p) noexcept { p2pool::free_hook(p); }
+NOINLINE void operator delete[](void* p) noexcept { p2pool::free_hook(p); }
+NOINLINE void operator delete(void* p, size_t) noexcept { p2pool::free_hook(p); }
+NOINLINE void operator delete[](void* p, size_t) noexcept { p2pool::free_hook(p); }
+#endif
 #endif
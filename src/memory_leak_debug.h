@@ -0,0 +1,79 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+void memory_tracking_start();
+void memory_tracking_stop();
+
+namespace p2pool {
+
+void* malloc_hook(size_t n) noexcept;
+void* realloc_hook(void* ptr, size_t size) noexcept;
+void* calloc_hook(size_t count, size_t size) noexcept;
+void free_hook(void* p) noexcept;
+
+// Sampled allocation telemetry for production builds, enabled with --alloc-telemetry
+// About one allocation in every sample_interval bytes is recorded with the tag of the code that made it, and it stands for sample_interval bytes
+// Only recorded allocations are looked up when they're freed, so live bytes per tag are an estimate too
+namespace alloc_telemetry {
+
+enum Tag : uint8_t {
+	OTHER,
+	SIDECHAIN,
+	BLOCK_TEMPLATE,
+	MEMPOOL,
+	CRYPTO_CACHE,
+	NETWORK_BUFFERS,
+	LOG,
+	NUM_TAGS
+};
+
+static constexpr uint64_t DEFAULT_SAMPLE_INTERVAL = 512 * 1024;
+
+// Must be called before memory_tracking_start(), it can't be disabled after that
+void enable(uint64_t sample_interval = DEFAULT_SAMPLE_INTERVAL);
+bool enabled();
+
+// Allocations made by this thread until the end of the scope get this tag
+struct Scope : public nocopy_nomove
+{
+	explicit Scope(Tag tag);
+	~Scope();
+
+private:
+	Tag m_prevTag;
+};
+
+struct TagStats
+{
+	uint64_t allocs;
+	uint64_t bytes;
+	uint64_t live_bytes;
+};
+
+void get(TagStats (&stats)[NUM_TAGS]);
+const char* name(Tag tag);
+
+// Rates are calculated since the previous call of the same function, print_status() is for the console and write_json() for the API
+void print_status();
+void write_json(log::Stream& s);
+
+} // namespace alloc_telemetry
+
+} // namespace p2pool
@@ -18,6 +18,7 @@
 #include "common.h"
 #include "mempool.h"
 #include "util.h"
+#include "memory_leak_debug.h"
 
 static constexpr char log_category_prefix[] = "Mempool ";
 
@@ -33,17 +34,22 @@ Mempool::~Mempool()
 	uv_rwlock_destroy(&m_lock);
 }
 
-void Mempool::add(const TxMempoolData& tx)
+bool Mempool::add(const TxMempoolData& tx)
 {
+	alloc_telemetry::Scope alloc_scope(alloc_telemetry::MEMPOOL);
 	WriteLock lock(m_lock);
 
 	if (!m_transactions.emplace(tx.id, tx).second) {
-		LOGWARN(1, "duplicate transaction with id = " << tx.id << ", skipped");
+		return false;
 	}
+
+	m_feeIndex.insert(tx);
+	return true;
 }
 
 void Mempool::swap(std::vector<TxMempoolData>& transactions)
 {
+	alloc_telemetry::Scope alloc_scope(alloc_telemetry::MEMPOOL);
 	const time_t cur_time = time(nullptr);
 
 	WriteLock lock(m_lock);
@@ -59,10 +65,41 @@ void Mempool::swap(std::vector<TxMempoolData>& transactions)
 		}
 	}
 
-	m_transactions.clear();
+	unordered_map<hash, TxMempoolData> new_transactions;
+	new_transactions.reserve(transactions.size());
 
 	for (TxMempoolData& data : transactions) {
-		m_transactions.emplace(data.id, data);
+		new_transactions.emplace(data.id, data);
+	}
+
+	// Update the fee index incrementally: most transactions are usually the same before and after the swap
+	for (const auto& it : m_transactions) {
+		if (new_transactions.find(it.first) == new_transactions.end()) {
+			m_feeIndex.erase(it.second);
+		}
+	}
+
+	for (const auto& it : new_transactions) {
+		if (m_transactions.find(it.first) == m_transactions.end()) {
+			m_feeIndex.insert(it.second);
+		}
+	}
+
+	m_transactions = std::move(new_transactions);
+}
+
+void Mempool::get_best_transactions(time_t max_time_received, size_t max_count, std::vector<TxMempoolData>& result, size_t& total_transactions) const
+{
+	result.clear();
+
+	ReadLock lock(m_lock);
+
+	total_transactions = m_transactions.size();
+
+	for (auto it = m_feeIndex.begin(); (it != m_feeIndex.end()) && (result.size() < max_count); ++it) {
+		if (it->time_received <= max_time_received) {
+			result.emplace_back(*it);
+		}
 	}
 }
 
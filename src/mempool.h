@@ -18,6 +18,7 @@
 #pragma once
 
 #include "uv_util.h"
+#include <set>
 
 namespace p2pool {
 
@@ -29,12 +30,35 @@ public:
 	Mempool();
 	~Mempool();
 
-	void add(const TxMempoolData& tx);
+	// Returns false if the transaction is already in the mempool
+	bool add(const TxMempoolData& tx);
 	void swap(std::vector<TxMempoolData>& transactions);
 
+	// Returns up to max_count transactions received at or before max_time_received, highest fee per weight first
+	void get_best_transactions(time_t max_time_received, size_t max_count, std::vector<TxMempoolData>& result, size_t& total_transactions) const;
+
 public:
 	mutable uv_rwlock_t m_lock;
 	unordered_map<hash, TxMempoolData> m_transactions;
+
+private:
+	struct FeeRateOrder
+	{
+		FORCEINLINE bool operator()(const TxMempoolData& a, const TxMempoolData& b) const
+		{
+			const uint64_t fee_a = a.fee * b.weight;
+			const uint64_t fee_b = b.fee * a.weight;
+
+			if (fee_a != fee_b) {
+				return fee_a > fee_b;
+			}
+
+			return a.id < b.id;
+		}
+	};
+
+	// All transactions from m_transactions, sorted by fee per weight
+	std::set<TxMempoolData, FeeRateOrder> m_feeIndex;
 };
 
 } // namespace p2pool
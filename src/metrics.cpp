@@ -0,0 +1,331 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "metrics.h"
+
+static constexpr char log_category_prefix[] = "Metrics ";
+
+namespace p2pool {
+
+namespace metrics {
+
+namespace {
+
+struct HistogramData
+{
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+	std::atomic<uint64_t> buckets[NUM_BUCKETS];
+};
+
+HistogramData histograms[NUM_HISTOGRAMS];
+std::atomic<uint64_t> counters[NUM_COUNTERS];
+std::atomic<uint64_t> gauges[NUM_GAUGES];
+
+const char* histogram_names[NUM_HISTOGRAMS] = {
+	"template_update",
+	"stratum_send_jobs",
+	"stratum_blobs_ready",
+	"share_queue_wait",
+	"share_check",
+	"randomx_hash_full",
+	"randomx_hash_light",
+	"p2p_broadcast_delay",
+	"sidechain_verify_loop",
+	"sidechain_lock_wait",
+};
+
+struct PerfData
+{
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+};
+
+PerfData perf_data[NUM_HISTOGRAMS];
+std::atomic<bool> perf_armed{ false };
+std::atomic<uint64_t> perf_start_time{ 0 };
+std::atomic<uint64_t> perf_stop_time{ 0 };
+
+FORCEINLINE void update_max(std::atomic<uint64_t>& max, uint64_t value)
+{
+	uint64_t cur_max = max.load(std::memory_order_relaxed);
+	while ((value > cur_max) && !max.compare_exchange_weak(cur_max, value, std::memory_order_relaxed)) {}
+}
+
+const char* counter_names[NUM_COUNTERS] = {
+	"templates_created",
+	"stratum_jobs_sent",
+	"stratum_shares_accepted",
+	"stratum_shares_rejected",
+	"p2p_blocks_broadcast",
+	"p2p_blocks_sent",
+};
+
+const char* gauge_names[NUM_GAUGES] = {
+	"template_transactions",
+	"template_shares",
+};
+
+FORCEINLINE uint32_t bucket_index(uint64_t value)
+{
+	if (value == 0) {
+		return 0;
+	}
+
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	const uint32_t bits = static_cast<uint32_t>(index) + 1;
+#else
+	const uint32_t bits = 64 - static_cast<uint32_t>(__builtin_clzll(value));
+#endif
+
+	return std::min(bits, NUM_BUCKETS - 1);
+}
+
+} // namespace
+
+void observe(Histogram h, uint64_t value)
+{
+	HistogramData& data = histograms[h];
+
+	data.count.fetch_add(1, std::memory_order_relaxed);
+	data.sum.fetch_add(value, std::memory_order_relaxed);
+	data.buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+	update_max(data.max, value);
+
+	if (perf_armed.load(std::memory_order_relaxed)) {
+		PerfData& perf = perf_data[h];
+		perf.count.fetch_add(1, std::memory_order_relaxed);
+		perf.sum.fetch_add(value, std::memory_order_relaxed);
+		update_max(perf.max, value);
+	}
+}
+
+void add(Counter c, uint64_t n)
+{
+	counters[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+void set(Gauge g, uint64_t value)
+{
+	gauges[g].store(value, std::memory_order_relaxed);
+}
+
+uint64_t get(Counter c)
+{
+	return counters[c].load(std::memory_order_relaxed);
+}
+
+uint64_t get(Gauge g)
+{
+	return gauges[g].load(std::memory_order_relaxed);
+}
+
+void get(Histogram h, HistogramStats& stats)
+{
+	const HistogramData& data = histograms[h];
+
+	stats.count = data.count.load(std::memory_order_relaxed);
+	stats.sum = data.sum.load(std::memory_order_relaxed);
+	stats.max = data.max.load(std::memory_order_relaxed);
+
+	for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+		stats.buckets[i] = data.buckets[i].load(std::memory_order_relaxed);
+	}
+}
+
+uint64_t HistogramStats::percentile(double p) const
+{
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+		total += buckets[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	const uint64_t target = std::max<uint64_t>(static_cast<uint64_t>(static_cast<double>(total) * p), 1);
+
+	uint64_t n = 0;
+	for (uint32_t i = 0; i < NUM_BUCKETS - 1; ++i) {
+		n += buckets[i];
+		if (n >= target) {
+			return std::min<uint64_t>((i > 0) ? (1ULL << i) - 1 : 0, max);
+		}
+	}
+
+	return max;
+}
+
+const char* name(Histogram h) { return histogram_names[h]; }
+const char* name(Counter c) { return counter_names[c]; }
+const char* name(Gauge g) { return gauge_names[g]; }
+
+void print_status()
+{
+	HistogramStats stats;
+
+	for (uint32_t i = 0; i < NUM_HISTOGRAMS; ++i) {
+		get(static_cast<Histogram>(i), stats);
+		if (stats.count == 0) {
+			continue;
+		}
+
+		LOGINFO(0, histogram_names[i] <<
+			": count " << stats.count <<
+			", avg " << stats.sum / stats.count <<
+			" us, p50 " << stats.percentile(0.5) <<
+			" us, p99 " << stats.percentile(0.99) <<
+			" us, max " << stats.max << " us");
+	}
+
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream s(buf);
+
+	for (uint32_t i = 0; i < NUM_COUNTERS; ++i) {
+		s << ((i > 0) ? ", " : "") << counter_names[i] << ' ' << get(static_cast<Counter>(i));
+	}
+	for (uint32_t i = 0; i < NUM_GAUGES; ++i) {
+		s << ", " << gauge_names[i] << ' ' << get(static_cast<Gauge>(i));
+	}
+
+	LOGINFO(0, log::const_buf(buf, s.m_pos));
+}
+
+void write_json(log::Stream& s)
+{
+	HistogramStats stats;
+
+	s << "{\"histograms\":{";
+	for (uint32_t i = 0; i < NUM_HISTOGRAMS; ++i) {
+		get(static_cast<Histogram>(i), stats);
+
+		s << ((i > 0) ? ",\"" : "\"") << histogram_names[i]
+			<< "\":{\"count\":" << stats.count
+			<< ",\"sum\":" << stats.sum
+			<< ",\"max\":" << stats.max
+			<< ",\"p50\":" << stats.percentile(0.5)
+			<< ",\"p99\":" << stats.percentile(0.99)
+			<< ",\"buckets\":[";
+
+		uint32_t n = NUM_BUCKETS;
+		while ((n > 0) && (stats.buckets[n - 1] == 0)) {
+			--n;
+		}
+		for (uint32_t j = 0; j < n; ++j) {
+			s << ((j > 0) ? "," : "") << stats.buckets[j];
+		}
+		s << "]}";
+	}
+
+	s << "},\"counters\":{";
+	for (uint32_t i = 0; i < NUM_COUNTERS; ++i) {
+		s << ((i > 0) ? ",\"" : "\"") << counter_names[i] << "\":" << get(static_cast<Counter>(i));
+	}
+
+	s << "},\"gauges\":{";
+	for (uint32_t i = 0; i < NUM_GAUGES; ++i) {
+		s << ((i > 0) ? ",\"" : "\"") << gauge_names[i] << "\":" << get(static_cast<Gauge>(i));
+	}
+
+	s << "}}";
+}
+
+void perf_start()
+{
+	perf_armed.store(false);
+
+	for (PerfData& perf : perf_data) {
+		perf.count.store(0, std::memory_order_relaxed);
+		perf.sum.store(0, std::memory_order_relaxed);
+		perf.max.store(0, std::memory_order_relaxed);
+	}
+
+	perf_start_time.store(now_us());
+	perf_stop_time.store(0);
+	perf_armed.store(true);
+}
+
+void perf_stop()
+{
+	if (perf_armed.exchange(false)) {
+		perf_stop_time.store(now_us());
+	}
+}
+
+bool perf_running()
+{
+	return perf_armed.load();
+}
+
+void perf_get(std::vector<PerfStats>& stats, uint64_t& duration)
+{
+	stats.clear();
+
+	const uint64_t start_time = perf_start_time.load();
+	const uint64_t stop_time = perf_stop_time.load();
+	duration = start_time ? ((stop_time ? stop_time : now_us()) - start_time) : 0;
+
+	for (uint32_t i = 0; i < NUM_HISTOGRAMS; ++i) {
+		const PerfData& perf = perf_data[i];
+		const uint64_t count = perf.count.load(std::memory_order_relaxed);
+		if (count > 0) {
+			stats.push_back({ static_cast<Histogram>(i), count, perf.sum.load(std::memory_order_relaxed), perf.max.load(std::memory_order_relaxed) });
+		}
+	}
+
+	std::sort(stats.begin(), stats.end(), [](const PerfStats& a, const PerfStats& b) { return a.sum > b.sum; });
+}
+
+void perf_report(uint32_t top_n)
+{
+	std::vector<PerfStats> stats;
+	uint64_t duration;
+	perf_get(stats, duration);
+
+	if (!duration) {
+		LOGINFO(0, "perf: not started, use \"perf start\" first");
+		return;
+	}
+
+	LOGINFO(0, "perf: " << (perf_running() ? "running for " : "stopped after ") << duration / 1000 << " ms, top " << top_n << " by total time:");
+
+	if (stats.empty()) {
+		LOGINFO(0, "nothing was measured yet");
+		return;
+	}
+
+	for (size_t i = 0, n = std::min<size_t>(stats.size(), top_n); i < n; ++i) {
+		const PerfStats& p = stats[i];
+		LOGINFO(0, histogram_names[p.histogram] <<
+			": total " << p.sum / 1000 <<
+			" ms (" << p.sum * 100 / duration <<
+			"% of wall time), count " << p.count <<
+			", avg " << p.sum / p.count <<
+			" us, max " << p.max << " us");
+	}
+}
+
+} // namespace metrics
+
+} // namespace p2pool
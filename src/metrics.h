@@ -0,0 +1,137 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "uv_util.h"
+
+namespace p2pool {
+
+// Process-wide counters, gauges and histograms for the hot paths
+// Everything is a relaxed atomic, so updating a metric costs about as much as an uncontended atomic add
+namespace metrics {
+
+// Durations in microseconds
+enum Histogram : uint32_t {
+	TEMPLATE_UPDATE,
+	STRATUM_SEND_JOBS,
+	STRATUM_BLOBS_READY,
+	SHARE_QUEUE_WAIT,
+	SHARE_CHECK,
+	RANDOMX_HASH_FULL,
+	RANDOMX_HASH_LIGHT,
+	P2P_BROADCAST_DELAY,
+	SIDECHAIN_VERIFY_LOOP,
+	SIDECHAIN_LOCK_WAIT,
+	NUM_HISTOGRAMS
+};
+
+enum Counter : uint32_t {
+	TEMPLATES_CREATED,
+	STRATUM_JOBS_SENT,
+	STRATUM_SHARES_ACCEPTED,
+	STRATUM_SHARES_REJECTED,
+	P2P_BLOCKS_BROADCAST,
+	P2P_BLOCKS_SENT,
+	NUM_COUNTERS
+};
+
+enum Gauge : uint32_t {
+	TEMPLATE_TRANSACTIONS,
+	TEMPLATE_SHARES,
+	NUM_GAUGES
+};
+
+// Bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeros, the last one counts everything that didn't fit
+static constexpr uint32_t NUM_BUCKETS = 40;
+
+FORCEINLINE uint64_t now_us() { return uv_hrtime() / 1000; }
+
+void observe(Histogram h, uint64_t value);
+void add(Counter c, uint64_t n = 1);
+void set(Gauge g, uint64_t value);
+
+uint64_t get(Counter c);
+uint64_t get(Gauge g);
+
+struct HistogramStats
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[NUM_BUCKETS];
+
+	// Upper bound of the bucket where the given fraction of values is reached
+	uint64_t percentile(double p) const;
+};
+
+void get(Histogram h, HistogramStats& stats);
+
+const char* name(Histogram h);
+const char* name(Counter c);
+const char* name(Gauge g);
+
+// Measures the time until the end of the scope
+struct Timer : public nocopy_nomove
+{
+	explicit FORCEINLINE Timer(Histogram h) : m_histogram(h), m_start(now_us()) {}
+	FORCEINLINE ~Timer() { observe(m_histogram, now_us() - m_start); }
+
+private:
+	Histogram m_histogram;
+	uint64_t m_start;
+};
+
+// Lock which records how long it waited to be acquired
+template<typename LockType, typename HandleType>
+struct TimedLock : public nocopy_nomove
+{
+	FORCEINLINE TimedLock(HandleType& handle, Histogram h) : m_start(now_us()), m_lock(handle) { observe(h, now_us() - m_start); }
+
+private:
+	uint64_t m_start;
+	LockType m_lock;
+};
+
+typedef TimedLock<ReadLock, uv_rwlock_t> TimedReadLock;
+typedef TimedLock<WriteLock, uv_rwlock_t> TimedWriteLock;
+
+void print_status();
+void write_json(log::Stream& s);
+
+// Profiling window for the "perf" console command
+// While it's running, observed values are also added to the window's totals, so they only show what happened since perf_start()
+struct PerfStats
+{
+	Histogram histogram;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+void perf_start();
+void perf_stop();
+bool perf_running();
+
+// Histograms which got values in the window sorted by total time, and the window duration in microseconds
+void perf_get(std::vector<PerfStats>& stats, uint64_t& duration);
+void perf_report(uint32_t top_n);
+
+} // namespace metrics
+
+} // namespace p2pool
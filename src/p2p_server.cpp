@@ -23,11 +23,16 @@
 #include "side_chain.h"
 #include "pool_block.h"
 #include "block_cache.h"
+#include "pow_hash.h"
+#include "mempool.h"
+#include "metrics.h"
+#include "traffic.h"
 #include <fstream>
 #include <numeric>
 
 static constexpr char log_category_prefix[] = "P2PServer ";
 static constexpr char saved_peer_list_file_name[] = "p2pool_peers.txt";
+static constexpr char snapshot_file_name[] = "p2pool.snapshot";
 static const char* seed_nodes[] = {
 	"seeds.p2pool.io"
 };
@@ -39,15 +44,251 @@ static constexpr uint64_t DEFAULT_BAN_TIME = 600;
 
 namespace p2pool {
 
+// Short transaction id for BLOCK_BROADCAST_COMPACT, keyed with a per-broadcast salt
+// so that nobody can prepare transactions that collide with others in advance
+static FORCEINLINE uint64_t compact_tx_id(const hash& id, uint64_t salt)
+{
+	const uint64_t* data = reinterpret_cast<const uint64_t*>(id.h);
+
+	uint64_t k = salt;
+	for (size_t i = 0; i < HASH_SIZE / sizeof(uint64_t); ++i) {
+		k ^= data[i];
+		k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		k = (k ^ (k >> 27)) * 0x94d049bb133111ebULL;
+		k ^= k >> 31;
+	}
+
+	return k;
+}
+
+// Moving average of block download times in microseconds, both values are in [0, BLOCK_REQUEST_MAX_RTT_US] so it can't overflow
+static FORCEINLINE int64_t block_time_average(int64_t average, int64_t t)
+{
+	t = std::min(std::max<int64_t>(t, 0), BLOCK_REQUEST_MAX_RTT_US);
+	return average ? (average + (t - average) / 4) : t;
+}
+
+bool make_broadcast_blobs(const PoolBlock& block, uint64_t total_reward, uint64_t salt, std::vector<uint8_t>& pruned_blob, std::vector<uint8_t>& compact_blob)
+{
+	pruned_blob.clear();
+	compact_blob.clear();
+
+	if (!block.m_blob) {
+		return false;
+	}
+
+	// Transaction hashes are at the end of the mainchain data, right after the miner transaction
+	const size_t tx_offset = block.m_mainChainHeaderSize + block.m_mainChainMinerTxSize;
+	const uint8_t* mainchain_data = block.main_chain_data();
+	const size_t mainchain_data_size = block.main_chain_data_size();
+	const uint8_t* sidechain_data = block.side_chain_data();
+	const size_t sidechain_data_size = block.side_chain_data_size();
+
+	const uint8_t* tx_data = mainchain_data + tx_offset;
+	const uint8_t* tx_data_end = mainchain_data + mainchain_data_size;
+
+	uint64_t num_transactions = 0;
+	const size_t outputs_end = static_cast<size_t>(block.m_mainChainOutputsOffset) + static_cast<size_t>(block.m_mainChainOutputsBlobSize);
+	if ((outputs_end > tx_offset) || (tx_offset >= mainchain_data_size) ||
+		!(tx_data = readVarint(tx_data, tx_data_end, num_transactions)) ||
+		(num_transactions != static_cast<uint64_t>(tx_data_end - tx_data) / HASH_SIZE) ||
+		(static_cast<uint64_t>(tx_data_end - tx_data) % HASH_SIZE)) {
+		return false;
+	}
+
+	// Pruned blob without the transaction list, it's the beginning of both pruned and compact blobs
+	std::vector<uint8_t> pruned_prefix;
+	pruned_prefix.reserve(tx_offset + 16 - block.m_mainChainOutputsBlobSize);
+	pruned_prefix.assign(mainchain_data, mainchain_data + block.m_mainChainOutputsOffset);
+
+	// 0 outputs in the pruned blob
+	pruned_prefix.push_back(0);
+
+	writeVarint(total_reward, pruned_prefix);
+	writeVarint(block.m_mainChainOutputsBlobSize, pruned_prefix);
+
+	pruned_prefix.insert(pruned_prefix.end(), mainchain_data + outputs_end, mainchain_data + tx_offset);
+
+	pruned_blob.reserve(pruned_prefix.size() + (tx_data_end - tx_data) + 16 + sidechain_data_size);
+	pruned_blob = pruned_prefix;
+	pruned_blob.insert(pruned_blob.end(), mainchain_data + tx_offset, mainchain_data + mainchain_data_size);
+	pruned_blob.insert(pruned_blob.end(), sidechain_data, sidechain_data + sidechain_data_size);
+
+	// Compact blob: sidechain id, salt, pruned prefix, short transaction ids and sidechain data
+	// It's not worth it for a few transactions, and it's skipped in the unlikely case of a short id collision
+	if (num_transactions < BLOCK_BROADCAST_COMPACT_MIN_TXS) {
+		return true;
+	}
+
+	std::vector<uint64_t> short_ids(num_transactions);
+	for (uint64_t i = 0; i < num_transactions; ++i) {
+		hash id;
+		memcpy(id.h, tx_data + i * HASH_SIZE, HASH_SIZE);
+		short_ids[i] = compact_tx_id(id, salt);
+	}
+
+	std::vector<uint64_t> sorted_ids = short_ids;
+	std::sort(sorted_ids.begin(), sorted_ids.end());
+
+	if (std::adjacent_find(sorted_ids.begin(), sorted_ids.end()) != sorted_ids.end()) {
+		return true;
+	}
+
+	compact_blob.reserve(HASH_SIZE + sizeof(uint64_t) + sizeof(uint32_t) * 2 + pruned_prefix.size() + num_transactions * sizeof(uint64_t) + sidechain_data_size);
+
+	compact_blob.assign(block.m_sidechainId.h, block.m_sidechainId.h + HASH_SIZE);
+
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(&salt);
+	compact_blob.insert(compact_blob.end(), p, p + sizeof(salt));
+
+	const uint32_t prefix_size = static_cast<uint32_t>(pruned_prefix.size());
+	p = reinterpret_cast<const uint8_t*>(&prefix_size);
+	compact_blob.insert(compact_blob.end(), p, p + sizeof(prefix_size));
+	compact_blob.insert(compact_blob.end(), pruned_prefix.begin(), pruned_prefix.end());
+
+	const uint32_t n = static_cast<uint32_t>(num_transactions);
+	p = reinterpret_cast<const uint8_t*>(&n);
+	compact_blob.insert(compact_blob.end(), p, p + sizeof(n));
+
+	p = reinterpret_cast<const uint8_t*>(short_ids.data());
+	compact_blob.insert(compact_blob.end(), p, p + short_ids.size() * sizeof(uint64_t));
+
+	compact_blob.insert(compact_blob.end(), sidechain_data, sidechain_data + sidechain_data_size);
+
+	return true;
+}
+
+int CompactBlock::parse(const uint8_t* buf, uint32_t size)
+{
+	const uint8_t* data = buf;
+	const uint8_t* data_end = buf + size;
+
+	if (static_cast<size_t>(data_end - data) < HASH_SIZE + sizeof(m_salt) + sizeof(m_prefixSize)) {
+		return __LINE__;
+	}
+
+	memcpy(m_id.h, data, HASH_SIZE);
+	data += HASH_SIZE;
+
+	memcpy(&m_salt, data, sizeof(m_salt));
+	data += sizeof(m_salt);
+
+	memcpy(&m_prefixSize, data, sizeof(m_prefixSize));
+	data += sizeof(m_prefixSize);
+
+	if (static_cast<size_t>(data_end - data) < static_cast<size_t>(m_prefixSize) + sizeof(uint32_t)) {
+		return __LINE__;
+	}
+
+	m_prefix = data;
+	data += m_prefixSize;
+
+	memcpy(&m_numTransactions, data, sizeof(m_numTransactions));
+	data += sizeof(m_numTransactions);
+
+	if ((m_numTransactions == 0) || (static_cast<size_t>(data_end - data) / sizeof(uint64_t) < m_numTransactions)) {
+		return __LINE__;
+	}
+
+	m_shortIds = data;
+	data += static_cast<size_t>(m_numTransactions) * sizeof(uint64_t);
+
+	m_sidechainData = data;
+	m_sidechainDataSize = static_cast<size_t>(data_end - data);
+
+	return 0;
+}
+
+bool CompactBlock::reconstruct(const Mempool& mempool, std::vector<uint8_t>& blob, uint32_t& num_missing) const
+{
+	blob.clear();
+
+	unordered_map<uint64_t, uint32_t> index;
+	index.reserve(m_numTransactions);
+
+	for (uint32_t i = 0; i < m_numTransactions; ++i) {
+		uint64_t k;
+		memcpy(&k, m_shortIds + i * sizeof(uint64_t), sizeof(k));
+		if (!index.emplace(k, i).second) {
+			return false;
+		}
+	}
+
+	std::vector<hash> transactions(m_numTransactions);
+	std::vector<uint8_t> found(m_numTransactions, 0);
+	uint32_t num_found = 0;
+
+	{
+		ReadLock lock(mempool.m_lock);
+
+		for (const auto& it : mempool.m_transactions) {
+			auto it2 = index.find(compact_tx_id(it.first, m_salt));
+			if (it2 != index.end()) {
+				const uint32_t i = it2->second;
+				if (!found[i]) {
+					found[i] = 1;
+					transactions[i] = it.first;
+					++num_found;
+				}
+			}
+		}
+	}
+
+	num_missing = m_numTransactions - num_found;
+	if (num_missing) {
+		return true;
+	}
+
+	blob.reserve(m_prefixSize + 16 + static_cast<size_t>(m_numTransactions) * HASH_SIZE + m_sidechainDataSize);
+
+	blob.assign(m_prefix, m_prefix + m_prefixSize);
+	writeVarint(m_numTransactions, blob);
+	for (const hash& h : transactions) {
+		blob.insert(blob.end(), h.h, h.h + HASH_SIZE);
+	}
+	blob.insert(blob.end(), m_sidechainData, m_sidechainData + m_sidechainDataSize);
+
+	return true;
+}
+
+struct P2PServer::SyncBlock
+{
+	SyncBlock(P2PClient* _client, const uint8_t* buf, uint32_t size)
+		: blob(buf, buf + size)
+		, block()
+		, client(_client)
+		, client_reset_counter(_client->m_resetCounter.load())
+		, client_ip(_client->m_addr)
+		, ok(false)
+		, missing_blocks()
+	{
+		memcpy(client_addr, _client->m_addrString, sizeof(client_addr));
+	}
+
+	std::vector<uint8_t> blob;
+	PoolBlock block;
+	P2PClient* client;
+	uint32_t client_reset_counter;
+	raw_ip client_ip;
+
+	// Jobs on the thread pool log this copy, the client can be reset and reused for another peer while they run
+	char client_addr[sizeof(P2PClient::m_addrString)];
+	bool ok;
+	std::vector<hash> missing_blocks;
+};
+
 P2PServer::P2PServer(p2pool* pool)
 	: TCPServer(P2PClient::allocate)
 	, m_pool(pool)
-	, m_cache(pool->params().m_blockCache ? new BlockCache() : nullptr)
+	, m_cache(pool->block_cache())
 	, m_cacheLoaded(false)
 	, m_initialPeerList(pool->params().m_p2pPeerList)
 	, m_rd{}
 	, m_rng(m_rd())
 	, m_block(new PoolBlock())
+	, m_syncJobs{}
+	, m_syncMaxJobs{}
+	, m_syncPendingBlocks(0)
 	, m_timer{}
 	, m_timerCounter(0)
 	, m_peerId(m_rng())
@@ -60,6 +301,12 @@ P2PServer::P2PServer(p2pool* pool)
 	uv_mutex_init_checked(&m_missingBlockRequestsLock);
 	uv_rwlock_init_checked(&m_cachedBlocksLock);
 
+	// Deserialize and PoW stages can use every PoW VM in parallel, blocks are added to the sidechain one job at a time to keep their order
+	const uint32_t num_vms = std::max(m_pool->hasher()->num_full_vms(), 1U);
+	m_syncMaxJobs[SYNC_DESERIALIZE] = num_vms;
+	m_syncMaxJobs[SYNC_POW] = num_vms;
+	m_syncMaxJobs[SYNC_ADD] = 1;
+
 	int err = uv_async_init(&m_loop, &m_broadcastAsync, on_broadcast);
 	if (err) {
 		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
@@ -78,6 +325,7 @@ P2PServer::P2PServer(p2pool* pool)
 		WriteLock lock(m_cachedBlocksLock);
 		m_cache->load_all(m_pool->side_chain(), *this);
 		m_cacheLoaded = true;
+		load_snapshot();
 	}
 
 	m_timer.data = this;
@@ -108,19 +356,34 @@ P2PServer::~P2PServer()
 	clear_cached_blocks();
 	uv_rwlock_destroy(&m_cachedBlocksLock);
 
+	for (std::deque<SyncBlock*>& queue : m_syncQueue) {
+		for (SyncBlock* b : queue) {
+			delete b;
+		}
+	}
+
 	delete m_block;
-	delete m_cache;
 }
 
-void P2PServer::add_cached_block(const PoolBlock& block)
+void P2PServer::add_cached_blocks(std::vector<PoolBlock*>& blocks)
 {
 	if (m_cacheLoaded) {
-		LOGERR(1, "add_cached_block can only be called on startup. Fix the code!");
+		LOGERR(1, "add_cached_blocks can only be called on startup. Fix the code!");
+		for (PoolBlock* block : blocks) {
+			delete block;
+		}
+		blocks.clear();
 		return;
 	}
 
-	PoolBlock* new_block = new PoolBlock(block);
-	m_cachedBlocks.insert({ new_block->m_sidechainId, new_block });
+	m_cachedBlocks.reserve(m_cachedBlocks.size() + blocks.size());
+
+	for (PoolBlock* block : blocks) {
+		if (!m_cachedBlocks.insert({ block->m_sidechainId, block }).second) {
+			delete block;
+		}
+	}
+	blocks.clear();
 }
 
 void P2PServer::clear_cached_blocks()
@@ -537,6 +800,8 @@ void P2PServer::remove_peer_from_list(const raw_ip& ip)
 
 void P2PServer::broadcast(const PoolBlock& block)
 {
+	const uint64_t start_time = metrics::now_us();
+
 	if (block.m_txinGenHeight + 2 < m_pool->miner_data().height) {
 		LOGWARN(3, "Trying to broadcast a stale block " << block.m_sidechainId << " (mainchain height " << block.m_txinGenHeight << ", current height is " << m_pool->miner_data().height << ')');
 		return;
@@ -547,41 +812,56 @@ void P2PServer::broadcast(const PoolBlock& block)
 		return;
 	}
 
-	Broadcast* data = new Broadcast();
-
-	data->blob.reserve(block.m_mainChainData.size() + block.m_sideChainData.size());
-	data->blob = block.m_mainChainData;
-	data->blob.insert(data->blob.end(), block.m_sideChainData.begin(), block.m_sideChainData.end());
-
-	data->pruned_blob.reserve(block.m_mainChainData.size() + block.m_sideChainData.size() + 16 - block.m_mainChainOutputsBlobSize);
-	data->pruned_blob.assign(block.m_mainChainData.begin(), block.m_mainChainData.begin() + block.m_mainChainOutputsOffset);
-
-	// 0 outputs in the pruned blob
-	data->pruned_blob.push_back(0);
+	// Sidechain blocks are compacted, so parse outputs back from the blob if needed
+	std::vector<PoolBlock::TxOutput> tmp_outputs;
+	const std::vector<PoolBlock::TxOutput>* outputs = block.get_outputs(tmp_outputs);
+	if (!outputs) {
+		LOGWARN(3, "Trying to broadcast a block " << block.m_sidechainId << " with invalid outputs");
+		return;
+	}
 
-	const uint64_t total_reward = std::accumulate(block.m_outputs.begin(), block.m_outputs.end(), 0ULL,
+	const uint64_t total_reward = std::accumulate(outputs->begin(), outputs->end(), 0ULL,
 		[](uint64_t a, const PoolBlock::TxOutput& b)
 		{
 			return a + b.m_reward;
 		});
 
-	writeVarint(total_reward, data->pruned_blob);
-	writeVarint(block.m_mainChainOutputsBlobSize, data->pruned_blob);
+	std::vector<uint8_t> pruned_blob;
+	std::vector<uint8_t> compact_blob;
+
+	if (!make_broadcast_blobs(block, total_reward, get_random64(), pruned_blob, compact_blob)) {
+		LOGWARN(3, "Trying to broadcast a block " << block.m_sidechainId << " with invalid mainchain data");
+		return;
+	}
+
+	Broadcast* data = new Broadcast();
+	data->start_time = start_time;
+
+	// Full blob is the block's own buffer
+	block.m_blob->add_ref();
+	data->blob = block.m_blob;
+
+	data->pruned_blob = new SharedBuf(std::move(pruned_blob));
+
+	if (!compact_blob.empty()) {
+		data->compact_blob = new SharedBuf(std::move(compact_blob));
+	}
 
-	data->pruned_blob.insert(data->pruned_blob.end(), block.m_mainChainData.begin() + block.m_mainChainOutputsOffset + block.m_mainChainOutputsBlobSize, block.m_mainChainData.end());
-	data->pruned_blob.insert(data->pruned_blob.end(), block.m_sideChainData.begin(), block.m_sideChainData.end());
+	data->id = block.m_sidechainId;
 
 	data->ancestor_hashes.reserve(block.m_uncles.size() + 1);
 	data->ancestor_hashes = block.m_uncles;
 	data->ancestor_hashes.push_back(block.m_parent);
 
-	LOGINFO(5, "Broadcasting block " << block.m_sidechainId << " (height " << block.m_sidechainHeight << "): " << data->pruned_blob.size() << '/' << data->blob.size() << " bytes (pruned/full)");
+	LOGINFO(5, "Broadcasting block " << block.m_sidechainId << " (height " << block.m_sidechainHeight << "): " << (data->compact_blob ? data->compact_blob->m_data.size() : 0) << '/' << data->pruned_blob->m_data.size() << '/' << data->blob->m_data.size() << " bytes (compact/pruned/full)");
 
 	{
 		MutexLock lock(m_broadcastLock);
 		m_broadcastQueue.push_back(data);
 	}
 
+	metrics::add(metrics::P2P_BLOCKS_BROADCAST);
+
 	if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&m_broadcastAsync))) {
 		return;
 	}
@@ -637,47 +917,62 @@ void P2PServer::on_broadcast()
 		}
 
 		for (Broadcast* data : broadcast_queue) {
-			send(client, [client, data](void* buf) {
-				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-				uint8_t* p = p0;
+			// It sent this block to us, or we sent it before
+			if (client->m_knownBlocks.contains(data->id)) {
+				LOGINFO(6, "peer " << log::Gray() << static_cast<char*>(client->m_addrString) << log::NoColor() << " already has block " << data->id << ", not sending it");
+				continue;
+			}
 
-				bool send_pruned = true;
+			bool send_pruned = true;
 
-				const hash* a = client->m_broadcastedHashes;
-				const hash* b = client->m_broadcastedHashes + array_size(&P2PClient::m_broadcastedHashes);
+			const hash* a = client->m_broadcastedHashes;
+			const hash* b = client->m_broadcastedHashes + array_size(&P2PClient::m_broadcastedHashes);
 
-				for (const hash& id : data->ancestor_hashes) {
-					if (std::find(a, b, id) == b) {
-						send_pruned = false;
-						break;
-					}
+			for (const hash& id : data->ancestor_hashes) {
+				if (std::find(a, b, id) == b) {
+					send_pruned = false;
+					break;
 				}
+			}
+
+			SharedBuf* payload;
+			MessageId id = MessageId::BLOCK_BROADCAST;
 
-				if (send_pruned) {
-					LOGINFO(6, "sending BLOCK_BROADCAST (pruned) to " << log::Gray() << static_cast<char*>(client->m_addrString));
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+			if (send_pruned && data->compact_blob && (client->m_protocolVersion >= PROTOCOL_VERSION_1_2)) {
+				LOGINFO(6, "sending BLOCK_BROADCAST_COMPACT  to " << log::Gray() << static_cast<char*>(client->m_addrString));
+				payload = data->compact_blob;
+				id = MessageId::BLOCK_BROADCAST_COMPACT;
+			}
+			else if (send_pruned) {
+				LOGINFO(6, "sending BLOCK_BROADCAST (pruned) to " << log::Gray() << static_cast<char*>(client->m_addrString));
+				payload = data->pruned_blob;
+			}
+			else {
+				LOGINFO(5, "sending BLOCK_BROADCAST (full)   to " << log::Gray() << static_cast<char*>(client->m_addrString));
+				payload = data->blob;
+			}
 
-					*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(data->pruned_blob.size());
-					p += sizeof(uint32_t);
+			uint8_t header[1 + sizeof(uint32_t)];
+			header[0] = static_cast<uint8_t>(id);
 
-					memcpy(p, data->pruned_blob.data(), data->pruned_blob.size());
-					p += data->pruned_blob.size();
-				}
-				else {
-					LOGINFO(5, "sending BLOCK_BROADCAST (full)   to " << log::Gray() << static_cast<char*>(client->m_addrString));
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+			const uint32_t payload_size = static_cast<uint32_t>(payload->m_data.size());
+			memcpy(header + 1, &payload_size, sizeof(uint32_t));
 
-					*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(data->blob.size());
-					p += sizeof(uint32_t);
+			if (send_shared(client, header, sizeof(header), payload)) {
+				client->m_knownBlocks.insert(data->id);
+				metrics::add(metrics::P2P_BLOCKS_SENT);
 
-					memcpy(p, data->blob.data(), data->blob.size());
-					p += data->blob.size();
+				if ((id == MessageId::BLOCK_BROADCAST_COMPACT) && (client->m_fullBroadcastRequestsAllowed < BLOCK_BROADCAST_FULL_REQUESTS_MAX)) {
+					++client->m_fullBroadcastRequestsAllowed;
 				}
-
-				return p - p0;
-				});
+			}
 		}
 	}
+
+	const uint64_t t = metrics::now_us();
+	for (const Broadcast* data : broadcast_queue) {
+		metrics::observe(metrics::P2P_BROADCAST_DELAY, t - data->start_time);
+	}
 }
 
 uint64_t P2PServer::get_random64()
@@ -686,6 +981,18 @@ uint64_t P2PServer::get_random64()
 	return m_rng();
 }
 
+void P2PServer::print_queues()
+{
+	size_t broadcast_queue_size;
+	{
+		MutexLock lock(m_broadcastLock);
+		broadcast_queue_size = m_broadcastQueue.size();
+	}
+
+	LOGINFO(0, "broadcast queue " << broadcast_queue_size << ", blocks being synced " << m_syncPendingBlocks.load() << " (max " << SYNC_MAX_PENDING_BLOCKS << ')');
+	TCPServer::print_queues();
+}
+
 void P2PServer::print_status()
 {
 	const int64_t uptime = time(nullptr) - m_pool->start_time();
@@ -704,10 +1011,21 @@ void P2PServer::print_status()
 	s1 << h << "h " << m << "m " << s << 's';
 
 	LOGINFO(0, "status" <<
-		"\nConnections    = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)" <<
+		"\nConnections    = " << m_numConnections.load() << " (" << m_numIncomingConnections.load() << " incoming)" <<
 		"\nPeer list size = " << m_peerList.size() <<
 		"\nUptime         = " << log::const_buf(buf, s1.m_pos)
 	);
+
+	static constexpr const char* stage_names[NUM_SYNC_STAGES] = { "deserialize", "PoW", "add" };
+
+	for (int i = 0; i < NUM_SYNC_STAGES; ++i) {
+		const uint64_t n = m_syncStats[i].blocks.load();
+		const uint64_t t = m_syncStats[i].busy_time_us.load();
+
+		// Throughput of a single job, multiply by the number of parallel jobs to get the stage's peak throughput
+		LOGINFO(0, "sync " << stage_names[i] << ": " << n << " blocks, " << (t ? (n * 1000000 / t) : 0) << " blocks/s per job, up to " << m_syncMaxJobs[i] << " jobs");
+	}
+	LOGINFO(0, "sync pipeline: " << m_syncPendingBlocks.load() << " blocks pending" << (sync_backpressure() ? ", block requests paused" : ""));
 }
 
 void P2PServer::show_peers()
@@ -716,7 +1034,7 @@ void P2PServer::show_peers()
 
 	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
 		if (client->m_listenPort >= 0) {
-			LOGINFO(0, (client->m_isIncoming ? "I " : "O ") << client->m_pingTime << " ms\t" << static_cast<char*>(client->m_addrString));
+			LOGINFO(0, (client->m_isIncoming ? "I " : "O ") << client->m_pingTime << " ms\t" << client->m_blockRequestRtt / 1000 << " ms block rtt\t" << static_cast<char*>(client->m_addrString));
 		}
 	}
 }
@@ -747,18 +1065,22 @@ void P2PServer::flush_cache()
 	struct Work
 	{
 		uv_work_t req;
-		BlockCache* cache;
+		P2PServer* server;
 	};
 
 	Work* work = new Work{};
 	work->req.data = work;
-	work->cache = m_cache;
+	work->server = this;
 
 	const int err = uv_queue_work(&m_loop, &work->req,
 		[](uv_work_t* req)
 		{
 			bkg_jobs_tracker.start("P2PServer::flush_cache");
-			reinterpret_cast<Work*>(req->data)->cache->flush();
+			P2PServer* server = reinterpret_cast<Work*>(req->data)->server;
+			server->m_cache->flush();
+
+			// Blocks listed in the snapshot must be in the cache, so save it after the cache is flushed
+			server->save_snapshot();
 		},
 		[](uv_work_t* req, int)
 		{
@@ -772,8 +1094,66 @@ void P2PServer::flush_cache()
 	}
 }
 
+void P2PServer::save_snapshot()
+{
+	std::vector<uint8_t> data;
+	m_pool->side_chain().get_snapshot(data);
+
+	if (data.empty()) {
+		return;
+	}
+
+	// Write it to a temporary file first, so a crash never leaves a half-written snapshot
+	const std::string tmp_name = std::string(snapshot_file_name) + ".tmp";
+	{
+		std::ofstream f(tmp_name, std::ios::binary);
+		if (!f.is_open()) {
+			LOGERR(1, "failed to save sidechain snapshot");
+			return;
+		}
+		f.write(reinterpret_cast<const char*>(data.data()), data.size());
+	}
+
+	std::remove(snapshot_file_name);
+	if (std::rename(tmp_name.c_str(), snapshot_file_name) != 0) {
+		LOGERR(1, "failed to rename " << tmp_name << " to " << snapshot_file_name);
+		return;
+	}
+
+	LOGINFO(5, "sidechain snapshot saved (" << data.size() << " bytes)");
+}
+
+void P2PServer::load_snapshot()
+{
+	std::ifstream f(snapshot_file_name, std::ios::binary | std::ios::ate);
+	if (!f.is_open()) {
+		return;
+	}
+
+	std::vector<uint8_t> data(static_cast<size_t>(f.tellg()));
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(data.data()), data.size());
+
+	if (!f.good()) {
+		LOGWARN(1, "failed to read " << snapshot_file_name);
+		return;
+	}
+
+	using namespace std::chrono;
+	const auto start_time = steady_clock::now();
+
+	if (m_pool->side_chain().restore_snapshot(data, m_cachedBlocks)) {
+		LOGINFO(1, "sidechain state restored from " << snapshot_file_name << " in " << duration_cast<milliseconds>(steady_clock::now() - start_time).count() << " ms");
+	}
+}
+
 void P2PServer::download_missing_blocks()
 {
+	if (sync_backpressure()) {
+		LOGINFO(5, "sync pipeline is full, not requesting missing blocks");
+		return;
+	}
+
 	std::vector<hash> missing_blocks;
 	m_pool->side_chain().get_missing_blocks(missing_blocks);
 
@@ -804,40 +1184,105 @@ void P2PServer::download_missing_blocks()
 		return;
 	}
 
-	// Try to download each block from a random client
-	for (const hash& id : missing_blocks) {
-		P2PClient* client = clients[get_random64() % clients.size()];
+	using namespace std::chrono;
+	const steady_clock::time_point now = steady_clock::now();
 
-		{
-			MutexLock lock2(m_missingBlockRequestsLock);
+	// Ask the peer that will most likely answer first, and if it doesn't answer in time, ask the next best one
+	std::vector<std::vector<hash>> requests(clients.size());
+	std::vector<bool> timed_out(clients.size(), false);
+	size_t num_requests = 0;
+
+	{
+		MutexLock lock2(m_missingBlockRequestsLock);
+
+		unordered_map<uint64_t, MissingBlockRequest> missing_block_requests;
+		missing_block_requests.reserve(missing_blocks.size());
 
+		for (const hash& id : missing_blocks) {
 			const uint64_t truncated_block_id = *reinterpret_cast<const uint64_t*>(id.h);
-			if (!m_missingBlockRequests.insert({ client->m_peerId, truncated_block_id }).second) {
-				// We already asked this peer about this block
-				// Don't try to ask another peer, leave it for another timer tick
+
+			bool retry = false;
+			uint64_t skip_peer_id = 0;
+
+			auto it = m_missingBlockRequests.find(truncated_block_id);
+			if (it != m_missingBlockRequests.end()) {
+				const MissingBlockRequest& request = it->second;
+
+				if (duration_cast<milliseconds>(now - request.m_time).count() < BLOCK_REQUEST_TIMEOUT_MS) {
+					missing_block_requests.emplace(truncated_block_id, request);
+					continue;
+				}
+
+				retry = true;
+				skip_peer_id = request.m_peerId;
+
+				for (size_t i = 0; i < clients.size(); ++i) {
+					if ((clients[i]->m_peerId == skip_peer_id) && !timed_out[i]) {
+						LOGINFO(5, "peer " << static_cast<char*>(clients[i]->m_addrString) << " didn't send block " << id << " in time, asking another peer");
+						clients[i]->on_block_request_timeout();
+						timed_out[i] = true;
+					}
+				}
+			}
+
+			size_t best_index = clients.size();
+			int64_t best_score = std::numeric_limits<int64_t>::max();
+
+			for (size_t i = 0; i < clients.size(); ++i) {
+				P2PClient* client = clients[i];
+				const uint32_t extra_blocks = static_cast<uint32_t>(requests[i].size());
+
+				if (client->m_blocksInFlight + extra_blocks >= BLOCK_REQUEST_MAX_IN_FLIGHT) {
+					continue;
+				}
+
+				// Don't ask the same peer again unless it's the only one we have
+				if (retry && (clients.size() > 1) && (client->m_peerId == skip_peer_id)) {
+					continue;
+				}
+
+				const int64_t score = client->block_request_score(extra_blocks);
+				if (score < best_score) {
+					best_index = i;
+					best_score = score;
+				}
+			}
+
+			// All peers are busy, leave it for another timer tick
+			if (best_index >= clients.size()) {
 				continue;
 			}
+
+			missing_block_requests.emplace(truncated_block_id, MissingBlockRequest{ clients[best_index]->m_peerId, now });
+
+			if (requests[best_index].empty()) {
+				++num_requests;
+			}
+			requests[best_index].push_back(id);
 		}
 
-		send(client,
-			[&id](void* buf)
-			{
-				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-				uint8_t* p = p0;
+		m_missingBlockRequests = std::move(missing_block_requests);
+	}
 
-				LOGINFO(5, "sending BLOCK_REQUEST for id = " << id);
-				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+	if (num_requests == 0) {
+		return;
+	}
 
-				memcpy(p, id.h, HASH_SIZE);
-				p += HASH_SIZE;
+	// Split what's left of the sync pipeline's capacity between the peers we ask
+	const size_t max_blocks = (SYNC_MAX_PENDING_BLOCKS - m_syncPendingBlocks.load()) / num_requests;
 
-				return p - p0;
-			});
+	for (size_t i = 0; i < clients.size(); ++i) {
+		clients[i]->send_block_requests(requests[i], max_blocks);
 	}
 }
 
 void P2PServer::check_zmq()
 {
+	// Failover between monerod hosts reacts faster than the warning below
+	if ((m_timerCounter % 5) == 0) {
+		m_pool->check_hosts();
+	}
+
 	if ((m_timerCounter % 30) != 0) {
 		return;
 	}
@@ -859,6 +1304,7 @@ P2PServer::P2PClient::P2PClient()
 	, m_handshakeComplete(false)
 	, m_handshakeInvalid(false)
 	, m_listenPort(-1)
+	, m_protocolVersion(PROTOCOL_VERSION_1_0)
 	, m_nextPeerListRequest(0)
 	, m_lastPeerListRequestTime{}
 	, m_peerListPendingRequests(0)
@@ -866,7 +1312,17 @@ P2PServer::P2PClient::P2PClient()
 	, m_lastAlive(0)
 	, m_lastBroadcastTimestamp(0)
 	, m_lastBlockrequestTimestamp(0)
+	, m_blocksInFlight(0)
+	, m_waitingForFirstBlock(false)
+	, m_blockRequestRtt(0)
+	, m_blockResponseTime(0)
+	, m_blockRequestSentTime{}
+	, m_lastBlockResponseTime{}
+	, m_blockRequestBudget(0)
+	, m_blockRequestBudgetTime{}
+	, m_fullBroadcastRequestsAllowed(0)
 	, m_broadcastedHashes{}
+	, m_trafficConnectionId(0)
 {
 }
 
@@ -885,6 +1341,7 @@ void P2PServer::P2PClient::reset()
 	m_handshakeComplete = false;
 	m_handshakeInvalid = false;
 	m_listenPort = -1;
+	m_protocolVersion = PROTOCOL_VERSION_1_0;
 	m_nextPeerListRequest = 0;
 	m_lastPeerListRequestTime = {};
 	m_peerListPendingRequests = 0;
@@ -892,11 +1349,22 @@ void P2PServer::P2PClient::reset()
 	m_lastAlive = 0;
 	m_lastBroadcastTimestamp = 0;
 	m_lastBlockrequestTimestamp = 0;
+	m_blocksInFlight = 0;
+	m_waitingForFirstBlock = false;
+	m_blockRequestRtt = 0;
+	m_blockResponseTime = 0;
+	m_blockRequestSentTime = {};
+	m_lastBlockResponseTime = {};
+	m_blockRequestBudget = 0;
+	m_blockRequestBudgetTime = {};
+	m_fullBroadcastRequestsAllowed = 0;
 
 	for (hash& h : m_broadcastedHashes) {
 		h = {};
 	}
 	m_broadcastedHashesIndex = 0;
+	m_knownBlocks.clear();
+	m_trafficConnectionId = 0;
 }
 
 bool P2PServer::P2PClient::on_connect()
@@ -913,6 +1381,11 @@ bool P2PServer::P2PClient::on_connect()
 	}
 
 	m_lastAlive = time(nullptr);
+
+	if (traffic::is_recording()) {
+		m_trafficConnectionId = traffic::new_connection_id();
+	}
+
 	return send_handshake_challenge();
 }
 
@@ -923,7 +1396,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 		return false;
 	}
 
-	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + m_readBufSize)) {
 		LOGERR(1, "peer " << static_cast<char*>(m_addrString) << " invalid data pointer or size in on_read()");
 		ban(DEFAULT_BAN_TIME);
 		server->remove_peer_from_list(this);
@@ -1018,6 +1491,31 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 			}
 			break;
 
+		case MessageId::BLOCK_REQUEST_BATCH:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_REQUEST_BATCH");
+
+			// 1 byte number of ids, 2 bytes max number of blocks to send, 8 bytes min height, then the ids
+			if (bytes_left >= 1 + 1 + sizeof(uint16_t) + sizeof(uint64_t)) {
+				const uint32_t num_ids = buf[1];
+				if ((num_ids == 0) || (num_ids > BLOCK_REQUEST_BATCH_MAX_IDS)) {
+					LOGWARN(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent an invalid BLOCK_REQUEST_BATCH (" << num_ids << " ids)");
+					ban(DEFAULT_BAN_TIME);
+					server->remove_peer_from_list(this);
+					return false;
+				}
+
+				const uint32_t msg_size = 1 + 1 + sizeof(uint16_t) + sizeof(uint64_t) + num_ids * HASH_SIZE;
+				if (bytes_left >= msg_size) {
+					bytes_read = msg_size;
+					if (!on_block_request_batch(buf + 1)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
 		case MessageId::BLOCK_RESPONSE:
 			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_RESPONSE");
 
@@ -1050,22 +1548,51 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 			}
 			break;
 
-		case MessageId::PEER_LIST_REQUEST:
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent PEER_LIST_REQUEST");
+		case MessageId::BLOCK_BROADCAST_COMPACT:
+			LOGINFO(6, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_BROADCAST_COMPACT");
 
-			if (bytes_left >= 1) {
-				bytes_read = 1;
-				if (!on_peer_list_request(buf + 1)) {
-					ban(DEFAULT_BAN_TIME);
-					server->remove_peer_from_list(this);
-					return false;
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t block_size = *reinterpret_cast<uint32_t*>(buf + 1);
+				if (bytes_left >= 1 + sizeof(uint32_t) + block_size) {
+					bytes_read = 1 + sizeof(uint32_t) + block_size;
+					if (!on_block_broadcast_compact(buf + 1 + sizeof(uint32_t), block_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
 				}
 			}
 			break;
 
-		case MessageId::PEER_LIST_RESPONSE:
-			if (m_peerListPendingRequests <= 0) {
-				LOGWARN(4, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent an unexpected PEER_LIST_RESPONSE");
+		case MessageId::BLOCK_BROADCAST_FULL_REQUEST:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_BROADCAST_FULL_REQUEST");
+
+			if (bytes_left >= 1 + HASH_SIZE) {
+				bytes_read = 1 + HASH_SIZE;
+				if (!on_block_broadcast_full_request(buf + 1)) {
+					ban(DEFAULT_BAN_TIME);
+					server->remove_peer_from_list(this);
+					return false;
+				}
+			}
+			break;
+
+		case MessageId::PEER_LIST_REQUEST:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent PEER_LIST_REQUEST");
+
+			if (bytes_left >= 1) {
+				bytes_read = 1;
+				if (!on_peer_list_request(buf + 1)) {
+					ban(DEFAULT_BAN_TIME);
+					server->remove_peer_from_list(this);
+					return false;
+				}
+			}
+			break;
+
+		case MessageId::PEER_LIST_RESPONSE:
+			if (m_peerListPendingRequests <= 0) {
+				LOGWARN(4, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent an unexpected PEER_LIST_RESPONSE");
 				ban(DEFAULT_BAN_TIME);
 				server->remove_peer_from_list(this);
 				return false;
@@ -1100,6 +1627,9 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 		}
 
 		if (bytes_read) {
+			if (m_trafficConnectionId) {
+				traffic::record(traffic::P2P, m_trafficConnectionId, buf, bytes_read);
+			}
 			buf += bytes_read;
 			bytes_left -= bytes_read;
 			m_lastAlive = time(nullptr);
@@ -1464,13 +1994,84 @@ bool P2PServer::P2PClient::on_block_request(const uint8_t* buf)
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	std::vector<uint8_t> blob;
-	if (!server->m_pool->side_chain().get_block_blob(id, blob) && !id.empty()) {
+	SharedBuf* blob = server->m_pool->side_chain().get_block_blob(id);
+	if (blob) {
+		if (blob->m_data.size() <= block_request_budget()) {
+			m_blockRequestBudget -= blob->m_data.size();
+
+			LOGINFO(5, "sending BLOCK_RESPONSE");
+
+			const bool result = send_block_blob(MessageId::BLOCK_RESPONSE, blob);
+			blob->release();
+			return result;
+		}
+
+		blob->release();
+		LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " is over its block request budget, not sending block " << id);
+	}
+	else if (!id.empty()) {
 		LOGWARN(5, "got a request for block with id " << id << " but couldn't find it");
 	}
 
-	return server->send(this,
-		[&blob](void* buf)
+	return send_empty_block_response();
+}
+
+bool P2PServer::P2PClient::on_block_request_batch(const uint8_t* buf)
+{
+	m_lastBlockrequestTimestamp = time(nullptr);
+
+	const uint32_t num_ids = *(buf++);
+
+	uint16_t max_blocks;
+	memcpy(&max_blocks, buf, sizeof(max_blocks));
+	buf += sizeof(max_blocks);
+
+	uint64_t min_height;
+	memcpy(&min_height, buf, sizeof(min_height));
+	buf += sizeof(min_height);
+
+	std::vector<hash> ids(num_ids);
+	for (hash& id : ids) {
+		memcpy(id.h, buf, HASH_SIZE);
+		buf += HASH_SIZE;
+	}
+
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	std::vector<SharedBuf*> blobs;
+	const size_t num_missing = server->m_pool->side_chain().get_block_blobs(ids.data(), ids.size(), min_height, std::min<size_t>(max_blocks, BLOCK_REQUEST_BATCH_MAX_BLOCKS), block_request_budget(), blobs);
+
+	ON_SCOPE_LEAVE([&blobs]()
+		{
+			for (SharedBuf* blob : blobs) {
+				blob->release();
+			}
+		});
+
+	LOGINFO(5, "sending " << blobs.size() << " blocks for BLOCK_REQUEST_BATCH with " << num_ids << " ids, " << num_missing << " of them missing");
+
+	// Stream all blocks back as regular BLOCK_RESPONSE messages, the oldest ones first
+	for (SharedBuf* blob : blobs) {
+		m_blockRequestBudget -= blob->m_data.size();
+		if (!send_block_blob(MessageId::BLOCK_RESPONSE, blob)) {
+			return false;
+		}
+	}
+
+	// One empty BLOCK_RESPONSE for every requested block which wasn't sent, like on_block_request() does
+	for (size_t i = 0; i < num_missing; ++i) {
+		if (!send_empty_block_response()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool P2PServer::P2PClient::send_empty_block_response()
+{
+	return static_cast<P2PServer*>(m_owner)->send(this,
+		[](void* buf)
 		{
 			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
 			uint8_t* p = p0;
@@ -1478,37 +2079,76 @@ bool P2PServer::P2PClient::on_block_request(const uint8_t* buf)
 			LOGINFO(5, "sending BLOCK_RESPONSE");
 			*(p++) = static_cast<uint8_t>(MessageId::BLOCK_RESPONSE);
 
-			*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(blob.size());
+			*reinterpret_cast<uint32_t*>(p) = 0;
 			p += sizeof(uint32_t);
 
-			memcpy(p, blob.data(), blob.size());
-			p += blob.size();
-
 			return p - p0;
 		});
 }
 
+uint64_t P2PServer::P2PClient::block_request_budget()
+{
+	using namespace std::chrono;
+	const steady_clock::time_point now = steady_clock::now();
+
+	// The budget is full after this much time, longer times would add nothing (and could overflow)
+	constexpr int64_t full_refill_ms = static_cast<int64_t>(BLOCK_REQUEST_BUDGET_BURST_BYTES * 1000 / BLOCK_REQUEST_BUDGET_BYTES_PER_SECOND);
+
+	const int64_t elapsed_ms = std::min<int64_t>(duration_cast<milliseconds>(now - m_blockRequestBudgetTime).count(), full_refill_ms);
+	if (elapsed_ms > 0) {
+		m_blockRequestBudget = std::min(m_blockRequestBudget + static_cast<uint64_t>(elapsed_ms) * BLOCK_REQUEST_BUDGET_BYTES_PER_SECOND / 1000, BLOCK_REQUEST_BUDGET_BURST_BYTES);
+		m_blockRequestBudgetTime = now;
+	}
+
+	return m_blockRequestBudget;
+}
+
 bool P2PServer::P2PClient::on_block_response(const uint8_t* buf, uint32_t size)
 {
 	if (!size) {
 		LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent an empty block response");
+
+		// It doesn't have one of the blocks we asked for, or won't send it
+		if (m_blocksInFlight > 0) {
+			--m_blocksInFlight;
+		}
 		return true;
 	}
 
-	P2PServer* server = static_cast<P2PServer*>(m_owner);
+	using namespace std::chrono;
+	const steady_clock::time_point now = steady_clock::now();
 
-	MutexLock lock(server->m_blockLock);
+	if (m_blocksInFlight > 0) {
+		if (m_waitingForFirstBlock) {
+			const int64_t rtt = duration_cast<microseconds>(now - m_blockRequestSentTime).count();
+			m_blockRequestRtt = block_time_average(m_blockRequestRtt, rtt);
+			m_waitingForFirstBlock = false;
+		}
+		else {
+			const int64_t t = duration_cast<microseconds>(now - m_lastBlockResponseTime).count();
+			m_blockResponseTime = block_time_average(m_blockResponseTime, t);
+		}
+		--m_blocksInFlight;
+	}
+	m_lastBlockResponseTime = now;
 
-	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain());
-	if (result != 0) {
-		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
-		return false;
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	// Blocks we already have (the same block asked from several peers) don't need to go through the pipeline
+	// Blobs which can't be peeked at are queued anyway, deserialize() will reject them and the peer will be banned
+	PoolBlock::Summary summary;
+	if ((PoolBlock::peek(buf, size, summary) == 0) && server->m_pool->side_chain().block_seen(summary.m_sidechainId, summary.m_sidechainHeight, summary.m_cumulativeDifficulty)) {
+		m_knownBlocks.insert(summary.m_sidechainId);
+		LOGINFO(6, "block " << summary.m_sidechainId << " was received before, skipping it");
+		return true;
 	}
 
-	return handle_incoming_block_async(server->m_block);
+	// Deserialization, PoW check and adding to the sidechain all happen in the sync pipeline
+	server->sync_enqueue(new SyncBlock(this, buf, size));
+	return true;
 }
 
-bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
+bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size, bool* reconstruct_failed)
 {
 	if (!size) {
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted an empty block");
@@ -1516,22 +2156,35 @@ bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
 	}
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
+	SideChain& side_chain = server->m_pool->side_chain();
 
-	MutexLock lock(server->m_blockLock);
-
-	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain());
-	if (result != 0) {
+	auto invalid_block = [this, reconstruct_failed](int result)
+	{
+		// A block reconstructed from a compact broadcast can be wrong because of a short id collision in our mempool, it's not the peer's fault
+		if (reconstruct_failed) {
+			*reconstruct_failed = true;
+			return true;
+		}
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
 		return false;
+	};
+
+	// Most broadcasts in a well connected network are blocks we already have
+	// Only the fields needed to find them are read here, the full deserialize() and hashing are done for new blocks only
+	PoolBlock::Summary summary;
+	int result = PoolBlock::peek(buf, size, summary);
+	if (result != 0) {
+		return invalid_block(result);
 	}
 
-	m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = server->m_block->m_sidechainId;
+	m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = summary.m_sidechainId;
+	m_knownBlocks.insert(summary.m_sidechainId);
 
 	const MinerData& miner_data = server->m_pool->miner_data();
 
-	if (server->m_block->m_prevId != miner_data.prev_id) {
+	if (summary.m_prevId != miner_data.prev_id) {
 		// This peer is mining on top of a different Monero block, investigate it
-		const uint64_t peer_height = server->m_block->m_txinGenHeight;
+		const uint64_t peer_height = summary.m_txinGenHeight;
 		const uint64_t our_height = miner_data.height;
 
 		if (peer_height < our_height) {
@@ -1561,24 +2214,159 @@ bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
 		}
 	}
 
-	server->m_block->m_wantBroadcast = true;
-
 	m_lastBroadcastTimestamp = time(nullptr);
 
+	if (side_chain.block_seen(summary.m_sidechainId, summary.m_sidechainHeight, summary.m_cumulativeDifficulty)) {
+		LOGINFO(6, "block " << summary.m_sidechainId << " was received before, skipping it");
+		return true;
+	}
+
+	MutexLock lock(server->m_blockLock);
+
+	result = server->m_block->deserialize(buf, size, side_chain);
+	if (result != 0) {
+		return invalid_block(result);
+	}
+
+	server->m_block->m_wantBroadcast = true;
+
 	return handle_incoming_block_async(server->m_block);
 }
 
+bool P2PServer::P2PClient::on_block_broadcast_compact(const uint8_t* buf, uint32_t size)
+{
+	CompactBlock compact;
+
+	const int err = compact.parse(buf, size);
+	if (err) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted an invalid compact block, error " << err);
+		return false;
+	}
+
+	const hash& id = compact.m_id;
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	// We already have this block, no need to reconstruct it
+	if (server->m_pool->side_chain().has_block(id)) {
+		m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = id;
+		m_knownBlocks.insert(id);
+		m_lastBroadcastTimestamp = time(nullptr);
+		return true;
+	}
+
+	std::vector<uint8_t> blob;
+	uint32_t num_missing;
+
+	if (!compact.reconstruct(server->m_pool->mempool(), blob, num_missing)) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted a compact block with duplicate short ids");
+		return false;
+	}
+
+	bool reconstruct_failed = (num_missing != 0);
+
+	if (!reconstruct_failed) {
+		if (!on_block_broadcast(blob.data(), static_cast<uint32_t>(blob.size()), &reconstruct_failed)) {
+			return false;
+		}
+	}
+
+	if (reconstruct_failed) {
+		LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " broadcasted compact block " << id << ", " << num_missing << '/' << compact.m_numTransactions << " transactions unknown, requesting the full block");
+		send_block_broadcast_full_request(id);
+	}
+
+	return true;
+}
+
+bool P2PServer::P2PClient::on_block_broadcast_full_request(const uint8_t* buf)
+{
+	hash id;
+	memcpy(id.h, buf, HASH_SIZE);
+
+	// Only peers which got compact broadcasts from us have a reason to ask, and every full block counts against their block request budget
+	if (m_fullBroadcastRequestsAllowed == 0) {
+		LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " requested full broadcast of block " << id << " without a compact broadcast, ignoring it");
+		return true;
+	}
+
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	SharedBuf* blob = server->m_pool->side_chain().get_block_blob(id);
+	if (!blob) {
+		LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " requested full broadcast of unknown block " << id);
+		return true;
+	}
+
+	if (blob->m_data.size() > block_request_budget()) {
+		blob->release();
+		LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " is over its block request budget, not sending block " << id);
+		return true;
+	}
+
+	--m_fullBroadcastRequestsAllowed;
+	m_blockRequestBudget -= blob->m_data.size();
+
+	LOGINFO(5, "sending BLOCK_BROADCAST (full) after BLOCK_BROADCAST_FULL_REQUEST");
+
+	const bool result = send_block_blob(MessageId::BLOCK_BROADCAST, blob);
+	blob->release();
+	return result;
+}
+
+bool P2PServer::P2PClient::send_block_blob(MessageId id, SharedBuf* blob)
+{
+	uint8_t header[1 + sizeof(uint32_t)];
+	header[0] = static_cast<uint8_t>(id);
+
+	const uint32_t size = static_cast<uint32_t>(blob->m_data.size());
+	memcpy(header + 1, &size, sizeof(uint32_t));
+
+	return static_cast<P2PServer*>(m_owner)->send_shared(this, header, sizeof(header), blob);
+}
+
+void P2PServer::P2PClient::send_block_broadcast_full_request(const hash& id)
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	server->send(this,
+		[&id](void* buf)
+		{
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
+
+			*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST_FULL_REQUEST);
+
+			memcpy(p, id.h, HASH_SIZE);
+			p += HASH_SIZE;
+
+			return p - p0;
+		});
+}
+
 bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
 {
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
 	Peer peers[PEER_LIST_RESPONSE_MAX_PEERS];
 	uint32_t num_selected_peers = 0;
+
+	// The first entry announces our protocol version: IPv4 address 255.255.255.255, port 65535 and the version in the first 4 bytes of the address
+	// Older versions zero these bytes for IPv4 addresses and only see an unreachable peer
+	{
+		Peer& p = peers[num_selected_peers++];
+		p.m_isV6 = false;
+		memset(p.m_addr.data, 0xFF, sizeof(p.m_addr.data));
+		memcpy(p.m_addr.data, &SUPPORTED_PROTOCOL_VERSION, sizeof(SUPPORTED_PROTOCOL_VERSION));
+		memset(p.m_addr.data + sizeof(SUPPORTED_PROTOCOL_VERSION), 0, 10 - sizeof(SUPPORTED_PROTOCOL_VERSION));
+		p.m_port = 0xFFFF;
+		p.m_numFailedConnections = 0;
+		p.m_lastSeen = 0;
+	}
 	{
 		MutexLock lock(server->m_clientsListLock);
 
 		// Send every 4th peer on average, selected at random
-		const uint32_t peers_to_send_target = std::min<uint32_t>(PEER_LIST_RESPONSE_MAX_PEERS, std::max<uint32_t>(1, server->m_numConnections / 4));
+		const uint32_t peers_to_send_target = std::min<uint32_t>(PEER_LIST_RESPONSE_MAX_PEERS, std::max<uint32_t>(1, server->m_numConnections / 4) + 1);
 		uint32_t n = 0;
 
 		for (P2PClient* client = static_cast<P2PClient*>(server->m_connectedClientsList->m_next); client != server->m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
@@ -1598,8 +2386,9 @@ bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
 			uint64_t k;
 			umul128(server->get_random64(), n, &k);
 
-			if (k < peers_to_send_target) {
-				peers[k] = p;
+			// peers[0] is the protocol version entry, never replace it
+			if (k < peers_to_send_target - 1) {
+				peers[k + 1] = p;
 			}
 		}
 	}
@@ -1630,13 +2419,15 @@ bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
 		});
 }
 
-bool P2PServer::P2PClient::on_peer_list_response(const uint8_t* buf) const
+bool P2PServer::P2PClient::on_peer_list_response(const uint8_t* buf)
 {
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 	const time_t cur_time = time(nullptr);
 
 	MutexLock lock(server->m_peerListLock);
 
+	static constexpr uint8_t version_entry_tail[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
 	const uint32_t num_peers = *(buf++);
 	for (uint32_t i = 0; i < num_peers; ++i) {
 		const bool is_v6 = *(buf++) != 0;
@@ -1645,6 +2436,9 @@ bool P2PServer::P2PClient::on_peer_list_response(const uint8_t* buf) const
 		memcpy(ip.data, buf, sizeof(ip.data));
 		buf += sizeof(ip.data);
 
+		uint32_t protocol_version;
+		memcpy(&protocol_version, ip.data, sizeof(protocol_version));
+
 		// Fill in default bytes for IPv4 addresses
 		if (!is_v6) {
 			memset(ip.data, 0, 10);
@@ -1656,6 +2450,13 @@ bool P2PServer::P2PClient::on_peer_list_response(const uint8_t* buf) const
 		memcpy(&port, buf, 2);
 		buf += 2;
 
+		// Protocol version entry, see on_peer_list_request()
+		if (!is_v6 && (port == 0xFFFF) && (memcmp(version_entry_tail, ip.data + 10, sizeof(version_entry_tail)) == 0)) {
+			m_protocolVersion = protocol_version;
+			LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " supports protocol version " << (m_protocolVersion >> 16) << '.' << (m_protocolVersion & 0xFFFF));
+			continue;
+		}
+
 		bool already_added = false;
 		for (Peer& p : server->m_peerList) {
 			if ((p.m_isV6 == is_v6) && (p.m_addr == ip)) {
@@ -1696,6 +2497,8 @@ bool P2PServer::P2PClient::handle_incoming_block_async(PoolBlock* block)
 	Work* work = new Work{ {}, *block, this, server, m_resetCounter.load(), m_addr, {} };
 	work->req.data = work;
 
+	bkg_jobs_tracker.queue("P2PServer::handle_incoming_block_async");
+
 	const int err = uv_queue_work(&server->m_loop, &work->req,
 		[](uv_work_t* req)
 		{
@@ -1713,6 +2516,7 @@ bool P2PServer::P2PClient::handle_incoming_block_async(PoolBlock* block)
 
 	if (err != 0) {
 		LOGERR(1, "handle_incoming_block_async: uv_queue_work failed, error " << uv_err_name(err));
+		bkg_jobs_tracker.unqueue("P2PServer::handle_incoming_block_async");
 		delete work;
 		return false;
 	}
@@ -1753,8 +2557,19 @@ void P2PServer::P2PClient::post_handle_incoming_block(const uint32_t reset_count
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
+	// Sync pipeline is full, download_missing_blocks() will request these blocks later
+	if (server->sync_backpressure()) {
+		return;
+	}
+
 	ReadLock lock(server->m_cachedBlocksLock);
 
+	std::vector<hash> ids;
+	ids.reserve(missing_blocks.size());
+
+	using namespace std::chrono;
+	const steady_clock::time_point now = steady_clock::now();
+
 	for (const hash& id : missing_blocks) {
 		auto it = server->m_cachedBlocks.find(id);
 		if (it != server->m_cachedBlocks.end()) {
@@ -1763,25 +2578,336 @@ void P2PServer::P2PClient::post_handle_incoming_block(const uint32_t reset_count
 			continue;
 		}
 
-		const bool result = m_owner->send(this,
-			[&id](void* buf)
+		// Ask this peer because it has the block for sure, unless someone else was asked recently
+		{
+			MutexLock lock2(server->m_missingBlockRequestsLock);
+
+			const uint64_t truncated_block_id = *reinterpret_cast<const uint64_t*>(id.h);
+			auto it2 = server->m_missingBlockRequests.find(truncated_block_id);
+
+			if ((it2 != server->m_missingBlockRequests.end()) && (duration_cast<milliseconds>(now - it2->second.m_time).count() < BLOCK_REQUEST_TIMEOUT_MS)) {
+				continue;
+			}
+
+			server->m_missingBlockRequests[truncated_block_id] = MissingBlockRequest{ m_peerId, now };
+		}
+
+		ids.push_back(id);
+	}
+
+	send_block_requests(ids, SYNC_MAX_PENDING_BLOCKS - server->m_syncPendingBlocks.load());
+}
+
+int64_t P2PServer::P2PClient::block_request_score(uint32_t extra_blocks) const
+{
+	// Until we get the first block from this peer, use the peer list round trip time
+	int64_t rtt = m_blockRequestRtt;
+	if (!rtt) {
+		rtt = (m_pingTime > 0) ? (m_pingTime * 1000) : (BLOCK_REQUEST_TIMEOUT_MS * 100);
+	}
+
+	const int64_t per_block = m_blockResponseTime ? m_blockResponseTime : 1000;
+
+	return rtt + static_cast<int64_t>(m_blocksInFlight + extra_blocks) * per_block;
+}
+
+void P2PServer::P2PClient::on_block_request_timeout()
+{
+	// Forget about the blocks it didn't send and make it the last choice for a while
+	m_blocksInFlight = 0;
+	m_waitingForFirstBlock = false;
+	m_blockRequestRtt = std::min(std::max(m_blockRequestRtt * 2, BLOCK_REQUEST_TIMEOUT_MS * 1000), BLOCK_REQUEST_MAX_RTT_US);
+}
+
+bool P2PServer::P2PClient::send_block_requests(const std::vector<hash>& ids, size_t max_blocks)
+{
+	if (ids.empty()) {
+		return true;
+	}
+
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	if (m_blocksInFlight == 0) {
+		m_blockRequestSentTime = std::chrono::steady_clock::now();
+		m_waitingForFirstBlock = true;
+	}
+	m_blocksInFlight += static_cast<uint32_t>(ids.size());
+
+	if (m_protocolVersion < PROTOCOL_VERSION_1_1) {
+		for (const hash& id : ids) {
+			const bool result = server->send(this,
+				[&id](void* buf)
+				{
+					uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+					uint8_t* p = p0;
+
+					LOGINFO(5, "sending BLOCK_REQUEST for id = " << id);
+					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+
+					memcpy(p, id.h, HASH_SIZE);
+					p += HASH_SIZE;
+
+					return p - p0;
+				});
+
+			if (!result) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Blocks up to our chain tip height are most likely already in our sidechain, don't ask for their ancestors
+	const uint64_t min_height = server->m_pool->side_chain().chain_tip_height();
+
+	for (size_t i = 0; i < ids.size(); i += BLOCK_REQUEST_BATCH_MAX_IDS) {
+		const size_t num_ids = std::min(ids.size() - i, BLOCK_REQUEST_BATCH_MAX_IDS);
+
+		// The peer always sends the requested blocks, the rest is filled with their ancestors
+		const uint16_t num_blocks = static_cast<uint16_t>(std::max(num_ids, std::min(max_blocks, BLOCK_REQUEST_BATCH_MAX_BLOCKS)));
+
+		const bool result = server->send(this,
+			[&ids, i, num_ids, num_blocks, min_height](void* buf)
 			{
 				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
 				uint8_t* p = p0;
 
-				LOGINFO(5, "sending BLOCK_REQUEST for id = " << id);
-				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+				LOGINFO(5, "sending BLOCK_REQUEST_BATCH for " << num_ids << " ids, up to " << num_blocks << " blocks");
+				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST_BATCH);
+				*(p++) = static_cast<uint8_t>(num_ids);
+
+				memcpy(p, &num_blocks, sizeof(num_blocks));
+				p += sizeof(num_blocks);
 
-				memcpy(p, id.h, HASH_SIZE);
-				p += HASH_SIZE;
+				memcpy(p, &min_height, sizeof(min_height));
+				p += sizeof(min_height);
+
+				for (size_t j = 0; j < num_ids; ++j) {
+					memcpy(p, ids[i + j].h, HASH_SIZE);
+					p += HASH_SIZE;
+				}
 
 				return p - p0;
 			});
 
 		if (!result) {
-			return;
+			return false;
+		}
+
+		max_blocks = (max_blocks > num_blocks) ? (max_blocks - num_blocks) : 0;
+	}
+
+	return true;
+}
+
+bool P2PServer::sync_enqueue(SyncBlock* block)
+{
+	// Peers only send BLOCK_RESPONSE when asked, and we stop asking at SYNC_MAX_PENDING_BLOCKS
+	// Anything far above that limit is unsolicited, drop it instead of queueing it
+	if (m_syncPendingBlocks.load() >= SYNC_MAX_PENDING_BLOCKS * 4) {
+		LOGWARN(4, "sync pipeline is full, dropping a block from peer " << static_cast<char*>(block->client->m_addrString));
+		delete block;
+		return false;
+	}
+
+	++m_syncPendingBlocks;
+	m_syncQueue[SYNC_DESERIALIZE].push_back(block);
+
+	sync_pump();
+	return true;
+}
+
+void P2PServer::sync_pump()
+{
+	struct Work
+	{
+		uv_work_t req;
+		P2PServer* server;
+		SyncStage stage;
+		std::vector<SyncBlock*> blocks;
+	};
+
+	// Start from the last stage so blocks already in the pipeline are finished first
+	for (int i = NUM_SYNC_STAGES - 1; i >= 0; --i) {
+		const SyncStage stage = static_cast<SyncStage>(i);
+		std::deque<SyncBlock*>& queue = m_syncQueue[stage];
+
+		while (!queue.empty() && (m_syncJobs[stage] < m_syncMaxJobs[stage])) {
+			// Don't run this stage if the next stage's queue is full
+			if ((stage + 1 < NUM_SYNC_STAGES) && (m_syncQueue[stage + 1].size() >= SYNC_STAGE_QUEUE_SIZE)) {
+				break;
+			}
+
+			const size_t n = std::min(queue.size(), SYNC_BATCH_SIZE);
+
+			Work* work = new Work{ {}, this, stage, std::vector<SyncBlock*>(queue.begin(), queue.begin() + n) };
+			work->req.data = work;
+
+			const int err = uv_queue_work(&m_loop, &work->req,
+				[](uv_work_t* req)
+				{
+					bkg_jobs_tracker.start("P2PServer::sync_pump");
+					Work* work = reinterpret_cast<Work*>(req->data);
+					work->server->sync_run_job(work->stage, work->blocks);
+				},
+				[](uv_work_t* req, int /*status*/)
+				{
+					Work* work = reinterpret_cast<Work*>(req->data);
+					work->server->sync_job_done(work->stage, work->blocks);
+					delete work;
+					bkg_jobs_tracker.stop("P2PServer::sync_pump");
+				});
+
+			if (err) {
+				LOGERR(1, "sync_pump: uv_queue_work failed, error " << uv_err_name(err));
+				delete work;
+				return;
+			}
+
+			queue.erase(queue.begin(), queue.begin() + n);
+			++m_syncJobs[stage];
+		}
+	}
+}
+
+void P2PServer::sync_run_job(SyncStage stage, std::vector<SyncBlock*>& blocks)
+{
+	using namespace std::chrono;
+	const auto start_time = steady_clock::now();
+
+	switch (stage) {
+	case SYNC_DESERIALIZE:
+		for (SyncBlock* b : blocks) {
+			const int result = b->block.deserialize(b->blob.data(), b->blob.size(), m_pool->side_chain());
+			if (result != 0) {
+				LOGWARN(3, "peer " << static_cast<const char*>(b->client_addr) << " sent an invalid block, error " << result);
+			}
+			b->ok = (result == 0);
+			std::vector<uint8_t>().swap(b->blob);
+		}
+		break;
+
+	case SYNC_POW:
+		sync_check_pow(blocks);
+		break;
+
+	case SYNC_ADD:
+		for (SyncBlock* b : blocks) {
+			b->client->handle_incoming_block(m_pool, b->block, b->client_reset_counter, b->client_ip, b->missing_blocks);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	m_syncStats[stage].blocks += blocks.size();
+	m_syncStats[stage].busy_time_us += duration_cast<microseconds>(steady_clock::now() - start_time).count();
+}
+
+void P2PServer::sync_check_pow(std::vector<SyncBlock*>& blocks)
+{
+	struct Blob
+	{
+		uint8_t data[128];
+		size_t size;
+	};
+
+	std::vector<Blob> blobs(blocks.size());
+	std::vector<RandomX_Hasher::PowJob> jobs;
+	std::vector<PoolBlock*> job_blocks;
+
+	jobs.reserve(blocks.size());
+	job_blocks.reserve(blocks.size());
+
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		PoolBlock& block = blocks[i]->block;
+
+		hash seed;
+		if (!m_pool->get_seed(block.m_txinGenHeight, seed)) {
+			// add_external_block() will deal with it
+			continue;
+		}
+
+		if (block.m_powHashTrusted && (block.m_powSeed == seed)) {
+			continue;
+		}
+
+		Blob& blob = blobs[i];
+		if (block.get_hashing_blob(blob.data, blob.size)) {
+			jobs.emplace_back(blob.data, blob.size, seed);
+			job_blocks.push_back(&block);
+		}
+	}
+
+	if (jobs.empty()) {
+		return;
+	}
+
+	// Hash the whole batch on one VM, add_external_block() will then use these results instead of calculating PoW again
+	m_pool->hasher()->calculate_batch(jobs);
+
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		if (jobs[i].ok) {
+			PoolBlock* block = job_blocks[i];
+			block->m_powHash = jobs[i].result;
+			block->m_powSeed = jobs[i].seed;
+			block->m_powHashTrusted = true;
+		}
+	}
+}
+
+void P2PServer::sync_job_done(SyncStage stage, std::vector<SyncBlock*>& blocks)
+{
+	--m_syncJobs[stage];
+
+	for (SyncBlock* b : blocks) {
+		switch (stage) {
+		case SYNC_DESERIALIZE:
+			// The peer has this block, don't broadcast it back
+			if (b->ok && (b->client_reset_counter == b->client->m_resetCounter.load())) {
+				b->client->m_knownBlocks.insert(b->block.m_sidechainId);
+			}
+
+			if (!b->ok) {
+				// Client sent bad data, disconnect and ban it
+				if (b->client_reset_counter == b->client->m_resetCounter.load()) {
+					b->client->ban(DEFAULT_BAN_TIME);
+					b->client->close();
+				}
+				else {
+					ban(b->client_ip, DEFAULT_BAN_TIME);
+				}
+				remove_peer_from_list(b->client_ip);
+			}
+			else if (m_pool->side_chain().block_seen(b->block)) {
+				LOGINFO(6, "block " << b->block.m_sidechainId << " was received before, skipping it");
+			}
+			else {
+				m_syncQueue[SYNC_POW].push_back(b);
+				continue;
+			}
+			break;
+
+		case SYNC_POW:
+			m_syncQueue[SYNC_ADD].push_back(b);
+			continue;
+
+		case SYNC_ADD:
+			--m_syncPendingBlocks;
+			b->client->post_handle_incoming_block(b->client_reset_counter, b->missing_blocks);
+			delete b;
+			continue;
+
+		default:
+			break;
 		}
+
+		--m_syncPendingBlocks;
+		delete b;
 	}
+
+	sync_pump();
 }
 
 } // namespace p2pool
@@ -19,17 +19,76 @@
 
 #include "tcp_server.h"
 #include <random>
+#include <deque>
 
 namespace p2pool {
 
 class p2pool;
 struct PoolBlock;
 class BlockCache;
+class Mempool;
 
 static constexpr size_t P2P_BUF_SIZE = 128 * 1024;
 static constexpr size_t PEER_LIST_RESPONSE_MAX_PEERS = 16;
 static constexpr int DEFAULT_P2P_PORT = 37889;
 
+static constexpr uint32_t PROTOCOL_VERSION_1_0 = 0x00010000UL;
+static constexpr uint32_t PROTOCOL_VERSION_1_1 = 0x00010001UL;
+static constexpr uint32_t PROTOCOL_VERSION_1_2 = 0x00010002UL;
+static constexpr uint32_t SUPPORTED_PROTOCOL_VERSION = PROTOCOL_VERSION_1_2;
+
+// BLOCK_REQUEST_BATCH (protocol version 1.1): up to BLOCK_REQUEST_BATCH_MAX_IDS ids per message,
+// the answer is at most BLOCK_REQUEST_BATCH_MAX_BLOCKS regular BLOCK_RESPONSE messages
+static constexpr size_t BLOCK_REQUEST_BATCH_MAX_IDS = 64;
+static constexpr size_t BLOCK_REQUEST_BATCH_MAX_BLOCKS = 512;
+
+// How much block data one peer can download from us with block requests: the budget refills at this rate up to the burst size
+static constexpr uint64_t BLOCK_REQUEST_BUDGET_BYTES_PER_SECOND = 4 * 1024 * 1024;
+static constexpr uint64_t BLOCK_REQUEST_BUDGET_BURST_BYTES = 32 * 1024 * 1024;
+
+// BLOCK_BROADCAST_COMPACT (protocol version 1.2): a pruned broadcast with 8-byte salted short ids instead of transaction hashes,
+// the receiver finds them in its mempool or asks for the full block with BLOCK_BROADCAST_FULL_REQUEST
+static constexpr size_t BLOCK_BROADCAST_COMPACT_MIN_TXS = 4;
+
+// BLOCK_BROADCAST_FULL_REQUEST is answered only for compact broadcasts we sent to this peer, at most this many of them are remembered
+static constexpr uint32_t BLOCK_BROADCAST_FULL_REQUESTS_MAX = 16;
+
+// Pruned blob for BLOCK_BROADCAST and the BLOCK_BROADCAST_COMPACT payload of a block, the compact one is empty if it's not worth sending
+// Returns false if the block's mainchain data is invalid
+bool make_broadcast_blobs(const PoolBlock& block, uint64_t total_reward, uint64_t salt, std::vector<uint8_t>& pruned_blob, std::vector<uint8_t>& compact_blob);
+
+// Received BLOCK_BROADCAST_COMPACT payload, it points into the message buffer
+struct CompactBlock
+{
+	CompactBlock() : m_id(), m_salt(0), m_prefix(nullptr), m_prefixSize(0), m_numTransactions(0), m_shortIds(nullptr), m_sidechainData(nullptr), m_sidechainDataSize(0) {}
+
+	// Returns 0 if the payload is valid
+	int parse(const uint8_t* buf, uint32_t size);
+
+	// Rebuilds the pruned blob with transactions from the mempool, the blob is left empty when num_missing of them are not there
+	// Returns false if the payload has duplicate short ids
+	bool reconstruct(const Mempool& mempool, std::vector<uint8_t>& blob, uint32_t& num_missing) const;
+
+	hash m_id;
+	uint64_t m_salt;
+	const uint8_t* m_prefix;
+	uint32_t m_prefixSize;
+	uint32_t m_numTransactions;
+	const uint8_t* m_shortIds;
+	const uint8_t* m_sidechainData;
+	size_t m_sidechainDataSize;
+};
+
+// Sync pipeline limits: blocks per job, blocks waiting between two stages, and blocks in the pipeline before we stop requesting new ones
+static constexpr size_t SYNC_BATCH_SIZE = 16;
+static constexpr size_t SYNC_STAGE_QUEUE_SIZE = 256;
+static constexpr uint32_t SYNC_MAX_PENDING_BLOCKS = 1024;
+
+// Missing block downloads: block ids requested from one peer and not answered yet, and how long to wait before asking the next best peer
+static constexpr uint32_t BLOCK_REQUEST_MAX_IN_FLIGHT = 64;
+static constexpr int64_t BLOCK_REQUEST_TIMEOUT_MS = 5000;
+static constexpr int64_t BLOCK_REQUEST_MAX_RTT_US = 60 * 1000 * 1000;
+
 class P2PServer : public TCPServer<P2P_BUF_SIZE, P2P_BUF_SIZE>
 {
 public:
@@ -42,18 +101,85 @@ public:
 		BLOCK_BROADCAST = 5,
 		PEER_LIST_REQUEST = 6,
 		PEER_LIST_RESPONSE = 7,
+		BLOCK_REQUEST_BATCH = 8,
+		BLOCK_BROADCAST_COMPACT = 9,
+		BLOCK_BROADCAST_FULL_REQUEST = 10,
 	};
 
 	explicit P2PServer(p2pool *pool);
 	~P2PServer();
 
-	void add_cached_block(const PoolBlock& block);
+	// Takes ownership of the blocks
+	void add_cached_blocks(std::vector<PoolBlock*>& blocks);
 	void clear_cached_blocks();
 	void store_in_cache(const PoolBlock& block);
 
 	void connect_to_peers(const std::string& peer_list);
 	void on_connect_failed(bool is_v6, const raw_ip& ip, int port) override;
 
+	// Rolling Bloom filter of block ids a peer already has: blocks it sent us and blocks we sent to it
+	// Two generations of KNOWN_BLOCKS_PER_GENERATION ids each, about 0.1% false positives
+	struct KnownBlocks
+	{
+		enum : uint32_t {
+			KNOWN_BLOCKS_PER_GENERATION = 256,
+			NUM_BITS = 8192,
+		};
+
+		FORCEINLINE KnownBlocks() { clear(); }
+
+		FORCEINLINE void clear()
+		{
+			memset(m_bits, 0, sizeof(m_bits));
+			m_count = 0;
+		}
+
+		void insert(const hash& id)
+		{
+			if (contains(m_bits[0], id)) {
+				return;
+			}
+
+			if (m_count >= KNOWN_BLOCKS_PER_GENERATION) {
+				memcpy(m_bits[1], m_bits[0], sizeof(m_bits[0]));
+				memset(m_bits[0], 0, sizeof(m_bits[0]));
+				m_count = 0;
+			}
+
+			// Block ids are hashes, so their 32-bit words are good enough as independent hash functions
+			uint32_t k[NUM_HASHES];
+			memcpy(k, id.h, sizeof(k));
+
+			for (uint32_t i = 0; i < NUM_HASHES; ++i) {
+				const uint32_t bit = k[i] % NUM_BITS;
+				m_bits[0][bit / 64] |= 1ULL << (bit % 64);
+			}
+			++m_count;
+		}
+
+		FORCEINLINE bool contains(const hash& id) const { return contains(m_bits[0], id) || contains(m_bits[1], id); }
+
+	private:
+		enum : uint32_t { NUM_HASHES = 3 };
+
+		static FORCEINLINE bool contains(const uint64_t (&bits)[NUM_BITS / 64], const hash& id)
+		{
+			uint32_t k[NUM_HASHES];
+			memcpy(k, id.h, sizeof(k));
+
+			for (uint32_t i = 0; i < NUM_HASHES; ++i) {
+				const uint32_t bit = k[i] % NUM_BITS;
+				if ((bits[bit / 64] & (1ULL << (bit % 64))) == 0) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		uint64_t m_bits[2][NUM_BITS / 64];
+		uint32_t m_count;
+	};
+
 	struct P2PClient : public Client
 	{
 		P2PClient();
@@ -92,10 +218,31 @@ public:
 		void on_after_handshake(uint8_t* &p);
 		bool on_listen_port(const uint8_t* buf);
 		bool on_block_request(const uint8_t* buf);
+		bool on_block_request_batch(const uint8_t* buf);
 		bool on_block_response(const uint8_t* buf, uint32_t size);
-		bool on_block_broadcast(const uint8_t* buf, uint32_t size);
+		bool on_block_broadcast(const uint8_t* buf, uint32_t size, bool* reconstruct_failed = nullptr);
+		bool on_block_broadcast_compact(const uint8_t* buf, uint32_t size);
+		bool on_block_broadcast_full_request(const uint8_t* buf);
+		void send_block_broadcast_full_request(const hash& id);
 		bool on_peer_list_request(const uint8_t* buf);
-		bool on_peer_list_response(const uint8_t* buf) const;
+		bool on_peer_list_response(const uint8_t* buf);
+
+		// Sends a block message with the block's blob as is, without copying it into a write buffer
+		bool send_block_blob(MessageId id, SharedBuf* blob);
+
+		// BLOCK_RESPONSE for a block which we don't have or won't send
+		bool send_empty_block_response();
+
+		// Refills and returns how many bytes of blocks this peer can request now
+		uint64_t block_request_budget();
+
+		// Sends BLOCK_REQUEST_BATCH messages if the peer supports them, one BLOCK_REQUEST per id otherwise
+		// max_blocks limits how many blocks (requested ones and their ancestors) the peer can send back
+		bool send_block_requests(const std::vector<hash>& ids, size_t max_blocks);
+
+		// Expected time in microseconds until this peer answers a new block request with extra_blocks more blocks in flight, lower is better
+		int64_t block_request_score(uint32_t extra_blocks) const;
+		void on_block_request_timeout();
 
 		bool handle_incoming_block_async(PoolBlock* block);
 		void handle_incoming_block(p2pool* pool, PoolBlock& block, const uint32_t reset_counter, const raw_ip& addr, std::vector<hash>& missing_blocks);
@@ -108,6 +255,7 @@ public:
 		bool m_handshakeComplete;
 		bool m_handshakeInvalid;
 		int m_listenPort;
+		uint32_t m_protocolVersion;
 
 		time_t m_nextPeerListRequest;
 		std::chrono::system_clock::time_point m_lastPeerListRequestTime;
@@ -118,8 +266,30 @@ public:
 		time_t m_lastBroadcastTimestamp;
 		time_t m_lastBlockrequestTimestamp;
 
+		// Block download statistics: round trip time until the first block arrives and the time per block after that
+		// Both are moving averages in microseconds, 0 until measured
+		uint32_t m_blocksInFlight;
+		bool m_waitingForFirstBlock;
+		int64_t m_blockRequestRtt;
+		int64_t m_blockResponseTime;
+		std::chrono::steady_clock::time_point m_blockRequestSentTime;
+		std::chrono::steady_clock::time_point m_lastBlockResponseTime;
+
+		// Block requests from this peer, see BLOCK_REQUEST_BUDGET_BYTES_PER_SECOND
+		uint64_t m_blockRequestBudget;
+		std::chrono::steady_clock::time_point m_blockRequestBudgetTime;
+
+		// Compact broadcasts sent to this peer which it can still ask the full block for
+		uint32_t m_fullBroadcastRequestsAllowed;
+
 		hash m_broadcastedHashes[8];
 		std::atomic<uint32_t> m_broadcastedHashesIndex{ 0 };
+
+		// Only used on the event loop thread
+		KnownBlocks m_knownBlocks;
+
+		// Identifies this connection in the traffic recording, 0 if it's not recorded
+		uint32_t m_trafficConnectionId;
 	};
 
 	void broadcast(const PoolBlock& block);
@@ -127,6 +297,7 @@ public:
 	uint64_t get_peerId() const { return m_peerId; }
 
 	void print_status() override;
+	void print_queues() override;
 	void show_peers();
 	size_t peer_list_size() const { return m_peerList.size(); }
 
@@ -144,6 +315,8 @@ private:
 	void on_timer();
 
 	void flush_cache();
+	void save_snapshot();
+	void load_snapshot();
 	void download_missing_blocks();
 	void check_zmq();
 	void update_peer_connections();
@@ -162,6 +335,36 @@ private:
 	uv_mutex_t m_blockLock;
 	PoolBlock* m_block;
 
+	// Blocks from BLOCK_RESPONSE messages go through 3 stages: deserialize -> PoW -> add to the sidechain
+	// Stage queues are only accessed on the event loop thread, jobs for every stage run on the UV threadpool
+	enum SyncStage {
+		SYNC_DESERIALIZE,
+		SYNC_POW,
+		SYNC_ADD,
+		NUM_SYNC_STAGES,
+	};
+
+	struct SyncBlock;
+
+	struct SyncStats
+	{
+		std::atomic<uint64_t> blocks{ 0 };
+		std::atomic<uint64_t> busy_time_us{ 0 };
+	};
+
+	std::deque<SyncBlock*> m_syncQueue[NUM_SYNC_STAGES];
+	uint32_t m_syncJobs[NUM_SYNC_STAGES];
+	uint32_t m_syncMaxJobs[NUM_SYNC_STAGES];
+	std::atomic<uint32_t> m_syncPendingBlocks;
+	SyncStats m_syncStats[NUM_SYNC_STAGES];
+
+	bool sync_backpressure() const { return m_syncPendingBlocks.load() >= SYNC_MAX_PENDING_BLOCKS; }
+	bool sync_enqueue(SyncBlock* block);
+	void sync_pump();
+	void sync_run_job(SyncStage stage, std::vector<SyncBlock*>& blocks);
+	void sync_job_done(SyncStage stage, std::vector<SyncBlock*>& blocks);
+	void sync_check_pow(std::vector<SyncBlock*>& blocks);
+
 	uv_timer_t m_timer;
 	uint32_t m_timerCounter;
 
@@ -183,17 +386,44 @@ private:
 
 	struct Broadcast
 	{
-		std::vector<uint8_t> blob;
-		std::vector<uint8_t> pruned_blob;
+		Broadcast() : blob(nullptr), pruned_blob(nullptr), compact_blob(nullptr), start_time(0) {}
+		~Broadcast()
+		{
+			if (blob) {
+				blob->release();
+			}
+			if (pruned_blob) {
+				pruned_blob->release();
+			}
+			if (compact_blob) {
+				compact_blob->release();
+			}
+		}
+
+		// Shared between all peers, each pending write holds its own reference
+		SharedBuf* blob;
+		SharedBuf* pruned_blob;
+		SharedBuf* compact_blob;
+		hash id;
 		std::vector<hash> ancestor_hashes;
+
+		// When broadcast() was called, for the delay until the block is sent to peers
+		uint64_t start_time;
 	};
 
 	uv_mutex_t m_broadcastLock;
 	uv_async_t m_broadcastAsync;
 	std::vector<Broadcast*> m_broadcastQueue;
 
+	struct MissingBlockRequest
+	{
+		uint64_t m_peerId;
+		std::chrono::steady_clock::time_point m_time;
+	};
+
+	// Truncated block id -> the peer we asked last
 	uv_mutex_t m_missingBlockRequestsLock;
-	unordered_set<std::pair<uint64_t, uint64_t>> m_missingBlockRequests;
+	unordered_map<uint64_t, MissingBlockRequest> m_missingBlockRequests;
 
 	static void on_broadcast(uv_async_t* handle) { reinterpret_cast<P2PServer*>(handle->data)->on_broadcast(); }
 	void on_broadcast();
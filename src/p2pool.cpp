@@ -31,6 +31,11 @@
 #include "console_commands.h"
 #include "crypto.h"
 #include "p2pool_api.h"
+#include "block_cache.h"
+#include "mainchain_index.h"
+#include "metrics.h"
+#include "traffic.h"
+#include "memory_leak_debug.h"
 #include <thread>
 #include <fstream>
 
@@ -42,6 +47,14 @@ constexpr uint64_t SEEDHASH_EPOCH_LAG = 64;
 
 constexpr char FOUND_BLOCKS_FILE[] = "p2pool.blocks";
 
+// Sidechain updates which arrive within this time after a block template update are coalesced into one more update at the end of it
+constexpr uint64_t TEMPLATE_UPDATE_DEBOUNCE_MS = 100;
+
+// With several monerod hosts, RPC requests switch to another one when the current host is silent on ZMQ
+// for this many seconds while others are not, or when it's this much later on average with new blocks
+constexpr time_t HOST_STALL_TIMEOUT = 60;
+constexpr double HOST_SWITCH_DELAY_MS = 1000.0;
+
 namespace p2pool {
 
 p2pool::p2pool(int argc, char* argv[])
@@ -49,9 +62,15 @@ p2pool::p2pool(int argc, char* argv[])
 	, m_params(new Params(argc, argv))
 	, m_updateSeed(true)
 	, m_submitBlockData{}
+	, m_lastTemplateUpdate(0)
+	, m_lastTemplateUpdateTime(0)
 	, m_zmqLastActive(0)
 	, m_startTime(time(nullptr))
 {
+	for (int64_t& t : m_startupStageTime) {
+		t = -1;
+	}
+
 	LOGINFO(1, log::LightCyan() << VERSION);
 
 	if (!m_params->m_wallet.valid()) {
@@ -59,12 +78,16 @@ p2pool::p2pool(int argc, char* argv[])
 		panic();
 	}
 
-	bool is_v6;
-	if (!resolve_host(m_params->m_host, is_v6)) {
-		LOGERR(1, "resolve_host failed for " << m_params->m_host);
-		panic();
+	for (Params::Host& host : m_params->m_hosts) {
+		bool is_v6;
+		if (!resolve_host(host.m_address, is_v6)) {
+			LOGERR(1, "resolve_host failed for " << host.m_address);
+			panic();
+		}
 	}
 
+	m_hostStatus = std::vector<HostStatus>(m_params->m_hosts.size());
+
 	hash pub, sec, eph_public_key;
 	generate_keys(pub, sec);
 
@@ -103,13 +126,62 @@ p2pool::p2pool(int argc, char* argv[])
 	}
 	m_stopAsync.data = this;
 
-	uv_rwlock_init_checked(&m_mainchainLock);
+	err = uv_timer_init(uv_default_loop_checked(), &m_txRefreshTimer);
+	if (err) {
+		LOGERR(1, "uv_timer_init failed, error " << uv_err_name(err));
+		panic();
+	}
+	m_txRefreshTimer.data = this;
+
+	err = uv_timer_init(uv_default_loop_checked(), &m_blockTemplateTimer);
+	if (err) {
+		LOGERR(1, "uv_timer_init failed, error " << uv_err_name(err));
+		panic();
+	}
+	m_blockTemplateTimer.data = this;
+
+	err = uv_timer_init(uv_default_loop_checked(), &m_apiUpdateTimer);
+	if (err) {
+		LOGERR(1, "uv_timer_init failed, error " << uv_err_name(err));
+		panic();
+	}
+	m_apiUpdateTimer.data = this;
+
+	JSONRPCRequest::init_pool();
+
+	if (m_params->m_txRefreshInterval) {
+		const uint64_t interval = m_params->m_txRefreshInterval * 1000ULL;
+		err = uv_timer_start(&m_txRefreshTimer, on_tx_refresh, interval, interval);
+		if (err) {
+			LOGERR(1, "uv_timer_start failed, error " << uv_err_name(err));
+			panic();
+		}
+	}
+
+	m_mainchain = new MainchainIndex(SEEDHASH_EPOCH_BLOCKS);
 	uv_mutex_init_checked(&m_foundBlocksLock);
 	uv_mutex_init_checked(&m_submitBlockDataLock);
+	uv_mutex_init_checked(&m_minerDataLock);
+	uv_mutex_init_checked(&m_handleMinerDataLock);
 
-	m_api = m_params->m_apiPath.empty() ? nullptr : new p2pool_api(m_params->m_apiPath, m_params->m_localStats);
+	if (!m_params->m_apiPath.empty() || !m_params->m_httpApiAddresses.empty()) {
+		m_api = new p2pool_api(m_params->m_apiPath, m_params->m_httpApiAddresses, m_params->m_localStats);
+	}
+	else {
+		m_api = nullptr;
+	}
+
+	if (m_api) {
+		const uint64_t interval = m_params->m_apiUpdateInterval * 1000ULL;
+		err = uv_timer_start(&m_apiUpdateTimer, on_api_update, interval, interval);
+		if (err) {
+			LOGERR(1, "uv_timer_start failed, error " << uv_err_name(err));
+			panic();
+		}
+	}
 
 	m_sideChain = new SideChain(this, type);
+	m_blockCache = m_params->m_blockCache ? new BlockCache() : nullptr;
 	m_hasher = new RandomX_Hasher(this);
 	m_blockTemplate = new BlockTemplate(this);
 	m_mempool = new Mempool();
@@ -118,11 +190,18 @@ p2pool::p2pool(int argc, char* argv[])
 
 p2pool::~p2pool()
 {
-	uv_rwlock_destroy(&m_mainchainLock);
 	uv_mutex_destroy(&m_foundBlocksLock);
 	uv_mutex_destroy(&m_submitBlockDataLock);
+	uv_mutex_destroy(&m_minerDataLock);
+	uv_mutex_destroy(&m_handleMinerDataLock);
+
+	for (ZMQHandler* h : m_zmqHandlers) {
+		delete h;
+	}
 
 	delete m_api;
+	delete m_blockCache;
+	delete m_mainchain;
 	delete m_sideChain;
 	delete m_hasher;
 	delete m_blockTemplate;
@@ -146,14 +225,12 @@ uint64_t p2pool::get_seed_height(uint64_t height)
 
 bool p2pool::get_seed(uint64_t height, hash& seed) const
 {
-	ReadLock lock(m_mainchainLock);
-
-	auto it = m_mainchainByHeight.find(get_seed_height(height));
-	if (it == m_mainchainByHeight.end()) {
+	ChainMain c;
+	if (!m_mainchain->get(get_seed_height(height), c)) {
 		return false;
 	}
 
-	seed = it->second.id;
+	seed = c.id;
 	return true;
 }
 
@@ -164,7 +241,13 @@ void p2pool::handle_tx(TxMempoolData& tx)
 		return;
 	}
 
-	m_mempool->add(tx);
+	if (!m_mempool->add(tx)) {
+		// Every monerod sends the same transactions when there are several of them
+		if (m_params->m_hosts.size() == 1) {
+			LOGWARN(1, "duplicate transaction with id = " << tx.id << ", skipped");
+		}
+		return;
+	}
 
 	LOGINFO(5,
 		"new tx id = " << log::LightBlue() << tx.id << log::NoColor() <<
@@ -189,23 +272,16 @@ void p2pool::handle_miner_data(MinerData& data)
 	m_mempool->swap(data.tx_backlog);
 #endif
 
-	{
-		WriteLock lock(m_mainchainLock);
-
-		m_mainchainByHeight[data.height].difficulty = data.difficulty;
-
-		ChainMain& c = m_mainchainByHeight[data.height - 1];
-		c.height = data.height - 1;
-		c.id = data.prev_id;
-
-		// timestamp and reward is unknown here
-		c.timestamp = 0;
-		c.reward = 0;
-
-		m_mainchainByHash[c.id] = c;
+	m_mainchain->update(data.height, [&data](ChainMain& c) { c.difficulty = data.difficulty; });
+	m_mainchain->update(data.height - 1,
+		[&data](ChainMain& c)
+		{
+			c.id = data.prev_id;
 
-		cleanup_mainchain_data(data.height);
-	}
+			// timestamp and reward is unknown here
+			c.timestamp = 0;
+			c.reward = 0;
+		});
 
 	data.tx_backlog.clear();
 	data.time_received = std::chrono::system_clock::now();
@@ -213,6 +289,14 @@ void p2pool::handle_miner_data(MinerData& data)
 	m_updateSeed = true;
 	update_median_timestamp();
 
+	// Next epoch's seed block is known SEEDHASH_EPOCH_LAG blocks in advance
+	if (m_params->m_prebuildDataset) {
+		hash next_seed;
+		if (get_seed(data.height + SEEDHASH_EPOCH_LAG, next_seed) && (next_seed != data.seed_hash)) {
+			m_hasher->set_next_seed_async(next_seed);
+		}
+	}
+
 	LOGINFO(2,
 		"new miner data\n---------------------------------------------------------------------------------------------------------------" <<
 		"\nmajor_version           = " << data.major_version <<
@@ -237,23 +321,20 @@ void p2pool::handle_miner_data(MinerData& data)
 
 	if (m_serversStarted.load()) {
 		std::vector<uint64_t> missing_heights;
-		{
-			WriteLock lock(m_mainchainLock);
+		m_mainchain->get_missing_heights((data.height >= BLOCK_HEADERS_REQUIRED) ? (data.height - BLOCK_HEADERS_REQUIRED + 1) : 1, data.height, missing_heights);
 
-			for (uint64_t h = data.height; h && (h + BLOCK_HEADERS_REQUIRED > data.height); --h) {
-				if (m_mainchainByHeight.find(h) == m_mainchainByHeight.end()) {
-					LOGWARN(3, "Mainchain data for height " << h << " is missing, requesting it from monerod again");
-					missing_heights.push_back(h);
-				}
-			}
+		for (uint64_t h : missing_heights) {
+			LOGWARN(3, "Mainchain data for height " << h << " is missing, requesting it from monerod again");
 		}
 
+		const Params::Host& host = m_params->m_hosts[m_currentHost];
+
 		for (uint64_t h : missing_heights) {
 			char buf[log::Stream::BUF_SIZE + 1];
 			log::Stream s(buf);
 			s << "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_block_header_by_height\",\"params\":{\"height\":" << h << "}}\0";
 
-			JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, buf,
+			JSONRPCRequest::call(host.m_address.c_str(), host.m_rpcPort, buf,
 				[this, h](const char* data, size_t size)
 				{
 					ChainMain block;
@@ -284,19 +365,15 @@ const char* BLOCK_FOUND = "\n\
 
 void p2pool::handle_chain_main(ChainMain& data, const char* extra)
 {
-	{
-		WriteLock lock(m_mainchainLock);
-
-		ChainMain& c = m_mainchainByHeight[data.height];
-		c.height = data.height;
-		c.timestamp = data.timestamp;
-		c.reward = data.reward;
-
-		// data.id not filled in here, but c.id should be available. Copy it to data.id for logging
-		data.id = c.id;
+	m_mainchain->update(data.height,
+		[&data](ChainMain& c)
+		{
+			c.timestamp = data.timestamp;
+			c.reward = data.reward;
 
-		m_mainchainByHash[c.id] = c;
-	}
+			// data.id not filled in here, but c.id should be available. Copy it to data.id for logging
+			data.id = c.id;
+		});
 	update_median_timestamp();
 
 	hash sidechain_id;
@@ -330,11 +407,187 @@ void p2pool::handle_chain_main(ChainMain& data, const char* extra)
 		}
 	}
 
-	api_update_network_stats();
+	api_set_dirty(API_NETWORK_STATS | API_STATS_MOD);
 
 	m_zmqLastActive = time(nullptr);
 }
 
+void p2pool::ZMQHandler::handle_tx(TxMempoolData& tx)
+{
+	m_pool->m_hostStatus[m_index].m_zmqLastActive = time(nullptr);
+	m_pool->handle_tx(tx);
+}
+
+void p2pool::ZMQHandler::handle_miner_data(MinerData& data)
+{
+	m_pool->m_hostStatus[m_index].m_zmqLastActive = time(nullptr);
+
+	// ZMQ threads of different hosts can get it at the same time, only one of them handles it
+	bool is_new;
+	{
+		MutexLock lock(m_pool->m_minerDataLock);
+		is_new = m_pool->is_new_miner_data(data, m_index);
+	}
+
+	if (!is_new) {
+		return;
+	}
+
+	// New miner data from different hosts is handled one at a time, m_minerDataLock stays free for the other ZMQ threads and check_hosts()
+	MutexLock lock(m_pool->m_handleMinerDataLock);
+
+	// A newer block from another host could have been handled while this thread was waiting
+	if (data.height < m_pool->m_minerData.height) {
+		return;
+	}
+
+	m_pool->handle_miner_data(data);
+}
+
+void p2pool::ZMQHandler::handle_chain_main(ChainMain& data, const char* extra)
+{
+	m_pool->m_hostStatus[m_index].m_zmqLastActive = time(nullptr);
+
+	bool is_new;
+	{
+		MutexLock lock(m_pool->m_minerDataLock);
+		is_new = m_pool->is_new_chain_main(data);
+	}
+
+	if (is_new) {
+		m_pool->handle_chain_main(data, extra);
+	}
+}
+
+bool p2pool::is_new_miner_data(const MinerData& data, uint32_t host_index)
+{
+	using namespace std::chrono;
+	const steady_clock::time_point now = steady_clock::now();
+
+	HostStatus& status = m_hostStatus[host_index];
+
+	for (const RecentMinerData& d : m_recentMinerData) {
+		if ((d.height == data.height) && (d.prev_id == data.prev_id)) {
+			const double delay = static_cast<double>(duration_cast<microseconds>(now - d.received).count()) / 1e3;
+			status.m_avgDelayMs = status.m_avgDelayMs * 0.8 + delay * 0.2;
+			++status.m_minerDataLate;
+			LOGINFO(5, "miner data for height " << data.height << " from host " << host_index << " is " << delay << " ms late");
+			return false;
+		}
+	}
+
+	// A slow host can still be sending the previous block
+	if (data.height < m_recentMinerDataHeight) {
+		return false;
+	}
+
+	RecentMinerData& d = m_recentMinerData[m_recentMinerDataIndex];
+	m_recentMinerDataIndex = (m_recentMinerDataIndex + 1) % RECENT_MINER_DATA_SIZE;
+
+	d.height = data.height;
+	d.prev_id = data.prev_id;
+	d.received = now;
+
+	m_recentMinerDataHeight = data.height;
+
+	status.m_avgDelayMs *= 0.8;
+	++status.m_minerDataFirst;
+
+	return true;
+}
+
+bool p2pool::is_new_chain_main(const ChainMain& data)
+{
+	for (const RecentChainMain& c : m_recentChainMain) {
+		if ((c.height == data.height) && (c.timestamp == data.timestamp) && (c.reward == data.reward)) {
+			return false;
+		}
+	}
+
+	RecentChainMain& c = m_recentChainMain[m_recentChainMainIndex];
+	m_recentChainMainIndex = (m_recentChainMainIndex + 1) % RECENT_MINER_DATA_SIZE;
+
+	c.height = data.height;
+	c.timestamp = data.timestamp;
+	c.reward = data.reward;
+
+	return true;
+}
+
+void p2pool::switch_host(uint32_t index, const char* reason)
+{
+	const uint32_t prev_index = m_currentHost.exchange(index);
+	if (prev_index == index) {
+		return;
+	}
+
+	const Params::Host& prev = m_params->m_hosts[prev_index];
+	const Params::Host& host = m_params->m_hosts[index];
+	LOGWARN(1, "switching from monerod " << prev.m_address << ':' << prev.m_rpcPort << " to " << host.m_address << ':' << host.m_rpcPort << " (" << reason << ')');
+}
+
+void p2pool::check_hosts()
+{
+	const uint32_t num_hosts = static_cast<uint32_t>(m_params->m_hosts.size());
+	if (num_hosts < 2) {
+		return;
+	}
+
+	const uint32_t current = m_currentHost;
+
+	std::vector<time_t> last_active(num_hosts);
+	time_t max_last_active = 0;
+
+	for (uint32_t i = 0; i < num_hosts; ++i) {
+		last_active[i] = m_hostStatus[i].m_zmqLastActive;
+		max_last_active = std::max(max_last_active, last_active[i]);
+	}
+
+	// Hosts which were silent for HOST_STALL_TIMEOUT seconds while others were sending messages are stalled
+	auto is_alive = [&last_active, max_last_active](uint32_t i) { return last_active[i] + HOST_STALL_TIMEOUT >= max_last_active; };
+
+	MutexLock lock(m_minerDataLock);
+
+	// Pick the host which is the fastest to deliver new blocks among those which are alive
+	uint32_t best = current;
+	for (uint32_t i = 0; i < num_hosts; ++i) {
+		if (is_alive(i) && (!is_alive(best) || (m_hostStatus[i].m_avgDelayMs < m_hostStatus[best].m_avgDelayMs))) {
+			best = i;
+		}
+	}
+
+	if (!is_alive(current)) {
+		switch_host(best, "no ZMQ messages");
+	}
+	else if (m_hostStatus[current].m_avgDelayMs > m_hostStatus[best].m_avgDelayMs + HOST_SWITCH_DELAY_MS) {
+		switch_host(best, "new blocks arrive earlier");
+	}
+}
+
+void p2pool::print_hosts() const
+{
+	const uint32_t num_hosts = static_cast<uint32_t>(m_params->m_hosts.size());
+	if (num_hosts < 2) {
+		return;
+	}
+
+	const time_t cur_time = time(nullptr);
+	const uint32_t current = m_currentHost;
+
+	MutexLock lock(m_minerDataLock);
+
+	for (uint32_t i = 0; i < num_hosts; ++i) {
+		const Params::Host& host = m_params->m_hosts[i];
+		const HostStatus& status = m_hostStatus[i];
+		const time_t last_active = status.m_zmqLastActive;
+
+		LOGINFO(0, "monerod " << host.m_address << ':' << host.m_rpcPort << ((i == current) ? " (current)" : "") <<
+			", last ZMQ message " << (last_active ? (cur_time - last_active) : -1) << " s ago" <<
+			", new blocks first/late = " << status.m_minerDataFirst << '/' << status.m_minerDataLate <<
+			", average delay " << status.m_avgDelayMs << " ms");
+	}
+}
+
 void p2pool::submit_block_async(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
 {
 	{
@@ -352,7 +605,7 @@ void p2pool::submit_block_async(uint32_t template_id, uint32_t nonce, uint32_t e
 	}
 }
 
-void p2pool::submit_block_async(const std::vector<uint8_t>& blob)
+void p2pool::submit_block_async(const uint8_t* blob, size_t size)
 {
 	{
 		MutexLock lock(m_submitBlockDataLock);
@@ -360,7 +613,7 @@ void p2pool::submit_block_async(const std::vector<uint8_t>& blob)
 		m_submitBlockData.template_id = 0;
 		m_submitBlockData.nonce = 0;
 		m_submitBlockData.extra_nonce = 0;
-		m_submitBlockData.blob = blob;
+		m_submitBlockData.blob.assign(blob, blob + size);
 	}
 
 	const int err = uv_async_send(&m_submitBlockAsync);
@@ -380,6 +633,13 @@ void p2pool::on_stop(uv_async_t* async)
 	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_submitBlockAsync), nullptr);
 	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_blockTemplateAsync), nullptr);
 	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_stopAsync), nullptr);
+	uv_timer_stop(&pool->m_txRefreshTimer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_txRefreshTimer), nullptr);
+	uv_timer_stop(&pool->m_blockTemplateTimer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_blockTemplateTimer), nullptr);
+	uv_timer_stop(&pool->m_apiUpdateTimer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_apiUpdateTimer), nullptr);
+	JSONRPCRequest::close_pool();
 	uv_stop(uv_default_loop());
 }
 
@@ -440,62 +700,74 @@ void p2pool::submit_block() const
 	}
 	request.append("\"]}");
 
-	JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, request.c_str(),
-		[height, diff, template_id, nonce, extra_nonce, is_external](const char* data, size_t size)
-		{
-			rapidjson::Document doc;
-			if (doc.Parse<rapidjson::kParseCommentsFlag | rapidjson::kParseTrailingCommasFlag>(data, size).HasParseError() || !doc.IsObject()) {
-				LOGERR(0, "submit_block: invalid JSON response from daemon");
-				return;
-			}
+	// Every monerod gets the block at the same time, it's enough for one of them to broadcast it
+	const uint32_t current_host = m_currentHost;
 
-			if (doc.HasMember("error")) {
-				auto& err = doc["error"];
+	for (uint32_t i = 0; i < m_params->m_hosts.size(); ++i) {
+		const Params::Host& host = m_params->m_hosts[i];
+		const bool is_current = (i == current_host);
 
-				if (!err.IsObject()) {
-					LOGERR(0, "submit_block: invalid JSON reponse from daemon: 'error' is not an object");
+		JSONRPCRequest::call_urgent(host.m_address.c_str(), host.m_rpcPort, request.c_str(),
+			[&host, height, diff, template_id, nonce, extra_nonce, is_external, is_current](const char* data, size_t size)
+			{
+				rapidjson::Document doc;
+				if (doc.Parse<rapidjson::kParseCommentsFlag | rapidjson::kParseTrailingCommasFlag>(data, size).HasParseError() || !doc.IsObject()) {
+					LOGERR(0, "submit_block: invalid JSON response from daemon " << host.m_address << ':' << host.m_rpcPort);
 					return;
 				}
 
-				const char* error_msg = nullptr;
+				if (doc.HasMember("error")) {
+					auto& err = doc["error"];
 
-				auto it = doc.FindMember("message");
-				if (it != doc.MemberEnd() && it->value.IsString()) {
-					error_msg = it->value.GetString();
-				}
+					if (!err.IsObject()) {
+						LOGERR(0, "submit_block: invalid JSON reponse from daemon " << host.m_address << ':' << host.m_rpcPort << ": 'error' is not an object");
+						return;
+					}
 
-				if (is_external) {
-					LOGWARN(3, "submit_block (external blob): daemon returned error: " << (error_msg ? error_msg : "unknown error"));
-				}
-				else {
-					LOGERR(0, "submit_block: daemon returned error: '" << (error_msg ? error_msg : "unknown error") << "', template id = " << template_id << ", nonce = " << nonce << ", extra_nonce = " << extra_nonce);
-				}
-				return;
-			}
+					const char* error_msg = nullptr;
 
-			auto it = doc.FindMember("result");
-			if (it != doc.MemberEnd() && it->value.IsObject()) {
-				auto& result = it->value;
-				auto it2 = result.FindMember("status");
-				if (it2 != result.MemberEnd() && it2->value.IsString() && (strcmp(it2->value.GetString(), "OK") == 0)) {
-					LOGINFO(0, log::LightGreen() << "submit_block: BLOCK ACCEPTED at height " << height << " and difficulty = " << diff);
+					auto it = doc.FindMember("message");
+					if (it != doc.MemberEnd() && it->value.IsString()) {
+						error_msg = it->value.GetString();
+					}
+
+					if (is_external) {
+						LOGWARN(3, "submit_block (external blob): daemon " << host.m_address << ':' << host.m_rpcPort << " returned error: " << (error_msg ? error_msg : "unknown error"));
+					}
+					else if (!is_current) {
+						// It could have received the block from another monerod already
+						LOGWARN(1, "submit_block: daemon " << host.m_address << ':' << host.m_rpcPort << " returned error: '" << (error_msg ? error_msg : "unknown error") << "', template id = " << template_id << ", nonce = " << nonce << ", extra_nonce = " << extra_nonce);
+					}
+					else {
+						LOGERR(0, "submit_block: daemon " << host.m_address << ':' << host.m_rpcPort << " returned error: '" << (error_msg ? error_msg : "unknown error") << "', template id = " << template_id << ", nonce = " << nonce << ", extra_nonce = " << extra_nonce);
+					}
 					return;
 				}
-			}
 
-			LOGWARN(0, "submit_block: daemon sent unrecognizable reply: " << log::const_buf(data, size));
-		},
-		[is_external](const char* data, size_t size)
-		{
-			if (size > 0) {
-				if (is_external) {
-					LOGWARN(3, "submit_block (external blob): RPC request failed, error " << log::const_buf(data, size));
+				auto it = doc.FindMember("result");
+				if (it != doc.MemberEnd() && it->value.IsObject()) {
+					auto& result = it->value;
+					auto it2 = result.FindMember("status");
+					if (it2 != result.MemberEnd() && it2->value.IsString() && (strcmp(it2->value.GetString(), "OK") == 0)) {
+						LOGINFO(0, log::LightGreen() << "submit_block: BLOCK ACCEPTED by " << host.m_address << ':' << host.m_rpcPort << " at height " << height << " and difficulty = " << diff);
+						return;
+					}
 				}
-				else {
-					LOGERR(0, "submit_block (external blob): RPC request failed, error " << log::const_buf(data, size));
+
+				LOGWARN(0, "submit_block: daemon " << host.m_address << ':' << host.m_rpcPort << " sent unrecognizable reply: " << log::const_buf(data, size));
+			},
+			[&host, is_external](const char* data, size_t size)
+			{
+				if (size > 0) {
+					if (is_external) {
+						LOGWARN(3, "submit_block (external blob): RPC request to " << host.m_address << ':' << host.m_rpcPort << " failed, error " << log::const_buf(data, size));
+					}
+					else {
+						LOGERR(0, "submit_block: RPC request to " << host.m_address << ':' << host.m_rpcPort << " failed, error " << log::const_buf(data, size));
+					}
 				}
-			}
-		});
+			});
+	}
 }
 
 void p2pool::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
@@ -504,23 +776,82 @@ void p2pool::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32
 	m_blockTemplate->submit_sidechain_block(template_id, nonce, extra_nonce);
 }
 
-void p2pool::update_block_template_async()
+void p2pool::update_block_template_async(bool coalesce)
 {
+	if (coalesce) {
+		m_templateUpdateCoalesced = true;
+	}
+	else {
+		m_templateUpdateNow = true;
+	}
+
 	const int err = uv_async_send(&m_blockTemplateAsync);
 	if (err) {
 		LOGERR(1, "uv_async_send failed, error " << uv_err_name(err));
 	}
 }
 
+void p2pool::on_update_block_template()
+{
+	if (m_templateUpdateNow.exchange(false)) {
+		m_templateUpdateCoalesced = false;
+		update_block_template();
+		return;
+	}
+
+	if (!m_templateUpdateCoalesced.exchange(false)) {
+		return;
+	}
+
+	// Already waiting, this update will be included
+	if (uv_is_active(reinterpret_cast<uv_handle_t*>(&m_blockTemplateTimer))) {
+		LOGINFO(6, "coalescing block template update");
+		return;
+	}
+
+	// No update in the last TEMPLATE_UPDATE_DEBOUNCE_MS, do it now and coalesce only the ones which follow it
+	const uint64_t elapsed_ms = (uv_hrtime() - m_lastTemplateUpdateTime) / 1000000;
+	if (elapsed_ms >= TEMPLATE_UPDATE_DEBOUNCE_MS) {
+		update_block_template();
+		return;
+	}
+
+	LOGINFO(6, "coalescing block template update");
+
+	const int err = uv_timer_start(&m_blockTemplateTimer, on_block_template_timer, TEMPLATE_UPDATE_DEBOUNCE_MS - elapsed_ms, 0);
+	if (err) {
+		LOGERR(1, "uv_timer_start failed, error " << uv_err_name(err));
+		update_block_template();
+	}
+}
+
 void p2pool::update_block_template()
 {
+	// This update makes any pending coalesced update redundant
+	uv_timer_stop(&m_blockTemplateTimer);
+
 	if (m_updateSeed) {
 		m_hasher->set_seed_async(m_minerData.seed_hash);
 		m_updateSeed = false;
 	}
 	m_blockTemplate->update(m_minerData, *m_mempool, &m_params->m_wallet);
+	m_lastTemplateUpdate = time(nullptr);
+	m_lastTemplateUpdateTime = uv_hrtime();
 	stratum_on_block();
-	api_update_pool_stats();
+	api_set_dirty(API_POOL_STATS | API_STATS_MOD);
+}
+
+void p2pool::refresh_block_template()
+{
+	// Full update happened recently, nothing to do
+	if (time(nullptr) < m_lastTemplateUpdate + static_cast<time_t>(m_params->m_txRefreshInterval)) {
+		return;
+	}
+
+	if (m_blockTemplate->refresh_transactions(*m_mempool)) {
+		m_lastTemplateUpdate = time(nullptr);
+		stratum_on_block();
+	}
 }
 
 void p2pool::download_block_headers(uint64_t current_height)
@@ -531,20 +862,27 @@ void p2pool::download_block_headers(uint64_t current_height)
 	char buf[log::Stream::BUF_SIZE + 1];
 	log::Stream s(buf);
 
-	// First download 2 RandomX seeds
+	const Params::Host& host = m_params->m_hosts[m_currentHost];
+
+	// 2 RandomX seeds and the headers range are downloaded in parallel
 	const uint64_t seed_heights[2] = { prev_seed_height, seed_height };
-	for (uint64_t height : seed_heights) {
+	for (uint32_t i = 0; i < 2; ++i) {
+		const uint64_t height = seed_heights[i];
+
 		s.m_pos = 0;
 		s << "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_block_header_by_height\",\"params\":{\"height\":" << height << "}}\0";
 
-		JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, buf,
-			[this, prev_seed_height, height](const char* data, size_t size)
+		JSONRPCRequest::call(host.m_address.c_str(), host.m_rpcPort, buf,
+			[this, i, height](const char* data, size_t size)
 			{
 				ChainMain block;
 				if (parse_block_header(data, size, block)) {
-					if (height == prev_seed_height) {
-						// Do it synchronously to make sure stratum and p2p don't start before it's finished
-						m_hasher->set_old_seed(block.id);
+					if (i == 0) {
+						// Stratum and p2p don't start before it's finished
+						set_old_seed_async(block.id);
+					}
+					else {
+						on_startup_stage_done(STARTUP_SEED_HEADER);
 					}
 				}
 				else {
@@ -564,17 +902,12 @@ void p2pool::download_block_headers(uint64_t current_height)
 	s.m_pos = 0;
 	s << "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_block_headers_range\",\"params\":{\"start_height\":" << current_height - BLOCK_HEADERS_REQUIRED << ",\"end_height\":" << current_height - 1 << "}}\0";
 
-	JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, buf,
+	JSONRPCRequest::call(host.m_address.c_str(), host.m_rpcPort, buf,
 		[this, current_height](const char* data, size_t size)
 		{
 			if (parse_block_headers_range(data, size) == BLOCK_HEADERS_REQUIRED) {
 				update_median_timestamp();
-				if (m_serversStarted.exchange(1) == 0) {
-					m_ZMQReader = new ZMQReader(m_params->m_host.c_str(), m_params->m_zmqPort, this);
-					m_stratumServer = new StratumServer(this);
-					m_p2pServer = new P2PServer(this);
-					api_update_network_stats();
-				}
+				on_startup_stage_done(STARTUP_BLOCK_HEADERS);
 			}
 			else {
 				LOGERR(1, "fatal error: couldn't download block headers for heights " << current_height - BLOCK_HEADERS_REQUIRED << " - " << current_height - 1);
@@ -592,49 +925,16 @@ void p2pool::download_block_headers(uint64_t current_height)
 
 bool p2pool::chainmain_get_by_hash(const hash& id, ChainMain& data) const
 {
-	ReadLock lock(m_mainchainLock);
-
-	auto it = m_mainchainByHash.find(id);
-	if (it == m_mainchainByHash.end()) {
-		return false;
-	}
-
-	data = it->second;
-	return true;
-}
-
-bool p2pool::get_timestamps(uint64_t (&timestamps)[TIMESTAMP_WINDOW]) const
-{
-	ReadLock lock(m_mainchainLock);
-
-	if (m_mainchainByHeight.size() <= TIMESTAMP_WINDOW) {
-		return false;
-	}
-
-	auto it = m_mainchainByHeight.end();
-
-	for (int i = 0; (i < TIMESTAMP_WINDOW) && (it != m_mainchainByHeight.begin()); ++i) {
-		--it;
-		timestamps[i] = it->second.timestamp;
-	}
-
-	return true;
+	return m_mainchain->get_by_hash(id, data);
 }
 
 void p2pool::update_median_timestamp()
 {
-	uint64_t timestamps[TIMESTAMP_WINDOW];
-	if (!get_timestamps(timestamps))
-	{
-		m_minerData.median_timestamp = 0;
-		return;
-	}
-
-	std::sort(timestamps, timestamps + TIMESTAMP_WINDOW);
-
 	// Shift it +1 block compared to Monero's code because we don't have the latest block yet when we receive new miner data
-	m_minerData.median_timestamp = (timestamps[TIMESTAMP_WINDOW / 2] + timestamps[TIMESTAMP_WINDOW / 2 + 1]) / 2;
-	LOGINFO(4, "median timestamp updated to " << log::Gray() << m_minerData.median_timestamp);
+	m_minerData.median_timestamp = m_mainchain->median_timestamp();
+	if (m_minerData.median_timestamp) {
+		LOGINFO(4, "median timestamp updated to " << log::Gray() << m_minerData.median_timestamp);
+	}
 }
 
 void p2pool::stratum_on_block()
@@ -659,7 +959,8 @@ void p2pool::stratum_on_block()
 
 void p2pool::get_info()
 {
-	JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_info\"}",
+	const Params::Host& host = m_params->m_hosts[m_currentHost];
+	JSONRPCRequest::call(host.m_address.c_str(), host.m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_info\"}",
 		[this](const char* data, size_t size)
 		{
 			parse_get_info_rpc(data, size);
@@ -668,6 +969,9 @@ void p2pool::get_info()
 		{
 			if (size > 0) {
 				LOGWARN(1, "get_info RPC request failed: error " << log::const_buf(data, size) << ", trying again in 1 second");
+				if (m_params->m_hosts.size() > 1) {
+					switch_host((m_currentHost + 1) % m_params->m_hosts.size(), "get_info failed");
+				}
 				std::this_thread::sleep_for(std::chrono::milliseconds(1000));
 				get_info();
 			}
@@ -708,7 +1012,7 @@ void p2pool::load_found_blocks()
 		m_foundBlocks.emplace_back(timestamp, height, id, block_difficulty, cumulative_difficulty);
 	}
 
-	api_update_block_found(nullptr);
+	api_set_dirty(API_BLOCKS | API_STATS_MOD);
 }
 
 void p2pool::parse_get_info_rpc(const char* data, size_t size)
@@ -760,12 +1064,13 @@ void p2pool::parse_get_info_rpc(const char* data, size_t size)
 		panic();
 	}
 
-	get_version();
+	on_startup_stage_done(STARTUP_DAEMON_INFO);
 }
 
 void p2pool::get_version()
 {
-	JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_version\"}",
+	const Params::Host& host = m_params->m_hosts[m_currentHost];
+	JSONRPCRequest::call(host.m_address.c_str(), host.m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_version\"}",
 		[this](const char* data, size_t size)
 		{
 			parse_get_version_rpc(data, size);
@@ -818,12 +1123,13 @@ void p2pool::parse_get_version_rpc(const char* data, size_t size)
 		panic();
 	}
 
-	get_miner_data();
+	on_startup_stage_done(STARTUP_DAEMON_VERSION);
 }
 
 void p2pool::get_miner_data()
 {
-	JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_miner_data\"}",
+	const Params::Host& host = m_params->m_hosts[m_currentHost];
+	JSONRPCRequest::call(host.m_address.c_str(), host.m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_miner_data\"}",
 		[this](const char* data, size_t size)
 		{
 			parse_get_miner_data_rpc(data, size);
@@ -883,9 +1189,168 @@ void p2pool::parse_get_miner_data_rpc(const char* data, size_t size)
 	}
 
 	handle_miner_data(minerData);
+	on_startup_stage_done(STARTUP_MINER_DATA);
 	download_block_headers(minerData.height);
 }
 
+void p2pool::on_startup_stage_done(StartupStage stage)
+{
+	if (startup_stage_done(stage)) {
+		return;
+	}
+
+	using namespace std::chrono;
+	m_startupStageTime[stage] = duration_cast<milliseconds>(steady_clock::now() - m_startupTime).count();
+
+	switch (stage) {
+	case STARTUP_DAEMON_INFO:
+	case STARTUP_DAEMON_VERSION:
+		// get_miner_data is only valid once we know monerod is synchronized and compatible
+		if (startup_stage_done(STARTUP_DAEMON_INFO) && startup_stage_done(STARTUP_DAEMON_VERSION)) {
+			get_miner_data();
+		}
+		break;
+
+	case STARTUP_SERVERS:
+		print_startup_timings();
+		break;
+
+	default:
+		break;
+	}
+
+	if (!startup_stage_done(STARTUP_SERVERS) &&
+		startup_stage_done(STARTUP_SEED_HEADER) &&
+		startup_stage_done(STARTUP_OLD_SEED) &&
+		startup_stage_done(STARTUP_BLOCK_HEADERS) &&
+		startup_stage_done(STARTUP_BLOCK_CACHE)) {
+		start_servers();
+	}
+}
+
+void p2pool::print_startup_timings() const
+{
+	static const char* stage_names[NUM_STARTUP_STAGES] = {
+		"get_info",
+		"get_version",
+		"get_miner_data",
+		"seed header",
+		"old seed cache",
+		"block headers",
+		"block cache",
+		"servers started",
+	};
+
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream s(buf);
+
+	for (uint32_t i = 0; i < NUM_STARTUP_STAGES; ++i) {
+		s << (i ? ", " : "") << stage_names[i] << " at " << m_startupStageTime[i] << " ms";
+	}
+
+	LOGINFO(1, "startup finished in " << log::Gray() << m_startupStageTime[STARTUP_SERVERS] << log::NoColor() << " ms (" << log::const_buf(buf, s.m_pos) << ')');
+}
+
+void p2pool::set_old_seed_async(const hash& seed)
+{
+	struct Work
+	{
+		uv_work_t req;
+		p2pool* pool;
+		hash seed;
+	};
+
+	Work* work = new Work{};
+	work->req.data = work;
+	work->pool = this;
+	work->seed = seed;
+
+	// Initializing RandomX cache takes a while, the main loop keeps processing RPC responses meanwhile
+	const int err = uv_queue_work(uv_default_loop_checked(), &work->req,
+		[](uv_work_t* req)
+		{
+			bkg_jobs_tracker.start("p2pool::set_old_seed_async");
+			Work* work = reinterpret_cast<Work*>(req->data);
+			if (!work->pool->stopped()) {
+				work->pool->m_hasher->set_old_seed(work->seed);
+			}
+		},
+		[](uv_work_t* req, int /*status*/)
+		{
+			Work* work = reinterpret_cast<Work*>(req->data);
+			work->pool->on_startup_stage_done(STARTUP_OLD_SEED);
+			delete work;
+			bkg_jobs_tracker.stop("p2pool::set_old_seed_async");
+		});
+
+	if (err) {
+		LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
+		m_hasher->set_old_seed(seed);
+		delete work;
+		on_startup_stage_done(STARTUP_OLD_SEED);
+	}
+}
+
+void p2pool::preload_block_cache_async()
+{
+	if (!m_blockCache) {
+		on_startup_stage_done(STARTUP_BLOCK_CACHE);
+		return;
+	}
+
+	struct Work
+	{
+		uv_work_t req;
+		p2pool* pool;
+	};
+
+	Work* work = new Work{};
+	work->req.data = work;
+	work->pool = this;
+
+	// Reading and deserializing cached blocks doesn't depend on monerod, it runs while RPC requests are in flight
+	const int err = uv_queue_work(uv_default_loop_checked(), &work->req,
+		[](uv_work_t* req)
+		{
+			bkg_jobs_tracker.start("p2pool::preload_block_cache_async");
+			p2pool* pool = reinterpret_cast<Work*>(req->data)->pool;
+			if (!pool->stopped()) {
+				pool->m_blockCache->preload(*pool->m_sideChain);
+			}
+		},
+		[](uv_work_t* req, int /*status*/)
+		{
+			Work* work = reinterpret_cast<Work*>(req->data);
+			work->pool->on_startup_stage_done(STARTUP_BLOCK_CACHE);
+			delete work;
+			bkg_jobs_tracker.stop("p2pool::preload_block_cache_async");
+		});
+
+	if (err) {
+		LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
+		delete work;
+
+		// P2PServer will load the cache synchronously
+		on_startup_stage_done(STARTUP_BLOCK_CACHE);
+	}
+}
+
+void p2pool::start_servers()
+{
+	if (m_serversStarted.exchange(1) == 0) {
+		for (uint32_t i = 0; i < m_params->m_hosts.size(); ++i) {
+			const Params::Host& host = m_params->m_hosts[i];
+			ZMQHandler* handler = new ZMQHandler(this, i);
+			m_zmqHandlers.push_back(handler);
+			m_ZMQReaders.push_back(new ZMQReader(host.m_address.c_str(), host.m_zmqPort, i, handler));
+		}
+		m_stratumServer = new StratumServer(this);
+		m_p2pServer = new P2PServer(this);
+		api_set_dirty(API_NETWORK_STATS | API_STATS_MOD);
+		on_startup_stage_done(STARTUP_SERVERS);
+	}
+}
+
 bool p2pool::parse_block_header(const char* data, size_t size, ChainMain& c)
 {
 	rapidjson::Document doc;
@@ -918,11 +1383,7 @@ bool p2pool::parse_block_header(const char* data, size_t size, ChainMain& c)
 		return false;
 	}
 
-	{
-		WriteLock lock(m_mainchainLock);
-		m_mainchainByHeight[c.height] = c;
-		m_mainchainByHash[c.id] = c;
-	}
+	m_mainchain->update(c.height, [&c](ChainMain& data) { data = c; });
 
 	LOGINFO(4, "parsed block header for height " << c.height);
 	return true;
@@ -950,8 +1411,6 @@ uint32_t p2pool::parse_block_headers_range(const char* data, size_t size)
 
 	uint32_t num_headers_parsed = 0;
 
-	WriteLock lock(m_mainchainLock);
-
 	auto headers = it2->value.GetArray();
 	uint64_t min_height = std::numeric_limits<uint64_t>::max();
 	uint64_t max_height = 0;
@@ -969,8 +1428,7 @@ uint32_t p2pool::parse_block_headers_range(const char* data, size_t size)
 		if (PARSE(*i, c, height) && PARSE(*i, c, timestamp) && PARSE(*i, c, reward) && parseValue(*i, "hash", c.id)) {
 			min_height = std::min(min_height, c.height);
 			max_height = std::max(max_height, c.height);
-			m_mainchainByHeight[c.height] = c;
-			m_mainchainByHash[c.id] = c;
+			m_mainchain->update(c.height, [&c](ChainMain& data) { data = c; });
 			++num_headers_parsed;
 		}
 	}
@@ -979,6 +1437,38 @@ uint32_t p2pool::parse_block_headers_range(const char* data, size_t size)
 	return num_headers_parsed;
 }
 
+void p2pool::api_update()
+{
+	const uint32_t dirty = m_apiDirty.exchange(0);
+
+	if (dirty & API_NETWORK_STATS) {
+		api_update_network_stats();
+	}
+
+	if (dirty & API_POOL_STATS) {
+		api_update_pool_stats();
+	}
+
+	if (dirty & API_BLOCKS) {
+		api_update_blocks();
+	}
+
+	if (dirty & API_STATS_MOD) {
+		api_update_stats_mod();
+	}
+
+	if ((dirty & API_LOCAL_STATS) && m_stratumServer) {
+		m_stratumServer->api_update_local_stats();
+	}
+
+	// Metrics change all the time, so they're updated on every tick
+	m_api->set(p2pool_api::Category::GLOBAL, "metrics", [](log::Stream& s) { metrics::write_json(s); });
+
+	if (alloc_telemetry::enabled()) {
+		m_api->set(p2pool_api::Category::GLOBAL, "alloc", [](log::Stream& s) { alloc_telemetry::write_json(s); });
+	}
+}
+
 void p2pool::api_update_network_stats()
 {
 	if (!m_api) {
@@ -987,8 +1477,7 @@ void p2pool::api_update_network_stats()
 
 	ChainMain mainnet_tip;
 	{
-		ReadLock lock(m_mainchainLock);
-		mainnet_tip = m_mainchainByHash[m_minerData.prev_id];
+		m_mainchain->get_by_hash(m_minerData.prev_id, mainnet_tip);
 	}
 
 	m_api->set(p2pool_api::Category::NETWORK, "stats",
@@ -1000,8 +1489,6 @@ void p2pool::api_update_network_stats()
 				<< ",\"reward\":" << mainnet_tip.reward
 				<< ",\"timestamp\":" << mainnet_tip.timestamp << "}";
 		});
-
-	api_update_stats_mod();
 }
 
 void p2pool::api_update_pool_stats()
@@ -1040,8 +1527,6 @@ void p2pool::api_update_pool_stats()
 				<< ",\"totalBlocksFound\":" << total_blocks_found
 				<< "}}";
 		});
-
-	api_update_stats_mod();
 }
 
 void p2pool::api_update_stats_mod()
@@ -1052,8 +1537,7 @@ void p2pool::api_update_stats_mod()
 
 	ChainMain mainnet_tip;
 	{
-		ReadLock lock(m_mainchainLock);
-		mainnet_tip = m_mainchainByHash[m_minerData.prev_id];
+		m_mainchain->get_by_hash(m_minerData.prev_id, mainnet_tip);
 	}
 
 	time_t last_block_found_time = 0;
@@ -1105,35 +1589,8 @@ void p2pool::api_update_stats_mod()
 		});
 }
 
-void p2pool::cleanup_mainchain_data(uint64_t height)
-{
-	// Expects m_mainchainLock to be already locked here
-	// Deletes everything older than 720 blocks, except for the 3 latest RandomX seed heights
-
-	constexpr uint64_t PRUNE_DISTANCE = BLOCK_HEADERS_REQUIRED;
-	const uint64_t seed_height = get_seed_height(height);
-	const std::array<uint64_t, 3> seed_heights{ seed_height, seed_height - SEEDHASH_EPOCH_BLOCKS, seed_height - SEEDHASH_EPOCH_BLOCKS * 2 };
-
-	for (auto it = m_mainchainByHeight.begin(); it != m_mainchainByHeight.end();) {
-		const uint64_t h = it->first;
-		if (h + PRUNE_DISTANCE >= height) {
-			break;
-		}
-
-		if (std::find(seed_heights.begin(), seed_heights.end(), h) == seed_heights.end()) {
-			m_mainchainByHash.erase(it->second.id);
-			it = m_mainchainByHeight.erase(it);
-		}
-		else {
-			++it;
-		}
-	}
-}
-
 void p2pool::api_update_block_found(const ChainMain* data)
 {
-	clear_crypto_cache();
-
 	if (!m_api) {
 		return;
 	}
@@ -1149,12 +1606,19 @@ void p2pool::api_update_block_found(const ChainMain* data)
 		}
 	}
 
+	if (data) {
+		MutexLock lock(m_foundBlocksLock);
+		m_foundBlocks.emplace_back(cur_time, data->height, data->id, diff, total_hashes);
+	}
+
+	api_set_dirty(API_POOL_STATS | API_BLOCKS | API_STATS_MOD);
+}
+
+void p2pool::api_update_blocks()
+{
 	std::vector<FoundBlock> found_blocks;
 	{
 		MutexLock lock(m_foundBlocksLock);
-		if (data) {
-			m_foundBlocks.emplace_back(cur_time, data->height, data->id, diff, total_hashes);
-		}
 		found_blocks.assign(m_foundBlocks.end() - std::min<size_t>(m_foundBlocks.size(), 51), m_foundBlocks.end());
 	}
 
@@ -1176,21 +1640,11 @@ void p2pool::api_update_block_found(const ChainMain* data)
 			}
 			s << ']';
 		});
-
-	api_update_stats_mod();
 }
 
 bool p2pool::get_difficulty_at_height(uint64_t height, difficulty_type& diff)
 {
-	ReadLock lock(m_mainchainLock);
-
-	auto it = m_mainchainByHeight.find(height);
-	if (it == m_mainchainByHeight.end()) {
-		return false;
-	}
-
-	diff = it->second.difficulty;
-	return true;
+	return m_mainchain->get_difficulty(height, diff);
 }
 
 static void on_signal(uv_signal_t* handle, int signum)
@@ -1249,6 +1703,11 @@ static bool init_signals(p2pool* pool)
 
 	static uv_signal_t signals[array_size(signal_names)];
 
+#ifdef SIGPIPE
+	// Writing to a socket closed by the other side (an idle keep-alive connection to monerod, for example) must fail with EPIPE and not kill p2pool
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
 	for (size_t i = 0; i < array_size(signal_names); ++i) {
 		uv_signal_init(uv_default_loop_checked(), &signals[i]);
 		signals[i].data = pool;
@@ -1284,12 +1743,33 @@ int p2pool::run()
 		return 1;
 	}
 
+	if (!m_params->m_recordTrafficPath.empty() && !traffic::start_recording(m_params->m_recordTrafficPath)) {
+		return 1;
+	}
+
+	if (m_params->m_allocTelemetry) {
+		if (alloc_telemetry::enabled()) {
+			LOGINFO(1, "allocation telemetry enabled, one sample every " << alloc_telemetry::DEFAULT_SAMPLE_INTERVAL << " bytes");
+		}
+		else {
+			LOGWARN(1, "allocation telemetry couldn't be enabled");
+		}
+	}
+
 	try {
+		m_startupTime = std::chrono::steady_clock::now();
+
+		// These don't depend on each other, monerod answers them in parallel
 		get_info();
+		get_version();
+		preload_block_cache_async();
 		load_found_blocks();
 		const int rc = uv_run(uv_default_loop_checked(), UV_RUN_DEFAULT);
 		LOGINFO(1, "uv_run exited, result = " << rc);
-		delete m_ZMQReader;
+		for (ZMQReader* reader : m_ZMQReaders) {
+			delete reader;
+		}
+		m_ZMQReaders.clear();
 	}
 	catch (const std::exception& e) {
 		const char* s = e.what();
@@ -1304,6 +1784,8 @@ int p2pool::run()
 	delete m_stratumServer;
 	delete m_p2pServer;
 
+	traffic::stop_recording();
+
 	LOGINFO(1, "stopped");
 	return 0;
 }
@@ -18,7 +18,6 @@
 #pragma once
 
 #include "uv_util.h"
-#include <map>
 
 namespace p2pool {
 
@@ -32,6 +31,8 @@ class P2PServer;
 class ConsoleCommands;
 class p2pool_api;
 class ZMQReader;
+class BlockCache;
+class MainchainIndex;
 
 class p2pool : public MinerCallbackHandler
 {
@@ -47,6 +48,7 @@ public:
 	const Params& params() const { return *m_params; }
 	BlockTemplate& block_template() { return *m_blockTemplate; }
 	SideChain& side_chain() { return *m_sideChain; }
+	const Mempool& mempool() const { return *m_mempool; }
 	const MinerData& miner_data() const { return m_minerData; }
 
 	p2pool_api* api() const { return m_api; }
@@ -58,16 +60,19 @@ public:
 
 	StratumServer* stratum_server() const { return m_stratumServer; }
 	P2PServer* p2p_server() const { return m_p2pServer; }
+	BlockCache* block_cache() const { return m_blockCache; }
 
 	virtual void handle_tx(TxMempoolData& tx) override;
 	virtual void handle_miner_data(MinerData& data) override;
 	virtual void handle_chain_main(ChainMain& data, const char* extra) override;
 
 	void submit_block_async(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
-	void submit_block_async(const std::vector<uint8_t>& blob);
+	void submit_block_async(const uint8_t* blob, size_t size);
 	void submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
 
-	void update_block_template_async();
+	// New Monero blocks update the template right away, so does the first sidechain change (new tip or uncle) after a quiet period
+	// Sidechain changes within TEMPLATE_UPDATE_DEBOUNCE_MS after an update are coalesced into a single update at the end of that time
+	void update_block_template_async(bool coalesce = false);
 	void update_block_template();
 
 	void download_block_headers(uint64_t current_height);
@@ -76,9 +81,24 @@ public:
 
 	void api_update_block_found(const ChainMain* data);
 
+	// API documents are regenerated by a timer in the main event loop, events only mark the ones they changed
+	enum ApiDocument : uint32_t {
+		API_NETWORK_STATS = 1 << 0,
+		API_POOL_STATS    = 1 << 1,
+		API_STATS_MOD     = 1 << 2,
+		API_BLOCKS        = 1 << 3,
+		API_LOCAL_STATS   = 1 << 4,
+	};
+
+	FORCEINLINE void api_set_dirty(uint32_t documents) { if (m_api) { m_apiDirty.fetch_or(documents); } }
+
 	bool get_difficulty_at_height(uint64_t height, difficulty_type& diff);
 
 	time_t zmq_last_active() const { return m_zmqLastActive; }
+
+	// Switches RPC requests to another monerod if the current one stopped sending ZMQ messages or is consistently late with new blocks
+	void check_hosts();
+	void print_hosts() const;
 	time_t start_time() const { return m_startTime; }
 
 private:
@@ -86,10 +106,15 @@ private:
 	p2pool(p2pool&&) = delete;
 
 	static void on_submit_block(uv_async_t* async) { reinterpret_cast<p2pool*>(async->data)->submit_block(); }
-	static void on_update_block_template(uv_async_t* async) { reinterpret_cast<p2pool*>(async->data)->update_block_template(); }
+	static void on_update_block_template(uv_async_t* async) { reinterpret_cast<p2pool*>(async->data)->on_update_block_template(); }
+	static void on_block_template_timer(uv_timer_t* timer) { reinterpret_cast<p2pool*>(timer->data)->update_block_template(); }
 	static void on_stop(uv_async_t*);
+	static void on_tx_refresh(uv_timer_t* timer) { reinterpret_cast<p2pool*>(timer->data)->refresh_block_template(); }
+	static void on_api_update(uv_timer_t* timer) { reinterpret_cast<p2pool*>(timer->data)->api_update(); }
 
 	void submit_block() const;
+	void refresh_block_template();
+	void on_update_block_template();
 
 	bool m_stopped;
 
@@ -103,12 +128,7 @@ private:
 	bool m_updateSeed;
 	Mempool* m_mempool;
 
-	mutable uv_rwlock_t m_mainchainLock;
-	std::map<uint64_t, ChainMain> m_mainchainByHeight;
-	unordered_map<hash, ChainMain> m_mainchainByHash;
-
-	enum { TIMESTAMP_WINDOW = 60 };
-	bool get_timestamps(uint64_t (&timestamps)[TIMESTAMP_WINDOW]) const;
+	MainchainIndex* m_mainchain;
 	void update_median_timestamp();
 
 	void stratum_on_block();
@@ -126,11 +146,40 @@ private:
 	bool parse_block_header(const char* data, size_t size, ChainMain& result);
 	uint32_t parse_block_headers_range(const char* data, size_t size);
 
+	void api_update();
 	void api_update_network_stats();
 	void api_update_pool_stats();
 	void api_update_stats_mod();
+	void api_update_blocks();
+
+	std::atomic<uint32_t> m_apiDirty{ 0 };
+	uv_timer_t m_apiUpdateTimer;
+
+	// Startup tasks run concurrently, ZMQ, stratum and P2P servers start as soon as the ones they need are done
+	enum StartupStage : uint32_t {
+		STARTUP_DAEMON_INFO,
+		STARTUP_DAEMON_VERSION,
+		STARTUP_MINER_DATA,
+		STARTUP_SEED_HEADER,
+		STARTUP_OLD_SEED,
+		STARTUP_BLOCK_HEADERS,
+		STARTUP_BLOCK_CACHE,
+		STARTUP_SERVERS,
+		NUM_STARTUP_STAGES
+	};
+
+	// Milliseconds since run() was called when each stage finished, -1 if it's not finished yet
+	// Accessed only from the main thread
+	std::chrono::steady_clock::time_point m_startupTime;
+	int64_t m_startupStageTime[NUM_STARTUP_STAGES];
+
+	bool startup_stage_done(StartupStage stage) const { return m_startupStageTime[stage] >= 0; }
+	void on_startup_stage_done(StartupStage stage);
+	void print_startup_timings() const;
 
-	void cleanup_mainchain_data(uint64_t height);
+	void set_old_seed_async(const hash& seed);
+	void preload_block_cache_async();
+	void start_servers();
 
 	struct FoundBlock
 	{
@@ -155,6 +204,7 @@ private:
 	std::atomic<uint32_t> m_serversStarted{ 0 };
 	StratumServer* m_stratumServer = nullptr;
 	P2PServer* m_p2pServer = nullptr;
+	BlockCache* m_blockCache = nullptr;
 
 	ConsoleCommands* m_consoleCommands;
 
@@ -172,11 +222,79 @@ private:
 	uv_async_t m_submitBlockAsync;
 	uv_async_t m_blockTemplateAsync;
 	uv_async_t m_stopAsync;
+	uv_timer_t m_txRefreshTimer;
 
+	// Template updates requested by update_block_template_async() and not done yet
+	std::atomic<bool> m_templateUpdateNow{ false };
+	std::atomic<bool> m_templateUpdateCoalesced{ false };
+	uv_timer_t m_blockTemplateTimer;
+
+	time_t m_lastTemplateUpdate;
+	uint64_t m_lastTemplateUpdateTime;
 	time_t m_zmqLastActive;
 	time_t m_startTime;
 
-	ZMQReader* m_ZMQReader = nullptr;
+	// Every monerod from the command line has its own ZMQ subscription, messages from all of them are handled here
+	// New miner data is acted on when the first host delivers it, copies from the other hosts only update their stats
+	struct ZMQHandler : public MinerCallbackHandler
+	{
+		FORCEINLINE ZMQHandler(p2pool* pool, uint32_t index) : m_pool(pool), m_index(index) {}
+
+		void handle_tx(TxMempoolData& tx) override;
+		void handle_miner_data(MinerData& data) override;
+		void handle_chain_main(ChainMain& data, const char* extra) override;
+
+		p2pool* m_pool;
+		uint32_t m_index;
+	};
+
+	struct HostStatus
+	{
+		std::atomic<time_t> m_zmqLastActive{ 0 };
+
+		// Accessed only with m_minerDataLock locked
+		uint64_t m_minerDataFirst = 0;
+		uint64_t m_minerDataLate = 0;
+		double m_avgDelayMs = 0.0;
+	};
+
+	std::vector<ZMQHandler*> m_zmqHandlers;
+	std::vector<ZMQReader*> m_ZMQReaders;
+	std::vector<HostStatus> m_hostStatus;
+
+	// Index of the host in params().m_hosts which gets RPC requests
+	std::atomic<uint32_t> m_currentHost{ 0 };
+
+	// Miner data seen recently from any host, used to tell new blocks from copies of them
+	struct RecentMinerData
+	{
+		uint64_t height;
+		hash prev_id;
+		std::chrono::steady_clock::time_point received;
+	};
+
+	enum { RECENT_MINER_DATA_SIZE = 8 };
+
+	struct RecentChainMain
+	{
+		uint64_t height;
+		uint64_t timestamp;
+		uint64_t reward;
+	};
+
+	mutable uv_mutex_t m_minerDataLock;
+
+	// Held while new miner data is handled, so it's never taken together with m_minerDataLock
+	uv_mutex_t m_handleMinerDataLock;
+	RecentMinerData m_recentMinerData[RECENT_MINER_DATA_SIZE] = {};
+	uint32_t m_recentMinerDataIndex = 0;
+	uint64_t m_recentMinerDataHeight = 0;
+	RecentChainMain m_recentChainMain[RECENT_MINER_DATA_SIZE] = {};
+	uint32_t m_recentChainMainIndex = 0;
+
+	bool is_new_miner_data(const MinerData& data, uint32_t host_index);
+	bool is_new_chain_main(const ChainMain& data);
+	void switch_host(uint32_t index, const char* reason);
 };
 
 } // namespace p2pool
@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "p2pool_api.h"
+#include "http_server.h"
 
 #ifdef _MSC_VER
 #include <direct.h>
@@ -28,12 +29,27 @@ static constexpr char log_category_prefix[] = "P2Pool API ";
 
 namespace p2pool {
 
-p2pool_api::p2pool_api(const std::string& api_path, const bool local_stats): m_apiPath(api_path)
+p2pool_api::p2pool_api(const std::string& api_path, const std::string& http_addresses, const bool local_stats)
+	: m_dumpToFile(!api_path.empty())
+	, m_httpServer(nullptr)
+	, m_apiPath(api_path)
 {
-	if (m_apiPath.empty()) {
-		LOGERR(1, "api path is empty");
+	if (!http_addresses.empty()) {
+		m_httpServer = new HTTPServer(http_addresses);
+	}
+
+	uv_mutex_init_checked(&m_dumpDataLock);
+
+	int result = uv_async_init(uv_default_loop_checked(), &m_dumpToFileAsync, on_dump_to_file);
+	if (result) {
+		LOGERR(1, "uv_async_init failed, error " << uv_err_name(result));
 		panic();
 	}
+	m_dumpToFileAsync.data = this;
+
+	if (!m_dumpToFile) {
+		return;
+	}
 
 	if ((m_apiPath.back() != '/')
 #ifdef _WIN32
@@ -49,15 +65,6 @@ p2pool_api::p2pool_api(const std::string& api_path, const bool local_stats): m_a
 		panic();
 	}
 
-	int result = uv_async_init(uv_default_loop_checked(), &m_dumpToFileAsync, on_dump_to_file);
-	if (result) {
-		LOGERR(1, "uv_async_init failed, error " << uv_err_name(result));
-		panic();
-	}
-	m_dumpToFileAsync.data = this;
-
-	uv_mutex_init_checked(&m_dumpDataLock);
-
 	m_networkPath = m_apiPath + "network/";
 	m_poolPath = m_apiPath + "pool/";
 	m_localPath = m_apiPath + "local/";
@@ -72,6 +79,7 @@ p2pool_api::p2pool_api(const std::string& api_path, const bool local_stats): m_a
 
 p2pool_api::~p2pool_api()
 {
+	delete m_httpServer;
 	uv_mutex_destroy(&m_dumpDataLock);
 }
 
@@ -108,6 +116,23 @@ void p2pool_api::dump_to_file_async_internal(const Category& category, const cha
 	callback(s);
 	buf.resize(s.m_pos);
 
+	if (m_httpServer) {
+		std::string url;
+
+		switch (category) {
+		case Category::GLOBAL:  url = "/";         break;
+		case Category::NETWORK: url = "/network/"; break;
+		case Category::POOL:    url = "/pool/";    break;
+		case Category::LOCAL:   url = "/local/";   break;
+		}
+
+		m_httpServer->update(url + filename, buf.data(), buf.size());
+	}
+
+	if (!m_dumpToFile) {
+		return;
+	}
+
 	std::string path;
 
 	switch (category) {
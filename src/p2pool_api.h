@@ -21,10 +21,12 @@
 
 namespace p2pool {
 
+class HTTPServer;
+
 class p2pool_api
 {
 public:
-	p2pool_api(const std::string& api_path, const bool local_stats);
+	p2pool_api(const std::string& api_path, const std::string& http_addresses, const bool local_stats);
 	~p2pool_api();
 
 	enum class Category {
@@ -77,6 +79,10 @@ private:
 	static void on_fs_write(uv_fs_t* req);
 	static void on_fs_close(uv_fs_t* req);
 
+	// JSON files are written only if the api path is set, the HTTP server keeps the latest version of each of them in memory
+	bool m_dumpToFile;
+	HTTPServer* m_httpServer;
+
 	std::string m_apiPath;
 	std::string m_networkPath;
 	std::string m_poolPath;
@@ -24,23 +24,42 @@ namespace p2pool {
 
 Params::Params(int argc, char* argv[])
 {
+	bool host_set = false;
+
 	for (int i = 1; i < argc; ++i) {
 		if ((strcmp(argv[i], "--host") == 0) && (i + 1 < argc)) {
-			m_host = argv[++i];
+			// Ports given before the first --host apply to it
+			if (host_set) {
+				m_hosts.emplace_back();
+			}
+			m_hosts.back().m_address = argv[++i];
+			host_set = true;
 		}
 
 		if ((strcmp(argv[i], "--rpc-port") == 0) && (i + 1 < argc)) {
-			m_rpcPort = static_cast<uint32_t>(atoi(argv[++i]));
+			m_hosts.back().m_rpcPort = static_cast<uint32_t>(atoi(argv[++i]));
 		}
 
 		if ((strcmp(argv[i], "--zmq-port") == 0) && (i + 1 < argc)) {
-			m_zmqPort = static_cast<uint32_t>(atoi(argv[++i]));
+			m_hosts.back().m_zmqPort = static_cast<uint32_t>(atoi(argv[++i]));
 		}
 
 		if (strcmp(argv[i], "--light-mode") == 0) {
 			m_lightMode = true;
 		}
 
+		if ((strcmp(argv[i], "--randomx-vms") == 0) && (i + 1 < argc)) {
+			m_numRandomXVMs = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 0), 1024));
+		}
+
+		if (strcmp(argv[i], "--prebuild-dataset") == 0) {
+			m_prebuildDataset = true;
+		}
+
+		if (strcmp(argv[i], "--numa") == 0) {
+			m_numa = true;
+		}
+
 		if ((strcmp(argv[i], "--wallet") == 0) && (i + 1 < argc)) {
 			m_wallet.decode(argv[++i]);
 		}
@@ -49,6 +68,22 @@ Params::Params(int argc, char* argv[])
 			m_stratumAddresses = argv[++i];
 		}
 
+		if ((strcmp(argv[i], "--stratum-threads") == 0) && (i + 1 < argc)) {
+			m_stratumThreads = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 1), 64));
+		}
+
+		if ((strcmp(argv[i], "--stratum-vardiff") == 0) && (i + 1 < argc)) {
+			m_stratumVardiff = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 0), 3600));
+		}
+
+		if ((strcmp(argv[i], "--stratum-group-size") == 0) && (i + 1 < argc)) {
+			m_stratumGroupSize = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 1), 256));
+		}
+
+		if ((strcmp(argv[i], "--stratum-verify") == 0) && (i + 1 < argc)) {
+			m_stratumVerifyRate = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 0), 100));
+		}
+
 		if ((strcmp(argv[i], "--p2p") == 0) && (i + 1 < argc)) {
 			m_p2pAddresses = argv[++i];
 		}
@@ -70,6 +105,14 @@ Params::Params(int argc, char* argv[])
 			m_apiPath = argv[++i];
 		}
 
+		if ((strcmp(argv[i], "--http-api") == 0) && (i + 1 < argc)) {
+			m_httpApiAddresses = argv[++i];
+		}
+
+		if ((strcmp(argv[i], "--api-update-interval") == 0) && (i + 1 < argc)) {
+			m_apiUpdateInterval = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 1), 3600));
+		}
+
 		if (strcmp(argv[i], "--stratum-api") == 0) {
 			m_localStats = true;
 		}
@@ -78,6 +121,26 @@ Params::Params(int argc, char* argv[])
 			m_blockCache = false;
 		}
 
+		if ((strcmp(argv[i], "--tx-refresh-interval") == 0) && (i + 1 < argc)) {
+			m_txRefreshInterval = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 0), 3600));
+		}
+
+		if ((strcmp(argv[i], "--tx-selection-time") == 0) && (i + 1 < argc)) {
+			m_txSelectionTimeBudget = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 0), 1000));
+		}
+
+		if ((strcmp(argv[i], "--record-traffic") == 0) && (i + 1 < argc)) {
+			m_recordTrafficPath = argv[++i];
+		}
+
+		if (strcmp(argv[i], "--alloc-telemetry") == 0) {
+			m_allocTelemetry = true;
+		}
+
+		if (strcmp(argv[i], "--log-deferred") == 0) {
+			log::DEFERRED_FORMATTING = true;
+		}
+
 		if (strcmp(argv[i], "--no-color") == 0) {
 			log::CONSOLE_COLORS = false;
 		}
@@ -106,7 +169,13 @@ Params::Params(int argc, char* argv[])
 
 bool Params::ok() const
 {
-	return !m_host.empty() && m_rpcPort && m_zmqPort && m_wallet.valid();
+	for (const Host& h : m_hosts) {
+		if (h.m_address.empty() || !h.m_rpcPort || !h.m_zmqPort) {
+			return false;
+		}
+	}
+
+	return m_wallet.valid();
 }
 
 } // namespace p2pool
@@ -27,18 +27,37 @@ struct Params
 
 	bool ok() const;
 
-	std::string m_host = "127.0.0.1";
-	uint32_t m_rpcPort = 18081;
-	uint32_t m_zmqPort = 18083;
+	// Every --host starts a new monerod entry, --rpc-port and --zmq-port apply to the last one
+	struct Host
+	{
+		std::string m_address = "127.0.0.1";
+		uint32_t m_rpcPort = 18081;
+		uint32_t m_zmqPort = 18083;
+	};
+
+	std::vector<Host> m_hosts{ Host() };
 	bool m_lightMode = false;
+	uint32_t m_numRandomXVMs = 0;
+	bool m_prebuildDataset = false;
+	bool m_numa = false;
 	Wallet m_wallet{ nullptr };
 	std::string m_stratumAddresses;
+	uint32_t m_stratumThreads = 1;
+	uint32_t m_stratumVardiff = 0;
+	uint32_t m_stratumGroupSize = 1;
+	uint32_t m_stratumVerifyRate = 0;
 	std::string m_p2pAddresses;
 	std::string m_p2pPeerList;
 	std::string m_config;
 	std::string m_apiPath;
+	std::string m_httpApiAddresses;
+	uint32_t m_apiUpdateInterval = 5;
 	bool m_localStats = false;
 	bool m_blockCache = true;
+	uint32_t m_txRefreshInterval = 10;
+	uint32_t m_txSelectionTimeBudget = 0;
+	std::string m_recordTrafficPath;
+	bool m_allocTelemetry = false;
 };
 
 } // namespace p2pool
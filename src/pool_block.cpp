@@ -21,6 +21,7 @@
 #include "side_chain.h"
 #include "pow_hash.h"
 #include "crypto.h"
+#include "memory_leak_debug.h"
 
 static constexpr char log_category_prefix[] = "PoolBlock ";
 
@@ -28,8 +29,180 @@ static constexpr char log_category_prefix[] = "PoolBlock ";
 
 namespace p2pool {
 
+class PoolBlockSlabs : public nocopy_nomove
+{
+public:
+	PoolBlockSlabs() : m_partialSlabs(nullptr), m_numSlabs(0)
+	{
+		uv_mutex_init_checked(&m_lock);
+	}
+
+	~PoolBlockSlabs()
+	{
+		// Only empty slabs can be freed here, if something still uses a slab it will be reported as a leak in debug builds
+		Slab* slab = m_partialSlabs;
+		while (slab) {
+			Slab* next = slab->m_next;
+			if (slab->m_numUsed == 0) {
+				free_hook(slab);
+			}
+			slab = next;
+		}
+		uv_mutex_destroy(&m_lock);
+	}
+
+	void* allocate()
+	{
+		MutexLock lock(m_lock);
+
+		Slab* slab = m_partialSlabs;
+		if (!slab) {
+			slab = new_slab();
+		}
+
+		Slot* slot = slab->m_freeSlots;
+		slab->m_freeSlots = slot->m_next;
+		++slab->m_numUsed;
+
+		// Full slabs are not in the list
+		if (!slab->m_freeSlots) {
+			unlink(slab);
+		}
+
+		slot->m_slab = slab;
+		return slot->m_data;
+	}
+
+	void deallocate(void* p)
+	{
+		Slot* slot = reinterpret_cast<Slot*>(reinterpret_cast<uint8_t*>(p) - offsetof(Slot, m_data));
+
+		MutexLock lock(m_lock);
+
+		Slab* slab = slot->m_slab;
+		if (!slab->m_freeSlots) {
+			link(slab);
+		}
+
+		slot->m_next = slab->m_freeSlots;
+		slab->m_freeSlots = slot;
+		--slab->m_numUsed;
+
+		// Keep one slab around to avoid allocating and freeing it repeatedly when the sidechain is small
+		if ((slab->m_numUsed == 0) && (m_numSlabs > 1)) {
+			unlink(slab);
+			free_hook(slab);
+			--m_numSlabs;
+		}
+	}
+
+private:
+	enum { SLOTS_PER_SLAB = 128 };
+
+	struct Slab;
+
+	struct Slot
+	{
+		union {
+			Slot* m_next;
+			Slab* m_slab;
+		};
+		alignas(16) uint8_t m_data[sizeof(PoolBlock)];
+	};
+
+	struct Slab
+	{
+		Slab* m_prev;
+		Slab* m_next;
+		Slot* m_freeSlots;
+		uint32_t m_numUsed;
+		alignas(16) Slot m_slots[SLOTS_PER_SLAB];
+	};
+
+	Slab* new_slab()
+	{
+		Slab* slab = reinterpret_cast<Slab*>(malloc_hook(sizeof(Slab)));
+		if (!slab) {
+			throw std::bad_alloc();
+		}
+
+		slab->m_prev = nullptr;
+		slab->m_next = nullptr;
+		slab->m_numUsed = 0;
+
+		slab->m_freeSlots = slab->m_slots;
+		for (size_t i = 0; i < SLOTS_PER_SLAB - 1; ++i) {
+			slab->m_slots[i].m_next = slab->m_slots + i + 1;
+		}
+		slab->m_slots[SLOTS_PER_SLAB - 1].m_next = nullptr;
+
+		link(slab);
+		++m_numSlabs;
+
+		return slab;
+	}
+
+	void link(Slab* slab)
+	{
+		slab->m_prev = nullptr;
+		slab->m_next = m_partialSlabs;
+		if (m_partialSlabs) {
+			m_partialSlabs->m_prev = slab;
+		}
+		m_partialSlabs = slab;
+	}
+
+	void unlink(Slab* slab)
+	{
+		if (slab->m_prev) {
+			slab->m_prev->m_next = slab->m_next;
+		}
+		else {
+			m_partialSlabs = slab->m_next;
+		}
+		if (slab->m_next) {
+			slab->m_next->m_prev = slab->m_prev;
+		}
+		slab->m_prev = nullptr;
+		slab->m_next = nullptr;
+	}
+
+	uv_mutex_t m_lock;
+	Slab* m_partialSlabs;
+	size_t m_numSlabs;
+};
+
+static PoolBlockSlabs& pool_block_slabs()
+{
+	static PoolBlockSlabs slabs;
+	return slabs;
+}
+
+void* PoolBlock::operator new(size_t size)
+{
+	// Derived classes don't fit into slots
+	if (size != sizeof(PoolBlock)) {
+		return ::operator new(size);
+	}
+	return pool_block_slabs().allocate();
+}
+
+void PoolBlock::operator delete(void* p, size_t size) noexcept
+{
+	if (!p) {
+		return;
+	}
+	if (size != sizeof(PoolBlock)) {
+		::operator delete(p);
+		return;
+	}
+	pool_block_slabs().deallocate(p);
+}
+
 PoolBlock::PoolBlock()
-	: m_mainChainHeaderSize(0)
+	: m_blob(nullptr)
+	, m_blobMainChainSize(0)
+	, m_mainChainHeaderSize(0)
 	, m_mainChainMinerTxSize(0)
 	, m_mainChainOutputsOffset(0)
 	, m_mainChainOutputsBlobSize(0)
@@ -53,19 +226,21 @@ PoolBlock::PoolBlock()
 	, m_invalid(false)
 	, m_broadcasted(false)
 	, m_wantBroadcast(false)
+	, m_powHash{}
+	, m_powSeed{}
+	, m_powHashTrusted(false)
 	, m_localTimestamp(time(nullptr))
 {
 	uv_mutex_init_checked(&m_lock);
 
-	m_mainChainData.reserve(48 * 1024);
 	m_outputs.reserve(2048);
 	m_transactions.reserve(256);
-	m_sideChainData.reserve(512);
 	m_uncles.reserve(8);
 	m_tmpTxExtra.reserve(80);
 }
 
 PoolBlock::PoolBlock(const PoolBlock& b)
+	: m_blob(nullptr)
 {
 	uv_mutex_init_checked(&m_lock);
 	operator=(b);
@@ -83,6 +258,15 @@ PoolBlock& PoolBlock::operator=(const PoolBlock& b)
 		LOGERR(1, "operator= uv_mutex_trylock failed. Fix the code!");
 	}
 
+	if (b.m_blob) {
+		b.m_blob->add_ref();
+	}
+	if (m_blob) {
+		m_blob->release();
+	}
+	m_blob = b.m_blob;
+	m_blobMainChainSize = b.m_blobMainChainSize;
+
 	m_mainChainData = b.m_mainChainData;
 	m_mainChainHeaderSize = b.m_mainChainHeaderSize;
 	m_mainChainMinerTxSize = b.m_mainChainMinerTxSize;
@@ -114,6 +298,9 @@ PoolBlock& PoolBlock::operator=(const PoolBlock& b)
 	m_invalid = b.m_invalid;
 	m_broadcasted = b.m_broadcasted;
 	m_wantBroadcast = b.m_wantBroadcast;
+	m_powHash = b.m_powHash;
+	m_powSeed = b.m_powSeed;
+	m_powHashTrusted = b.m_powHashTrusted;
 
 	m_localTimestamp = time(nullptr);
 
@@ -126,9 +313,38 @@ PoolBlock& PoolBlock::operator=(const PoolBlock& b)
 
 PoolBlock::~PoolBlock()
 {
+	if (m_blob) {
+		m_blob->release();
+	}
 	uv_mutex_destroy(&m_lock);
 }
 
+void PoolBlock::set_blob(std::vector<uint8_t>&& blob, size_t main_chain_size)
+{
+	if (m_blob) {
+		m_blob->release();
+	}
+	m_blob = new SharedBuf(std::move(blob));
+	m_blobMainChainSize = main_chain_size;
+}
+
+void PoolBlock::make_blob()
+{
+	MutexLock lock(m_lock);
+
+	const size_t main_chain_size = m_mainChainData.size();
+
+	std::vector<uint8_t> blob;
+	blob.reserve(main_chain_size + m_sideChainData.size());
+	blob.insert(blob.end(), m_mainChainData.begin(), m_mainChainData.end());
+	blob.insert(blob.end(), m_sideChainData.begin(), m_sideChainData.end());
+
+	set_blob(std::move(blob), main_chain_size);
+
+	std::vector<uint8_t>().swap(m_mainChainData);
+	std::vector<uint8_t>().swap(m_sideChainData);
+}
+
 void PoolBlock::serialize_mainchain_data(uint32_t nonce, uint32_t extra_nonce, const hash& sidechain_hash)
 {
 	MutexLock lock(m_lock);
@@ -225,7 +441,7 @@ void PoolBlock::serialize_sidechain_data()
 	writeVarint(m_cumulativeDifficulty.hi, m_sideChainData);
 }
 
-bool PoolBlock::get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash& pow_hash)
+bool PoolBlock::get_hashing_blob(uint8_t (&blob)[128], size_t& blob_size)
 {
 	alignas(8) uint8_t hashes[HASH_SIZE * 3];
 
@@ -239,21 +455,22 @@ bool PoolBlock::get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash
 
 	uint64_t count;
 
-	uint8_t blob[128];
-	size_t blob_size = 0;
+	blob_size = 0;
 
 	{
 		MutexLock lock(m_lock);
 
-		if (!m_mainChainHeaderSize || !m_mainChainMinerTxSize || (m_mainChainData.size() < m_mainChainHeaderSize + m_mainChainMinerTxSize)) {
+		const uint8_t* mainchain_data = main_chain_data();
+
+		if (!m_mainChainHeaderSize || !m_mainChainMinerTxSize || (main_chain_data_size() < m_mainChainHeaderSize + m_mainChainMinerTxSize)) {
 			LOGERR(1, "tried to calculate PoW of uninitialized block");
 			return false;
 		}
 
 		blob_size = m_mainChainHeaderSize;
-		memcpy(blob, m_mainChainData.data(), blob_size);
+		memcpy(blob, mainchain_data, blob_size);
 
-		uint8_t* miner_tx = m_mainChainData.data() + m_mainChainHeaderSize;
+		const uint8_t* miner_tx = mainchain_data + m_mainChainHeaderSize;
 		keccak(miner_tx, static_cast<int>(m_mainChainMinerTxSize) - 1, reinterpret_cast<uint8_t*>(hashes), HASH_SIZE);
 
 		count = m_transactions.size();
@@ -295,7 +512,97 @@ bool PoolBlock::get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash
 
 	writeVarint(count, [&blob, &blob_size](uint8_t b) { blob[blob_size++] = b; });
 
+	return true;
+}
+
+bool PoolBlock::get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash& pow_hash)
+{
+	uint8_t blob[128];
+	size_t blob_size;
+
+	if (!get_hashing_blob(blob, blob_size)) {
+		return false;
+	}
+
 	return hasher->calculate(blob, blob_size, seed_hash, pow_hash);
 }
 
+void PoolBlock::compact()
+{
+	MutexLock lock(m_lock);
+
+	std::vector<TxOutput> outputs;
+	if (!parse_outputs(outputs) || (outputs.size() != m_outputs.size())) {
+		LOGWARN(4, "compact: couldn't parse outputs for block " << m_sidechainId);
+		return;
+	}
+
+	std::vector<TxOutput>().swap(m_outputs);
+	std::vector<hash>().swap(m_transactions);
+	std::vector<uint8_t>().swap(m_tmpTxExtra);
+
+	m_mainChainData.shrink_to_fit();
+	m_sideChainData.shrink_to_fit();
+	m_uncles.shrink_to_fit();
+}
+
+const std::vector<PoolBlock::TxOutput>* PoolBlock::get_outputs(std::vector<TxOutput>& tmp) const
+{
+	if (!m_outputs.empty()) {
+		return &m_outputs;
+	}
+
+	MutexLock lock(m_lock);
+	return parse_outputs(tmp) ? &tmp : nullptr;
+}
+
+bool PoolBlock::parse_outputs(std::vector<TxOutput>& outputs) const
+{
+	outputs.clear();
+
+	if ((m_mainChainOutputsOffset <= 0) || (m_mainChainOutputsBlobSize <= 0) ||
+		(static_cast<size_t>(m_mainChainOutputsOffset) + static_cast<size_t>(m_mainChainOutputsBlobSize) > main_chain_data_size())) {
+		return false;
+	}
+
+	const uint8_t* data = main_chain_data() + m_mainChainOutputsOffset;
+	const uint8_t* data_end = data + m_mainChainOutputsBlobSize;
+
+	auto read_varint = [&data, data_end](uint64_t& b) -> bool
+	{
+		uint64_t result = 0;
+
+		for (int k = 0; (data < data_end) && (k < 64); k += 7) {
+			const uint64_t cur_byte = *(data++);
+			result |= (cur_byte & 0x7F) << k;
+
+			if ((cur_byte & 0x80) == 0) {
+				b = result;
+				return true;
+			}
+		}
+		return false;
+	};
+
+	uint64_t num_outputs;
+	if (!read_varint(num_outputs) || (num_outputs > static_cast<uint64_t>(data_end - data) / (HASH_SIZE + 2))) {
+		return false;
+	}
+
+	outputs.reserve(num_outputs);
+
+	for (uint64_t i = 0; i < num_outputs; ++i) {
+		TxOutput t;
+		if (!read_varint(t.m_reward) || (static_cast<size_t>(data_end - data) < HASH_SIZE + 1) || (*(data++) != TXOUT_TO_KEY)) {
+			return false;
+		}
+		memcpy(t.m_ephPublicKey.h, data, HASH_SIZE);
+		data += HASH_SIZE;
+
+		outputs.emplace_back(t);
+	}
+
+	return data == data_end;
+}
+
 } // namespace p2pool
@@ -61,9 +61,20 @@ struct PoolBlock
 	PoolBlock(const PoolBlock& b);
 	PoolBlock& operator=(const PoolBlock& b);
 
+	// PoolBlock objects are allocated from slabs of fixed-size slots (see pool_block.cpp)
+	// Sidechain keeps thousands of them and constantly adds and prunes blocks, so this saves malloc calls and heap fragmentation
+	static void* operator new(size_t size);
+	static void operator delete(void* p, size_t size) noexcept;
+
 	mutable uv_mutex_t m_lock;
 
-	// Monero block template
+	// Serialized block (Monero block template followed by side-chain data) in one immutable buffer
+	// Copies of the block share it, so P2P responses, broadcasts and the block cache send or store these bytes without copying them first
+	// deserialize() and make_blob() replace it, it's never changed in place
+	SharedBuf* m_blob;
+	size_t m_blobMainChainSize;
+
+	// Monero block template and side-chain data while a block template is built, they're empty in blocks which have m_blob
 	std::vector<uint8_t> m_mainChainData;
 	size_t m_mainChainHeaderSize;
 	size_t m_mainChainMinerTxSize;
@@ -97,7 +108,6 @@ struct PoolBlock
 	// All block transaction hashes including the miner transaction hash at index 0
 	std::vector<hash> m_transactions;
 
-	// Side-chain data
 	std::vector<uint8_t> m_sideChainData;
 
 	// Miner's wallet
@@ -130,13 +140,54 @@ struct PoolBlock
 	bool m_broadcasted;
 	bool m_wantBroadcast;
 
+	// PoW hash and the seed it was calculated with, saved in the block cache
+	// m_powHashTrusted is set only for blocks loaded from the local cache with a valid checksum, or hashed by the P2P sync pipeline
+	hash m_powHash;
+	hash m_powSeed;
+	bool m_powHashTrusted;
+
 	time_t m_localTimestamp;
 
 	void serialize_mainchain_data(uint32_t nonce, uint32_t extra_nonce, const hash& sidechain_hash);
 	void serialize_sidechain_data();
 
+	// Moves m_mainChainData and m_sideChainData into a new m_blob
+	void make_blob();
+
+	FORCEINLINE const uint8_t* main_chain_data() const { return m_blob ? m_blob->m_data.data() : m_mainChainData.data(); }
+	FORCEINLINE size_t main_chain_data_size() const { return m_blob ? m_blobMainChainSize : m_mainChainData.size(); }
+	FORCEINLINE const uint8_t* side_chain_data() const { return m_blob ? (m_blob->m_data.data() + m_blobMainChainSize) : m_sideChainData.data(); }
+	FORCEINLINE size_t side_chain_data_size() const { return m_blob ? (m_blob->m_data.size() - m_blobMainChainSize) : m_sideChainData.size(); }
+
 	int deserialize(const uint8_t* data, size_t size, SideChain& sidechain);
+
+	// What the P2P server needs to know about a received block before it's deserialized: is it a duplicate or a stale block
+	// peek() only walks the blob, it doesn't parse outputs and transactions and doesn't hash the block, so m_sidechainId is not verified yet
+	struct Summary
+	{
+		hash m_prevId;
+		uint64_t m_txinGenHeight;
+		hash m_sidechainId;
+		uint64_t m_sidechainHeight;
+		difficulty_type m_cumulativeDifficulty;
+	};
+
+	static int peek(const uint8_t* data, size_t size, Summary& summary);
+
+	bool get_hashing_blob(uint8_t (&blob)[128], size_t& blob_size);
 	bool get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash& pow_hash);
+
+	// Sidechain stores thousands of blocks, so it drops everything that can be parsed back from the block's data:
+	// m_outputs and m_transactions are exact copies of the outputs blob and transaction hashes in it
+	// Must not be called for blocks that still need to calculate PoW hash
+	void compact();
+
+	// Returns m_outputs if the block has them, or parses them from the block's data into "tmp" if the block was compacted
+	const std::vector<TxOutput>* get_outputs(std::vector<TxOutput>& tmp) const;
+
+private:
+	void set_blob(std::vector<uint8_t>&& blob, size_t main_chain_size);
+	bool parse_outputs(std::vector<TxOutput>& outputs) const;
 };
 
 } // namespace p2pool
@@ -25,6 +25,8 @@ namespace p2pool {
 // Semantics must also be checked elsewhere before accepting the block (PoW, reward split between miners, difficulty calculation and so on)
 int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechain)
 {
+	alloc_telemetry::Scope alloc_scope(alloc_telemetry::SIDECHAIN);
+
 	try {
 		// Sanity check
 		if (!data || (size > 128 * 1024)) {
@@ -223,10 +225,14 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechai
 			m_transactions.emplace_back(std::move(id));
 		}
 
-		m_mainChainData.reserve((data - data_begin) + outputs_blob_size_diff);
-		m_mainChainData.assign(data_begin, data_begin + m_mainChainOutputsOffset);
-		m_mainChainData.insert(m_mainChainData.end(), m_mainChainOutputsBlobSize, 0);
-		m_mainChainData.insert(m_mainChainData.end(), data_begin + m_mainChainOutputsOffset + outputs_actual_blob_size, data);
+		// The whole block with the real outputs blob, it's the only copy of the block's bytes which is kept
+		const size_t main_chain_size = (data - data_begin) + outputs_blob_size_diff;
+
+		std::vector<uint8_t> blob;
+		blob.reserve(main_chain_size + (data_end - data));
+		blob.assign(data_begin, data_begin + m_mainChainOutputsOffset);
+		blob.insert(blob.end(), m_mainChainOutputsBlobSize, 0);
+		blob.insert(blob.end(), data_begin + m_mainChainOutputsOffset + outputs_actual_blob_size, data);
 
 		const uint8_t* sidechain_data_begin = data;
 
@@ -286,52 +292,44 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechai
 			return __LINE__;
 		}
 
-		memcpy(m_mainChainData.data() + m_mainChainOutputsOffset, outputs_blob.data(), m_mainChainOutputsBlobSize);
+		memcpy(blob.data() + m_mainChainOutputsOffset, outputs_blob.data(), m_mainChainOutputsBlobSize);
 
-		hash check;
+		// Hash the block with the real outputs blob and consensus ID, replacing NONCE, EXTRA_NONCE and HASH itself with 0's
+		// extra_nonce_offset and sidechain_hash_offset are offsets in the block with the real outputs blob, convert them back to the offsets in data
 		const std::vector<uint8_t>& consensus_id = sidechain.consensus_id();
-		keccak_custom(
-			[this, nonce_offset, extra_nonce_offset, sidechain_hash_offset, data_begin, data_end, &consensus_id, &outputs_blob, outputs_blob_size_diff](int offset) -> uint8_t
-			{
-				uint32_t k = static_cast<uint32_t>(offset - nonce_offset);
-				if (k < NONCE_SIZE) {
-					return 0;
-				}
+		const uint8_t* outputs_end = data_begin + m_mainChainOutputsOffset + outputs_actual_blob_size;
+		const uint8_t* extra_nonce_begin = data_begin + extra_nonce_offset - outputs_blob_size_diff;
+		const uint8_t* sidechain_hash_begin = data_begin + sidechain_hash_offset - outputs_blob_size_diff;
 
-				k = static_cast<uint32_t>(offset - extra_nonce_offset);
-				if (k < EXTRA_NONCE_SIZE) {
-					return 0;
-				}
+		KeccakState state;
 
-				k = static_cast<uint32_t>(offset - sidechain_hash_offset);
-				if (k < HASH_SIZE) {
-					return 0;
-				}
+		state.absorb(data_begin, nonce_offset);
+		state.absorb_zeros(NONCE_SIZE);
 
-				const int data_size = static_cast<int>((data_end - data_begin) + outputs_blob_size_diff);
-				if (offset < data_size) {
-					if (offset < m_mainChainOutputsOffset) {
-						return data_begin[offset];
-					}
-					else if (offset < m_mainChainOutputsOffset + m_mainChainOutputsBlobSize) {
-						const int tmp = offset - m_mainChainOutputsOffset;
-						return outputs_blob[tmp];
-					}
-					else {
-						return data_begin[offset - outputs_blob_size_diff];
-					}
-				}
-				offset -= data_size;
+		state.absorb(data_begin + nonce_offset + NONCE_SIZE, m_mainChainOutputsOffset - nonce_offset - NONCE_SIZE);
+		state.absorb(outputs_blob.data(), m_mainChainOutputsBlobSize);
 
-				return consensus_id[offset];
-			},
-			static_cast<int>(size + outputs_blob_size_diff + consensus_id.size()), check.h, HASH_SIZE);
+		state.absorb(outputs_end, extra_nonce_begin - outputs_end);
+		state.absorb_zeros(EXTRA_NONCE_SIZE);
+
+		state.absorb(extra_nonce_begin + EXTRA_NONCE_SIZE, sidechain_hash_begin - extra_nonce_begin - EXTRA_NONCE_SIZE);
+		state.absorb_zeros(HASH_SIZE);
+
+		state.absorb(sidechain_hash_begin + HASH_SIZE, data_end - sidechain_hash_begin - HASH_SIZE);
+		state.absorb(consensus_id.data(), consensus_id.size());
+
+		hash check;
+		state.finalize(check.h);
 
 		if (check != m_sidechainId) {
 			return __LINE__;
 		}
 
-		m_sideChainData.assign(sidechain_data_begin, data_end);
+		blob.insert(blob.end(), sidechain_data_begin, data_end);
+		set_blob(std::move(blob), main_chain_size);
+
+		m_mainChainData.clear();
+		m_sideChainData.clear();
 	}
 	catch (std::exception& e) {
 		const char* msg = e.what();
@@ -350,9 +348,120 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechai
 	m_broadcasted = false;
 	m_wantBroadcast = false;
 
+	m_powHash = {};
+	m_powSeed = {};
+	m_powHashTrusted = false;
+
 	m_localTimestamp = time(nullptr);
 
 	return 0;
 }
 
+// First phase of deserialize(): the same walk over the blob, but it only reads what duplicate and staleness checks need and skips everything else
+// It returns 0 for some blobs which deserialize() rejects, never the other way around
+int PoolBlock::peek(const uint8_t* data, size_t size, Summary& summary)
+{
+	if (!data || (size > 128 * 1024)) {
+		return __LINE__;
+	}
+
+	const uint8_t* const data_end = data + size;
+
+	auto skip = [&data, data_end](uint64_t size) -> bool
+	{
+		if (static_cast<uint64_t>(data_end - data) < size) {
+			return false;
+		}
+		data += size;
+		return true;
+	};
+
+	auto read_varint = [&data, data_end](uint64_t& b) -> bool
+	{
+		data = readVarint(data, data_end, b);
+		return data != nullptr;
+	};
+
+#define SKIP(size) do { if (!skip(size)) return __LINE__; } while (0)
+#define READ_VARINT(x) do { if (!read_varint(x)) return __LINE__; } while (0)
+#define READ_BUF(buf, size) do { const uint8_t* p = data; SKIP(size); memcpy((buf), p, (size)); } while (0)
+
+	uint64_t tmp;
+
+	// major_version, minor_version, timestamp
+	SKIP(2);
+	READ_VARINT(tmp);
+
+	READ_BUF(summary.m_prevId.h, HASH_SIZE);
+
+	// nonce, miner tx version, unlock_height, number of inputs and TXIN_GEN
+	SKIP(NONCE_SIZE + 1);
+	READ_VARINT(tmp);
+	SKIP(2);
+
+	READ_VARINT(summary.m_txinGenHeight);
+
+	uint64_t num_outputs;
+	READ_VARINT(num_outputs);
+
+	if (num_outputs > 0) {
+		for (uint64_t i = 0; i < num_outputs; ++i) {
+			READ_VARINT(tmp);
+			SKIP(1 + HASH_SIZE);
+		}
+	}
+	else {
+		// Total reward and outputs blob size
+		READ_VARINT(tmp);
+		READ_VARINT(tmp);
+	}
+
+	uint64_t tx_extra_size;
+	READ_VARINT(tx_extra_size);
+
+	// Sidechain id is at the end of tx_extra: TX_EXTRA_MERGE_MINING_TAG, HASH_SIZE, id
+	if (tx_extra_size < HASH_SIZE + 2) {
+		return __LINE__;
+	}
+	SKIP(tx_extra_size - HASH_SIZE);
+	READ_BUF(summary.m_sidechainId.h, HASH_SIZE);
+
+	// Empty tx_inputs
+	SKIP(1);
+
+	uint64_t num_transactions;
+	READ_VARINT(num_transactions);
+
+	if (num_transactions > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
+	SKIP(num_transactions * HASH_SIZE);
+
+	// Miner wallet, txkeySec and parent
+	SKIP(HASH_SIZE * 4);
+
+	uint64_t num_uncles;
+	READ_VARINT(num_uncles);
+
+	if (num_uncles > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
+	SKIP(num_uncles * HASH_SIZE);
+
+	READ_VARINT(summary.m_sidechainHeight);
+
+	// Difficulty
+	READ_VARINT(tmp);
+	READ_VARINT(tmp);
+
+	READ_VARINT(summary.m_cumulativeDifficulty.lo);
+	READ_VARINT(summary.m_cumulativeDifficulty.hi);
+
+#undef SKIP
+#undef READ_VARINT
+#undef READ_BUF
+
+	if (data != data_end) {
+		return __LINE__;
+	}
+
+	return 0;
+}
+
 } // namespace p2pool
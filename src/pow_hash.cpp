@@ -19,19 +19,114 @@
 #include "pow_hash.h"
 #include "p2pool.h"
 #include "params.h"
+#include "metrics.h"
 #include "randomx.h"
 #include "configuration.h"
 #include "virtual_machine.hpp"
 #include <thread>
 
+#ifdef __linux__
+#include <fstream>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
 static constexpr char log_category_prefix[] = "RandomX_Hasher ";
 
 namespace p2pool {
 
+#ifdef __linux__
+// Parses a cpulist like "0-7,16-23"
+static std::vector<uint32_t> parse_cpu_list(const std::string& s)
+{
+	std::vector<uint32_t> result;
+
+	const char* p = s.c_str();
+	while (*p) {
+		char* end;
+		const uint32_t a = static_cast<uint32_t>(strtoul(p, &end, 10));
+		if (end == p) {
+			break;
+		}
+		uint32_t b = a;
+		p = end;
+
+		if (*p == '-') {
+			b = static_cast<uint32_t>(strtoul(p + 1, &end, 10));
+			p = end;
+		}
+
+		for (uint32_t i = a; (i <= b) && (i < 4096); ++i) {
+			result.push_back(i);
+		}
+
+		if (*p != ',') {
+			break;
+		}
+		++p;
+	}
+
+	return result;
+}
+#endif
+
+// Returns the list of CPUs for every NUMA node, empty if there is only one node or it's unknown
+static std::vector<std::vector<uint32_t>> get_numa_nodes()
+{
+	std::vector<std::vector<uint32_t>> result;
+
+#ifdef __linux__
+	for (uint32_t i = 0;; ++i) {
+		std::ifstream f("/sys/devices/system/node/node" + std::to_string(i) + "/cpulist");
+		if (!f.is_open()) {
+			break;
+		}
+
+		std::string s;
+		std::getline(f, s);
+		result.emplace_back(parse_cpu_list(s));
+	}
+#endif
+
+	if (result.size() < 2) {
+		result.clear();
+	}
+
+	return result;
+}
+
+// Binds the current thread to the list of CPUs
+static void bind_to_cpus(const std::vector<uint32_t>& cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	for (uint32_t cpu : cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+		}
+	}
+
+	const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		LOGWARN(1, "pthread_setaffinity_np failed, error " << err);
+	}
+#else
+	(void)cpus;
+#endif
+}
+
 RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 	: m_pool(pool)
 	, m_cache{}
 	, m_dataset(nullptr)
+	, m_nextDataset(nullptr)
+	, m_nextDatasetReady(false)
+	, m_nextDatasetBuilding(false)
+	, m_fullVMs(nullptr)
+	, m_numFullVMs(0)
+	, m_fullVMIndex(0)
 	, m_seed{}
 	, m_index(0)
 	, m_setSeedCounter(0)
@@ -49,6 +144,41 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 		}
 		if (m_dataset) {
 			memory_allocated += RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE;
+
+			// PoW checks run on libuv's threadpool, so one full dataset VM per worker thread is enough to never wait for a VM
+			m_numFullVMs = m_pool->params().m_numRandomXVMs;
+			if (!m_numFullVMs) {
+				m_numFullVMs = uv_threadpool_size();
+			}
+
+			m_fullVMs = new ThreadSafeVM[m_numFullVMs];
+			for (uint32_t i = 0; i < m_numFullVMs; ++i) {
+				uv_mutex_init_checked(&m_fullVMs[i].mutex);
+			}
+
+			LOGINFO(1, "using " << m_numFullVMs << " full dataset VMs");
+
+			if (m_pool->params().m_numa) {
+				init_numa();
+				memory_allocated += (RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE) * (m_numaNodes.empty() ? 0 : (m_numaNodes.size() - 1));
+			}
+
+			if (m_pool->params().m_prebuildDataset && !m_numaNodes.empty()) {
+				LOGWARN(1, "--prebuild-dataset can't be used together with --numa, ignoring it");
+			}
+			else if (m_pool->params().m_prebuildDataset) {
+				m_nextDataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
+				if (!m_nextDataset) {
+					LOGWARN(1, "couldn't allocate the second RandomX dataset using large pages");
+					m_nextDataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+					if (!m_nextDataset) {
+						LOGERR(1, "couldn't allocate the second RandomX dataset, next epoch's dataset won't be prebuilt");
+					}
+				}
+				if (m_nextDataset) {
+					memory_allocated += RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE;
+				}
+			}
 		}
 	}
 
@@ -69,6 +199,7 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 
 	uv_rwlock_init_checked(&m_datasetLock);
 	uv_rwlock_init_checked(&m_cacheLock);
+	uv_mutex_init_checked(&m_nextDatasetLock);
 
 	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_vm); ++i) {
 		uv_mutex_init_checked(&m_vm[i].mutex);
@@ -90,6 +221,7 @@ RandomX_Hasher::~RandomX_Hasher()
 
 	uv_rwlock_destroy(&m_datasetLock);
 	uv_rwlock_destroy(&m_cacheLock);
+	uv_mutex_destroy(&m_nextDatasetLock);
 
 	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_vm); ++i) {
 		{
@@ -101,10 +233,43 @@ RandomX_Hasher::~RandomX_Hasher()
 		uv_mutex_destroy(&m_vm[i].mutex);
 	}
 
+	for (uint32_t i = 0; i < m_numFullVMs; ++i) {
+		{
+			MutexLock lock(m_fullVMs[i].mutex);
+			if (m_fullVMs[i].vm) {
+				randomx_destroy_vm(m_fullVMs[i].vm);
+			}
+		}
+		uv_mutex_destroy(&m_fullVMs[i].mutex);
+	}
+	delete[] m_fullVMs;
+
+	for (size_t i = 1; i < m_numaNodes.size(); ++i) {
+		NumaNode& node = m_numaNodes[i];
+		for (uint32_t j = 0; j < m_numFullVMs; ++j) {
+			{
+				MutexLock lock(node.vms[j].mutex);
+				if (node.vms[j].vm) {
+					randomx_destroy_vm(node.vms[j].vm);
+				}
+			}
+			uv_mutex_destroy(&node.vms[j].mutex);
+		}
+		delete[] node.vms;
+
+		if (node.dataset) {
+			randomx_release_dataset(node.dataset);
+		}
+	}
+
 	if (m_dataset) {
 		randomx_release_dataset(m_dataset);
 	}
 
+	if (m_nextDataset) {
+		randomx_release_dataset(m_nextDataset);
+	}
+
 	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_cache); ++i) {
 		if (m_cache[i]) {
 			randomx_release_cache(m_cache[i]);
@@ -208,58 +373,310 @@ void RandomX_Hasher::set_seed(const hash& seed)
 	LOGINFO(1, log::LightCyan() << "cache updated");
 
 	if (m_dataset) {
-		const uint32_t numItems = randomx_dataset_item_count();
-		uint32_t numThreads = std::thread::hardware_concurrency();
+		if (use_next_dataset(seed)) {
+			LOGINFO(1, log::LightCyan() << "dataset updated (prebuilt)");
+			return;
+		}
+
+		{
+			ReadLock lock2(m_cacheLock);
+
+			if (m_numaNodes.empty()) {
+				init_dataset(m_dataset, m_cache[m_index]);
+			}
+			else {
+				// Each node initializes its own copy using only its own CPUs, so all pages end up in local memory
+				std::vector<std::thread> threads;
+				threads.reserve(m_numaNodes.size());
+
+				randomx_cache* cache = m_cache[m_index];
+
+				for (size_t i = 0; i < m_numaNodes.size(); ++i) {
+					randomx_dataset* dataset = (i == 0) ? m_dataset : m_numaNodes[i].dataset;
+					const std::vector<uint32_t>* cpus = &m_numaNodes[i].cpus;
+					threads.emplace_back([dataset, cache, cpus]() { init_dataset(dataset, cache, cpus); });
+				}
 
-		// Use only half the cores to let other threads do their stuff in the meantime
-		if (numThreads > 1) {
-			numThreads /= 2;
+				for (std::thread& t : threads) {
+					t.join();
+				}
+			}
 		}
 
-		LOGINFO(1, log::LightCyan() << "running " << numThreads << " threads to update dataset");
+		update_full_vms();
 
-		ReadLock lock2(m_cacheLock);
+		LOGINFO(1, log::LightCyan() << "dataset updated");
+	}
+}
 
-		if (numThreads > 1) {
-			std::vector<std::thread> threads;
-			threads.reserve(numThreads);
+void RandomX_Hasher::init_numa()
+{
+	std::vector<std::vector<uint32_t>> nodes = get_numa_nodes();
+	if (nodes.empty()) {
+		LOGWARN(1, "NUMA nodes not found, using a single dataset");
+		return;
+	}
 
-			for (uint32_t i = 0; i < numThreads; ++i) {
-				const uint32_t a = (numItems * i) / numThreads;
-				const uint32_t b = (numItems * (i + 1)) / numThreads;
+	uint32_t max_cpu = 0;
+	for (const std::vector<uint32_t>& cpus : nodes) {
+		for (uint32_t cpu : cpus) {
+			max_cpu = std::max(max_cpu, cpu);
+		}
+	}
+
+	m_cpuToNode.assign(max_cpu + 1, 0);
+
+	m_numaNodes.resize(nodes.size());
 
-				threads.emplace_back([this, a, b]()
-					{
-						// Background doesn't work very well with xmrig mining on all cores
-						//make_thread_background();
-						randomx_init_dataset(m_dataset, m_cache[m_index], a, b - a);
-					});
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		NumaNode& node = m_numaNodes[i];
+		node.cpus = std::move(nodes[i]);
+
+		for (uint32_t cpu : node.cpus) {
+			m_cpuToNode[cpu] = static_cast<uint32_t>(i);
+		}
+
+		if (i == 0) {
+			continue;
+		}
+
+		// Memory is not touched until the dataset is initialized, so the first touch policy will put it on the right node
+		node.dataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
+		if (!node.dataset) {
+			LOGWARN(1, "couldn't allocate RandomX dataset for NUMA node " << i << " using large pages");
+			node.dataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+			if (!node.dataset) {
+				LOGERR(1, "couldn't allocate RandomX dataset for NUMA node " << i << ", using a single dataset");
+				for (size_t j = 1; j < i; ++j) {
+					randomx_release_dataset(m_numaNodes[j].dataset);
+					for (uint32_t k = 0; k < m_numFullVMs; ++k) {
+						uv_mutex_destroy(&m_numaNodes[j].vms[k].mutex);
+					}
+					delete[] m_numaNodes[j].vms;
+				}
+				m_numaNodes.clear();
+				m_cpuToNode.clear();
+				return;
 			}
+		}
+
+		node.vms = new ThreadSafeVM[m_numFullVMs];
+		for (uint32_t j = 0; j < m_numFullVMs; ++j) {
+			uv_mutex_init_checked(&node.vms[j].mutex);
+		}
+	}
+
+	LOGINFO(1, "using " << m_numaNodes.size() << " NUMA nodes, one dataset per node");
+}
 
-			for (std::thread& t : threads) {
-				t.join();
+RandomX_Hasher::ThreadSafeVM* RandomX_Hasher::get_local_vms()
+{
+#ifdef __linux__
+	if (!m_numaNodes.empty()) {
+		const int cpu = sched_getcpu();
+		if ((cpu >= 0) && (static_cast<size_t>(cpu) < m_cpuToNode.size())) {
+			const uint32_t node = m_cpuToNode[cpu];
+			if (node > 0) {
+				return m_numaNodes[node].vms;
 			}
 		}
-		else {
-			randomx_init_dataset(m_dataset, m_cache[m_index], 0, numItems);
+	}
+#endif
+
+	return m_fullVMs;
+}
+
+void RandomX_Hasher::init_dataset(randomx_dataset* dataset, randomx_cache* cache, const std::vector<uint32_t>* cpus)
+{
+	const uint32_t numItems = randomx_dataset_item_count();
+	uint32_t numThreads = cpus ? static_cast<uint32_t>(cpus->size()) : std::thread::hardware_concurrency();
+
+	// Use only half the cores to let other threads do their stuff in the meantime
+	if (numThreads > 1) {
+		numThreads /= 2;
+	}
+
+	LOGINFO(1, log::LightCyan() << "running " << numThreads << " threads to update dataset");
+
+	if (numThreads > 1) {
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads);
+
+		for (uint32_t i = 0; i < numThreads; ++i) {
+			const uint32_t a = (numItems * i) / numThreads;
+			const uint32_t b = (numItems * (i + 1)) / numThreads;
+
+			threads.emplace_back([dataset, cache, cpus, a, b]()
+				{
+					// Background doesn't work very well with xmrig mining on all cores
+					//make_thread_background();
+					if (cpus) {
+						bind_to_cpus(*cpus);
+					}
+					randomx_init_dataset(dataset, cache, a, b - a);
+				});
+		}
+
+		for (std::thread& t : threads) {
+			t.join();
 		}
+	}
+	else {
+		if (cpus) {
+			bind_to_cpus(*cpus);
+		}
+		randomx_init_dataset(dataset, cache, 0, numItems);
+	}
+}
 
-		MutexLock lock3(m_vm[FULL_DATASET_VM].mutex);
+void RandomX_Hasher::update_vms(ThreadSafeVM* vms, uint32_t count, randomx_dataset* dataset)
+{
+	const randomx_flags flags = randomx_get_flags() | RANDOMX_FLAG_FULL_MEM;
 
-		if (!m_vm[FULL_DATASET_VM].vm) {
-			const randomx_flags flags = randomx_get_flags() | RANDOMX_FLAG_FULL_MEM;
+	for (uint32_t i = 0; i < count; ++i) {
+		ThreadSafeVM& vm = vms[i];
+		MutexLock lock(vm.mutex);
 
-			m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, nullptr, m_dataset);
-			if (!m_vm[FULL_DATASET_VM].vm) {
-				LOGWARN(1, "couldn't allocate RandomX VM using large pages");
-				m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags, nullptr, m_dataset);
-				if (!m_vm[FULL_DATASET_VM].vm) {
-					LOGERR(1, "couldn't allocate RandomX VM");
-				}
+		if (vm.vm) {
+			vm.vm->setDataset(dataset);
+			continue;
+		}
+
+		vm.vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, nullptr, dataset);
+		if (!vm.vm) {
+			LOGWARN(1, "couldn't allocate RandomX VM using large pages");
+			vm.vm = randomx_create_vm(flags, nullptr, dataset);
+			if (!vm.vm) {
+				LOGERR(1, "couldn't allocate RandomX VM");
 			}
 		}
+	}
+}
 
-		LOGINFO(1, log::LightCyan() << "dataset updated");
+void RandomX_Hasher::update_full_vms()
+{
+	// Expects m_datasetLock to be already locked for writing here
+	update_vms(m_fullVMs, m_numFullVMs, m_dataset);
+
+	for (size_t i = 1; i < m_numaNodes.size(); ++i) {
+		update_vms(m_numaNodes[i].vms, m_numFullVMs, m_numaNodes[i].dataset);
+	}
+}
+
+bool RandomX_Hasher::use_next_dataset(const hash& seed)
+{
+	// Expects m_datasetLock to be already locked for writing here
+	{
+		MutexLock lock(m_nextDatasetLock);
+
+		if (!m_nextDataset || !m_nextDatasetReady || (m_nextSeed != seed)) {
+			return false;
+		}
+
+		std::swap(m_dataset, m_nextDataset);
+		m_nextDatasetReady = false;
+	}
+
+	update_full_vms();
+	return true;
+}
+
+void RandomX_Hasher::set_next_seed_async(const hash& seed)
+{
+	{
+		MutexLock lock(m_nextDatasetLock);
+
+		if (!m_nextDataset || m_nextDatasetBuilding || (m_nextSeed == seed)) {
+			return;
+		}
+
+		m_nextSeed = seed;
+		m_nextDatasetReady = false;
+		m_nextDatasetBuilding = true;
+	}
+
+	struct Work
+	{
+		p2pool* pool;
+		RandomX_Hasher* hasher;
+		hash seed;
+		uv_work_t req;
+	};
+
+	Work* work = new Work{};
+	work->pool = m_pool;
+	work->hasher = this;
+	work->seed = seed;
+	work->req.data = work;
+
+	const int err = uv_queue_work(uv_default_loop_checked(), &work->req,
+		[](uv_work_t* req)
+		{
+			bkg_jobs_tracker.start("RandomX_Hasher::set_next_seed_async");
+			Work* work = reinterpret_cast<Work*>(req->data);
+			if (!work->pool->stopped()) {
+				work->hasher->build_next_dataset(work->seed);
+			}
+		},
+		[](uv_work_t* req, int)
+		{
+			delete reinterpret_cast<Work*>(req->data);
+			bkg_jobs_tracker.stop("RandomX_Hasher::set_next_seed_async");
+		}
+	);
+
+	if (err) {
+		LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
+		{
+			MutexLock lock(m_nextDatasetLock);
+			m_nextSeed = {};
+			m_nextDatasetBuilding = false;
+		}
+		delete work;
+	}
+}
+
+void RandomX_Hasher::build_next_dataset(const hash& seed)
+{
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([this]()
+		{
+			MutexLock lock(m_nextDatasetLock);
+			m_nextDatasetBuilding = false;
+		});
+
+	if (m_stopped.load()) {
+		return;
+	}
+
+	const randomx_flags flags = randomx_get_flags();
+
+	randomx_cache* cache = randomx_alloc_cache(flags | RANDOMX_FLAG_LARGE_PAGES);
+	if (!cache) {
+		cache = randomx_alloc_cache(flags);
+		if (!cache) {
+			LOGERR(1, "couldn't allocate RandomX cache for the next seed");
+			return;
+		}
+	}
+
+	LOGINFO(1, "prebuilding dataset for the next seed " << log::LightBlue() << seed);
+
+	randomx_init_cache(cache, seed.h, HASH_SIZE);
+
+	// m_nextDataset is not used by anyone else until m_nextDatasetReady is set
+	init_dataset(m_nextDataset, cache);
+	randomx_release_cache(cache);
+
+	if (m_stopped.load()) {
+		return;
+	}
+
+	MutexLock lock(m_nextDatasetLock);
+
+	if (m_nextSeed == seed) {
+		m_nextDatasetReady = true;
+		LOGINFO(1, log::LightCyan() << "next dataset is ready");
 	}
 }
 
@@ -302,6 +719,14 @@ void RandomX_Hasher::set_old_seed(const hash& seed)
 	LOGINFO(1, log::LightCyan() << "old cache updated");
 }
 
+// Hash latency doesn't include the time spent waiting for a free VM
+static FORCEINLINE void calculate_hash(randomx_vm* vm, const void* data, size_t size, hash& result, metrics::Histogram h)
+{
+	const uint64_t t = metrics::now_us();
+	randomx_calculate_hash(vm, data, size, &result);
+	metrics::observe(h, metrics::now_us() - t);
+}
+
 bool RandomX_Hasher::calculate(const void* data, size_t size, const hash& seed, hash& result)
 {
 	// First try to use the dataset if it's ready
@@ -313,10 +738,7 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, const hash& seed,
 			return false;
 		}
 
-		MutexLock lock(m_vm[FULL_DATASET_VM].mutex);
-
-		if (m_vm[FULL_DATASET_VM].vm && (seed == m_seed[m_index])) {
-			randomx_calculate_hash(m_vm[FULL_DATASET_VM].vm, data, size, &result);
+		if ((seed == m_seed[m_index]) && calculate_full(data, size, result)) {
 			return true;
 		}
 	}
@@ -331,7 +753,7 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, const hash& seed,
 	{
 		MutexLock lock2(m_vm[m_index].mutex);
 		if (m_vm[m_index].vm && (seed == m_seed[m_index])) {
-			randomx_calculate_hash(m_vm[m_index].vm, data, size, &result);
+			calculate_hash(m_vm[m_index].vm, data, size, result, metrics::RANDOMX_HASH_LIGHT);
 			return true;
 		}
 	}
@@ -341,11 +763,132 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, const hash& seed,
 	MutexLock lock2(m_vm[prev_index].mutex);
 
 	if (m_vm[prev_index].vm && (seed == m_seed[prev_index])) {
-		randomx_calculate_hash(m_vm[prev_index].vm, data, size, &result);
+		calculate_hash(m_vm[prev_index].vm, data, size, result, metrics::RANDOMX_HASH_LIGHT);
 		return true;
 	}
 
 	return false;
 }
 
+static void calculate_pipelined(randomx_vm* vm, const std::vector<RandomX_Hasher::PowJob*>& batch, metrics::Histogram h)
+{
+	const uint64_t t = metrics::now_us();
+
+	randomx_calculate_hash_first(vm, batch[0]->data, batch[0]->size);
+
+	for (size_t i = 1, n = batch.size(); i < n; ++i) {
+		randomx_calculate_hash_next(vm, batch[i]->data, batch[i]->size, &batch[i - 1]->result);
+		batch[i - 1]->ok = true;
+	}
+
+	randomx_calculate_hash_last(vm, &batch.back()->result);
+	batch.back()->ok = true;
+
+	// Pipelined hashes overlap, so each of them is counted with the average time
+	const uint64_t dt = (metrics::now_us() - t) / batch.size();
+	for (size_t i = 0, n = batch.size(); i < n; ++i) {
+		metrics::observe(h, dt);
+	}
+}
+
+void RandomX_Hasher::calculate_batch(std::vector<PowJob>& jobs)
+{
+	for (PowJob& job : jobs) {
+		job.ok = false;
+	}
+
+	std::vector<PowJob*> batch;
+	batch.reserve(jobs.size());
+
+	// First try to use the dataset if it's ready
+	if (m_numFullVMs && (uv_rwlock_tryrdlock(&m_datasetLock) == 0)) {
+		// cppcheck-suppress unreadVariable
+		ON_SCOPE_LEAVE([this]() { uv_rwlock_rdunlock(&m_datasetLock); });
+
+		if (m_stopped.load()) {
+			return;
+		}
+
+		for (PowJob& job : jobs) {
+			if (job.seed == m_seed[m_index]) {
+				batch.push_back(&job);
+			}
+		}
+
+		if (!batch.empty()) {
+			ThreadSafeVM& vm = get_local_vms()[m_fullVMIndex.fetch_add(1) % m_numFullVMs];
+			MutexLock lock(vm.mutex);
+
+			if (vm.vm) {
+				calculate_pipelined(vm.vm, batch, metrics::RANDOMX_HASH_FULL);
+			}
+		}
+	}
+
+	// Hash everything else using the cache
+	ReadLock lock(m_cacheLock);
+
+	if (m_stopped.load()) {
+		return;
+	}
+
+	const uint32_t indices[2] = { m_index, m_index ^ 1 };
+
+	for (uint32_t index : indices) {
+		batch.clear();
+
+		for (PowJob& job : jobs) {
+			if (!job.ok && (job.seed == m_seed[index])) {
+				batch.push_back(&job);
+			}
+		}
+
+		if (!batch.empty()) {
+			MutexLock lock2(m_vm[index].mutex);
+
+			if (m_vm[index].vm) {
+				calculate_pipelined(m_vm[index].vm, batch, metrics::RANDOMX_HASH_LIGHT);
+			}
+		}
+	}
+}
+
+bool RandomX_Hasher::calculate_full(const void* data, size_t size, hash& result)
+{
+	// Expects m_datasetLock to be already locked here
+	if (!m_numFullVMs) {
+		return false;
+	}
+
+	// Use the VMs bound to this NUMA node's dataset
+	ThreadSafeVM* vms = get_local_vms();
+
+	// Take the first free VM, starting from a different one every time to spread the load
+	const uint32_t start = m_fullVMIndex.fetch_add(1) % m_numFullVMs;
+
+	for (uint32_t i = 0; i < m_numFullVMs; ++i) {
+		ThreadSafeVM& vm = vms[(start + i) % m_numFullVMs];
+		if (uv_mutex_trylock(&vm.mutex) == 0) {
+			// cppcheck-suppress unreadVariable
+			ON_SCOPE_LEAVE([&vm]() { uv_mutex_unlock(&vm.mutex); });
+			if (!vm.vm) {
+				return false;
+			}
+			calculate_hash(vm.vm, data, size, result, metrics::RANDOMX_HASH_FULL);
+			return true;
+		}
+	}
+
+	// All VMs are busy, wait for one of them
+	ThreadSafeVM& vm = vms[start];
+	MutexLock lock(vm.mutex);
+
+	if (!vm.vm) {
+		return false;
+	}
+
+	calculate_hash(vm.vm, data, size, result, metrics::RANDOMX_HASH_FULL);
+	return true;
+}
+
 } // namespace p2pool
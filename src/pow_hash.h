@@ -38,8 +38,30 @@ public:
 
 	void set_old_seed(const hash& seed);
 
+	// Prebuilds the dataset for the next epoch in the background (only with --prebuild-dataset)
+	// set_seed() swaps it in instantly when the seed switches
+	void set_next_seed_async(const hash& seed);
+
 	bool calculate(const void* data, size_t size, const hash& seed, hash& result);
 
+	struct PowJob
+	{
+		FORCEINLINE PowJob() : data(nullptr), size(0), seed(), result(), ok(false) {}
+		FORCEINLINE PowJob(const void* _data, size_t _size, const hash& _seed) : data(_data), size(_size), seed(_seed), result(), ok(false) {}
+
+		const void* data;
+		size_t size;
+		hash seed;
+		hash result;
+		bool ok;
+	};
+
+	// Calculates all hashes using RandomX pipelining (randomx_calculate_hash_first/next/last)
+	// Jobs with the same seed go to the same VM, job.ok is set for every hash that was calculated
+	void calculate_batch(std::vector<PowJob>& jobs);
+
+	uint32_t num_full_vms() const { return m_numFullVMs; }
+
 private:
 
 	struct ThreadSafeVM
@@ -58,11 +80,43 @@ private:
 	uv_rwlock_t m_datasetLock;
 	randomx_dataset* m_dataset;
 
+	uv_mutex_t m_nextDatasetLock;
+	randomx_dataset* m_nextDataset;
+	hash m_nextSeed;
+	bool m_nextDatasetReady;
+	bool m_nextDatasetBuilding;
+
+	static void init_dataset(randomx_dataset* dataset, randomx_cache* cache, const std::vector<uint32_t>* cpus = nullptr);
+	static void update_vms(ThreadSafeVM* vms, uint32_t count, randomx_dataset* dataset);
+	void update_full_vms();
+	bool use_next_dataset(const hash& seed);
+	void build_next_dataset(const hash& seed);
+
 	// 0: light VM for the current seed
 	// 1: light VM for the previous seed
-	// 2: full dataset VM for the current seed
-	enum { FULL_DATASET_VM = 2 };
-	ThreadSafeVM m_vm[3]{};
+	ThreadSafeVM m_vm[2]{};
+
+	// Full dataset VMs for the current seed, they all share m_dataset
+	ThreadSafeVM* m_fullVMs;
+	uint32_t m_numFullVMs;
+	std::atomic<uint32_t> m_fullVMIndex;
+
+	// Only with --numa: a dataset copy and a set of full dataset VMs for every NUMA node
+	// Node 0 always uses m_dataset and m_fullVMs, so m_numaNodes[0] only has the list of CPUs
+	struct NumaNode
+	{
+		std::vector<uint32_t> cpus;
+		randomx_dataset* dataset = nullptr;
+		ThreadSafeVM* vms = nullptr;
+	};
+
+	std::vector<NumaNode> m_numaNodes;
+	std::vector<uint32_t> m_cpuToNode;
+
+	void init_numa();
+	ThreadSafeVM* get_local_vms();
+
+	bool calculate_full(const void* data, size_t size, hash& result);
 
 	hash m_seed[2];
 	uint32_t m_index;
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "share_verifier.h"
+
+namespace p2pool {
+
+ShareVerifier::ShareVerifier(uint32_t default_rate)
+	: m_defaultRate(std::min(default_rate, 100U))
+{
+	uv_mutex_init_checked(&m_suspectsLock);
+}
+
+ShareVerifier::~ShareVerifier()
+{
+	uv_mutex_destroy(&m_suspectsLock);
+}
+
+void ShareVerifier::on_login(ClientState& state, const raw_ip& ip)
+{
+	state.m_cleanShares = 0;
+
+	if (is_suspect(ip)) {
+		state.m_rate = 100;
+		state.m_verifyAllShares = 0;
+		return;
+	}
+
+	// With verification turned off, only clients which sent bad shares get verified
+	state.m_rate = m_defaultRate;
+	state.m_verifyAllShares = m_defaultRate ? VERIFY_NEW_CLIENT_SHARES : 0;
+}
+
+void ShareVerifier::on_good_share(ClientState& state, const raw_ip& ip)
+{
+	if (state.m_rate <= m_defaultRate) {
+		return;
+	}
+
+	if (++state.m_cleanShares < VERIFY_DECAY_SHARES) {
+		return;
+	}
+
+	state.m_cleanShares = 0;
+	state.m_rate = std::max(state.m_rate / 2, m_defaultRate);
+
+	if (state.m_rate == m_defaultRate) {
+		MutexLock lock(m_suspectsLock);
+		m_suspects.erase(ip);
+	}
+}
+
+void ShareVerifier::on_bad_share(ClientState& state, const raw_ip& ip)
+{
+	state.m_rate = 100;
+	state.m_cleanShares = 0;
+	on_bad_share(ip);
+}
+
+void ShareVerifier::on_bad_share(const raw_ip& ip)
+{
+	MutexLock lock(m_suspectsLock);
+	m_suspects[ip] = time(nullptr) + VERIFY_SUSPECT_TIME;
+}
+
+bool ShareVerifier::is_suspect(const raw_ip& ip)
+{
+	MutexLock lock(m_suspectsLock);
+
+	auto it = m_suspects.find(ip);
+	if (it == m_suspects.end()) {
+		return false;
+	}
+
+	if (time(nullptr) >= it->second) {
+		m_suspects.erase(it);
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace p2pool
@@ -0,0 +1,82 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "uv_util.h"
+
+namespace p2pool {
+
+// Shares of a new connection which are verified regardless of the rate
+static constexpr uint32_t VERIFY_NEW_CLIENT_SHARES = 16;
+
+// Verified good shares in a row after which an escalated rate is halved (but not below the default rate)
+static constexpr uint32_t VERIFY_DECAY_SHARES = 1000;
+
+// How long an IP address which sent a bad share is remembered, in seconds
+static constexpr uint64_t VERIFY_SUSPECT_TIME = 24 * 60 * 60;
+
+// Picks which stratum shares below sidechain difficulty get their PoW checked
+// Every client has its own verification rate: it starts at the --stratum-verify rate, jumps to 100% after a bad share
+// and goes back down only after a long run of verified good shares
+// IP addresses which sent bad shares are remembered, so new connections from them start at 100%
+class ShareVerifier : public nocopy_nomove
+{
+public:
+	// Accessed only from the client's event loop
+	struct ClientState
+	{
+		uint32_t m_rate;
+		uint32_t m_verifyAllShares;
+		uint32_t m_cleanShares;
+	};
+
+	explicit ShareVerifier(uint32_t default_rate);
+	~ShareVerifier();
+
+	uint32_t default_rate() const { return m_defaultRate; }
+
+	void on_login(ClientState& state, const raw_ip& ip);
+
+	template<typename Rng>
+	FORCEINLINE bool need_to_verify(ClientState& state, Rng&& rng) const
+	{
+		if (state.m_verifyAllShares) {
+			--state.m_verifyAllShares;
+			return true;
+		}
+
+		return (state.m_rate >= 100) || (state.m_rate && ((rng() % 100) < state.m_rate));
+	}
+
+	// Results of shares which had their PoW checked
+	void on_good_share(ClientState& state, const raw_ip& ip);
+	void on_bad_share(ClientState& state, const raw_ip& ip);
+
+	// For bad shares of clients which are already gone
+	void on_bad_share(const raw_ip& ip);
+
+	bool is_suspect(const raw_ip& ip);
+
+private:
+	const uint32_t m_defaultRate;
+
+	uv_mutex_t m_suspectsLock;
+	unordered_map<raw_ip, time_t> m_suspects;
+};
+
+} // namespace p2pool
@@ -29,10 +29,13 @@
 #include "p2p_server.h"
 #include "params.h"
 #include "json_parsers.h"
+#include "metrics.h"
+#include "memory_leak_debug.h"
 #include <rapidjson/document.h>
 #include <rapidjson/istreamwrapper.h>
 #include <fstream>
 #include <iterator>
+#include <thread>
 #include <numeric>
 
 // Only uncomment it to debug issues with uncle/orphan blocks
@@ -59,15 +62,23 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 	: m_pool(pool)
 	, m_networkType(type)
 	, m_chainTip(nullptr)
+	, m_windowTip(nullptr)
 	, m_poolName(pool_name ? pool_name : "default")
 	, m_targetBlockTime(10)
 	, m_minDifficulty(MIN_DIFFICULTY, 0)
 	, m_chainWindowSize(2160)
 	, m_unclePenalty(20)
 	, m_curDifficulty(m_minDifficulty)
+	, m_stats{}
+	, m_ourWalletId(pool ? pool->params().m_wallet.id() : 0)
+	, m_windowHeightBlocks(0)
+	, m_windowHeightOurBlocks(0)
+	, m_statsSeq(0)
 {
 	LOGINFO(1, log::LightCyan() << "network type  = " << m_networkType);
 
+	publish_stats();
+
 	if (m_pool && !load_config(m_pool->params().m_config)) {
 		panic();
 	}
@@ -76,12 +87,14 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 		panic();
 	}
 
-	uv_mutex_init_checked(&m_sidechainLock);
+	uv_rwlock_init_checked(&m_sidechainLock);
+	uv_mutex_init_checked(&m_seenWalletsLock);
 	uv_mutex_init_checked(&m_seenBlocksLock);
 
 	m_difficultyData.reserve(m_chainWindowSize);
-	m_tmpShares.reserve(m_chainWindowSize * 2);
-	m_tmpRewards.reserve(m_chainWindowSize * 2);
+
+	// Pruning keeps about 2 PPLNS windows of blocks, leave the same amount of space for blocks received ahead of the chain tip
+	m_blocksByHeight.init(m_chainWindowSize * 4 + 1024);
 
 	LOGINFO(1, "generating consensus ID");
 
@@ -149,7 +162,8 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 
 SideChain::~SideChain()
 {
-	uv_mutex_destroy(&m_sidechainLock);
+	uv_rwlock_destroy(&m_sidechainLock);
+	uv_mutex_destroy(&m_seenWalletsLock);
 	uv_mutex_destroy(&m_seenBlocksLock);
 	for (auto& it : m_blocksById) {
 		delete it.second;
@@ -158,7 +172,7 @@ SideChain::~SideChain()
 
 void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares)
 {
-	MutexLock lock(m_sidechainLock);
+	metrics::TimedReadLock lock(m_sidechainLock, metrics::SIDECHAIN_LOCK_WAIT);
 
 	block.m_minerWallet = *w;
 	block.m_txkeySec = txkeySec;
@@ -191,7 +205,11 @@ void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txk
 	}
 
 	for (uint64_t i = 0, n = std::min<uint64_t>(UNCLE_BLOCK_DEPTH, m_chainTip->m_sidechainHeight + 1); i < n; ++i) {
-		for (PoolBlock* uncle : m_blocksByHeight[m_chainTip->m_sidechainHeight - i]) {
+		const std::vector<PoolBlock*>* uncles = m_blocksByHeight.find(m_chainTip->m_sidechainHeight - i);
+		if (!uncles) {
+			continue;
+		}
+		for (PoolBlock* uncle : *uncles) {
 			// Only add verified and valid blocks
 			if (!uncle || !uncle->m_verified || uncle->m_invalid) {
 				continue;
@@ -270,6 +288,22 @@ P2PServer* SideChain::p2pServer() const
 
 bool SideChain::get_shares(PoolBlock* tip, std::vector<MinerShare>& shares) const
 {
+	// Fast path: shares for the current chain tip or for a new block on top of it
+	if (m_windowTip) {
+		if (tip == m_windowTip) {
+			get_window_shares(m_windowShares, shares);
+			return true;
+		}
+
+		if ((tip->m_sidechainHeight == m_windowTip->m_sidechainHeight + 1) && (tip->m_parent == m_windowTip->m_sidechainId)) {
+			unordered_map<uint32_t, MinerShare> window_shares = m_windowShares;
+			if (get_window_delta(tip, window_shares)) {
+				get_window_shares(window_shares, shares);
+				return true;
+			}
+		}
+	}
+
 	shares.clear();
 	shares.reserve(m_chainWindowSize * 2);
 
@@ -328,40 +362,494 @@ bool SideChain::get_shares(PoolBlock* tip, std::vector<MinerShare>& shares) cons
 		cur = it->second;
 	} while (block_depth < m_chainWindowSize);
 
-	// Combine shares with the same wallet addresses
-	std::sort(shares.begin(), shares.end(), [](const auto& a, const auto& b) { return *a.m_wallet < *b.m_wallet; });
+	// Combine shares with the same wallet addresses: share_index[wallet id] is 1 + where this wallet's share is, or 0 if it wasn't seen yet
+	// Only the unique wallets need to be sorted then
+	static thread_local std::vector<uint32_t> share_index;
+
+	const uint32_t num_ids = Wallet::num_ids();
+	if (share_index.size() < num_ids) {
+		share_index.resize(num_ids, 0);
+	}
 
 	size_t k = 0;
-	for (size_t i = 1, n = shares.size(); i < n; ++i)
-	{
-		if (*shares[i].m_wallet == *shares[k].m_wallet) {
-			shares[k].m_weight += shares[i].m_weight;
+	for (size_t i = 0, n = shares.size(); i < n; ++i) {
+		uint32_t& index = share_index[shares[i].m_wallet->id()];
+		if (index) {
+			shares[index - 1].m_weight += shares[i].m_weight;
 		}
 		else {
-			++k;
-			shares[k].m_weight = shares[i].m_weight;
-			shares[k].m_wallet = shares[i].m_wallet;
+			shares[k] = shares[i];
+			index = static_cast<uint32_t>(++k);
+		}
+	}
+
+	shares.resize(k);
+
+	for (const MinerShare& share : shares) {
+		share_index[share.m_wallet->id()] = 0;
+	}
+
+	std::sort(shares.begin(), shares.end(), [](const auto& a, const auto& b) { return *a.m_wallet < *b.m_wallet; });
+
+	LOGINFO(6, "get_shares: " << k << " unique wallets in PPLNS window");
+	return true;
+}
+
+static FORCEINLINE uint64_t get_uncle_penalty(const PoolBlock* uncle, uint64_t uncle_penalty_percent)
+{
+	uint64_t product[2];
+	product[0] = umul128(uncle->m_difficulty.lo, uncle_penalty_percent, &product[1]);
+
+	uint64_t rem;
+	return udiv128(product[1], product[0], 100, &rem);
+}
+
+static FORCEINLINE void add_window_share(unordered_map<uint32_t, MinerShare>& shares, Wallet* wallet, uint64_t weight)
+{
+	MinerShare& share = shares[wallet->id()];
+	share.m_weight += weight;
+	share.m_wallet = wallet;
+}
+
+static FORCEINLINE bool sub_window_share(unordered_map<uint32_t, MinerShare>& shares, const Wallet* wallet, uint64_t weight)
+{
+	if (weight == 0) {
+		return true;
+	}
+
+	auto it = shares.find(wallet->id());
+	if ((it == shares.end()) || (it->second.m_weight < weight)) {
+		return false;
+	}
+
+	it->second.m_weight -= weight;
+	if (it->second.m_weight == 0) {
+		shares.erase(it);
+	}
+
+	return true;
+}
+
+static FORCEINLINE bool difficulty_data_less(const DifficultyData& a, const DifficultyData& b)
+{
+	if (a.m_timestamp != b.m_timestamp) {
+		return a.m_timestamp < b.m_timestamp;
+	}
+	return a.m_cumulativeDifficulty < b.m_cumulativeDifficulty;
+}
+
+static FORCEINLINE void add_difficulty_data(std::vector<DifficultyData>& data, const PoolBlock* block)
+{
+	const DifficultyData d(block->m_timestamp, block->m_cumulativeDifficulty);
+	data.insert(std::upper_bound(data.begin(), data.end(), d, difficulty_data_less), d);
+}
+
+static FORCEINLINE bool sub_difficulty_data(std::vector<DifficultyData>& data, const PoolBlock* block)
+{
+	const DifficultyData d(block->m_timestamp, block->m_cumulativeDifficulty);
+
+	auto it = std::lower_bound(data.begin(), data.end(), d, difficulty_data_less);
+	if ((it == data.end()) || (it->m_timestamp != d.m_timestamp) || (it->m_cumulativeDifficulty != d.m_cumulativeDifficulty)) {
+		return false;
+	}
+
+	data.erase(it);
+	return true;
+}
+
+void SideChain::get_window_shares(const unordered_map<uint32_t, MinerShare>& window_shares, std::vector<MinerShare>& shares) const
+{
+	shares.clear();
+	shares.reserve(window_shares.size());
+
+	for (const auto& it : window_shares) {
+		shares.push_back(it.second);
+	}
+
+	std::sort(shares.begin(), shares.end(), [](const auto& a, const auto& b) { return *a.m_wallet < *b.m_wallet; });
+
+	LOGINFO(6, "get_shares: " << shares.size() << " unique wallets in PPLNS window");
+}
+
+// Calls "f(block, nullptr)" for the block itself and "f(block, uncle)" for each of its uncles which are still in the window
+template<typename T>
+bool SideChain::visit_window_block(PoolBlock* block, uint64_t lowest_height, T&& f) const
+{
+	if (!f(block, nullptr)) {
+		return false;
+	}
+
+	for (const hash& uncle_id : block->m_uncles) {
+		auto it = m_blocksById.find(uncle_id);
+		if (it == m_blocksById.end()) {
+			return false;
+		}
+
+		PoolBlock* uncle = it->second;
+		if ((uncle->m_sidechainHeight >= lowest_height) && !f(block, uncle)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Finds changes to the window when "block" is added on top of m_windowTip
+// "remove" is called for everything that drops out at the bottom of the window, "add" is called for the new block and its uncles
+template<typename T, typename U>
+bool SideChain::visit_window_delta(PoolBlock* block, T&& remove, U&& add) const
+{
+	if (m_windowBlocks.empty()) {
+		return false;
+	}
+
+	const uint64_t h = block->m_sidechainHeight;
+	const uint64_t lowest_height = (h + 1 > m_chainWindowSize) ? (h + 1 - m_chainWindowSize) : 0;
+
+	PoolBlock* bottom = m_windowBlocks.front();
+	const uint64_t bottom_height = bottom->m_sidechainHeight;
+
+	if (bottom_height < lowest_height) {
+		if (!remove(bottom, nullptr)) {
+			return false;
+		}
+
+		// Uncles at the bottom height can be referenced only by the next UNCLE_BLOCK_DEPTH blocks
+		for (size_t i = 1, n = m_windowBlocks.size(); i < n; ++i) {
+			PoolBlock* nephew = m_windowBlocks[i];
+			if (nephew->m_sidechainHeight > bottom_height + UNCLE_BLOCK_DEPTH) {
+				break;
+			}
+
+			for (const hash& uncle_id : nephew->m_uncles) {
+				auto it = m_blocksById.find(uncle_id);
+				if (it == m_blocksById.end()) {
+					return false;
+				}
+
+				PoolBlock* uncle = it->second;
+				if ((uncle->m_sidechainHeight == bottom_height) && !remove(nephew, uncle)) {
+					return false;
+				}
+			}
+		}
+	}
+
+	return visit_window_block(block, lowest_height, add);
+}
+
+bool SideChain::get_window_delta(PoolBlock* block, unordered_map<uint32_t, MinerShare>& shares) const
+{
+	const uint64_t uncle_penalty_percent = m_unclePenalty;
+
+	return visit_window_delta(block,
+		[&shares, uncle_penalty_percent](PoolBlock* b, PoolBlock* uncle)
+		{
+			if (!uncle) {
+				return sub_window_share(shares, &b->m_minerWallet, b->m_difficulty.lo);
+			}
+			const uint64_t uncle_penalty = get_uncle_penalty(uncle, uncle_penalty_percent);
+			return sub_window_share(shares, &b->m_minerWallet, uncle_penalty) &&
+				sub_window_share(shares, &uncle->m_minerWallet, uncle->m_difficulty.lo - uncle_penalty);
+		},
+		[&shares, uncle_penalty_percent](PoolBlock* b, PoolBlock* uncle)
+		{
+			if (!uncle) {
+				add_window_share(shares, &b->m_minerWallet, b->m_difficulty.lo);
+				return true;
+			}
+			const uint64_t uncle_penalty = get_uncle_penalty(uncle, uncle_penalty_percent);
+			add_window_share(shares, &b->m_minerWallet, uncle_penalty);
+			add_window_share(shares, &uncle->m_minerWallet, uncle->m_difficulty.lo - uncle_penalty);
+			return true;
+		});
+}
+
+bool SideChain::get_window_difficulty_delta(PoolBlock* block, std::vector<DifficultyData>& data) const
+{
+	return visit_window_delta(block,
+		[&data](PoolBlock* b, PoolBlock* uncle) { return sub_difficulty_data(data, uncle ? uncle : b); },
+		[&data](PoolBlock* b, PoolBlock* uncle) { add_difficulty_data(data, uncle ? uncle : b); return true; });
+}
+
+void SideChain::reset_window()
+{
+	m_windowTip = nullptr;
+	m_windowBlocks.clear();
+	m_windowShares.clear();
+	m_windowDifficultyData.clear();
+
+	rebuild_window_stats();
+}
+
+bool SideChain::rebuild_window(PoolBlock* tip)
+{
+	reset_window();
+
+	PoolBlock* cur = tip;
+	for (uint64_t i = 0; i < m_chainWindowSize; ++i) {
+		m_windowBlocks.push_front(cur);
+
+		if (cur->m_sidechainHeight == 0) {
+			break;
+		}
+
+		if (i + 1 < m_chainWindowSize) {
+			auto it = m_blocksById.find(cur->m_parent);
+			if (it == m_blocksById.end()) {
+				m_windowBlocks.clear();
+				return false;
+			}
+			cur = it->second;
+		}
+	}
+
+	const uint64_t lowest_height = m_windowBlocks.front()->m_sidechainHeight;
+	const uint64_t uncle_penalty_percent = m_unclePenalty;
+
+	for (PoolBlock* block : m_windowBlocks) {
+		const bool ok = visit_window_block(block, lowest_height,
+			[this, uncle_penalty_percent](PoolBlock* b, PoolBlock* uncle)
+			{
+				if (!uncle) {
+					add_window_share(m_windowShares, &b->m_minerWallet, b->m_difficulty.lo);
+					m_windowDifficultyData.emplace_back(b->m_timestamp, b->m_cumulativeDifficulty);
+					return true;
+				}
+				const uint64_t uncle_penalty = get_uncle_penalty(uncle, uncle_penalty_percent);
+				add_window_share(m_windowShares, &b->m_minerWallet, uncle_penalty);
+				add_window_share(m_windowShares, &uncle->m_minerWallet, uncle->m_difficulty.lo - uncle_penalty);
+				m_windowDifficultyData.emplace_back(uncle->m_timestamp, uncle->m_cumulativeDifficulty);
+				return true;
+			});
+
+		if (!ok) {
+			m_windowBlocks.clear();
+			m_windowShares.clear();
+			m_windowDifficultyData.clear();
+			return false;
 		}
 	}
 
-	shares.resize(k + 1);
+	std::sort(m_windowDifficultyData.begin(), m_windowDifficultyData.end(), difficulty_data_less);
 
-	LOGINFO(6, "get_shares: " << k + 1 << " unique wallets in PPLNS window");
+	m_windowTip = tip;
 	return true;
 }
 
+void SideChain::update_window(PoolBlock* tip)
+{
+	if (tip == m_windowTip) {
+		// The window could follow this block while it was verified, now it's the chain tip and the stats can be published
+		publish_stats();
+		return;
+	}
+
+	// Most of the time the new tip is built on top of the previous one, anything else (reorg) rebuilds the window from scratch
+	if (m_windowTip && (tip->m_sidechainHeight == m_windowTip->m_sidechainHeight + 1) && (tip->m_parent == m_windowTip->m_sidechainId)) {
+		if (get_window_delta(tip, m_windowShares) && get_window_difficulty_delta(tip, m_windowDifficultyData)) {
+			update_window_stats(tip);
+
+			m_windowBlocks.push_back(tip);
+			while (m_windowBlocks.size() > m_chainWindowSize) {
+				m_windowBlocks.pop_front();
+			}
+			m_windowTip = tip;
+
+			m_stats.m_windowBlocks = m_windowBlocks.size();
+			m_stats.m_windowMiners = m_windowShares.size();
+			publish_stats();
+			return;
+		}
+	}
+
+	if (!rebuild_window(tip)) {
+		LOGWARN(4, "update_window: couldn't build PPLNS window for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId);
+	}
+
+	rebuild_window_stats();
+	publish_stats();
+}
+
+void SideChain::count_window_share(const PoolBlock* b, const PoolBlock* uncle, bool add)
+{
+	auto change = [add](uint64_t& value, uint64_t delta) { value = add ? (value + delta) : (value - delta); };
+
+	if (!uncle) {
+		change(m_stats.m_windowWeight, b->m_difficulty.lo);
+		if (b->m_minerWallet.id() == m_ourWalletId) {
+			change(m_stats.m_ourBlocks, 1);
+			change(m_stats.m_ourWeight, b->m_difficulty.lo);
+		}
+		return;
+	}
+
+	// Uncle's weight is split between the uncle and the block which included it
+	const uint64_t uncle_penalty = get_uncle_penalty(uncle, m_unclePenalty);
+
+	change(m_stats.m_windowUncles, 1);
+	change(m_stats.m_windowWeight, uncle->m_difficulty.lo);
+
+	if (b->m_minerWallet.id() == m_ourWalletId) {
+		change(m_stats.m_ourWeight, uncle_penalty);
+	}
+	if (uncle->m_minerWallet.id() == m_ourWalletId) {
+		change(m_stats.m_ourUncles, 1);
+		change(m_stats.m_ourWeight, uncle->m_difficulty.lo - uncle_penalty);
+	}
+}
+
+void SideChain::count_window_height(uint64_t height, bool add)
+{
+	const std::vector<PoolBlock*>* blocks = m_blocksByHeight.find(height);
+	if (!blocks) {
+		return;
+	}
+
+	for (const PoolBlock* b : *blocks) {
+		if (add) {
+			++m_windowHeightBlocks;
+		}
+		else {
+			--m_windowHeightBlocks;
+		}
+
+		if (b->m_minerWallet.id() == m_ourWalletId) {
+			if (add) {
+				++m_windowHeightOurBlocks;
+			}
+			else {
+				--m_windowHeightOurBlocks;
+			}
+		}
+	}
+}
+
+void SideChain::update_window_stats(PoolBlock* tip)
+{
+	// Must be called before the new tip is added to m_windowBlocks, visit_window_delta() needs the old window
+	visit_window_delta(tip,
+		[this](PoolBlock* b, PoolBlock* uncle) { count_window_share(b, uncle, false); return true; },
+		[this](PoolBlock* b, PoolBlock* uncle) { count_window_share(b, uncle, true); return true; });
+
+	for (uint64_t h = window_lowest_height(m_windowTip->m_sidechainHeight), h1 = window_lowest_height(tip->m_sidechainHeight); h < h1; ++h) {
+		count_window_height(h, false);
+	}
+	count_window_height(tip->m_sidechainHeight, true);
+}
+
+void SideChain::rebuild_window_stats()
+{
+	m_stats.m_windowBlocks = 0;
+	m_stats.m_windowUncles = 0;
+	m_stats.m_windowMiners = 0;
+	m_stats.m_windowWeight = 0;
+	m_stats.m_ourBlocks = 0;
+	m_stats.m_ourUncles = 0;
+	m_stats.m_ourWeight = 0;
+
+	m_windowHeightBlocks = 0;
+	m_windowHeightOurBlocks = 0;
+
+	if (!m_windowTip) {
+		return;
+	}
+
+	const uint64_t lowest_height = m_windowBlocks.front()->m_sidechainHeight;
+
+	for (PoolBlock* block : m_windowBlocks) {
+		visit_window_block(block, lowest_height, [this](PoolBlock* b, PoolBlock* uncle) { count_window_share(b, uncle, true); return true; });
+	}
+
+	for (uint64_t h = window_lowest_height(m_windowTip->m_sidechainHeight); h <= m_windowTip->m_sidechainHeight; ++h) {
+		count_window_height(h, true);
+	}
+
+	m_stats.m_windowBlocks = m_windowBlocks.size();
+	m_stats.m_windowMiners = m_windowShares.size();
+}
+
+void SideChain::publish_stats()
+{
+	static_assert(sizeof(Stats) % sizeof(uint64_t) == 0, "Stats must consist of 64-bit values");
+
+	// Window counters follow m_windowTip, which is on a different block only while verify_loop() runs
+	if (m_windowTip && (m_windowTip != m_chainTip)) {
+		return;
+	}
+
+	if (m_chainTip) {
+		m_stats.m_tipHeight = m_chainTip->m_sidechainHeight;
+		m_stats.m_totalHashes = m_chainTip->m_cumulativeDifficulty;
+	}
+
+	// Uncles referenced twice would make it negative
+	const uint64_t in_window = m_stats.m_windowBlocks + m_stats.m_windowUncles;
+	const uint64_t our_in_window = m_stats.m_ourBlocks + m_stats.m_ourUncles;
+	m_stats.m_windowOrphans = (m_windowHeightBlocks > in_window) ? (m_windowHeightBlocks - in_window) : 0;
+	m_stats.m_ourOrphans = (m_windowHeightOurBlocks > our_in_window) ? (m_windowHeightOurBlocks - our_in_window) : 0;
+
+	uint64_t values[array_size(&SideChain::m_publishedStats)];
+	memcpy(values, &m_stats, sizeof(values));
+
+	const uint32_t seq = m_statsSeq.load(std::memory_order_relaxed);
+	m_statsSeq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (size_t i = 0; i < array_size(values); ++i) {
+		m_publishedStats[i].store(values[i], std::memory_order_relaxed);
+	}
+
+	m_statsSeq.store(seq + 2, std::memory_order_release);
+}
+
+SideChain::Stats SideChain::stats() const
+{
+	uint64_t values[array_size(&SideChain::m_publishedStats)];
+
+	for (;;) {
+		const uint32_t seq = m_statsSeq.load(std::memory_order_acquire);
+		if (seq & 1) {
+			continue;
+		}
+
+		for (size_t i = 0; i < array_size(values); ++i) {
+			values[i] = m_publishedStats[i].load(std::memory_order_relaxed);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_statsSeq.load(std::memory_order_relaxed) == seq) {
+			break;
+		}
+	}
+
+	Stats result;
+	memcpy(&result, values, sizeof(result));
+	return result;
+}
+
 bool SideChain::block_seen(const PoolBlock& block)
+{
+	if (block_seen(block.m_sidechainId, block.m_sidechainHeight, block.m_cumulativeDifficulty)) {
+		return true;
+	}
+
+	// Another thread could have marked it as seen since the check above, insert() tells which one was first
+	MutexLock lock(m_seenBlocksLock);
+	return !m_seenBlocks.insert(block.m_sidechainId).second;
+}
+
+bool SideChain::block_seen(const hash& id, uint64_t sidechain_height, const difficulty_type& cumulative_difficulty)
 {
 	// Check if it's some old block
 	const PoolBlock* tip = m_chainTip;
-	if (tip && tip->m_sidechainHeight > block.m_sidechainHeight + m_chainWindowSize * 2 &&
-		block.m_cumulativeDifficulty < tip->m_cumulativeDifficulty) {
+	if (tip && tip->m_sidechainHeight > sidechain_height + m_chainWindowSize * 2 &&
+		cumulative_difficulty < tip->m_cumulativeDifficulty) {
 		return true;
 	}
 
-	// Check if it was received before
 	MutexLock lock(m_seenBlocksLock);
-	return !m_seenBlocks.insert(block.m_sidechainId).second;
+	return m_seenBlocks.find(id) != m_seenBlocks.end();
 }
 
 void SideChain::unsee_block(const PoolBlock& block)
@@ -381,7 +869,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 
 	bool too_low_diff = (block.m_difficulty < m_curDifficulty);
 	{
-		MutexLock lock(m_sidechainLock);
+		metrics::TimedReadLock lock(m_sidechainLock, metrics::SIDECHAIN_LOCK_WAIT);
 		if (m_blocksById.find(block.m_sidechainId) != m_blocksById.end()) {
 			LOGINFO(4, "add_external_block: block " << block.m_sidechainId << " is already added");
 			return true;
@@ -429,17 +917,26 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 	}
 
 	hash pow_hash;
-	if (!block.get_pow_hash(m_pool->hasher(), seed, pow_hash)) {
-		LOGWARN(3, "add_external_block: couldn't get PoW hash for height = " << block.m_sidechainHeight << ", mainchain height " << block.m_txinGenHeight << ". Ignoring it.");
-		unsee_block(block);
-		return true;
+	if (block.m_powHashTrusted && (block.m_powSeed == seed)) {
+		// This block was loaded from the local cache and its PoW was already checked when it was stored there
+		pow_hash = block.m_powHash;
 	}
+	else {
+		if (!block.get_pow_hash(m_pool->hasher(), seed, pow_hash)) {
+			LOGWARN(3, "add_external_block: couldn't get PoW hash for height = " << block.m_sidechainHeight << ", mainchain height " << block.m_txinGenHeight << ". Ignoring it.");
+			unsee_block(block);
+			return true;
+		}
+		block.m_powHash = pow_hash;
+		block.m_powSeed = seed;
+	}
+	block.m_powHashTrusted = false;
 
 	// Check if it has the correct parent and difficulty to go right to monerod for checking
 	const MinerData& miner_data = m_pool->miner_data();
 	if ((block.m_prevId == miner_data.prev_id) && miner_data.difficulty.check_pow(pow_hash)) {
 		LOGINFO(0, log::LightGreen() << "add_external_block: block " << block.m_sidechainId << " has enough PoW for Monero network, submitting it");
-		m_pool->submit_block_async(block.m_mainChainData);
+		m_pool->submit_block_async(block.main_chain_data(), block.main_chain_data_size());
 	}
 	else {
 		difficulty_type diff;
@@ -448,7 +945,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 		}
 		else if (diff.check_pow(pow_hash)) {
 			LOGINFO(0, log::LightGreen() << "add_external_block: block " << block.m_sidechainId << " has enough PoW for Monero height " << block.m_txinGenHeight << ", submitting it");
-			m_pool->submit_block_async(block.m_mainChainData);
+			m_pool->submit_block_async(block.main_chain_data(), block.main_chain_data_size());
 		}
 	}
 
@@ -461,7 +958,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 
 	missing_blocks.clear();
 	{
-		MutexLock lock(m_sidechainLock);
+		metrics::TimedWriteLock lock(m_sidechainLock, metrics::SIDECHAIN_LOCK_WAIT);
 		if (!block.m_parent.empty() && (m_blocksById.find(block.m_parent) == m_blocksById.end())) {
 			missing_blocks.push_back(block.m_parent);
 		}
@@ -490,6 +987,8 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 
 void SideChain::add_block(const PoolBlock& block)
 {
+	alloc_telemetry::Scope alloc_scope(alloc_telemetry::SIDECHAIN);
+
 	LOGINFO(3, "add_block: height = " << block.m_sidechainHeight <<
 		", id = " << block.m_sidechainId <<
 		", mainchain height = " << block.m_txinGenHeight <<
@@ -501,9 +1000,16 @@ void SideChain::add_block(const PoolBlock& block)
 		p2pServer()->store_in_cache(block);
 	}
 
+	// Copies share the block's bytes, blocks which were built locally get them in one buffer here
 	PoolBlock* new_block = new PoolBlock(block);
+	if (!new_block->m_blob) {
+		new_block->make_blob();
+	}
 
-	MutexLock lock(m_sidechainLock);
+	// PoW was already checked, the sidechain doesn't need transaction hashes and parsed outputs anymore
+	new_block->compact();
+
+	metrics::TimedWriteLock lock(m_sidechainLock, metrics::SIDECHAIN_LOCK_WAIT);
 
 	auto result = m_blocksById.insert({ new_block->m_sidechainId, new_block });
 	if (!result.second) {
@@ -512,96 +1018,353 @@ void SideChain::add_block(const PoolBlock& block)
 			<< new_block->m_sidechainHeight << ", height = "
 			<< new_block->m_txinGenHeight);
 
-		delete new_block;
-		return;
+		delete new_block;
+		return;
+	}
+
+	m_blocksByHeight.add(new_block->m_sidechainHeight, new_block);
+
+	// Blocks at the heights of the current PPLNS window are counted here, blocks above it are counted when the window moves up
+	if (m_windowTip && (new_block->m_sidechainHeight >= window_lowest_height(m_windowTip->m_sidechainHeight)) && (new_block->m_sidechainHeight <= m_windowTip->m_sidechainHeight)) {
+		++m_windowHeightBlocks;
+		if (new_block->m_minerWallet.id() == m_ourWalletId) {
+			++m_windowHeightOurBlocks;
+		}
+	}
+
+	update_depths(new_block);
+
+	if (new_block->m_verified) {
+		if (!new_block->m_invalid) {
+			update_chain_tip(new_block);
+		}
+	}
+	else {
+		verify_loop(new_block);
+	}
+
+	{
+		MutexLock lock2(m_seenWalletsLock);
+		m_seenWallets[new_block->m_minerWallet.spend_public_key()] = new_block->m_localTimestamp;
+		m_stats.m_minerCount = m_seenWallets.size();
+	}
+
+	publish_stats();
+}
+
+bool SideChain::has_block(const hash& id)
+{
+	ReadLock lock(m_sidechainLock);
+	return m_blocksById.find(id) != m_blocksById.end();
+}
+
+void SideChain::watch_mainchain_block(const ChainMain& data, const hash& possible_id)
+{
+	WriteLock lock(m_sidechainLock);
+	m_watchBlock = data;
+	m_watchBlockSidechainId = possible_id;
+}
+
+SharedBuf* SideChain::get_block_blob(const hash& id)
+{
+	ReadLock lock(m_sidechainLock);
+
+	PoolBlock* block = nullptr;
+
+	// Empty hash means we return current sidechain tip
+	if (id == hash()) {
+		block = m_chainTip;
+	}
+	else {
+		auto it = m_blocksById.find(id);
+		if (it != m_blocksById.end()) {
+			block = it->second;
+		}
+	}
+
+	if (!block || !block->m_blob) {
+		return nullptr;
+	}
+
+	block->m_blob->add_ref();
+	return block->m_blob;
+}
+
+size_t SideChain::get_block_blobs(const hash* ids, size_t num_ids, uint64_t min_height, size_t max_blocks, uint64_t max_bytes, std::vector<SharedBuf*>& blobs)
+{
+	blobs.clear();
+
+	std::vector<const PoolBlock*> blocks;
+	std::vector<const PoolBlock*> chain;
+	unordered_set<hash> added;
+	uint64_t num_bytes = 0;
+	size_t num_missing = 0;
+
+	ReadLock lock(m_sidechainLock);
+
+	for (size_t i = 0; i < num_ids; ++i) {
+		auto it = m_blocksById.find(ids[i]);
+		if ((it == m_blocksById.end()) || !it->second->m_blob) {
+			++num_missing;
+			continue;
+		}
+
+		chain.clear();
+
+		// The requested block itself is always sent if it fits, ancestors only down to min_height
+		for (const PoolBlock* b = it->second; b && b->m_blob && (blocks.size() + chain.size() < max_blocks) && (num_bytes + b->m_blob->m_data.size() <= max_bytes); b = get_parent(b)) {
+			if (!added.insert(b->m_sidechainId).second) {
+				break;
+			}
+			chain.push_back(b);
+			num_bytes += b->m_blob->m_data.size();
+			if (b->m_sidechainHeight <= min_height) {
+				break;
+			}
+		}
+
+		// Blocks which were sent as ancestors of a previous one are not missing
+		if (chain.empty() && (added.find(ids[i]) == added.end())) {
+			++num_missing;
+		}
+
+		blocks.insert(blocks.end(), chain.rbegin(), chain.rend());
+	}
+
+	blobs.reserve(blocks.size());
+
+	for (const PoolBlock* b : blocks) {
+		b->m_blob->add_ref();
+		blobs.push_back(b->m_blob);
+	}
+
+	return num_missing;
+}
+
+static constexpr uint64_t SNAPSHOT_MAGIC = 0x31504E5353434250ULL; // "PBCSSNP1"
+static constexpr size_t SNAPSHOT_HEADER_SIZE = sizeof(uint64_t) + HASH_SIZE * 2 + sizeof(difficulty_type) + sizeof(uint32_t);
+
+void SideChain::get_snapshot(std::vector<uint8_t>& data)
+{
+	data.clear();
+
+	hash consensus_hash;
+	keccak(m_consensusId.data(), static_cast<int>(m_consensusId.size()), consensus_hash.h, HASH_SIZE);
+
+	ReadLock lock(m_sidechainLock);
+
+	if (!m_chainTip) {
+		return;
+	}
+
+	data.reserve(SNAPSHOT_HEADER_SIZE + m_blocksById.size() * HASH_SIZE + HASH_SIZE);
+	data.resize(SNAPSHOT_HEADER_SIZE);
+
+	uint8_t* p = data.data();
+
+	memcpy(p, &SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	p += sizeof(SNAPSHOT_MAGIC);
+
+	memcpy(p, consensus_hash.h, HASH_SIZE);
+	p += HASH_SIZE;
+
+	memcpy(p, m_chainTip->m_sidechainId.h, HASH_SIZE);
+	p += HASH_SIZE;
+
+	memcpy(p, &m_chainTip->m_cumulativeDifficulty, sizeof(difficulty_type));
+	p += sizeof(difficulty_type);
+
+	uint32_t count = 0;
+	for (const auto& it : m_blocksById) {
+		const PoolBlock* b = it.second;
+		if (b->m_verified && !b->m_invalid) {
+			data.insert(data.end(), b->m_sidechainId.h, b->m_sidechainId.h + HASH_SIZE);
+			++count;
+		}
+	}
+	memcpy(data.data() + SNAPSHOT_HEADER_SIZE - sizeof(uint32_t), &count, sizeof(count));
+
+	hash checksum;
+	keccak(data.data(), static_cast<int>(data.size()), checksum.h, HASH_SIZE);
+	data.insert(data.end(), checksum.h, checksum.h + HASH_SIZE);
+}
+
+bool SideChain::restore_snapshot(const std::vector<uint8_t>& data, const unordered_map<hash, PoolBlock*>& cached_blocks)
+{
+	if (data.size() < SNAPSHOT_HEADER_SIZE + HASH_SIZE) {
+		return false;
+	}
+
+	const uint8_t* p = data.data();
+
+	hash checksum;
+	keccak(p, static_cast<int>(data.size() - HASH_SIZE), checksum.h, HASH_SIZE);
+	if (memcmp(checksum.h, p + data.size() - HASH_SIZE, HASH_SIZE) != 0) {
+		LOGWARN(1, "snapshot has invalid checksum, ignoring it");
+		return false;
+	}
+
+	uint64_t magic;
+	memcpy(&magic, p, sizeof(magic));
+	p += sizeof(magic);
+
+	hash consensus_hash, h;
+	keccak(m_consensusId.data(), static_cast<int>(m_consensusId.size()), h.h, HASH_SIZE);
+	memcpy(consensus_hash.h, p, HASH_SIZE);
+	p += HASH_SIZE;
+
+	if ((magic != SNAPSHOT_MAGIC) || (consensus_hash != h)) {
+		LOGWARN(1, "snapshot is from a different version or sidechain, ignoring it");
+		return false;
+	}
+
+	hash tip_id;
+	memcpy(tip_id.h, p, HASH_SIZE);
+	p += HASH_SIZE;
+
+	difficulty_type tip_cumulative_diff;
+	memcpy(&tip_cumulative_diff, p, sizeof(difficulty_type));
+	p += sizeof(difficulty_type);
+
+	uint32_t count;
+	memcpy(&count, p, sizeof(count));
+	p += sizeof(count);
+
+	if (data.size() != SNAPSHOT_HEADER_SIZE + static_cast<size_t>(count) * HASH_SIZE + HASH_SIZE) {
+		LOGWARN(1, "snapshot has invalid size, ignoring it");
+		return false;
 	}
 
-	m_blocksByHeight[new_block->m_sidechainHeight].push_back(new_block);
+	// The tip must be there and match the snapshot, otherwise cache and snapshot are out of sync
+	auto tip_it = cached_blocks.find(tip_id);
+	if ((tip_it == cached_blocks.end()) || (tip_it->second->m_cumulativeDifficulty != tip_cumulative_diff)) {
+		LOGWARN(1, "snapshot doesn't match the block cache, ignoring it");
+		return false;
+	}
 
-	update_depths(new_block);
+	std::vector<PoolBlock*> blocks;
+	blocks.reserve(count);
 
-	if (new_block->m_verified) {
-		if (!new_block->m_invalid) {
-			update_chain_tip(new_block);
+	for (uint32_t i = 0; i < count; ++i, p += HASH_SIZE) {
+		memcpy(h.h, p, HASH_SIZE);
+		auto it = cached_blocks.find(h);
+		if (it != cached_blocks.end()) {
+			// These blocks were verified before they were saved in the cache
+			PoolBlock* b = new PoolBlock(*it->second);
+			b->m_verified = true;
+			b->m_invalid = false;
+			b->m_depth = 0;
+			b->compact();
+			blocks.push_back(b);
 		}
 	}
-	else {
-		verify_loop(new_block);
-	}
 
-	m_seenWallets[new_block->m_minerWallet.spend_public_key()] = new_block->m_localTimestamp;
-}
+	// Depths only depend on blocks above, so one pass from the highest block to the lowest is enough
+	std::sort(blocks.begin(), blocks.end(), [](const PoolBlock* a, const PoolBlock* b) { return a->m_sidechainHeight > b->m_sidechainHeight; });
 
-bool SideChain::has_block(const hash& id)
-{
-	MutexLock lock(m_sidechainLock);
-	return m_blocksById.find(id) != m_blocksById.end();
-}
+	size_t num_restored = 0;
+	bool tip_restored = false;
+	{
+		metrics::TimedWriteLock lock(m_sidechainLock, metrics::SIDECHAIN_LOCK_WAIT);
 
-void SideChain::watch_mainchain_block(const ChainMain& data, const hash& possible_id)
-{
-	MutexLock lock(m_sidechainLock);
-	m_watchBlock = data;
-	m_watchBlockSidechainId = possible_id;
-}
+		// Adding blocks one by one with add_block() would walk all their ancestors to update depths every time
+		if (!m_blocksById.empty()) {
+			for (PoolBlock* b : blocks) {
+				delete b;
+			}
+			LOGWARN(1, "snapshot can only be restored into an empty sidechain");
+			return false;
+		}
 
-bool SideChain::get_block_blob(const hash& id, std::vector<uint8_t>& blob)
-{
-	MutexLock lock(m_sidechainLock);
+		for (PoolBlock*& b : blocks) {
+			if (m_blocksById.insert({ b->m_sidechainId, b }).second) {
+				m_blocksByHeight.add(b->m_sidechainHeight, b);
+			}
+			else {
+				delete b;
+				b = nullptr;
+			}
+		}
 
-	PoolBlock* block = nullptr;
+		blocks.erase(std::remove(blocks.begin(), blocks.end(), nullptr), blocks.end());
+		num_restored = blocks.size();
 
-	// Empty hash means we return current sidechain tip
-	if (id == hash()) {
-		block = m_chainTip;
-	}
-	else {
-		auto it = m_blocksById.find(id);
+		for (PoolBlock* b : blocks) {
+			PoolBlock* parent = get_parent(b);
+			if (parent) {
+				parent->m_depth = std::max(parent->m_depth, b->m_depth + 1);
+			}
+
+			for (const hash& uncle_id : b->m_uncles) {
+				auto it = m_blocksById.find(uncle_id);
+				if ((it != m_blocksById.end()) && (it->second->m_sidechainHeight < b->m_sidechainHeight)) {
+					it->second->m_depth = std::max(it->second->m_depth, b->m_depth + (b->m_sidechainHeight - it->second->m_sidechainHeight));
+				}
+			}
+		}
+
+		{
+			MutexLock lock2(m_seenWalletsLock);
+			for (const PoolBlock* b : blocks) {
+				m_seenWallets[b->m_minerWallet.spend_public_key()] = b->m_localTimestamp;
+			}
+			m_stats.m_minerCount = m_seenWallets.size();
+		}
+
+		// This also calculates difficulty and PPLNS window for the restored tip
+		auto it = m_blocksById.find(tip_id);
 		if (it != m_blocksById.end()) {
-			block = it->second;
+			update_chain_tip(it->second);
 		}
-	}
 
-	if (!block) {
-		return false;
+		tip_restored = m_chainTip && (m_chainTip->m_sidechainId == tip_id);
 	}
 
-	blob.reserve(block->m_mainChainData.size() + block->m_sideChainData.size());
+	LOGINFO(1, "restored " << num_restored << " of " << count << " verified blocks from the snapshot" << (tip_restored ? "" : ", but couldn't restore the chain tip"));
 
-	blob = block->m_mainChainData;
-	blob.insert(blob.end(), block->m_sideChainData.begin(), block->m_sideChainData.end());
-	return true;
+	return tip_restored;
 }
 
 bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::vector<uint8_t>& blob)
 {
 	blob.clear();
 
-	MutexLock lock(m_sidechainLock);
+	metrics::TimedReadLock lock(m_sidechainLock, metrics::SIDECHAIN_LOCK_WAIT);
 
 	auto it = m_blocksById.find(block->m_sidechainId);
 	if (it != m_blocksById.end()) {
 		PoolBlock* b = it->second;
-		const size_t n = b->m_outputs.size();
+
+		std::vector<PoolBlock::TxOutput> tmp;
+		const std::vector<PoolBlock::TxOutput>* outputs = b->get_outputs(tmp);
+		if (!outputs) {
+			return false;
+		}
+
+		const size_t n = outputs->size();
 
 		blob.reserve(n * 38 + 64);
 		writeVarint(n, blob);
 
-		for (const PoolBlock::TxOutput& output : b->m_outputs) {
+		for (const PoolBlock::TxOutput& output : *outputs) {
 			writeVarint(output.m_reward, blob);
 			blob.emplace_back(TXOUT_TO_KEY);
 			blob.insert(blob.end(), output.m_ephPublicKey.h, output.m_ephPublicKey.h + HASH_SIZE);
 		}
 
-		block->m_outputs = b->m_outputs;
+		block->m_outputs = *outputs;
 		return true;
 	}
 
-	if (!get_shares(block, m_tmpShares) || !split_reward(total_reward, m_tmpShares, m_tmpRewards) || (m_tmpRewards.size() != m_tmpShares.size())) {
+	std::vector<MinerShare> shares;
+	std::vector<uint64_t> rewards;
+	std::vector<hash> eph_public_keys;
+
+	if (!get_shares(block, shares) || !split_reward(total_reward, shares, rewards) || (rewards.size() != shares.size())) {
 		return false;
 	}
 
-	const size_t n = m_tmpShares.size();
+	const size_t n = shares.size();
 
 	blob.reserve(n * 38 + 64);
 
@@ -610,18 +1373,20 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 	block->m_outputs.clear();
 	block->m_outputs.reserve(n);
 
-	hash eph_public_key;
+	size_t failed_index;
+	if (!get_eph_public_keys(block->m_txkeySec, shares, eph_public_keys, failed_index)) {
+		LOGWARN(6, "get_eph_public_key failed at index " << failed_index);
+	}
+
 	for (size_t i = 0; i < n; ++i) {
-		writeVarint(m_tmpRewards[i], blob);
+		writeVarint(rewards[i], blob);
 
 		blob.emplace_back(TXOUT_TO_KEY);
 
-		if (!m_tmpShares[i].m_wallet->get_eph_public_key(block->m_txkeySec, i, eph_public_key)) {
-			LOGWARN(6, "get_eph_public_key failed at index " << i);
-		}
+		const hash& eph_public_key = eph_public_keys[i];
 		blob.insert(blob.end(), eph_public_key.h, eph_public_key.h + HASH_SIZE);
 
-		block->m_outputs.emplace_back(m_tmpRewards[i], eph_public_key);
+		block->m_outputs.emplace_back(rewards[i], eph_public_key);
 	}
 
 	return true;
@@ -629,10 +1394,9 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 
 void SideChain::print_status()
 {
-	std::vector<hash> blocks_in_window;
-	blocks_in_window.reserve(m_chainWindowSize * 9 / 8);
+	ReadLock lock(m_sidechainLock);
 
-	MutexLock lock(m_sidechainLock);
+	const Stats& stats = m_stats;
 
 	uint64_t rem;
 	uint64_t pool_hashrate = udiv128(m_curDifficulty.hi, m_curDifficulty.lo, m_targetBlockTime, &rem);
@@ -640,90 +1404,56 @@ void SideChain::print_status()
 	const difficulty_type& network_diff = m_pool->miner_data().difficulty;
 	uint64_t network_hashrate = udiv128(network_diff.hi, network_diff.lo, 120, &rem);
 
-	uint64_t block_depth = 0;
-	PoolBlock* cur = m_chainTip;
 	const uint64_t tip_height = m_chainTip ? m_chainTip->m_sidechainHeight : 0;
 
-	uint32_t total_blocks_in_window = 0;
-	uint32_t total_uncles_in_window = 0;
-
 	// each dot corresponds to m_chainWindowSize / 30 shares, with current values, 2160 / 30 = 72
 	std::array<uint32_t, 30> our_blocks_in_window{};
 	std::array<uint32_t, 30> our_uncles_in_window{};
 
-	while (cur) {
-		blocks_in_window.emplace_back(cur->m_sidechainId);
-		++total_blocks_in_window;
-
-		if (cur->m_minerWallet == m_pool->params().m_wallet) {
-			// this produces an integer division with quotient rounded up, avoids non-whole divisions from overflowing on total_blocks_in_window
-			const size_t window_index = (total_blocks_in_window - 1) / ((m_chainWindowSize + our_blocks_in_window.size() - 1) / our_blocks_in_window.size());
-			our_blocks_in_window[std::min(window_index, our_blocks_in_window.size() - 1)]++; // clamp window_index, even if total_blocks_in_window is not larger than m_chainWindowSize
-		}
-
-		++block_depth;
-		if (block_depth >= m_chainWindowSize) {
-			break;
-		}
-
-		for (const hash& uncle_id : cur->m_uncles) {
-			blocks_in_window.emplace_back(uncle_id);
-			auto it = m_blocksById.find(uncle_id);
-			if (it != m_blocksById.end()) {
-				PoolBlock* uncle = it->second;
-				if (tip_height - uncle->m_sidechainHeight < m_chainWindowSize) {
-					++total_uncles_in_window;
-					if (uncle->m_minerWallet == m_pool->params().m_wallet) {
-						// this produces an integer division with quotient rounded up, avoids non-whole divisions from overflowing on total_blocks_in_window
-						const size_t window_index = (total_blocks_in_window - 1) / ((m_chainWindowSize + our_uncles_in_window.size() - 1) / our_uncles_in_window.size());
-						our_uncles_in_window[std::min(window_index, our_uncles_in_window.size() - 1)]++; // clamp window_index, even if total_blocks_in_window is not larger than m_chainWindowSize
+	// Positions of our shares are the only thing that needs to walk the window, and only if there is something to show
+	if (stats.m_ourBlocks + stats.m_ourUncles > 0) {
+		const size_t blocks_per_dot = (m_chainWindowSize + our_blocks_in_window.size() - 1) / our_blocks_in_window.size();
+		const uint64_t lowest_height = window_lowest_height(tip_height);
+
+		size_t window_index = 0;
+		for (auto it = m_windowBlocks.rbegin(); it != m_windowBlocks.rend(); ++it, ++window_index) {
+			visit_window_block(*it, lowest_height,
+				[this, &our_blocks_in_window, &our_uncles_in_window, window_index, blocks_per_dot](PoolBlock* b, PoolBlock* uncle)
+				{
+					const size_t i = std::min(window_index / blocks_per_dot, our_blocks_in_window.size() - 1);
+					if (!uncle) {
+						if (b->m_minerWallet.id() == m_ourWalletId) {
+							++our_blocks_in_window[i];
+						}
 					}
-				}
-			}
+					else if (uncle->m_minerWallet.id() == m_ourWalletId) {
+						++our_uncles_in_window[i];
+					}
+					return true;
+				});
 		}
-
-		cur = get_parent(cur);
 	}
 
-	uint64_t total_orphans = 0;
-	uint64_t our_orphans = 0;
-
 	uint64_t your_reward = 0;
-	uint64_t total_reward = 0;
-
-	if (m_chainTip) {
-		std::sort(blocks_in_window.begin(), blocks_in_window.end());
-		for (uint64_t i = 0; (i < m_chainWindowSize) && (i <= tip_height); ++i) {
-			for (PoolBlock* block : m_blocksByHeight[tip_height - i]) {
-				if (!std::binary_search(blocks_in_window.begin(), blocks_in_window.end(), block->m_sidechainId)) {
-					LOGINFO(4, "orphan block at height " << log::Gray() << block->m_sidechainHeight << log::NoColor() << ": " << log::Gray() << block->m_sidechainId);
-					++total_orphans;
-					if (block->m_minerWallet == m_pool->params().m_wallet) {
-						++our_orphans;
-					}
-				}
-			}
-		}
 
-		Wallet w = m_pool->params().m_wallet;
-		const std::vector<PoolBlock::TxOutput>& outs = m_chainTip->m_outputs;
+	if (m_chainTip && stats.m_windowWeight) {
+		std::vector<PoolBlock::TxOutput> tmp;
+		const std::vector<PoolBlock::TxOutput>* outputs = m_chainTip->get_outputs(tmp);
 
-		hash eph_public_key;
-		for (size_t i = 0, n = outs.size(); i < n; ++i) {
-			if (w.get_eph_public_key(m_chainTip->m_txkeySec, i, eph_public_key) && (outs[i].m_ephPublicKey == eph_public_key)) {
-				your_reward = outs[i].m_reward;
-			}
-			total_reward += outs[i].m_reward;
+		uint64_t total_reward = 0;
+		for (const PoolBlock::TxOutput& out : (outputs ? *outputs : tmp)) {
+			total_reward += out.m_reward;
 		}
+
+		uint64_t product[2];
+		product[0] = umul128(total_reward, stats.m_ourWeight, &product[1]);
+		your_reward = udiv128(product[1], product[0], stats.m_windowWeight, &rem);
 	}
 
 	uint64_t product[2];
-	product[0] = umul128(pool_hashrate, your_reward, &product[1]);
-	const uint64_t hashrate_est = total_reward ? udiv128(product[1], product[0], total_reward, &rem) : 0;
-	const double block_share = total_reward ? ((static_cast<double>(your_reward) * 100.0) / static_cast<double>(total_reward)) : 0.0;
-
-	uint32_t our_blocks_in_window_total = std::accumulate(our_blocks_in_window.begin(), our_blocks_in_window.end(), decltype(our_blocks_in_window)::value_type(0));
-	uint32_t our_uncles_in_window_total = std::accumulate(our_uncles_in_window.begin(), our_uncles_in_window.end(), decltype(our_uncles_in_window)::value_type(0));
+	product[0] = umul128(pool_hashrate, stats.m_ourWeight, &product[1]);
+	const uint64_t hashrate_est = stats.m_windowWeight ? udiv128(product[1], product[0], stats.m_windowWeight, &rem) : 0;
+	const double block_share = stats.m_windowWeight ? ((static_cast<double>(stats.m_ourWeight) * 100.0) / static_cast<double>(stats.m_windowWeight)) : 0.0;
 
 	std::string our_blocks_in_window_chart;
 	our_blocks_in_window_chart.reserve(our_blocks_in_window.size());
@@ -743,36 +1473,18 @@ void SideChain::print_status()
 		"\nSide chain height         = " << tip_height + 1 <<
 		"\nSide chain hashrate       = " << log::Hashrate(pool_hashrate) <<
 		(hashrate_est ? "\nYour hashrate (pool-side) = " : "") << (hashrate_est ? log::Hashrate(hashrate_est) : log::Hashrate()) <<
-		"\nPPLNS window              = " << total_blocks_in_window << " blocks (+" << total_uncles_in_window << " uncles, " << total_orphans << " orphans)" <<
-		"\nYour shares               = " << our_blocks_in_window_total << " blocks (+" << our_uncles_in_window_total << " uncles, " << our_orphans << " orphans)" <<
-		(our_blocks_in_window_total > 0 ? "\nYour shares position      = " : "") << (our_blocks_in_window_total > 0 ? "[" + our_blocks_in_window_chart + "]" : "") <<
-		(our_uncles_in_window_total > 0 ? "\nYour uncles position      = " : "") << (our_uncles_in_window_total > 0 ? "[" + our_uncles_in_window_chart + "]" : "") <<
+		"\nPPLNS window              = " << stats.m_windowBlocks << " blocks (+" << stats.m_windowUncles << " uncles, " << stats.m_windowOrphans << " orphans)" <<
+		"\nYour shares               = " << stats.m_ourBlocks << " blocks (+" << stats.m_ourUncles << " uncles, " << stats.m_ourOrphans << " orphans)" <<
+		(stats.m_ourBlocks > 0 ? "\nYour shares position      = " : "") << (stats.m_ourBlocks > 0 ? "[" + our_blocks_in_window_chart + "]" : "") <<
+		(stats.m_ourUncles > 0 ? "\nYour uncles position      = " : "") << (stats.m_ourUncles > 0 ? "[" + our_uncles_in_window_chart + "]" : "") <<
 		"\nBlock reward share        = " << block_share << "% (" << log::XMRAmount(your_reward) << ')'
 	);
 }
 
-difficulty_type SideChain::total_hashes() const
+uint64_t SideChain::chain_tip_height() const
 {
-	return m_chainTip ? m_chainTip->m_cumulativeDifficulty : difficulty_type();
-}
-
-uint64_t SideChain::miner_count()
-{
-	const time_t cur_time = time(nullptr);
-
-	MutexLock lock(m_sidechainLock);
-
-	// Delete wallets that weren't seen for more than 72 hours and return how many remain
-	for (auto it = m_seenWallets.begin(); it != m_seenWallets.end();) {
-		if (it->second + 72 * 60 * 60 <= cur_time) {
-			it = m_seenWallets.erase(it);
-		}
-		else {
-			++it;
-		}
-	}
-
-	return m_seenWallets.size();
+	ReadLock lock(m_sidechainLock);
+	return m_chainTip ? m_chainTip->m_sidechainHeight : 0;
 }
 
 time_t SideChain::last_updated() const
@@ -823,16 +1535,63 @@ bool SideChain::split_reward(uint64_t reward, const std::vector<MinerShare>& sha
 	return true;
 }
 
+bool SideChain::get_eph_public_keys(const hash& txkey_sec, const std::vector<MinerShare>& shares, std::vector<hash>& eph_public_keys, size_t& failed_index)
+{
+	// Each key is a scalar multiplication, so a range of keys is worth handing to another thread only when it has enough of them
+	constexpr size_t MIN_KEYS_PER_THREAD = 64;
+
+	const size_t n = shares.size();
+	eph_public_keys.resize(n);
+
+	std::atomic<size_t> first_failed{ n };
+
+	auto calc_keys = [&txkey_sec, &shares, &eph_public_keys, &first_failed](size_t from, size_t to)
+	{
+		for (size_t i = from; i < to; ++i) {
+			if (!shares[i].m_wallet->get_eph_public_key(txkey_sec, i, eph_public_keys[i])) {
+				eph_public_keys[i] = {};
+
+				size_t k = first_failed.load();
+				while ((i < k) && !first_failed.compare_exchange_weak(k, i)) {}
+			}
+		}
+	};
+
+	const uint32_t num_chunks = static_cast<uint32_t>(std::min<size_t>(parallel_run_threads(), n / MIN_KEYS_PER_THREAD));
+
+	if (num_chunks <= 1) {
+		calc_keys(0, n);
+	}
+	else {
+		parallel_run(num_chunks, [n, num_chunks, &calc_keys](uint32_t i) { calc_keys((n * i) / num_chunks, (n * (i + 1)) / num_chunks); });
+	}
+
+	failed_index = first_failed.load();
+	return failed_index == n;
+}
+
 bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const
 {
+	// Fast path: difficulty for the current chain tip or for a new block on top of it
+	if (m_windowTip) {
+		if (tip == m_windowTip) {
+			return calculate_difficulty(tip, m_windowDifficultyData, curDifficulty);
+		}
+
+		if ((tip->m_sidechainHeight == m_windowTip->m_sidechainHeight + 1) && (tip->m_parent == m_windowTip->m_sidechainId)) {
+			difficultyData = m_windowDifficultyData;
+			if (get_window_difficulty_delta(tip, difficultyData)) {
+				return calculate_difficulty(tip, difficultyData, curDifficulty);
+			}
+		}
+	}
+
 	difficultyData.clear();
 
 	PoolBlock* cur = tip;
-	uint64_t oldest_timestamp = std::numeric_limits<uint64_t>::max();
 
 	uint64_t block_depth = 0;
 	do {
-		oldest_timestamp = std::min(oldest_timestamp, cur->m_timestamp);
 		difficultyData.emplace_back(cur->m_timestamp, cur->m_cumulativeDifficulty);
 
 		for (const hash& uncle_id : cur->m_uncles) {
@@ -845,7 +1604,6 @@ bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& diff
 
 			const PoolBlock* uncle = it->second;
 			if (tip->m_sidechainHeight - uncle->m_sidechainHeight < m_chainWindowSize) {
-				oldest_timestamp = std::min(oldest_timestamp, uncle->m_timestamp);
 				difficultyData.emplace_back(uncle->m_timestamp, uncle->m_cumulativeDifficulty);
 			}
 		}
@@ -870,32 +1628,63 @@ bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& diff
 		cur = it->second;
 	} while (true);
 
-	// Discard 10% oldest and 10% newest (by timestamp) blocks
-	std::vector<uint32_t> tmpTimestamps;
-	tmpTimestamps.reserve(difficultyData.size());
+	std::sort(difficultyData.begin(), difficultyData.end(), difficulty_data_less);
 
-	std::transform(difficultyData.begin(), difficultyData.end(), std::back_inserter(tmpTimestamps),
-		[oldest_timestamp](const DifficultyData& d)
-		{
-			return static_cast<uint32_t>(d.m_timestamp - oldest_timestamp);
-		});
+	return calculate_difficulty(tip, difficultyData, curDifficulty);
+}
+
+// "difficultyData" must be sorted by timestamp
+bool SideChain::calculate_difficulty(const PoolBlock* tip, const std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const
+{
+	if (difficultyData.empty()) {
+		return false;
+	}
 
+	// Discard 10% oldest and 10% newest (by timestamp) blocks
 	const uint64_t cut_size = (difficultyData.size() + 9) / 10;
 	const uint64_t index1 = cut_size - 1;
 	const uint64_t index2 = difficultyData.size() - cut_size;
 
-	std::nth_element(tmpTimestamps.begin(), tmpTimestamps.begin() + index1, tmpTimestamps.end());
-	const uint64_t timestamp1 = oldest_timestamp + tmpTimestamps[index1];
+	const uint64_t oldest_timestamp = difficultyData.front().m_timestamp;
+
+	uint64_t timestamp1 = difficultyData[index1].m_timestamp;
+	uint64_t timestamp2 = difficultyData[index2].m_timestamp;
+
+	auto range_begin = difficultyData.begin();
+	auto range_end = difficultyData.end();
 
-	std::nth_element(tmpTimestamps.begin(), tmpTimestamps.begin() + index2, tmpTimestamps.end());
-	const uint64_t timestamp2 = oldest_timestamp + tmpTimestamps[index2];
+	if (difficultyData.back().m_timestamp - oldest_timestamp <= std::numeric_limits<uint32_t>::max()) {
+		// Only blocks with timestamps in [timestamp1, timestamp2] are used, they're all between index1 and index2 (plus equal timestamps around them)
+		range_begin = std::lower_bound(difficultyData.begin(), difficultyData.begin() + index1, timestamp1,
+			[](const DifficultyData& d, uint64_t t) { return d.m_timestamp < t; });
+		range_end = std::upper_bound(difficultyData.begin() + index2, difficultyData.end(), timestamp2,
+			[](uint64_t t, const DifficultyData& d) { return t < d.m_timestamp; });
+	}
+	else {
+		// Timestamps are compared as 32-bit offsets from the oldest timestamp, do it exactly the same way if they wrap
+		std::vector<uint32_t> tmpTimestamps;
+		tmpTimestamps.reserve(difficultyData.size());
+
+		std::transform(difficultyData.begin(), difficultyData.end(), std::back_inserter(tmpTimestamps),
+			[oldest_timestamp](const DifficultyData& d)
+			{
+				return static_cast<uint32_t>(d.m_timestamp - oldest_timestamp);
+			});
+
+		std::nth_element(tmpTimestamps.begin(), tmpTimestamps.begin() + index1, tmpTimestamps.end());
+		timestamp1 = oldest_timestamp + tmpTimestamps[index1];
+
+		std::nth_element(tmpTimestamps.begin(), tmpTimestamps.begin() + index2, tmpTimestamps.end());
+		timestamp2 = oldest_timestamp + tmpTimestamps[index2];
+	}
 
 	const uint64_t delta_t = (timestamp2 > timestamp1) ? (timestamp2 - timestamp1) : 1;
 
 	difficulty_type diff1{ std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max() };
 	difficulty_type diff2{ 0, 0 };
 
-	for (const DifficultyData& d : difficultyData) {
+	for (auto it = range_begin; it != range_end; ++it) {
+		const DifficultyData& d = *it;
 		if (timestamp1 <= d.m_timestamp && d.m_timestamp <= timestamp2) {
 			if (d.m_cumulativeDifficulty < diff1) {
 				diff1 = d.m_cumulativeDifficulty;
@@ -930,10 +1719,13 @@ bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& diff
 
 void SideChain::verify_loop(PoolBlock* block)
 {
+	metrics::Timer timer(metrics::SIDECHAIN_VERIFY_LOOP);
+
 	// PoW is already checked at this point
 
 	std::vector<PoolBlock*> blocks_to_verify(1, block);
-	PoolBlock* highest_block = nullptr;
+	std::vector<PoolBlock*> verified_blocks;
+	std::vector<DeferredKeysCheck> deferred_checks;
 
 	while (!blocks_to_verify.empty()) {
 		block = blocks_to_verify.back();
@@ -943,7 +1735,7 @@ void SideChain::verify_loop(PoolBlock* block)
 			continue;
 		}
 
-		verify(block);
+		verify(block, deferred_checks);
 
 		if (!block->m_verified) {
 			LOGINFO(6, "can't verify block at height = " << block->m_sidechainHeight <<
@@ -952,65 +1744,170 @@ void SideChain::verify_loop(PoolBlock* block)
 			continue;
 		}
 
-		if (block->m_invalid) {
-			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight << " is invalid");
-		}
-		else {
-			LOGINFO(3, "verified block at height = " << block->m_sidechainHeight <<
-				", depth = " << block->m_depth <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight);
-
-			// This block is now verified
+		verified_blocks.push_back(block);
 
-			if (is_longer_chain(highest_block, block)) {
-				highest_block = block;
-			}
-			else if (highest_block && (highest_block->m_sidechainHeight > block->m_sidechainHeight)) {
-				LOGINFO(4, "block " << highest_block->m_sidechainId <<
-					", height = " << highest_block->m_sidechainHeight <<
-					" is not a longer chain than " << block->m_sidechainId <<
-					", height " << block->m_sidechainHeight);
+		if (!block->m_invalid) {
+			// Keep the PPLNS window following the chain being verified, so the next block on top of it doesn't need a full window walk
+			if ((block->m_depth < m_chainWindowSize) && (!m_windowTip ||
+				((block->m_sidechainHeight == m_windowTip->m_sidechainHeight + 1) && (block->m_parent == m_windowTip->m_sidechainId))))
+			{
+				update_window(block);
 			}
 
-			// If it came through a broadcast, send it to our peers
-			if (block->m_wantBroadcast && !block->m_broadcasted) {
-				block->m_broadcasted = true;
-				if (p2pServer() && (block->m_depth < UNCLE_BLOCK_DEPTH)) {
-					p2pServer()->broadcast(*block);
+			// Try to verify blocks on top of this one
+			// It's valid so far, but its deferred checks can still make it invalid. Blocks on top of it will be fixed up below in this case
+			for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
+				const std::vector<PoolBlock*>* next_blocks = m_blocksByHeight.find(block->m_sidechainHeight + i);
+				if (next_blocks) {
+					blocks_to_verify.insert(blocks_to_verify.end(), next_blocks->begin(), next_blocks->end());
 				}
 			}
+		}
+	}
+
+	if (!deferred_checks.empty()) {
+		run_deferred_checks(deferred_checks);
+
+		bool any_failed = false;
 
-			// Save it for faster syncing on the next p2pool start
-			if (p2pServer()) {
-				p2pServer()->store_in_cache(*block);
+		for (const DeferredKeysCheck& check : deferred_checks) {
+			if (check.m_failedIndex < check.m_shares.size()) {
+				PoolBlock* b = check.m_block;
+				LOGWARN(3, "block at height = " << b->m_sidechainHeight <<
+					", id = " << b->m_sidechainId <<
+					", mainchain height = " << b->m_txinGenHeight <<
+					" pays out to a wrong wallet at index " << check.m_failedIndex);
+				b->m_invalid = true;
+				any_failed = true;
 			}
+		}
 
-			// Try to verify blocks on top of this one
-			for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
-				auto it = m_blocksByHeight.find(block->m_sidechainHeight + i);
-				if (it == m_blocksByHeight.end()) {
+		// Blocks are verified only after their parent and uncles, so a single pass in the same order is enough
+		// to mark everything built on top of newly invalid blocks as invalid, exactly as verify() would have done it
+		if (any_failed) {
+			for (PoolBlock* b : verified_blocks) {
+				if (b->m_invalid) {
 					continue;
 				}
 
-				const std::vector<PoolBlock*>& next_blocks = it->second;
-				if (!next_blocks.empty()) {
-					blocks_to_verify.insert(blocks_to_verify.end(), next_blocks.begin(), next_blocks.end());
+				PoolBlock* parent = get_parent(b);
+				bool invalid = parent && parent->m_invalid;
+
+				for (size_t i = 0, n = b->m_uncles.size(); (i < n) && !invalid; ++i) {
+					auto it = m_blocksById.find(b->m_uncles[i]);
+					invalid = (it != m_blocksById.end()) && it->second->m_invalid;
 				}
+
+				b->m_invalid = invalid;
+			}
+
+			if (m_windowTip && m_windowTip->m_invalid) {
+				reset_window();
+			}
+		}
+	}
+
+	PoolBlock* highest_block = nullptr;
+
+	for (PoolBlock* b : verified_blocks) {
+		if (b->m_invalid) {
+			LOGWARN(3, "block at height = " << b->m_sidechainHeight <<
+				", id = " << b->m_sidechainId <<
+				", mainchain height = " << b->m_txinGenHeight << " is invalid");
+			continue;
+		}
+
+		LOGINFO(3, "verified block at height = " << b->m_sidechainHeight <<
+			", depth = " << b->m_depth <<
+			", id = " << b->m_sidechainId <<
+			", mainchain height = " << b->m_txinGenHeight);
+
+		// This block is now verified
+
+		if (is_longer_chain(highest_block, b)) {
+			highest_block = b;
+		}
+		else if (highest_block && (highest_block->m_sidechainHeight > b->m_sidechainHeight)) {
+			LOGINFO(4, "block " << highest_block->m_sidechainId <<
+				", height = " << highest_block->m_sidechainHeight <<
+				" is not a longer chain than " << b->m_sidechainId <<
+				", height " << b->m_sidechainHeight);
+		}
+
+		// If it came through a broadcast, send it to our peers
+		if (b->m_wantBroadcast && !b->m_broadcasted) {
+			b->m_broadcasted = true;
+			if (p2pServer() && (b->m_depth < UNCLE_BLOCK_DEPTH)) {
+				p2pServer()->broadcast(*b);
 			}
 		}
+
+		// Save it for faster syncing on the next p2pool start
+		if (p2pServer()) {
+			p2pServer()->store_in_cache(*b);
+		}
 	}
 
 	if (highest_block) {
 		update_chain_tip(highest_block);
 	}
 
-	return;
+	// The window followed the blocks being verified, put it back on the chain tip if they didn't become one
+	if (m_windowTip != m_chainTip) {
+		if (m_chainTip) {
+			update_window(m_chainTip);
+		}
+		else {
+			reset_window();
+		}
+	}
+}
+
+void SideChain::run_deferred_checks(std::vector<DeferredKeysCheck>& checks)
+{
+	// A single block (the usual case outside of sync) is split between threads by get_eph_public_keys() itself
+	if (checks.size() == 1) {
+		DeferredKeysCheck& check = checks[0];
+
+		std::vector<hash> eph_public_keys;
+		size_t failed_index;
+		get_eph_public_keys(check.m_block->m_txkeySec, check.m_shares, eph_public_keys, failed_index);
+
+		check.m_failedIndex = check.m_shares.size();
+		for (size_t i = 0, n = check.m_shares.size(); i < n; ++i) {
+			if (eph_public_keys[i] != check.m_ephPublicKeys[i]) {
+				check.m_failedIndex = i;
+				break;
+			}
+		}
+		return;
+	}
+
+	std::atomic<size_t> next_check{ 0 };
+
+	auto worker = [&checks, &next_check]()
+	{
+		hash eph_public_key;
+
+		for (size_t k = next_check.fetch_add(1); k < checks.size(); k = next_check.fetch_add(1)) {
+			DeferredKeysCheck& check = checks[k];
+			const hash& txkey_sec = check.m_block->m_txkeySec;
+
+			check.m_failedIndex = check.m_shares.size();
+			for (size_t i = 0, n = check.m_shares.size(); i < n; ++i) {
+				if (!check.m_shares[i].m_wallet->get_eph_public_key(txkey_sec, i, eph_public_key) || (eph_public_key != check.m_ephPublicKeys[i])) {
+					check.m_failedIndex = i;
+					break;
+				}
+			}
+		}
+	};
+
+	// It runs with the sidechain locked, so it uses threads which are already running
+	parallel_run(static_cast<uint32_t>(std::min<size_t>(parallel_run_threads(), checks.size())), [&worker](uint32_t) { worker(); });
 }
 
-void SideChain::verify(PoolBlock* block)
+void SideChain::verify(PoolBlock* block, std::vector<DeferredKeysCheck>& deferred_checks)
 {
 	// Genesis block
 	if (block->m_sidechainHeight == 0) {
@@ -1237,16 +2134,28 @@ void SideChain::verify(PoolBlock* block)
 		return;
 	}
 
-	if (shares.size() != block->m_outputs.size()) {
+	std::vector<PoolBlock::TxOutput> tmp_outputs;
+	const std::vector<PoolBlock::TxOutput>* p = block->get_outputs(tmp_outputs);
+	if (!p) {
+		LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
+			", id = " << block->m_sidechainId <<
+			", mainchain height = " << block->m_txinGenHeight <<
+			" has invalid outputs blob");
+		block->m_invalid = true;
+		return;
+	}
+	const std::vector<PoolBlock::TxOutput>& outputs = *p;
+
+	if (shares.size() != outputs.size()) {
 		LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
 			", id = " << block->m_sidechainId <<
 			", mainchain height = " << block->m_txinGenHeight
-			<< " has invalid number of outputs: got " << block->m_outputs.size() << ", expected " << shares.size());
+			<< " has invalid number of outputs: got " << outputs.size() << ", expected " << shares.size());
 		block->m_invalid = true;
 		return;
 	}
 
-	uint64_t total_reward = std::accumulate(block->m_outputs.begin(), block->m_outputs.end(), 0ULL,
+	uint64_t total_reward = std::accumulate(outputs.begin(), outputs.end(), 0ULL,
 		[](uint64_t a, const PoolBlock::TxOutput& b)
 		{
 			return a + b.m_reward;
@@ -1255,46 +2164,38 @@ void SideChain::verify(PoolBlock* block)
 	std::vector<uint64_t> rewards;
 	split_reward(total_reward, shares, rewards);
 
-	if (rewards.size() != block->m_outputs.size()) {
+	if (rewards.size() != outputs.size()) {
 		LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
 			", id = " << block->m_sidechainId <<
 			", mainchain height = " << block->m_txinGenHeight
-			<< " has invalid number of outputs: got " << block->m_outputs.size() << ", expected " << rewards.size());
+			<< " has invalid number of outputs: got " << outputs.size() << ", expected " << rewards.size());
 		block->m_invalid = true;
 		return;
 	}
 
 	for (size_t i = 0, n = rewards.size(); i < n; ++i) {
-		if (rewards[i] != block->m_outputs[i].m_reward) {
-			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight <<
-				" has invalid reward at index " << i << ": got " << block->m_outputs[i].m_reward << ", expected " << rewards[i]);
-			block->m_invalid = true;
-			return;
-		}
-
-		hash eph_public_key;
-		if (!shares[i].m_wallet->get_eph_public_key(block->m_txkeySec, i, eph_public_key)) {
+		if (rewards[i] != outputs[i].m_reward) {
 			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
 				", id = " << block->m_sidechainId <<
 				", mainchain height = " << block->m_txinGenHeight <<
-				" failed to eph_public_key at index " << i);
+				" has invalid reward at index " << i << ": got " << outputs[i].m_reward << ", expected " << rewards[i]);
 			block->m_invalid = true;
 			return;
 		}
+	}
 
-		if (eph_public_key != block->m_outputs[i].m_ephPublicKey) {
-			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight <<
-				" pays out to a wrong wallet at index " << i);
-			block->m_invalid = true;
-			return;
-		}
+	// Ephemeral public keys are checked later in verify_loop()
+	DeferredKeysCheck check;
+	check.m_block = block;
+	check.m_shares = std::move(shares);
+	check.m_ephPublicKeys.reserve(outputs.size());
+	for (const PoolBlock::TxOutput& output : outputs) {
+		check.m_ephPublicKeys.emplace_back(output.m_ephPublicKey);
 	}
+	check.m_failedIndex = 0;
+	deferred_checks.emplace_back(std::move(check));
 
-	// All checks passed
+	// All checks passed so far
 	block->m_invalid = false;
 }
 
@@ -1315,6 +2216,7 @@ void SideChain::update_chain_tip(PoolBlock* block)
 		if (get_difficulty(block, m_difficultyData, diff)) {
 			m_chainTip = block;
 			m_curDifficulty = diff;
+			update_window(block);
 
 			LOGINFO(2, "new chain tip: next height = " << log::Gray() << block->m_sidechainHeight + 1 << log::NoColor() <<
 				", next difficulty = " << log::Gray() << m_curDifficulty << log::NoColor() <<
@@ -1322,7 +2224,7 @@ void SideChain::update_chain_tip(PoolBlock* block)
 
 			block->m_wantBroadcast = true;
 			if (m_pool) {
-				m_pool->update_block_template_async();
+				m_pool->update_block_template_async(true);
 			}
 			prune_old_blocks();
 		}
@@ -1336,7 +2238,7 @@ void SideChain::update_chain_tip(PoolBlock* block)
 	else if (block->m_sidechainHeight + UNCLE_BLOCK_DEPTH > m_chainTip->m_sidechainHeight) {
 		LOGINFO(4, "possible uncle block: id = " << log::Gray() << block->m_sidechainId << log::NoColor() <<
 			", height = " << log::Gray() << block->m_sidechainHeight);
-		m_pool->update_block_template_async();
+		m_pool->update_block_template_async(true);
 	}
 
 	if (p2pServer() && block->m_wantBroadcast && !block->m_broadcasted) {
@@ -1479,7 +2381,11 @@ bool SideChain::is_longer_chain(const PoolBlock* block, const PoolBlock* candida
 void SideChain::update_depths(PoolBlock* block)
 {
 	for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
-		for (PoolBlock* child : m_blocksByHeight[block->m_sidechainHeight + i]) {
+		const std::vector<PoolBlock*>* children = m_blocksByHeight.find(block->m_sidechainHeight + i);
+		if (!children) {
+			continue;
+		}
+		for (PoolBlock* child : *children) {
 			if (child->m_parent == block->m_sidechainId) {
 				if (i != 1) {
 					LOGERR(1, "m_blocksByHeight is inconsistent with child->m_parent. Fix the code!");
@@ -1543,8 +2449,29 @@ void SideChain::prune_old_blocks()
 	// Leave 2 minutes worth of spare blocks in addition to 2xPPLNS window for lagging nodes which need to sync
 	const uint64_t prune_distance = m_chainWindowSize * 2 + 120 / m_targetBlockTime;
 
+	const time_t cur_time = time(nullptr);
+
 	// Remove old blocks from alternative unconnected chains after long enough time
-	const time_t prune_time = time(nullptr) - m_chainWindowSize * 4 * m_targetBlockTime;
+	const time_t prune_time = cur_time - m_chainWindowSize * 4 * m_targetBlockTime;
+
+	// Delete wallets that weren't seen for more than 72 hours
+	{
+		MutexLock lock(m_seenWalletsLock);
+
+		for (auto it = m_seenWallets.begin(); it != m_seenWallets.end();) {
+			if (it->second + 72 * 60 * 60 <= cur_time) {
+				it = m_seenWallets.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+
+		if (m_stats.m_minerCount != m_seenWallets.size()) {
+			m_stats.m_minerCount = m_seenWallets.size();
+			publish_stats();
+		}
+	}
 
 	if (m_chainTip->m_sidechainHeight < prune_distance) {
 		return;
@@ -1554,36 +2481,28 @@ void SideChain::prune_old_blocks()
 
 	uint64_t num_blocks_pruned = 0;
 
-	for (auto it = m_blocksByHeight.begin(); (it != m_blocksByHeight.end()) && (it->first <= h);) {
-		const uint64_t height = it->first;
-		std::vector<PoolBlock*>& v = it->second;
-
-		v.erase(std::remove_if(v.begin(), v.end(),
-			[this, prune_distance, prune_time, &num_blocks_pruned, height](PoolBlock* block)
-			{
-				if ((block->m_depth >= prune_distance) || (block->m_localTimestamp <= prune_time)) {
-					auto it2 = m_blocksById.find(block->m_sidechainId);
-					if (it2 != m_blocksById.end()) {
-						m_blocksById.erase(it2);
-						unsee_block(*block);
-						delete block;
-						++num_blocks_pruned;
-					}
-					else {
-						LOGERR(1, "m_blocksByHeight and m_blocksById are inconsistent at height " << height << ". Fix the code!");
+	m_blocksByHeight.prune(h,
+		[this, prune_distance, prune_time, &num_blocks_pruned](uint64_t height, std::vector<PoolBlock*>& v)
+		{
+			v.erase(std::remove_if(v.begin(), v.end(),
+				[this, prune_distance, prune_time, &num_blocks_pruned, height](PoolBlock* block)
+				{
+					if ((block->m_depth >= prune_distance) || (block->m_localTimestamp <= prune_time)) {
+						auto it2 = m_blocksById.find(block->m_sidechainId);
+						if (it2 != m_blocksById.end()) {
+							m_blocksById.erase(it2);
+							unsee_block(*block);
+							delete block;
+							++num_blocks_pruned;
+						}
+						else {
+							LOGERR(1, "m_blocksByHeight and m_blocksById are inconsistent at height " << height << ". Fix the code!");
+						}
+						return true;
 					}
-					return true;
-				}
-				return false;
-			}), v.end());
-
-		if (v.empty()) {
-			it = m_blocksByHeight.erase(it);
-		}
-		else {
-			++it;
-		}
-	}
+					return false;
+				}), v.end());
+		});
 
 	if (num_blocks_pruned) {
 		LOGINFO(4, "pruned " << num_blocks_pruned << " old blocks at heights <= " << h);
@@ -1600,7 +2519,7 @@ void SideChain::get_missing_blocks(std::vector<hash>& missing_blocks)
 {
 	missing_blocks.clear();
 
-	MutexLock lock(m_sidechainLock);
+	ReadLock lock(m_sidechainLock);
 
 	for (auto& b : m_blocksById) {
 		if (b.second->m_verified) {
@@ -19,6 +19,7 @@
 
 #include "uv_util.h"
 #include <map>
+#include <deque>
 
 namespace p2pool {
 
@@ -37,6 +38,111 @@ struct MinerShare
 	Wallet* m_wallet;
 };
 
+// Sidechain blocks grouped by height
+// Almost all of them are in a window of heights around the chain tip, so they're stored in a ring buffer indexed by height.
+// Vectors in the ring are reused, so adding and pruning blocks doesn't allocate memory in the steady state.
+// Blocks which don't fit in the ring (very old or far ahead of the others) go to a std::map
+class BlocksByHeight : public nocopy_nomove
+{
+public:
+	BlocksByHeight() : m_mask(0), m_lowestHeight(std::numeric_limits<uint64_t>::max()) {}
+
+	void init(size_t min_capacity)
+	{
+		size_t capacity = 1;
+		while (capacity < min_capacity) {
+			capacity <<= 1;
+		}
+		m_ring.resize(capacity);
+		m_mask = capacity - 1;
+	}
+
+	const std::vector<PoolBlock*>* find(uint64_t height) const
+	{
+		const Bucket& b = m_ring[height & m_mask];
+		if ((b.m_height == height) && !b.m_blocks.empty()) {
+			return &b.m_blocks;
+		}
+
+		if (m_overflow.empty()) {
+			return nullptr;
+		}
+
+		auto it = m_overflow.find(height);
+		return (it != m_overflow.end()) ? &it->second : nullptr;
+	}
+
+	void add(uint64_t height, PoolBlock* block)
+	{
+		m_lowestHeight = std::min(m_lowestHeight, height);
+
+		Bucket& b = m_ring[height & m_mask];
+		if (b.m_blocks.empty()) {
+			if (m_overflow.empty() || (m_overflow.find(height) == m_overflow.end())) {
+				b.m_height = height;
+				b.m_blocks.push_back(block);
+				return;
+			}
+		}
+		else if (b.m_height == height) {
+			b.m_blocks.push_back(block);
+			return;
+		}
+
+		m_overflow[height].push_back(block);
+	}
+
+	// Calls f(height, blocks) for all heights <= max_height, "f" can remove blocks from the vector
+	template<typename T>
+	void prune(uint64_t max_height, T&& f)
+	{
+		const uint64_t capacity = m_ring.size();
+
+		if (m_lowestHeight <= max_height) {
+			uint64_t lowest_remaining = std::numeric_limits<uint64_t>::max();
+
+			// Every ring bucket is checked at most once
+			const uint64_t from = std::max(m_lowestHeight, (max_height + 1 > capacity) ? (max_height + 1 - capacity) : 0);
+			for (uint64_t height = from; height <= max_height; ++height) {
+				Bucket& b = m_ring[height & m_mask];
+				if (!b.m_blocks.empty() && (b.m_height <= max_height)) {
+					f(b.m_height, b.m_blocks);
+					if (!b.m_blocks.empty()) {
+						lowest_remaining = std::min(lowest_remaining, b.m_height);
+					}
+				}
+			}
+
+			for (auto it = m_overflow.begin(); (it != m_overflow.end()) && (it->first <= max_height);) {
+				f(it->first, it->second);
+				if (it->second.empty()) {
+					it = m_overflow.erase(it);
+				}
+				else {
+					lowest_remaining = std::min(lowest_remaining, it->first);
+					++it;
+				}
+			}
+
+			m_lowestHeight = std::min(lowest_remaining, max_height + 1);
+		}
+	}
+
+private:
+	struct Bucket
+	{
+		Bucket() : m_height(0) {}
+
+		uint64_t m_height;
+		std::vector<PoolBlock*> m_blocks;
+	};
+
+	std::vector<Bucket> m_ring;
+	uint64_t m_mask;
+	uint64_t m_lowestHeight;
+	std::map<uint64_t, std::vector<PoolBlock*>> m_overflow;
+};
+
 class SideChain
 {
 public:
@@ -47,6 +153,10 @@ public:
 
 	bool block_seen(const PoolBlock& block);
 	void unsee_block(const PoolBlock& block);
+
+	// The same check for a block which wasn't deserialized yet (see PoolBlock::peek), it doesn't mark the block as seen
+	// Its id is not verified, so a forged blob can't stop the real block with the same id from being accepted later
+	bool block_seen(const hash& id, uint64_t sidechain_height, const difficulty_type& cumulative_difficulty);
 	bool add_external_block(PoolBlock& block, std::vector<hash>& missing_blocks);
 	void add_block(const PoolBlock& block);
 	void get_missing_blocks(std::vector<hash>& missing_blocks);
@@ -54,11 +164,50 @@ public:
 	bool has_block(const hash& id);
 	void watch_mainchain_block(const ChainMain& data, const hash& possible_id);
 
-	bool get_block_blob(const hash& id, std::vector<uint8_t>& blob);
+	// Blobs are shared with the sidechain's blocks, the caller gets a reference to each of them and must release() it
+	// Returns nullptr if the block is unknown
+	SharedBuf* get_block_blob(const hash& id);
+
+	// Blobs of the requested blocks and their ancestors down to min_height, at most max_blocks and max_bytes in total
+	// Every block's ancestors come before it, so the receiver can link them in the order they're sent
+	// Returns how many of the requested blocks are not included because they're unknown or didn't fit
+	size_t get_block_blobs(const hash* ids, size_t num_ids, uint64_t min_height, size_t max_blocks, uint64_t max_bytes, std::vector<SharedBuf*>& blobs);
 	bool get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::vector<uint8_t>& blob);
 
+	// Snapshot of the verification state: the chain tip and ids of all verified blocks, protected by a checksum
+	// restore_snapshot() adds the listed blocks found in cached_blocks as already verified, so they don't need to be verified again
+	void get_snapshot(std::vector<uint8_t>& data);
+	bool restore_snapshot(const std::vector<uint8_t>& data, const unordered_map<hash, PoolBlock*>& cached_blocks);
+
 	void print_status();
 
+	// Statistics which are kept up to date when blocks are added, the chain tip changes and old blocks are pruned
+	// "Our" means blocks mined to the wallet p2pool was started with
+	struct Stats
+	{
+		uint64_t m_tipHeight;
+		difficulty_type m_totalHashes;
+
+		// Wallets which mined a block in the last 72 hours
+		uint64_t m_minerCount;
+
+		// PPLNS window of the chain tip: blocks, uncles and orphans (blocks at the same heights which are not in the window)
+		// Weight is the sum of all shares' difficulties, it's what rewards are split by
+		uint64_t m_windowBlocks;
+		uint64_t m_windowUncles;
+		uint64_t m_windowOrphans;
+		uint64_t m_windowMiners;
+		uint64_t m_windowWeight;
+
+		uint64_t m_ourBlocks;
+		uint64_t m_ourUncles;
+		uint64_t m_ourOrphans;
+		uint64_t m_ourWeight;
+	};
+
+	// Consistent copy of the latest statistics, it doesn't take any locks
+	Stats stats() const;
+
 	// Consensus ID can be used to spawn independent P2Pools with their own sidechains
 	// It's never sent over the network to avoid revealing it to the possible man in the middle
 	// Consensus ID can therefore be used as a password to create private P2Pools
@@ -66,16 +215,21 @@ public:
 	uint64_t chain_window_size() const { return m_chainWindowSize; }
 	NetworkType network_type() const { return m_networkType; }
 	const difficulty_type& difficulty() const { return m_curDifficulty; }
-	difficulty_type total_hashes() const;
+	difficulty_type total_hashes() const { return stats().m_totalHashes; }
 	uint64_t block_time() const { return m_targetBlockTime; }
-	uint64_t miner_count();
+	uint64_t miner_count() const { return stats().m_minerCount; }
 	time_t last_updated() const;
 	bool is_default() const;
 
 	const PoolBlock* chainTip() const { return m_chainTip; }
+	uint64_t chain_tip_height() const;
 
 	static bool split_reward(uint64_t reward, const std::vector<MinerShare>& shares, std::vector<uint64_t>& rewards);
 
+	// Calculates ephemeral public keys for all outputs, large numbers of outputs are split between multiple threads
+	// Returns false and the first index that failed if some of the keys couldn't be calculated
+	static bool get_eph_public_keys(const hash& txkey_sec, const std::vector<MinerShare>& shares, std::vector<hash>& eph_public_keys, size_t& failed_index);
+
 private:
 	p2pool* m_pool;
 	P2PServer* p2pServer() const;
@@ -84,9 +238,44 @@ private:
 private:
 	bool get_shares(PoolBlock* tip, std::vector<MinerShare>& shares) const;
 	bool get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const;
+	bool calculate_difficulty(const PoolBlock* tip, const std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const;
+	// Ephemeral public key checks are the most expensive part of verification and they don't depend on other blocks,
+	// so verify_loop() collects them from all blocks it can verify and runs them in parallel at the end
+	struct DeferredKeysCheck
+	{
+		PoolBlock* m_block;
+		std::vector<MinerShare> m_shares;
+		std::vector<hash> m_ephPublicKeys;
+		size_t m_failedIndex;
+	};
+
 	void verify_loop(PoolBlock* block);
-	void verify(PoolBlock* block);
+	void verify(PoolBlock* block, std::vector<DeferredKeysCheck>& deferred_checks);
+	static void run_deferred_checks(std::vector<DeferredKeysCheck>& checks);
 	void update_chain_tip(PoolBlock* block);
+
+	// PPLNS window of the current chain tip is kept up to date incrementally: each new tip adds its own (and its uncles') shares
+	// and removes shares which drop out of the window, so get_shares() doesn't have to walk the whole window every time
+	// The same is done for difficulty data which is kept sorted by timestamp, so get_difficulty() doesn't need to walk and sort it
+	void update_window(PoolBlock* tip);
+	void reset_window();
+	bool rebuild_window(PoolBlock* tip);
+
+	template<typename T> bool visit_window_block(PoolBlock* block, uint64_t lowest_height, T&& f) const;
+	template<typename T, typename U> bool visit_window_delta(PoolBlock* block, T&& remove, U&& add) const;
+
+	bool get_window_delta(PoolBlock* block, unordered_map<uint32_t, MinerShare>& shares) const;
+	bool get_window_difficulty_delta(PoolBlock* block, std::vector<DifficultyData>& data) const;
+
+	// Window statistics follow the window: update_window_stats() applies the same delta as get_window_delta() for the new tip,
+	// rebuild_window_stats() counts everything again after the window was rebuilt
+	uint64_t window_lowest_height(uint64_t tip_height) const { return (tip_height + 1 > m_chainWindowSize) ? (tip_height + 1 - m_chainWindowSize) : 0; }
+	void count_window_share(const PoolBlock* b, const PoolBlock* uncle, bool add);
+	void count_window_height(uint64_t height, bool add);
+	void update_window_stats(PoolBlock* tip);
+	void rebuild_window_stats();
+	void publish_stats();
+	void get_window_shares(const unordered_map<uint32_t, MinerShare>& window_shares, std::vector<MinerShare>& shares) const;
 	PoolBlock* get_parent(const PoolBlock* block);
 
 	// Checks if "candidate" has longer (higher difficulty) chain than "block"
@@ -97,13 +286,19 @@ private:
 	bool load_config(const std::string& filename);
 	bool check_config();
 
-	mutable uv_mutex_t m_sidechainLock;
+	// Blocks are added, verified and pruned under the write lock, everything that only reads sidechain state takes the read lock
+	mutable uv_rwlock_t m_sidechainLock;
 	PoolBlock* m_chainTip;
-	std::map<uint64_t, std::vector<PoolBlock*>> m_blocksByHeight;
+	BlocksByHeight m_blocksByHeight;
 	unordered_map<hash, PoolBlock*> m_blocksById;
+
+	uv_mutex_t m_seenWalletsLock;
 	unordered_map<hash, time_t> m_seenWallets;
-	std::vector<MinerShare> m_tmpShares;
-	std::vector<uint64_t> m_tmpRewards;
+
+	PoolBlock* m_windowTip;
+	std::deque<PoolBlock*> m_windowBlocks;
+	unordered_map<uint32_t, MinerShare> m_windowShares;
+	std::vector<DifficultyData> m_windowDifficultyData;
 
 	uv_mutex_t m_seenBlocksLock;
 	unordered_set<hash> m_seenBlocks;
@@ -123,6 +318,18 @@ private:
 
 	ChainMain m_watchBlock;
 	hash m_watchBlockSidechainId;
+
+	// Changed only with m_sidechainLock locked for writing, publish_stats() copies it for readers
+	Stats m_stats;
+	uint32_t m_ourWalletId;
+
+	// Number of blocks (all and ours) at the heights of the PPLNS window, orphans are what the window doesn't include
+	uint64_t m_windowHeightBlocks;
+	uint64_t m_windowHeightOurBlocks;
+
+	// Published statistics, protected by a sequence counter: it's odd while they're written, readers retry if it changed
+	std::atomic<uint32_t> m_statsSeq;
+	std::atomic<uint64_t> m_publishedStats[sizeof(Stats) / sizeof(uint64_t)];
 };
 
 } // namespace p2pool
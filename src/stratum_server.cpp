@@ -22,6 +22,7 @@
 #include "side_chain.h"
 #include "params.h"
 #include "p2pool_api.h"
+#include "metrics.h"
 
 static constexpr char log_category_prefix[] = "StratumServer ";
 
@@ -31,13 +32,47 @@ static constexpr uint64_t DEFAULT_BAN_TIME = 600;
 // Use short target format (4 bytes) for diff <= 4 million
 static constexpr uint64_t TARGET_4_BYTES_LIMIT = std::numeric_limits<uint64_t>::max() / 4000000;
 
+// Vardiff retargets after this many shares or this many share intervals, whichever comes first
+static constexpr uint32_t VARDIFF_RETARGET_SHARES = 16;
+static constexpr uint32_t VARDIFF_RETARGET_INTERVALS = 4;
+
+// Vardiff doesn't change difficulty more than this many times at once
+static constexpr uint64_t VARDIFF_MAX_STEP = 4;
+
+static constexpr uint64_t VARDIFF_START_DIFFICULTY = 10000;
+static constexpr uint64_t VARDIFF_MIN_DIFFICULTY = 1000;
+
+// Time windows (in seconds) of per-worker hashrate averages
+static constexpr double WORKER_HASHRATE_WINDOWS[] = { 15 * 60, 60 * 60, 24 * 60 * 60 };
+
+// Workers beyond this limit are counted together as one "(other)" entry
+static constexpr size_t MAX_WORKERS = 10000;
+
+// Only the top workers by hashrate are written to the API file
+static constexpr size_t API_MAX_WORKERS = 100;
+
 #include "tcp_server.inl"
 
 namespace p2pool {
 
+// Number of hashes represented by a share with this target
+static FORCEINLINE uint64_t target_to_hashes(uint64_t target)
+{
+	if (target >= TARGET_4_BYTES_LIMIT) {
+		target = (target >> 32) << 32;
+	}
+
+	uint64_t rem;
+	return (target > 1) ? udiv128(1, 0, target, &rem) : 0;
+}
+
 StratumServer::StratumServer(p2pool* pool)
-	: TCPServer(StratumClient::allocate)
+	: TCPServer(StratumClient::allocate, pool->params().m_stratumThreads)
 	, m_pool(pool)
+	, m_vardiffInterval(pool->params().m_stratumVardiff)
+	, m_groupSize(pool->params().m_stratumGroupSize)
+	, m_verifier(pool->params().m_stratumVerifyRate)
+	, m_assignedTemplateId(0)
 	, m_extraNonce(0)
 	, m_rd{}
 	, m_rng(m_rd())
@@ -49,7 +84,6 @@ StratumServer::StratumServer(p2pool* pool)
 	, m_hashrateDataTail_24h(0)
 	, m_cumulativeFoundSharesDiff(0.0)
 	, m_totalFoundShares(0)
-	, m_apiLastUpdateTime(0)
 {
 	m_hashrateData[0] = { time(nullptr), 0 };
 
@@ -63,7 +97,7 @@ StratumServer::StratumServer(p2pool* pool)
 		m_submittedSharesPool[i] = new SubmittedShare{};
 	}
 
-	const int err = uv_async_init(&m_loop, &m_blobsAsync, on_blobs_ready);
+	int err = uv_async_init(&m_loop, &m_blobsAsync, on_blobs_ready);
 	if (err) {
 		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
 		return;
@@ -71,6 +105,22 @@ StratumServer::StratumServer(p2pool* pool)
 	m_blobsAsync.data = this;
 	m_blobsQueue.reserve(2);
 
+	for (size_t i = 1; i < m_loops.size(); ++i) {
+		LoopBlobsQueue* queue = new LoopBlobsQueue{};
+		queue->m_server = this;
+		queue->m_loop = m_loops[i];
+		uv_mutex_init_checked(&queue->m_lock);
+
+		err = uv_async_init(&queue->m_loop->m_loop, &queue->m_async, on_loop_blobs_ready);
+		if (err) {
+			LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
+			panic();
+		}
+		queue->m_async.data = queue;
+
+		m_loopBlobsQueues.push_back(queue);
+	}
+
 	start_listening(pool->params().m_stratumAddresses);
 }
 
@@ -78,8 +128,20 @@ StratumServer::~StratumServer()
 {
 	uv_close(reinterpret_cast<uv_handle_t*>(&m_blobsAsync), nullptr);
 
+	for (LoopBlobsQueue* queue : m_loopBlobsQueues) {
+		uv_close(reinterpret_cast<uv_handle_t*>(&queue->m_async), nullptr);
+	}
+
 	shutdown_tcp();
 
+	for (LoopBlobsQueue* queue : m_loopBlobsQueues) {
+		for (SharedBlobs* blobs : queue->m_queue) {
+			blobs->release();
+		}
+		uv_mutex_destroy(&queue->m_lock);
+		delete queue;
+	}
+
 	uv_mutex_destroy(&m_blobsQueueLock);
 	uv_mutex_destroy(&m_rngLock);
 	uv_mutex_destroy(&m_submittedSharesPoolLock);
@@ -110,33 +172,123 @@ void StratumServer::on_block(const BlockTemplate& block)
 	// Even if they do, they'll be added to the beginning of the list and will get their block template in on_login()
 	// We'll iterate through the list backwards so when we get to the beginning and run out of extra_nonce values, it'll be only new clients left
 	blobs_data->m_numClientsExpected = num_connections;
-	m_extraNonce.exchange(blobs_data->m_numClientsExpected);
 
-	blobs_data->m_blobSize = block.get_hashing_blobs(0, blobs_data->m_numClientsExpected, blobs_data->m_blobs, blobs_data->m_height, difficulty, sidechain_difficulty, blobs_data->m_seedHash, nonce_offset, blobs_data->m_templateId);
+	// Every group of m_groupSize clients shares one blob (and one extra_nonce value)
+	const uint32_t num_blobs = (num_connections + m_groupSize - 1) / m_groupSize;
+	m_extraNonce.exchange(num_blobs);
+
+	// Only the first chunk of blobs is made here, the rest are made in parallel in the background
+	// and sent by on_blobs_ready() as soon as they're done
+	blobs_data->m_extraNonceStart = 0;
+	blobs_data->m_numBlobs = std::min<uint32_t>(num_blobs, BLOBS_CHUNK_SIZE);
+
+	blobs_data->m_blobSize = block.get_hashing_blobs(0, blobs_data->m_numBlobs, blobs_data->m_blobs, blobs_data->m_height, difficulty, sidechain_difficulty, blobs_data->m_seedHash, nonce_offset, blobs_data->m_templateId);
+	blobs_data->m_target = std::max(difficulty.target(), sidechain_difficulty.target());
+	blobs_data->m_nonceOffset = nonce_offset;
+
+	if (!check_blobs(blobs_data)) {
+		delete blobs_data;
+		return;
+	}
+
+	// Copy everything but the blobs before the first chunk gets queued (on_blobs_ready() will delete it)
+	BlobsData chunk_template = *blobs_data;
+	chunk_template.m_blobs.clear();
+
+	queue_blobs(blobs_data);
+
+	for (uint32_t start = chunk_template.m_numBlobs; start < num_blobs; start += BLOBS_CHUNK_SIZE) {
+		BlobsData* chunk = new BlobsData(chunk_template);
+		chunk->m_extraNonceStart = start;
+		chunk->m_numBlobs = std::min<uint32_t>(num_blobs - start, BLOBS_CHUNK_SIZE);
+
+		struct Work
+		{
+			uv_work_t req;
+			StratumServer* server;
+			const BlockTemplate* block;
+			BlobsData* blobs;
+		};
+
+		Work* work = new Work{ {}, this, &block, chunk };
+		work->req.data = work;
+
+		bkg_jobs_tracker.queue("StratumServer::on_block");
+
+		const int err = uv_queue_work(uv_default_loop_checked(), &work->req,
+			[](uv_work_t* req)
+			{
+				bkg_jobs_tracker.start("StratumServer::on_block");
+
+				Work* work = reinterpret_cast<Work*>(req->data);
+				BlobsData* data = work->blobs;
+
+				const uint32_t blob_size = work->block->get_hashing_blobs(data->m_templateId, data->m_extraNonceStart, data->m_numBlobs, data->m_blobs);
+
+				// Block template was updated again before this chunk got its turn, a newer job will be sent anyway
+				if (blob_size == 0) {
+					LOGINFO(5, "template id " << data->m_templateId << " is not available anymore, dropping blobs " << data->m_extraNonceStart << " - " << data->m_extraNonceStart + data->m_numBlobs - 1);
+					return;
+				}
+
+				if (blob_size != data->m_blobSize) {
+					LOGERR(1, "internal error: get_hashing_blobs returned different blob size " << blob_size << ", expected " << data->m_blobSize);
+					return;
+				}
+
+				if (check_blobs(data)) {
+					work->server->queue_blobs(data);
+					work->blobs = nullptr;
+				}
+			},
+			[](uv_work_t* req, int /*status*/)
+			{
+				Work* work = reinterpret_cast<Work*>(req->data);
+				delete work->blobs;
+				delete work;
+				bkg_jobs_tracker.stop("StratumServer::on_block");
+			});
+
+		if (err) {
+			LOGERR(1, "on_block: uv_queue_work failed, error " << uv_err_name(err));
+			bkg_jobs_tracker.unqueue("StratumServer::on_block");
+			delete chunk;
+			delete work;
+		}
+	}
+}
+
+bool StratumServer::check_blobs(const BlobsData* blobs_data)
+{
+	const uint32_t num_blobs = blobs_data->m_numBlobs;
 
 	// Integrity checks
 	if (blobs_data->m_blobSize < 76) {
 		LOGERR(1, "internal error: get_hashing_blobs returned too small blobs (" << blobs_data->m_blobSize << " bytes)");
+		return false;
 	}
-	else if (blobs_data->m_blobs.size() != blobs_data->m_blobSize * num_connections) {
+
+	if (blobs_data->m_blobs.size() != blobs_data->m_blobSize * num_blobs) {
 		LOGERR(1, "internal error: get_hashing_blobs returned wrong amount of data");
+		return false;
 	}
-	else if (num_connections > 1) {
+
+	if (num_blobs > 1) {
 		std::vector<uint64_t> blob_hashes;
-		blob_hashes.reserve(num_connections);
+		blob_hashes.reserve(num_blobs);
 
 		const uint8_t* data = blobs_data->m_blobs.data();
 		const size_t size = blobs_data->m_blobSize;
 
 		// Get first 8 bytes of the Merkle root hash from each blob
-		for (size_t i = 0; i < num_connections; ++i) {
+		for (size_t i = 0; i < num_blobs; ++i) {
 			blob_hashes.emplace_back(*reinterpret_cast<const uint64_t*>(data + i * size + 43));
 		}
 
 		// Find duplicates
 		std::sort(blob_hashes.begin(), blob_hashes.end());
 
-		for (uint32_t i = 1; i < num_connections; ++i) {
+		for (uint32_t i = 1; i < num_blobs; ++i) {
 			if (blob_hashes[i - 1] == blob_hashes[i]) {
 				LOGERR(1, "internal error: get_hashing_blobs returned two identical blobs");
 				break;
@@ -144,7 +296,44 @@ void StratumServer::on_block(const BlockTemplate& block)
 		}
 	}
 
-	blobs_data->m_target = std::max(difficulty.target(), sidechain_difficulty.target());
+	return true;
+}
+
+void StratumServer::prepare_job_message(BlobsData* blobs_data) const
+{
+	const uint8_t* blobs = blobs_data->m_blobs.data();
+	const size_t blob_size = blobs_data->m_blobSize;
+
+	// Blobs differ only in the Merkle root and what follows it, find how many bytes they have in common
+	// When clients share blobs, the highest nonce byte is different for each of them so the common part ends before it
+	size_t prefix_size = (m_groupSize > 1) ? group_nonce_byte(blobs_data->m_nonceOffset) : blob_size;
+	for (uint32_t i = 1; (i < blobs_data->m_numBlobs) && (prefix_size > 0); ++i) {
+		const uint8_t* blob = blobs + i * blob_size;
+		size_t k = 0;
+		while ((k < prefix_size) && (blob[k] == blobs[k])) {
+			++k;
+		}
+		prefix_size = k;
+	}
+
+	blobs_data->m_blobPrefixSize = prefix_size;
+
+	char buf[log::Stream::BUF_SIZE + 1];
+	{
+		log::Stream s(buf);
+		s << "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":{\"blob\":\"" << log::hex_buf(blobs, prefix_size);
+		blobs_data->m_jobPrefix.assign(buf, s.m_pos);
+	}
+	{
+		log::Stream s(buf);
+		s << "\",\"algo\":\"rx/0\",\"height\":" << blobs_data->m_height << ",\"seed_hash\":\"" << blobs_data->m_seedHash << "\"}}\n";
+		blobs_data->m_jobSuffix.assign(buf, s.m_pos);
+	}
+}
+
+void StratumServer::queue_blobs(BlobsData* blobs_data)
+{
+	prepare_job_message(blobs_data);
 
 	{
 		MutexLock lock(m_blobsQueueLock);
@@ -244,17 +433,26 @@ bool StratumServer::on_login(StratumClient* client, uint32_t id, const char* log
 
 	if (get_custom_diff(login, client->m_customDiff)) {
 		LOGINFO(5, "client " << log::Gray() << static_cast<char*>(client->m_addrString) << " set custom difficulty " << client->m_customDiff);
-		target = std::max(target, client->m_customDiff.target());
 	}
 
-	if (get_custom_user(login, client->m_customUser)) {
-		LOGINFO(5, "client " << log::Gray() << static_cast<char*>(client->m_addrString) << " set custom user " << client->m_customUser);
+	init_vardiff(client);
+	target = client_target(client, target);
+
+	// New connections get their first shares verified, connections from addresses which sent bad shares get all of them verified
+	m_verifier.on_login(client->m_verify, client->m_addr);
+
+	// get_worker_stats() reads the user name from other threads
+	std::string custom_user;
+	if (get_custom_user(login, custom_user)) {
+		LOGINFO(5, "client " << log::Gray() << static_cast<char*>(client->m_addrString) << " set custom user " << log::JSONString(custom_user));
 	}
 
 	uint32_t job_id;
 	{
 		MutexLock lock(client->m_jobsLock);
 
+		client->m_customUser = std::move(custom_user);
+
 		job_id = client->m_perConnectionJobId++;
 
 		StratumClient::SavedJob& saved_job = client->m_jobs[job_id % array_size(&StratumClient::m_jobs)];
@@ -262,10 +460,15 @@ bool StratumServer::on_login(StratumClient* client, uint32_t id, const char* log
 		saved_job.extra_nonce = extra_nonce;
 		saved_job.template_id = template_id;
 		saved_job.target = target;
+		saved_job.nonce_mask = 0;
+		saved_job.nonce_fixed = 0;
 	}
 
+	// This client has its own extra_nonce until the next job, so it can use all nonce values
+	const bool nicehash = (m_groupSize > 1);
+
 	const bool result = send(client,
-		[client, id, &hashing_blob, job_id, blob_size, target, height, &seed_hash](void* buf)
+		[client, id, &hashing_blob, job_id, blob_size, target, height, &seed_hash, nicehash](void* buf)
 		{
 			do {
 				client->m_rpcId = static_cast<uint32_t>(static_cast<StratumServer*>(client->m_owner)->get_random64());
@@ -285,7 +488,7 @@ bool StratumServer::on_login(StratumClient* client, uint32_t id, const char* log
 			s << log::Hex(job_id) << "\",\"target\":\"";
 			s << target_hex << "\",\"algo\":\"rx/0\",\"height\":";
 			s << height << ",\"seed_hash\":\"";
-			s << seed_hash << "\"},\"extensions\":[\"algo\"],\"status\":\"OK\"}}\n";
+			s << seed_hash << "\"},\"extensions\":[\"algo\"" << (nicehash ? ",\"nicehash\"" : "") << "],\"status\":\"OK\"}}\n";
 			return s.m_pos;
 		});
 
@@ -329,6 +532,8 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 
 	uint32_t template_id = 0;
 	uint32_t extra_nonce = 0;
+	uint32_t nonce_mask = 0;
+	uint32_t nonce_fixed = 0;
 	uint64_t target = 0;
 
 	bool found = false;
@@ -339,12 +544,16 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 		if (saved_job.job_id == job_id) {
 			template_id = saved_job.template_id;
 			extra_nonce = saved_job.extra_nonce;
+			nonce_mask = saved_job.nonce_mask;
+			nonce_fixed = saved_job.nonce_fixed;
 			target = saved_job.target;
 			found = true;
 		}
 	}
 
 	if (found) {
+		update_vardiff(client, target);
+
 		BlockTemplate& block = m_pool->block_template();
 		difficulty_type mainchain_diff, sidechain_diff;
 
@@ -361,7 +570,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 
 		if (mainchain_diff.check_pow(resultHash)) {
 			const std::string& s = client->m_customUser;
-			LOGINFO(0, log::Green() << "client " << static_cast<char*>(client->m_addrString) << (!s.empty() ? " user " : "") << s << " found a mainchain block, submitting it");
+			LOGINFO(0, log::Green() << "client " << static_cast<char*>(client->m_addrString) << (!s.empty() ? " user " : "") << log::JSONString(s) << " found a mainchain block, submitting it");
 			m_pool->submit_block_async(template_id, nonce, extra_nonce);
 			block.update_tx_keys();
 		}
@@ -390,19 +599,27 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 		share->m_templateId = template_id;
 		share->m_nonce = nonce;
 		share->m_extraNonce = extra_nonce;
+		share->m_nonceMask = nonce_mask;
+		share->m_nonceFixed = nonce_fixed;
 		share->m_target = target;
+		share->m_hashes = 0;
 		share->m_resultHash = resultHash;
 		share->m_sidechainDifficulty = sidechain_diff;
+		share->m_verifyPoW = need_to_verify(client);
+		share->m_queueTime = metrics::now_us();
 
-		// If this share is below sidechain difficulty, process it in this thread because it'll be quick
-		if (!share->m_sidechainDifficulty.check_pow(share->m_resultHash)) {
+		// If this share is below sidechain difficulty and doesn't need to be verified, process it in this thread because it'll be quick
+		if (!share->m_verifyPoW && !share->m_sidechainDifficulty.check_pow(share->m_resultHash)) {
 			on_share_found(&share->m_req);
 			on_after_share_found(&share->m_req, 0);
 			return true;
 		}
 
 		// Else switch to a worker thread to check PoW which can take a long time
-		const int err = uv_queue_work(&m_loop, &share->m_req, on_share_found, on_after_share_found);
+		// The result is sent from the client's own event loop
+		bkg_jobs_tracker.queue("StratumServer::on_share_found");
+
+		const int err = uv_queue_work(&client->m_eventLoop->m_loop, &share->m_req, on_share_found, on_after_share_found);
 		if (err) {
 			LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
 
@@ -427,12 +644,99 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 	return result;
 }
 
+void StratumServer::init_vardiff(StratumClient* client) const
+{
+	if (!m_vardiffInterval) {
+		return;
+	}
+
+	// Custom difficulty from the login is the starting point
+	client->m_vardiff = client->m_customDiff.lo ? client->m_customDiff : difficulty_type(VARDIFF_START_DIFFICULTY, 0);
+	client->m_vardiffWindowStart = std::chrono::steady_clock::now();
+	client->m_vardiffHashes = 0;
+	client->m_vardiffShares = 0;
+}
+
+void StratumServer::update_vardiff(StratumClient* client, uint64_t share_target) const
+{
+	if (!m_vardiffInterval || !client->m_vardiff.lo) {
+		return;
+	}
+
+	using namespace std::chrono;
+
+	if (share_target) {
+		client->m_vardiffHashes += target_to_hashes(share_target);
+		++client->m_vardiffShares;
+	}
+
+	const steady_clock::time_point now = steady_clock::now();
+	const uint64_t elapsed_ms = static_cast<uint64_t>(duration_cast<milliseconds>(now - client->m_vardiffWindowStart).count());
+	const uint64_t interval_ms = m_vardiffInterval * 1000ULL;
+
+	if ((elapsed_ms == 0) || ((client->m_vardiffShares < VARDIFF_RETARGET_SHARES) && (elapsed_ms < interval_ms * VARDIFF_RETARGET_INTERVALS))) {
+		return;
+	}
+
+	// Difficulty which gives one share per interval at the hashrate measured in this window
+	uint64_t hi, rem;
+	const uint64_t lo = umul128(client->m_vardiffHashes, interval_ms, &hi);
+	uint64_t diff = (hi < elapsed_ms) ? udiv128(hi, lo, elapsed_ms, &rem) : std::numeric_limits<uint64_t>::max();
+
+	const uint64_t cur_diff = client->m_vardiff.lo;
+	const uint64_t max_diff = (cur_diff < std::numeric_limits<uint64_t>::max() / VARDIFF_MAX_STEP) ? (cur_diff * VARDIFF_MAX_STEP) : std::numeric_limits<uint64_t>::max();
+
+	diff = std::min(std::max(diff, cur_diff / VARDIFF_MAX_STEP), max_diff);
+	diff = std::max(diff, VARDIFF_MIN_DIFFICULTY);
+
+	if (diff != cur_diff) {
+		LOGINFO(6, "client " << static_cast<char*>(client->m_addrString) << " vardiff " << cur_diff << " -> " << diff << " (" << client->m_vardiffShares << " shares in " << elapsed_ms << " ms)");
+		client->m_vardiff = { diff, 0 };
+	}
+
+	client->m_vardiffWindowStart = now;
+	client->m_vardiffHashes = 0;
+	client->m_vardiffShares = 0;
+}
+
+uint64_t StratumServer::client_target(const StratumClient* client, uint64_t target) const
+{
+	// Clients never get a target harder than the template's, so they don't miss any sidechain shares
+	const difficulty_type& diff = m_vardiffInterval ? client->m_vardiff : client->m_customDiff;
+	return diff.lo ? std::max(target, diff.target()) : target;
+}
+
+bool StratumServer::need_to_verify(StratumClient* client)
+{
+	return m_verifier.need_to_verify(client->m_verify, [this]() { return get_random64(); });
+}
+
 uint64_t StratumServer::get_random64()
 {
 	MutexLock lock(m_rngLock);
 	return m_rng();
 }
 
+void StratumServer::print_queues()
+{
+	size_t blobs_queue_size;
+	{
+		MutexLock lock(m_blobsQueueLock);
+		blobs_queue_size = m_blobsQueue.size();
+	}
+
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream s(buf);
+
+	for (LoopBlobsQueue* queue : m_loopBlobsQueues) {
+		MutexLock lock(queue->m_lock);
+		s << ", loop " << queue->m_loop->m_index << ' ' << queue->m_queue.size();
+	}
+
+	LOGINFO(0, "blobs queue " << blobs_queue_size << log::const_buf(buf, s.m_pos));
+	TCPServer::print_queues();
+}
+
 void StratumServer::print_status()
 {
 	update_hashrate_data(0, time(nullptr));
@@ -485,10 +789,129 @@ void StratumServer::print_stratum_status() const
 		"\nShares found       = " << m_totalFoundShares <<
 		"\nAverage effort     = " << average_effort << '%' <<
 		"\nCurrent effort     = " << static_cast<double>(hashes_since_last_share) * 100.0 / m_pool->side_chain().difficulty().to_double() << '%' <<
-		"\nConnections        = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)"
+		"\nConnections        = " << m_numConnections.load() << " (" << m_numIncomingConnections.load() << " incoming)"
 	);
 }
 
+void StratumServer::WorkerHashrate::reset()
+{
+	m_bucketTimestamp = 0;
+	m_bucketHashes = 0;
+	m_totalHashes = 0;
+
+	for (std::atomic<double>& rate : m_rates) {
+		rate = 0.0;
+	}
+}
+
+void StratumServer::WorkerHashrate::add(uint64_t hashes, uint64_t timestamp)
+{
+	const uint64_t bucket_timestamp = m_bucketTimestamp.load(std::memory_order_relaxed);
+
+	if (timestamp != bucket_timestamp) {
+		const uint64_t bucket_hashes = m_bucketHashes.load(std::memory_order_relaxed);
+		const double dt = (timestamp > bucket_timestamp) ? static_cast<double>(timestamp - bucket_timestamp) : 0.0;
+
+		for (int i = 0; i < NUM_WINDOWS; ++i) {
+			const double T = WORKER_HASHRATE_WINDOWS[i];
+			const double rate = m_rates[i].load(std::memory_order_relaxed);
+			m_rates[i].store((rate + static_cast<double>(bucket_hashes) / T) * exp(-dt / T), std::memory_order_relaxed);
+		}
+
+		m_bucketHashes.store(0, std::memory_order_relaxed);
+		m_bucketTimestamp.store(timestamp, std::memory_order_relaxed);
+	}
+
+	m_bucketHashes.store(m_bucketHashes.load(std::memory_order_relaxed) + hashes, std::memory_order_relaxed);
+	m_totalHashes.store(m_totalHashes.load(std::memory_order_relaxed) + hashes, std::memory_order_relaxed);
+}
+
+void StratumServer::WorkerHashrate::get(uint64_t timestamp, double (&hashrate)[NUM_WINDOWS]) const
+{
+	// Same as add(0, timestamp) but without changing anything
+	const uint64_t bucket_timestamp = m_bucketTimestamp.load(std::memory_order_relaxed);
+	const uint64_t bucket_hashes = m_bucketHashes.load(std::memory_order_relaxed);
+	const double dt = (timestamp > bucket_timestamp) ? static_cast<double>(timestamp - bucket_timestamp) : 0.0;
+
+	for (int i = 0; i < NUM_WINDOWS; ++i) {
+		const double T = WORKER_HASHRATE_WINDOWS[i];
+		hashrate[i] = (m_rates[i].load(std::memory_order_relaxed) + static_cast<double>(bucket_hashes) / T) * exp(-dt / T);
+	}
+}
+
+void StratumServer::get_worker_stats(std::vector<WorkerStats>& stats) const
+{
+	stats.clear();
+
+	const uint64_t timestamp = time(nullptr);
+	unordered_map<std::string, size_t> workers;
+
+	for (EventLoop* loop : m_loops) {
+		MutexLock lock(loop->m_clientsListLock);
+
+		const Client* list = loop->m_connectedClientsList;
+		for (StratumClient* client = static_cast<StratumClient*>(list->m_next); client != list; client = static_cast<StratumClient*>(client->m_next)) {
+			if (!client->m_rpcId) {
+				continue;
+			}
+
+			std::string name;
+			{
+				MutexLock lock2(client->m_jobsLock);
+				name = client->m_customUser;
+			}
+
+			if (name.empty()) {
+				// Strip the port number
+				const char* addr = static_cast<const char*>(client->m_addrString);
+				const char* port = strrchr(addr, ':');
+				name.assign(addr, port ? static_cast<size_t>(port - addr) : strlen(addr));
+			}
+
+			auto it = workers.find(name);
+			if ((it == workers.end()) && (workers.size() >= MAX_WORKERS - 1)) {
+				name = "(other)";
+				it = workers.find(name);
+			}
+
+			if (it == workers.end()) {
+				it = workers.emplace(name, stats.size()).first;
+				stats.emplace_back(WorkerStats{ std::move(name), 0, 0, {} });
+			}
+
+			WorkerStats& worker = stats[it->second];
+
+			double hashrate[WorkerHashrate::NUM_WINDOWS];
+			client->m_hashrate.get(timestamp, hashrate);
+
+			++worker.m_connections;
+			worker.m_totalHashes += client->m_hashrate.m_totalHashes.load(std::memory_order_relaxed);
+			for (int i = 0; i < WorkerHashrate::NUM_WINDOWS; ++i) {
+				worker.m_hashrate[i] += hashrate[i];
+			}
+		}
+	}
+
+	std::sort(stats.begin(), stats.end(), [](const WorkerStats& a, const WorkerStats& b) { return a.m_hashrate[0] > b.m_hashrate[0]; });
+}
+
+void StratumServer::print_workers() const
+{
+	std::vector<WorkerStats> stats;
+	get_worker_stats(stats);
+
+	LOGINFO(0, stats.size() << " workers (hashrate 15m/1h/24h est)");
+
+	for (const WorkerStats& w : stats) {
+		// Custom user names come from miners, control characters in them must not get into the console and log
+		LOGINFO(0, log::JSONString(w.m_name) << ": " << w.m_connections << " connections, " <<
+			log::Hashrate(static_cast<uint64_t>(w.m_hashrate[0])) << " / " <<
+			log::Hashrate(static_cast<uint64_t>(w.m_hashrate[1])) << " / " <<
+			log::Hashrate(static_cast<uint64_t>(w.m_hashrate[2])) << ", " <<
+			w.m_totalHashes << " total hashes");
+	}
+}
+
 void StratumServer::on_blobs_ready()
 {
 	std::vector<BlobsData*> blobs_queue;
@@ -504,6 +927,8 @@ void StratumServer::on_blobs_ready()
 		return;
 	}
 
+	metrics::Timer timer(metrics::STRATUM_BLOBS_READY);
+
 	ON_SCOPE_LEAVE([&blobs_queue]()
 		{
 			for (BlobsData* data : blobs_queue) {
@@ -511,81 +936,195 @@ void StratumServer::on_blobs_ready()
 			}
 		});
 
-	// Only send the latest blob
-	BlobsData* data = blobs_queue.back();
+	// Only send the latest template: skip everything before its first chunk
+	size_t first = 0;
+	for (size_t i = 0, n = blobs_queue.size(); i < n; ++i) {
+		if (blobs_queue[i]->m_extraNonceStart == 0) {
+			first = i;
+		}
+	}
+
+	// Extra nonces must be unique across all event loops, so all clients lists are locked while they're assigned
+	if (blobs_queue[first]->m_extraNonceStart == 0) {
+		for (EventLoop* loop : m_loops) {
+			uv_mutex_lock(&loop->m_clientsListLock);
+		}
+
+		assign_extra_nonces(blobs_queue[first]);
+
+		for (EventLoop* loop : m_loops) {
+			uv_mutex_unlock(&loop->m_clientsListLock);
+		}
+	}
+
+	for (size_t i = first, n = blobs_queue.size(); i < n; ++i) {
+		BlobsData* data = blobs_queue[i];
+
+		// Chunks of older templates can still arrive from the background jobs
+		if (data->m_templateId != m_assignedTemplateId) {
+			continue;
+		}
+
+		// Other event loops send the same chunk to their own clients in parallel
+		SharedBlobs* shared = nullptr;
+		if (!m_loopBlobsQueues.empty()) {
+			shared = new SharedBlobs(data, static_cast<uint32_t>(m_loopBlobsQueues.size() + 1));
+			blobs_queue[i] = nullptr;
+
+			for (LoopBlobsQueue* queue : m_loopBlobsQueues) {
+				{
+					MutexLock lock(queue->m_lock);
+					queue->m_queue.push_back(shared);
+				}
+				uv_async_send(&queue->m_async);
+			}
+		}
+
+		{
+			MutexLock lock(m_clientsListLock);
+			send_blobs(m_loops[0], data);
+		}
+
+		if (shared) {
+			shared->release();
+		}
+	}
+}
+
+void StratumServer::on_loop_blobs_ready(LoopBlobsQueue* queue)
+{
+	std::vector<SharedBlobs*> blobs_queue;
 
-	size_t numClientsProcessed = 0;
-	uint32_t extra_nonce = 0;
 	{
-		MutexLock lock2(m_clientsListLock);
+		MutexLock lock(queue->m_lock);
+		blobs_queue.swap(queue->m_queue);
+	}
+
+	MutexLock lock(queue->m_loop->m_clientsListLock);
+
+	for (SharedBlobs* blobs : blobs_queue) {
+		send_blobs(queue->m_loop, blobs->m_data);
+		blobs->release();
+	}
+}
+
+void StratumServer::assign_extra_nonces(const BlobsData* data)
+{
+	size_t numClientsProcessed = 0;
+	uint32_t num_assigned = 0;
+
+	for (const EventLoop* loop : m_loops) {
+		Client* list = loop->m_connectedClientsList;
 
-		for (StratumClient* client = static_cast<StratumClient*>(m_connectedClientsList->m_prev); client != m_connectedClientsList; client = static_cast<StratumClient*>(client->m_prev)) {
+		for (StratumClient* client = static_cast<StratumClient*>(list->m_prev); client != list; client = static_cast<StratumClient*>(client->m_prev)) {
 			++numClientsProcessed;
 
+			client->m_pendingTemplateId = 0;
+
 			if (!client->m_rpcId) {
 				// Not logged in yet, on_login() will send the job to this client
 				continue;
 			}
 
-			if (extra_nonce >= data->m_numClientsExpected) {
+			if (num_assigned >= data->m_numClientsExpected) {
 				// We don't have any more extra_nonce values available
 				continue;
 			}
 
-			uint8_t* hashing_blob = data->m_blobs.data() + extra_nonce * data->m_blobSize;
+			client->m_pendingTemplateId = data->m_templateId;
+			client->m_pendingExtraNonce = num_assigned / m_groupSize;
+			client->m_pendingNonceSlot = num_assigned % m_groupSize;
+			++num_assigned;
+		}
+	}
 
-			uint64_t target = data->m_target;
-			if (client->m_customDiff.lo) {
-				target = std::max(target, client->m_customDiff.target());
-			}
+	const uint32_t num_connections = m_numConnections.load();
+	if (numClientsProcessed != num_connections) {
+		LOGWARN(1, "client list is broken, expected " << num_connections << ", got " << numClientsProcessed << " clients");
+	}
 
-			uint32_t job_id;
-			{
-				MutexLock lock3(client->m_jobsLock);
+	m_assignedTemplateId = data->m_templateId;
+}
 
-				job_id = client->m_perConnectionJobId++;
+void StratumServer::send_blobs(EventLoop* loop, const BlobsData* data)
+{
+	metrics::Timer timer(metrics::STRATUM_SEND_JOBS);
 
-				StratumClient::SavedJob& saved_job = client->m_jobs[job_id % array_size(&StratumClient::m_jobs)];
-				saved_job.job_id = job_id;
-				saved_job.extra_nonce = extra_nonce;
-				saved_job.template_id = data->m_templateId;
-				saved_job.target = target;
-			}
+	Client* list = loop->m_connectedClientsList;
 
-			const bool result = send(client,
-				[data, target, hashing_blob, &job_id](void* buf)
-				{
-					log::hex_buf target_hex(reinterpret_cast<const uint8_t*>(&target), sizeof(uint64_t));
+	const uint32_t extra_nonce_start = data->m_extraNonceStart;
+	const uint32_t extra_nonce_end = extra_nonce_start + data->m_numBlobs;
 
-					if (target >= TARGET_4_BYTES_LIMIT) {
-						target_hex.m_data += sizeof(uint32_t);
-						target_hex.m_size -= sizeof(uint32_t);
-					}
+	uint32_t num_sent = 0;
+	uint32_t num_clients = 0;
 
-					log::Stream s(reinterpret_cast<char*>(buf));
-					s << "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":{\"blob\":\"";
-					s << log::hex_buf(hashing_blob, data->m_blobSize) << "\",\"job_id\":\"";
-					s << log::Hex(job_id) << "\",\"target\":\"";
-					s << target_hex << "\",\"algo\":\"rx/0\",\"height\":";
-					s << data->m_height << ",\"seed_hash\":\"";
-					s << data->m_seedHash << "\"}}\n";
-					return s.m_pos;
-				});
+	for (StratumClient* client = static_cast<StratumClient*>(list->m_prev); client != list; client = static_cast<StratumClient*>(client->m_prev)) {
+		if (client->m_pendingTemplateId != data->m_templateId) {
+			continue;
+		}
 
-			if (result) {
-				++extra_nonce;
-			}
-			else {
-				client->close();
-			}
+		const uint32_t extra_nonce = client->m_pendingExtraNonce;
+		if ((extra_nonce < extra_nonce_start) || (extra_nonce >= extra_nonce_end)) {
+			continue;
 		}
 
-		if (numClientsProcessed != m_numConnections) {
-			LOGWARN(1, "client list is broken, expected " << m_numConnections << ", got " << numClientsProcessed << " clients");
+		client->m_pendingTemplateId = 0;
+		++num_clients;
+
+		const uint8_t* hashing_blob = data->m_blobs.data() + static_cast<size_t>(extra_nonce - extra_nonce_start) * data->m_blobSize;
+
+		const uint64_t target = client_target(client, data->m_target);
+		const uint8_t nonce_slot = static_cast<uint8_t>(client->m_pendingNonceSlot);
+
+		uint32_t job_id;
+		{
+			MutexLock lock3(client->m_jobsLock);
+
+			job_id = client->m_perConnectionJobId++;
+
+			StratumClient::SavedJob& saved_job = client->m_jobs[job_id % array_size(&StratumClient::m_jobs)];
+			saved_job.job_id = job_id;
+			saved_job.extra_nonce = extra_nonce;
+			saved_job.template_id = data->m_templateId;
+			saved_job.target = target;
+			saved_job.nonce_mask = group_nonce_mask(m_groupSize);
+			saved_job.nonce_fixed = group_nonce_fixed(nonce_slot);
+		}
+
+		const bool nicehash = (m_groupSize > 1);
+
+		const bool result = send(client,
+			[data, target, hashing_blob, &job_id, nicehash, nonce_slot](void* buf)
+			{
+				log::hex_buf target_hex(reinterpret_cast<const uint8_t*>(&target), sizeof(uint64_t));
+
+				if (target >= TARGET_4_BYTES_LIMIT) {
+					target_hex.m_data += sizeof(uint32_t);
+					target_hex.m_size -= sizeof(uint32_t);
+				}
+
+				log::Stream s(reinterpret_cast<char*>(buf));
+				s << log::const_buf(data->m_jobPrefix.c_str(), data->m_jobPrefix.length());
+
+				// prepare_job_message() made sure the prefix ends at or before the highest nonce byte
+				write_job_blob(s, hashing_blob, data->m_blobSize, data->m_blobPrefixSize, data->m_nonceOffset, nicehash, nonce_slot);
+
+				s << "\",\"job_id\":\"" << log::Hex(job_id) << "\",\"target\":\"";
+				s << target_hex << log::const_buf(data->m_jobSuffix.c_str(), data->m_jobSuffix.length());
+				return s.m_pos;
+			});
+
+		if (result) {
+			++num_sent;
+		}
+		else {
+			client->close();
 		}
 	}
 
-	LOGINFO(3, "sent new job to " << extra_nonce << '/' << numClientsProcessed << " clients");
+	metrics::add(metrics::STRATUM_JOBS_SENT, num_sent);
+
+	LOGINFO(3, "sent new job to " << num_sent << '/' << num_clients << " clients (extra_nonce " << extra_nonce_start << " - " << extra_nonce_end - 1 << ')');
 }
 
 void StratumServer::update_hashrate_data(uint64_t hashes, time_t timestamp)
@@ -624,6 +1163,9 @@ void StratumServer::on_share_found(uv_work_t* req)
 	bkg_jobs_tracker.start("StratumServer::on_share_found");
 
 	SubmittedShare* share = reinterpret_cast<SubmittedShare*>(req->data);
+
+	metrics::observe(metrics::SHARE_QUEUE_WAIT, metrics::now_us() - share->m_queueTime);
+	metrics::Timer timer(metrics::SHARE_CHECK);
 	StratumClient* client = share->m_client;
 	StratumServer* server = share->m_server;
 	p2pool* pool = server->m_pool;
@@ -633,18 +1175,29 @@ void StratumServer::on_share_found(uv_work_t* req)
 		target = (target >> 32) << 32;
 	}
 
-	uint64_t rem;
-	const uint64_t hashes = (target > 1) ? udiv128(1, 0, target, &rem) : 0;
+	const uint64_t hashes = target_to_hashes(target);
+	share->m_hashes = hashes;
+
+	// Clients sharing a blob would find the same shares if they went outside of their nonce ranges
+	if (!nonce_in_range(share->m_nonce, share->m_nonceMask, share->m_nonceFixed)) {
+		LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " submitted a share with nonce outside of its range");
+		share->m_result = SubmittedShare::Result::INVALID_NONCE;
+		return;
+	}
 
 	if (pool->stopped()) {
 		LOGWARN(0, "p2pool is shutting down, but a share was found. Trying to process it anyway!");
 	}
 
-	if (share->m_sidechainDifficulty.check_pow(share->m_resultHash)) {
+	const bool sidechain_share = share->m_sidechainDifficulty.check_pow(share->m_resultHash);
+
+	uint64_t height = 0;
+	difficulty_type sidechain_difficulty;
+
+	// PoW of sidechain shares is always checked, other shares are checked only if on_submit() picked them for verification
+	if (sidechain_share || share->m_verifyPoW) {
 		uint8_t blob[128];
-		uint64_t height;
 		difficulty_type difficulty;
-		difficulty_type sidechain_difficulty;
 		hash seed_hash;
 		size_t nonce_offset;
 
@@ -655,10 +1208,7 @@ void StratumServer::on_share_found(uv_work_t* req)
 			return;
 		}
 
-		for (uint32_t i = 0, nonce = share->m_nonce; i < sizeof(share->m_nonce); ++i) {
-			blob[nonce_offset + i] = nonce & 255;
-			nonce >>= 8;
-		}
+		write_nonce(blob, nonce_offset, share->m_nonce);
 
 		hash pow_hash;
 		if (!pool->calculate_hash(blob, blob_size, seed_hash, pow_hash)) {
@@ -672,7 +1222,9 @@ void StratumServer::on_share_found(uv_work_t* req)
 			share->m_result = SubmittedShare::Result::INVALID_POW;
 			return;
 		}
+	}
 
+	if (sidechain_share) {
 		const uint64_t n = server->m_cumulativeHashes + hashes;
 		const double diff = sidechain_difficulty.to_double();
 		const double effort = static_cast<double>(n - server->m_cumulativeHashesAtLastShare) * 100.0 / diff;
@@ -682,7 +1234,7 @@ void StratumServer::on_share_found(uv_work_t* req)
 		++server->m_totalFoundShares;
 
 		const std::string& s = client->m_customUser;
-		LOGINFO(0, log::Green() << "SHARE FOUND: mainchain height " << height << ", diff " << sidechain_difficulty << ", client " << static_cast<char*>(client->m_addrString) << (!s.empty() ? " user " : "") << s << ", effort " << effort << '%');
+		LOGINFO(0, log::Green() << "SHARE FOUND: mainchain height " << height << ", diff " << sidechain_difficulty << ", client " << static_cast<char*>(client->m_addrString) << (!s.empty() ? " user " : "") << log::JSONString(s) << ", effort " << effort << '%');
 		pool->submit_sidechain_block(share->m_templateId, share->m_nonce, share->m_extraNonce);
 	}
 
@@ -692,7 +1244,7 @@ void StratumServer::on_share_found(uv_work_t* req)
 	if (LIKELY(value < target)) {
 		const time_t timestamp = time(nullptr);
 		server->update_hashrate_data(hashes, timestamp);
-		server->api_update_local_stats(timestamp);
+		pool->api_set_dirty(p2pool::API_LOCAL_STATS);
 		share->m_result = SubmittedShare::Result::OK;
 	}
 	else {
@@ -720,7 +1272,22 @@ void StratumServer::on_after_share_found(uv_work_t* req, int /*status*/)
 
 	const bool bad_share = (share->m_result == SubmittedShare::Result::LOW_DIFF) || (share->m_result == SubmittedShare::Result::INVALID_POW);
 
+	// Shares which couldn't be checked are not a reason to ban, but the client's next shares are all checked
+	const bool suspect_share = bad_share || (share->m_result == SubmittedShare::Result::COULDNT_CHECK_POW);
+
+	metrics::add((share->m_result == SubmittedShare::Result::OK) ? metrics::STRATUM_SHARES_ACCEPTED : metrics::STRATUM_SHARES_REJECTED);
+
 	if ((client->m_resetCounter.load() == share->m_clientResetCounter) && (client->m_rpcId == share->m_rpcId)) {
+		if (share->m_result == SubmittedShare::Result::OK) {
+			client->m_hashrate.add(share->m_hashes, time(nullptr));
+			if (share->m_verifyPoW) {
+				server->m_verifier.on_good_share(client->m_verify, client->m_addr);
+			}
+		}
+		else if (suspect_share) {
+			server->m_verifier.on_bad_share(client->m_verify, client->m_addr);
+		}
+
 		const bool result = server->send(client,
 			[share](void* buf)
 			{
@@ -738,6 +1305,9 @@ void StratumServer::on_after_share_found(uv_work_t* req, int /*status*/)
 				case SubmittedShare::Result::INVALID_POW:
 					s << "{\"id\":" << share->m_id << ",\"jsonrpc\":\"2.0\",\"error\":{\"message\":\"Invalid PoW\"}}\n";
 					break;
+				case SubmittedShare::Result::INVALID_NONCE:
+					s << "{\"id\":" << share->m_id << ",\"jsonrpc\":\"2.0\",\"error\":{\"message\":\"Nonce out of range\"}}\n";
+					break;
 				case SubmittedShare::Result::OK:
 					s << "{\"id\":" << share->m_id << ",\"jsonrpc\":\"2.0\",\"error\":null,\"result\":{\"status\":\"OK\"}}\n";
 					break;
@@ -753,8 +1323,11 @@ void StratumServer::on_after_share_found(uv_work_t* req, int /*status*/)
 			client->close();
 		}
 	}
-	else if (bad_share) {
-		server->ban(share->m_clientAddr, DEFAULT_BAN_TIME);
+	else if (suspect_share) {
+		server->m_verifier.on_bad_share(share->m_clientAddr);
+		if (bad_share) {
+			server->ban(share->m_clientAddr, DEFAULT_BAN_TIME);
+		}
 	}
 }
 
@@ -763,8 +1336,16 @@ StratumServer::StratumClient::StratumClient()
 	, m_jobs{}
 	, m_perConnectionJobId(0)
 	, m_customDiff{}
+	, m_pendingTemplateId(0)
+	, m_pendingExtraNonce(0)
+	, m_pendingNonceSlot(0)
+	, m_vardiff{}
+	, m_vardiffHashes(0)
+	, m_vardiffShares(0)
+	, m_verify{}
 {
 	uv_mutex_init_checked(&m_jobsLock);
+	m_hashrate.reset();
 }
 
 StratumServer::StratumClient::~StratumClient()
@@ -780,11 +1361,20 @@ void StratumServer::StratumClient::reset()
 	m_perConnectionJobId = 0;
 	m_customDiff = {};
 	m_customUser.clear();
+	m_pendingTemplateId = 0;
+	m_pendingExtraNonce = 0;
+	m_pendingNonceSlot = 0;
+	m_vardiff = {};
+	m_vardiffWindowStart = {};
+	m_vardiffHashes = 0;
+	m_vardiffShares = 0;
+	m_verify = {};
+	m_hashrate.reset();
 }
 
 bool StratumServer::StratumClient::on_read(char* data, uint32_t size)
 {
-	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + m_readBufSize)) {
 		LOGERR(1, "client: invalid data pointer or size in on_read()");
 		ban(DEFAULT_BAN_TIME);
 		return false;
@@ -815,8 +1405,207 @@ bool StratumServer::StratumClient::on_read(char* data, uint32_t size)
 	return true;
 }
 
+// Minimal parser for flat JSON requests like {"id":1,"method":"submit","params":{"job_id":"...",...}}
+// Values can only be unsigned integers, strings without escape sequences, and one level of nested "params" object
+// It doesn't modify the data while parsing, so anything it can't parse is simply given to rapidjson instead
+static FORCEINLINE const char* fast_json_skip_ws(const char* p)
+{
+	while ((*p == ' ') || (*p == '\t') || (*p == '\r')) {
+		++p;
+	}
+	return p;
+}
+
+static FORCEINLINE bool fast_json_string(const char*& p, const char*& s, uint32_t& len)
+{
+	s = ++p;
+	while (*p != '"') {
+		// Also stops at the terminating '\0'
+		if ((*p == '\\') || (static_cast<uint8_t>(*p) < 0x20)) {
+			return false;
+		}
+		++p;
+	}
+	len = static_cast<uint32_t>(p - s);
+	++p;
+	return true;
+}
+
+template<typename T>
+static bool fast_json_object(const char*& p, uint32_t depth, T& callback)
+{
+	p = fast_json_skip_ws(p + 1);
+	if (*p == '}') {
+		++p;
+		return true;
+	}
+
+	for (;;) {
+		const char* key;
+		uint32_t key_len;
+		if ((*p != '"') || !fast_json_string(p, key, key_len)) {
+			return false;
+		}
+
+		p = fast_json_skip_ws(p);
+		if (*p != ':') {
+			return false;
+		}
+		p = fast_json_skip_ws(p + 1);
+
+		if (*p == '"') {
+			const char* value;
+			uint32_t value_len;
+			if (!fast_json_string(p, value, value_len) || !callback(depth, key, key_len, value, value_len, true)) {
+				return false;
+			}
+		}
+		else if ((*p >= '0') && (*p <= '9')) {
+			const char* value = p;
+			do { ++p; } while ((*p >= '0') && (*p <= '9'));
+			if (!callback(depth, key, key_len, value, static_cast<uint32_t>(p - value), false)) {
+				return false;
+			}
+		}
+		else if ((*p == '{') && (depth == 0) && (key_len == 6) && (memcmp(key, "params", 6) == 0)) {
+			if (!fast_json_object(p, depth + 1, callback)) {
+				return false;
+			}
+		}
+		else {
+			return false;
+		}
+
+		p = fast_json_skip_ws(p);
+		if (*p == ',') {
+			p = fast_json_skip_ws(p + 1);
+		}
+		else if (*p == '}') {
+			++p;
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+}
+
+template<typename T>
+static bool fast_json_parse(const char* data, T&& callback)
+{
+	const char* p = fast_json_skip_ws(data);
+	if ((*p != '{') || !fast_json_object(p, 0, callback)) {
+		return false;
+	}
+	return *fast_json_skip_ws(p) == '\0';
+}
+
+static FORCEINLINE bool fast_json_key(const char* key, uint32_t key_len, const char* name, uint32_t name_len)
+{
+	return (key_len == name_len) && (memcmp(key, name, name_len) == 0);
+}
+
+bool StratumServer::StratumClient::process_fast_request(char* data, bool& request_result)
+{
+	struct Field
+	{
+		const char* m_value;
+		uint32_t m_len;
+		bool m_isString;
+	};
+
+	Field id{}, method{}, rpc_id{}, job_id{}, nonce{}, result{};
+
+	const bool parsed = fast_json_parse(data,
+		[&](uint32_t depth, const char* key, uint32_t key_len, const char* value, uint32_t value_len, bool is_string)
+		{
+			Field* field = nullptr;
+
+			if (depth == 0) {
+				if (fast_json_key(key, key_len, "id", 2)) {
+					field = &id;
+				}
+				else if (fast_json_key(key, key_len, "method", 6)) {
+					field = &method;
+				}
+			}
+			else {
+				if (fast_json_key(key, key_len, "id", 2)) {
+					field = &rpc_id;
+				}
+				else if (fast_json_key(key, key_len, "job_id", 6)) {
+					field = &job_id;
+				}
+				else if (fast_json_key(key, key_len, "nonce", 5)) {
+					field = &nonce;
+				}
+				else if (fast_json_key(key, key_len, "result", 6)) {
+					field = &result;
+				}
+			}
+
+			// Leave duplicate keys to rapidjson
+			if (field) {
+				if (field->m_value) {
+					return false;
+				}
+				*field = { value, value_len, is_string };
+			}
+			return true;
+		});
+
+	if (!parsed || !id.m_value || id.m_isString || !method.m_value || !method.m_isString) {
+		return false;
+	}
+
+	// Must fit in uint32_t and have no leading zeros, same as rapidjson's IsUint()
+	if ((id.m_len > 10) || ((id.m_len > 1) && (id.m_value[0] == '0'))) {
+		return false;
+	}
+
+	uint64_t id_value = 0;
+	for (uint32_t i = 0; i < id.m_len; ++i) {
+		id_value = id_value * 10 + static_cast<uint32_t>(id.m_value[i] - '0');
+	}
+
+	if (id_value > std::numeric_limits<uint32_t>::max()) {
+		return false;
+	}
+
+	if (fast_json_key(method.m_value, method.m_len, "submit", 6)) {
+		// Invalid submits go through rapidjson which reports what exactly is wrong with them
+		if (!rpc_id.m_isString || !job_id.m_isString || !nonce.m_isString || !result.m_isString ||
+			(nonce.m_len != sizeof(uint32_t) * 2) || (result.m_len != HASH_SIZE * 2)) {
+			return false;
+		}
+
+		// Terminate the strings in place, the rest of the request is not needed anymore
+		const_cast<char*>(job_id.m_value)[job_id.m_len] = '\0';
+		const_cast<char*>(nonce.m_value)[nonce.m_len] = '\0';
+		const_cast<char*>(result.m_value)[result.m_len] = '\0';
+
+		LOGINFO(6, "incoming share from " << log::Gray() << static_cast<char*>(m_addrString));
+		request_result = static_cast<StratumServer*>(m_owner)->on_submit(this, static_cast<uint32_t>(id_value), job_id.m_value, nonce.m_value, result.m_value);
+		return true;
+	}
+
+	if (fast_json_key(method.m_value, method.m_len, "keepalived", 10)) {
+		LOGINFO(6, "incoming keepalive from " << log::Gray() << static_cast<char*>(m_addrString));
+		request_result = true;
+		return true;
+	}
+
+	return false;
+}
+
 bool StratumServer::StratumClient::process_request(char* data, uint32_t /*size*/)
 {
+	// Submits and keepalives are by far the most frequent requests, they don't need a DOM
+	bool result;
+	if (process_fast_request(data, result)) {
+		return result;
+	}
+
 	rapidjson::Document doc;
 	if (doc.ParseInsitu(data).HasParseError()) {
 		LOGWARN(4, "client " << static_cast<char*>(m_addrString) << " invalid JSON request (parse error)");
@@ -968,19 +1757,12 @@ bool StratumServer::StratumClient::process_submit(rapidjson::Document& doc, uint
 	return static_cast<StratumServer*>(m_owner)->on_submit(this, id, job_id.GetString(), nonce.GetString(), result.GetString());
 }
 
-void StratumServer::api_update_local_stats(time_t timestamp)
+void StratumServer::api_update_local_stats()
 {
 	if (!m_pool->api() || !m_pool->params().m_localStats) {
 		return;
 	}
 
-	// Rate limit to no more than once in 60 seconds.
-	if (timestamp < m_apiLastUpdateTime + 60) {
-		return;
-	}
-
-	m_apiLastUpdateTime = timestamp;
-
 	uint64_t hashes_15m, hashes_1h, hashes_24h, total_hashes;
 	int64_t dt_15m, dt_1h, dt_24h;
 
@@ -1038,6 +1820,33 @@ void StratumServer::api_update_local_stats(time_t timestamp)
 				<< ",\"incoming_connections\":" << incoming_connections
 				<< "}";
 		});
+
+	std::vector<WorkerStats> workers;
+	get_worker_stats(workers);
+
+	if (workers.size() > API_MAX_WORKERS) {
+		workers.resize(API_MAX_WORKERS);
+	}
+
+	m_pool->api()->set(p2pool_api::Category::LOCAL, "workers",
+		[&workers](log::Stream& s)
+		{
+			s << '[';
+			for (size_t i = 0, n = workers.size(); i < n; ++i) {
+				const WorkerStats& w = workers[i];
+				if (i > 0) {
+					s << ',';
+				}
+				s << "{\"name\":\"" << log::JSONString(w.m_name)
+					<< "\",\"connections\":" << w.m_connections
+					<< ",\"hashrate_15m\":" << static_cast<uint64_t>(w.m_hashrate[0])
+					<< ",\"hashrate_1h\":" << static_cast<uint64_t>(w.m_hashrate[1])
+					<< ",\"hashrate_24h\":" << static_cast<uint64_t>(w.m_hashrate[2])
+					<< ",\"total_hashes\":" << w.m_totalHashes
+					<< '}';
+			}
+			s << ']';
+		});
 }
 
 } // namespace p2pool
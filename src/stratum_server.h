@@ -18,6 +18,7 @@
 #pragma once
 
 #include "tcp_server.h"
+#include "share_verifier.h"
 #include <rapidjson/document.h>
 #include <random>
 
@@ -37,6 +38,24 @@ public:
 
 	void on_block(const BlockTemplate& block);
 
+	// Hashrate of one connection as exponentially decaying averages over 15 minutes, 1 hour and 24 hours
+	// Only the connection's event loop updates it, readers don't take any locks
+	struct WorkerHashrate
+	{
+		enum { NUM_WINDOWS = 3 };
+
+		void reset();
+		void add(uint64_t hashes, uint64_t timestamp);
+		void get(uint64_t timestamp, double (&hashrate)[NUM_WINDOWS]) const;
+
+		// Hashes submitted during the current second, they're folded into the averages when the next second starts
+		std::atomic<uint64_t> m_bucketTimestamp;
+		std::atomic<uint64_t> m_bucketHashes;
+
+		std::atomic<uint64_t> m_totalHashes;
+		std::atomic<double> m_rates[NUM_WINDOWS];
+	};
+
 	struct StratumClient : public Client
 	{
 		StratumClient();
@@ -49,6 +68,7 @@ public:
 		bool on_read(char* data, uint32_t size) override;
 
 		bool process_request(char* data, uint32_t size);
+		bool process_fast_request(char* data, bool& request_result);
 		bool process_login(rapidjson::Document& doc, uint32_t id);
 		bool process_submit(rapidjson::Document& doc, uint32_t id);
 
@@ -61,18 +81,86 @@ public:
 			uint32_t extra_nonce;
 			uint32_t template_id;
 			uint64_t target;
+			uint32_t nonce_mask;
+			uint32_t nonce_fixed;
 		} m_jobs[4];
 
 		uint32_t m_perConnectionJobId;
 		difficulty_type m_customDiff;
 		std::string m_customUser;
+
+		// Job (template id and extra_nonce) assigned in on_blobs_ready() and not sent yet, accessed only with the client's event loop clients list locked
+		uint32_t m_pendingTemplateId;
+		uint32_t m_pendingExtraNonce;
+		uint32_t m_pendingNonceSlot;
+
+		// Automatic difficulty and the shares it was measured on, accessed only from the client's event loop
+		difficulty_type m_vardiff;
+		std::chrono::steady_clock::time_point m_vardiffWindowStart;
+		uint64_t m_vardiffHashes;
+		uint32_t m_vardiffShares;
+
+		ShareVerifier::ClientState m_verify;
+
+		WorkerHashrate m_hashrate;
+	};
+
+	// Workers are identified by custom user name if it's set, or by IP address otherwise
+	struct WorkerStats
+	{
+		std::string m_name;
+		uint32_t m_connections;
+		uint64_t m_totalHashes;
+		double m_hashrate[WorkerHashrate::NUM_WINDOWS];
 	};
 
+	// Clients sharing a hashing blob (NiceHash-style groups) only iterate the lower 3 bytes of the nonce,
+	// the highest byte is fixed to the client's slot in the group
+	static constexpr uint32_t GROUP_NONCE_SHIFT = 24;
+	static constexpr uint32_t GROUP_NONCE_MASK = 0xFF000000U;
+
+	static FORCEINLINE uint32_t group_nonce_mask(uint32_t group_size) { return (group_size > 1) ? GROUP_NONCE_MASK : 0; }
+	static FORCEINLINE uint32_t group_nonce_fixed(uint32_t nonce_slot) { return nonce_slot << GROUP_NONCE_SHIFT; }
+	static FORCEINLINE bool nonce_in_range(uint32_t nonce, uint32_t nonce_mask, uint32_t nonce_fixed) { return (nonce & nonce_mask) == nonce_fixed; }
+
+	// The nonce is little-endian in the hashing blob, so its highest byte is the last one
+	static FORCEINLINE size_t group_nonce_byte(size_t nonce_offset) { return nonce_offset + sizeof(uint32_t) - 1; }
+
+	static FORCEINLINE void write_nonce(uint8_t* blob, size_t nonce_offset, uint32_t nonce)
+	{
+		for (size_t i = 0; i < sizeof(nonce); ++i) {
+			blob[nonce_offset + i] = nonce & 255;
+			nonce >>= 8;
+		}
+	}
+
+	// Hex of the hashing blob starting at prefix_size, as it's sent in a job message
+	// Clients in a group get the highest nonce byte set to their slot, prefix_size must not go past that byte then
+	static FORCEINLINE void write_job_blob(log::Stream& s, const uint8_t* hashing_blob, size_t blob_size, size_t prefix_size, size_t nonce_offset, bool nicehash, uint8_t nonce_slot)
+	{
+		if (nicehash) {
+			const size_t k = group_nonce_byte(nonce_offset);
+			s << log::hex_buf(hashing_blob + prefix_size, k - prefix_size) << log::hex_buf(&nonce_slot, 1);
+			s << log::hex_buf(hashing_blob + k + 1, blob_size - k - 1);
+		}
+		else {
+			s << log::hex_buf(hashing_blob + prefix_size, blob_size - prefix_size);
+		}
+	}
+
+	// Sums up hashrates of all connections for each worker, sorted by 15 minutes hashrate
+	void get_worker_stats(std::vector<WorkerStats>& stats) const;
+	void print_workers() const;
+
 	bool on_login(StratumClient* client, uint32_t id, const char* login);
 	bool on_submit(StratumClient* client, uint32_t id, const char* job_id_str, const char* nonce_str, const char* result_str);
 	uint64_t get_random64();
 
 	void print_status() override;
+	void print_queues() override;
+
+	// Called by the API update timer in the main event loop, never from share validation threads
+	void api_update_local_stats();
 
 private:
 	void print_stratum_status() const;
@@ -85,15 +173,43 @@ private:
 
 	p2pool* m_pool;
 
+	// Target time between shares in seconds for automatic difficulty, 0 if it's disabled
+	uint32_t m_vardiffInterval;
+
+	// Number of clients sharing one hashing blob, each of them gets its own value of the highest nonce byte (NiceHash-style)
+	uint32_t m_groupSize;
+
+	// Percentage of shares below sidechain difficulty which get their PoW checked, it's set for every client separately
+	ShareVerifier m_verifier;
+
+	bool need_to_verify(StratumClient* client);
+
+	void init_vardiff(StratumClient* client) const;
+	void update_vardiff(StratumClient* client, uint64_t share_target) const;
+	uint64_t client_target(const StratumClient* client, uint64_t target) const;
+
+	// Hashing blobs for extra_nonce values [m_extraNonceStart, m_extraNonceStart + m_numBlobs)
+	// Large numbers of clients get their blobs in chunks made in parallel
+	enum { BLOBS_CHUNK_SIZE = 512 };
+
 	struct BlobsData
 	{
 		std::vector<uint8_t> m_blobs;
 		size_t m_blobSize;
 		uint64_t m_target;
+		uint32_t m_extraNonceStart;
+		uint32_t m_numBlobs;
 		uint32_t m_numClientsExpected;
 		uint32_t m_templateId;
 		uint64_t m_height;
 		hash m_seedHash;
+		size_t m_nonceOffset;
+
+		// Parts of the job message that are the same for all clients of this chunk, made in queue_blobs()
+		// Only the rest of the blob (starting at m_blobPrefixSize), job_id and target are written for each client
+		size_t m_blobPrefixSize;
+		std::string m_jobPrefix;
+		std::string m_jobSuffix;
 	};
 
 	uv_mutex_t m_blobsQueueLock;
@@ -103,6 +219,40 @@ private:
 	static void on_blobs_ready(uv_async_t* handle) { reinterpret_cast<StratumServer*>(handle->data)->on_blobs_ready(); }
 	void on_blobs_ready();
 
+	// Chunk of blobs sent by several event loops, the last one to finish with it deletes it
+	struct SharedBlobs : public nocopy_nomove
+	{
+		FORCEINLINE SharedBlobs(BlobsData* data, uint32_t ref_count) : m_data(data), m_refCount(ref_count) {}
+		FORCEINLINE void release() { if (--m_refCount == 0) { delete m_data; delete this; } }
+
+		BlobsData* m_data;
+		std::atomic<uint32_t> m_refCount;
+	};
+
+	// Blobs waiting to be sent by one of the additional event loops
+	struct LoopBlobsQueue
+	{
+		StratumServer* m_server;
+		EventLoop* m_loop;
+		uv_async_t m_async;
+		uv_mutex_t m_lock;
+		std::vector<SharedBlobs*> m_queue;
+	};
+
+	// One queue for each event loop except the main one
+	std::vector<LoopBlobsQueue*> m_loopBlobsQueues;
+
+	static void on_loop_blobs_ready(uv_async_t* handle) { LoopBlobsQueue* queue = reinterpret_cast<LoopBlobsQueue*>(handle->data); queue->m_server->on_loop_blobs_ready(queue); }
+	void on_loop_blobs_ready(LoopBlobsQueue* queue);
+
+	static bool check_blobs(const BlobsData* blobs_data);
+	void prepare_job_message(BlobsData* blobs_data) const;
+	void queue_blobs(BlobsData* blobs_data);
+	void assign_extra_nonces(const BlobsData* data);
+	void send_blobs(EventLoop* loop, const BlobsData* data);
+
+	uint32_t m_assignedTemplateId;
+
 	std::atomic<uint32_t> m_extraNonce;
 
 	uv_mutex_t m_rngLock;
@@ -121,15 +271,26 @@ private:
 		uint32_t m_templateId;
 		uint32_t m_nonce;
 		uint32_t m_extraNonce;
+		uint32_t m_nonceMask;
+		uint32_t m_nonceFixed;
 		uint64_t m_target;
+
+		// Set by on_share_found(), the same number goes to the pool and the worker hashrate
+		uint64_t m_hashes;
+
 		hash m_resultHash;
 		difficulty_type m_sidechainDifficulty;
+		bool m_verifyPoW;
+
+		// When the share was queued for checking, to measure the time it waited for a worker thread
+		uint64_t m_queueTime;
 
 		enum class Result {
 			STALE,
 			COULDNT_CHECK_POW,
 			LOW_DIFF,
 			INVALID_POW,
+			INVALID_NONCE,
 			OK
 		} m_result;
 	};
@@ -156,10 +317,7 @@ private:
 	double m_cumulativeFoundSharesDiff;
 	uint32_t m_totalFoundShares;
 
-	time_t m_apiLastUpdateTime;
-
 	void update_hashrate_data(uint64_t hashes, time_t timestamp);
-	void api_update_local_stats(time_t timestamp);
 };
 
 } // namespace p2pool
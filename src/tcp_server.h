@@ -18,6 +18,7 @@
 #pragma once
 
 #include "uv_util.h"
+#include "memory_leak_debug.h"
 
 namespace p2pool {
 
@@ -26,9 +27,10 @@ class TCPServer : public nocopy_nomove
 {
 public:
 	struct Client;
+	struct EventLoop;
 	typedef Client* (*allocate_client_callback)();
 
-	explicit TCPServer(allocate_client_callback allocate_new_client);
+	explicit TCPServer(allocate_client_callback allocate_new_client, uint32_t num_loops = 1);
 	virtual ~TCPServer();
 
 	template<typename T>
@@ -36,11 +38,16 @@ public:
 
 	bool connect_to_peer(bool is_v6, const char* ip, int port);
 
-	void drop_connections() { uv_async_send(&m_dropConnectionsAsync); }
+	void drop_connections();
 	void shutdown_tcp();
 	virtual void print_status();
 
+	// Queue lengths and buffer pools occupancy of every event loop
+	virtual void print_queues();
+
 	uv_loop_t* get_loop() { return &m_loop; }
+	uint32_t num_loops() const { return static_cast<uint32_t>(m_loops.size()); }
+	uint32_t num_connections() const { return m_numConnections; }
 
 	int listen_port() const { return m_listenPort; }
 
@@ -49,6 +56,12 @@ public:
 
 	void ban(const raw_ip& ip, uint64_t seconds);
 
+	// Connections start with a small inline read buffer and switch to a pooled READ_BUF_SIZE buffer only while a large message is being assembled
+	static constexpr size_t READ_BUF_SMALL_SIZE = (READ_BUF_SIZE < 4096) ? READ_BUF_SIZE : 4096;
+
+	// Free large read buffers above this many bytes per event loop are deleted instead of returned to the pool
+	static constexpr size_t READ_BUF_POOL_HIGH_WATER = 1024 * 1024;
+
 	struct Client
 	{
 		Client();
@@ -63,13 +76,18 @@ public:
 		static void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
 		static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
 		static void on_write(uv_write_t* req, int status);
+		static void on_write_shared(uv_write_t* req, int status);
 
 		void close();
 		void ban(uint64_t seconds);
 
+		void grow_read_buf();
+		void shrink_read_buf();
+
 		void init_addr_string(bool is_v6, const sockaddr_storage* peer_addr);
 
 		TCPServer* m_owner;
+		EventLoop* m_eventLoop;
 
 		// Used to maintain connected clients list
 		Client* m_prev;
@@ -86,23 +104,87 @@ public:
 		char m_addrString[64];
 
 		bool m_readBufInUse;
-		char m_readBuf[READ_BUF_SIZE];
+		char* m_readBuf;
+		uint32_t m_readBufSize;
 		uint32_t m_numRead;
+		char m_smallReadBuf[READ_BUF_SMALL_SIZE];
 
 		std::atomic<uint32_t> m_resetCounter{ 0 };
 
 		uv_mutex_t m_sendLock;
 	};
 
+	// Write buffers come in several size classes so that small messages don't pin WRITE_BUF_SIZE bytes each
+	enum WriteBufClass : uint32_t { WRITE_BUF_SMALL, WRITE_BUF_MEDIUM, WRITE_BUF_LARGE, NUM_WRITE_BUF_CLASSES };
+
+	static constexpr size_t write_buf_class_size(uint32_t size_class)
+	{
+		return (size_class == WRITE_BUF_SMALL) ? std::min<size_t>(256, WRITE_BUF_SIZE) :
+			((size_class == WRITE_BUF_MEDIUM) ? std::min<size_t>(4096, WRITE_BUF_SIZE) : WRITE_BUF_SIZE);
+	}
+
+	// Free buffers above this many bytes per size class are deleted instead of returned to the pool
+	static constexpr size_t WRITE_BUF_POOL_HIGH_WATER = 1024 * 1024;
+
 	struct WriteBuf
+	{
+		explicit FORCEINLINE WriteBuf(uint32_t size_class) : m_client(nullptr), m_write{}, m_sizeClass(size_class), m_data(new char[write_buf_class_size(size_class)]) {}
+		FORCEINLINE ~WriteBuf() { delete[] m_data; }
+
+		Client* m_client;
+		uv_write_t m_write;
+		uint32_t m_sizeClass;
+		char* m_data;
+	};
+
+	struct SharedWriteReq
 	{
 		Client* m_client;
 		uv_write_t m_write;
-		char m_data[WRITE_BUF_SIZE];
+		SharedBuf* m_payload;
+		char m_header[16];
+	};
+
+	// Each event loop runs in its own thread and owns all connections it accepted
+	// Loop 0 is the main loop: it also runs the server's timers and async handles, and makes all outgoing connections
+	struct EventLoop : public nocopy_nomove
+	{
+		EventLoop(TCPServer* owner, uint32_t index);
+
+		TCPServer* m_owner;
+		uint32_t m_index;
+
+		uv_loop_t m_loop;
+		uv_thread_t m_thread;
+		volatile bool m_stopped;
+
+		uv_mutex_t m_clientsListLock;
+		std::vector<Client*> m_preallocatedClients;
+		Client* m_connectedClientsList;
+		uint32_t m_numConnections;
+
+		std::vector<uv_tcp_t*> m_listenSockets6;
+		std::vector<uv_tcp_t*> m_listenSockets;
+
+		// Write buffer pools are only touched from this loop's thread, so they don't need a lock
+		std::vector<WriteBuf*> m_writeBuffers[NUM_WRITE_BUF_CLASSES];
+		std::vector<SharedWriteReq*> m_sharedWriteRequests;
+		std::vector<char*> m_readBuffers;
+
+		// Number of buffers in the pools above, other threads can only read these
+		std::atomic<uint32_t> m_numPooledWriteBuffers[NUM_WRITE_BUF_CLASSES];
+		std::atomic<uint32_t> m_numPooledReadBuffers;
+
+		uv_async_t m_dropConnectionsAsync;
+		uv_async_t m_shutdownAsync;
 	};
 
-	uv_mutex_t m_writeBuffersLock;
-	std::vector<WriteBuf*> m_writeBuffers;
+	// Pools are used only when called from the loop's own thread, otherwise buffers are allocated and freed directly
+	static bool in_loop_thread(const EventLoop* loop);
+	static WriteBuf* get_write_buffer(EventLoop* loop, uint32_t size_class);
+	static void return_write_buffer(EventLoop* loop, WriteBuf* buf);
+	static char* get_read_buffer(EventLoop* loop);
+	static void return_read_buffer(EventLoop* loop, char* buf);
 
 	struct SendCallbackBase
 	{
@@ -125,12 +207,15 @@ public:
 	template<typename T>
 	FORCEINLINE bool send(Client* client, T&& callback) { return send_internal(client, SendCallback<T>(std::move(callback))); }
 
+	// Sends a small per-client header followed by a shared payload in a single uv_write
+	bool send_shared(Client* client, const void* header, size_t header_size, SharedBuf* payload);
+
 private:
 	static void loop(void* data);
 	static void on_new_connection(uv_stream_t* server, int status);
 	static void on_connection_close(uv_handle_t* handle);
 	static void on_connect(uv_connect_t* req, int status);
-	void on_new_client(uv_stream_t* server);
+	void on_new_client(EventLoop* loop, uv_stream_t* server);
 	void on_new_client_nolock(uv_stream_t* server, Client* client);
 
 	bool connect_to_peer_nolock(Client* client, bool is_v6, const sockaddr* addr);
@@ -139,26 +224,27 @@ private:
 
 	allocate_client_callback m_allocateNewClient;
 
-	void close_sockets(bool listen_sockets);
-
-	std::vector<uv_tcp_t*> m_listenSockets6;
-	std::vector<uv_tcp_t*> m_listenSockets;
-	uv_thread_t m_loopThread;
+	void close_sockets(EventLoop* loop, bool listen_sockets);
 
 protected:
 	void start_listening(const std::string& listen_addresses);
 
+	// Starts event loop threads without listening, for servers that only make outgoing connections
+	void start_event_loops();
+
+	std::vector<EventLoop*> m_loops;
+
 	std::atomic<int> m_finished;
 	int m_listenPort;
 
-	uv_loop_t m_loop;
-	volatile bool m_loopStopped;
+	// Main event loop, code that only ever runs one loop can keep using these
+	uv_loop_t& m_loop;
+	uv_mutex_t& m_clientsListLock;
+	Client*& m_connectedClientsList;
 
-	uv_mutex_t m_clientsListLock;
-	std::vector<Client*> m_preallocatedClients;
-	Client* m_connectedClientsList;
-	uint32_t m_numConnections;
-	uint32_t m_numIncomingConnections;
+	// Totals for all event loops
+	std::atomic<uint32_t> m_numConnections;
+	std::atomic<uint32_t> m_numIncomingConnections;
 
 	uv_mutex_t m_bansLock;
 	unordered_map<raw_ip, time_t> m_bans;
@@ -168,17 +254,19 @@ protected:
 	uv_mutex_t m_pendingConnectionsLock;
 	unordered_set<raw_ip> m_pendingConnections;
 
-	uv_async_t m_dropConnectionsAsync;
-	static void on_drop_connections(uv_async_t* async) { reinterpret_cast<TCPServer*>(async->data)->close_sockets(false); }
+	static void on_drop_connections(uv_async_t* async)
+	{
+		EventLoop* loop = reinterpret_cast<EventLoop*>(async->data);
+		loop->m_owner->close_sockets(loop, false);
+	}
 
-	uv_async_t m_shutdownAsync;
 	static void on_shutdown(uv_async_t* async)
 	{
-		TCPServer* server = reinterpret_cast<TCPServer*>(async->data);
-		server->close_sockets(true);
+		EventLoop* loop = reinterpret_cast<EventLoop*>(async->data);
+		loop->m_owner->close_sockets(loop, true);
 
-		uv_close(reinterpret_cast<uv_handle_t*>(&server->m_dropConnectionsAsync), nullptr);
-		uv_close(reinterpret_cast<uv_handle_t*>(&server->m_shutdownAsync), nullptr);
+		uv_close(reinterpret_cast<uv_handle_t*>(&loop->m_dropConnectionsAsync), nullptr);
+		uv_close(reinterpret_cast<uv_handle_t*>(&loop->m_shutdownAsync), nullptr);
 	}
 };
 
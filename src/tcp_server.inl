@@ -17,19 +17,58 @@
 
 #include <thread>
 
-static thread_local bool server_event_loop_thread = false;
+// Event loop which runs in the current thread, nullptr for all other threads
+static thread_local const void* server_event_loop = nullptr;
 
 namespace p2pool {
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback allocate_new_client)
+TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback allocate_new_client, uint32_t num_loops)
 	: m_allocateNewClient(allocate_new_client)
-	, m_loopThread{}
+	, m_loops{ new EventLoop(this, 0) }
 	, m_finished(0)
 	, m_listenPort(-1)
-	, m_loopStopped(false)
+	, m_loop(m_loops[0]->m_loop)
+	, m_clientsListLock(m_loops[0]->m_clientsListLock)
+	, m_connectedClientsList(m_loops[0]->m_connectedClientsList)
 	, m_numConnections(0)
 	, m_numIncomingConnections(0)
+{
+#ifndef SO_REUSEPORT
+	if (num_loops > 1) {
+		LOGWARN(1, "SO_REUSEPORT is not supported on this platform, using only 1 event loop");
+		num_loops = 1;
+	}
+#endif
+
+	for (uint32_t i = 1; i < num_loops; ++i) {
+		m_loops.push_back(new EventLoop(this, i));
+	}
+
+	uv_mutex_init_checked(&m_bansLock);
+	uv_mutex_init_checked(&m_pendingConnectionsLock);
+
+	for (EventLoop* loop : m_loops) {
+		loop->m_preallocatedClients.reserve(DEFAULT_BACKLOG);
+		for (int i = 0; i < DEFAULT_BACKLOG; ++i) {
+			loop->m_preallocatedClients.emplace_back(m_allocateNewClient());
+		}
+
+		loop->m_connectedClientsList = m_allocateNewClient();
+		loop->m_connectedClientsList->m_next = loop->m_connectedClientsList;
+		loop->m_connectedClientsList->m_prev = loop->m_connectedClientsList;
+	}
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::EventLoop::EventLoop(TCPServer* owner, uint32_t index)
+	: m_owner(owner)
+	, m_index(index)
+	, m_loop{}
+	, m_thread{}
+	, m_stopped(false)
+	, m_connectedClientsList(nullptr)
+	, m_numConnections(0)
 {
 	int err = uv_loop_init(&m_loop);
 	if (err) {
@@ -44,23 +83,16 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback all
 	m_shutdownAsync.data = this;
 
 	uv_mutex_init_checked(&m_clientsListLock);
-	uv_mutex_init_checked(&m_bansLock);
-	uv_mutex_init_checked(&m_pendingConnectionsLock);
-	uv_mutex_init_checked(&m_writeBuffersLock);
 
-	m_writeBuffers.resize(DEFAULT_BACKLOG);
-	for (size_t i = 0; i < m_writeBuffers.size(); ++i) {
-		m_writeBuffers[i] = new WriteBuf();
-	}
-
-	m_preallocatedClients.reserve(DEFAULT_BACKLOG);
+	m_writeBuffers[WRITE_BUF_SMALL].reserve(DEFAULT_BACKLOG);
 	for (int i = 0; i < DEFAULT_BACKLOG; ++i) {
-		m_preallocatedClients.emplace_back(m_allocateNewClient());
+		m_writeBuffers[WRITE_BUF_SMALL].push_back(new WriteBuf(WRITE_BUF_SMALL));
 	}
 
-	m_connectedClientsList = m_allocateNewClient();
-	m_connectedClientsList->m_next = m_connectedClientsList;
-	m_connectedClientsList->m_prev = m_connectedClientsList;
+	for (uint32_t i = 0; i < NUM_WRITE_BUF_CLASSES; ++i) {
+		m_numPooledWriteBuffers[i] = static_cast<uint32_t>(m_writeBuffers[i].size());
+	}
+	m_numPooledReadBuffers = 0;
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
@@ -71,10 +103,12 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::~TCPServer()
 		shutdown_tcp();
 	}
 
-	delete m_connectedClientsList;
+	for (EventLoop* loop : m_loops) {
+		delete loop->m_connectedClientsList;
+		delete loop;
+	}
 }
 
-
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 template<typename T>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::parse_address_list(const std::string& address_list, T callback)
@@ -129,81 +163,120 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string
 		panic();
 	}
 
-	parse_address_list(listen_addresses,
-		[this](bool is_v6, const std::string& address, const std::string& ip, int port)
-		{
-			if (m_listenPort < 0) {
-				m_listenPort = port;
-			}
-			else if (m_listenPort != port) {
-				LOGERR(1, "all sockets must be listening on the same port number, fix the command line");
-				panic();
-			}
-
-			uv_tcp_t* socket = new uv_tcp_t();
+	// With more than one event loop, each loop gets its own set of listen sockets and the kernel spreads incoming connections between them
+	const bool reuse_port = (m_loops.size() > 1);
 
-			if (is_v6) {
-				m_listenSockets6.push_back(socket);
-			}
-			else {
-				m_listenSockets.push_back(socket);
-			}
+	for (EventLoop* loop : m_loops) {
+		parse_address_list(listen_addresses,
+			[this, loop, reuse_port](bool is_v6, const std::string& address, const std::string& ip, int port)
+			{
+				if (m_listenPort < 0) {
+					m_listenPort = port;
+				}
+				else if (m_listenPort != port) {
+					LOGERR(1, "all sockets must be listening on the same port number, fix the command line");
+					panic();
+				}
 
-			int err = uv_tcp_init(&m_loop, socket);
-			if (err) {
-				LOGERR(1, "failed to create tcp server handle, error " << uv_err_name(err));
-				panic();
-			}
-			socket->data = this;
+				uv_tcp_t* socket = new uv_tcp_t();
 
-			err = uv_tcp_nodelay(socket, 1);
-			if (err) {
-				LOGERR(1, "failed to set tcp_nodelay on tcp server handle, error " << uv_err_name(err));
-				panic();
-			}
+				if (is_v6) {
+					loop->m_listenSockets6.push_back(socket);
+				}
+				else {
+					loop->m_listenSockets.push_back(socket);
+				}
 
-			if (is_v6) {
-				sockaddr_in6 addr6;
-				err = uv_ip6_addr(ip.c_str(), port, &addr6);
+				// The socket must be created right away to set SO_REUSEPORT on it before bind
+				int err = uv_tcp_init_ex(&loop->m_loop, socket, is_v6 ? AF_INET6 : AF_INET);
 				if (err) {
-					LOGERR(1, "failed to parse IPv6 address " << ip << ", error " << uv_err_name(err));
+					LOGERR(1, "failed to create tcp server handle, error " << uv_err_name(err));
 					panic();
 				}
+				socket->data = loop;
 
-				err = uv_tcp_bind(socket, reinterpret_cast<sockaddr*>(&addr6), UV_TCP_IPV6ONLY);
+				err = uv_tcp_nodelay(socket, 1);
 				if (err) {
-					LOGERR(1, "failed to bind tcp server IPv6 socket, error " << uv_err_name(err));
+					LOGERR(1, "failed to set tcp_nodelay on tcp server handle, error " << uv_err_name(err));
 					panic();
 				}
-			}
-			else {
-				sockaddr_in addr;
-				err = uv_ip4_addr(ip.c_str(), port, &addr);
-				if (err) {
-					LOGERR(1, "failed to parse IPv4 address " << ip << ", error " << uv_err_name(err));
-					panic();
+
+#ifdef SO_REUSEPORT
+				if (reuse_port) {
+					uv_os_fd_t fd;
+					err = uv_fileno(reinterpret_cast<uv_handle_t*>(socket), &fd);
+					if (err) {
+						LOGERR(1, "failed to get tcp server socket descriptor, error " << uv_err_name(err));
+						panic();
+					}
+
+					const int reuse = 1;
+					if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+						LOGERR(1, "failed to set SO_REUSEPORT on tcp server socket, error " << errno);
+						panic();
+					}
+				}
+#else
+				(void)reuse_port;
+#endif
+
+				if (is_v6) {
+					sockaddr_in6 addr6;
+					err = uv_ip6_addr(ip.c_str(), port, &addr6);
+					if (err) {
+						LOGERR(1, "failed to parse IPv6 address " << ip << ", error " << uv_err_name(err));
+						panic();
+					}
+
+					err = uv_tcp_bind(socket, reinterpret_cast<sockaddr*>(&addr6), UV_TCP_IPV6ONLY);
+					if (err) {
+						LOGERR(1, "failed to bind tcp server IPv6 socket, error " << uv_err_name(err));
+						panic();
+					}
+				}
+				else {
+					sockaddr_in addr;
+					err = uv_ip4_addr(ip.c_str(), port, &addr);
+					if (err) {
+						LOGERR(1, "failed to parse IPv4 address " << ip << ", error " << uv_err_name(err));
+						panic();
+					}
+
+					err = uv_tcp_bind(socket, reinterpret_cast<sockaddr*>(&addr), 0);
+					if (err) {
+						LOGERR(1, "failed to bind tcp server IPv4 socket, error " << uv_err_name(err));
+						panic();
+					}
 				}
 
-				err = uv_tcp_bind(socket, reinterpret_cast<sockaddr*>(&addr), 0);
+				err = uv_listen(reinterpret_cast<uv_stream_t*>(socket), DEFAULT_BACKLOG, on_new_connection);
 				if (err) {
-					LOGERR(1, "failed to bind tcp server IPv4 socket, error " << uv_err_name(err));
+					LOGERR(1, "failed to listen on tcp server socket, error " << uv_err_name(err));
 					panic();
 				}
-			}
 
-			err = uv_listen(reinterpret_cast<uv_stream_t*>(socket), DEFAULT_BACKLOG, on_new_connection);
-			if (err) {
-				LOGERR(1, "failed to listen on tcp server socket, error " << uv_err_name(err));
-				panic();
-			}
+				if (loop->m_index == 0) {
+					LOGINFO(1, "listening on " << log::Gray() << address);
+				}
+			});
+	}
 
-			LOGINFO(1, "listening on " << log::Gray() << address);
-		});
+	if (reuse_port) {
+		LOGINFO(1, "using " << m_loops.size() << " event loops");
+	}
 
-	const int err = uv_thread_create(&m_loopThread, loop, this);
-	if (err) {
-		LOGERR(1, "failed to start event loop thread, error " << uv_err_name(err));
-		panic();
+	start_event_loops();
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_event_loops()
+{
+	for (EventLoop* event_loop : m_loops) {
+		const int err = uv_thread_create(&event_loop->m_thread, loop, event_loop);
+		if (err) {
+			LOGERR(1, "failed to start event loop thread, error " << uv_err_name(err));
+			panic();
+		}
 	}
 }
 
@@ -215,7 +288,9 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 		return false;
 	}
 
-	MutexLock lock(m_clientsListLock);
+	// Outgoing connections always run in the main event loop
+	EventLoop* loop = m_loops[0];
+	MutexLock lock(loop->m_clientsListLock);
 
 	if (m_finished.load()) {
 		return false;
@@ -223,9 +298,9 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 
 	Client* client;
 
-	if (!m_preallocatedClients.empty()) {
-		client = m_preallocatedClients.back();
-		m_preallocatedClients.pop_back();
+	if (!loop->m_preallocatedClients.empty()) {
+		client = loop->m_preallocatedClients.back();
+		loop->m_preallocatedClients.pop_back();
 		client->reset();
 	}
 	else {
@@ -233,6 +308,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 	}
 
 	client->m_owner = this;
+	client->m_eventLoop = loop;
 	client->m_port = port;
 
 	log::Stream s(client->m_addrString);
@@ -243,7 +319,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 		const int err = uv_ip6_addr(ip, port, addr6);
 		if (err) {
 			LOGERR(1, "failed to parse IPv6 address " << ip << ", error " << uv_err_name(err));
-			m_preallocatedClients.push_back(client);
+			loop->m_preallocatedClients.push_back(client);
 			return false;
 		}
 
@@ -256,7 +332,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 		const int err = uv_ip4_addr(ip, port, addr4);
 		if (err) {
 			LOGERR(1, "failed to parse IPv4 address " << ip << ", error " << uv_err_name(err));
-			m_preallocatedClients.push_back(client);
+			loop->m_preallocatedClients.push_back(client);
 			return false;
 		}
 
@@ -274,7 +350,8 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const raw_ip& ip, int port)
 {
-	MutexLock lock(m_clientsListLock);
+	EventLoop* loop = m_loops[0];
+	MutexLock lock(loop->m_clientsListLock);
 
 	if (m_finished.load()) {
 		return false;
@@ -282,9 +359,9 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 
 	Client* client;
 
-	if (!m_preallocatedClients.empty()) {
-		client = m_preallocatedClients.back();
-		m_preallocatedClients.pop_back();
+	if (!loop->m_preallocatedClients.empty()) {
+		client = loop->m_preallocatedClients.back();
+		loop->m_preallocatedClients.pop_back();
 		client->reset();
 	}
 	else {
@@ -292,6 +369,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(bool is_v6, const
 	}
 
 	client->m_owner = this;
+	client->m_eventLoop = loop;
 	client->m_addr = ip;
 	client->m_port = port;
 
@@ -339,18 +417,20 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::is_banned(const raw_ip& ip)
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer_nolock(Client* client, bool is_v6, const sockaddr* addr)
 {
+	EventLoop* loop = client->m_eventLoop;
+
 	if (is_banned(client->m_addr)) {
 		LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(client->m_addrString) << log::NoColor() << " is banned, not connecting to it");
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return false;
 	}
 
 	client->m_isV6 = is_v6;
 
-	int err = uv_tcp_init(&m_loop, &client->m_socket);
+	int err = uv_tcp_init(&loop->m_loop, &client->m_socket);
 	if (err) {
 		LOGERR(1, "failed to create tcp client handle, error " << uv_err_name(err));
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return false;
 	}
 	client->m_socket.data = client;
@@ -358,7 +438,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer_nolock(Client* cl
 	err = uv_tcp_nodelay(&client->m_socket, 1);
 	if (err) {
 		LOGERR(1, "failed to set tcp_nodelay on tcp client handle, error " << uv_err_name(err));
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return false;
 	}
 
@@ -366,7 +446,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer_nolock(Client* cl
 
 	if (!m_pendingConnections.insert(client->m_addr).second) {
 		LOGINFO(6, "there is already a pending connection to this IP, not connecting to " << log::Gray() << static_cast<char*>(client->m_addrString));
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return false;
 	}
 
@@ -375,7 +455,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer_nolock(Client* cl
 	if (err) {
 		LOGERR(1, "failed to initiate tcp connection, error " << uv_err_name(err));
 		m_pendingConnections.erase(client->m_addr);
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return false;
 	}
 	else {
@@ -386,20 +466,20 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer_nolock(Client* cl
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::close_sockets(bool listen_sockets)
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::close_sockets(EventLoop* loop, bool listen_sockets)
 {
-	if (!server_event_loop_thread) {
+	if (!in_loop_thread(loop)) {
 		LOGERR(1, "closing sockets from another thread, this is not thread safe");
 	}
 
 	if (listen_sockets) {
-		for (uv_tcp_t* s : m_listenSockets6) {
+		for (uv_tcp_t* s : loop->m_listenSockets6) {
 			uv_handle_t* h = reinterpret_cast<uv_handle_t*>(s);
 			if (!uv_is_closing(h)) {
 				uv_close(h, [](uv_handle_t* h) { delete reinterpret_cast<uv_tcp_t*>(h); });
 			}
 		}
-		for (uv_tcp_t* s : m_listenSockets) {
+		for (uv_tcp_t* s : loop->m_listenSockets) {
 			uv_handle_t* h = reinterpret_cast<uv_handle_t*>(s);
 			if (!uv_is_closing(h)) {
 				uv_close(h, [](uv_handle_t* h) { delete reinterpret_cast<uv_tcp_t*>(h); });
@@ -407,11 +487,11 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::close_sockets(bool listen_sockets
 		}
 	}
 
-	MutexLock lock(m_clientsListLock);
+	MutexLock lock(loop->m_clientsListLock);
 
 	size_t numClosed = 0;
 
-	for (Client* c = m_connectedClientsList->m_next; c != m_connectedClientsList; c = c->m_next) {
+	for (Client* c = loop->m_connectedClientsList->m_next; c != loop->m_connectedClientsList; c = c->m_next) {
 		uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&c->m_socket);
 		if (!uv_is_closing(h)) {
 			uv_close(h, on_connection_close);
@@ -424,6 +504,14 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::close_sockets(bool listen_sockets
 	}
 }
 
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::drop_connections()
+{
+	for (EventLoop* loop : m_loops) {
+		uv_async_send(&loop->m_dropConnectionsAsync);
+	}
+}
+
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::shutdown_tcp()
 {
@@ -431,17 +519,29 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::shutdown_tcp()
 		return;
 	}
 
-	uv_async_send(&m_shutdownAsync);
+	for (EventLoop* loop : m_loops) {
+		uv_async_send(&loop->m_shutdownAsync);
+	}
 
 	using namespace std::chrono;
 
 	const system_clock::time_point start_time = system_clock::now();
 	int64_t counter = 0;
-	uv_async_t asy;
+	std::vector<uv_async_t> asy(m_loops.size());
 
 	constexpr uint32_t timeout_seconds = 30;
 
-	while (!m_loopStopped) {
+	auto all_stopped = [this]()
+	{
+		for (const EventLoop* loop : m_loops) {
+			if (!loop->m_stopped) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	while (!all_stopped()) {
 		const int64_t elapsed_time = duration_cast<milliseconds>(system_clock::now() - start_time).count();
 
 		if (elapsed_time >= (counter + 1) * 1000) {
@@ -451,9 +551,14 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::shutdown_tcp()
 			}
 			else {
 				LOGWARN(1, "timed out while waiting for event loop to stop");
-				uv_async_init(&m_loop, &asy, nullptr);
-				uv_stop(&m_loop);
-				uv_async_send(&asy);
+				for (size_t i = 0, n = m_loops.size(); i < n; ++i) {
+					EventLoop* loop = m_loops[i];
+					if (!loop->m_stopped) {
+						uv_async_init(&loop->m_loop, &asy[i], nullptr);
+						uv_stop(&loop->m_loop);
+						uv_async_send(&asy[i]);
+					}
+				}
 				break;
 			}
 		}
@@ -461,23 +566,30 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::shutdown_tcp()
 		std::this_thread::sleep_for(milliseconds(1));
 	}
 
-	uv_thread_join(&m_loopThread);
+	for (EventLoop* loop : m_loops) {
+		uv_thread_join(&loop->m_thread);
 
-	for (Client* c : m_preallocatedClients) {
-		delete c;
-	}
+		for (Client* c : loop->m_preallocatedClients) {
+			delete c;
+		}
 
-	uv_mutex_destroy(&m_clientsListLock);
-	uv_mutex_destroy(&m_bansLock);
-	uv_mutex_destroy(&m_pendingConnectionsLock);
+		uv_mutex_destroy(&loop->m_clientsListLock);
 
-	{
-		MutexLock lock(m_writeBuffersLock);
-		for (WriteBuf* buf : m_writeBuffers) {
-			delete buf;
+		for (std::vector<WriteBuf*>& buffers : loop->m_writeBuffers) {
+			for (WriteBuf* buf : buffers) {
+				delete buf;
+			}
+		}
+		for (SharedWriteReq* req : loop->m_sharedWriteRequests) {
+			delete req;
+		}
+		for (char* buf : loop->m_readBuffers) {
+			delete[] buf;
 		}
 	}
-	uv_mutex_destroy(&m_writeBuffersLock);
+
+	uv_mutex_destroy(&m_bansLock);
+	uv_mutex_destroy(&m_pendingConnectionsLock);
 
 	LOGINFO(1, "stopped");
 }
@@ -486,10 +598,27 @@ template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::print_status()
 {
 	LOGINFO(0, "status" <<
-		"\nConnections = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)"
+		"\nConnections = " << m_numConnections.load() << " (" << m_numIncomingConnections.load() << " incoming)"
 	);
 }
 
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::print_queues()
+{
+	for (const EventLoop* loop : m_loops) {
+		uint64_t pooled_bytes = loop->m_numPooledReadBuffers.load(std::memory_order_relaxed) * READ_BUF_SIZE;
+		for (uint32_t i = 0; i < NUM_WRITE_BUF_CLASSES; ++i) {
+			pooled_bytes += loop->m_numPooledWriteBuffers[i].load(std::memory_order_relaxed) * write_buf_class_size(i);
+		}
+
+		LOGINFO(0, "event loop " << loop->m_index << ": pooled write buffers " <<
+			loop->m_numPooledWriteBuffers[WRITE_BUF_SMALL].load(std::memory_order_relaxed) << " small, " <<
+			loop->m_numPooledWriteBuffers[WRITE_BUF_MEDIUM].load(std::memory_order_relaxed) << " medium, " <<
+			loop->m_numPooledWriteBuffers[WRITE_BUF_LARGE].load(std::memory_order_relaxed) << " large, pooled read buffers " <<
+			loop->m_numPooledReadBuffers.load(std::memory_order_relaxed) << ", " << pooled_bytes / 1024 << " KB in total");
+	}
+}
+
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::ban(const raw_ip& ip, uint64_t seconds)
 {
@@ -498,44 +627,112 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::ban(const raw_ip& ip, uint64_t se
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, SendCallbackBase&& callback)
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::in_loop_thread(const EventLoop* loop)
 {
-	if (!server_event_loop_thread) {
-		LOGERR(1, "sending data from another thread, this is not thread safe");
+	return loop && (server_event_loop == loop);
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+typename TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::WriteBuf* TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::get_write_buffer(EventLoop* loop, uint32_t size_class)
+{
+	if (in_loop_thread(loop)) {
+		std::vector<WriteBuf*>& buffers = loop->m_writeBuffers[size_class];
+		if (!buffers.empty()) {
+			WriteBuf* buf = buffers.back();
+			buffers.pop_back();
+			loop->m_numPooledWriteBuffers[size_class].store(static_cast<uint32_t>(buffers.size()), std::memory_order_relaxed);
+			return buf;
+		}
 	}
 
-	MutexLock lock0(client->m_sendLock);
+	alloc_telemetry::Scope alloc_scope(alloc_telemetry::NETWORK_BUFFERS);
+	return new WriteBuf(size_class);
+}
 
-	WriteBuf* buf = nullptr;
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::return_write_buffer(EventLoop* loop, WriteBuf* buf)
+{
+	if (!in_loop_thread(loop)) {
+		delete buf;
+		return;
+	}
 
-	{
-		MutexLock lock(m_writeBuffersLock);
-		if (!m_writeBuffers.empty()) {
-			buf = m_writeBuffers.back();
-			m_writeBuffers.pop_back();
-		}
+	std::vector<WriteBuf*>& buffers = loop->m_writeBuffers[buf->m_sizeClass];
+
+	if ((buffers.size() + 1) * write_buf_class_size(buf->m_sizeClass) > WRITE_BUF_POOL_HIGH_WATER) {
+		delete buf;
+		return;
 	}
 
-	if (!buf) {
-		buf = new WriteBuf();
+	buffers.push_back(buf);
+	loop->m_numPooledWriteBuffers[buf->m_sizeClass].store(static_cast<uint32_t>(buffers.size()), std::memory_order_relaxed);
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+char* TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::get_read_buffer(EventLoop* loop)
+{
+	if (in_loop_thread(loop) && !loop->m_readBuffers.empty()) {
+		char* buf = loop->m_readBuffers.back();
+		loop->m_readBuffers.pop_back();
+		loop->m_numPooledReadBuffers.store(static_cast<uint32_t>(loop->m_readBuffers.size()), std::memory_order_relaxed);
+		return buf;
+	}
+
+	alloc_telemetry::Scope alloc_scope(alloc_telemetry::NETWORK_BUFFERS);
+	return new char[READ_BUF_SIZE];
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::return_read_buffer(EventLoop* loop, char* buf)
+{
+	if (!in_loop_thread(loop) || ((loop->m_readBuffers.size() + 1) * READ_BUF_SIZE > READ_BUF_POOL_HIGH_WATER)) {
+		delete[] buf;
+		return;
 	}
 
+	loop->m_readBuffers.push_back(buf);
+	loop->m_numPooledReadBuffers.store(static_cast<uint32_t>(loop->m_readBuffers.size()), std::memory_order_relaxed);
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, SendCallbackBase&& callback)
+{
+	EventLoop* loop = client->m_eventLoop;
+
+	if (!in_loop_thread(loop)) {
+		LOGERR(1, "sending data from another thread, this is not thread safe");
+	}
+
+	MutexLock lock0(client->m_sendLock);
+
+	// The callback doesn't know its size in advance, so it always writes into a large buffer
+	WriteBuf* buf = get_write_buffer(loop, WRITE_BUF_LARGE);
+
 	const size_t bytes_written = callback(buf->m_data);
 
-	if (bytes_written > sizeof(buf->m_data)) {
-		LOGERR(0, "send callback wrote " << bytes_written << " bytes, expected no more than " << sizeof(buf->m_data) << " bytes");
+	if (bytes_written > WRITE_BUF_SIZE) {
+		LOGERR(0, "send callback wrote " << bytes_written << " bytes, expected no more than " << WRITE_BUF_SIZE << " bytes");
 		panic();
 	}
 
 	if (bytes_written == 0) {
 		LOGWARN(1, "send callback wrote 0 bytes, nothing to do");
-		{
-			MutexLock lock(m_writeBuffersLock);
-			m_writeBuffers.push_back(buf);
-		}
+		return_write_buffer(loop, buf);
 		return true;
 	}
 
+	// Move small messages to a smaller buffer, so the large one goes back to the pool right away
+	for (uint32_t size_class = WRITE_BUF_SMALL; size_class < WRITE_BUF_LARGE; ++size_class) {
+		const size_t size = write_buf_class_size(size_class);
+		if ((bytes_written <= size) && (size < WRITE_BUF_SIZE)) {
+			WriteBuf* small_buf = get_write_buffer(loop, size_class);
+			memcpy(small_buf->m_data, buf->m_data, bytes_written);
+			return_write_buffer(loop, buf);
+			buf = small_buf;
+			break;
+		}
+	}
+
 	buf->m_client = client;
 	buf->m_write.data = buf;
 
@@ -545,9 +742,78 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, Sen
 
 	const int err = uv_write(&buf->m_write, reinterpret_cast<uv_stream_t*>(&client->m_socket), bufs, 1, Client::on_write);
 	if (err) {
-		{
-			MutexLock lock(m_writeBuffersLock);
-			m_writeBuffers.push_back(buf);
+		return_write_buffer(loop, buf);
+		LOGWARN(1, "failed to start writing data to client connection " << static_cast<const char*>(client->m_addrString) << ", error " << uv_err_name(err));
+		return false;
+	}
+
+	return true;
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_shared(Client* client, const void* header, size_t header_size, SharedBuf* payload)
+{
+	EventLoop* loop = client->m_eventLoop;
+	const bool pooled = in_loop_thread(loop);
+
+	if (!pooled) {
+		LOGERR(1, "sending data from another thread, this is not thread safe");
+	}
+
+	if (header_size > sizeof(SharedWriteReq::m_header)) {
+		LOGERR(0, "send_shared: header is " << header_size << " bytes, expected no more than " << sizeof(SharedWriteReq::m_header) << " bytes");
+		panic();
+	}
+
+	if ((header_size == 0) && payload->m_data.empty()) {
+		LOGWARN(1, "send_shared: nothing to do");
+		return true;
+	}
+
+	MutexLock lock0(client->m_sendLock);
+
+	SharedWriteReq* req = nullptr;
+
+	if (pooled && !loop->m_sharedWriteRequests.empty()) {
+		req = loop->m_sharedWriteRequests.back();
+		loop->m_sharedWriteRequests.pop_back();
+	}
+
+	if (!req) {
+		req = new SharedWriteReq();
+	}
+
+	memcpy(req->m_header, header, header_size);
+
+	req->m_client = client;
+	req->m_payload = payload;
+	req->m_write.data = req;
+
+	payload->add_ref();
+
+	uv_buf_t bufs[2];
+	uint32_t num_bufs = 0;
+
+	if (header_size > 0) {
+		bufs[num_bufs].base = req->m_header;
+		bufs[num_bufs].len = static_cast<int>(header_size);
+		++num_bufs;
+	}
+
+	if (!payload->m_data.empty()) {
+		bufs[num_bufs].base = reinterpret_cast<char*>(const_cast<uint8_t*>(payload->m_data.data()));
+		bufs[num_bufs].len = static_cast<int>(payload->m_data.size());
+		++num_bufs;
+	}
+
+	const int err = uv_write(&req->m_write, reinterpret_cast<uv_stream_t*>(&client->m_socket), bufs, num_bufs, Client::on_write_shared);
+	if (err) {
+		payload->release();
+		if (pooled) {
+			loop->m_sharedWriteRequests.push_back(req);
+		}
+		else {
+			delete req;
 		}
 		LOGWARN(1, "failed to start writing data to client connection " << static_cast<const char*>(client->m_addrString) << ", error " << uv_err_name(err));
 		return false;
@@ -560,17 +826,18 @@ template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::loop(void* data)
 {
 	LOGINFO(1, "event loop started");
-	server_event_loop_thread = true;
-	TCPServer* server = static_cast<TCPServer*>(data);
-	uv_run(&server->m_loop, UV_RUN_DEFAULT);
-	uv_loop_close(&server->m_loop);
-	server->m_loopStopped = true;
+	EventLoop* loop = static_cast<EventLoop*>(data);
+	server_event_loop = loop;
+	uv_run(&loop->m_loop, UV_RUN_DEFAULT);
+	uv_loop_close(&loop->m_loop);
+	loop->m_stopped = true;
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_connection(uv_stream_t* server, int status)
 {
-	TCPServer* pThis = static_cast<TCPServer*>(server->data);
+	EventLoop* loop = static_cast<EventLoop*>(server->data);
+	TCPServer* pThis = loop->m_owner;
 
 	if (pThis->m_finished.load()) {
 		return;
@@ -581,7 +848,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_connection(uv_stream_t* se
 		return;
 	}
 
-	pThis->on_new_client(server);
+	pThis->on_new_client(loop, server);
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
@@ -591,11 +858,12 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_connection_close(uv_handle_t*
 	MutexLock lock0(client->m_sendLock);
 
 	TCPServer* owner = client->m_owner;
+	EventLoop* loop = client->m_eventLoop;
 
 	LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(client->m_addrString) << log::NoColor() << " disconnected");
 
-	if (owner) {
-		MutexLock lock(owner->m_clientsListLock);
+	if (owner && loop) {
+		MutexLock lock(loop->m_clientsListLock);
 
 		Client* prev_in_list = client->m_prev;
 		Client* next_in_list = client->m_next;
@@ -607,8 +875,9 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_connection_close(uv_handle_t*
 		prev_in_list->m_next = next_in_list;
 		next_in_list->m_prev = prev_in_list;
 
-		owner->m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 
+		--loop->m_numConnections;
 		--owner->m_numConnections;
 		if (is_incoming) {
 			--owner->m_numIncomingConnections;
@@ -634,7 +903,8 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_connect(uv_connect_t* req, int
 		server->m_pendingConnections.erase(client->m_addr);
 	}
 
-	MutexLock lock(server->m_clientsListLock);
+	EventLoop* loop = client->m_eventLoop;
+	MutexLock lock(loop->m_clientsListLock);
 
 	if (status) {
 		if (status == UV_ETIMEDOUT) {
@@ -648,7 +918,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_connect(uv_connect_t* req, int
 		if (!uv_is_closing(h)) {
 			uv_close(h, nullptr);
 		}
-		server->m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return;
 	}
 
@@ -656,9 +926,9 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_connect(uv_connect_t* req, int
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client(uv_stream_t* server)
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client(EventLoop* loop, uv_stream_t* server)
 {
-	MutexLock lock(m_clientsListLock);
+	MutexLock lock(loop->m_clientsListLock);
 
 	if (m_finished.load()) {
 		return;
@@ -666,35 +936,36 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client(uv_stream_t* server
 
 	Client* client;
 
-	if (!m_preallocatedClients.empty()) {
-		client = m_preallocatedClients.back();
-		m_preallocatedClients.pop_back();
+	if (!loop->m_preallocatedClients.empty()) {
+		client = loop->m_preallocatedClients.back();
+		loop->m_preallocatedClients.pop_back();
 		client->reset();
 	}
 	else {
 		client = m_allocateNewClient();
 	}
 
-	int err = uv_tcp_init(&m_loop, &client->m_socket);
+	int err = uv_tcp_init(&loop->m_loop, &client->m_socket);
 	if (err) {
 		LOGERR(1, "failed to create tcp client handle, error " << uv_err_name(err));
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return;
 	}
 	client->m_socket.data = client;
 	client->m_owner = this;
+	client->m_eventLoop = loop;
 
 	err = uv_tcp_nodelay(&client->m_socket, 1);
 	if (err) {
 		LOGERR(1, "failed to set tcp_nodelay on tcp client handle, error " << uv_err_name(err));
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return;
 	}
 
 	err = uv_accept(server, reinterpret_cast<uv_stream_t*>(&client->m_socket));
 	if (err) {
 		LOGERR(1, "failed to accept client connection, error " << uv_err_name(err));
-		m_preallocatedClients.push_back(client);
+		loop->m_preallocatedClients.push_back(client);
 		return;
 	}
 
@@ -705,11 +976,15 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client(uv_stream_t* server
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client_nolock(uv_stream_t* server, Client* client)
 {
-	client->m_prev = m_connectedClientsList;
-	client->m_next = m_connectedClientsList->m_next;
-	m_connectedClientsList->m_next->m_prev = client;
-	m_connectedClientsList->m_next = client;
+	EventLoop* loop = client->m_eventLoop;
+	Client* list = loop->m_connectedClientsList;
 
+	client->m_prev = list;
+	client->m_next = list->m_next;
+	list->m_next->m_prev = client;
+	list->m_next = client;
+
+	++loop->m_numConnections;
 	++m_numConnections;
 	client->m_isIncoming = false;
 
@@ -724,7 +999,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client_nolock(uv_stream_t*
 
 	bool is_v6;
 	if (server) {
-		is_v6 = (std::find(m_listenSockets6.begin(), m_listenSockets6.end(), reinterpret_cast<uv_tcp_t*>(server)) != m_listenSockets6.end());
+		is_v6 = (std::find(loop->m_listenSockets6.begin(), loop->m_listenSockets6.end(), reinterpret_cast<uv_tcp_t*>(server)) != loop->m_listenSockets6.end());
 		client->m_isV6 = is_v6;
 	}
 	else {
@@ -775,6 +1050,8 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client_nolock(uv_stream_t*
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::Client()
+	: m_eventLoop(nullptr)
+	, m_readBuf(m_smallReadBuf)
 {
 	Client::reset();
 
@@ -786,6 +1063,10 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::Client()
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::~Client()
 {
+	if (m_readBuf != m_smallReadBuf) {
+		delete[] m_readBuf;
+	}
+
 	uv_mutex_destroy(&m_sendLock);
 }
 
@@ -794,7 +1075,13 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::reset()
 {
 	m_resetCounter.fetch_add(1);
 
+	if (m_readBuf != m_smallReadBuf) {
+		return_read_buffer(m_eventLoop, m_readBuf);
+		m_readBuf = m_smallReadBuf;
+	}
+
 	m_owner = nullptr;
+	m_eventLoop = nullptr;
 	m_prev = nullptr;
 	m_next = nullptr;
 	memset(&m_socket, 0, sizeof(m_socket));
@@ -806,6 +1093,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::reset()
 	m_port = -1;
 	m_addrString[0] = '\0';
 	m_readBufInUse = false;
+	m_readBufSize = static_cast<uint32_t>(READ_BUF_SMALL_SIZE);
 	m_numRead = 0;
 }
 
@@ -821,14 +1109,19 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_alloc(uv_handle_t* han
 		return;
 	}
 
-	if (pThis->m_numRead >= sizeof(pThis->m_readBuf)) {
-		LOGWARN(4, "client " << static_cast<const char*>(pThis->m_addrString) << " read buffer is full");
-		buf->len = 0;
-		buf->base = nullptr;
-		return;
+	if (pThis->m_numRead >= pThis->m_readBufSize) {
+		if (pThis->m_readBufSize < READ_BUF_SIZE) {
+			pThis->grow_read_buf();
+		}
+		else {
+			LOGWARN(4, "client " << static_cast<const char*>(pThis->m_addrString) << " read buffer is full");
+			buf->len = 0;
+			buf->base = nullptr;
+			return;
+		}
 	}
 
-	buf->len = sizeof(pThis->m_readBuf) - pThis->m_numRead;
+	buf->len = pThis->m_readBufSize - pThis->m_numRead;
 	buf->base = pThis->m_readBuf + pThis->m_numRead;
 	pThis->m_readBufInUse = true;
 }
@@ -844,6 +1137,9 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_read(uv_stream_t* stre
 			if (!pThis->on_read(buf->base, static_cast<uint32_t>(nread))) {
 				pThis->close();
 			}
+			else {
+				pThis->shrink_read_buf();
+			}
 		}
 	}
 	else if (nread < 0) {
@@ -864,11 +1160,30 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_write(uv_write_t* req,
 {
 	WriteBuf* buf = static_cast<WriteBuf*>(req->data);
 	Client* client = buf->m_client;
-	TCPServer* server = client->m_owner;
 
-	if (server) {
-		MutexLock lock(server->m_writeBuffersLock);
-		server->m_writeBuffers.push_back(buf);
+	return_write_buffer(client->m_eventLoop, buf);
+
+	if (status != 0) {
+		LOGWARN(5, "client " << static_cast<const char*>(client->m_addrString) << " failed to write data to client connection, error " << uv_err_name(status));
+		client->close();
+	}
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_write_shared(uv_write_t* req, int status)
+{
+	SharedWriteReq* shared_req = static_cast<SharedWriteReq*>(req->data);
+	Client* client = shared_req->m_client;
+	EventLoop* loop = client->m_eventLoop;
+
+	shared_req->m_payload->release();
+	shared_req->m_payload = nullptr;
+
+	if (in_loop_thread(loop)) {
+		loop->m_sharedWriteRequests.push_back(shared_req);
+	}
+	else {
+		delete shared_req;
 	}
 
 	if (status != 0) {
@@ -894,6 +1209,31 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::close()
 	}
 }
 
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::grow_read_buf()
+{
+	char* buf = get_read_buffer(m_eventLoop);
+	memcpy(buf, m_readBuf, m_numRead);
+
+	m_readBuf = buf;
+	m_readBufSize = static_cast<uint32_t>(READ_BUF_SIZE);
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::shrink_read_buf()
+{
+	// Keep the large buffer while it still holds more than a small buffer can
+	if ((m_readBuf == m_smallReadBuf) || (m_numRead > READ_BUF_SMALL_SIZE)) {
+		return;
+	}
+
+	memcpy(m_smallReadBuf, m_readBuf, m_numRead);
+	return_read_buffer(m_eventLoop, m_readBuf);
+
+	m_readBuf = m_smallReadBuf;
+	m_readBufSize = static_cast<uint32_t>(READ_BUF_SMALL_SIZE);
+}
+
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::ban(uint64_t seconds)
 {
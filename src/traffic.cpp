@@ -0,0 +1,222 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "traffic.h"
+#include "metrics.h"
+
+static constexpr char log_category_prefix[] = "Traffic ";
+
+namespace p2pool {
+
+namespace traffic {
+
+std::atomic<bool> recording{ false };
+
+// Records are appended to a memory buffer, the writer thread writes it to the file
+// so threads which receive traffic never wait for the disk
+static constexpr size_t FLUSH_SIZE = 1 << 20;
+static constexpr size_t MAX_BUFFERED_SIZE = 256 << 20;
+static constexpr uint64_t FLUSH_INTERVAL_NS = 1000000000ULL;
+
+static uv_mutex_t recording_lock;
+static uv_cond_t recording_cond;
+static uv_thread_t writer_thread;
+static bool writer_running = false;
+static std::vector<uint8_t> recording_buf;
+static std::ofstream recording_file;
+static uint64_t recording_start_time = 0;
+static uint64_t recording_size = 0;
+static uint64_t recording_dropped = 0;
+static std::atomic<uint32_t> connection_id_counter{ 0 };
+
+static void writer(void*)
+{
+	std::vector<uint8_t> buf;
+
+	MutexLock lock(recording_lock);
+
+	for (;;) {
+		if (writer_running && recording_buf.empty()) {
+			uv_cond_timedwait(&recording_cond, &recording_lock, FLUSH_INTERVAL_NS);
+		}
+
+		if (!recording_buf.empty()) {
+			buf.swap(recording_buf);
+
+			uv_mutex_unlock(&recording_lock);
+			recording_file.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+			buf.clear();
+			uv_mutex_lock(&recording_lock);
+		}
+		else if (!writer_running) {
+			break;
+		}
+	}
+}
+
+bool start_recording(const std::string& path)
+{
+	if (is_recording()) {
+		return false;
+	}
+
+	static bool initialized = false;
+	if (!initialized) {
+		uv_mutex_init_checked(&recording_lock);
+		uv_cond_init_checked(&recording_cond);
+		initialized = true;
+	}
+
+	recording_file.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+	if (!recording_file.is_open()) {
+		LOGERR(1, "failed to open " << path << " for writing");
+		return false;
+	}
+
+	recording_file.write(SIGNATURE, sizeof(SIGNATURE));
+	recording_start_time = metrics::now_us();
+	recording_size = sizeof(SIGNATURE);
+	recording_dropped = 0;
+	recording_buf.reserve(FLUSH_SIZE * 2);
+
+	writer_running = true;
+
+	const int err = uv_thread_create(&writer_thread, writer, nullptr);
+	if (err) {
+		LOGERR(1, "failed to start the writer thread, error " << uv_err_name(err));
+		writer_running = false;
+		recording_file.close();
+		return false;
+	}
+
+	recording.store(true);
+
+	LOGINFO(1, "recording incoming traffic to " << path);
+	return true;
+}
+
+void stop_recording()
+{
+	if (!recording.exchange(false)) {
+		return;
+	}
+
+	// The lock stays alive after this, threads which are still in record() will see that the writer is stopped
+	{
+		MutexLock lock(recording_lock);
+		writer_running = false;
+		uv_cond_signal(&recording_cond);
+	}
+
+	// The writer thread writes what's left in the buffer before it exits
+	uv_thread_join(&writer_thread);
+	recording_file.close();
+
+	if (recording_dropped) {
+		LOGWARN(1, recording_dropped << " records were dropped because the disk was too slow");
+	}
+
+	LOGINFO(1, "recording stopped, " << recording_size << " bytes written");
+}
+
+uint32_t new_connection_id()
+{
+	return ++connection_id_counter;
+}
+
+void record(Source source, uint32_t connection_id, const void* data, size_t size)
+{
+	if (!is_recording() || (size > std::numeric_limits<uint32_t>::max())) {
+		return;
+	}
+
+	uint8_t header[RECORD_HEADER_SIZE];
+
+	MutexLock lock(recording_lock);
+
+	if (!writer_running) {
+		return;
+	}
+
+	if (recording_buf.size() + sizeof(header) + size > MAX_BUFFERED_SIZE) {
+		++recording_dropped;
+		return;
+	}
+
+	// Timestamps are taken under the lock, so they never go backwards in the file
+	const uint64_t timestamp = metrics::now_us() - recording_start_time;
+	const uint32_t n = static_cast<uint32_t>(size);
+
+	uint8_t* p = header;
+	memcpy(p, &timestamp, sizeof(timestamp)); p += sizeof(timestamp);
+	*(p++) = source;
+	memcpy(p, &connection_id, sizeof(connection_id)); p += sizeof(connection_id);
+	memcpy(p, &n, sizeof(n));
+
+	recording_buf.insert(recording_buf.end(), header, header + sizeof(header));
+	recording_buf.insert(recording_buf.end(), reinterpret_cast<const uint8_t*>(data), reinterpret_cast<const uint8_t*>(data) + size);
+	recording_size += sizeof(header) + size;
+
+	if (recording_buf.size() >= FLUSH_SIZE) {
+		uv_cond_signal(&recording_cond);
+	}
+}
+
+Reader::Reader(const std::string& path)
+	: m_file(path, std::ios::binary | std::ios::in)
+	, m_valid(false)
+{
+	char signature[sizeof(SIGNATURE)];
+	if (m_file.is_open() && m_file.read(signature, sizeof(signature)) && (memcmp(signature, SIGNATURE, sizeof(SIGNATURE)) == 0)) {
+		m_valid = true;
+	}
+}
+
+bool Reader::next(Record& record)
+{
+	if (!m_valid) {
+		return false;
+	}
+
+	uint8_t header[RECORD_HEADER_SIZE];
+	if (!m_file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+		m_valid = false;
+		return false;
+	}
+
+	const uint8_t* p = header;
+	uint32_t size;
+
+	memcpy(&record.timestamp, p, sizeof(record.timestamp)); p += sizeof(record.timestamp);
+	record.source = static_cast<Source>(*(p++));
+	memcpy(&record.connection_id, p, sizeof(record.connection_id)); p += sizeof(record.connection_id);
+	memcpy(&size, p, sizeof(size));
+
+	record.data.resize(size);
+	if (size && !m_file.read(reinterpret_cast<char*>(record.data.data()), size)) {
+		m_valid = false;
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace traffic
+
+} // namespace p2pool
@@ -0,0 +1,76 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "uv_util.h"
+#include <fstream>
+
+namespace p2pool {
+
+// Recording of the traffic p2pool receives (ZMQ messages from monerod and P2P messages from peers) for offline replay
+// File format: 8-byte signature, then records of { uint64_t timestamp, uint8_t source, uint32_t connection_id, uint32_t size, data[size] }
+// Timestamps are in microseconds since the start of the recording, all numbers are little-endian
+namespace traffic {
+
+enum Source : uint8_t {
+	ZMQ = 0,
+	P2P = 1,
+};
+
+static constexpr char SIGNATURE[8] = { 'P', '2', 'P', 'T', 'R', 'F', '0', '1' };
+static constexpr size_t RECORD_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t);
+
+extern std::atomic<bool> recording;
+
+bool start_recording(const std::string& path);
+void stop_recording();
+
+FORCEINLINE bool is_recording() { return recording.load(std::memory_order_relaxed); }
+
+// P2P messages are recorded one complete message per record, with a connection id unique for the whole recording
+// ZMQ messages are recorded with the index of the monerod host they came from as the connection id
+uint32_t new_connection_id();
+void record(Source source, uint32_t connection_id, const void* data, size_t size);
+
+struct Record
+{
+	uint64_t timestamp;
+	Source source;
+	uint32_t connection_id;
+	std::vector<uint8_t> data;
+};
+
+class Reader : public nocopy_nomove
+{
+public:
+	explicit Reader(const std::string& path);
+
+	bool valid() const { return m_valid; }
+
+	// Returns false at the end of the file or if the file is corrupted
+	bool next(Record& record);
+
+private:
+	std::ifstream m_file;
+	bool m_valid;
+};
+
+} // namespace traffic
+
+} // namespace p2pool
@@ -25,6 +25,13 @@
 #include <sched.h>
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define HEX_ENCODE_SSE2
+#ifndef _MSC_VER
+#include <emmintrin.h>
+#endif
+#endif
+
 static constexpr char log_category_prefix[] = "Util ";
 
 namespace p2pool {
@@ -180,6 +187,39 @@ std::ostream& operator<<(std::ostream& s, const hash& h)
 	return s;
 }
 
+void hex_encode(const uint8_t* data, size_t size, char* out)
+{
+	size_t i = 0;
+
+#ifdef HEX_ENCODE_SSE2
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i digits = _mm_set1_epi8('0');
+	const __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+
+	// 16 bytes at a time: split them into nibbles, interleave high and low nibbles, then map 0-9 to '0'-'9' and 10-15 to 'a'-'f'
+	for (; i + 16 <= size; i += 16) {
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+		const __m128i lo = _mm_and_si128(x, mask);
+
+		__m128i a = _mm_unpacklo_epi8(hi, lo);
+		__m128i b = _mm_unpackhi_epi8(hi, lo);
+
+		a = _mm_add_epi8(_mm_add_epi8(a, digits), _mm_and_si128(_mm_cmpgt_epi8(a, nine), letters));
+		b = _mm_add_epi8(_mm_add_epi8(b, digits), _mm_and_si128(_mm_cmpgt_epi8(b, nine), letters));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2), a);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2 + 16), b);
+	}
+#endif
+
+	for (; i < size; ++i) {
+		out[i * 2] = "0123456789abcdef"[data[i] >> 4];
+		out[i * 2 + 1] = "0123456789abcdef"[data[i] & 15];
+	}
+}
+
 std::istream& operator>>(std::istream& s, hash& h)
 {
 	memset(h.h, 0, HASH_SIZE);
@@ -223,6 +263,15 @@ void uv_rwlock_init_checked(uv_rwlock_t* lock)
 	}
 }
 
+void uv_cond_init_checked(uv_cond_t* cond)
+{
+	const int result = uv_cond_init(cond);
+	if (result) {
+		LOGERR(1, "failed to create condition variable, error " << uv_err_name(result));
+		panic();
+	}
+}
+
 uv_loop_t* uv_default_loop_checked()
 {
 	if (!is_main_thread()) {
@@ -245,6 +294,8 @@ struct BackgroundJobTracker::Impl
 	{
 		MutexLock lock(m_lock);
 
+		decrement(m_queued, name);
+
 		auto it = m_jobs.insert({ name, 1 });
 		if (!it.second) {
 			++it.first->second;
@@ -287,6 +338,45 @@ struct BackgroundJobTracker::Impl
 		} while (1);
 	}
 
+	void queue(const char* name)
+	{
+		MutexLock lock(m_lock);
+
+		auto it = m_queued.insert({ name, 1 });
+		if (!it.second) {
+			++it.first->second;
+		}
+	}
+
+	void unqueue(const char* name)
+	{
+		MutexLock lock(m_lock);
+		decrement(m_queued, name);
+	}
+
+	static void decrement(std::map<std::string, int32_t>& jobs, const char* name)
+	{
+		auto it = jobs.find(name);
+		if ((it != jobs.end()) && (--it->second <= 0)) {
+			jobs.erase(it);
+		}
+	}
+
+	void print_queues()
+	{
+		MutexLock lock(m_lock);
+
+		char buf[log::Stream::BUF_SIZE + 1];
+		log::Stream s(buf);
+
+		for (const auto& job : m_queued) {
+			s << '\n' << job.first << " (" << job.second << ')';
+		}
+
+		LOGINFO(0, "UV threadpool: " << uv_threadpool_size() << " threads, " << m_jobs.size() << " kinds of jobs running, " <<
+			(m_queued.empty() ? "no jobs waiting" : "jobs waiting for a free thread:") << log::const_buf(buf, s.m_pos));
+	}
+
 	void print_status()
 	{
 		MutexLock lock(m_lock);
@@ -307,6 +397,7 @@ struct BackgroundJobTracker::Impl
 
 	uv_mutex_t m_lock;
 	std::map<std::string, int32_t> m_jobs;
+	std::map<std::string, int32_t> m_queued;
 };
 
 BackgroundJobTracker::BackgroundJobTracker() : m_impl(new Impl())
@@ -338,8 +429,185 @@ void BackgroundJobTracker::print_status()
 	m_impl->print_status();
 }
 
+void BackgroundJobTracker::queue(const char* name)
+{
+	m_impl->queue(name);
+}
+
+void BackgroundJobTracker::unqueue(const char* name)
+{
+	m_impl->unqueue(name);
+}
+
+void BackgroundJobTracker::print_queues()
+{
+	m_impl->print_queues();
+}
+
+uint32_t uv_threadpool_size()
+{
+	uint32_t result = 4;
+
+	const char* s = getenv("UV_THREADPOOL_SIZE");
+	if (s) {
+		const int n = atoi(s);
+		if (n > 0) {
+			result = static_cast<uint32_t>(n);
+		}
+	}
+
+	return std::min(result, 1024U);
+}
+
 BackgroundJobTracker bkg_jobs_tracker;
 
+struct ParallelRun : public nocopy_nomove
+{
+	ParallelRun()
+		: m_job(nullptr)
+		, m_numJobs(0)
+		, m_nextJob(0)
+		, m_generation(0)
+		, m_busyThreads(0)
+		, m_stopped(false)
+	{
+		uv_mutex_init_checked(&m_runLock);
+		uv_mutex_init_checked(&m_lock);
+		uv_cond_init_checked(&m_wakeCond);
+		uv_cond_init_checked(&m_doneCond);
+
+		const uint32_t n = std::max(std::thread::hardware_concurrency(), 1U) - 1;
+		m_threads.reserve(n);
+
+		for (uint32_t i = 0; i < n; ++i) {
+			uv_thread_t t;
+			const int err = uv_thread_create(&t, worker, this);
+			if (err) {
+				LOGWARN(1, "parallel_run: failed to start a thread, error " << uv_err_name(err));
+				break;
+			}
+			m_threads.push_back(t);
+		}
+	}
+
+	~ParallelRun()
+	{
+		uv_mutex_lock(&m_lock);
+		m_stopped = true;
+		uv_cond_broadcast(&m_wakeCond);
+		uv_mutex_unlock(&m_lock);
+
+		for (uv_thread_t& t : m_threads) {
+			uv_thread_join(&t);
+		}
+
+		uv_cond_destroy(&m_doneCond);
+		uv_cond_destroy(&m_wakeCond);
+		uv_mutex_destroy(&m_lock);
+		uv_mutex_destroy(&m_runLock);
+	}
+
+	void take_jobs()
+	{
+		for (uint32_t i = m_nextJob.fetch_add(1); i < m_numJobs; i = m_nextJob.fetch_add(1)) {
+			(*m_job)(i);
+		}
+	}
+
+	static void worker(void* arg) { reinterpret_cast<ParallelRun*>(arg)->worker_loop(); }
+
+	void worker_loop()
+	{
+		uv_mutex_lock(&m_lock);
+
+		uint64_t generation = m_generation;
+
+		for (;;) {
+			while (!m_stopped && (!m_job || (m_generation == generation))) {
+				uv_cond_wait(&m_wakeCond, &m_lock);
+			}
+
+			if (m_stopped) {
+				break;
+			}
+
+			generation = m_generation;
+			++m_busyThreads;
+
+			uv_mutex_unlock(&m_lock);
+			take_jobs();
+			uv_mutex_lock(&m_lock);
+
+			if (--m_busyThreads == 0) {
+				uv_cond_signal(&m_doneCond);
+			}
+		}
+
+		uv_mutex_unlock(&m_lock);
+	}
+
+	void run(uint32_t num_jobs, const std::function<void(uint32_t)>& job)
+	{
+		if ((num_jobs <= 1) || m_threads.empty() || (uv_mutex_trylock(&m_runLock) != 0)) {
+			for (uint32_t i = 0; i < num_jobs; ++i) {
+				job(i);
+			}
+			return;
+		}
+
+		uv_mutex_lock(&m_lock);
+		m_job = &job;
+		m_numJobs = num_jobs;
+		m_nextJob = 0;
+		++m_generation;
+		uv_cond_broadcast(&m_wakeCond);
+		uv_mutex_unlock(&m_lock);
+
+		take_jobs();
+
+		// Threads which didn't wake up before this point see m_job == nullptr and don't touch this job anymore
+		uv_mutex_lock(&m_lock);
+		while (m_busyThreads > 0) {
+			uv_cond_wait(&m_doneCond, &m_lock);
+		}
+		m_job = nullptr;
+		uv_mutex_unlock(&m_lock);
+
+		uv_mutex_unlock(&m_runLock);
+	}
+
+	uv_mutex_t m_runLock;
+
+	uv_mutex_t m_lock;
+	uv_cond_t m_wakeCond;
+	uv_cond_t m_doneCond;
+
+	const std::function<void(uint32_t)>* m_job;
+	uint32_t m_numJobs;
+	std::atomic<uint32_t> m_nextJob;
+	uint64_t m_generation;
+	uint32_t m_busyThreads;
+	bool m_stopped;
+
+	std::vector<uv_thread_t> m_threads;
+};
+
+static ParallelRun& parallel_runner()
+{
+	static ParallelRun runner;
+	return runner;
+}
+
+void parallel_run(uint32_t num_jobs, const std::function<void(uint32_t)>& job)
+{
+	parallel_runner().run(num_jobs, job);
+}
+
+uint32_t parallel_run_threads()
+{
+	return static_cast<uint32_t>(parallel_runner().m_threads.size() + 1);
+}
+
 static thread_local bool main_thread = false;
 void set_main_thread() { main_thread = true; }
 bool is_main_thread() { return main_thread; }
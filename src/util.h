@@ -47,6 +47,23 @@ struct nocopy_nomove
 	nocopy_nomove& operator=(nocopy_nomove&&) = delete;
 };
 
+// Immutable payload shared by many owners without copying it: blocks and everyone sending or storing them, network writes to many clients
+// Every owner holds a reference, the last one to release it frees it
+struct SharedBuf : public nocopy_nomove
+{
+	explicit FORCEINLINE SharedBuf(std::vector<uint8_t>&& data) : m_data(std::move(data)), m_refCount(1) {}
+
+	FORCEINLINE void add_ref() { ++m_refCount; }
+	FORCEINLINE void release() { if (--m_refCount == 0) delete this; }
+
+	const std::vector<uint8_t> m_data;
+
+private:
+	~SharedBuf() {}
+
+	std::atomic<uint32_t> m_refCount;
+};
+
 template<typename T>
 struct ScopeGuard
 {
@@ -87,6 +104,9 @@ static FORCEINLINE bool from_hex(char c, T& out_value) {
 	return false;
 }
 
+// Writes 2 * size lowercase hex characters to out, no terminating '\0'
+void hex_encode(const uint8_t* data, size_t size, char* out);
+
 template<typename T, bool is_signed> struct abs_helper {};
 template<typename T> struct abs_helper<T, false> { static FORCEINLINE T value(T x) { return x; } };
 template<typename T> struct abs_helper<T, true>  { static FORCEINLINE T value(T x) { return (x >= 0) ? x : -x; } };
@@ -109,6 +129,31 @@ FORCEINLINE void writeVarint(T value, std::vector<uint8_t>& out)
 	writeVarint(value, [&out](uint8_t b) { out.emplace_back(b); });
 }
 
+// Returns the pointer past the varint, or nullptr if it's truncated or doesn't fit into T
+template<typename T>
+FORCEINLINE const uint8_t* readVarint(const uint8_t* data, const uint8_t* data_end, T& b)
+{
+	uint64_t result = 0;
+	int k = 0;
+
+	while (data < data_end) {
+		if (k >= static_cast<int>(sizeof(T)) * 8) {
+			return nullptr;
+		}
+
+		const uint64_t cur_byte = *(data++);
+		result |= (cur_byte & 0x7F) << k;
+		k += 7;
+
+		if ((cur_byte & 0x80) == 0) {
+			b = static_cast<T>(result);
+			return data;
+		}
+	}
+
+	return nullptr;
+}
+
 template<typename T, size_t N> FORCEINLINE constexpr size_t array_size(T(&)[N]) { return N; }
 template<typename T, typename U, size_t N> FORCEINLINE constexpr size_t array_size(T(U::*)[N]) { return N; }
 
@@ -127,6 +172,12 @@ public:
 	void wait();
 	void print_status();
 
+	// Jobs submitted to the UV threadpool which haven't started yet, start() with the same name takes one of them off the queue
+	// unqueue() is for jobs which couldn't be submitted after all
+	void queue(const char* name);
+	void unqueue(const char* name);
+	void print_queues();
+
 private:
 	struct Impl;
 	Impl* m_impl;
@@ -134,6 +185,17 @@ private:
 
 extern BackgroundJobTracker bkg_jobs_tracker;
 
+// Number of UV threadpool threads (UV_THREADPOOL_SIZE environment variable, 4 by default)
+uint32_t uv_threadpool_size();
+
+// Runs job(i) for every i in [0, num_jobs) on a set of threads which is started once, the calling thread also takes jobs and returns when all of them are done
+// It's for short CPU bound jobs on hot paths: UV threadpool can't be used because callers often run on it already and would wait for their own jobs
+// All jobs run on the calling thread if another parallel_run() is in progress or if no threads could be started
+void parallel_run(uint32_t num_jobs, const std::function<void(uint32_t)>& job);
+
+// Number of threads parallel_run() uses, including the calling thread
+uint32_t parallel_run_threads();
+
 void set_main_thread();
 bool is_main_thread();
 
@@ -59,6 +59,7 @@ typedef RWLock<true> WriteLock;
 
 void uv_mutex_init_checked(uv_mutex_t* mutex);
 void uv_rwlock_init_checked(uv_rwlock_t* lock);
+void uv_cond_init_checked(uv_cond_t* cond);
 uv_loop_t* uv_default_loop_checked();
 
 } // namespace p2pool
@@ -27,6 +27,8 @@ extern "C" {
 #include "crypto-ops.h"
 }
 
+static constexpr char log_category_prefix[] = "Wallet ";
+
 namespace {
 
 // public keys: 64 bytes -> 88 characters in base58
@@ -79,16 +81,137 @@ static_assert(rev_alphabet.num_symbols == 58, "Check alphabet");
 
 namespace p2pool {
 
-Wallet::Wallet(const char* address)
+// Interned spend public keys: every distinct one which is in use gets a small id
+// Ids are reference counted by the wallets which have them and are reused when the last of these wallets is gone
+// Copying and destroying wallets only changes the atomic counter, the lock is taken when an id is allocated or freed
+struct WalletIds
+{
+	// Entries are allocated in chunks which never move, so they can be used without the lock
+	enum { CHUNK_SIZE = 1024, MAX_CHUNKS = 4096 };
+
+	WalletIds() : m_chunks{}, m_size(1)
+	{
+		uv_mutex_init_checked(&m_lock);
+		m_chunks[0] = new Entry[CHUNK_SIZE];
+	}
+
+	~WalletIds()
+	{
+		for (std::atomic<Entry*>& chunk : m_chunks) {
+			delete[] chunk.load();
+		}
+		uv_mutex_destroy(&m_lock);
+	}
+
+	uint32_t acquire(const hash& spend_pub_key)
+	{
+		MutexLock lock(m_lock);
+
+		auto it = m_ids.find(spend_pub_key);
+		if (it != m_ids.end()) {
+			// It can be at 0 here if the last wallet is being destroyed, release() checks it again under the lock
+			entry(it->second).m_refs.fetch_add(1);
+			return it->second;
+		}
+
+		uint32_t id;
+		if (!m_freeIds.empty()) {
+			id = m_freeIds.back();
+			m_freeIds.pop_back();
+		}
+		else {
+			id = m_size.load();
+			if (id >= CHUNK_SIZE * MAX_CHUNKS) {
+				LOGERR(1, "too many wallet ids in use. Fix the code!");
+				panic();
+			}
+			if (!m_chunks[id / CHUNK_SIZE].load()) {
+				m_chunks[id / CHUNK_SIZE].store(new Entry[CHUNK_SIZE]);
+			}
+			m_size.store(id + 1);
+		}
+
+		Entry& e = entry(id);
+		e.m_key = spend_pub_key;
+		e.m_refs.store(1);
+
+		m_ids.emplace(spend_pub_key, id);
+		return id;
+	}
+
+	// The caller already has a reference, so the counter can't be 0 here
+	void add_ref(uint32_t id)
+	{
+		if (id) {
+			entry(id).m_refs.fetch_add(1);
+		}
+	}
+
+	void release(uint32_t id)
+	{
+		if (!id) {
+			return;
+		}
+
+		Entry& e = entry(id);
+		if (e.m_refs.fetch_sub(1) != 1) {
+			return;
+		}
+
+		MutexLock lock(m_lock);
+
+		// acquire() could have taken it again, or another release() could have freed it already
+		if (e.m_refs.load() != 0) {
+			return;
+		}
+
+		auto it = m_ids.find(e.m_key);
+		if ((it != m_ids.end()) && (it->second == id)) {
+			m_ids.erase(it);
+			m_freeIds.push_back(id);
+		}
+	}
+
+	FORCEINLINE uint32_t size() const { return m_size.load(); }
+
+	struct Entry
+	{
+		hash m_key;
+		std::atomic<uint32_t> m_refs{ 0 };
+	};
+
+	FORCEINLINE Entry& entry(uint32_t id) { return m_chunks[id / CHUNK_SIZE].load()[id % CHUNK_SIZE]; }
+
+	uv_mutex_t m_lock;
+	std::atomic<Entry*> m_chunks[MAX_CHUNKS];
+	std::atomic<uint32_t> m_size;
+
+	unordered_map<hash, uint32_t> m_ids;
+	std::vector<uint32_t> m_freeIds;
+};
+
+static WalletIds& wallet_ids()
+{
+	static WalletIds ids;
+	return ids;
+}
+
+uint32_t Wallet::num_ids()
+{
+	return wallet_ids().size();
+}
+
+Wallet::Wallet(const char* address) : m_id(0)
 {
 	decode(address);
 }
 
 Wallet::~Wallet()
 {
+	wallet_ids().release(m_id);
 }
 
-Wallet::Wallet(const Wallet& w)
+Wallet::Wallet(const Wallet& w) : m_id(0)
 {
 	operator=(w);
 }
@@ -106,12 +229,20 @@ Wallet& Wallet::operator=(const Wallet& w)
 	m_checksum = w.m_checksum;
 	m_type = w.m_type;
 
+	if (m_id != w.m_id) {
+		wallet_ids().add_ref(w.m_id);
+		wallet_ids().release(m_id);
+		m_id = w.m_id;
+	}
+
 	return *this;
 }
 
 bool Wallet::decode(const char* address)
 {
 	m_type = NetworkType::Invalid;
+	wallet_ids().release(m_id);
+	m_id = 0;
 
 	if (!address || (strlen(address) != ADDRESS_LENGTH)) {
 		return false;
@@ -179,6 +310,10 @@ bool Wallet::decode(const char* address)
 		m_type = NetworkType::Invalid;
 	}
 
+	if (valid()) {
+		m_id = wallet_ids().acquire(m_spendPublicKey);
+	}
+
 	return valid();
 }
 
@@ -196,6 +331,10 @@ bool Wallet::assign(const hash& spend_pub_key, const hash& view_pub_key, Network
 
 	m_type = type;
 
+	const uint32_t old_id = m_id;
+	m_id = wallet_ids().acquire(spend_pub_key);
+	wallet_ids().release(old_id);
+
 	return true;
 }
 
@@ -39,6 +39,14 @@ public:
 	FORCEINLINE const hash& spend_public_key() const { return m_spendPublicKey; }
 	FORCEINLINE const hash& view_public_key() const { return m_viewPublicKey; }
 
+	// Small number which is the same for all wallets with this spend public key, 0 for invalid wallets
+	// An id stays the same while any wallet with this spend public key exists and can be reused after that, so per-wallet data can be kept in arrays indexed by id
+	// Ids are small because only the wallets which are in use have them
+	FORCEINLINE uint32_t id() const { return m_id; }
+
+	// All wallet ids in use are less than this
+	static uint32_t num_ids();
+
 	bool get_eph_public_key(const hash& txkey_sec, size_t output_index, hash& eph_public_key) const;
 
 	FORCEINLINE bool operator<(const Wallet& w) const { return m_spendPublicKey < w.m_spendPublicKey; }
@@ -50,6 +58,7 @@ private:
 	hash m_viewPublicKey;
 	uint32_t m_checksum;
 	NetworkType m_type;
+	uint32_t m_id;
 };
 
 } // namespace p2pool
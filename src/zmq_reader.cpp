@@ -18,22 +18,368 @@
 #include "common.h"
 #include "zmq_reader.h"
 #include "json_parsers.h"
+#include "traffic.h"
 #include <rapidjson/document.h>
+#include <rapidjson/memorystream.h>
+#include <rapidjson/encodedstream.h>
 #include <random>
 
 static constexpr char log_category_prefix[] = "ZMQReader ";
 
 namespace p2pool {
 
-ZMQReader::ZMQReader(const char* address, uint32_t zmq_port, MinerCallbackHandler* handler)
-	: m_address(address)
-	, m_zmqPort(zmq_port)
-	, m_handler(handler)
+namespace {
+
+template<size_t N>
+FORCEINLINE bool key_is(const char* s, rapidjson::SizeType len, const char (&name)[N])
+{
+	return (len == N - 1) && (memcmp(s, name, N - 1) == 0);
+}
+
+bool parse_hash(const char* s, rapidjson::SizeType len, hash& out_value)
+{
+	if (len != HASH_SIZE * 2) {
+		return false;
+	}
+
+	for (size_t i = 0; i < HASH_SIZE; ++i) {
+		uint8_t d[2];
+		if (!from_hex(s[i * 2], d[0]) || !from_hex(s[i * 2 + 1], d[1])) {
+			return false;
+		}
+		out_value.h[i] = (d[0] << 4) | d[1];
+	}
+
+	return true;
+}
+
+bool parse_difficulty(const char* s, rapidjson::SizeType len, difficulty_type& out_value)
+{
+	if ((len >= 2) && (s[0] == '0') && (s[1] == 'x')) {
+		s += 2;
+		len -= 2;
+	}
+
+	out_value.lo = 0;
+	out_value.hi = 0;
+
+	for (rapidjson::SizeType i = 0; i < len; ++i) {
+		uint8_t d;
+		if (!from_hex(s[i], d)) {
+			return false;
+		}
+		out_value.hi = (out_value.hi << 4) | (out_value.lo >> 60);
+		out_value.lo = (out_value.lo << 4) | d;
+	}
+
+	return true;
+}
+
+// json-minimal-txpool_add: [{"id":"...","blob_size":N,"weight":N,"fee":N}, ...]
+// Transactions are collected in txs, they're passed to the callback handler only if the whole message parses
+struct TxpoolAddHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, TxpoolAddHandler>
+{
+	enum Field : uint32_t {
+		NONE      = 0,
+		ID        = 1 << 0,
+		BLOB_SIZE = 1 << 1,
+		WEIGHT    = 1 << 2,
+		FEE       = 1 << 3,
+		ALL       = ID | BLOB_SIZE | WEIGHT | FEE,
+	};
+
+	TxpoolAddHandler(TxMempoolData& tx, std::vector<TxMempoolData>& txs) : m_tx(tx), m_txs(txs), m_depth(0), m_key(NONE), m_fields(0), m_index(0) {}
+
+	// Top level must be an array, anything else stops the parser
+	bool Default() { m_key = NONE; return m_depth > 0; }
+
+	bool StartArray() { ++m_depth; m_key = NONE; return true; }
+	bool EndArray(rapidjson::SizeType) { --m_depth; m_key = NONE; return true; }
+
+	bool StartObject()
+	{
+		// Top level must be an array
+		if (m_depth == 0) {
+			return false;
+		}
+
+		if (++m_depth == 2) {
+			m_fields = 0;
+		}
+
+		m_key = NONE;
+		return true;
+	}
+
+	bool EndObject(rapidjson::SizeType)
+	{
+		if (m_depth-- == 2) {
+			++m_index;
+			if (m_fields == ALL) {
+				m_txs.push_back(m_tx);
+			}
+			else {
+				LOGWARN(1, "transaction #" << m_index << " in json-minimal-txpool_add failed to parse, skipped it");
+			}
+		}
+
+		m_key = NONE;
+		return true;
+	}
+
+	bool Key(const char* s, rapidjson::SizeType len, bool)
+	{
+		m_key = NONE;
+
+		if (m_depth == 2) {
+			if (key_is(s, len, "id")) m_key = ID;
+			else if (key_is(s, len, "blob_size")) m_key = BLOB_SIZE;
+			else if (key_is(s, len, "weight")) m_key = WEIGHT;
+			else if (key_is(s, len, "fee")) m_key = FEE;
+		}
+
+		return true;
+	}
+
+	bool String(const char* s, rapidjson::SizeType len, bool)
+	{
+		if ((m_key == ID) && parse_hash(s, len, m_tx.id)) {
+			m_fields |= ID;
+		}
+
+		m_key = NONE;
+		return m_depth > 0;
+	}
+
+	bool Uint(unsigned value) { return Uint64(value); }
+
+	bool Uint64(uint64_t value)
+	{
+		bool ok = true;
+
+		switch (m_key) {
+		case BLOB_SIZE: m_tx.blob_size = value; break;
+		case WEIGHT:    m_tx.weight = value;    break;
+		case FEE:       m_tx.fee = value;       break;
+		default: ok = false; break;
+		}
+
+		if (ok) {
+			m_fields |= m_key;
+		}
+
+		m_key = NONE;
+		return m_depth > 0;
+	}
+
+	TxMempoolData& m_tx;
+	std::vector<TxMempoolData>& m_txs;
+
+	uint32_t m_depth;
+	Field m_key;
+	uint32_t m_fields;
+	uint32_t m_index;
+};
+
+// json-full-miner_data: {"major_version":N,"height":N,...,"tx_backlog":[{"id":"...","weight":N,"fee":N}, ...]}
+// tx_backlog is cleared and filled in place, so its capacity is reused from one block to another
+struct MinerDataHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, MinerDataHandler>
+{
+	enum Field : uint32_t {
+		NONE                    = 0,
+		MAJOR_VERSION           = 1 << 0,
+		HEIGHT                  = 1 << 1,
+		PREV_ID                 = 1 << 2,
+		SEED_HASH               = 1 << 3,
+		MEDIAN_WEIGHT           = 1 << 4,
+		ALREADY_GENERATED_COINS = 1 << 5,
+		DIFFICULTY              = 1 << 6,
+		TX_BACKLOG              = 1 << 7,
+		ALL = MAJOR_VERSION | HEIGHT | PREV_ID | SEED_HASH | MEDIAN_WEIGHT | ALREADY_GENERATED_COINS | DIFFICULTY,
+
+		// tx_backlog entries
+		TX_ID     = 1 << 8,
+		TX_WEIGHT = 1 << 9,
+		TX_FEE    = 1 << 10,
+		TX_ALL    = TX_ID | TX_WEIGHT | TX_FEE,
+	};
+
+	MinerDataHandler(MinerData& data, TxMempoolData& tx) : m_data(data), m_tx(tx), m_depth(0), m_inBacklog(false), m_key(NONE), m_fields(0), m_txFields(0), m_index(0) {}
+
+	bool Default() { m_key = NONE; return true; }
+
+	bool StartObject()
+	{
+		if ((++m_depth == 3) && m_inBacklog) {
+			m_txFields = 0;
+		}
+
+		m_key = NONE;
+		return true;
+	}
+
+	bool EndObject(rapidjson::SizeType)
+	{
+		if ((m_depth == 3) && m_inBacklog) {
+			++m_index;
+			if (m_txFields == TX_ALL) {
+				m_data.tx_backlog.push_back(m_tx);
+			}
+			else {
+				LOGWARN(1, "transaction #" << m_index << " in json-full-miner_data `tx_backlog` failed to parse, skipped it");
+			}
+		}
+
+		--m_depth;
+		m_key = NONE;
+		return true;
+	}
+
+	bool StartArray()
+	{
+		// Top level must be an object
+		if (m_depth == 0) {
+			return false;
+		}
+
+		if ((m_depth == 1) && (m_key == TX_BACKLOG)) {
+			m_inBacklog = true;
+			m_fields |= TX_BACKLOG;
+			m_data.tx_backlog.clear();
+		}
+
+		++m_depth;
+		m_key = NONE;
+		return true;
+	}
+
+	bool EndArray(rapidjson::SizeType)
+	{
+		if (--m_depth == 1) {
+			m_inBacklog = false;
+		}
+
+		m_key = NONE;
+		return true;
+	}
+
+	bool Key(const char* s, rapidjson::SizeType len, bool)
+	{
+		m_key = NONE;
+
+		if ((m_depth == 1) && !m_inBacklog) {
+			if (key_is(s, len, "major_version")) m_key = MAJOR_VERSION;
+			else if (key_is(s, len, "height")) m_key = HEIGHT;
+			else if (key_is(s, len, "prev_id")) m_key = PREV_ID;
+			else if (key_is(s, len, "seed_hash")) m_key = SEED_HASH;
+			else if (key_is(s, len, "median_weight")) m_key = MEDIAN_WEIGHT;
+			else if (key_is(s, len, "already_generated_coins")) m_key = ALREADY_GENERATED_COINS;
+			else if (key_is(s, len, "difficulty")) m_key = DIFFICULTY;
+			else if (key_is(s, len, "tx_backlog")) m_key = TX_BACKLOG;
+		}
+		else if ((m_depth == 3) && m_inBacklog) {
+			if (key_is(s, len, "id")) m_key = TX_ID;
+			else if (key_is(s, len, "weight")) m_key = TX_WEIGHT;
+			else if (key_is(s, len, "fee")) m_key = TX_FEE;
+		}
+
+		return true;
+	}
+
+	bool String(const char* s, rapidjson::SizeType len, bool)
+	{
+		bool ok = false;
+
+		switch (m_key) {
+		case PREV_ID:    ok = parse_hash(s, len, m_data.prev_id);          break;
+		case SEED_HASH:  ok = parse_hash(s, len, m_data.seed_hash);        break;
+		case DIFFICULTY: ok = parse_difficulty(s, len, m_data.difficulty); break;
+		case TX_ID:      ok = parse_hash(s, len, m_tx.id);                 break;
+		default: break;
+		}
+
+		if (ok) {
+			set_field(m_key);
+		}
+
+		m_key = NONE;
+		return true;
+	}
+
+	bool Uint(unsigned value)
+	{
+		if (m_key == MAJOR_VERSION) {
+			m_data.major_version = static_cast<uint8_t>(value);
+			set_field(m_key);
+			m_key = NONE;
+			return true;
+		}
+		return Uint64(value);
+	}
+
+	bool Uint64(uint64_t value)
+	{
+		bool ok = true;
+
+		switch (m_key) {
+		case HEIGHT:                  m_data.height = value;                  break;
+		case MEDIAN_WEIGHT:           m_data.median_weight = value;           break;
+		case ALREADY_GENERATED_COINS: m_data.already_generated_coins = value; break;
+		case TX_WEIGHT:               m_tx.weight = value;                    break;
+		case TX_FEE:                  m_tx.fee = value;                       break;
+		default: ok = false; break;
+		}
+
+		if (ok) {
+			set_field(m_key);
+		}
+
+		m_key = NONE;
+		return true;
+	}
+
+	FORCEINLINE void set_field(Field f)
+	{
+		if (f >= TX_ID) {
+			m_txFields |= f;
+		}
+		else {
+			m_fields |= f;
+		}
+	}
+
+	MinerData& m_data;
+	TxMempoolData& m_tx;
+
+	uint32_t m_depth;
+	bool m_inBacklog;
+	Field m_key;
+	uint32_t m_fields;
+	uint32_t m_txFields;
+	uint32_t m_index;
+};
+
+} // namespace
+
+ZMQParser::ZMQParser(MinerCallbackHandler* handler)
+	: m_handler(handler)
 	, m_tx()
+	, m_txpoolAdd()
 	, m_minerData()
 	, m_chainmainData()
 {
-	for (uint32_t i = m_publisherPort; i < std::numeric_limits<uint16_t>::max(); ++i) {
+}
+
+ZMQReader::ZMQReader(const char* address, uint32_t zmq_port, uint32_t host_index, MinerCallbackHandler* handler)
+	: m_address(address)
+	, m_zmqPort(zmq_port)
+	, m_hostIndex(host_index)
+	, m_parser(handler)
+{
+	// Readers for different monerod hosts are created one after another on the main thread, each takes the next free port
+	static uint32_t next_publisher_port = m_publisherPort;
+
+	for (uint32_t i = next_publisher_port; i < std::numeric_limits<uint16_t>::max(); ++i) {
 		try {
 			m_publisherPort = 0;
 
@@ -41,6 +387,7 @@ ZMQReader::ZMQReader(const char* address, uint32_t zmq_port, MinerCallbackHandle
 			snprintf(addr, sizeof(addr), "tcp://127.0.0.1:%u", i);
 			m_publisher.bind(addr);
 			m_publisherPort = static_cast<uint16_t>(i);
+			next_publisher_port = i + 1;
 			break;
 		}
 		catch (const std::exception& e) {
@@ -120,7 +467,14 @@ void ZMQReader::run()
 				break;
 			}
 
-			parse(reinterpret_cast<char*>(zmq_msg_data(&message)), zmq_msg_size(&message));
+			char* data = reinterpret_cast<char*>(zmq_msg_data(&message));
+			const size_t size = zmq_msg_size(&message);
+
+			if (traffic::is_recording()) {
+				traffic::record(traffic::ZMQ, m_hostIndex, data, size);
+			}
+
+			m_parser.parse(data, size);
 		} while (true);
 
 		zmq_msg_close(&message);
@@ -177,7 +531,7 @@ bool ZMQReader::connect(const char* address)
 	return true;
 }
 
-void ZMQReader::parse(char* data, size_t size)
+void ZMQParser::parse(char* data, size_t size)
 {
 	char* value = data;
 	char* end = data + size;
@@ -196,77 +550,71 @@ void ZMQReader::parse(char* data, size_t size)
 
 	using namespace rapidjson;
 
-	Document doc;
-	if (doc.Parse<rapidjson::kParseCommentsFlag | rapidjson::kParseTrailingCommasFlag>(value, end - value).HasParseError()) {
-		LOGWARN(1, "ZeroMQ message failed to parse, skipping it");
-		return;
-	}
+	constexpr unsigned int parse_flags = kParseCommentsFlag | kParseTrailingCommasFlag;
 
 	if (strcmp(data, "json-minimal-txpool_add") == 0) {
-		if (!doc.IsArray()) {
-			LOGWARN(1, "json-minimal-txpool_add is not an array, skipping it");
-			return;
-		}
-
 		m_tx.time_received = time(nullptr);
 
-		for (SizeType i = 0, n = doc.Size(); i < n; ++i) {
-			const auto& v = doc[i];
-			if (PARSE(v, m_tx, id) && PARSE(v, m_tx, blob_size) && PARSE(v, m_tx, weight) && PARSE(v, m_tx, fee)) {
-				m_handler->handle_tx(m_tx);
+		MemoryStream ms(value, static_cast<size_t>(end - value));
+		EncodedInputStream<UTF8<>, MemoryStream> is(ms);
+		m_txpoolAdd.clear();
+		TxpoolAddHandler handler(m_tx, m_txpoolAdd);
+
+		const ParseResult result = m_reader.Parse<parse_flags>(is, handler);
+		if (result.IsError()) {
+			if (result.Code() == kParseErrorTermination) {
+				LOGWARN(1, "json-minimal-txpool_add is not an array, skipping it");
 			}
 			else {
-				LOGWARN(1, "transaction #" << (i + 1) << " in json-minimal-txpool_add failed to parse, skipped it");
+				LOGWARN(1, "ZeroMQ message failed to parse, skipping it");
 			}
-		}
-	}
-	else if (strcmp(data, "json-full-miner_data") == 0) {
-		if (!doc.IsObject()) {
-			LOGWARN(1, "json-full-miner_data is not an object, skipping it");
 			return;
 		}
 
-		if (!PARSE(doc, m_minerData, major_version) ||
-			!PARSE(doc, m_minerData, height) ||
-			!PARSE(doc, m_minerData, prev_id) ||
-			!PARSE(doc, m_minerData, seed_hash) ||
-			!PARSE(doc, m_minerData, median_weight) ||
-			!PARSE(doc, m_minerData, already_generated_coins) ||
-			!PARSE(doc, m_minerData, difficulty)) {
-			LOGWARN(1, "json-full-miner_data failed to parse, skipping it");
-			return;
+		for (TxMempoolData& tx : m_txpoolAdd) {
+			m_handler->handle_tx(tx);
 		}
+		return;
+	}
+
+	if (strcmp(data, "json-full-miner_data") == 0) {
+		MemoryStream ms(value, static_cast<size_t>(end - value));
+		EncodedInputStream<UTF8<>, MemoryStream> is(ms);
+		MinerDataHandler handler(m_minerData, m_tx);
 
-		if (!doc.HasMember("tx_backlog")) {
-			LOGWARN(1, "json-full-miner_data doesn't have 'tx_backlog', skipping it");
+		const ParseResult result = m_reader.Parse<parse_flags>(is, handler);
+		if (result.IsError()) {
+			if (result.Code() == kParseErrorTermination) {
+				LOGWARN(1, "json-full-miner_data is not an object, skipping it");
+			}
+			else {
+				LOGWARN(1, "ZeroMQ message failed to parse, skipping it");
+			}
 			return;
 		}
 
-		const auto& tx_backlog = doc["tx_backlog"];
-
-		if (!tx_backlog.IsArray()) {
-			LOGWARN(1, "'tx_backlog' in json-full-miner_data is not an array, skipping it");
+		if ((handler.m_fields & MinerDataHandler::ALL) != MinerDataHandler::ALL) {
+			LOGWARN(1, "json-full-miner_data failed to parse, skipping it");
 			return;
 		}
 
-		m_minerData.tx_backlog.clear();
-
-		const SizeType n = tx_backlog.Size();
-		m_minerData.tx_backlog.reserve(n);
-
-		for (SizeType i = 0; i < n; ++i) {
-			const auto& v = tx_backlog[i];
-			if (PARSE(v, m_tx, id) && PARSE(v, m_tx, weight) && PARSE(v, m_tx, fee)) {
-				m_minerData.tx_backlog.push_back(m_tx);
-			}
-			else {
-				LOGWARN(1, "transaction #" << (i + 1) << " in json-full-miner_data `tx_backlog` failed to parse, skipped it");
-			}
+		if (!(handler.m_fields & MinerDataHandler::TX_BACKLOG)) {
+			LOGWARN(1, "json-full-miner_data doesn't have 'tx_backlog' array, skipping it");
+			return;
 		}
 
 		m_handler->handle_miner_data(m_minerData);
+		return;
+	}
+
+	// chain_main messages are small (only the block header and miner tx), so they still go through the DOM
+	Document doc;
+	if (doc.Parse<parse_flags>(value, end - value).HasParseError()) {
+		LOGWARN(1, "ZeroMQ message failed to parse, skipping it");
+		return;
 	}
-	else if (strcmp(data, "json-full-chain_main") == 0) {
+
+	if (strcmp(data, "json-full-chain_main") == 0) {
 		if (!doc.IsArray()) {
 			LOGWARN(1, "json-full-chain_main is not an object, skipping it");
 			return;
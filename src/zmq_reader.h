@@ -19,12 +19,35 @@
 
 #include "uv_util.h"
 #include <zmq.hpp>
+#include <rapidjson/reader.h>
 
 namespace p2pool {
 
+// Parses messages published by monerod and passes them to the handler
+// It's separate from the socket handling, so recorded messages can be replayed through exactly the same code
+class ZMQParser {
+public:
+	explicit ZMQParser(MinerCallbackHandler* handler);
+
+	// Modifies the data in place
+	void parse(char* data, size_t size);
+
+private:
+	MinerCallbackHandler* m_handler;
+
+	// txpool_add and miner_data messages are parsed with SAX handlers straight into these structures,
+	// so the same reader stack and tx_backlog storage are reused for every message
+	rapidjson::Reader m_reader;
+
+	TxMempoolData m_tx;
+	std::vector<TxMempoolData> m_txpoolAdd;
+	MinerData m_minerData;
+	ChainMain m_chainmainData;
+};
+
 class ZMQReader {
 public:
-	ZMQReader(const char* address, uint32_t zmq_port, MinerCallbackHandler* handler);
+	ZMQReader(const char* address, uint32_t zmq_port, uint32_t host_index, MinerCallbackHandler* handler);
 	~ZMQReader();
 
 private:
@@ -32,11 +55,10 @@ private:
 	void run();
 	bool connect(const char* address);
 
-	void parse(char* data, size_t size);
-
 	const char* m_address;
 	uint32_t m_zmqPort;
-	MinerCallbackHandler* m_handler;
+	uint32_t m_hostIndex;
+	ZMQParser m_parser;
 
 	uv_thread_t m_worker{};
 	zmq::context_t m_context{ 1 };
@@ -44,10 +66,6 @@ private:
 	zmq::socket_t m_subscriber{ m_context, ZMQ_SUB };
 	uint16_t m_publisherPort = 37891;
 	std::atomic<int> m_finished{ 0 };
-
-	TxMempoolData m_tx;
-	MinerData m_minerData;
-	ChainMain m_chainmainData;
 };
 
 } // namespace p2pool
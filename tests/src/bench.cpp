@@ -0,0 +1,320 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "crypto.h"
+#include "keccak.h"
+#include "mempool.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include "wallet.h"
+#include <fstream>
+#include <random>
+#include <new>
+
+// Micro-benchmarks for the hot paths of template building and block verification
+// Usage: p2pool_bench [name filter ...]
+// Every benchmark is calibrated to run for at least MIN_SAMPLE_TIME_NS per sample, the median of NUM_SAMPLES samples is reported
+
+static std::atomic<uint64_t> num_allocations{ 0 };
+
+void* operator new(size_t size)
+{
+	num_allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { num_allocations.fetch_add(1, std::memory_order_relaxed); return malloc(size ? size : 1); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return operator new(size, std::nothrow); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+
+namespace p2pool {
+
+static constexpr uint64_t MIN_SAMPLE_TIME_NS = 50000000;
+static constexpr size_t NUM_SAMPLES = 7;
+
+// Results are folded into it so the compiler can't throw the benchmarked code away
+static volatile uint64_t sink = 0;
+
+static FORCEINLINE void consume(const hash& h) { sink = sink + *reinterpret_cast<const uint64_t*>(h.h); }
+static FORCEINLINE void consume(uint64_t x) { sink = sink + x; }
+
+static std::vector<const char*> filters;
+
+template<typename T>
+static void run(const char* name, T&& f)
+{
+	if (!filters.empty()) {
+		bool found = false;
+		for (const char* s : filters) {
+			if (strstr(name, s)) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			return;
+		}
+	}
+
+	// Warm up and find the number of iterations which takes at least MIN_SAMPLE_TIME_NS
+	uint64_t iterations = 1;
+	for (;;) {
+		const uint64_t t = uv_hrtime();
+		for (uint64_t i = 0; i < iterations; ++i) {
+			f();
+		}
+		const uint64_t dt = uv_hrtime() - t;
+
+		if (dt >= MIN_SAMPLE_TIME_NS) {
+			break;
+		}
+
+		iterations = (dt > 0) ? std::max<uint64_t>(iterations * 2, iterations * MIN_SAMPLE_TIME_NS / dt + 1) : iterations * 16;
+	}
+
+	double samples[NUM_SAMPLES];
+	uint64_t allocations = 0;
+
+	for (size_t k = 0; k < NUM_SAMPLES; ++k) {
+		const uint64_t a = num_allocations.load(std::memory_order_relaxed);
+		const uint64_t t = uv_hrtime();
+		for (uint64_t i = 0; i < iterations; ++i) {
+			f();
+		}
+		const uint64_t dt = uv_hrtime() - t;
+		allocations += num_allocations.load(std::memory_order_relaxed) - a;
+
+		samples[k] = static_cast<double>(dt) / iterations;
+	}
+
+	std::sort(samples, samples + NUM_SAMPLES);
+
+	printf("%-48s %14.1f %14.1f %12.2f\n", name, samples[NUM_SAMPLES / 2], samples[0], static_cast<double>(allocations) / (iterations * NUM_SAMPLES));
+	fflush(stdout);
+}
+
+static bool read_file(const char* file_name, std::vector<uint8_t>& buf)
+{
+	std::ifstream f(file_name, std::ios::binary | std::ios::ate);
+	if (!f.good() || !f.is_open()) {
+		fprintf(stderr, "Can't open %s\n", file_name);
+		return false;
+	}
+
+	buf.resize(f.tellg());
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(buf.data()), buf.size());
+
+	if (!f.good()) {
+		fprintf(stderr, "Can't read %s\n", file_name);
+		return false;
+	}
+
+	return true;
+}
+
+static void bench_keccak()
+{
+	uint8_t data[4096];
+	for (size_t i = 0; i < sizeof(data); ++i) {
+		data[i] = static_cast<uint8_t>(i * 31 + 7);
+	}
+
+	hash h;
+
+	run("keccak (76 bytes)", [&]() { keccak(data, 76, h.h, HASH_SIZE); consume(h); });
+	run("keccak (4096 bytes)", [&]() { keccak(data, sizeof(data), h.h, HASH_SIZE); consume(h); });
+	run("keccak_custom (76 bytes)", [&]() { keccak_custom([&data](int offset) { return data[offset]; }, 76, h.h, HASH_SIZE); consume(h); });
+
+	const uint8_t* in[4] = { data, data + 96, data + 192, data + 288 };
+	hash h4[4];
+	uint8_t* const md[4] = { h4[0].h, h4[1].h, h4[2].h, h4[3].h };
+	run("keccak_x4 (4 x 96 bytes)", [&]() { keccak_x4(in, HASH_SIZE * 3, md, HASH_SIZE); consume(h4[3]); });
+}
+
+static bool bench_pool_block()
+{
+	std::vector<uint8_t> buf;
+	if (!read_file("mainnet_test2_block.dat", buf)) {
+		return false;
+	}
+
+	SideChain sidechain(nullptr, NetworkType::Mainnet, "mainnet test 2");
+	PoolBlock b;
+
+	if (b.deserialize(buf.data(), buf.size(), sidechain) != 0) {
+		fprintf(stderr, "Failed to deserialize mainnet_test2_block.dat\n");
+		return false;
+	}
+
+	run("PoolBlock::deserialize", [&]() { consume(static_cast<uint64_t>(b.deserialize(buf.data(), buf.size(), sidechain))); });
+
+	// Same work as BlockTemplate::calc_miner_tx_hash(): prefix hash (everything but the last byte of miner tx) and then the hash of 3 partial hashes
+	// Input changes every iteration like it does with a new extra_nonce for each stratum job
+	const uint8_t* miner_tx = b.main_chain_data() + b.m_mainChainHeaderSize;
+	const int miner_tx_prefix_size = static_cast<int>(b.m_mainChainMinerTxSize - 1);
+	uint32_t extra_nonce = 0;
+
+	uint8_t hashes[HASH_SIZE * 3] = {};
+	hash h;
+
+	run("miner tx hash", [&]() {
+		const uint32_t nonce = ++extra_nonce;
+		keccak_custom([miner_tx, nonce](int offset) { return (offset < 4) ? static_cast<uint8_t>(miner_tx[offset] ^ (nonce >> (offset * 8))) : miner_tx[offset]; }, miner_tx_prefix_size, hashes, HASH_SIZE);
+		keccak(hashes, sizeof(hashes), h.h, HASH_SIZE);
+		consume(h);
+	});
+
+	return true;
+}
+
+static bool bench_sidechain()
+{
+	std::vector<uint8_t> buf;
+	if (!read_file("sidechain_dump.dat", buf)) {
+		return false;
+	}
+
+	SideChain sidechain(nullptr, NetworkType::Mainnet);
+
+	{
+		PoolBlock b;
+		for (const uint8_t *p = buf.data(), *e = buf.data() + buf.size(); p < e;) {
+			if (p + sizeof(uint32_t) > e) {
+				fprintf(stderr, "sidechain_dump.dat is corrupted\n");
+				return false;
+			}
+			const uint32_t n = *reinterpret_cast<const uint32_t*>(p);
+			p += sizeof(uint32_t);
+
+			if ((p + n > e) || (b.deserialize(p, n, sidechain) != 0)) {
+				fprintf(stderr, "sidechain_dump.dat is corrupted\n");
+				return false;
+			}
+			p += n;
+
+			sidechain.add_block(b);
+		}
+	}
+
+	const PoolBlock* tip = sidechain.chainTip();
+	if (!tip) {
+		fprintf(stderr, "sidechain_dump.dat didn't produce a chain tip\n");
+		return false;
+	}
+
+	Wallet w = tip->m_minerWallet;
+	hash txkey_pub, txkey_sec;
+	generate_keys(txkey_pub, txkey_sec);
+
+	PoolBlock block;
+	std::vector<MinerShare> shares;
+
+	run("SideChain::fill_sidechain_data", [&]() { sidechain.fill_sidechain_data(block, &w, txkey_sec, shares); consume(shares.size()); });
+
+	std::vector<uint64_t> rewards;
+	run("SideChain::split_reward", [&]() { SideChain::split_reward(600000000000ULL, shares, rewards); consume(rewards.size()); });
+
+	std::vector<hash> eph_public_keys;
+	size_t failed_index;
+
+	run("SideChain::get_eph_public_keys (cached)", [&]() { SideChain::get_eph_public_keys(txkey_sec, shares, eph_public_keys, failed_index); consume(eph_public_keys.size()); });
+	run("SideChain::get_eph_public_keys (uncached)", [&]() { clear_crypto_cache(); SideChain::get_eph_public_keys(txkey_sec, shares, eph_public_keys, failed_index); consume(eph_public_keys.size()); });
+
+	return true;
+}
+
+static void bench_mempool()
+{
+	constexpr uint64_t NUM_TRANSACTIONS = 5000;
+
+	Mempool mempool;
+	std::mt19937_64 rng(NUM_TRANSACTIONS);
+
+	const time_t cur_time = time(nullptr);
+
+	for (uint64_t i = 0; i < NUM_TRANSACTIONS; ++i) {
+		TxMempoolData tx;
+		keccak(reinterpret_cast<const uint8_t*>(&i), sizeof(i), tx.id.h, HASH_SIZE);
+		tx.blob_size = 1500 + (rng() % 3000);
+		tx.weight = tx.blob_size;
+		tx.fee = 20000 * tx.weight / 1000 + (rng() % 1000000);
+		tx.time_received = cur_time - static_cast<time_t>(rng() % 600);
+		mempool.add(tx);
+	}
+
+	std::vector<TxMempoolData> result;
+	size_t total_transactions;
+
+	run("Mempool::get_best_transactions (5000 tx)", [&]() { mempool.get_best_transactions(cur_time, NUM_TRANSACTIONS, result, total_transactions); consume(result.size()); });
+}
+
+static void bench_crypto()
+{
+	hash pub1, sec1, pub2, sec2, derivation;
+	generate_keys(pub1, sec1);
+	generate_keys(pub2, sec2);
+
+	run("generate_key_derivation (cached)", [&]() { generate_key_derivation(pub1, sec2, derivation); consume(derivation); });
+	run("generate_key_derivation (uncached)", [&]() { clear_crypto_cache(); generate_key_derivation(pub1, sec2, derivation); consume(derivation); });
+}
+
+} // namespace p2pool
+
+int main(int argc, char** argv)
+{
+	using namespace p2pool;
+
+	for (int i = 1; i < argc; ++i) {
+		filters.push_back(argv[i]);
+	}
+
+	init_crypto_cache();
+
+	printf("%-48s %14s %14s %12s\n", "benchmark", "ns/op (median)", "ns/op (min)", "allocs/op");
+
+	bench_keccak();
+	bench_crypto();
+	bench_mempool();
+
+	int result = 0;
+
+	if (!bench_pool_block()) {
+		result = 1;
+	}
+
+	if (!bench_sidechain()) {
+		result = 1;
+	}
+
+	destroy_crypto_cache();
+
+	return result;
+}
@@ -67,4 +67,80 @@ TEST(crypto, derivation)
 	destroy_crypto_cache();
 }
 
+TEST(crypto, derivation_tables)
+{
+	init_crypto_cache();
+
+	struct Derivation
+	{
+		hash key1;
+		hash key2;
+		bool result;
+		hash derivation;
+	};
+
+	std::vector<Derivation> derivations;
+
+	std::ifstream f("crypto_tests.txt");
+	ASSERT_EQ(f.good() && f.is_open(), true);
+	do {
+		std::string name;
+		f >> name;
+		if (name == "generate_key_derivation") {
+			Derivation d;
+			std::string result_str;
+			f >> d.key1 >> d.key2 >> result_str;
+			if (result_str == "true") {
+				f >> d.derivation;
+			}
+			derivations.push_back(d);
+		}
+		else if (name == "derive_public_key") {
+			std::string s;
+			for (int i = 0; i < 4; ++i) {
+				f >> s;
+			}
+			if (s == "true") {
+				f >> s;
+			}
+		}
+	} while (!f.eof());
+
+	ASSERT_FALSE(derivations.empty());
+
+	// Random wallets and tx keys, the same way they're made in side chain blocks
+	constexpr size_t NUM_RANDOM_KEYS = 64;
+	for (size_t i = 0; i < NUM_RANDOM_KEYS; ++i) {
+		Derivation d;
+		hash view_sec, tx_pub;
+		generate_keys(d.key1, view_sec);
+		generate_keys(tx_pub, d.key2);
+		derivations.push_back(d);
+	}
+
+	// Reference results without derivation tables
+	std::vector<hash> view_public_keys;
+	for (Derivation& d : derivations) {
+		d.result = generate_key_derivation(d.key1, d.key2, d.derivation);
+		view_public_keys.push_back(d.key1);
+	}
+
+	update_derivation_tables(view_public_keys);
+	clear_crypto_cache();
+
+	CryptoCacheStats stats;
+	get_crypto_cache_stats(stats);
+	ASSERT_GE(stats.derivation_tables, NUM_RANDOM_KEYS);
+
+	for (const Derivation& d : derivations) {
+		hash derivation;
+		ASSERT_EQ(generate_key_derivation(d.key1, d.key2, derivation), d.result);
+		if (d.result) {
+			ASSERT_EQ(derivation, d.derivation);
+		}
+	}
+
+	destroy_crypto_cache();
+}
+
 }
@@ -0,0 +1,329 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "http_server.h"
+#include "gtest/gtest.h"
+#include <thread>
+
+namespace p2pool {
+
+namespace {
+
+constexpr int TEST_PORT = 37891;
+
+// Client connection with its own event loop, runs in the test thread
+class TestConnection
+{
+public:
+	TestConnection()
+		: m_loop{}
+		, m_socket{}
+		, m_timer{}
+		, m_connect{}
+		, m_connected(false)
+		, m_closed(false)
+	{
+		uv_loop_init(&m_loop);
+		uv_tcp_init(&m_loop, &m_socket);
+		uv_timer_init(&m_loop, &m_timer);
+		m_socket.data = this;
+		m_timer.data = this;
+
+		sockaddr_in addr;
+		uv_ip4_addr("127.0.0.1", TEST_PORT, &addr);
+		m_connect.data = this;
+		uv_tcp_connect(&m_connect, &m_socket, reinterpret_cast<const sockaddr*>(&addr),
+			[](uv_connect_t* req, int status) { static_cast<TestConnection*>(req->data)->m_connected = (status == 0); });
+		uv_run(&m_loop, UV_RUN_DEFAULT);
+
+		if (m_connected) {
+			uv_read_start(reinterpret_cast<uv_stream_t*>(&m_socket), on_alloc, on_read);
+		}
+	}
+
+	~TestConnection()
+	{
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_socket), nullptr);
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+		uv_run(&m_loop, UV_RUN_DEFAULT);
+		uv_loop_close(&m_loop);
+	}
+
+	bool connected() const { return m_connected; }
+	bool closed() const { return m_closed; }
+
+	void send(const std::string& data)
+	{
+		struct WriteReq
+		{
+			uv_write_t m_write;
+			std::string m_data;
+		};
+
+		WriteReq* req = new WriteReq{ {}, data };
+		req->m_write.data = req;
+
+		uv_buf_t buf = uv_buf_init(&req->m_data[0], static_cast<unsigned int>(req->m_data.size()));
+		uv_write(&req->m_write, reinterpret_cast<uv_stream_t*>(&m_socket), &buf, 1, [](uv_write_t* req, int) { delete static_cast<WriteReq*>(req->data); });
+		uv_run(&m_loop, UV_RUN_NOWAIT);
+	}
+
+	// Returns everything received since the last call, waits until the server closes the connection or nothing arrives for timeout_ms
+	std::string read(uint64_t timeout_ms = 200)
+	{
+		m_timeout = timeout_ms;
+
+		if (!m_closed) {
+			uv_timer_start(&m_timer, on_timer, m_timeout, 0);
+			uv_run(&m_loop, UV_RUN_DEFAULT);
+		}
+
+		std::string result;
+		result.swap(m_response);
+		return result;
+	}
+
+private:
+	static void on_alloc(uv_handle_t* handle, size_t, uv_buf_t* buf)
+	{
+		TestConnection* pThis = static_cast<TestConnection*>(handle->data);
+		*buf = uv_buf_init(pThis->m_buf, sizeof(pThis->m_buf));
+	}
+
+	static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+	{
+		TestConnection* pThis = static_cast<TestConnection*>(stream->data);
+
+		if (nread > 0) {
+			pThis->m_response.append(buf->base, static_cast<size_t>(nread));
+			uv_timer_start(&pThis->m_timer, on_timer, pThis->m_timeout, 0);
+		}
+		else if (nread < 0) {
+			// Keep our end open, the server must close the connection by itself
+			pThis->m_closed = true;
+			uv_timer_stop(&pThis->m_timer);
+			uv_read_stop(stream);
+			uv_stop(&pThis->m_loop);
+		}
+	}
+
+	static void on_timer(uv_timer_t* timer)
+	{
+		uv_stop(&static_cast<TestConnection*>(timer->data)->m_loop);
+	}
+
+	uv_loop_t m_loop;
+	uv_tcp_t m_socket;
+	uv_timer_t m_timer;
+	uv_connect_t m_connect;
+
+	bool m_connected;
+	bool m_closed;
+
+	uint64_t m_timeout = 0;
+	std::string m_response;
+	char m_buf[65536];
+};
+
+std::string header(const std::string& response, const char* name)
+{
+	const std::string s = std::string("\r\n") + name + ": ";
+	const size_t k = response.find(s);
+	if (k == std::string::npos) {
+		return std::string();
+	}
+	const size_t k1 = k + s.length();
+	return response.substr(k1, response.find("\r\n", k1) - k1);
+}
+
+bool starts_with(const std::string& s, const char* prefix)
+{
+	return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Waits until the server has closed all its connections
+bool no_connections(const HTTPServer& server)
+{
+	for (int i = 0; i < 50; ++i) {
+		if (server.num_connections() == 0) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	return false;
+}
+}
+
+TEST(http_server, requests)
+{
+	HTTPServer server("127.0.0.1:" + std::to_string(TEST_PORT));
+
+	const std::string doc = "{\"a\":1}";
+	server.update("/pool/stats", doc.data(), doc.size());
+
+	// Keep-alive: several requests over the same connection
+	TestConnection c;
+	ASSERT_TRUE(c.connected());
+
+	c.send("GET /pool/stats HTTP/1.1\r\nHost: x\r\n\r\n");
+	std::string r = c.read();
+	ASSERT_TRUE(starts_with(r, "HTTP/1.1 200 OK\r\n"));
+	ASSERT_EQ(header(r, "Connection"), "keep-alive");
+	ASSERT_EQ(header(r, "Content-Length"), std::to_string(doc.size()));
+	ASSERT_EQ(r.substr(r.length() - doc.size()), doc);
+	ASSERT_FALSE(c.closed());
+
+	const std::string etag = header(r, "ETag");
+	ASSERT_EQ(etag.length(), 18);
+
+	// Query string is ignored, matching ETag gives 304 without a body
+	c.send("GET /pool/stats?t=123 HTTP/1.1\r\nHost: x\r\nIf-None-Match: " + etag + "\r\n\r\n");
+	r = c.read();
+	ASSERT_TRUE(starts_with(r, "HTTP/1.1 304 Not Modified\r\n"));
+	ASSERT_EQ(header(r, "ETag"), etag);
+	ASSERT_TRUE(header(r, "Content-Length").empty());
+	ASSERT_EQ(r.substr(r.length() - 4), "\r\n\r\n");
+
+	// Header names are case insensitive
+	c.send("GET /pool/stats HTTP/1.1\r\nif-none-match: \"0000\", " + etag + "\r\n\r\n");
+	ASSERT_TRUE(starts_with(c.read(), "HTTP/1.1 304 Not Modified\r\n"));
+
+	c.send("GET /pool/stats HTTP/1.1\r\nIF-NONE-MATCH: *\r\n\r\n");
+	ASSERT_TRUE(starts_with(c.read(), "HTTP/1.1 304 Not Modified\r\n"));
+
+	// A new version of the document has a new ETag
+	const std::string doc2 = "{\"a\":2}";
+	server.update("/pool/stats", doc2.data(), doc2.size());
+
+	c.send("GET /pool/stats HTTP/1.1\r\nIf-None-Match: " + etag + "\r\n\r\n");
+	r = c.read();
+	ASSERT_TRUE(starts_with(r, "HTTP/1.1 200 OK\r\n"));
+	ASSERT_NE(header(r, "ETag"), etag);
+	ASSERT_EQ(r.substr(r.length() - doc2.size()), doc2);
+
+	// HEAD has the headers of GET, but no body
+	c.send("HEAD /pool/stats HTTP/1.1\r\n\r\n");
+	r = c.read();
+	ASSERT_TRUE(starts_with(r, "HTTP/1.1 200 OK\r\n"));
+	ASSERT_EQ(header(r, "Content-Length"), std::to_string(doc2.size()));
+	ASSERT_EQ(r.substr(r.length() - 4), "\r\n\r\n");
+
+	c.send("GET /pool/missing HTTP/1.1\r\n\r\n");
+	ASSERT_TRUE(starts_with(c.read(), "HTTP/1.1 404 Not Found\r\n"));
+
+	c.send("POST /pool/stats HTTP/1.1\r\nContent-Length: 0\r\n\r\n");
+	r = c.read();
+	ASSERT_TRUE(starts_with(r, "HTTP/1.1 405 Method Not Allowed\r\n"));
+	ASSERT_EQ(header(r, "Allow"), "GET, HEAD");
+	ASSERT_FALSE(c.closed());
+
+	// Connection: close and HTTP/1.0 get the response, then the server closes the connection
+	c.send("GET /pool/stats HTTP/1.1\r\nConnection: close\r\n\r\n");
+	r = c.read(5000);
+	ASSERT_TRUE(starts_with(r, "HTTP/1.1 200 OK\r\n"));
+	ASSERT_EQ(header(r, "Connection"), "close");
+	ASSERT_TRUE(c.closed());
+
+	TestConnection c2;
+	c2.send("GET /pool/stats HTTP/1.0\r\n\r\n");
+	r = c2.read(5000);
+	ASSERT_TRUE(starts_with(r, "HTTP/1.1 200 OK\r\n"));
+	ASSERT_EQ(header(r, "Connection"), "close");
+	ASSERT_TRUE(c2.closed());
+	ASSERT_TRUE(no_connections(server));
+}
+
+TEST(http_server, bounds)
+{
+	HTTPServer server("127.0.0.1:" + std::to_string(TEST_PORT));
+
+	const std::string doc = "{}";
+	server.update("/stats", doc.data(), doc.size());
+
+	// URL at the limit is fine, one byte more closes the connection without a response
+	std::string url = "/stats?" + std::string(HTTP_MAX_URL_SIZE - 7, 'a');
+	{
+		TestConnection c;
+		c.send("GET " + url + " HTTP/1.1\r\n\r\n");
+		ASSERT_TRUE(starts_with(c.read(), "HTTP/1.1 200 OK\r\n"));
+		ASSERT_FALSE(c.closed());
+	}
+	{
+		TestConnection c;
+		c.send("GET " + url + "a HTTP/1.1\r\n\r\n");
+		ASSERT_TRUE(c.read(5000).empty());
+		ASSERT_TRUE(c.closed());
+	}
+
+	// Same for headers, their size is counted over the whole request
+	{
+		TestConnection c;
+		c.send("GET /stats HTTP/1.1\r\nX-A: " + std::string(HTTP_MAX_HEADERS_SIZE / 2, 'a') + "\r\nX-B: " + std::string(HTTP_MAX_HEADERS_SIZE / 2, 'b') + "\r\n\r\n");
+		ASSERT_TRUE(c.read(5000).empty());
+		ASSERT_TRUE(c.closed());
+	}
+
+	// The limit is per request, not per connection
+	{
+		TestConnection c;
+		const std::string request = "GET /stats HTTP/1.1\r\nX-A: " + std::string(HTTP_MAX_HEADERS_SIZE - 16, 'a') + "\r\n\r\n";
+		for (int i = 0; i < 3; ++i) {
+			c.send(request);
+			ASSERT_TRUE(starts_with(c.read(), "HTTP/1.1 200 OK\r\n"));
+		}
+		ASSERT_FALSE(c.closed());
+	}
+
+	// Garbage closes the connection
+	{
+		TestConnection c;
+		c.send("\x01\x02\x03 /stats HTTP/1.1\r\n\r\n");
+		ASSERT_TRUE(c.read(5000).empty());
+		ASSERT_TRUE(c.closed());
+	}
+}
+
+TEST(http_server, idle_timeout)
+{
+	HTTPServer server("127.0.0.1:" + std::to_string(TEST_PORT), 2);
+
+	const std::string doc = "{}";
+	server.update("/stats", doc.data(), doc.size());
+
+	// A connection which never sends anything
+	TestConnection c;
+	ASSERT_TRUE(c.connected());
+	ASSERT_TRUE(c.read(5000).empty());
+	ASSERT_TRUE(c.closed());
+
+	// A request which is never finished
+	TestConnection c2;
+	c2.send("GET /stats HTTP/1.1\r\n");
+	ASSERT_TRUE(c2.read(5000).empty());
+	ASSERT_TRUE(c2.closed());
+
+	// An idle keep-alive connection
+	TestConnection c3;
+	c3.send("GET /stats HTTP/1.1\r\n\r\n");
+	ASSERT_TRUE(starts_with(c3.read(), "HTTP/1.1 200 OK\r\n"));
+	ASSERT_FALSE(c3.closed());
+	c3.read(5000);
+	ASSERT_TRUE(c3.closed());
+}
+
+}
@@ -0,0 +1,400 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "uv_util.h"
+#include "json_rpc_request.h"
+#include "gtest/gtest.h"
+#include <thread>
+
+namespace p2pool {
+
+namespace {
+
+constexpr int TEST_PORT = 37892;
+
+// Daemon stub which runs on the default loop together with the connection pool and answers every request with its own body
+class StubServer
+{
+public:
+	StubServer()
+		: m_numConnections(0)
+		, m_numOpenConnections(0)
+		, m_numRequests(0)
+		, m_holdResponses(false)
+		, m_dropRequests(0)
+		, m_silent(false)
+		, m_server{}
+	{
+		uv_loop_t* loop = uv_default_loop_checked();
+
+		uv_tcp_init(loop, &m_server);
+		m_server.data = this;
+
+		sockaddr_in addr;
+		uv_ip4_addr("127.0.0.1", TEST_PORT, &addr);
+		EXPECT_EQ(uv_tcp_bind(&m_server, reinterpret_cast<const sockaddr*>(&addr), 0), 0);
+		EXPECT_EQ(uv_listen(reinterpret_cast<uv_stream_t*>(&m_server), 16, on_new_connection), 0);
+	}
+
+	~StubServer()
+	{
+		for (Connection* c : m_connections) {
+			c->close();
+		}
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_server), nullptr);
+
+		while (m_numOpenConnections > 0) {
+			uv_run(uv_default_loop_checked(), UV_RUN_NOWAIT);
+		}
+		uv_run(uv_default_loop_checked(), UV_RUN_NOWAIT);
+	}
+
+	// Sends all responses which were held back
+	void release()
+	{
+		m_holdResponses = false;
+		for (Connection* c : m_connections) {
+			for (const std::string& body : c->m_held) {
+				c->respond(body);
+			}
+			c->m_held.clear();
+		}
+	}
+
+	uint32_t m_numConnections;
+	uint32_t m_numOpenConnections;
+	uint32_t m_numRequests;
+
+	bool m_holdResponses;
+
+	// Connections which get a request close without responding, like a daemon closing a keep-alive connection that was idle for too long
+	uint32_t m_dropRequests;
+
+	// Requests are never answered
+	bool m_silent;
+
+private:
+	struct Connection
+	{
+		explicit Connection(StubServer* server) : m_server(server), m_socket{}, m_closing(false) { m_socket.data = this; }
+
+		void close()
+		{
+			if (!m_closing) {
+				m_closing = true;
+				uv_close(reinterpret_cast<uv_handle_t*>(&m_socket), on_close);
+			}
+		}
+
+		void respond(const std::string& body)
+		{
+			struct WriteReq
+			{
+				uv_write_t m_write;
+				std::string m_data;
+			};
+
+			WriteReq* req = new WriteReq{ {}, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body };
+			req->m_write.data = req;
+
+			uv_buf_t buf = uv_buf_init(&req->m_data[0], static_cast<unsigned int>(req->m_data.size()));
+			uv_write(&req->m_write, reinterpret_cast<uv_stream_t*>(&m_socket), &buf, 1, [](uv_write_t* req, int) { delete static_cast<WriteReq*>(req->data); });
+		}
+
+		StubServer* m_server;
+		uv_tcp_t m_socket;
+		bool m_closing;
+		std::string m_data;
+		std::vector<std::string> m_held;
+		char m_buf[4096];
+	};
+
+	static void on_new_connection(uv_stream_t* stream, int status)
+	{
+		ASSERT_EQ(status, 0);
+
+		StubServer* pThis = static_cast<StubServer*>(stream->data);
+
+		Connection* c = new Connection(pThis);
+		uv_tcp_init(uv_default_loop_checked(), &c->m_socket);
+		ASSERT_EQ(uv_accept(stream, reinterpret_cast<uv_stream_t*>(&c->m_socket)), 0);
+
+		pThis->m_connections.push_back(c);
+		++pThis->m_numConnections;
+		++pThis->m_numOpenConnections;
+
+		uv_read_start(reinterpret_cast<uv_stream_t*>(&c->m_socket),
+			[](uv_handle_t* handle, size_t, uv_buf_t* buf)
+			{
+				Connection* c = static_cast<Connection*>(handle->data);
+				*buf = uv_buf_init(c->m_buf, sizeof(c->m_buf));
+			},
+			on_read);
+	}
+
+	static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+	{
+		Connection* c = static_cast<Connection*>(stream->data);
+		StubServer* pThis = c->m_server;
+
+		if (nread < 0) {
+			c->close();
+			return;
+		}
+
+		c->m_data.append(buf->base, static_cast<size_t>(nread));
+
+		// Requests look like "POST /json_rpc HTTP/1.1\n...Content-Length: N\n\n<body>"
+		for (;;) {
+			const size_t k = c->m_data.find("\n\n");
+			if (k == std::string::npos) {
+				return;
+			}
+
+			static constexpr char content_length[] = "Content-Length: ";
+			const size_t k1 = c->m_data.find(content_length);
+			ASSERT_LT(k1, k);
+
+			const size_t body_size = std::stoul(c->m_data.substr(k1 + sizeof(content_length) - 1));
+			if (c->m_data.size() < k + 2 + body_size) {
+				return;
+			}
+
+			const std::string body = c->m_data.substr(k + 2, body_size);
+			c->m_data.erase(0, k + 2 + body_size);
+
+			++pThis->m_numRequests;
+
+			if (pThis->m_dropRequests > 0) {
+				--pThis->m_dropRequests;
+				c->close();
+				return;
+			}
+
+			if (pThis->m_silent) {
+				continue;
+			}
+
+			if (pThis->m_holdResponses) {
+				c->m_held.push_back(body);
+			}
+			else {
+				c->respond(body);
+			}
+		}
+	}
+
+	static void on_close(uv_handle_t* handle)
+	{
+		Connection* c = static_cast<Connection*>(handle->data);
+		StubServer* pThis = c->m_server;
+
+		pThis->m_connections.erase(std::find(pThis->m_connections.begin(), pThis->m_connections.end(), c));
+		--pThis->m_numOpenConnections;
+
+		delete c;
+	}
+
+	uv_tcp_t m_server;
+	std::vector<Connection*> m_connections;
+};
+
+// Result of one request: the response and the error reported by the close callback
+struct Result
+{
+	bool m_done = false;
+	std::string m_response;
+	std::string m_error;
+};
+
+void call(const char* req, Result& result, bool urgent = false)
+{
+	auto cb = [&result](const char* data, size_t size) { result.m_response.assign(data, size); };
+	auto close_cb = [&result](const char* data, size_t size) { result.m_error.assign(data, size); result.m_done = true; };
+
+	if (urgent) {
+		JSONRPCRequest::call_urgent("127.0.0.1", TEST_PORT, req, std::move(cb), std::move(close_cb));
+	}
+	else {
+		JSONRPCRequest::call("127.0.0.1", TEST_PORT, req, std::move(cb), std::move(close_cb));
+	}
+}
+
+// Runs the default loop until the condition is true or timeout_ms pass
+template<typename T>
+bool run_until(T&& condition, uint64_t timeout_ms = 5000)
+{
+	const uint64_t deadline = uv_hrtime() + timeout_ms * 1000000;
+
+	while (!condition()) {
+		if (uv_hrtime() >= deadline) {
+			return false;
+		}
+		uv_run(uv_default_loop_checked(), UV_RUN_NOWAIT);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return true;
+}
+
+// Closes the pool and lets all its handles close
+void close_pool()
+{
+	JSONRPCRequest::close_pool();
+	for (int i = 0; i < 10; ++i) {
+		uv_run(uv_default_loop_checked(), UV_RUN_NOWAIT);
+	}
+}
+
+}
+
+TEST(json_rpc_request, keep_alive)
+{
+	JSONRPCRequest::init_pool();
+	StubServer server;
+
+	// Requests one after another use the same connection
+	for (int i = 0; i < 5; ++i) {
+		const std::string req = "{\"id\":" + std::to_string(i) + "}";
+
+		Result result;
+		call(req.c_str(), result);
+		ASSERT_TRUE(run_until([&result]() { return result.m_done; }));
+
+		ASSERT_EQ(result.m_response, req);
+		ASSERT_TRUE(result.m_error.empty());
+	}
+
+	ASSERT_EQ(server.m_numRequests, 5);
+	ASSERT_EQ(server.m_numConnections, 1);
+	ASSERT_EQ(server.m_numOpenConnections, 1);
+
+	close_pool();
+}
+
+TEST(json_rpc_request, retry)
+{
+	JSONRPCRequest::init_pool();
+	StubServer server;
+
+	Result result;
+	call("{\"id\":1}", result);
+	ASSERT_TRUE(run_until([&result]() { return result.m_done; }));
+	ASSERT_EQ(server.m_numConnections, 1);
+
+	// The idle connection is closed by the server when the next request comes, it's sent again on a new connection
+	server.m_dropRequests = 1;
+
+	Result result2;
+	call("{\"id\":2}", result2);
+	ASSERT_TRUE(run_until([&result2]() { return result2.m_done; }));
+
+	ASSERT_EQ(result2.m_response, "{\"id\":2}");
+	ASSERT_TRUE(result2.m_error.empty());
+	ASSERT_EQ(server.m_numRequests, 3);
+	ASSERT_EQ(server.m_numConnections, 2);
+
+	// Requests are sent again only once
+	server.m_dropRequests = 2;
+
+	Result result3;
+	call("{\"id\":3}", result3);
+	ASSERT_TRUE(run_until([&result3]() { return result3.m_done; }));
+
+	ASSERT_TRUE(result3.m_response.empty());
+	ASSERT_EQ(result3.m_error, "connection closed by server");
+	ASSERT_EQ(server.m_numRequests, 5);
+	ASSERT_EQ(server.m_numConnections, 3);
+
+	// The pool still works after that
+	Result result4;
+	call("{\"id\":4}", result4);
+	ASSERT_TRUE(run_until([&result4]() { return result4.m_done; }));
+	ASSERT_EQ(result4.m_response, "{\"id\":4}");
+
+	close_pool();
+}
+
+TEST(json_rpc_request, timeout)
+{
+	constexpr uint64_t TIMEOUT_MS = 500;
+
+	JSONRPCRequest::init_pool(TIMEOUT_MS);
+	StubServer server;
+	server.m_silent = true;
+
+	const uint64_t t = uv_hrtime();
+
+	// Requests which time out fail without retrying, the daemon is too slow to be asked again
+	Result result;
+	call("{\"id\":1}", result);
+	ASSERT_TRUE(run_until([&result]() { return result.m_done; }));
+
+	const uint64_t dt = (uv_hrtime() - t) / 1000000;
+	ASSERT_GE(dt, TIMEOUT_MS - 10);
+	ASSERT_LT(dt, TIMEOUT_MS * 4);
+
+	ASSERT_TRUE(result.m_response.empty());
+	ASSERT_EQ(result.m_error, "timeout");
+	ASSERT_EQ(server.m_numRequests, 1);
+	ASSERT_TRUE(run_until([&server]() { return server.m_numOpenConnections == 0; }));
+
+	close_pool();
+}
+
+TEST(json_rpc_request, connection_limit)
+{
+	JSONRPCRequest::init_pool();
+	StubServer server;
+	server.m_holdResponses = true;
+
+	// Busy connections: new ones are opened until the limit, then requests are pipelined
+	constexpr size_t N = MAX_CONNECTIONS_PER_DAEMON * 3;
+
+	std::vector<Result> results(N);
+	std::vector<std::string> requests(N);
+
+	for (size_t i = 0; i < N; ++i) {
+		requests[i] = "{\"id\":" + std::to_string(i) + "}";
+		call(requests[i].c_str(), results[i]);
+	}
+
+	ASSERT_TRUE(run_until([&server]() { return server.m_numRequests == N; }));
+	ASSERT_EQ(server.m_numConnections, MAX_CONNECTIONS_PER_DAEMON);
+
+	// Urgent requests don't wait behind them
+	Result urgent;
+	call("{\"id\":\"urgent\"}", urgent, true);
+
+	ASSERT_TRUE(run_until([&server]() { return server.m_numRequests == N + 1; }));
+	ASSERT_EQ(server.m_numConnections, MAX_CONNECTIONS_PER_DAEMON + 1);
+
+	// Every response goes to its own request
+	server.release();
+	ASSERT_TRUE(run_until([&results, &urgent]() { return urgent.m_done && std::all_of(results.begin(), results.end(), [](const Result& r) { return r.m_done; }); }));
+
+	for (size_t i = 0; i < N; ++i) {
+		ASSERT_EQ(results[i].m_response, requests[i]);
+		ASSERT_TRUE(results[i].m_error.empty());
+	}
+	ASSERT_EQ(urgent.m_response, "{\"id\":\"urgent\"}");
+
+	close_pool();
+}
+
+}
@@ -55,4 +55,71 @@ TEST(keccak, hashing)
 	check(v.data(), v.size(), "fadae6b49f129bbb812be8407b7b2894f34aecf6dbd1f9b0f0c7e9853098fc96");
 }
 
+TEST(keccak, incremental)
+{
+	std::vector<uint8_t> data(1000);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>(i * 31 + 7);
+	}
+
+	for (int size : { 0, 1, 135, 136, 137, 300, 1000 }) {
+		for (int split : { 0, 1, 100, 136, 137, 300 }) {
+			if (split > size) {
+				continue;
+			}
+
+			hash expected;
+			keccak(data.data(), size, expected.h, HASH_SIZE);
+
+			KeccakState state;
+			state.absorb(data.data(), split);
+			state.absorb(data.data() + split, size - split);
+
+			hash output;
+			state.finalize(output.h);
+			ASSERT_EQ(output, expected);
+
+			// Zeroed range in the middle
+			std::vector<uint8_t> tmp(data.begin(), data.begin() + size);
+			std::fill(tmp.begin() + split / 2, tmp.begin() + split, 0);
+			keccak(tmp.data(), size, expected.h, HASH_SIZE);
+
+			state.init(HASH_SIZE);
+			state.absorb(tmp.data(), split / 2);
+			state.absorb_zeros(split - split / 2);
+			state.absorb(tmp.data() + split, size - split);
+			state.finalize(output.h);
+			ASSERT_EQ(output, expected);
+		}
+	}
+}
+
+TEST(keccak, hashing_x4)
+{
+	std::vector<uint8_t> data[4];
+
+	for (int size : { 0, 1, 64, 96, 135, 136, 137, 1000, 10000 }) {
+		const uint8_t* in[4];
+		hash output[4];
+		uint8_t* out[4];
+
+		for (int i = 0; i < 4; ++i) {
+			data[i].resize(size + 1);
+			for (int j = 0; j < size; ++j) {
+				data[i][j] = static_cast<uint8_t>(j * 7 + i * 13);
+			}
+			in[i] = data[i].data();
+			out[i] = output[i].h;
+		}
+
+		keccak_x4(in, size, out, HASH_SIZE);
+
+		for (int i = 0; i < 4; ++i) {
+			hash expected;
+			keccak(in[i], size, expected.h, HASH_SIZE);
+			ASSERT_EQ(output[i], expected);
+		}
+	}
+}
+
 }
@@ -0,0 +1,188 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "mainchain_index.h"
+#include "gtest/gtest.h"
+#include <random>
+
+namespace p2pool {
+
+static hash test_id(uint64_t height)
+{
+	hash h;
+	memcpy(h.h, &height, sizeof(height));
+	h.h[HASH_SIZE - 1] = 1;
+	return h;
+}
+
+TEST(mainchain_index, median_timestamp)
+{
+	MainchainIndex index(2048);
+
+	std::mt19937_64 rng(123);
+	std::map<uint64_t, uint64_t> timestamps;
+
+	auto check_median = [&index, &timestamps]()
+	{
+		std::vector<uint64_t> t;
+		for (auto it = timestamps.rbegin(); (it != timestamps.rend()) && (t.size() < MainchainIndex::TIMESTAMP_WINDOW); ++it) {
+			t.push_back(it->second);
+		}
+		std::sort(t.begin(), t.end());
+		ASSERT_EQ(index.median_timestamp(), (t[t.size() / 2] + t[t.size() / 2 + 1]) / 2);
+	};
+
+	for (uint64_t h = 10000; h < 10720; ++h) {
+		const uint64_t t = rng() % 1000000;
+		index.update(h, [h, t](ChainMain& c) { c.id = test_id(h); c.timestamp = t; });
+		timestamps[h] = t;
+	}
+	check_median();
+
+	// New blocks and timestamp updates inside the window
+	for (uint64_t h = 10720; h < 12000; ++h) {
+		const uint64_t t = rng() % 1000000;
+		index.update(h, [h, t](ChainMain& c) { c.id = test_id(h); c.timestamp = t; });
+		timestamps[h] = t;
+		check_median();
+
+		const uint64_t h2 = h - rng() % MainchainIndex::TIMESTAMP_WINDOW;
+		const uint64_t t2 = rng() % 1000000;
+		index.update(h2, [t2](ChainMain& c) { c.timestamp = t2; });
+		timestamps[h2] = t2;
+		check_median();
+	}
+}
+
+TEST(mainchain_index, median_timestamp_gaps)
+{
+	MainchainIndex index(2048);
+
+	std::mt19937_64 rng(456);
+	std::map<uint64_t, uint64_t> timestamps;
+
+	// Median of the highest TIMESTAMP_WINDOW headers which are there
+	auto expected_median = [&timestamps]()
+	{
+		std::vector<uint64_t> t;
+		for (auto it = timestamps.rbegin(); (it != timestamps.rend()) && (t.size() < MainchainIndex::TIMESTAMP_WINDOW); ++it) {
+			t.push_back(it->second);
+		}
+		std::sort(t.begin(), t.end());
+		return (t[t.size() / 2] + t[t.size() / 2 + 1]) / 2;
+	};
+
+	auto add = [&index, &timestamps, &rng](uint64_t h)
+	{
+		const uint64_t t = rng() % 1000000;
+		index.update(h, [h, t](ChainMain& c) { c.id = test_id(h); c.timestamp = t; });
+		timestamps[h] = t;
+	};
+
+	// Seeds which are outside of the ring don't count
+	for (uint64_t h = 2048; h <= 6144; h += 2048) {
+		add(h);
+	}
+	for (uint64_t h = 10000; h < 10000 + MainchainIndex::TIMESTAMP_WINDOW - 2; ++h) {
+		add(h);
+	}
+	ASSERT_EQ(index.median_timestamp(), 0);
+
+	for (uint64_t h = 10000 + MainchainIndex::TIMESTAMP_WINDOW - 2; h < 10200; ++h) {
+		add(h);
+	}
+	timestamps.erase(2048);
+	timestamps.erase(4096);
+	timestamps.erase(6144);
+	ASSERT_EQ(index.median_timestamp(), expected_median());
+
+	// Missing heights inside the window, older headers take their place
+	const uint64_t gaps[] = { 10201, 10205, 10230, 10259 };
+	for (uint64_t h = 10200; h <= 10260; ++h) {
+		if (std::find(std::begin(gaps), std::end(gaps), h) == std::end(gaps)) {
+			add(h);
+		}
+	}
+	ASSERT_EQ(index.median_timestamp(), expected_median());
+
+	// The window is 60 headers wide again when the gaps are filled
+	for (uint64_t h : gaps) {
+		add(h);
+		ASSERT_EQ(index.median_timestamp(), expected_median());
+	}
+
+	// A big gap: the window only has the newest header
+	add(10260 + MainchainIndex::TIMESTAMP_WINDOW * 2);
+	ASSERT_EQ(index.median_timestamp(), expected_median());
+
+	// Not enough headers left in the ring
+	add(10260 + MainchainIndex::RING_SIZE);
+	add(10260 + MainchainIndex::RING_SIZE * 2);
+	ASSERT_EQ(index.median_timestamp(), 0);
+}
+
+TEST(mainchain_index, lookups)
+{
+	MainchainIndex index(2048);
+
+	ASSERT_EQ(index.median_timestamp(), 0);
+
+	// Old RandomX seed
+	index.update(8192, [](ChainMain& c) { c.id = test_id(8192); c.difficulty = difficulty_type(8192, 0); });
+
+	for (uint64_t h = 10200; h < 12100; ++h) {
+		index.update(h, [h](ChainMain& c) { c.id = test_id(h); c.difficulty = difficulty_type(h, 0); });
+	}
+
+	ChainMain c;
+	difficulty_type diff;
+
+	ASSERT_TRUE(index.get(8192, c));
+	ASSERT_EQ(c.id, test_id(8192));
+	ASSERT_TRUE(index.get_by_hash(test_id(8192), c));
+	ASSERT_EQ(c.height, 8192);
+
+	// Seed height which left the ring is still there, other heights are gone
+	ASSERT_TRUE(index.get_by_hash(test_id(10240), c));
+	ASSERT_EQ(c.height, 10240);
+	ASSERT_FALSE(index.get(10241, c));
+	ASSERT_FALSE(index.get_by_hash(test_id(11000), c));
+
+	ASSERT_TRUE(index.get_difficulty(12099, diff));
+	ASSERT_EQ(diff, difficulty_type(12099, 0));
+	ASSERT_TRUE(index.get_by_hash(test_id(12099 - MainchainIndex::RING_SIZE + 1), c));
+	ASSERT_EQ(c.height, 12099 - MainchainIndex::RING_SIZE + 1);
+	ASSERT_FALSE(index.get(12100, c));
+
+	// Changing the id of a block makes the old one unknown
+	index.update(12000, [](ChainMain& c1) { c1.id = test_id(1); });
+	ASSERT_FALSE(index.get_by_hash(test_id(12000), c));
+	ASSERT_TRUE(index.get_by_hash(test_id(1), c));
+	ASSERT_EQ(c.height, 12000);
+
+	std::vector<uint64_t> missing;
+	index.get_missing_heights(12090, 12110, missing);
+	ASSERT_EQ(missing.size(), 11);
+	ASSERT_EQ(missing.front(), 12100);
+
+	// Heights which are too old and not seed heights are not stored
+	index.update(9000, [](ChainMain& c1) { c1.id = test_id(9000); });
+	ASSERT_FALSE(index.get(9000, c));
+}
+
+}
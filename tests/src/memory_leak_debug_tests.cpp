@@ -0,0 +1,72 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "memory_leak_debug.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+TEST(alloc_telemetry, sampling)
+{
+	constexpr uint64_t SAMPLE_INTERVAL = 4096;
+	constexpr size_t NUM_ALLOCATIONS = 10000;
+	constexpr size_t ALLOCATION_SIZE = 1000;
+
+	alloc_telemetry::enable(SAMPLE_INTERVAL);
+	ASSERT_TRUE(alloc_telemetry::enabled());
+
+	alloc_telemetry::TagStats before[alloc_telemetry::NUM_TAGS];
+	alloc_telemetry::get(before);
+
+	std::vector<void*> p(NUM_ALLOCATIONS);
+	{
+		alloc_telemetry::Scope scope(alloc_telemetry::MEMPOOL);
+		for (void*& k : p) {
+			k = malloc_hook(ALLOCATION_SIZE);
+		}
+	}
+
+	alloc_telemetry::TagStats stats[alloc_telemetry::NUM_TAGS];
+	alloc_telemetry::get(stats);
+
+	const alloc_telemetry::TagStats& s = stats[alloc_telemetry::MEMPOOL];
+	const alloc_telemetry::TagStats& s0 = before[alloc_telemetry::MEMPOOL];
+
+	// Sampled estimates are within a few percent of the real numbers, 10% is a safe margin
+	const double bytes = static_cast<double>(s.bytes - s0.bytes);
+	const double allocs = static_cast<double>(s.allocs - s0.allocs);
+	const double live_bytes = static_cast<double>(s.live_bytes - s0.live_bytes);
+
+	ASSERT_NEAR(bytes, NUM_ALLOCATIONS * ALLOCATION_SIZE, NUM_ALLOCATIONS * ALLOCATION_SIZE * 0.1);
+	ASSERT_NEAR(allocs, NUM_ALLOCATIONS, NUM_ALLOCATIONS * 0.1);
+	ASSERT_EQ(live_bytes, bytes);
+
+	// Nothing was tagged as sidechain
+	ASSERT_EQ(stats[alloc_telemetry::SIDECHAIN].bytes, before[alloc_telemetry::SIDECHAIN].bytes);
+
+	for (void* k : p) {
+		free_hook(k);
+	}
+
+	alloc_telemetry::get(stats);
+	ASSERT_EQ(stats[alloc_telemetry::MEMPOOL].live_bytes, s0.live_bytes);
+	ASSERT_EQ(stats[alloc_telemetry::MEMPOOL].bytes - s0.bytes, static_cast<uint64_t>(bytes));
+}
+
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "metrics.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+TEST(metrics, histogram)
+{
+	metrics::HistogramStats stats;
+	metrics::get(metrics::SIDECHAIN_VERIFY_LOOP, stats);
+
+	const uint64_t count = stats.count;
+	const uint64_t sum = stats.sum;
+
+	// 90 fast values and 10 slow ones
+	for (uint64_t i = 0; i < 90; ++i) {
+		metrics::observe(metrics::SIDECHAIN_VERIFY_LOOP, 100);
+	}
+	for (uint64_t i = 0; i < 10; ++i) {
+		metrics::observe(metrics::SIDECHAIN_VERIFY_LOOP, 100000);
+	}
+
+	metrics::get(metrics::SIDECHAIN_VERIFY_LOOP, stats);
+
+	ASSERT_EQ(stats.count - count, 100);
+	ASSERT_EQ(stats.sum - sum, 90 * 100 + 10 * 100000);
+	ASSERT_GE(stats.max, 100000);
+
+	// Values 64-127 go to bucket 7, 65536-131071 go to bucket 17
+	ASSERT_GE(stats.buckets[7], 90);
+	ASSERT_GE(stats.buckets[17], 10);
+
+	ASSERT_EQ(stats.percentile(0.5), 127);
+	ASSERT_EQ(stats.percentile(0.99), 100000);
+}
+
+TEST(metrics, counters)
+{
+	const uint64_t n = metrics::get(metrics::P2P_BLOCKS_SENT);
+	metrics::add(metrics::P2P_BLOCKS_SENT, 5);
+	ASSERT_EQ(metrics::get(metrics::P2P_BLOCKS_SENT), n + 5);
+
+	metrics::set(metrics::TEMPLATE_SHARES, 123);
+	ASSERT_EQ(metrics::get(metrics::TEMPLATE_SHARES), 123);
+
+	char buf[16384];
+	log::Stream s(buf, sizeof(buf));
+	metrics::write_json(s);
+	buf[s.m_pos] = '\0';
+
+	ASSERT_NE(strstr(buf, "\"template_shares\":123"), nullptr);
+}
+
+TEST(metrics, perf)
+{
+	metrics::observe(metrics::TEMPLATE_UPDATE, 1000);
+
+	metrics::perf_start();
+	ASSERT_TRUE(metrics::perf_running());
+
+	metrics::observe(metrics::TEMPLATE_UPDATE, 300);
+	metrics::observe(metrics::TEMPLATE_UPDATE, 500);
+	metrics::observe(metrics::SHARE_CHECK, 2000);
+
+	metrics::perf_stop();
+	ASSERT_FALSE(metrics::perf_running());
+
+	// Not counted after perf_stop()
+	metrics::observe(metrics::SHARE_CHECK, 5000);
+
+	std::vector<metrics::PerfStats> stats;
+	uint64_t duration;
+	metrics::perf_get(stats, duration);
+
+	ASSERT_EQ(stats.size(), 2);
+
+	ASSERT_EQ(stats[0].histogram, metrics::SHARE_CHECK);
+	ASSERT_EQ(stats[0].count, 1);
+	ASSERT_EQ(stats[0].sum, 2000);
+
+	ASSERT_EQ(stats[1].histogram, metrics::TEMPLATE_UPDATE);
+	ASSERT_EQ(stats[1].count, 2);
+	ASSERT_EQ(stats[1].sum, 800);
+	ASSERT_EQ(stats[1].max, 500);
+}
+
+}
@@ -0,0 +1,146 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "mempool.h"
+#include "p2p_server.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <numeric>
+
+namespace p2pool {
+
+TEST(p2p_server, compact_broadcast)
+{
+	init_crypto_cache();
+
+	PoolBlock b;
+	SideChain sidechain(nullptr, NetworkType::Mainnet);
+
+	std::ifstream f("sidechain_dump.dat", std::ios::binary | std::ios::ate);
+	ASSERT_EQ(f.good() && f.is_open(), true);
+
+	std::vector<uint8_t> buf(f.tellg());
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(buf.data()), buf.size());
+	ASSERT_EQ(f.good(), true);
+
+	std::vector<std::pair<const uint8_t*, uint32_t>> blobs;
+
+	for (const uint8_t *p = buf.data(), *e = buf.data() + buf.size(); p < e;) {
+		ASSERT_TRUE(p + sizeof(uint32_t) <= e);
+		const uint32_t n = *reinterpret_cast<const uint32_t*>(p);
+		p += sizeof(uint32_t);
+
+		ASSERT_TRUE(p + n <= e);
+		ASSERT_EQ(b.deserialize(p, n, sidechain), 0);
+		sidechain.add_block(b);
+		blobs.emplace_back(p, n);
+		p += n;
+	}
+
+	// The dump starts with the newest blocks, their parents are all in the sidechain to rebuild the outputs of pruned blobs
+	uint32_t num_checked = 0;
+
+	for (size_t i = 0; (i < blobs.size()) && (num_checked < 32); ++i) {
+		ASSERT_EQ(b.deserialize(blobs[i].first, blobs[i].second, sidechain), 0);
+
+		const uint64_t total_reward = std::accumulate(b.m_outputs.begin(), b.m_outputs.end(), 0ULL,
+			[](uint64_t a, const PoolBlock::TxOutput& out)
+			{
+				return a + out.m_reward;
+			});
+
+		std::vector<uint8_t> pruned_blob, compact_blob;
+		ASSERT_TRUE(make_broadcast_blobs(b, total_reward, i * 0x9E3779B97F4A7C15ULL, pruned_blob, compact_blob));
+
+		// The first transaction is the miner transaction, it's not in the transaction list
+		const size_t num_transactions = b.m_transactions.size() - 1;
+		if (num_transactions < BLOCK_BROADCAST_COMPACT_MIN_TXS) {
+			ASSERT_TRUE(compact_blob.empty());
+			continue;
+		}
+
+		ASSERT_FALSE(compact_blob.empty());
+		ASSERT_LT(compact_blob.size(), pruned_blob.size());
+
+		Mempool mempool;
+		for (size_t j = 1; j < b.m_transactions.size(); ++j) {
+			TxMempoolData tx;
+			tx.id = b.m_transactions[j];
+			tx.blob_size = tx.weight = 1000;
+			tx.fee = 1;
+			mempool.add(tx);
+		}
+
+		// Also add unrelated transactions
+		for (uint64_t j = 0; j < 16; ++j) {
+			TxMempoolData tx;
+			memcpy(tx.id.h, &j, sizeof(j));
+			tx.blob_size = tx.weight = 1000;
+			tx.fee = 1;
+			mempool.add(tx);
+		}
+
+		CompactBlock compact;
+		ASSERT_EQ(compact.parse(compact_blob.data(), static_cast<uint32_t>(compact_blob.size())), 0);
+		ASSERT_EQ(compact.m_id, b.m_sidechainId);
+		ASSERT_EQ(compact.m_numTransactions, num_transactions);
+
+		std::vector<uint8_t> blob;
+		uint32_t num_missing;
+		ASSERT_TRUE(compact.reconstruct(mempool, blob, num_missing));
+		ASSERT_EQ(num_missing, 0);
+		ASSERT_EQ(blob, pruned_blob);
+
+		// The reconstructed blob is the same block as the full one
+		PoolBlock b2;
+		ASSERT_EQ(b2.deserialize(blob.data(), blob.size(), sidechain), 0);
+		ASSERT_EQ(b2.m_sidechainId, b.m_sidechainId);
+		ASSERT_TRUE(b2.m_blob != nullptr);
+		ASSERT_EQ(b2.m_blob->m_data, std::vector<uint8_t>(blobs[i].first, blobs[i].first + blobs[i].second));
+
+		// Without one of the transactions it can't be reconstructed
+		Mempool mempool2;
+		for (size_t j = 2; j < b.m_transactions.size(); ++j) {
+			TxMempoolData tx;
+			tx.id = b.m_transactions[j];
+			tx.blob_size = tx.weight = 1000;
+			tx.fee = 1;
+			mempool2.add(tx);
+		}
+
+		ASSERT_TRUE(compact.reconstruct(mempool2, blob, num_missing));
+		ASSERT_EQ(num_missing, 1);
+		ASSERT_TRUE(blob.empty());
+
+		// Truncated payloads are rejected
+		ASSERT_NE(compact.parse(compact_blob.data(), HASH_SIZE), 0);
+		ASSERT_NE(compact.parse(compact_blob.data(), static_cast<uint32_t>(HASH_SIZE + sizeof(uint64_t) + sizeof(uint32_t) + 10)), 0);
+
+		++num_checked;
+	}
+
+	ASSERT_GT(num_checked, 0);
+
+	destroy_crypto_cache();
+}
+
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "params.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+TEST(params, hosts)
+{
+	char wallet[] = "49ccoSmrBTPJd5yf8VYCULh4J5rHQaXP1TeC8Cnqhd5H9Y2cMwkJ9w42euLmMghKtCiQcgZEiGYW1K6Ae4biZ7w1HLSexS6";
+
+	// No --host: one monerod with the default address and ports
+	{
+		char* argv[] = { const_cast<char*>("p2pool"), const_cast<char*>("--wallet"), wallet };
+		Params p(static_cast<int>(array_size(argv)), argv);
+
+		ASSERT_TRUE(p.ok());
+		ASSERT_EQ(p.m_hosts.size(), 1);
+		ASSERT_EQ(p.m_hosts[0].m_address, "127.0.0.1");
+		ASSERT_EQ(p.m_hosts[0].m_rpcPort, 18081);
+		ASSERT_EQ(p.m_hosts[0].m_zmqPort, 18083);
+	}
+
+	// Ports before the first --host apply to it, later ports apply to the last --host, hosts without ports get the defaults
+	{
+		char* argv[] = {
+			const_cast<char*>("p2pool"),
+			const_cast<char*>("--rpc-port"), const_cast<char*>("28081"),
+			const_cast<char*>("--host"), const_cast<char*>("node1"),
+			const_cast<char*>("--zmq-port"), const_cast<char*>("28083"),
+			const_cast<char*>("--wallet"), wallet,
+			const_cast<char*>("--host"), const_cast<char*>("node2"),
+			const_cast<char*>("--rpc-port"), const_cast<char*>("38081"),
+			const_cast<char*>("--host"), const_cast<char*>("node3"),
+		};
+		Params p(static_cast<int>(array_size(argv)), argv);
+
+		ASSERT_TRUE(p.ok());
+		ASSERT_EQ(p.m_hosts.size(), 3);
+
+		ASSERT_EQ(p.m_hosts[0].m_address, "node1");
+		ASSERT_EQ(p.m_hosts[0].m_rpcPort, 28081);
+		ASSERT_EQ(p.m_hosts[0].m_zmqPort, 28083);
+
+		ASSERT_EQ(p.m_hosts[1].m_address, "node2");
+		ASSERT_EQ(p.m_hosts[1].m_rpcPort, 38081);
+		ASSERT_EQ(p.m_hosts[1].m_zmqPort, 18083);
+
+		ASSERT_EQ(p.m_hosts[2].m_address, "node3");
+		ASSERT_EQ(p.m_hosts[2].m_rpcPort, 18081);
+		ASSERT_EQ(p.m_hosts[2].m_zmqPort, 18083);
+	}
+
+	// A host with an invalid port makes the parameters invalid
+	{
+		char* argv[] = {
+			const_cast<char*>("p2pool"),
+			const_cast<char*>("--host"), const_cast<char*>("node1"),
+			const_cast<char*>("--host"), const_cast<char*>("node2"),
+			const_cast<char*>("--zmq-port"), const_cast<char*>("0"),
+			const_cast<char*>("--wallet"), wallet,
+		};
+		Params p(static_cast<int>(array_size(argv)), argv);
+
+		ASSERT_EQ(p.m_hosts.size(), 2);
+		ASSERT_FALSE(p.ok());
+	}
+}
+
+}
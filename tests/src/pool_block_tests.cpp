@@ -51,7 +51,7 @@ TEST(pool_block, deserialize)
 
 	ASSERT_EQ(b.deserialize(buf.data(), buf.size(), sidechain), 0);
 
-	ASSERT_EQ(b.m_mainChainData.size(), 5607);
+	ASSERT_EQ(b.main_chain_data_size(), 5607);
 	ASSERT_EQ(b.m_mainChainHeaderSize, 43);
 	ASSERT_EQ(b.m_mainChainMinerTxSize, 506);
 	ASSERT_EQ(b.m_mainChainOutputsOffset, 54);
@@ -65,7 +65,7 @@ TEST(pool_block, deserialize)
 	ASSERT_EQ(b.m_extraNonceSize, 4);
 	ASSERT_EQ(b.m_extraNonce, 28);
 	ASSERT_EQ(b.m_transactions.size(), 159);
-	ASSERT_EQ(b.m_sideChainData.size(), 146);
+	ASSERT_EQ(b.side_chain_data_size(), 146);
 	ASSERT_EQ(b.m_uncles.size(), 0);
 	ASSERT_EQ(b.m_sidechainHeight, 53450);
 	ASSERT_EQ(b.m_difficulty.lo, 319296691);
@@ -79,6 +79,24 @@ TEST(pool_block, deserialize)
 	ASSERT_EQ(b.m_broadcasted, false);
 	ASSERT_EQ(b.m_wantBroadcast, false);
 
+	PoolBlock::Summary summary;
+	ASSERT_EQ(PoolBlock::peek(buf.data(), buf.size(), summary), 0);
+	ASSERT_EQ(summary.m_prevId, b.m_prevId);
+	ASSERT_EQ(summary.m_txinGenHeight, b.m_txinGenHeight);
+	ASSERT_EQ(summary.m_sidechainId, b.m_sidechainId);
+	ASSERT_EQ(summary.m_sidechainHeight, b.m_sidechainHeight);
+	ASSERT_EQ(summary.m_cumulativeDifficulty, b.m_cumulativeDifficulty);
+	ASSERT_NE(PoolBlock::peek(buf.data(), buf.size() - 1, summary), 0);
+
+	// The block keeps its bytes in one shared buffer, copies of the block don't copy them
+	ASSERT_TRUE(b.m_blob != nullptr);
+	ASSERT_EQ(b.m_blob->m_data, buf);
+	{
+		PoolBlock b2(b);
+		ASSERT_EQ(b2.m_blob, b.m_blob);
+		ASSERT_EQ(memcmp(b2.side_chain_data(), buf.data() + 5607, 146), 0);
+	}
+
 	RandomX_Hasher hasher(nullptr);
 
 	hash seed;
@@ -98,6 +116,18 @@ TEST(pool_block, deserialize)
 	ASSERT_EQ(s.str(), "f76d731c61c9c9b6c3f46be2e60c9478930b49b4455feecd41ecb9420d000000");
 
 	ASSERT_EQ(b.m_difficulty.check_pow(pow_hash), true);
+
+	uint8_t blob[128];
+	size_t blob_size;
+	ASSERT_EQ(b.get_hashing_blob(blob, blob_size), true);
+
+	std::vector<RandomX_Hasher::PowJob> jobs(3, RandomX_Hasher::PowJob(blob, blob_size, seed));
+	hasher.calculate_batch(jobs);
+
+	for (const RandomX_Hasher::PowJob& job : jobs) {
+		ASSERT_TRUE(job.ok);
+		ASSERT_EQ(job.result, pow_hash);
+	}
 }
 
 TEST(pool_block, verify)
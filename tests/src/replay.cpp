@@ -0,0 +1,328 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "crypto.h"
+#include "mempool.h"
+#include "p2p_server.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include "traffic.h"
+#include "wallet.h"
+#include "zmq_reader.h"
+#include <thread>
+
+// Replays traffic recorded with "p2pool --record-traffic <file>"
+// Usage: p2pool_replay <file> [--pace] [--pool-name <name>]
+//
+// ZMQ messages go through the same parser as in p2pool, P2P block messages are deserialized and added to the sidechain
+// monerod and peers are stubbed out: nothing is sent back, PoW and mainchain checks are skipped, compact broadcasts are counted but not reconstructed
+// Block template rebuilds are done the way BlockTemplate::update() does them (transaction picking, PPLNS window, reward split and output keys)
+// on every new miner_data and every new sidechain tip
+
+namespace p2pool {
+
+// Tail emission, exact base reward doesn't matter for the amount of work
+static constexpr uint64_t BLOCK_REWARD = 600000000000ULL;
+
+struct Latencies
+{
+	std::vector<uint64_t> m_values;
+
+	void add(uint64_t ns) { m_values.push_back(ns); }
+
+	void print(const char* name)
+	{
+		if (m_values.empty()) {
+			printf("%-34s %10s\n", name, "-");
+			return;
+		}
+
+		std::sort(m_values.begin(), m_values.end());
+
+		auto percentile = [this](size_t p) { return m_values[std::min(m_values.size() - 1, m_values.size() * p / 100)] / 1000.0; };
+		printf("%-34s %10zu %12.1f %12.1f %12.1f %12.1f\n", name, m_values.size(), percentile(50), percentile(90), percentile(99), m_values.back() / 1000.0);
+	}
+};
+
+class Replay : public MinerCallbackHandler
+{
+public:
+	explicit Replay(const char* pool_name)
+		: m_sidechain(nullptr, NetworkType::Mainnet, pool_name)
+		, m_parser(this)
+		, m_wallet(nullptr)
+		, m_arrivalTime(0)
+		, m_zmqMessages(0)
+		, m_zmqSkipped(0)
+		, m_zmqHost(std::numeric_limits<uint32_t>::max())
+		, m_p2pMessages(0)
+		, m_blocksIngested(0)
+		, m_blocksCompact(0)
+		, m_blocksFailed(0)
+		, m_templateRebuilds(0)
+	{
+		hash pub;
+		generate_keys(pub, m_txkeySec);
+	}
+
+	~Replay() {}
+
+	void handle_tx(TxMempoolData& tx) override { m_mempool.add(tx); }
+
+	void handle_miner_data(MinerData& data) override
+	{
+		m_mempool.swap(data.tx_backlog);
+		rebuild_template();
+	}
+
+	void handle_chain_main(ChainMain&, const char*) override {}
+
+	void process(traffic::Record& record, uint64_t arrival_time)
+	{
+		m_arrivalTime = arrival_time;
+
+		if (record.source == traffic::ZMQ) {
+			// Every monerod host sends the same events, only the one seen first is replayed
+			if (m_zmqHost == std::numeric_limits<uint32_t>::max()) {
+				m_zmqHost = record.connection_id;
+			}
+			if (record.connection_id != m_zmqHost) {
+				++m_zmqSkipped;
+				return;
+			}
+			++m_zmqMessages;
+			m_parser.parse(reinterpret_cast<char*>(record.data.data()), record.data.size());
+			m_zmqLatency.add(uv_hrtime() - m_arrivalTime);
+		}
+		else if (record.source == traffic::P2P) {
+			++m_p2pMessages;
+			process_p2p(record.data);
+		}
+	}
+
+	void process_p2p(const std::vector<uint8_t>& data)
+	{
+		if (data.empty()) {
+			return;
+		}
+
+		const P2PServer::MessageId id = static_cast<P2PServer::MessageId>(data[0]);
+
+		if (id == P2PServer::MessageId::BLOCK_BROADCAST_COMPACT) {
+			++m_blocksCompact;
+			return;
+		}
+
+		if ((id != P2PServer::MessageId::BLOCK_RESPONSE) && (id != P2PServer::MessageId::BLOCK_BROADCAST)) {
+			return;
+		}
+
+		uint32_t size;
+		if (data.size() < 1 + sizeof(size)) {
+			return;
+		}
+		memcpy(&size, data.data() + 1, sizeof(size));
+
+		// Empty BLOCK_RESPONSE means the peer didn't have the block
+		if (!size || (data.size() < 1 + sizeof(size) + size)) {
+			return;
+		}
+
+		if (m_block.deserialize(data.data() + 1 + sizeof(size), size, m_sidechain) != 0) {
+			++m_blocksFailed;
+			return;
+		}
+
+		if (m_sidechain.has_block(m_block.m_sidechainId)) {
+			return;
+		}
+
+		const PoolBlock* old_tip = m_sidechain.chainTip();
+
+		m_sidechain.add_block(m_block);
+		++m_blocksIngested;
+		m_blockLatency.add(uv_hrtime() - m_arrivalTime);
+
+		if (!m_wallet.valid()) {
+			m_wallet = m_block.m_minerWallet;
+		}
+
+		if (m_sidechain.chainTip() != old_tip) {
+			rebuild_template();
+		}
+	}
+
+	void rebuild_template()
+	{
+		if (!m_wallet.valid()) {
+			return;
+		}
+
+		const uint64_t t = uv_hrtime();
+
+		size_t total_transactions;
+		m_mempool.get_best_transactions(time(nullptr), std::numeric_limits<size_t>::max(), m_transactions, total_transactions);
+
+		uint64_t reward = BLOCK_REWARD;
+		for (const TxMempoolData& tx : m_transactions) {
+			reward += tx.fee;
+		}
+
+		m_sidechain.fill_sidechain_data(m_template, &m_wallet, m_txkeySec, m_shares);
+
+		if (SideChain::split_reward(reward, m_shares, m_rewards)) {
+			size_t failed_index;
+			SideChain::get_eph_public_keys(m_txkeySec, m_shares, m_ephPublicKeys, failed_index);
+		}
+
+		const uint64_t t1 = uv_hrtime();
+
+		++m_templateRebuilds;
+		m_templateLatency.add(t1 - t);
+		m_endToEndLatency.add(t1 - m_arrivalTime);
+	}
+
+	void print_report(uint64_t replay_time, uint64_t recorded_time, uint64_t num_records)
+	{
+		const double seconds = replay_time / 1e9;
+
+		printf("\nrecords                  %llu (%llu ZMQ, %llu P2P), %llu ZMQ from other hosts skipped\n", static_cast<unsigned long long>(num_records), static_cast<unsigned long long>(m_zmqMessages), static_cast<unsigned long long>(m_p2pMessages), static_cast<unsigned long long>(m_zmqSkipped));
+		printf("replay time              %.3f s (recorded %.3f s)\n", seconds, recorded_time / 1e6);
+		printf("blocks ingested          %llu (%.1f/s), %llu failed to deserialize, %llu compact broadcasts skipped\n", static_cast<unsigned long long>(m_blocksIngested), m_blocksIngested / seconds, static_cast<unsigned long long>(m_blocksFailed), static_cast<unsigned long long>(m_blocksCompact));
+		printf("template rebuilds        %llu (%.1f/s)\n", static_cast<unsigned long long>(m_templateRebuilds), m_templateRebuilds / seconds);
+
+		const PoolBlock* tip = m_sidechain.chainTip();
+		if (tip) {
+			printf("sidechain tip            height %llu, mainchain height %llu\n", static_cast<unsigned long long>(tip->m_sidechainHeight), static_cast<unsigned long long>(tip->m_txinGenHeight));
+		}
+
+		printf("\n%-34s %10s %12s %12s %12s %12s\n", "latency, us", "count", "p50", "p90", "p99", "max");
+		m_zmqLatency.print("ZMQ message");
+		m_blockLatency.print("P2P block");
+		m_templateLatency.print("template rebuild");
+		m_endToEndLatency.print("end-to-end (message to template)");
+	}
+
+private:
+	SideChain m_sidechain;
+	Mempool m_mempool;
+	ZMQParser m_parser;
+
+	Wallet m_wallet;
+	hash m_txkeySec;
+
+	PoolBlock m_block;
+	PoolBlock m_template;
+	std::vector<TxMempoolData> m_transactions;
+	std::vector<MinerShare> m_shares;
+	std::vector<uint64_t> m_rewards;
+	std::vector<hash> m_ephPublicKeys;
+
+	// When the message that is being processed arrived (was taken from the file or was due by the recorded pace)
+	uint64_t m_arrivalTime;
+
+	uint64_t m_zmqMessages;
+	uint64_t m_zmqSkipped;
+	uint32_t m_zmqHost;
+	uint64_t m_p2pMessages;
+	uint64_t m_blocksIngested;
+	uint64_t m_blocksCompact;
+	uint64_t m_blocksFailed;
+	uint64_t m_templateRebuilds;
+
+	Latencies m_zmqLatency;
+	Latencies m_blockLatency;
+	Latencies m_templateLatency;
+	Latencies m_endToEndLatency;
+};
+
+} // namespace p2pool
+
+int main(int argc, char** argv)
+{
+	using namespace p2pool;
+
+	const char* file_name = nullptr;
+	const char* pool_name = nullptr;
+	bool pace = false;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--pace") == 0) {
+			pace = true;
+		}
+		else if ((strcmp(argv[i], "--pool-name") == 0) && (i + 1 < argc)) {
+			pool_name = argv[++i];
+		}
+		else {
+			file_name = argv[i];
+		}
+	}
+
+	if (!file_name) {
+		printf("Usage: %s <file> [--pace] [--pool-name <name>]\n\n"
+			"--pace       Replay at the recorded pace instead of as fast as possible\n"
+			"--pool-name  Sidechain the traffic was recorded on, default is the main sidechain\n", argv[0]);
+		return 1;
+	}
+
+	traffic::Reader reader(file_name);
+	if (!reader.valid()) {
+		fprintf(stderr, "%s is not a traffic recording\n", file_name);
+		return 1;
+	}
+
+	init_crypto_cache();
+
+	int result = 0;
+	{
+		Replay replay(pool_name);
+		traffic::Record record;
+
+		const uint64_t start_time = uv_hrtime();
+		uint64_t num_records = 0;
+		uint64_t recorded_time = 0;
+
+		while (reader.next(record)) {
+			uint64_t arrival_time = uv_hrtime();
+
+			// Messages which are due while the previous ones are still processed wait, and it's a part of their latency
+			if (pace) {
+				const uint64_t due_time = start_time + record.timestamp * 1000;
+				if (due_time > arrival_time) {
+					std::this_thread::sleep_for(std::chrono::nanoseconds(due_time - arrival_time));
+				}
+				arrival_time = due_time;
+			}
+
+			replay.process(record, arrival_time);
+			recorded_time = record.timestamp;
+			++num_records;
+		}
+
+		replay.print_report(uv_hrtime() - start_time, recorded_time, num_records);
+
+		if (!num_records) {
+			result = 1;
+		}
+	}
+
+	destroy_crypto_cache();
+
+	return result;
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "share_verifier.h"
+#include "gtest/gtest.h"
+#include <random>
+
+namespace p2pool {
+
+namespace {
+
+// Number of shares out of n which need to be verified
+uint32_t count_verified(ShareVerifier& verifier, ShareVerifier::ClientState& state, uint32_t n)
+{
+	std::mt19937_64 rng(n);
+
+	uint32_t result = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		if (verifier.need_to_verify(state, rng)) {
+			++result;
+		}
+	}
+	return result;
+}
+
+raw_ip make_ip(uint8_t k)
+{
+	raw_ip ip = {};
+	ip.data[sizeof(ip.data) - 1] = k;
+	return ip;
+}
+
+}
+
+TEST(share_verifier, escalation)
+{
+	ShareVerifier verifier(10);
+	const raw_ip ip = make_ip(1);
+	const raw_ip ip2 = make_ip(2);
+
+	// New connection: the first shares are verified, then about 10% of them
+	ShareVerifier::ClientState state;
+	verifier.on_login(state, ip);
+	ASSERT_EQ(count_verified(verifier, state, VERIFY_NEW_CLIENT_SHARES), VERIFY_NEW_CLIENT_SHARES);
+
+	const uint32_t n = count_verified(verifier, state, 10000);
+	ASSERT_GT(n, 500);
+	ASSERT_LT(n, 1500);
+
+	// A bad share: everything is verified from now on
+	verifier.on_bad_share(state, ip);
+	ASSERT_TRUE(verifier.is_suspect(ip));
+	ASSERT_FALSE(verifier.is_suspect(ip2));
+	ASSERT_EQ(count_verified(verifier, state, 10000), 10000);
+
+	// Reconnecting doesn't help, no matter how many honest shares it sends first
+	ShareVerifier::ClientState state2;
+	verifier.on_login(state2, ip);
+	ASSERT_EQ(count_verified(verifier, state2, 10000), 10000);
+
+	// Other addresses are not affected
+	ShareVerifier::ClientState state3;
+	verifier.on_login(state3, ip2);
+	ASSERT_EQ(count_verified(verifier, state3, VERIFY_NEW_CLIENT_SHARES), VERIFY_NEW_CLIENT_SHARES);
+	ASSERT_LT(count_verified(verifier, state3, 10000), 1500);
+
+	// A long run of good shares halves the rate, until it's back to the default one and the address is forgotten
+	for (uint32_t i = 0; i < VERIFY_DECAY_SHARES - 1; ++i) {
+		verifier.on_good_share(state2, ip);
+	}
+	ASSERT_EQ(state2.m_rate, 100);
+
+	verifier.on_good_share(state2, ip);
+	ASSERT_EQ(state2.m_rate, 50);
+	ASSERT_TRUE(verifier.is_suspect(ip));
+
+	// A bad share in the middle of it starts everything again
+	verifier.on_good_share(state2, ip);
+	verifier.on_bad_share(state2, ip);
+	ASSERT_EQ(state2.m_rate, 100);
+
+	for (uint32_t i = 0; i < VERIFY_DECAY_SHARES * 4; ++i) {
+		verifier.on_good_share(state2, ip);
+	}
+	ASSERT_EQ(state2.m_rate, 10);
+	ASSERT_FALSE(verifier.is_suspect(ip));
+
+	ShareVerifier::ClientState state4;
+	verifier.on_login(state4, ip);
+	ASSERT_EQ(state4.m_rate, 10);
+	ASSERT_EQ(state4.m_verifyAllShares, VERIFY_NEW_CLIENT_SHARES);
+
+	// Bad shares of clients which are already gone still count
+	verifier.on_bad_share(ip2);
+	verifier.on_login(state4, ip2);
+	ASSERT_EQ(state4.m_rate, 100);
+}
+
+TEST(share_verifier, disabled)
+{
+	// Verification is off, but clients which sent bad shares are still verified
+	ShareVerifier verifier(0);
+	const raw_ip ip = make_ip(1);
+
+	ShareVerifier::ClientState state;
+	verifier.on_login(state, ip);
+	ASSERT_EQ(count_verified(verifier, state, 1000), 0);
+
+	verifier.on_bad_share(state, ip);
+	ASSERT_EQ(count_verified(verifier, state, 1000), 1000);
+
+	ShareVerifier::ClientState state2;
+	verifier.on_login(state2, ip);
+	ASSERT_EQ(count_verified(verifier, state2, 1000), 1000);
+
+	for (uint32_t i = 0; i < VERIFY_DECAY_SHARES * 8; ++i) {
+		verifier.on_good_share(state2, ip);
+	}
+	ASSERT_EQ(state2.m_rate, 0);
+	ASSERT_FALSE(verifier.is_suspect(ip));
+}
+
+}
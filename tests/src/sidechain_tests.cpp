@@ -0,0 +1,304 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <map>
+#include <set>
+
+namespace p2pool {
+
+namespace {
+
+struct TestBlock
+{
+	hash m_id;
+	hash m_parent;
+	std::vector<hash> m_uncles;
+	uint64_t m_height;
+	uint64_t m_difficulty;
+	hash m_wallet;
+};
+
+struct Dump
+{
+	std::vector<uint8_t> m_data;
+	std::vector<std::pair<const uint8_t*, uint32_t>> m_blobs;
+};
+
+void load_dump(Dump& dump)
+{
+	std::ifstream f("sidechain_dump.dat", std::ios::binary | std::ios::ate);
+	ASSERT_EQ(f.good() && f.is_open(), true);
+
+	dump.m_data.resize(f.tellg());
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(dump.m_data.data()), dump.m_data.size());
+	ASSERT_EQ(f.good(), true);
+
+	for (const uint8_t *p = dump.m_data.data(), *e = dump.m_data.data() + dump.m_data.size(); p < e;) {
+		ASSERT_TRUE(p + sizeof(uint32_t) <= e);
+		const uint32_t n = *reinterpret_cast<const uint32_t*>(p);
+		p += sizeof(uint32_t);
+
+		ASSERT_TRUE(p + n <= e);
+		dump.m_blobs.emplace_back(p, n);
+		p += n;
+	}
+}
+
+// Walks the PPLNS window of the chain tip from scratch and compares it to the running counters
+void check_stats(const SideChain& sidechain, const unordered_map<hash, TestBlock>& blocks, const std::map<uint64_t, std::vector<hash>>& blocks_by_height)
+{
+	const PoolBlock* tip = sidechain.chainTip();
+	if (!tip) {
+		return;
+	}
+
+	const uint64_t window_size = sidechain.chain_window_size();
+
+	std::vector<const TestBlock*> window;
+	auto it = blocks.find(tip->m_sidechainId);
+	ASSERT_TRUE(it != blocks.end());
+
+	for (const TestBlock* cur = &it->second;;) {
+		window.push_back(cur);
+		if ((cur->m_height == 0) || (window.size() >= window_size)) {
+			break;
+		}
+		it = blocks.find(cur->m_parent);
+		ASSERT_TRUE(it != blocks.end());
+		cur = &it->second;
+	}
+
+	const uint64_t lowest_height = window.back()->m_height;
+
+	std::set<hash> in_window;
+	std::set<hash> wallets;
+	uint64_t num_uncles = 0;
+	uint64_t weight = 0;
+
+	for (const TestBlock* b : window) {
+		in_window.insert(b->m_id);
+		wallets.insert(b->m_wallet);
+		weight += b->m_difficulty;
+
+		for (const hash& uncle_id : b->m_uncles) {
+			auto it2 = blocks.find(uncle_id);
+			ASSERT_TRUE(it2 != blocks.end());
+
+			const TestBlock& uncle = it2->second;
+			if (uncle.m_height >= lowest_height) {
+				in_window.insert(uncle.m_id);
+				wallets.insert(uncle.m_wallet);
+				weight += uncle.m_difficulty;
+				++num_uncles;
+			}
+		}
+	}
+
+	uint64_t num_orphans = 0;
+	for (auto it2 = blocks_by_height.lower_bound(lowest_height); (it2 != blocks_by_height.end()) && (it2->first <= tip->m_sidechainHeight); ++it2) {
+		for (const hash& id : it2->second) {
+			if (in_window.find(id) == in_window.end()) {
+				++num_orphans;
+			}
+		}
+	}
+
+	const SideChain::Stats stats = sidechain.stats();
+
+	ASSERT_EQ(stats.m_tipHeight, tip->m_sidechainHeight);
+	ASSERT_EQ(stats.m_totalHashes, tip->m_cumulativeDifficulty);
+	ASSERT_EQ(stats.m_windowBlocks, window.size());
+	ASSERT_EQ(stats.m_windowUncles, num_uncles);
+	ASSERT_EQ(stats.m_windowOrphans, num_orphans);
+	ASSERT_EQ(stats.m_windowMiners, wallets.size());
+	ASSERT_EQ(stats.m_windowWeight, weight);
+
+	// There is no p2pool instance and therefore no wallet of our own
+	ASSERT_EQ(stats.m_ourBlocks, 0);
+	ASSERT_EQ(stats.m_ourUncles, 0);
+	ASSERT_EQ(stats.m_ourOrphans, 0);
+	ASSERT_EQ(stats.m_ourWeight, 0);
+}
+
+// Keeps its own copy of what was added to the sidechain to check its statistics after every block
+struct StatsChecker
+{
+	StatsChecker() : m_sidechain(nullptr, NetworkType::Mainnet), m_numReorgs(0) {}
+
+	void add(const PoolBlock& b)
+	{
+		TestBlock& t = m_blocks[b.m_sidechainId];
+		t.m_id = b.m_sidechainId;
+		t.m_parent = b.m_parent;
+		t.m_uncles = b.m_uncles;
+		t.m_height = b.m_sidechainHeight;
+		t.m_difficulty = b.m_difficulty.lo;
+		t.m_wallet = b.m_minerWallet.spend_public_key();
+		m_blocksByHeight[t.m_height].push_back(t.m_id);
+
+		const PoolBlock* old_tip = m_sidechain.chainTip();
+		const hash old_tip_id = old_tip ? old_tip->m_sidechainId : hash();
+
+		m_sidechain.add_block(b);
+
+		const PoolBlock* new_tip = m_sidechain.chainTip();
+		if (old_tip && (new_tip != old_tip) && (new_tip->m_parent != old_tip_id)) {
+			++m_numReorgs;
+		}
+
+		check_stats(m_sidechain, m_blocks, m_blocksByHeight);
+	}
+
+	SideChain m_sidechain;
+	unordered_map<hash, TestBlock> m_blocks;
+	std::map<uint64_t, std::vector<hash>> m_blocksByHeight;
+	uint64_t m_numReorgs;
+};
+
+}
+
+TEST(sidechain, stats)
+{
+	init_crypto_cache();
+
+	Dump dump;
+	load_dump(dump);
+
+	StatsChecker checker;
+	PoolBlock b;
+
+	std::vector<uint64_t> heights;
+	for (const auto& blob : dump.m_blobs) {
+		ASSERT_EQ(b.deserialize(blob.first, blob.second, checker.m_sidechain), 0);
+		heights.push_back(b.m_sidechainHeight);
+	}
+
+	const uint64_t top_height = *std::max_element(heights.begin(), heights.end());
+
+	// The dump goes from the newest block to the oldest, and the oldest ones are verified only when they're deep enough (m_chainWindowSize * 2)
+	// Holding back a few top heights still leaves them deep enough, so the chain tip is known before these blocks are added on top of it
+	constexpr uint64_t NUM_APPENDED_HEIGHTS = 10;
+
+	std::vector<size_t> appended;
+	for (size_t i = 0; i < dump.m_blobs.size(); ++i) {
+		if (heights[i] + NUM_APPENDED_HEIGHTS > top_height) {
+			appended.push_back(i);
+			continue;
+		}
+		ASSERT_EQ(b.deserialize(dump.m_blobs[i].first, dump.m_blobs[i].second, checker.m_sidechain), 0);
+		checker.add(b);
+		ASSERT_FALSE(HasFatalFailure());
+	}
+
+	ASSERT_TRUE(checker.m_sidechain.chainTip() != nullptr);
+	ASSERT_EQ(checker.m_sidechain.chainTip()->m_sidechainHeight + NUM_APPENDED_HEIGHTS, top_height);
+
+	std::sort(appended.begin(), appended.end(), [&heights](size_t a, size_t b) { return heights[a] < heights[b]; });
+
+	for (size_t k = 0; k < appended.size(); ++k) {
+		const size_t i = appended[k];
+		ASSERT_EQ(b.deserialize(dump.m_blobs[i].first, dump.m_blobs[i].second, checker.m_sidechain), 0);
+
+		// Every other height gets a competing block first: the same block with a different id, so it's valid and becomes the chain tip
+		// The real block then loses the tie, and the next real block on top of it moves the tip back to the real chain (a reorg)
+		if (k & 1) {
+			PoolBlock fake(b);
+			fake.m_sidechainId.h[0] ^= 1;
+			checker.add(fake);
+			ASSERT_FALSE(HasFatalFailure());
+			ASSERT_EQ(checker.m_sidechain.chainTip()->m_sidechainId, fake.m_sidechainId);
+		}
+
+		checker.add(b);
+		ASSERT_FALSE(HasFatalFailure());
+	}
+
+	ASSERT_GT(checker.m_numReorgs, 0);
+	ASSERT_EQ(checker.m_sidechain.chainTip()->m_sidechainHeight, top_height);
+
+	// Competing blocks which lost are orphans now
+	ASSERT_GT(checker.m_sidechain.stats().m_windowOrphans, 0);
+
+	destroy_crypto_cache();
+}
+
+TEST(sidechain, get_block_blobs)
+{
+	init_crypto_cache();
+
+	Dump dump;
+	load_dump(dump);
+
+	SideChain sidechain(nullptr, NetworkType::Mainnet);
+	PoolBlock b;
+
+	for (const auto& blob : dump.m_blobs) {
+		ASSERT_EQ(b.deserialize(blob.first, blob.second, sidechain), 0);
+		sidechain.add_block(b);
+	}
+
+	const PoolBlock* tip = sidechain.chainTip();
+	ASSERT_TRUE(tip != nullptr);
+
+	hash unknown_id;
+	unknown_id.h[0] = 1;
+
+	const hash ids[3] = { tip->m_sidechainId, unknown_id, tip->m_parent };
+	std::vector<SharedBuf*> blobs;
+
+	auto release = [&blobs]() {
+		for (SharedBuf* blob : blobs) {
+			blob->release();
+		}
+		blobs.clear();
+	};
+
+	// The tip and its ancestors down to min_height, the parent was sent with them and only the unknown block is missing
+	ASSERT_EQ(sidechain.get_block_blobs(ids, 3, tip->m_sidechainHeight - 5, 100, std::numeric_limits<uint64_t>::max(), blobs), 1);
+	ASSERT_EQ(blobs.size(), 6);
+	ASSERT_EQ(blobs.back(), tip->m_blob);
+	release();
+
+	// Block limit: the tip and its parent fill it
+	ASSERT_EQ(sidechain.get_block_blobs(ids, 3, 0, 2, std::numeric_limits<uint64_t>::max(), blobs), 1);
+	ASSERT_EQ(blobs.size(), 2);
+	release();
+
+	ASSERT_EQ(sidechain.get_block_blobs(ids, 3, 0, 1, std::numeric_limits<uint64_t>::max(), blobs), 2);
+	ASSERT_EQ(blobs.size(), 1);
+	release();
+
+	// Byte limit: only the tip fits
+	ASSERT_EQ(sidechain.get_block_blobs(ids, 1, 0, 100, tip->m_blob->m_data.size(), blobs), 0);
+	ASSERT_EQ(blobs.size(), 1);
+	ASSERT_EQ(blobs[0], tip->m_blob);
+	release();
+
+	ASSERT_EQ(sidechain.get_block_blobs(ids, 3, 0, 100, 0, blobs), 3);
+	ASSERT_TRUE(blobs.empty());
+
+	destroy_crypto_cache();
+}
+
+}
@@ -0,0 +1,889 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "tcp_server.h"
+#include <random>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Opens many stratum connections to a running p2pool and measures how fast it serves them
+// Usage: p2pool_stratum_load [options], see print_usage()
+//
+// Every connection logs in as its own worker with a custom difficulty and submits shares at its part of the total rate
+// Valid shares get a made-up result hash that passes the target check, so p2pool must run with "--stratum-verify 0" (the default)
+// Invalid shares use a job id the server never issued, stale shares use the job before the current one
+// Low diff and invalid PoW shares are never sent: p2pool bans the IP for them, and all connections come from one IP here
+
+static constexpr char log_category_prefix[] = "StratumLoad ";
+
+static constexpr int DEFAULT_BACKLOG = 16;
+static constexpr size_t LOAD_BUF_SIZE = p2pool::log::Stream::BUF_SIZE + 1;
+
+#include "tcp_server.inl"
+
+namespace p2pool {
+
+// Waves of new jobs are considered finished after this long, and their delivery latencies are reported
+static constexpr uint64_t WAVE_TIMEOUT_NS = 5000000000ULL;
+
+static constexpr uint64_t SUBMIT_INTERVAL_MS = 10;
+
+static constexpr uint32_t LOGIN_RPC_ID = 1;
+
+// Hex chars of the hashing blob before the nonce: versions, timestamp and prev_id are the same for all jobs of one template
+static constexpr size_t BLOB_TEMPLATE_KEY_SIZE = 78;
+static constexpr size_t BLOB_NONCE_OFFSET = 39;
+
+struct LoadParams
+{
+	std::vector<std::string> m_hosts{ "127.0.0.1" };
+	int m_port = 3333;
+	uint32_t m_connections = 1000;
+	double m_shareRate = 100.0;
+	uint32_t m_invalidPercent = 2;
+	uint32_t m_stalePercent = 2;
+	uint64_t m_diff = 10000;
+	const char* m_user = "load";
+	uint32_t m_duration = 60;
+	uint32_t m_reportInterval = 10;
+};
+
+struct Latencies
+{
+	std::vector<uint64_t> m_values;
+
+	void add(uint64_t ns) { m_values.push_back(ns); }
+
+	uint64_t percentile(size_t p) const { return m_values[std::min(m_values.size() - 1, m_values.size() * p / 100)]; }
+
+	void print(const char* name)
+	{
+		if (m_values.empty()) {
+			printf("%-28s %10s\n", name, "-");
+			return;
+		}
+
+		std::sort(m_values.begin(), m_values.end());
+		printf("%-28s %10zu %12.1f %12.1f %12.1f %12.1f\n", name, m_values.size(), percentile(50) / 1e3, percentile(90) / 1e3, percentile(99) / 1e3, m_values.back() / 1e3);
+	}
+};
+
+class LoadGenerator : public TCPServer<LOAD_BUF_SIZE, LOAD_BUF_SIZE>
+{
+public:
+	explicit LoadGenerator(const LoadParams& params);
+	~LoadGenerator();
+
+	// Stops connecting and submitting, must be called before shutdown_tcp()
+	void stop();
+
+	void print_report(uint64_t elapsed_ns);
+
+	enum ShareKind { SHARE_VALID, SHARE_STALE, SHARE_INVALID, NUM_SHARE_KINDS };
+	enum ShareResult { RESULT_OK, RESULT_STALE, RESULT_INVALID_JOB_ID, RESULT_OTHER_ERROR, NUM_SHARE_RESULTS };
+
+	struct LoadClient : public Client
+	{
+		LoadClient() : m_loggedIn(false) { LoadClient::reset(); }
+
+		static Client* allocate() { return new LoadClient(); }
+
+		void reset() override;
+		bool on_connect() override;
+		bool on_read(char* data, uint32_t size) override;
+		void on_read_failed(int /*err*/) override { on_disconnected(); }
+		void on_disconnected() override;
+
+		bool process_line(char* line);
+		bool parse_job(const char* job, uint64_t now);
+		bool submit(ShareKind kind);
+
+		struct PendingShare
+		{
+			uint64_t m_sendTime;
+			ShareKind m_kind;
+		};
+
+		uint64_t m_connectTime;
+		uint32_t m_index;
+		bool m_loggedIn;
+
+		char m_rpcId[32];
+		char m_jobId[32];
+		char m_prevJobId[32];
+		uint64_t m_target;
+		uint32_t m_nonceFixed;
+
+		uint32_t m_nextRequestId;
+		uint32_t m_nonce;
+		double m_credit;
+		unordered_map<uint32_t, PendingShare> m_pendingShares;
+
+		uint64_t m_lastWaveId;
+	};
+
+private:
+	static void on_connect_async(uv_async_t* handle) { reinterpret_cast<LoadGenerator*>(handle->data)->connect_more(); }
+	static void on_stop_async(uv_async_t* handle) { reinterpret_cast<LoadGenerator*>(handle->data)->on_stop(); }
+	static void on_submit_timer(uv_timer_t* handle) { reinterpret_cast<LoadGenerator*>(handle->data)->submit_shares(); }
+	static void on_report_timer(uv_timer_t* handle) { reinterpret_cast<LoadGenerator*>(handle->data)->on_report(); }
+
+	void connect_more();
+	void on_stop();
+	void submit_shares();
+	void on_report();
+
+	void on_connect_failed(bool is_v6, const raw_ip& ip, int port) override;
+
+	void on_job(LoadClient* client, const char* blob, uint64_t now);
+	void on_share_response(ShareKind kind, ShareResult result, uint64_t latency);
+
+	// All connections of one template's jobs, the first client to get it starts the wave
+	struct Wave
+	{
+		uint64_t m_id;
+		uint64_t m_startTime;
+		uint32_t m_numClients;
+		Latencies m_latency;
+	};
+
+	void finish_wave(Wave& wave);
+
+	LoadParams m_params;
+
+	uv_async_t m_connectAsync;
+	uv_async_t m_stopAsync;
+	uv_timer_t m_submitTimer;
+	uv_timer_t m_reportTimer;
+	std::atomic<bool> m_stopped;
+
+	std::mt19937_64 m_rng;
+
+	// Everything below is only accessed from the event loop thread, or after it has stopped
+	uint64_t m_startTime;
+	uint32_t m_numConnecting;
+	uint32_t m_numLoggedIn;
+	uint32_t m_nextClientIndex;
+
+	uint64_t m_connectAttempts;
+	uint64_t m_connectFailures;
+	uint64_t m_drops;
+	uint64_t m_loginErrors;
+	uint64_t m_protocolErrors;
+	uint64_t m_sharesLost;
+	uint64_t m_sharesUnanswered;
+
+	uint64_t m_sharesSent[NUM_SHARE_KINDS];
+	uint64_t m_shareResults[NUM_SHARE_KINDS][NUM_SHARE_RESULTS];
+	uint64_t m_lastReportSent;
+	uint64_t m_lastReportAnswered;
+	uint64_t m_lastReportTime;
+
+	uint64_t m_jobsReceived;
+	uint64_t m_waveCounter;
+	unordered_map<std::string, Wave> m_waves;
+	uint64_t m_numWaves;
+
+	Latencies m_loginLatency;
+	Latencies m_submitLatency[NUM_SHARE_KINDS];
+	Latencies m_jobLatency;
+};
+
+LoadGenerator::LoadGenerator(const LoadParams& params)
+	: TCPServer(LoadClient::allocate)
+	, m_params(params)
+	, m_connectAsync{}
+	, m_stopAsync{}
+	, m_submitTimer{}
+	, m_reportTimer{}
+	, m_stopped(false)
+	, m_rng(std::random_device()())
+	, m_startTime(uv_hrtime())
+	, m_numConnecting(0)
+	, m_numLoggedIn(0)
+	, m_nextClientIndex(0)
+	, m_connectAttempts(0)
+	, m_connectFailures(0)
+	, m_drops(0)
+	, m_loginErrors(0)
+	, m_protocolErrors(0)
+	, m_sharesLost(0)
+	, m_sharesUnanswered(0)
+	, m_sharesSent{}
+	, m_shareResults{}
+	, m_lastReportSent(0)
+	, m_lastReportAnswered(0)
+	, m_lastReportTime(m_startTime)
+	, m_jobsReceived(0)
+	, m_waveCounter(0)
+	, m_numWaves(0)
+{
+	int err = uv_async_init(&m_loop, &m_connectAsync, on_connect_async);
+	if (err) {
+		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
+		panic();
+	}
+	m_connectAsync.data = this;
+
+	err = uv_async_init(&m_loop, &m_stopAsync, on_stop_async);
+	if (err) {
+		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
+		panic();
+	}
+	m_stopAsync.data = this;
+
+	err = uv_timer_init(&m_loop, &m_submitTimer);
+	if (err) {
+		LOGERR(1, "failed to create timer, error " << uv_err_name(err));
+		panic();
+	}
+	m_submitTimer.data = this;
+
+	err = uv_timer_init(&m_loop, &m_reportTimer);
+	if (err) {
+		LOGERR(1, "failed to create timer, error " << uv_err_name(err));
+		panic();
+	}
+	m_reportTimer.data = this;
+
+	err = uv_timer_start(&m_submitTimer, on_submit_timer, SUBMIT_INTERVAL_MS, SUBMIT_INTERVAL_MS);
+	if (err) {
+		LOGERR(1, "failed to start timer, error " << uv_err_name(err));
+		panic();
+	}
+
+	// Also retries connections which couldn't be started, for example when running out of file descriptors
+	err = uv_timer_start(&m_reportTimer, on_report_timer, 1000, 1000);
+	if (err) {
+		LOGERR(1, "failed to start timer, error " << uv_err_name(err));
+		panic();
+	}
+
+	uv_async_send(&m_connectAsync);
+	start_event_loops();
+}
+
+LoadGenerator::~LoadGenerator()
+{
+	stop();
+	shutdown_tcp();
+}
+
+void LoadGenerator::stop()
+{
+	if (m_stopped.exchange(true)) {
+		return;
+	}
+
+	// Handles of the event loop must be closed in its own thread
+	uv_async_send(&m_stopAsync);
+}
+
+void LoadGenerator::on_stop()
+{
+	uv_timer_stop(&m_submitTimer);
+	uv_timer_stop(&m_reportTimer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_submitTimer), nullptr);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_reportTimer), nullptr);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_connectAsync), nullptr);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_stopAsync), nullptr);
+
+	MutexLock lock(m_clientsListLock);
+
+	for (LoadClient* client = static_cast<LoadClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<LoadClient*>(client->m_next)) {
+		m_sharesUnanswered += client->m_pendingShares.size();
+	}
+
+	for (auto& it : m_waves) {
+		finish_wave(it.second);
+	}
+	m_waves.clear();
+}
+
+void LoadGenerator::connect_more()
+{
+	if (m_stopped.load()) {
+		return;
+	}
+
+	// TCPServer allows only one pending connection per IP, so each host gets one new connection at a time
+	// and the next one starts as soon as it's connected
+	for (const std::string& host : m_params.m_hosts) {
+		if (m_numConnections + m_numConnecting >= m_params.m_connections) {
+			break;
+		}
+
+		++m_connectAttempts;
+
+		if (connect_to_peer(host.find(':') != std::string::npos, host.c_str(), m_params.m_port)) {
+			++m_numConnecting;
+		}
+	}
+}
+
+void LoadGenerator::on_connect_failed(bool, const raw_ip&, int)
+{
+	// Failed connections are retried by the report timer, retrying right away would only flood a server that can't accept more
+	++m_connectFailures;
+	--m_numConnecting;
+}
+
+void LoadGenerator::submit_shares()
+{
+	if (!m_numLoggedIn) {
+		return;
+	}
+
+	const double credit = m_params.m_shareRate * (SUBMIT_INTERVAL_MS / 1e3) / m_numLoggedIn;
+
+	MutexLock lock(m_clientsListLock);
+
+	for (LoadClient* client = static_cast<LoadClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<LoadClient*>(client->m_next)) {
+		if (!client->m_loggedIn) {
+			continue;
+		}
+
+		for (client->m_credit += credit; client->m_credit >= 1.0; client->m_credit -= 1.0) {
+			const uint32_t k = static_cast<uint32_t>(m_rng() % 100);
+
+			ShareKind kind = SHARE_VALID;
+			if (k < m_params.m_invalidPercent) {
+				kind = SHARE_INVALID;
+			}
+			else if ((k < m_params.m_invalidPercent + m_params.m_stalePercent) && client->m_prevJobId[0]) {
+				kind = SHARE_STALE;
+			}
+
+			if (!client->submit(kind)) {
+				client->close();
+				break;
+			}
+		}
+	}
+}
+
+void LoadGenerator::on_report()
+{
+	connect_more();
+
+	const uint64_t now = uv_hrtime();
+
+	for (auto it = m_waves.begin(); it != m_waves.end();) {
+		if (now - it->second.m_startTime >= WAVE_TIMEOUT_NS) {
+			finish_wave(it->second);
+			it = m_waves.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	if ((now - m_lastReportTime) / 1000000000ULL < m_params.m_reportInterval) {
+		return;
+	}
+
+	uint64_t sent = 0;
+	uint64_t answered = 0;
+	for (uint32_t i = 0; i < NUM_SHARE_KINDS; ++i) {
+		sent += m_sharesSent[i];
+		for (uint32_t j = 0; j < NUM_SHARE_RESULTS; ++j) {
+			answered += m_shareResults[i][j];
+		}
+	}
+
+	const double dt = (now - m_lastReportTime) / 1e9;
+
+	printf("%6.0f s: %u connected, %u logged in, %u connecting, %.1f shares/s sent, %.1f responses/s, %llu drops, %llu connect failures, %llu templates\n",
+		(now - m_startTime) / 1e9, m_numConnections.load(), m_numLoggedIn, m_numConnecting, (sent - m_lastReportSent) / dt, (answered - m_lastReportAnswered) / dt,
+		static_cast<unsigned long long>(m_drops), static_cast<unsigned long long>(m_connectFailures), static_cast<unsigned long long>(m_numWaves));
+	fflush(stdout);
+
+	m_lastReportSent = sent;
+	m_lastReportAnswered = answered;
+	m_lastReportTime = now;
+}
+
+void LoadGenerator::on_job(LoadClient* client, const char* blob, uint64_t now)
+{
+	++m_jobsReceived;
+
+	const std::string key(blob, std::min(strlen(blob), BLOB_TEMPLATE_KEY_SIZE));
+
+	auto it = m_waves.find(key);
+
+	// A client getting the same template key twice means it's a new template with the same timestamp and prev_id
+	if ((it == m_waves.end()) || (it->second.m_id == client->m_lastWaveId)) {
+		if (it != m_waves.end()) {
+			finish_wave(it->second);
+			m_waves.erase(it);
+		}
+
+		Wave& wave = m_waves[key];
+		wave.m_id = ++m_waveCounter;
+		wave.m_startTime = now;
+		wave.m_numClients = m_numLoggedIn;
+		wave.m_latency.add(0);
+
+		client->m_lastWaveId = wave.m_id;
+		return;
+	}
+
+	it->second.m_latency.add(now - it->second.m_startTime);
+	client->m_lastWaveId = it->second.m_id;
+}
+
+void LoadGenerator::finish_wave(Wave& wave)
+{
+	Latencies& l = wave.m_latency;
+	std::sort(l.m_values.begin(), l.m_values.end());
+
+	++m_numWaves;
+	printf("template %llu: jobs delivered to %zu of %u clients, spread p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+		static_cast<unsigned long long>(wave.m_id), l.m_values.size(), wave.m_numClients, l.percentile(50) / 1e6, l.percentile(99) / 1e6, l.m_values.back() / 1e6);
+	fflush(stdout);
+
+	// The first client's zero is not a latency, it only marks the start of the wave
+	m_jobLatency.m_values.insert(m_jobLatency.m_values.end(), l.m_values.begin() + 1, l.m_values.end());
+}
+
+void LoadGenerator::on_share_response(ShareKind kind, ShareResult result, uint64_t latency)
+{
+	++m_shareResults[kind][result];
+	m_submitLatency[kind].add(latency);
+}
+
+void LoadGenerator::print_report(uint64_t elapsed_ns)
+{
+	static const char* kind_names[NUM_SHARE_KINDS] = { "valid", "stale", "invalid" };
+
+	const double seconds = elapsed_ns / 1e9;
+
+	printf("\nduration             %.1f s\n", seconds);
+	printf("connections          %llu attempts, %llu failed, %llu dropped by the server, %llu login errors, %llu protocol errors\n",
+		static_cast<unsigned long long>(m_connectAttempts), static_cast<unsigned long long>(m_connectFailures), static_cast<unsigned long long>(m_drops),
+		static_cast<unsigned long long>(m_loginErrors), static_cast<unsigned long long>(m_protocolErrors));
+	printf("jobs                 %llu received, %llu templates\n", static_cast<unsigned long long>(m_jobsReceived), static_cast<unsigned long long>(m_numWaves));
+	printf("shares               %llu lost with dropped connections, %llu unanswered at the end\n", static_cast<unsigned long long>(m_sharesLost), static_cast<unsigned long long>(m_sharesUnanswered));
+
+	printf("\n%-28s %10s %10s %10s %10s %10s\n", "shares", "sent", "OK", "stale", "bad job id", "other");
+	for (uint32_t i = 0; i < NUM_SHARE_KINDS; ++i) {
+		const uint64_t* r = m_shareResults[i];
+		printf("%-28s %10llu %10llu %10llu %10llu %10llu\n", kind_names[i], static_cast<unsigned long long>(m_sharesSent[i]),
+			static_cast<unsigned long long>(r[RESULT_OK]), static_cast<unsigned long long>(r[RESULT_STALE]),
+			static_cast<unsigned long long>(r[RESULT_INVALID_JOB_ID]), static_cast<unsigned long long>(r[RESULT_OTHER_ERROR]));
+	}
+
+	printf("\n%-28s %10s %12s %12s %12s %12s\n", "latency, us", "count", "p50", "p90", "p99", "max");
+	m_loginLatency.print("login");
+	m_jobLatency.print("job delivery (spread)");
+	m_submitLatency[SHARE_VALID].print("submit (valid)");
+	m_submitLatency[SHARE_STALE].print("submit (stale)");
+	m_submitLatency[SHARE_INVALID].print("submit (invalid)");
+	fflush(stdout);
+}
+
+void LoadGenerator::LoadClient::reset()
+{
+	if (m_owner && m_loggedIn) {
+		--static_cast<LoadGenerator*>(m_owner)->m_numLoggedIn;
+	}
+
+	Client::reset();
+
+	m_connectTime = 0;
+	m_index = 0;
+	m_loggedIn = false;
+
+	m_rpcId[0] = '\0';
+	m_jobId[0] = '\0';
+	m_prevJobId[0] = '\0';
+	m_target = 0;
+	m_nonceFixed = 0;
+
+	m_nextRequestId = LOGIN_RPC_ID + 1;
+	m_nonce = 0;
+	m_credit = 0.0;
+	m_pendingShares.clear();
+
+	m_lastWaveId = 0;
+}
+
+bool LoadGenerator::LoadClient::on_connect()
+{
+	LoadGenerator* owner = static_cast<LoadGenerator*>(m_owner);
+
+	--owner->m_numConnecting;
+	uv_async_send(&owner->m_connectAsync);
+
+	m_connectTime = uv_hrtime();
+	m_index = owner->m_nextClientIndex++;
+
+	const char* user = owner->m_params.m_user;
+	const uint32_t index = m_index;
+	const uint64_t diff = owner->m_params.m_diff;
+
+	return owner->send(this,
+		[user, index, diff](void* buf)
+		{
+			log::Stream s(reinterpret_cast<char*>(buf));
+			s << "{\"id\":" << LOGIN_RPC_ID << ",\"jsonrpc\":\"2.0\",\"method\":\"login\",\"params\":{\"login\":\"" << user << index;
+			if (diff) {
+				s << '+' << diff;
+			}
+			s << "\",\"pass\":\"x\",\"agent\":\"p2pool_stratum_load\"}}\n";
+			return s.m_pos;
+		});
+}
+
+void LoadGenerator::LoadClient::on_disconnected()
+{
+	LoadGenerator* owner = static_cast<LoadGenerator*>(m_owner);
+	if (!owner || owner->m_stopped.load()) {
+		return;
+	}
+
+	++owner->m_drops;
+	owner->m_sharesLost += m_pendingShares.size();
+	m_pendingShares.clear();
+
+	uv_async_send(&owner->m_connectAsync);
+}
+
+bool LoadGenerator::LoadClient::on_read(char* data, uint32_t size)
+{
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + m_readBufSize)) {
+		LOGERR(1, "client: invalid data pointer or size in on_read()");
+		return false;
+	}
+
+	m_numRead += size;
+
+	char* line_start = m_readBuf;
+	for (char* c = data; c < m_readBuf + m_numRead; ++c) {
+		if (*c == '\n') {
+			*c = '\0';
+			if (!process_line(line_start)) {
+				++static_cast<LoadGenerator*>(m_owner)->m_protocolErrors;
+				return false;
+			}
+			line_start = c + 1;
+		}
+	}
+
+	if (line_start != m_readBuf) {
+		m_numRead = static_cast<uint32_t>(m_readBuf + m_numRead - line_start);
+		if (m_numRead > 0) {
+			memmove(m_readBuf, line_start, m_numRead);
+		}
+	}
+
+	return true;
+}
+
+// Server messages have a fixed layout, so looking up "key":"value" strings is enough to parse them
+static bool find_string(const char* data, const char* key, char* value, size_t max_size)
+{
+	const char* p = strstr(data, key);
+	if (!p) {
+		return false;
+	}
+	p += strlen(key);
+
+	size_t n = 0;
+	while (p[n] && (p[n] != '"')) {
+		if (n + 1 >= max_size) {
+			return false;
+		}
+		value[n] = p[n];
+		++n;
+	}
+	value[n] = '\0';
+
+	return p[n] == '"';
+}
+
+bool LoadGenerator::LoadClient::parse_job(const char* job, uint64_t now)
+{
+	const char* blob = strstr(job, "\"blob\":\"");
+	if (!blob) {
+		return false;
+	}
+	blob += 8;
+
+	char target[32];
+	char job_id[sizeof(m_jobId)];
+
+	if (!find_string(job, "\"job_id\":\"", job_id, sizeof(job_id)) || !find_string(job, "\"target\":\"", target, sizeof(target))) {
+		return false;
+	}
+
+	// Target is a little-endian 4 or 8 byte value, 4 byte targets are the highest half of the 8 byte target
+	const size_t target_len = strlen(target);
+	if ((target_len != sizeof(uint32_t) * 2) && (target_len != sizeof(uint64_t) * 2)) {
+		return false;
+	}
+
+	uint64_t t = 0;
+	for (size_t i = target_len; i > 0; i -= 2) {
+		uint32_t d[2];
+		if (!from_hex(target[i - 2], d[0]) || !from_hex(target[i - 1], d[1])) {
+			return false;
+		}
+		t = (t << 8) | (d[0] << 4) | d[1];
+	}
+
+	if (target_len == sizeof(uint32_t) * 2) {
+		t <<= 32;
+	}
+
+	if (!t) {
+		return false;
+	}
+
+	// With NiceHash-style blob sharing, the highest nonce byte is fixed by the server
+	m_nonceFixed = 0;
+	if (strlen(blob) >= (BLOB_NONCE_OFFSET + sizeof(uint32_t)) * 2) {
+		uint32_t d[2];
+		const char* s = blob + (BLOB_NONCE_OFFSET + sizeof(uint32_t) - 1) * 2;
+		if (from_hex(s[0], d[0]) && from_hex(s[1], d[1])) {
+			m_nonceFixed = ((d[0] << 4) | d[1]) << 24;
+		}
+	}
+
+	memcpy(m_prevJobId, m_jobId, sizeof(m_jobId));
+	memcpy(m_jobId, job_id, sizeof(m_jobId));
+	m_target = t;
+
+	// Only jobs pushed by the server are new templates, the job sent with the login response is not
+	if (m_loggedIn) {
+		static_cast<LoadGenerator*>(m_owner)->on_job(this, blob, now);
+	}
+
+	return true;
+}
+
+bool LoadGenerator::LoadClient::process_line(char* line)
+{
+	const uint64_t now = uv_hrtime();
+	LoadGenerator* owner = static_cast<LoadGenerator*>(m_owner);
+
+	if (strstr(line, "\"method\":\"job\"")) {
+		return parse_job(line, now);
+	}
+
+	if (strncmp(line, "{\"id\":", 6) != 0) {
+		return false;
+	}
+
+	const uint32_t id = static_cast<uint32_t>(strtoul(line + 6, nullptr, 10));
+
+	if (id == LOGIN_RPC_ID) {
+		if (m_loggedIn) {
+			return false;
+		}
+
+		if (!find_string(line, "\"result\":{\"id\":\"", m_rpcId, sizeof(m_rpcId)) || !parse_job(line, now)) {
+			++owner->m_loginErrors;
+			return false;
+		}
+
+		m_loggedIn = true;
+		++owner->m_numLoggedIn;
+		owner->m_loginLatency.add(now - m_connectTime);
+		return true;
+	}
+
+	auto it = m_pendingShares.find(id);
+	if (it == m_pendingShares.end()) {
+		return false;
+	}
+
+	ShareResult result = RESULT_OTHER_ERROR;
+	if (strstr(line, "\"status\":\"OK\"")) {
+		result = RESULT_OK;
+	}
+	else if (strstr(line, "\"message\":\"Stale share\"")) {
+		result = RESULT_STALE;
+	}
+	else if (strstr(line, "\"message\":\"Invalid job id\"")) {
+		result = RESULT_INVALID_JOB_ID;
+	}
+
+	owner->on_share_response(it->second.m_kind, result, now - it->second.m_sendTime);
+	m_pendingShares.erase(it);
+
+	return true;
+}
+
+bool LoadGenerator::LoadClient::submit(ShareKind kind)
+{
+	LoadGenerator* owner = static_cast<LoadGenerator*>(m_owner);
+
+	const uint32_t id = m_nextRequestId++;
+	const uint32_t nonce = m_nonceFixed | (m_nonce++ & 0xFFFFFFU);
+
+	const char* job_id = m_jobId;
+	if (kind == SHARE_STALE) {
+		job_id = m_prevJobId;
+	}
+	else if (kind == SHARE_INVALID) {
+		job_id = "ffffffff";
+	}
+
+	// Random result hash that passes the target check: its highest 64 bits are below the target
+	uint64_t result[HASH_SIZE / sizeof(uint64_t)];
+	for (uint64_t& k : result) {
+		k = owner->m_rng();
+	}
+	result[array_size(result) - 1] %= m_target;
+
+	const char* rpc_id = m_rpcId;
+
+	const bool ok = owner->send(this,
+		[id, rpc_id, job_id, nonce, &result](void* buf)
+		{
+			log::Stream s(reinterpret_cast<char*>(buf));
+			s << "{\"id\":" << id << ",\"jsonrpc\":\"2.0\",\"method\":\"submit\",\"params\":{\"id\":\"" << rpc_id << "\",\"job_id\":\"" << job_id << "\",\"nonce\":\"";
+			s << log::hex_buf(reinterpret_cast<const uint8_t*>(&nonce), sizeof(nonce)) << "\",\"result\":\"";
+			s << log::hex_buf(reinterpret_cast<const uint8_t*>(result), sizeof(result)) << "\"}}\n";
+			return s.m_pos;
+		});
+
+	if (ok) {
+		m_pendingShares.emplace(id, PendingShare{ uv_hrtime(), kind });
+		++owner->m_sharesSent[kind];
+	}
+
+	return ok;
+}
+
+static void print_usage(const char* name)
+{
+	const LoadParams defaults;
+
+	printf("Usage: %s [options]\n\n"
+		"--host         Comma-separated IP addresses of the stratum server, default is %s\n"
+		"               Use several loopback addresses (127.0.0.1,127.0.0.2,...) for more than ~28000 connections to a local server\n"
+		"--port         Stratum port, default is %d\n"
+		"--connections  Number of connections to keep open, default is %u\n"
+		"--rate         Total shares per second for all connections, default is %.0f\n"
+		"--invalid      Percentage of shares with invalid job id, default is %u\n"
+		"--stale        Percentage of shares for the previous job, default is %u\n"
+		"--diff         Custom difficulty set at login, 0 to use the server's difficulty, default is %llu\n"
+		"--user         Worker name prefix, connection index is appended to it, default is %s\n"
+		"--duration     Test duration in seconds, default is %u\n"
+		"--report       Progress report interval in seconds, default is %u\n\n"
+		"p2pool must run with --stratum-verify 0 because valid shares are not real PoW\n",
+		name, defaults.m_hosts[0].c_str(), defaults.m_port, defaults.m_connections, defaults.m_shareRate, defaults.m_invalidPercent, defaults.m_stalePercent,
+		static_cast<unsigned long long>(defaults.m_diff), defaults.m_user, defaults.m_duration, defaults.m_reportInterval);
+}
+
+} // namespace p2pool
+
+int main(int argc, char** argv)
+{
+	using namespace p2pool;
+
+	LoadParams params;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			print_usage(argv[0]);
+			return 1;
+		}
+
+		const char* value = argv[i + 1];
+
+		if (strcmp(argv[i], "--host") == 0) {
+			params.m_hosts.clear();
+			std::string s = value;
+			for (size_t k = s.find(','); k != std::string::npos; k = s.find(',')) {
+				params.m_hosts.push_back(s.substr(0, k));
+				s.erase(0, k + 1);
+			}
+			params.m_hosts.push_back(s);
+		}
+		else if (strcmp(argv[i], "--port") == 0) {
+			params.m_port = atoi(value);
+		}
+		else if (strcmp(argv[i], "--connections") == 0) {
+			params.m_connections = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+		}
+		else if (strcmp(argv[i], "--rate") == 0) {
+			params.m_shareRate = strtod(value, nullptr);
+		}
+		else if (strcmp(argv[i], "--invalid") == 0) {
+			params.m_invalidPercent = std::min<uint32_t>(static_cast<uint32_t>(strtoul(value, nullptr, 10)), 100);
+		}
+		else if (strcmp(argv[i], "--stale") == 0) {
+			params.m_stalePercent = std::min<uint32_t>(static_cast<uint32_t>(strtoul(value, nullptr, 10)), 100);
+		}
+		else if (strcmp(argv[i], "--diff") == 0) {
+			params.m_diff = strtoull(value, nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--user") == 0) {
+			params.m_user = value;
+		}
+		else if (strcmp(argv[i], "--duration") == 0) {
+			params.m_duration = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+		}
+		else if (strcmp(argv[i], "--report") == 0) {
+			params.m_reportInterval = std::max<uint32_t>(static_cast<uint32_t>(strtoul(value, nullptr, 10)), 1);
+		}
+		else {
+			print_usage(argv[0]);
+			return 1;
+		}
+		++i;
+	}
+
+	if (params.m_hosts.empty() || (params.m_port <= 0) || (params.m_port >= 65536)) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+#ifndef _WIN32
+	// Every connection is a file descriptor
+	rlimit limit;
+	if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur < limit.rlim_max)) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+
+	printf("%u connections to port %d, %.1f shares/s (%u%% invalid, %u%% stale), %u seconds\n",
+		params.m_connections, params.m_port, params.m_shareRate, params.m_invalidPercent, params.m_stalePercent, params.m_duration);
+	fflush(stdout);
+
+	{
+		LoadGenerator generator(params);
+
+		const uint64_t start_time = uv_hrtime();
+		std::this_thread::sleep_for(std::chrono::seconds(params.m_duration));
+
+		generator.stop();
+		generator.shutdown_tcp();
+		generator.print_report(uv_hrtime() - start_time);
+	}
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "stratum_server.h"
+#include "gtest/gtest.h"
+#include <random>
+
+namespace p2pool {
+
+namespace {
+
+// Bytes of the hashing blob as the client sees them in the job message
+std::vector<uint8_t> job_blob(const std::vector<uint8_t>& blob, size_t prefix_size, size_t nonce_offset, bool nicehash, uint8_t nonce_slot)
+{
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream s(buf);
+
+	s << log::hex_buf(blob.data(), prefix_size);
+	StratumServer::write_job_blob(s, blob.data(), blob.size(), prefix_size, nonce_offset, nicehash, nonce_slot);
+
+	std::vector<uint8_t> result;
+	for (int i = 0; i + 1 < s.m_pos; i += 2) {
+		uint8_t d[2];
+		EXPECT_TRUE(from_hex(buf[i], d[0]) && from_hex(buf[i + 1], d[1]));
+		result.push_back(static_cast<uint8_t>((d[0] << 4) | d[1]));
+	}
+	return result;
+}
+
+}
+
+TEST(stratum_server, nonce_groups)
+{
+	constexpr size_t BLOB_SIZE = 76;
+	constexpr size_t NONCE_OFFSET = 39;
+	constexpr uint32_t GROUP_SIZE = 4;
+
+	std::mt19937_64 rng(0);
+
+	std::vector<uint8_t> blob(BLOB_SIZE);
+	for (uint8_t& b : blob) {
+		b = static_cast<uint8_t>(rng());
+	}
+
+	// The highest nonce byte is the last one because the nonce is little-endian
+	ASSERT_EQ(StratumServer::group_nonce_byte(NONCE_OFFSET), NONCE_OFFSET + 3);
+
+	const uint32_t mask = StratumServer::group_nonce_mask(GROUP_SIZE);
+	ASSERT_EQ(mask, 0xFF000000U);
+
+	for (uint32_t slot = 0; slot < GROUP_SIZE; ++slot) {
+		const uint32_t fixed = StratumServer::group_nonce_fixed(slot);
+
+		// The same blob no matter where the common prefix ends, only the highest nonce byte is changed
+		for (size_t prefix_size : { static_cast<size_t>(0), NONCE_OFFSET, StratumServer::group_nonce_byte(NONCE_OFFSET) }) {
+			const std::vector<uint8_t> b = job_blob(blob, prefix_size, NONCE_OFFSET, true, static_cast<uint8_t>(slot));
+			ASSERT_EQ(b.size(), BLOB_SIZE);
+
+			for (size_t i = 0; i < BLOB_SIZE; ++i) {
+				ASSERT_EQ(b[i], (i == NONCE_OFFSET + 3) ? slot : blob[i]);
+			}
+		}
+
+		// A miner keeps the nonce's highest byte and iterates the others
+		std::vector<uint8_t> b = job_blob(blob, 0, NONCE_OFFSET, true, static_cast<uint8_t>(slot));
+
+		uint32_t start_nonce;
+		memcpy(&start_nonce, b.data() + NONCE_OFFSET, sizeof(start_nonce));
+
+		for (uint32_t i : { 0U, 1U, 0x123456U, 0xFFFFFFU }) {
+			const uint32_t nonce = (start_nonce & mask) | i;
+			ASSERT_TRUE(StratumServer::nonce_in_range(nonce, mask, fixed));
+
+			// The server puts the submitted nonce into its own copy of the blob and gets what the miner hashed
+			std::vector<uint8_t> miner_blob = b;
+			memcpy(miner_blob.data() + NONCE_OFFSET, &nonce, sizeof(nonce));
+
+			std::vector<uint8_t> server_blob = blob;
+			StratumServer::write_nonce(server_blob.data(), NONCE_OFFSET, nonce);
+			ASSERT_EQ(server_blob, miner_blob);
+
+			// Nonces of one client are out of range for all others in the group, on_share_found() rejects them with INVALID_NONCE
+			for (uint32_t slot2 = 0; slot2 < 256; ++slot2) {
+				if (slot2 != slot) {
+					ASSERT_FALSE(StratumServer::nonce_in_range(nonce, mask, StratumServer::group_nonce_fixed(slot2)));
+				}
+			}
+		}
+
+		ASSERT_FALSE(StratumServer::nonce_in_range(fixed ^ 0x01000000U, mask, fixed));
+	}
+
+	// Without groups the blob is sent as is and all nonces are in range
+	ASSERT_EQ(job_blob(blob, 0, NONCE_OFFSET, false, 0), blob);
+	ASSERT_EQ(job_blob(blob, BLOB_SIZE / 2, NONCE_OFFSET, false, 0), blob);
+
+	ASSERT_EQ(StratumServer::group_nonce_mask(1), 0);
+	ASSERT_TRUE(StratumServer::nonce_in_range(0xFFFFFFFFU, StratumServer::group_nonce_mask(1), StratumServer::group_nonce_fixed(0)));
+	ASSERT_TRUE(StratumServer::nonce_in_range(0, StratumServer::group_nonce_mask(1), StratumServer::group_nonce_fixed(0)));
+}
+
+}
@@ -0,0 +1,106 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "traffic.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+TEST(traffic, record_and_read)
+{
+	const char file_name[] = "traffic_test.dat";
+
+	ASSERT_TRUE(traffic::start_recording(file_name));
+	ASSERT_TRUE(traffic::is_recording());
+
+	const char zmq_message[] = "json-minimal-txpool_add:[]";
+	const uint8_t p2p_message[] = { 4, 0, 0, 0, 0 };
+
+	const uint32_t id = traffic::new_connection_id();
+	ASSERT_NE(id, 0);
+
+	// ZMQ messages are recorded with the monerod host index
+	traffic::record(traffic::ZMQ, 1, zmq_message, sizeof(zmq_message) - 1);
+	traffic::record(traffic::P2P, id, p2p_message, sizeof(p2p_message));
+	traffic::stop_recording();
+
+	ASSERT_FALSE(traffic::is_recording());
+
+	// Not recorded anymore
+	traffic::record(traffic::ZMQ, 0, zmq_message, sizeof(zmq_message) - 1);
+
+	{
+		traffic::Reader reader(file_name);
+		ASSERT_TRUE(reader.valid());
+
+		traffic::Record r1, r2, r3;
+
+		ASSERT_TRUE(reader.next(r1));
+		ASSERT_EQ(r1.source, traffic::ZMQ);
+		ASSERT_EQ(r1.connection_id, 1);
+		ASSERT_EQ(r1.data, std::vector<uint8_t>(zmq_message, zmq_message + sizeof(zmq_message) - 1));
+
+		ASSERT_TRUE(reader.next(r2));
+		ASSERT_EQ(r2.source, traffic::P2P);
+		ASSERT_EQ(r2.connection_id, id);
+		ASSERT_EQ(r2.data, std::vector<uint8_t>(p2p_message, p2p_message + sizeof(p2p_message)));
+		ASSERT_GE(r2.timestamp, r1.timestamp);
+
+		ASSERT_FALSE(reader.next(r3));
+	}
+
+	remove(file_name);
+}
+
+TEST(traffic, buffered_writes)
+{
+	const char file_name[] = "traffic_test.dat";
+
+	// More than the writer thread flushes at once, and recording can be started again after it was stopped
+	constexpr uint32_t NUM_RECORDS = 5000;
+	std::vector<uint8_t> data(1000);
+
+	for (int k = 0; k < 2; ++k) {
+		ASSERT_TRUE(traffic::start_recording(file_name));
+
+		for (uint32_t i = 0; i < NUM_RECORDS; ++i) {
+			memcpy(data.data(), &i, sizeof(i));
+			traffic::record(traffic::P2P, i, data.data(), data.size());
+		}
+
+		traffic::stop_recording();
+
+		traffic::Reader reader(file_name);
+		ASSERT_TRUE(reader.valid());
+
+		traffic::Record r;
+		for (uint32_t i = 0; i < NUM_RECORDS; ++i) {
+			ASSERT_TRUE(reader.next(r));
+			ASSERT_EQ(r.connection_id, i);
+			ASSERT_EQ(r.data.size(), data.size());
+			ASSERT_EQ(memcmp(r.data.data(), &i, sizeof(i)), 0);
+		}
+
+		ASSERT_FALSE(reader.next(r));
+	}
+
+	remove(file_name);
+}
+
+}
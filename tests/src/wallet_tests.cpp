@@ -18,6 +18,7 @@
 #include "common.h"
 #include "wallet.h"
 #include "gtest/gtest.h"
+#include <thread>
 
 namespace p2pool {
 
@@ -124,4 +125,102 @@ TEST(wallet, decode)
 	);
 }
 
+TEST(wallet, id)
+{
+	Wallet invalid(nullptr);
+	ASSERT_EQ(invalid.id(), 0);
+
+	Wallet w1("49ccoSmrBTPJd5yf8VYCULh4J5rHQaXP1TeC8Cnqhd5H9Y2cMwkJ9w42euLmMghKtCiQcgZEiGYW1K6Ae4biZ7w1HLSexS6");
+	Wallet w2("45JHuqGBSqUXUyZx95H4C2J5aEL4zFjM3jpTmMTESPXPa3jmtSQWYezHX7r4A2xPQNBGsQupJqmPhRZb2QgBcEWRDQ9ywwR");
+
+	ASSERT_NE(w1.id(), 0);
+	ASSERT_NE(w2.id(), 0);
+	ASSERT_NE(w1.id(), w2.id());
+	ASSERT_LT(w1.id(), Wallet::num_ids());
+	ASSERT_LT(w2.id(), Wallet::num_ids());
+
+	// Same spend public key means the same wallet and the same id, no matter how it was made
+	Wallet w3(nullptr);
+	ASSERT_TRUE(w3.assign(w1.spend_public_key(), w1.view_public_key(), NetworkType::Mainnet));
+	ASSERT_EQ(w3.id(), w1.id());
+
+	Wallet w4(w2);
+	ASSERT_EQ(w4.id(), w2.id());
+
+	// Ids of wallets which are gone are given to new wallets, so the number of ids doesn't grow
+	const uint32_t num_ids = Wallet::num_ids();
+	const hash spend_pub_key = w3.spend_public_key();
+	const hash view_pub_key = w3.view_public_key();
+	const uint32_t id1 = w1.id();
+
+	ASSERT_TRUE(w1.decode(nullptr) == false);
+	ASSERT_EQ(w1.id(), 0);
+	ASSERT_EQ(w3.id(), id1);
+	ASSERT_TRUE(w3.decode(nullptr) == false);
+
+	for (int i = 0; i < 100; ++i) {
+		Wallet w5(w2);
+		ASSERT_TRUE(w5.assign(w2.view_public_key(), w2.spend_public_key(), NetworkType::Mainnet));
+		ASSERT_NE(w5.id(), w2.id());
+		ASSERT_EQ(w5.id(), id1);
+		ASSERT_EQ(w4.id(), w2.id());
+	}
+	ASSERT_EQ(Wallet::num_ids(), num_ids);
+
+	ASSERT_TRUE(w1.assign(spend_pub_key, view_pub_key, NetworkType::Mainnet));
+	ASSERT_EQ(w1.id(), id1);
+}
+
+TEST(wallet, id_threads)
+{
+	const Wallet w1("49ccoSmrBTPJd5yf8VYCULh4J5rHQaXP1TeC8Cnqhd5H9Y2cMwkJ9w42euLmMghKtCiQcgZEiGYW1K6Ae4biZ7w1HLSexS6");
+	const Wallet w2("45JHuqGBSqUXUyZx95H4C2J5aEL4zFjM3jpTmMTESPXPa3jmtSQWYezHX7r4A2xPQNBGsQupJqmPhRZb2QgBcEWRDQ9ywwR");
+
+	// Keys which nothing else holds, their ids are freed and allocated again all the time
+	const hash keys[] = { w1.view_public_key(), w2.view_public_key() };
+
+	const uint32_t num_ids = Wallet::num_ids();
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i) {
+		threads.emplace_back([&w1, &w2, &keys, i]()
+			{
+				for (int j = 0; j < 20000; ++j) {
+					Wallet a(w1);
+					Wallet b(nullptr);
+					b = w2;
+
+					Wallet c(nullptr);
+					c.assign(keys[(i + j) & 1], w1.spend_public_key(), NetworkType::Mainnet);
+
+					Wallet d(c);
+					a = d;
+					ASSERT_EQ(a.id(), c.id());
+					ASSERT_EQ(b.id(), w2.id());
+				}
+			});
+	}
+
+	for (std::thread& t : threads) {
+		t.join();
+	}
+
+	// Every id was freed exactly once: wallets with different keys still get different ids
+	Wallet c1(nullptr), c2(nullptr), c3(nullptr);
+	ASSERT_TRUE(c1.assign(keys[0], w1.spend_public_key(), NetworkType::Mainnet));
+	ASSERT_TRUE(c2.assign(keys[1], w1.spend_public_key(), NetworkType::Mainnet));
+	ASSERT_TRUE(c3.assign(keys[0], w2.spend_public_key(), NetworkType::Mainnet));
+
+	ASSERT_NE(c1.id(), 0);
+	ASSERT_NE(c2.id(), 0);
+	ASSERT_NE(c1.id(), c2.id());
+	ASSERT_EQ(c1.id(), c3.id());
+	ASSERT_NE(c1.id(), w1.id());
+	ASSERT_NE(c1.id(), w2.id());
+	ASSERT_NE(c2.id(), w1.id());
+	ASSERT_NE(c2.id(), w2.id());
+
+	ASSERT_LE(Wallet::num_ids(), num_ids + 2);
+}
+
 }
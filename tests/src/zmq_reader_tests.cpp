@@ -0,0 +1,88 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "zmq_reader.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+namespace {
+
+struct TestHandler : public MinerCallbackHandler
+{
+	void handle_tx(TxMempoolData& tx) override { m_txs.push_back(tx); }
+	void handle_miner_data(MinerData&) override {}
+	void handle_chain_main(ChainMain&, const char*) override {}
+
+	std::vector<TxMempoolData> m_txs;
+};
+
+void parse(ZMQParser& parser, const char* message)
+{
+	std::vector<char> buf(message, message + strlen(message));
+	parser.parse(buf.data(), buf.size());
+}
+
+}
+
+TEST(zmq_reader, txpool_add)
+{
+	TestHandler handler;
+	ZMQParser parser(&handler);
+
+	const char tx1[] = "{\"id\":\"0102030405060708091011121314151617181920212223242526272829303132\",\"blob_size\":1500,\"weight\":1600,\"fee\":30000000}";
+	const char tx2[] = "{\"id\":\"a102030405060708091011121314151617181920212223242526272829303132\",\"blob_size\":2500,\"weight\":2600,\"fee\":40000000}";
+
+	// Transactions which don't have all fields are skipped, the rest are added
+	parse(parser, (std::string("json-minimal-txpool_add:[") + tx1 + ",{\"id\":\"01\",\"weight\":1}," + tx2 + "]").c_str());
+	ASSERT_EQ(handler.m_txs.size(), 2);
+	ASSERT_EQ(handler.m_txs[0].id.h[0], 0x01);
+	ASSERT_EQ(handler.m_txs[0].blob_size, 1500);
+	ASSERT_EQ(handler.m_txs[0].weight, 1600);
+	ASSERT_EQ(handler.m_txs[0].fee, 30000000);
+	ASSERT_EQ(handler.m_txs[1].id.h[0], 0xa1);
+	ASSERT_EQ(handler.m_txs[1].weight, 2600);
+	handler.m_txs.clear();
+
+	// A message which doesn't parse to the end is skipped as a whole, even the transactions before the error
+	parse(parser, (std::string("json-minimal-txpool_add:[") + tx1 + "," + tx2 + ",{\"id\":").c_str());
+	ASSERT_TRUE(handler.m_txs.empty());
+
+	parse(parser, (std::string("json-minimal-txpool_add:[") + tx1 + "," + tx2 + "]]").c_str());
+	ASSERT_TRUE(handler.m_txs.empty());
+
+	// Top level must be an array
+	parse(parser, (std::string("json-minimal-txpool_add:") + tx1).c_str());
+	ASSERT_TRUE(handler.m_txs.empty());
+
+	parse(parser, "json-minimal-txpool_add:123");
+	ASSERT_TRUE(handler.m_txs.empty());
+
+	parse(parser, "json-minimal-txpool_add:\"abc\"");
+	ASSERT_TRUE(handler.m_txs.empty());
+
+	parse(parser, "json-minimal-txpool_add:null");
+	ASSERT_TRUE(handler.m_txs.empty());
+
+	// The parser is still usable after errors
+	parse(parser, (std::string("json-minimal-txpool_add:[") + tx2 + "]").c_str());
+	ASSERT_EQ(handler.m_txs.size(), 1);
+	ASSERT_EQ(handler.m_txs[0].id.h[0], 0xa1);
+}
+
+}